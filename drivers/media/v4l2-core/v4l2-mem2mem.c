@@ -285,50 +285,23 @@ static void v4l2_m2m_try_run(struct v4l2_m2m_dev *m2m_dev)
 }
 
 /*
- * __v4l2_m2m_try_queue() - queue a job
- * @m2m_dev: m2m device
- * @m2m_ctx: m2m context
- *
- * Check if this context is ready to queue a job.
- *
- * This function can run in interrupt context.
+ * Assumes job_spinlock is held, called from __v4l2_m2m_try_queue() and
+ * _v4l2_m2m_job_continue().
  */
-static void __v4l2_m2m_try_queue(struct v4l2_m2m_dev *m2m_dev,
+static bool __v4l2_m2m_job_ready(struct v4l2_m2m_dev *m2m_dev,
 				 struct v4l2_m2m_ctx *m2m_ctx)
 {
-	unsigned long flags_job;
 	struct vb2_v4l2_buffer *dst, *src;
 
-	dprintk("Trying to schedule a job for m2m_ctx: %p\n", m2m_ctx);
-
-	if (!m2m_ctx->out_q_ctx.q.streaming
-	    || !m2m_ctx->cap_q_ctx.q.streaming) {
-		dprintk("Streaming needs to be on for both queues\n");
-		return;
-	}
-
-	spin_lock_irqsave(&m2m_dev->job_spinlock, flags_job);
-
-	/* If the context is aborted then don't schedule it */
-	if (m2m_ctx->job_flags & TRANS_ABORT) {
-		dprintk("Aborted context\n");
-		goto job_unlock;
-	}
-
-	if (m2m_ctx->job_flags & TRANS_QUEUED) {
-		dprintk("On job queue already\n");
-		goto job_unlock;
-	}
-
 	src = v4l2_m2m_next_src_buf(m2m_ctx);
 	dst = v4l2_m2m_next_dst_buf(m2m_ctx);
 	if (!src && !m2m_ctx->out_q_ctx.buffered) {
 		dprintk("No input buffers available\n");
-		goto job_unlock;
+		return false;
 	}
 	if (!dst && !m2m_ctx->cap_q_ctx.buffered) {
 		dprintk("No output buffers available\n");
-		goto job_unlock;
+		return false;
 	}
 
 	m2m_ctx->new_frame = true;
@@ -344,7 +317,7 @@ static void __v4l2_m2m_try_queue(struct v4l2_m2m_dev *m2m_dev,
 
 		if (!dst && !m2m_ctx->cap_q_ctx.buffered) {
 			dprintk("No output buffers available after returning held buffer\n");
-			goto job_unlock;
+			return false;
 		}
 	}
 
@@ -355,15 +328,56 @@ static void __v4l2_m2m_try_queue(struct v4l2_m2m_dev *m2m_dev,
 
 	if (m2m_ctx->has_stopped) {
 		dprintk("Device has stopped\n");
-		goto job_unlock;
+		return false;
 	}
 
 	if (m2m_dev->m2m_ops->job_ready
 		&& (!m2m_dev->m2m_ops->job_ready(m2m_ctx->priv))) {
 		dprintk("Driver not ready\n");
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * __v4l2_m2m_try_queue() - queue a job
+ * @m2m_dev: m2m device
+ * @m2m_ctx: m2m context
+ *
+ * Check if this context is ready to queue a job.
+ *
+ * This function can run in interrupt context.
+ */
+static void __v4l2_m2m_try_queue(struct v4l2_m2m_dev *m2m_dev,
+				 struct v4l2_m2m_ctx *m2m_ctx)
+{
+	unsigned long flags_job;
+
+	dprintk("Trying to schedule a job for m2m_ctx: %p\n", m2m_ctx);
+
+	if (!m2m_ctx->out_q_ctx.q.streaming
+	    || !m2m_ctx->cap_q_ctx.q.streaming) {
+		dprintk("Streaming needs to be on for both queues\n");
+		return;
+	}
+
+	spin_lock_irqsave(&m2m_dev->job_spinlock, flags_job);
+
+	/* If the context is aborted then don't schedule it */
+	if (m2m_ctx->job_flags & TRANS_ABORT) {
+		dprintk("Aborted context\n");
+		goto job_unlock;
+	}
+
+	if (m2m_ctx->job_flags & TRANS_QUEUED) {
+		dprintk("On job queue already\n");
 		goto job_unlock;
 	}
 
+	if (!__v4l2_m2m_job_ready(m2m_dev, m2m_ctx))
+		goto job_unlock;
+
 	list_add_tail(&m2m_ctx->queue, &m2m_dev->job_queue);
 	m2m_ctx->job_flags |= TRANS_QUEUED;
 
@@ -481,6 +495,32 @@ static bool _v4l2_m2m_job_finish(struct v4l2_m2m_dev *m2m_dev,
 	return true;
 }
 
+/*
+ * Assumes job_spinlock is held, called from v4l2_m2m_job_finish_batch() or
+ * v4l2_m2m_buf_done_and_job_finish_batch(). The context keeps the device for
+ * its next job when it is ready and no other context is waiting for it.
+ */
+static bool _v4l2_m2m_job_continue(struct v4l2_m2m_dev *m2m_dev,
+				   struct v4l2_m2m_ctx *m2m_ctx)
+{
+	if (!m2m_dev->curr_ctx || m2m_dev->curr_ctx != m2m_ctx)
+		return false;
+
+	if (m2m_ctx->job_flags & TRANS_ABORT)
+		return false;
+
+	if (m2m_dev->job_queue_flags & QUEUE_PAUSED)
+		return false;
+
+	if (!list_is_singular(&m2m_dev->job_queue))
+		return false;
+
+	if (!m2m_ctx->out_q_ctx.q.streaming || !m2m_ctx->cap_q_ctx.q.streaming)
+		return false;
+
+	return __v4l2_m2m_job_ready(m2m_dev, m2m_ctx);
+}
+
 void v4l2_m2m_job_finish(struct v4l2_m2m_dev *m2m_dev,
 			 struct v4l2_m2m_ctx *m2m_ctx)
 {
@@ -503,9 +543,34 @@ void v4l2_m2m_job_finish(struct v4l2_m2m_dev *m2m_dev,
 }
 EXPORT_SYMBOL(v4l2_m2m_job_finish);
 
-void v4l2_m2m_buf_done_and_job_finish(struct v4l2_m2m_dev *m2m_dev,
-				      struct v4l2_m2m_ctx *m2m_ctx,
-				      enum vb2_buffer_state state)
+bool v4l2_m2m_job_finish_batch(struct v4l2_m2m_dev *m2m_dev,
+			       struct v4l2_m2m_ctx *m2m_ctx)
+{
+	unsigned long flags;
+	bool schedule_next;
+
+	WARN_ON(m2m_ctx->out_q_ctx.q.subsystem_flags &
+		VB2_V4L2_FL_SUPPORTS_M2M_HOLD_CAPTURE_BUF);
+	spin_lock_irqsave(&m2m_dev->job_spinlock, flags);
+	if (_v4l2_m2m_job_continue(m2m_dev, m2m_ctx)) {
+		spin_unlock_irqrestore(&m2m_dev->job_spinlock, flags);
+		dprintk("Running next job on m2m_ctx: %p\n", m2m_ctx);
+		return true;
+	}
+	schedule_next = _v4l2_m2m_job_finish(m2m_dev, m2m_ctx);
+	spin_unlock_irqrestore(&m2m_dev->job_spinlock, flags);
+
+	if (schedule_next)
+		v4l2_m2m_schedule_next_job(m2m_dev, m2m_ctx);
+
+	return false;
+}
+EXPORT_SYMBOL(v4l2_m2m_job_finish_batch);
+
+static bool __v4l2_m2m_buf_done_and_job_finish(struct v4l2_m2m_dev *m2m_dev,
+					       struct v4l2_m2m_ctx *m2m_ctx,
+					       enum vb2_buffer_state state,
+					       bool batch)
 {
 	struct vb2_v4l2_buffer *src_buf, *dst_buf;
 	bool schedule_next = false;
@@ -532,15 +597,38 @@ void v4l2_m2m_buf_done_and_job_finish(struct v4l2_m2m_dev *m2m_dev,
 	 * before the CAPTURE buffer is done.
 	 */
 	v4l2_m2m_buf_done(src_buf, state);
+	if (batch && _v4l2_m2m_job_continue(m2m_dev, m2m_ctx)) {
+		spin_unlock_irqrestore(&m2m_dev->job_spinlock, flags);
+		dprintk("Running next job on m2m_ctx: %p\n", m2m_ctx);
+		return true;
+	}
 	schedule_next = _v4l2_m2m_job_finish(m2m_dev, m2m_ctx);
 unlock:
 	spin_unlock_irqrestore(&m2m_dev->job_spinlock, flags);
 
 	if (schedule_next)
 		v4l2_m2m_schedule_next_job(m2m_dev, m2m_ctx);
+
+	return false;
+}
+
+void v4l2_m2m_buf_done_and_job_finish(struct v4l2_m2m_dev *m2m_dev,
+				      struct v4l2_m2m_ctx *m2m_ctx,
+				      enum vb2_buffer_state state)
+{
+	__v4l2_m2m_buf_done_and_job_finish(m2m_dev, m2m_ctx, state, false);
 }
 EXPORT_SYMBOL(v4l2_m2m_buf_done_and_job_finish);
 
+bool v4l2_m2m_buf_done_and_job_finish_batch(struct v4l2_m2m_dev *m2m_dev,
+					    struct v4l2_m2m_ctx *m2m_ctx,
+					    enum vb2_buffer_state state)
+{
+	return __v4l2_m2m_buf_done_and_job_finish(m2m_dev, m2m_ctx, state,
+						  true);
+}
+EXPORT_SYMBOL(v4l2_m2m_buf_done_and_job_finish_batch);
+
 void v4l2_m2m_suspend(struct v4l2_m2m_dev *m2m_dev)
 {
 	unsigned long flags;
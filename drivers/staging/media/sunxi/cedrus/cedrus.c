@@ -9,6 +9,8 @@
  */
 
 #include <linux/clk.h>
+#include <linux/device.h>
+#include <linux/dma-mapping.h>
 #include <linux/interrupt.h>
 #include <linux/module.h>
 #include <linux/of.h>
@@ -16,18 +18,28 @@
 #include <linux/platform_device.h>
 #include <linux/pm_runtime.h>
 #include <linux/reset.h>
+#include <linux/sched.h>
 #include <linux/soc/sunxi/sunxi_sram.h>
 #include <linux/types.h>
+#include <uapi/linux/sched/types.h>
 #include <media/v4l2-device.h>
 #include <media/v4l2-mem2mem.h>
+#include <media/videobuf2-dma-contig.h>
 
 #include "cedrus.h"
 #include "cedrus_context.h"
+#include "cedrus_debugfs.h"
 #include "cedrus_dec.h"
+#include "cedrus_devfreq.h"
 #include "cedrus_enc.h"
 #include "cedrus_engine.h"
+#include "cedrus_fault.h"
+#include "cedrus_pool.h"
 #include "cedrus_proc.h"
 
+#define CREATE_TRACE_POINTS
+#include "cedrus_trace.h"
+
 /* Media */
 
 static int cedrus_media_request_validate(struct media_request *req)
@@ -70,15 +82,250 @@ static const struct media_device_ops cedrus_media_ops = {
 	.req_queue	= v4l2_m2m_request_queue,
 };
 
+/* Dispatch */
+
+/*
+ * Jobs are run from the m2m job scheduler work or from the IRQ thread by
+ * default. A dedicated worker gives control over the priority and CPU of job
+ * dispatch instead, for instance to pin it with the interrupt on a CPU that is
+ * isolated from the rest of the system. Setting a priority or a CPU implies
+ * the worker.
+ */
+static unsigned int cedrus_dispatch_priority;
+module_param_named(dispatch_priority, cedrus_dispatch_priority, uint, 0444);
+MODULE_PARM_DESC(dispatch_priority,
+		 "Dispatch worker real-time priority, or 0 for none (default: 0)");
+
+static int cedrus_dispatch_cpu = -1;
+module_param_named(dispatch_cpu, cedrus_dispatch_cpu, int, 0444);
+MODULE_PARM_DESC(dispatch_cpu,
+		 "CPU of the job dispatch worker, or -1 for any (default: -1)");
+
+static bool cedrus_dispatch_worker;
+module_param_named(dispatch_worker, cedrus_dispatch_worker, bool, 0444);
+MODULE_PARM_DESC(dispatch_worker,
+		 "Run jobs from a dedicated worker (default: false)");
+
+/*
+ * Complete the job (or start its next pass) after the engine was done with it,
+ * returning whether the next job of the same context should run right away.
+ */
+static bool cedrus_job_complete(struct cedrus_context *ctx, int status)
+{
+	int state;
+	int ret;
+
+	/* Run the next pass of the same job when the engine requires it. */
+	if (status == CEDRUS_IRQ_CONTINUE) {
+		/* Unless a more urgent context is waiting for the engine. */
+		if (cedrus_context_job_suspend(ctx))
+			return false;
+
+		ret = cedrus_engine_job_continue(ctx);
+		if (!ret) {
+			cedrus_context_job_watchdog_schedule(ctx);
+			cedrus_engine_job_trigger(ctx);
+
+			return false;
+		}
+
+		/* Parked jobs are taken back by the engine later on. */
+		if (ret == -EAGAIN)
+			return false;
+
+		status = CEDRUS_IRQ_ERROR;
+	}
+
+	if (status == CEDRUS_IRQ_ERROR)
+		state = VB2_BUF_STATE_ERROR;
+	else
+		state = VB2_BUF_STATE_DONE;
+
+	/* Errors go through the scheduler, giving other contexts a chance. */
+	if (state == VB2_BUF_STATE_ERROR) {
+		cedrus_context_job_finish(ctx, state);
+		return false;
+	}
+
+	/*
+	 * Run the next job of the same context right away when it is ready
+	 * and no other context is waiting, without a trip through the m2m
+	 * job scheduler and its work queue.
+	 */
+	return cedrus_context_job_finish_batch(ctx, state);
+}
+
+/*
+ * Jobs of contexts with a poll threshold that are expected to complete within
+ * it are busy-waited for on the CPU that triggered them, with the interrupt
+ * line disabled from before the trigger. The watchdog is cancelled as done by
+ * the IRQ handler, so the job is only ever completed once. Jobs still running
+ * at the threshold and further passes of the same job are left to the IRQ,
+ * which is pending already if the engine got done in between. The interrupt is
+ * level-triggered and cleared before it is enabled, so it never fires late.
+ */
+static bool cedrus_dispatch_poll(struct cedrus_context *ctx,
+				 unsigned int timeout_us)
+{
+	struct cedrus_device *cedrus_dev = ctx->proc->dev;
+	int status;
+	int ret;
+
+	ret = read_poll_timeout_atomic(cedrus_engine_irq_status, status,
+				       status != CEDRUS_IRQ_NONE, 0,
+				       timeout_us, false, ctx);
+	if (ret || !cancel_delayed_work(&cedrus_dev->watchdog_work)) {
+		enable_irq(cedrus_dev->irq);
+		return false;
+	}
+
+	if (cedrus_fault_irq_error())
+		status = CEDRUS_IRQ_ERROR;
+
+	trace_cedrus_irq(ctx, status);
+	cedrus_debugfs_job_irq(ctx);
+
+	cedrus_engine_irq_disable(ctx);
+	cedrus_engine_irq_clear(ctx);
+
+	enable_irq(cedrus_dev->irq);
+
+	return cedrus_job_complete(ctx, status);
+}
+
+static void cedrus_dispatch_run(struct cedrus_context *ctx)
+{
+	struct cedrus_device *cedrus_dev = ctx->proc->dev;
+	unsigned int timeout_us;
+	int ret;
+
+	/* Polled jobs of the same context run one after the other. */
+	do {
+		timeout_us = cedrus_context_job_poll_timeout(ctx);
+		if (!timeout_us) {
+			cedrus_context_job_run(ctx);
+			return;
+		}
+
+		disable_irq_nosync(cedrus_dev->irq);
+
+		/* Headers are produced without the engine, nothing to poll. */
+		ret = cedrus_context_job_run(ctx);
+		if (ret || !ctx->job.triggered) {
+			enable_irq(cedrus_dev->irq);
+			return;
+		}
+	} while (cedrus_dispatch_poll(ctx, timeout_us));
+}
+
+static void cedrus_dispatch_work(struct kthread_work *work)
+{
+	struct cedrus_device *cedrus_dev =
+		container_of(work, struct cedrus_device, dispatch_work);
+
+	cedrus_dispatch_run(cedrus_dev->dispatch_ctx);
+}
+
+static void cedrus_dispatch(struct cedrus_context *ctx)
+{
+	struct cedrus_device *cedrus_dev = ctx->proc->dev;
+
+	if (!cedrus_dev->dispatch_worker) {
+		cedrus_dispatch_run(ctx);
+		return;
+	}
+
+	/* The m2m core only runs one job at a time. */
+	cedrus_dev->dispatch_ctx = ctx;
+	kthread_queue_work(cedrus_dev->dispatch_worker,
+			   &cedrus_dev->dispatch_work);
+}
+
+static int cedrus_dispatch_setup(struct cedrus_device *cedrus_dev)
+{
+	struct device *dev = cedrus_dev->dev;
+	struct kthread_worker *worker;
+	int cpu = cedrus_dispatch_cpu;
+	int ret;
+
+	kthread_init_work(&cedrus_dev->dispatch_work, cedrus_dispatch_work);
+
+	if (!cedrus_dispatch_worker && !cedrus_dispatch_priority && cpu < 0)
+		return 0;
+
+	if (cedrus_dispatch_priority >= MAX_RT_PRIO) {
+		dev_err(dev, "invalid dispatch priority: %u\n",
+			cedrus_dispatch_priority);
+		return -EINVAL;
+	}
+
+	if (cpu >= 0 && (cpu >= nr_cpu_ids || !cpu_possible(cpu))) {
+		dev_err(dev, "invalid dispatch CPU: %d\n", cpu);
+		return -EINVAL;
+	}
+
+	worker = kthread_create_worker(0, "%s-dispatch", dev_name(dev));
+	if (IS_ERR(worker)) {
+		dev_err(dev, "failed to create dispatch worker\n");
+		return PTR_ERR(worker);
+	}
+
+	if (cedrus_dispatch_priority) {
+		struct sched_attr attr = {
+			.sched_policy	= SCHED_FIFO,
+			.sched_priority	= cedrus_dispatch_priority,
+		};
+
+		ret = sched_setattr_nocheck(worker->task, &attr);
+		if (ret) {
+			dev_err(dev, "failed to set dispatch priority\n");
+			goto error_worker;
+		}
+	}
+
+	/* Not bound for good, so that it can still be moved from userspace. */
+	if (cpu >= 0) {
+		ret = set_cpus_allowed_ptr(worker->task, cpumask_of(cpu));
+		if (ret) {
+			dev_err(dev, "failed to set dispatch CPU\n");
+			goto error_worker;
+		}
+	}
+
+	cedrus_dev->dispatch_worker = worker;
+
+	return 0;
+
+error_worker:
+	kthread_destroy_worker(worker);
+
+	return ret;
+}
+
+static void cedrus_dispatch_cleanup(struct cedrus_device *cedrus_dev)
+{
+	if (!cedrus_dev->dispatch_worker)
+		return;
+
+	kthread_destroy_worker(cedrus_dev->dispatch_worker);
+	cedrus_dev->dispatch_worker = NULL;
+}
+
 /* V4L2 */
 
 static void cedrus_v4l2_m2m_device_run(void *private)
 {
-	cedrus_context_job_run(private);
+	cedrus_dispatch(private);
+}
+
+static int cedrus_v4l2_m2m_job_ready(void *private)
+{
+	return cedrus_context_job_ready(private);
 }
 
 static const struct v4l2_m2m_ops cedrus_v4l2_m2m_ops = {
 	.device_run	= cedrus_v4l2_m2m_device_run,
+	.job_ready	= cedrus_v4l2_m2m_job_ready,
 };
 
 static int cedrus_v4l2_setup(struct cedrus_device *cedrus_dev)
@@ -147,6 +394,38 @@ static void cedrus_v4l2_cleanup(struct cedrus_device *cedrus_dev)
 	media_device_cleanup(media_dev);
 }
 
+/* Sysfs */
+
+static ssize_t cedrus_decoder_load_show(struct device *dev,
+					struct device_attribute *attr,
+					char *buf)
+{
+	struct cedrus_device *cedrus_dev = dev_get_drvdata(dev);
+
+	return sysfs_emit(buf, "%u\n", cedrus_proc_load(&cedrus_dev->dec));
+}
+
+static DEVICE_ATTR(decoder_load, 0444, cedrus_decoder_load_show, NULL);
+
+static ssize_t cedrus_encoder_load_show(struct device *dev,
+					struct device_attribute *attr,
+					char *buf)
+{
+	struct cedrus_device *cedrus_dev = dev_get_drvdata(dev);
+
+	return sysfs_emit(buf, "%u\n", cedrus_proc_load(&cedrus_dev->enc));
+}
+
+static DEVICE_ATTR(encoder_load, 0444, cedrus_encoder_load_show, NULL);
+
+static struct attribute *cedrus_attrs[] = {
+	&dev_attr_decoder_load.attr,
+	&dev_attr_encoder_load.attr,
+	NULL
+};
+
+ATTRIBUTE_GROUPS(cedrus);
+
 /* Platform */
 
 void cedrus_watchdog(struct work_struct *work)
@@ -161,8 +440,19 @@ void cedrus_watchdog(struct work_struct *work)
 	if (!ctx)
 		return;
 
+	trace_cedrus_watchdog(ctx);
+
+	ctx->job.timeout = true;
+
 	v4l2_err(v4l2_dev, "frame processing timed out!\n");
-	reset_control_reset(cedrus_dev->reset);
+
+	cedrus_dev->ctx_configured = NULL;
+
+	/* Only reset the hung engine, falling back to a full reset. */
+	if (cedrus_proc_reset(ctx)) {
+		reset_control_reset(cedrus_dev->reset);
+		cedrus_write_shadow_invalidate(cedrus_dev);
+	}
 
 	cedrus_context_job_finish(ctx, VB2_BUF_STATE_ERROR);
 }
@@ -205,7 +495,16 @@ static irqreturn_t cedrus_irq(int irq, void *private)
 	struct v4l2_m2m_dev *m2m_dev = cedrus_dev->v4l2.m2m_dev;
 	struct cedrus_context *ctx = v4l2_m2m_get_curr_priv(m2m_dev);
 	int status;
-	int state;
+
+	/* Replayed jobs are not known to the engines. */
+	if (cedrus_debugfs_trace_irq(cedrus_dev))
+		return IRQ_HANDLED;
+
+	/* Pretend the interrupt was lost, so that the watchdog kicks in. */
+	if (ctx && cedrus_fault_irq_drop()) {
+		cedrus_irq_disable_clear(ctx);
+		return IRQ_HANDLED;
+	}
 
 	/*
 	 * If cancel_delayed_work returns false it means watchdog already
@@ -229,22 +528,55 @@ static irqreturn_t cedrus_irq(int irq, void *private)
 	if (status == CEDRUS_IRQ_NONE)
 		return IRQ_NONE;
 
+	if (cedrus_fault_irq_error())
+		status = CEDRUS_IRQ_ERROR;
+
+	trace_cedrus_irq(ctx, status);
+	cedrus_debugfs_job_irq(ctx);
+
 	cedrus_irq_disable_clear(ctx);
 
-	if (status == CEDRUS_IRQ_ERROR)
-		state = VB2_BUF_STATE_ERROR;
-	else
-		state = VB2_BUF_STATE_DONE;
+	/* Complete the job (or start its next pass) in the IRQ thread. */
+	cedrus_dev->irq_status = status;
+
+	return IRQ_WAKE_THREAD;
+}
+
+static irqreturn_t cedrus_irq_thread(int irq, void *private)
+{
+	struct cedrus_device *cedrus_dev = private;
+	struct v4l2_m2m_dev *m2m_dev = cedrus_dev->v4l2.m2m_dev;
+	struct cedrus_context *ctx = v4l2_m2m_get_curr_priv(m2m_dev);
+	int status = cedrus_dev->irq_status;
+
+	if (WARN_ON(!ctx))
+		return IRQ_HANDLED;
 
-	cedrus_context_job_finish(ctx, state);
+	if (cedrus_job_complete(ctx, status))
+		cedrus_dispatch(ctx);
 
 	return IRQ_HANDLED;
 }
 
+/* Runtime PM */
+
+/*
+ * The hardware is powered for each job and kept on for a while after the
+ * last one, so that bursts of jobs and short sessions don't pay for a full
+ * reset each time. The delay can also be changed through sysfs later on.
+ */
+static int cedrus_autosuspend_delay_ms = 500;
+module_param_named(autosuspend_delay_ms, cedrus_autosuspend_delay_ms, int,
+		   0444);
+MODULE_PARM_DESC(autosuspend_delay_ms,
+		 "Runtime PM autosuspend delay in milliseconds (default: 500)");
+
 static int cedrus_suspend(struct device *dev)
 {
 	struct cedrus_device *cedrus_dev = dev_get_drvdata(dev);
 
+	cedrus_devfreq_suspend(cedrus_dev);
+
 	clk_disable_unprepare(cedrus_dev->clock_ram);
 	clk_disable_unprepare(cedrus_dev->clock_mod);
 	clk_disable_unprepare(cedrus_dev->clock_ahb);
@@ -259,6 +591,10 @@ static int cedrus_resume(struct device *dev)
 	struct cedrus_device *cedrus_dev = dev_get_drvdata(dev);
 	int ret;
 
+	/* Registers are lost across suspend. */
+	cedrus_dev->ctx_configured = NULL;
+	cedrus_write_shadow_invalidate(cedrus_dev);
+
 	ret = reset_control_reset(cedrus_dev->reset);
 	if (ret) {
 		dev_err(dev, "failed to reset\n");
@@ -283,6 +619,8 @@ static int cedrus_resume(struct device *dev)
 		goto error_clock_mod;
 	}
 
+	cedrus_devfreq_resume(cedrus_dev);
+
 	return 0;
 
 error_clock_mod:
@@ -297,7 +635,46 @@ static int cedrus_resume(struct device *dev)
 	return ret;
 }
 
+/* System Sleep */
+
+/*
+ * The current job (with all its passes) completes before the device gets
+ * suspended, while the next ones are only run after resume. Contexts keep
+ * their state and buffers in memory and the hardware is configured again for
+ * the first job after resume, like after a runtime suspend.
+ */
+static int cedrus_system_suspend(struct device *dev)
+{
+	struct cedrus_device *cedrus_dev = dev_get_drvdata(dev);
+	int ret;
+
+	v4l2_m2m_suspend(cedrus_dev->v4l2.m2m_dev);
+
+	ret = pm_runtime_force_suspend(dev);
+	if (ret) {
+		v4l2_m2m_resume(cedrus_dev->v4l2.m2m_dev);
+		return ret;
+	}
+
+	return 0;
+}
+
+static int cedrus_system_resume(struct device *dev)
+{
+	struct cedrus_device *cedrus_dev = dev_get_drvdata(dev);
+	int ret;
+
+	ret = pm_runtime_force_resume(dev);
+	if (ret)
+		return ret;
+
+	v4l2_m2m_resume(cedrus_dev->v4l2.m2m_dev);
+
+	return 0;
+}
+
 static const struct dev_pm_ops cedrus_pm_ops = {
+	SYSTEM_SLEEP_PM_OPS(cedrus_system_suspend, cedrus_system_resume)
 	.runtime_suspend	= cedrus_suspend,
 	.runtime_resume		= cedrus_resume,
 };
@@ -352,6 +729,25 @@ static int cedrus_resources_setup(struct cedrus_device *cedrus_dev,
 		return ret;
 	}
 
+	cedrus_dev->clock_mod_rate = clk_get_rate(cedrus_dev->clock_mod);
+	cedrus_dev->clock_mod_rate_nominal = cedrus_dev->clock_mod_rate;
+
+	/* Devfreq */
+
+	ret = cedrus_devfreq_setup(cedrus_dev);
+	if (ret) {
+		dev_err(dev, "failed to setup devfreq\n");
+		return ret;
+	}
+
+	/* Cooling */
+
+	ret = cedrus_cooling_setup(cedrus_dev);
+	if (ret) {
+		dev_err(dev, "failed to setup cooling device\n");
+		return ret;
+	}
+
 	/* Reset */
 
 	cedrus_dev->reset = devm_reset_control_get(dev, NULL);
@@ -368,19 +764,34 @@ static int cedrus_resources_setup(struct cedrus_device *cedrus_dev,
 		return -ENXIO;
 	}
 
-	ret = devm_request_irq(dev, irq, cedrus_irq, 0, CEDRUS_NAME,
-			       cedrus_dev);
+	ret = devm_request_threaded_irq(dev, irq, cedrus_irq, cedrus_irq_thread,
+					0, CEDRUS_NAME, cedrus_dev);
 	if (ret) {
 		dev_err(dev, "failed to request irq\n");
 		return ret;
 	}
 
+	cedrus_dev->irq = irq;
+
 	/* Memory */
 
-	ret = of_reserved_mem_device_init(dev);
-	if (ret && ret != -ENODEV) {
-		dev_err(dev, "failed to reserve memory\n");
-		return ret;
+	/*
+	 * Behind an IOMMU, buffers are backed by scattered pages that are
+	 * mapped contiguously for the engine, so that neither CMA nor a
+	 * reserved region is needed, and imported buffers may be scattered.
+	 */
+	if (device_iommu_mapped(dev)) {
+		ret = vb2_dma_contig_set_max_seg_size(dev, DMA_BIT_MASK(32));
+		if (ret) {
+			dev_err(dev, "failed to set maximum segment size\n");
+			return ret;
+		}
+	} else {
+		ret = of_reserved_mem_device_init(dev);
+		if (ret && ret != -ENODEV) {
+			dev_err(dev, "failed to reserve memory\n");
+			return ret;
+		}
 	}
 
 	/* SRAM */
@@ -393,6 +804,8 @@ static int cedrus_resources_setup(struct cedrus_device *cedrus_dev,
 
 	/* Runtime PM */
 
+	pm_runtime_set_autosuspend_delay(dev, cedrus_autosuspend_delay_ms);
+	pm_runtime_use_autosuspend(dev);
 	pm_runtime_enable(dev);
 
 	return 0;
@@ -408,6 +821,7 @@ static void cedrus_resources_cleanup(struct cedrus_device *cedrus_dev)
 	struct device *dev = cedrus_dev->dev;
 
 	pm_runtime_disable(dev);
+	pm_runtime_dont_use_autosuspend(dev);
 	sunxi_sram_release(dev);
 	of_reserved_mem_device_release(dev);
 }
@@ -427,33 +841,53 @@ static int cedrus_probe(struct platform_device *platform_dev)
 
 	INIT_DELAYED_WORK(&cedrus_dev->watchdog_work, cedrus_watchdog);
 
-	ret = cedrus_resources_setup(cedrus_dev, platform_dev);
+	INIT_LIST_HEAD(&cedrus_dev->contexts);
+	spin_lock_init(&cedrus_dev->contexts_lock);
+	mutex_init(&cedrus_dev->contexts_mutex);
+	INIT_WORK(&cedrus_dev->schedule_work, cedrus_context_schedule_work);
+
+	cedrus_pool_setup(cedrus_dev);
+
+	ret = cedrus_dispatch_setup(cedrus_dev);
 	if (ret)
 		return ret;
 
+	ret = cedrus_resources_setup(cedrus_dev, platform_dev);
+	if (ret)
+		goto error_dispatch;
+
 	ret = cedrus_v4l2_setup(cedrus_dev);
 	if (ret)
 		goto error_resources;
 
+	cedrus_debugfs_setup(cedrus_dev);
+	cedrus_fault_setup(cedrus_dev);
+
 	ret = cedrus_dec_setup(cedrus_dev);
 	if (ret)
-		goto error_v4l2;
+		goto error_debugfs;
 
 	ret = cedrus_enc_setup(cedrus_dev);
 	if (ret)
 		goto error_dec;
 
+	cedrus_selftest_setup(cedrus_dev);
+
 	return 0;
 
 error_dec:
 	cedrus_dec_cleanup(cedrus_dev);
 
-error_v4l2:
+error_debugfs:
+	cedrus_debugfs_cleanup(cedrus_dev);
 	cedrus_v4l2_cleanup(cedrus_dev);
 
 error_resources:
 	cedrus_resources_cleanup(cedrus_dev);
 
+error_dispatch:
+	cedrus_dispatch_cleanup(cedrus_dev);
+
 	return ret;
 }
 
@@ -461,32 +895,45 @@ static void cedrus_remove(struct platform_device *platform_dev)
 {
 	struct cedrus_device *cedrus_dev = platform_get_drvdata(platform_dev);
 
+	/* A self-test run in progress still needs the job scheduling. */
+	cedrus_selftest_cleanup(cedrus_dev);
+
 	cancel_delayed_work_sync(&cedrus_dev->watchdog_work);
+	cancel_work_sync(&cedrus_dev->schedule_work);
 
 	cedrus_enc_cleanup(cedrus_dev);
 	cedrus_dec_cleanup(cedrus_dev);
+	cedrus_debugfs_cleanup(cedrus_dev);
 	cedrus_v4l2_cleanup(cedrus_dev);
+	cedrus_pool_cleanup(cedrus_dev);
 	cedrus_resources_cleanup(cedrus_dev);
+	cedrus_dispatch_cleanup(cedrus_dev);
 }
 
 static const struct cedrus_variant cedrus_variant_sun4i_a10 = {
 	.capabilities	= CEDRUS_CAPABILITY_MPEG2_DEC |
 			  CEDRUS_CAPABILITY_H264_DEC |
-			  CEDRUS_CAPABILITY_VP8_DEC,
+			  CEDRUS_CAPABILITY_VP8_DEC |
+			  CEDRUS_CAPABILITY_H264_DEC_FLUSH_SKIP |
+			  CEDRUS_CAPABILITY_MPEG2_DEC_ROTATE,
 	.clock_mod_rate	= 320000000,
 };
 
 static const struct cedrus_variant cedrus_variant_sun5i_a13 = {
 	.capabilities	= CEDRUS_CAPABILITY_MPEG2_DEC |
 			  CEDRUS_CAPABILITY_H264_DEC |
-			  CEDRUS_CAPABILITY_VP8_DEC,
+			  CEDRUS_CAPABILITY_VP8_DEC |
+			  CEDRUS_CAPABILITY_H264_DEC_FLUSH_SKIP |
+			  CEDRUS_CAPABILITY_MPEG2_DEC_ROTATE,
 	.clock_mod_rate	= 320000000,
 };
 
 static const struct cedrus_variant cedrus_variant_sun7i_a20 = {
 	.capabilities	= CEDRUS_CAPABILITY_MPEG2_DEC |
 			  CEDRUS_CAPABILITY_H264_DEC |
-			  CEDRUS_CAPABILITY_VP8_DEC,
+			  CEDRUS_CAPABILITY_VP8_DEC |
+			  CEDRUS_CAPABILITY_H264_DEC_FLUSH_SKIP |
+			  CEDRUS_CAPABILITY_MPEG2_DEC_ROTATE,
 	.clock_mod_rate	= 320000000,
 };
 
@@ -555,7 +1002,8 @@ static const struct cedrus_variant cedrus_variant_sun50i_h6 = {
 			  CEDRUS_CAPABILITY_H264_DEC |
 			  CEDRUS_CAPABILITY_H265_DEC |
 			  CEDRUS_CAPABILITY_H265_10_DEC |
-			  CEDRUS_CAPABILITY_VP8_DEC,
+			  CEDRUS_CAPABILITY_VP8_DEC |
+			  CEDRUS_CAPABILITY_DDR_BW_256,
 	.clock_mod_rate	= 600000000,
 };
 
@@ -616,6 +1064,7 @@ static struct platform_driver cedrus_driver = {
 		.name		= CEDRUS_NAME,
 		.of_match_table	= cedrus_of_match,
 		.pm		= &cedrus_pm_ops,
+		.dev_groups	= cedrus_groups,
 	},
 };
 
@@ -626,3 +1075,4 @@ MODULE_AUTHOR("Florent Revest <florent.revest@free-electrons.com>");
 MODULE_AUTHOR("Paul Kocialkowski <paul.kocialkowski@bootlin.com>");
 MODULE_AUTHOR("Maxime Ripard <maxime.ripard@bootlin.com>");
 MODULE_LICENSE("GPL v2");
+MODULE_IMPORT_NS(DMA_BUF);
@@ -11,7 +11,10 @@
 #ifndef _CEDRUS_H_
 #define _CEDRUS_H_
 
+#include <linux/bitmap.h>
+#include <linux/dma-mapping.h>
 #include <linux/iopoll.h>
+#include <linux/kthread.h>
 #include <linux/videodev2.h>
 #include <linux/workqueue.h>
 #include <media/v4l2-ctrls.h>
@@ -21,7 +24,12 @@
 #include <media/videobuf2-dma-contig.h>
 
 #include "cedrus_context.h"
+#include "cedrus_cooling.h"
+#include "cedrus_debugfs.h"
+#include "cedrus_devfreq.h"
+#include "cedrus_pool.h"
 #include "cedrus_proc.h"
+#include "cedrus_selftest.h"
 
 #define CEDRUS_NAME		"cedrus"
 #define CEDRUS_DESCRIPTION	"Allwinner Cedrus Video Engine Driver"
@@ -31,6 +39,8 @@
 #define CEDRUS_HEIGHT_MIN	16U
 #define CEDRUS_HEIGHT_MAX	2304U
 
+#define CEDRUS_REGS_SHADOW_COUNT	(0x1000 / 4)
+
 enum cedrus_codec {
 	CEDRUS_CODEC_MPEG2,
 	CEDRUS_CODEC_H264,
@@ -42,6 +52,7 @@ enum cedrus_irq_status {
 	CEDRUS_IRQ_NONE,
 	CEDRUS_IRQ_ERROR,
 	CEDRUS_IRQ_SUCCESS,
+	CEDRUS_IRQ_CONTINUE,
 };
 
 enum cedrus_capability {
@@ -52,6 +63,12 @@ enum cedrus_capability {
 	CEDRUS_CAPABILITY_H265_10_DEC	= BIT(4),
 	CEDRUS_CAPABILITY_VP8_DEC	= BIT(5),
 	CEDRUS_CAPABILITY_H264_ENC	= BIT(6),
+	/* Quirk: H.264 slice header must be skipped with flush bits only. */
+	CEDRUS_CAPABILITY_H264_DEC_FLUSH_SKIP	= BIT(7),
+	/* Quirk: DRAM interface is wide enough for 256-bit bandwidth mode. */
+	CEDRUS_CAPABILITY_DDR_BW_256	= BIT(8),
+	/* MPEG engine rotate/scale output, writing untiled pictures. */
+	CEDRUS_CAPABILITY_MPEG2_DEC_ROTATE	= BIT(9),
 };
 
 struct cedrus_context;
@@ -63,10 +80,16 @@ struct cedrus_variant {
 
 struct cedrus_format {
 	unsigned int	pixelformat;
+	unsigned int	pixelformat_coded;
 	unsigned int	capabilities;
 	int		type;
 };
 
+struct cedrus_reg_value {
+	u32	reg;
+	u32	val;
+};
+
 struct cedrus_v4l2 {
 	struct v4l2_device	v4l2_dev;
 	struct media_device	media_dev;
@@ -84,11 +107,43 @@ struct cedrus_device {
 	struct clk		*clock_ahb;
 	struct clk		*clock_mod;
 	struct clk		*clock_ram;
+	unsigned long		clock_mod_rate;
+	/* Module clock rate of the variant, as set when probing. */
+	unsigned long		clock_mod_rate_nominal;
 	struct reset_control	*reset;
 
+	struct cedrus_devfreq	devfreq;
+	struct cedrus_cooling	cooling;
+
 	unsigned int		capabilities;
 
+	struct cedrus_pool	pool;
+
 	struct delayed_work	watchdog_work;
+	int			irq;
+	int			irq_status;
+
+	struct cedrus_context	*ctx_configured;
+
+	/* Jobs of other engines give way to the one running (see job_ready). */
+	const struct cedrus_engine	*engine_running;
+	bool				engine_yielded;
+
+	u32			regs_shadow[CEDRUS_REGS_SHADOW_COUNT];
+	DECLARE_BITMAP(regs_shadow_valid, CEDRUS_REGS_SHADOW_COUNT);
+
+	struct list_head	contexts;
+	spinlock_t		contexts_lock;
+	struct mutex		contexts_mutex;
+	struct work_struct	schedule_work;
+
+	/* Jobs are run from this worker when set, one at a time. */
+	struct kthread_worker	*dispatch_worker;
+	struct kthread_work	dispatch_work;
+	struct cedrus_context	*dispatch_ctx;
+
+	struct cedrus_debugfs	debugfs;
+	struct cedrus_selftest	selftest;
 };
 
 /* Capabilities */
@@ -101,11 +156,103 @@ static inline bool cedrus_capabilities_check(struct cedrus_device *dev,
 
 /* I/O */
 
+static inline void cedrus_write_trace(struct cedrus_device *dev, u32 reg,
+				      u32 val)
+{
+	if (unlikely(READ_ONCE(dev->debugfs.trace.active)))
+		cedrus_debugfs_trace_write(dev, reg, val);
+}
+
 static inline void cedrus_write(struct cedrus_device *dev, u32 reg, u32 val)
 {
+	/* The register no longer holds the shadowed value. */
+	if (reg / 4 < CEDRUS_REGS_SHADOW_COUNT)
+		__clear_bit(reg / 4, dev->regs_shadow_valid);
+
+	cedrus_write_trace(dev, reg, val);
+	writel(val, dev->io_base + reg);
+}
+
+/*
+ * Shadowed writes are skipped when the register already holds the value,
+ * which is only valid for registers that the hardware never updates.
+ */
+static inline bool cedrus_write_shadow_update(struct cedrus_device *dev,
+					      u32 reg, u32 val)
+{
+	unsigned int index = reg / 4;
+
+	if (WARN_ON_ONCE(index >= CEDRUS_REGS_SHADOW_COUNT))
+		return true;
+
+	if (test_bit(index, dev->regs_shadow_valid) &&
+	    dev->regs_shadow[index] == val)
+		return false;
+
+	dev->regs_shadow[index] = val;
+	__set_bit(index, dev->regs_shadow_valid);
+
+	return true;
+}
+
+static inline void cedrus_write_shadow(struct cedrus_device *dev, u32 reg,
+				       u32 val)
+{
+	if (!cedrus_write_shadow_update(dev, reg, val))
+		return;
+
+	cedrus_write_trace(dev, reg, val);
 	writel(val, dev->io_base + reg);
 }
 
+static inline void cedrus_write_batch(struct cedrus_device *dev,
+				      const struct cedrus_reg_value *values,
+				      unsigned int count)
+{
+	unsigned int i;
+
+	/* Order memory accesses once for the whole batch. */
+	wmb();
+
+	for (i = 0; i < count; i++) {
+		if (!cedrus_write_shadow_update(dev, values[i].reg,
+						values[i].val))
+			continue;
+
+		cedrus_write_trace(dev, values[i].reg, values[i].val);
+		writel_relaxed(values[i].val, dev->io_base + values[i].reg);
+	}
+}
+
+/*
+ * Data ports take consecutive words at the same address, which are written
+ * with a single string write. The words are taken in memory order.
+ */
+static inline void cedrus_write_port(struct cedrus_device *dev, u32 reg,
+				     const void *data, unsigned int size)
+{
+	const u32 *words = data;
+	unsigned int i;
+
+	if (reg / 4 < CEDRUS_REGS_SHADOW_COUNT)
+		__clear_bit(reg / 4, dev->regs_shadow_valid);
+
+	/* Each word is recorded as a write to the port. */
+	if (unlikely(READ_ONCE(dev->debugfs.trace.active)))
+		for (i = 0; i < DIV_ROUND_UP(size, 4); i++)
+			cedrus_debugfs_trace_write(dev, reg, words[i]);
+
+	/* String writes are not ordered with previous memory accesses. */
+	wmb();
+
+	writesl(dev->io_base + reg, data, DIV_ROUND_UP(size, 4));
+}
+
+static inline void cedrus_write_shadow_invalidate(struct cedrus_device *dev)
+{
+	bitmap_zero(dev->regs_shadow_valid, CEDRUS_REGS_SHADOW_COUNT);
+}
+
 static inline u32 cedrus_read(struct cedrus_device *dev, u32 reg)
 {
 	return readl(dev->io_base + reg);
@@ -135,6 +282,18 @@ static inline u64 cedrus_buffer_timestamp(struct cedrus_buffer *buffer)
 	return buffer->m2m_buffer.vb.vb2_buf.timestamp;
 }
 
+/*
+ * Chroma planes of single-plane picture formats come right after the luma
+ * plane, or further away at the offset requested for the context.
+ */
+static inline unsigned int
+cedrus_picture_chroma_offset(struct cedrus_context *ctx,
+			     struct v4l2_pix_format *pix_format)
+{
+	return max(ctx->v4l2.chroma_offset_picture,
+		   pix_format->bytesperline * pix_format->height);
+}
+
 static inline void cedrus_buffer_picture_dma(struct cedrus_context *ctx,
 					     struct cedrus_buffer *cedrus_buffer,
 					     dma_addr_t *luma_addr,
@@ -147,7 +306,7 @@ static inline void cedrus_buffer_picture_dma(struct cedrus_context *ctx,
 	addr = vb2_dma_contig_plane_dma_addr(vb2_buffer, 0);
 	*luma_addr = addr;
 
-	addr += pix_format->bytesperline * pix_format->height;
+	addr += cedrus_picture_chroma_offset(ctx, pix_format);
 	*chroma_addr = addr;
 }
 
@@ -169,22 +328,81 @@ static inline void cedrus_buffer_coded_dma(struct cedrus_context *ctx,
 		*size = vb2_plane_size(vb2_buffer, 0);
 }
 
-static inline struct cedrus_buffer *
-cedrus_buffer_picture_find(struct cedrus_context *ctx, u64 timestamp)
+static inline void *
+cedrus_buffer_coded_vaddr(struct cedrus_buffer *cedrus_buffer)
 {
-	struct vb2_buffer *vb2_buffer;
-	struct vb2_v4l2_buffer *v4l2_buffer;
+	struct vb2_buffer *vb2_buffer = &cedrus_buffer->m2m_buffer.vb.vb2_buf;
 
-	if (WARN_ON(!ctx->job.queue_picture))
+	/*
+	 * Only allocated buffers are kept mapped. Accesses to non-coherent
+	 * ones must be bracketed with cedrus_buffer_coded_sync_cpu/device.
+	 * Imported buffers would need to be mapped and bracketed with CPU
+	 * access calls.
+	 */
+	if (vb2_buffer->memory != VB2_MEMORY_MMAP)
 		return NULL;
 
-	vb2_buffer = vb2_find_buffer(ctx->job.queue_picture, timestamp);
-	if (!vb2_buffer)
-		return NULL;
+	return vb2_plane_vaddr(vb2_buffer, 0);
+}
+
+/*
+ * Non-coherent buffers are cached for the CPU while the engine writes them.
+ * Ranges accessed by the CPU are synced page by page, since the pages behind
+ * their DMA addresses need not be contiguous.
+ */
+static inline void cedrus_buffer_coded_sync(struct cedrus_buffer *cedrus_buffer,
+					    unsigned int offset,
+					    unsigned int size, bool cpu)
+{
+	struct vb2_buffer *vb2_buffer = &cedrus_buffer->m2m_buffer.vb.vb2_buf;
+	struct vb2_queue *queue = vb2_buffer->vb2_queue;
+	unsigned int length;
+	dma_addr_t addr;
 
-	v4l2_buffer = to_vb2_v4l2_buffer(vb2_buffer);
+	if (vb2_buffer->memory != VB2_MEMORY_MMAP || !queue->non_coherent_mem)
+		return;
 
-	return container_of(v4l2_buffer, struct cedrus_buffer, m2m_buffer.vb);
+	addr = vb2_dma_contig_plane_dma_addr(vb2_buffer, 0) + offset;
+
+	while (size) {
+		length = min_t(unsigned int, size,
+			       PAGE_SIZE - offset_in_page(addr));
+
+		if (cpu)
+			dma_sync_single_for_cpu(queue->dev, addr, length,
+						DMA_BIDIRECTIONAL);
+		else
+			dma_sync_single_for_device(queue->dev, addr, length,
+						   DMA_BIDIRECTIONAL);
+
+		addr += length;
+		size -= length;
+	}
+}
+
+/* Engine writes to the range become visible to the CPU. */
+static inline void
+cedrus_buffer_coded_sync_cpu(struct cedrus_buffer *cedrus_buffer,
+			     unsigned int offset, unsigned int size)
+{
+	cedrus_buffer_coded_sync(cedrus_buffer, offset, size, true);
+}
+
+/* CPU writes to the range reach memory, before the buffer is done. */
+static inline void
+cedrus_buffer_coded_sync_device(struct cedrus_buffer *cedrus_buffer,
+				unsigned int offset, unsigned int size)
+{
+	cedrus_buffer_coded_sync(cedrus_buffer, offset, size, false);
+}
+
+static inline struct cedrus_buffer *
+cedrus_buffer_picture_find(struct cedrus_context *ctx, u64 timestamp)
+{
+	if (WARN_ON(!ctx->job.queue_picture))
+		return NULL;
+
+	return cedrus_context_buffer_find(ctx, timestamp);
 }
 
 static inline struct cedrus_buffer *
@@ -8,10 +8,17 @@
  * Author: Paul Kocialkowski <paul.kocialkowski@bootlin.com>
  */
 
+#include <linux/dma-buf.h>
+#include <linux/dma-resv.h>
+#include <linux/math64.h>
+#include <linux/module.h>
 #include <linux/pm_runtime.h>
+#include <linux/reset.h>
 #include <linux/videodev2.h>
+#include <drm/drm_fourcc.h>
 #include <media/v4l2-ctrls.h>
 #include <media/v4l2-device.h>
+#include <media/v4l2-event.h>
 #include <media/v4l2-fh.h>
 #include <media/v4l2-mem2mem.h>
 #include <media/videobuf2-v4l2.h>
@@ -19,8 +26,220 @@
 
 #include "cedrus.h"
 #include "cedrus_context.h"
+#include "cedrus_debugfs.h"
+#include "cedrus_devfreq.h"
 #include "cedrus_engine.h"
 #include "cedrus_proc.h"
+#include "cedrus_trace.h"
+#include "include/uapi/sunxi-cedrus.h"
+
+/* Schedule */
+
+static void cedrus_context_schedule(struct cedrus_context *ctx)
+{
+	struct cedrus_device *dev = ctx->proc->dev;
+	bool yielded = xchg(&dev->engine_yielded, false);
+
+	/*
+	 * Only contexts of lower priority or of another engine may have given
+	 * way to this one.
+	 */
+	if (ctx->priority || ctx->deadline_ms || yielded)
+		schedule_work(&dev->schedule_work);
+}
+
+static void cedrus_context_priority_update(struct cedrus_context *ctx,
+					   unsigned int priority)
+{
+	struct cedrus_device *dev = ctx->proc->dev;
+	unsigned long flags;
+
+	if (priority == ctx->priority)
+		return;
+
+	spin_lock_irqsave(&dev->contexts_lock, flags);
+	ctx->priority = priority;
+	spin_unlock_irqrestore(&dev->contexts_lock, flags);
+
+	schedule_work(&dev->schedule_work);
+}
+
+static void cedrus_context_deadline_update(struct cedrus_context *ctx,
+					   unsigned int deadline_ms)
+{
+	struct cedrus_device *dev = ctx->proc->dev;
+	unsigned long flags;
+
+	if (deadline_ms == ctx->deadline_ms)
+		return;
+
+	spin_lock_irqsave(&dev->contexts_lock, flags);
+	ctx->deadline_ms = deadline_ms;
+	spin_unlock_irqrestore(&dev->contexts_lock, flags);
+
+	schedule_work(&dev->schedule_work);
+}
+
+static ktime_t cedrus_context_buffer_deadline(struct cedrus_context *ctx,
+					      struct vb2_v4l2_buffer *buffer)
+{
+	struct cedrus_buffer *cedrus_buffer;
+
+	if (!ctx->deadline_ms || !buffer)
+		return 0;
+
+	cedrus_buffer = cedrus_buffer_from_vb2(&buffer->vb2_buf);
+
+	return ktime_add_ms(cedrus_buffer->time_queue, ctx->deadline_ms);
+}
+
+static ktime_t cedrus_context_next_deadline(struct cedrus_context *ctx)
+{
+	struct v4l2_m2m_ctx *m2m_ctx = ctx->v4l2.fh.m2m_ctx;
+
+	return cedrus_context_buffer_deadline(ctx,
+					      v4l2_m2m_next_src_buf(m2m_ctx));
+}
+
+static bool cedrus_context_job_pending(struct cedrus_context *ctx)
+{
+	struct v4l2_m2m_ctx *m2m_ctx = ctx->v4l2.fh.m2m_ctx;
+
+	if (!vb2_is_streaming(v4l2_m2m_get_src_vq(m2m_ctx)) ||
+	    !vb2_is_streaming(v4l2_m2m_get_dst_vq(m2m_ctx)))
+		return false;
+
+	if (!v4l2_m2m_num_dst_bufs_ready(m2m_ctx))
+		return false;
+
+	return ctx->header_pending || ctx->pictures_held_ready ||
+	       v4l2_m2m_num_src_bufs_ready(m2m_ctx);
+}
+
+static bool cedrus_context_priority_yield(struct cedrus_context *ctx)
+{
+	struct cedrus_device *dev = ctx->proc->dev;
+	struct cedrus_context *other;
+	unsigned long flags;
+	bool yield = false;
+
+	if (ctx->priority == CEDRUS_CONTEXT_PRIORITY_MAX)
+		return false;
+
+	spin_lock_irqsave(&dev->contexts_lock, flags);
+
+	list_for_each_entry(other, &dev->contexts, list) {
+		if (other->priority > ctx->priority &&
+		    cedrus_context_job_pending(other)) {
+			yield = true;
+			break;
+		}
+	}
+
+	spin_unlock_irqrestore(&dev->contexts_lock, flags);
+
+	return yield;
+}
+
+/*
+ * Contexts of the same priority are served by earliest deadline first, with
+ * the deadline of the next source buffer (held pictures are not considered).
+ */
+static bool cedrus_context_deadline_yield(struct cedrus_context *ctx)
+{
+	struct cedrus_device *dev = ctx->proc->dev;
+	struct cedrus_context *other;
+	ktime_t deadline, deadline_other;
+	unsigned long flags;
+	bool yield = false;
+
+	spin_lock_irqsave(&dev->contexts_lock, flags);
+
+	deadline = cedrus_context_next_deadline(ctx);
+
+	list_for_each_entry(other, &dev->contexts, list) {
+		if (other == ctx || other->priority != ctx->priority ||
+		    !other->deadline_ms)
+			continue;
+
+		deadline_other = cedrus_context_next_deadline(other);
+		if (!deadline_other ||
+		    (deadline && !ktime_before(deadline_other, deadline)))
+			continue;
+
+		if (cedrus_context_job_pending(other)) {
+			yield = true;
+			break;
+		}
+	}
+
+	spin_unlock_irqrestore(&dev->contexts_lock, flags);
+
+	return yield;
+}
+
+/*
+ * Switching between engines reconfigures the mode and resets the engine, so
+ * contexts of other engines give way to pending jobs of the running engine,
+ * for a limited time so that they still meet their own deadlines.
+ */
+static bool cedrus_context_engine_yield(struct cedrus_context *ctx)
+{
+	struct cedrus_device *dev = ctx->proc->dev;
+	const struct cedrus_engine *engine = READ_ONCE(dev->engine_running);
+	unsigned long delay = msecs_to_jiffies(CEDRUS_CONTEXT_ENGINE_YIELD_MS);
+	struct cedrus_context *other;
+	unsigned long flags;
+	bool yield = false;
+
+	/* Jobs are checked again when the running one finishes. */
+	if (!engine || engine == ctx->engine)
+		return false;
+
+	if (ctx->engine_yielding &&
+	    time_after(jiffies, ctx->engine_yield_time + delay))
+		return false;
+
+	spin_lock_irqsave(&dev->contexts_lock, flags);
+
+	list_for_each_entry(other, &dev->contexts, list) {
+		if (other->engine == engine &&
+		    other->priority >= ctx->priority &&
+		    cedrus_context_job_pending(other)) {
+			yield = true;
+			break;
+		}
+	}
+
+	spin_unlock_irqrestore(&dev->contexts_lock, flags);
+
+	if (!yield)
+		return false;
+
+	if (!ctx->engine_yielding) {
+		ctx->engine_yield_time = jiffies;
+		ctx->engine_yielding = true;
+	}
+
+	WRITE_ONCE(dev->engine_yielded, true);
+
+	return true;
+}
+
+void cedrus_context_schedule_work(struct work_struct *work)
+{
+	struct cedrus_device *dev =
+		container_of(work, struct cedrus_device, schedule_work);
+	struct cedrus_context *ctx;
+
+	/* Check again the contexts that may have given way. */
+	mutex_lock(&dev->contexts_mutex);
+
+	list_for_each_entry(ctx, &dev->contexts, list)
+		v4l2_m2m_try_schedule(ctx->v4l2.fh.m2m_ctx);
+
+	mutex_unlock(&dev->contexts_mutex);
+}
 
 /* Ctrl */
 
@@ -41,13 +260,107 @@ struct v4l2_ctrl *cedrus_context_ctrl_find(struct cedrus_context *ctx, u32 id)
 	return NULL;
 }
 
+/*
+ * Compound controls of decoders come with each request, which the control
+ * framework would copy twice on the way to the current values. Dynamic arrays
+ * (e.g. slice parameters) only make sense for their own request, so they are
+ * read there in place for the duration of the job instead, leaving the current
+ * values behind. Other compound controls (e.g. parameter sets) are only copied
+ * when they changed.
+ */
+static bool cedrus_context_ctrl_request_skip(struct v4l2_ctrl_ref *ref)
+{
+	struct v4l2_ctrl *ctrl = ref->ctrl;
+	bool skip;
+
+	if (!ref->p_req_valid || ctrl->type < V4L2_CTRL_COMPOUND_TYPES ||
+	    ctrl->ncontrols != 1)
+		return false;
+
+	if (ctrl->is_dyn_array)
+		return true;
+
+	v4l2_ctrl_lock(ctrl);
+	skip = !memcmp(ref->p_req.p, ctrl->p_cur.p,
+		       ctrl->elems * ctrl->elem_size);
+	v4l2_ctrl_unlock(ctrl);
+
+	return skip;
+}
+
+static void cedrus_context_ctrl_request_setup(struct cedrus_context *ctx,
+					      struct media_request *req)
+{
+	struct v4l2_ctrl_handler *ctrl_handler = &ctx->v4l2.ctrl_handler;
+	struct v4l2_ctrl_ref *skipped[CEDRUS_CONTEXT_CTRLS_SKIP_MAX];
+	struct v4l2_ctrl_handler *hdl = NULL;
+	struct v4l2_ctrl_ref *ref;
+	unsigned int count = 0;
+	unsigned int i;
+
+	if (ctx->proc->role == CEDRUS_ROLE_DECODER)
+		hdl = v4l2_ctrl_request_hdl_find(req, ctrl_handler);
+
+	if (!hdl) {
+		v4l2_ctrl_request_setup(req, ctrl_handler);
+		return;
+	}
+
+	/* Queued requests are left alone by userspace until completed. */
+	list_for_each_entry(ref, &hdl->ctrl_refs, node) {
+		if (count == ARRAY_SIZE(skipped))
+			break;
+
+		if (cedrus_context_ctrl_request_skip(ref)) {
+			ref->p_req_valid = false;
+			skipped[count++] = ref;
+		}
+	}
+
+	v4l2_ctrl_request_setup(req, ctrl_handler);
+
+	/* Completing the request must not copy the current values over. */
+	for (i = 0; i < count; i++)
+		skipped[i]->p_req_valid = true;
+
+	ctx->job.ctrl_request = hdl;
+}
+
+static struct v4l2_ctrl_ref *
+cedrus_context_ctrl_request_ref(struct cedrus_context *ctx,
+				struct v4l2_ctrl *ctrl)
+{
+	struct v4l2_ctrl_handler *hdl = ctx->job.ctrl_request;
+	struct v4l2_ctrl_ref *ref;
+
+	if (!hdl || !ctrl->is_dyn_array)
+		return NULL;
+
+	list_for_each_entry(ref, &hdl->ctrl_refs, node)
+		if (ref->ctrl == ctrl)
+			return ref->p_req_valid ? ref : NULL;
+
+	return NULL;
+}
+
+static void cedrus_context_ctrl_request_put(struct cedrus_context *ctx)
+{
+	if (ctx->job.ctrl_request)
+		v4l2_ctrl_request_hdl_put(ctx->job.ctrl_request);
+}
+
 void *cedrus_context_ctrl_data(struct cedrus_context *ctx, u32 id)
 {
 	struct v4l2_ctrl *ctrl = v4l2_ctrl_find(&ctx->v4l2.ctrl_handler, id);
+	struct v4l2_ctrl_ref *ref;
 
 	if (WARN_ON(!ctrl))
 		return NULL;
 
+	ref = cedrus_context_ctrl_request_ref(ctx, ctrl);
+	if (ref)
+		return ref->p_req.p;
+
 	return ctrl->p_cur.p;
 }
 
@@ -64,165 +377,1148 @@ int cedrus_context_ctrl_value(struct cedrus_context *ctx, u32 id)
 int cedrus_context_ctrl_array_count(struct cedrus_context *ctx, u32 id)
 {
 	struct v4l2_ctrl *ctrl = v4l2_ctrl_find(&ctx->v4l2.ctrl_handler, id);
+	struct v4l2_ctrl_ref *ref;
 
 	if (WARN_ON(!ctrl))
 		return 0;
 
+	ref = cedrus_context_ctrl_request_ref(ctx, ctrl);
+	if (ref)
+		return ref->p_req_elems;
+
 	return ctrl->elems;
 }
 
 static int cedrus_context_s_ctrl(struct v4l2_ctrl *ctrl)
 {
 	struct cedrus_context *ctx = ctrl->priv;
+	int ret;
 
 	/* XXX: monitor this when using with request, plan is to not use it
 	 * during streaming, maybe needs a check here. */
 
+	/* Context controls are shared by all engines. */
+	switch (ctrl->id) {
+	case V4L2_CID_CEDRUS_PRIORITY:
+		cedrus_context_priority_update(ctx, ctrl->val);
+		return 0;
+	case V4L2_CID_CEDRUS_DEADLINE:
+		cedrus_context_deadline_update(ctx, ctrl->val);
+		return 0;
+	case V4L2_CID_CEDRUS_POLL_THRESHOLD:
+		WRITE_ONCE(ctx->poll_us, ctrl->val);
+		return 0;
+	}
+
+	ret = cedrus_proc_ctrl_prepare(ctx, ctrl);
+	if (ret)
+		return ret;
+
 	return cedrus_engine_ctrl_prepare(ctx, ctrl);
 }
 
 static int cedrus_context_try_ctrl(struct v4l2_ctrl *ctrl)
 {
 	struct cedrus_context *ctx = ctrl->priv;
+	int ret;
+
+	ret = cedrus_proc_ctrl_validate(ctx, ctrl);
+	if (ret)
+		return ret;
 
 	return cedrus_engine_ctrl_validate(ctx, ctrl);
 }
 
+static int cedrus_context_g_volatile_ctrl(struct v4l2_ctrl *ctrl)
+{
+	struct cedrus_context *ctx = ctrl->priv;
+	struct cedrus_device *dev = ctx->proc->dev;
+
+	switch (ctrl->id) {
+	case V4L2_CID_CEDRUS_MB_RATE:
+		/* Devfreq may lower the rate, but only when the load allows. */
+		if (ctx->engine->mb_cycles)
+			ctrl->val = dev->clock_mod_rate_nominal /
+				    ctx->engine->mb_cycles;
+		else
+			ctrl->val = 0;
+		break;
+	case V4L2_CID_CEDRUS_DEC_DRM_MODIFIER:
+		if (ctx->v4l2.format_picture.fmt.pix.pixelformat ==
+		    V4L2_PIX_FMT_NV12_32L32)
+			*ctrl->p_new.p_s64 = DRM_FORMAT_MOD_ALLWINNER_TILED;
+		else
+			*ctrl->p_new.p_s64 = DRM_FORMAT_MOD_LINEAR;
+		break;
+	case V4L2_CID_CEDRUS_DEADLINE_MISSED:
+		spin_lock(&ctx->stats.lock);
+		*ctrl->p_new.p_s64 = ctx->stats.deadlines_missed;
+		spin_unlock(&ctx->stats.lock);
+		break;
+	}
+
+	return 0;
+}
+
 const struct v4l2_ctrl_ops cedrus_context_ctrl_ops = {
-	.s_ctrl		= cedrus_context_s_ctrl,
-	.try_ctrl	= cedrus_context_try_ctrl,
+	.g_volatile_ctrl	= cedrus_context_g_volatile_ctrl,
+	.s_ctrl			= cedrus_context_s_ctrl,
+	.try_ctrl		= cedrus_context_try_ctrl,
+};
+
+static const struct v4l2_ctrl_config cedrus_context_ctrl_configs[] = {
+	{
+		.id		= V4L2_CID_CEDRUS_PRIORITY,
+		.name		= "Scheduling Priority",
+		.type		= V4L2_CTRL_TYPE_INTEGER,
+		.step		= 1,
+		.min		= 0,
+		.max		= CEDRUS_CONTEXT_PRIORITY_MAX,
+		.def		= 0,
+		.ops		= &cedrus_context_ctrl_ops,
+	},
+	{
+		.id		= V4L2_CID_CEDRUS_DEADLINE,
+		.name		= "Scheduling Deadline",
+		.type		= V4L2_CTRL_TYPE_INTEGER,
+		.step		= 1,
+		.min		= 0,
+		.max		= CEDRUS_CONTEXT_DEADLINE_MAX_MS,
+		.def		= 0,
+		.ops		= &cedrus_context_ctrl_ops,
+	},
+	{
+		.id		= V4L2_CID_CEDRUS_DEADLINE_MISSED,
+		.name		= "Missed Deadlines",
+		.type		= V4L2_CTRL_TYPE_INTEGER64,
+		.flags		= V4L2_CTRL_FLAG_READ_ONLY |
+				  V4L2_CTRL_FLAG_VOLATILE,
+		.step		= 1,
+		.min		= 0,
+		.max		= S64_MAX,
+		.def		= 0,
+		.ops		= &cedrus_context_ctrl_ops,
+	},
+	{
+		.id		= V4L2_CID_CEDRUS_POLL_THRESHOLD,
+		.name		= "Completion Poll Threshold",
+		.type		= V4L2_CTRL_TYPE_INTEGER,
+		.step		= 1,
+		.min		= 0,
+		.max		= CEDRUS_CONTEXT_POLL_MAX_US,
+		.def		= 0,
+		.ops		= &cedrus_context_ctrl_ops,
+	},
+	{
+		.id		= V4L2_CID_CEDRUS_MB_RATE,
+		.name		= "Engine Macroblock Rate",
+		.type		= V4L2_CTRL_TYPE_INTEGER,
+		.flags		= V4L2_CTRL_FLAG_READ_ONLY |
+				  V4L2_CTRL_FLAG_VOLATILE,
+		.step		= 1,
+		.min		= 0,
+		.max		= INT_MAX,
+		.def		= 0,
+		.ops		= &cedrus_context_ctrl_ops,
+	},
 };
 
+static int cedrus_context_ctrl_new(struct cedrus_context *ctx,
+				   const struct v4l2_ctrl_config *ctrl_config,
+				   unsigned int index)
+{
+	struct cedrus_context_v4l2 *v4l2 = &ctx->v4l2;
+	struct v4l2_device *v4l2_dev = &ctx->proc->dev->v4l2.v4l2_dev;
+	struct v4l2_ctrl_handler *handler = &v4l2->ctrl_handler;
+	struct v4l2_ctrl *ctrl;
+
+	ctrl = v4l2_ctrl_new_custom(handler, ctrl_config, ctx);
+	if (handler->error) {
+		v4l2_err(v4l2_dev, "failed to create %s control (%d)\n",
+			 v4l2_ctrl_get_name(ctrl_config->id), handler->error);
+		return handler->error;
+	}
+
+	v4l2->ctrls[index] = ctrl;
+
+	return 0;
+}
+
+static int cedrus_context_ctrls_engine_update(struct cedrus_context *ctx)
+{
+	const struct cedrus_engine *engine = ctx->engine;
+	struct cedrus_proc *proc = ctx->proc;
+	struct v4l2_ctrl **ctrls = ctx->v4l2.ctrls;
+	unsigned int index = 0;
+	unsigned int i, j;
+	int ret;
+
+	/*
+	 * Controls can't be removed from the handler on their own (events and
+	 * requests may still refer to them), so the ones of engines selected
+	 * before are only deactivated.
+	 */
+	for (i = 0; i < proc->engines_count; i++) {
+		const struct cedrus_engine *other = proc->engines[i];
+		const struct v4l2_ctrl_config *ctrl_configs =
+			other->ctrl_configs;
+
+		for (j = 0; j < other->ctrl_configs_count; j++) {
+			struct v4l2_ctrl *ctrl =
+				cedrus_context_ctrl_find(ctx,
+							 ctrl_configs[j].id);
+
+			v4l2_ctrl_activate(ctrl, other == engine);
+		}
+	}
+
+	/* Engine controls are only created the first time it's selected. */
+	if (!engine->ctrl_configs_count ||
+	    cedrus_context_ctrl_find(ctx, engine->ctrl_configs[0].id))
+		return 0;
+
+	while (ctrls[index])
+		index++;
+
+	for (j = 0; j < engine->ctrl_configs_count; j++) {
+		ret = cedrus_context_ctrl_new(ctx, &engine->ctrl_configs[j],
+					      index);
+		if (ret)
+			return ret;
+
+		if (ctx->ctrls_pinned)
+			v4l2_ctrl_grab(ctrls[index], true);
+
+		index++;
+	}
+
+	return 0;
+}
+
 static int cedrus_context_ctrls_setup(struct cedrus_context *ctx)
 {
 	struct cedrus_proc *proc = ctx->proc;
 	struct cedrus_context_v4l2 *v4l2 = &ctx->v4l2;
 	struct v4l2_device *v4l2_dev = &proc->dev->v4l2.v4l2_dev;
 	struct v4l2_ctrl_handler *handler = &v4l2->ctrl_handler;
-	unsigned int count = 0;
+	unsigned int count = ARRAY_SIZE(cedrus_context_ctrl_configs) +
+			     proc->ctrl_configs_count;
+	unsigned int count_engine = 0;
+	unsigned int count_all = count;
 	unsigned int index = 0;
 	unsigned int size;
-	unsigned int i, j;
+	unsigned int i;
 	int ret;
 
-	/* TODO: Also get ctrl_configs from proc for shared controls. */
+	/*
+	 * Only the shared controls and the ones of the default engine are
+	 * created at open, others once their engine is selected (see
+	 * cedrus_context_engine_update).
+	 */
+	for (i = 0; i < proc->engines_count; i++) {
+		const struct cedrus_engine *engine = proc->engines[i];
 
-	for (i = 0; i < proc->engines_count; i++)
-		count += proc->engines[i]->ctrl_configs_count;
+		count_engine = max(count_engine, engine->ctrl_configs_count);
+		count_all += engine->ctrl_configs_count;
+	}
 
-	if (WARN_ON(!count))
+	if (WARN_ON(!count_all))
 		return -ENODEV;
 
 	/* Last entry is a zero sentinel. */
-	size = sizeof(*v4l2->ctrls) * (count + 1);
+	size = sizeof(*v4l2->ctrls) * (count_all + 1);
+
+	v4l2->ctrls = kzalloc(size, GFP_KERNEL);
+	if (!v4l2->ctrls)
+		return -ENOMEM;
+
+	ret = v4l2_ctrl_handler_init(handler, count + count_engine);
+	if (ret) {
+		v4l2_err(v4l2_dev, "failed to initialize control handler\n");
+		goto error_ctrls;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(cedrus_context_ctrl_configs); i++) {
+		ret = cedrus_context_ctrl_new(ctx,
+					      &cedrus_context_ctrl_configs[i],
+					      index);
+		if (ret)
+			goto error_handler;
+
+		index++;
+	}
+
+	for (i = 0; i < proc->ctrl_configs_count; i++) {
+		ret = cedrus_context_ctrl_new(ctx, &proc->ctrl_configs[i],
+					      index);
+		if (ret)
+			goto error_handler;
+
+		index++;
+	}
+
+	ret = cedrus_context_ctrls_engine_update(ctx);
+	if (ret)
+		goto error_handler;
+
+	ctx->v4l2.fh.ctrl_handler = handler;
+
+	ret = v4l2_ctrl_handler_setup(handler);
+	if (ret)
+		goto error_handler;
+
+	return 0;
+
+error_handler:
+	v4l2_ctrl_handler_free(handler);
+
+error_ctrls:
+	kfree(v4l2->ctrls);
+
+	return ret;
+}
+
+static void cedrus_context_ctrls_pin_update(struct cedrus_context *ctx,
+					    bool pinned)
+{
+	struct v4l2_ctrl **ctrls = ctx->v4l2.ctrls;
+	unsigned int index = 0;
+
+	if (ctx->ctrls_pinned == pinned)
+		return;
+
+	/*
+	 * Engines grab some controls on their own from setup to stop, which
+	 * covers the whole pinned period.
+	 */
+	while (ctrls[index]) {
+		v4l2_ctrl_grab(ctrls[index], pinned);
+		index++;
+	}
+
+	ctx->ctrls_pinned = pinned;
+}
+
+static void cedrus_context_ctrls_cleanup(struct cedrus_context *ctx)
+{
+	v4l2_ctrl_handler_free(&ctx->v4l2.ctrl_handler);
+	kfree(ctx->v4l2.ctrls);
+}
+
+/* Engine */
+
+static void cedrus_context_engine_release(struct cedrus_context *ctx)
+{
+	/* Buffers freed afterwards still go back to the slot. */
+	cedrus_pool_unreserve(ctx);
+
+	if (!ctx->engine_ctx && !ctx->engine_job)
+		return;
+
+	cedrus_engine_cleanup(ctx);
+
+	if (ctx->engine_job) {
+		kfree(ctx->engine_job);
+		ctx->engine_job = NULL;
+	}
+
+	if (ctx->engine_ctx) {
+		kfree(ctx->engine_ctx);
+		ctx->engine_ctx = NULL;
+	}
+}
+
+/*
+ * Contexts kept for a quick restart hold on to their auxiliary buffers while
+ * none of their queues stream. Under memory pressure, they are released and
+ * the engine is setup again from scratch when streaming starts next time.
+ */
+static bool cedrus_context_engine_kept_check(struct cedrus_context *ctx)
+{
+	struct v4l2_m2m_ctx *m2m_ctx = ctx->v4l2.fh.m2m_ctx;
+
+	if (!ctx->engine_ctx && !ctx->engine_job)
+		return false;
+
+	return !vb2_is_streaming(v4l2_m2m_get_src_vq(m2m_ctx)) &&
+	       !vb2_is_streaming(v4l2_m2m_get_dst_vq(m2m_ctx));
+}
+
+unsigned long cedrus_context_engine_kept_memory(struct cedrus_device *dev)
+{
+	struct cedrus_context *ctx;
+	unsigned long memory = 0;
+
+	/* Only an estimate, as contexts may start streaming at any time. */
+	spin_lock_irq(&dev->contexts_lock);
+
+	list_for_each_entry(ctx, &dev->contexts, list)
+		if (cedrus_context_engine_kept_check(ctx))
+			memory += atomic_long_read(&ctx->memory);
+
+	spin_unlock_irq(&dev->contexts_lock);
+
+	return memory;
+}
+
+void cedrus_context_engine_reclaim(struct cedrus_device *dev)
+{
+	struct cedrus_context *ctx;
+	struct mutex *lock;
+
+	mutex_lock(&dev->contexts_mutex);
+
+	list_for_each_entry(ctx, &dev->contexts, list) {
+		lock = &ctx->proc->v4l2.lock;
+
+		/* The lock is taken before the contexts one, skip busy ones. */
+		if (!mutex_trylock(lock))
+			continue;
+
+		if (cedrus_context_engine_kept_check(ctx))
+			cedrus_context_engine_release(ctx);
+
+		mutex_unlock(lock);
+	}
+
+	mutex_unlock(&dev->contexts_mutex);
+}
+
+int cedrus_context_engine_update(struct cedrus_context *ctx)
+{
+	unsigned int pixelformat = ctx->v4l2.format_coded.fmt.pix.pixelformat;
+	struct vb2_queue *queue = v4l2_m2m_get_src_vq(ctx->v4l2.fh.m2m_ctx);
+	const struct cedrus_engine *engine;
+	int ret;
+
+	engine = cedrus_proc_engine_find_format(ctx->proc, pixelformat);
+	if (WARN_ON(!engine))
+		return -ENODEV;
+
+	/* A context kept from a previous session belongs to its engine. */
+	if (engine != ctx->engine)
+		cedrus_context_engine_release(ctx);
+
+	ctx->engine = engine;
+
+	ret = cedrus_context_ctrls_engine_update(ctx);
+	if (ret)
+		return ret;
+
+	if (engine->slice_based)
+		queue->subsystem_flags |=
+			VB2_V4L2_FL_SUPPORTS_M2M_HOLD_CAPTURE_BUF;
+	else
+		queue->subsystem_flags &=
+			~VB2_V4L2_FL_SUPPORTS_M2M_HOLD_CAPTURE_BUF;
+
+	return 0;
+}
+
+/* Format */
+
+bool cedrus_context_format_configured_check(struct cedrus_context *ctx)
+{
+	return ctx->proc->dev->ctx_configured == ctx;
+}
+
+void cedrus_context_format_invalidate(struct cedrus_context *ctx)
+{
+	struct cedrus_device *dev = ctx->proc->dev;
+
+	if (dev->ctx_configured == ctx)
+		dev->ctx_configured = NULL;
+}
+
+/* Selection */
+
+int cedrus_context_selection_picture_reset(struct cedrus_context *ctx)
+{
+	struct v4l2_pix_format *pix_format = &ctx->v4l2.format_picture.fmt.pix;
+	struct v4l2_rect *selection = &ctx->v4l2.selection_picture;
+
+	selection->left = 0;
+	selection->top = 0;
+	selection->width = pix_format->width;
+	selection->height = pix_format->height;
+
+	return 0;
+}
+
+/* Buffer */
+
+/*
+ * Decoders look references up by timestamp for each slice, which is copied to
+ * the picture buffer when its job runs. Buffers stay indexed until the next
+ * one or their cleanup, matching what vb2_find_buffer would find without
+ * scanning the whole queue each time.
+ */
+static void cedrus_context_buffer_index(struct cedrus_context *ctx,
+					struct cedrus_buffer *cedrus_buffer)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&ctx->buffers_timestamp_lock, flags);
+	hash_del(&cedrus_buffer->timestamp_node);
+	hash_add(ctx->buffers_timestamp, &cedrus_buffer->timestamp_node,
+		 cedrus_buffer_timestamp(cedrus_buffer));
+	spin_unlock_irqrestore(&ctx->buffers_timestamp_lock, flags);
+}
+
+static void cedrus_context_buffer_unindex(struct cedrus_context *ctx,
+					  struct cedrus_buffer *cedrus_buffer)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&ctx->buffers_timestamp_lock, flags);
+	hash_del(&cedrus_buffer->timestamp_node);
+	spin_unlock_irqrestore(&ctx->buffers_timestamp_lock, flags);
+}
+
+struct cedrus_buffer *cedrus_context_buffer_find(struct cedrus_context *ctx,
+						 u64 timestamp)
+{
+	struct cedrus_buffer *cedrus_buffer;
+	struct vb2_buffer *vb2_buffer;
+	unsigned long flags;
+
+	spin_lock_irqsave(&ctx->buffers_timestamp_lock, flags);
+
+	hash_for_each_possible(ctx->buffers_timestamp, cedrus_buffer,
+			       timestamp_node, timestamp) {
+		vb2_buffer = &cedrus_buffer->m2m_buffer.vb.vb2_buf;
+
+		/* The timestamp is dropped when the queue is cancelled. */
+		if (vb2_buffer->copied_timestamp &&
+		    vb2_buffer->timestamp == timestamp)
+			goto complete;
+	}
+
+	cedrus_buffer = NULL;
+
+complete:
+	spin_unlock_irqrestore(&ctx->buffers_timestamp_lock, flags);
+
+	return cedrus_buffer;
+}
+
+/* Job */
+
+static unsigned int cedrus_context_timeout_ms;
+module_param_named(watchdog_timeout_ms, cedrus_context_timeout_ms, uint, 0644);
+MODULE_PARM_DESC(watchdog_timeout_ms,
+		 "Job watchdog timeout in milliseconds (default: 0 for adaptive)");
+
+static const struct v4l2_event cedrus_context_eos_event = {
+	.type = V4L2_EVENT_EOS,
+};
+
+void cedrus_context_job_picture_hold(struct cedrus_context *ctx)
+{
+	/* Keep the picture buffer aside instead of processing it now. */
+	if (!WARN_ON(ctx->job.picture_held))
+		ctx->job.picture_hold = true;
+}
+
+void cedrus_context_pictures_held_ready(struct cedrus_context *ctx)
+{
+	/* Process all the pictures held so far before any new one. */
+	ctx->pictures_held_ready = ctx->pictures_held_count;
+}
+
+void cedrus_context_job_header_request(struct cedrus_context *ctx)
+{
+	/* Produce a coded buffer with only headers as next job. */
+	ctx->header_pending = true;
+}
+
+static void cedrus_context_pictures_held_cleanup(struct cedrus_context *ctx)
+{
+	struct cedrus_buffer *cedrus_buffer, *tmp;
+
+	list_for_each_entry_safe(cedrus_buffer, tmp, &ctx->pictures_held,
+				 m2m_buffer.list) {
+		struct vb2_buffer *vb2_buffer =
+			&cedrus_buffer->m2m_buffer.vb.vb2_buf;
+
+		list_del(&cedrus_buffer->m2m_buffer.list);
+
+		if (vb2_buffer->req_obj.req)
+			v4l2_ctrl_request_complete(vb2_buffer->req_obj.req,
+						   &ctx->v4l2.ctrl_handler);
+
+		v4l2_m2m_buf_done(&cedrus_buffer->m2m_buffer.vb,
+				  VB2_BUF_STATE_ERROR);
+	}
+
+	ctx->pictures_held_count = 0;
+	ctx->pictures_held_ready = 0;
+}
+
+unsigned long cedrus_context_job_timeout(struct cedrus_context *ctx)
+{
+	struct cedrus_device *dev = ctx->proc->dev;
+	struct v4l2_pix_format *pix_format = &ctx->v4l2.format_picture.fmt.pix;
+	unsigned int timeout_ms = READ_ONCE(cedrus_context_timeout_ms);
+	u64 cycles;
+
+	if (timeout_ms)
+		return msecs_to_jiffies(timeout_ms);
+
+	/*
+	 * Allow a generous number of engine cycles for each macroblock of the
+	 * picture, so that small pictures get their errors reported quickly.
+	 */
+	cycles = (u64)DIV_ROUND_UP(pix_format->width, 16) *
+		 DIV_ROUND_UP(pix_format->height, 16) *
+		 CEDRUS_CONTEXT_TIMEOUT_MB_CYCLES;
+
+	timeout_ms = div64_ul(cycles * MSEC_PER_SEC,
+			      READ_ONCE(dev->clock_mod_rate));
+	timeout_ms = max_t(unsigned int, timeout_ms,
+			   CEDRUS_CONTEXT_TIMEOUT_MIN_MS);
+
+	return msecs_to_jiffies(timeout_ms);
+}
+
+/*
+ * The watchdog normally gets the whole timeout for each pass of the job. Jobs
+ * that wait for userspace between passes set a single expiry instead, so that
+ * they can't keep the engine for longer than that in total.
+ */
+void cedrus_context_job_watchdog_schedule(struct cedrus_context *ctx)
+{
+	struct cedrus_device *cedrus_dev = ctx->proc->dev;
+	unsigned long expires = ctx->job.expires;
+	unsigned long delay = 0;
+
+	if (!expires)
+		delay = cedrus_context_job_timeout(ctx);
+	else if (time_before(jiffies, expires))
+		delay = expires - jiffies;
+
+	schedule_delayed_work(&cedrus_dev->watchdog_work, delay);
+}
+
+/*
+ * Engines park a job waiting for more input from their continue operation,
+ * which then returns -EAGAIN. The job keeps the engine, without the IRQ thread,
+ * until the engine takes it back from outside the IRQ path or its watchdog
+ * expires. The watchdog is scheduled before the job can be taken back, which
+ * fails once the watchdog has run.
+ */
+void cedrus_context_job_park(struct cedrus_context *ctx)
+{
+	cedrus_context_job_watchdog_schedule(ctx);
+}
+
+int cedrus_context_job_unpark(struct cedrus_context *ctx)
+{
+	struct cedrus_device *cedrus_dev = ctx->proc->dev;
+
+	if (!cancel_delayed_work(&cedrus_dev->watchdog_work))
+		return -ETIMEDOUT;
+
+	cedrus_context_job_watchdog_schedule(ctx);
+
+	return 0;
+}
+
+/*
+ * Engines that need to run a job over from scratch (e.g. after a stall) reset
+ * the whole VE first, since the state it is left in is unknown. Registers are
+ * lost with the reset, so the formats of the job are configured again and the
+ * engine then programs the job itself.
+ */
+int cedrus_context_job_reset(struct cedrus_context *ctx)
+{
+	struct cedrus_device *cedrus_dev = ctx->proc->dev;
+	int ret;
+
+	cedrus_dev->ctx_configured = NULL;
+	ctx->job.configured_kept = false;
+
+	ret = reset_control_reset(cedrus_dev->reset);
+	if (ret)
+		return ret;
+
+	cedrus_write_shadow_invalidate(cedrus_dev);
+
+	ret = cedrus_engine_format_configure(ctx);
+	if (ret)
+		return ret;
+
+	ret = cedrus_proc_format_picture_configure(ctx);
+	if (ret)
+		return ret;
+
+	cedrus_dev->ctx_configured = ctx;
+
+	return 0;
+}
+
+/*
+ * Jobs are expected to take as long on the engine as the previous one of the
+ * context, which holds for streams of pictures of the same size. The first
+ * job is never polled for, nor any job after one that overran the threshold.
+ */
+unsigned int cedrus_context_job_poll_timeout(struct cedrus_context *ctx)
+{
+	struct cedrus_debugfs_stats *stats = &ctx->stats;
+	unsigned int poll_us = READ_ONCE(ctx->poll_us);
+	unsigned int index;
+	u32 time_hw_us = 0;
+
+	if (!poll_us)
+		return 0;
+
+	spin_lock(&stats->lock);
+
+	if (stats->samples_count) {
+		index = (stats->samples_index + CEDRUS_DEBUGFS_SAMPLES_COUNT -
+			 1) % CEDRUS_DEBUGFS_SAMPLES_COUNT;
+		time_hw_us = stats->samples_hw_us[index];
+	}
+
+	spin_unlock(&stats->lock);
+
+	if (!time_hw_us || time_hw_us > poll_us)
+		return 0;
+
+	return poll_us;
+}
+
+bool cedrus_context_job_picture_last_check(struct cedrus_context *ctx)
+{
+	struct v4l2_m2m_ctx *m2m_ctx = ctx->v4l2.fh.m2m_ctx;
+
+	return v4l2_m2m_is_last_draining_src_buf(m2m_ctx,
+						 ctx->job.buffer_picture);
+}
+
+static bool cedrus_context_job_last_check(struct cedrus_context *ctx)
+{
+	struct v4l2_m2m_ctx *m2m_ctx = ctx->v4l2.fh.m2m_ctx;
+
+	if (!m2m_ctx->is_draining)
+		return false;
+
+	if (ctx->job.buffer_picture == m2m_ctx->last_src_buf)
+		m2m_ctx->last_src_buf = NULL;
+
+	/* Pictures held so far are encoded after the last one. */
+	return !m2m_ctx->last_src_buf && !ctx->pictures_held_count;
+}
+
+static void cedrus_context_job_last_mark(struct cedrus_context *ctx,
+					 struct vb2_v4l2_buffer *buffer_dst)
+{
+	if (WARN_ON(!buffer_dst))
+		return;
+
+	buffer_dst->flags |= V4L2_BUF_FLAG_LAST;
+	v4l2_m2m_mark_stopped(ctx->v4l2.fh.m2m_ctx);
+	v4l2_event_queue_fh(&ctx->v4l2.fh, &cedrus_context_eos_event);
+}
+
+static void cedrus_context_job_fence_signal(struct dma_fence *fence,
+					    struct dma_fence_cb *cb)
+{
+	struct cedrus_context *ctx =
+		container_of(cb, struct cedrus_context, fence_cb);
+
+	/* The fence reference is dropped by cleanup if it got there first. */
+	if (xchg(&ctx->fence_wait, NULL))
+		dma_fence_put(fence);
+
+	schedule_work(&ctx->proc->dev->schedule_work);
+}
+
+/*
+ * Imported buffers may still be used by other devices, as told by the fences
+ * of their reservation object: the producer of a source buffer and the readers
+ * of a destination buffer are waited for. This is called with the m2m job
+ * lock held, so the job is only run again when the first pending fence gets
+ * signalled.
+ */
+static bool cedrus_context_job_fence_check(struct cedrus_context *ctx,
+					   struct vb2_v4l2_buffer *buffer,
+					   enum dma_resv_usage usage)
+{
+	struct vb2_buffer *vb2_buffer = &buffer->vb2_buf;
+	struct dma_resv_iter cursor;
+	struct dma_fence *fence;
+	bool ready = true;
+
+	if (vb2_buffer->memory != VB2_MEMORY_DMABUF ||
+	    !vb2_buffer->planes[0].dbuf)
+		return true;
+
+	dma_resv_iter_begin(&cursor, vb2_buffer->planes[0].dbuf->resv, usage);
+	dma_resv_for_each_fence_unlocked(&cursor, fence) {
+		if (dma_fence_is_signaled(fence))
+			continue;
+
+		ctx->fence_wait = dma_fence_get(fence);
+
+		if (!dma_fence_add_callback(fence, &ctx->fence_cb,
+					    cedrus_context_job_fence_signal)) {
+			ready = false;
+			break;
+		}
+
+		/* Signalled in the meantime. */
+		ctx->fence_wait = NULL;
+		dma_fence_put(fence);
+	}
+	dma_resv_iter_end(&cursor);
+
+	return ready;
+}
+
+static bool cedrus_context_job_fences_check(struct cedrus_context *ctx)
+{
+	struct v4l2_m2m_ctx *m2m_ctx = ctx->v4l2.fh.m2m_ctx;
+	struct vb2_v4l2_buffer *buffer;
+
+	/* Wait for the pending callback. */
+	if (READ_ONCE(ctx->fence_wait))
+		return false;
+
+	/* Header jobs and held pictures do not use the next source buffer. */
+	buffer = v4l2_m2m_next_src_buf(m2m_ctx);
+	if (buffer && !ctx->header_pending && !ctx->pictures_held_ready &&
+	    !cedrus_context_job_fence_check(ctx, buffer, DMA_RESV_USAGE_WRITE))
+		return false;
+
+	buffer = v4l2_m2m_next_dst_buf(m2m_ctx);
+	if (buffer &&
+	    !cedrus_context_job_fence_check(ctx, buffer, DMA_RESV_USAGE_READ))
+		return false;
+
+	return true;
+}
+
+static void cedrus_context_job_fence_cleanup(struct cedrus_context *ctx)
+{
+	struct dma_fence *fence = xchg(&ctx->fence_wait, NULL);
+
+	if (!fence)
+		return;
+
+	dma_fence_remove_callback(fence, &ctx->fence_cb);
+	dma_fence_put(fence);
+}
+
+bool cedrus_context_job_ready(struct cedrus_context *ctx)
+{
+	struct v4l2_m2m_ctx *m2m_ctx = ctx->v4l2.fh.m2m_ctx;
+
+	/*
+	 * Decoders never hold pictures and the source queue is not buffered.
+	 * Header jobs only need a coded buffer, which is always there. The
+	 * lookahead pictures are waited for, unless draining.
+	 */
+	if (ctx->proc->role == CEDRUS_ROLE_ENCODER &&
+	    !ctx->header_pending && !ctx->pictures_held_ready &&
+	    v4l2_m2m_num_src_bufs_ready(m2m_ctx) <=
+	    (m2m_ctx->is_draining ? 0 : ctx->lookahead))
+		return false;
+
+	/* Other devices may still be using the buffers. */
+	if (!cedrus_context_job_fences_check(ctx))
+		return false;
+
+	/* Give way to contexts of higher priority with a job ready too. */
+	if (cedrus_context_priority_yield(ctx))
+		return false;
+
+	/* Then to the ones of the same priority with an earlier deadline. */
+	if (cedrus_context_deadline_yield(ctx))
+		return false;
+
+	return !cedrus_context_engine_yield(ctx);
+}
+
+static void cedrus_context_job_times_event(struct cedrus_context *ctx)
+{
+	struct cedrus_job *job = &ctx->job;
+	struct vb2_v4l2_buffer *buffer_src;
+	struct cedrus_buffer *cedrus_buffer;
+	struct cedrus_job_times *times;
+	struct v4l2_event event = { 0 };
+
+	if (ctx->proc->role == CEDRUS_ROLE_DECODER)
+		buffer_src = job->buffer_coded;
+	else
+		buffer_src = job->buffer_picture;
+
+	cedrus_buffer = cedrus_buffer_from_vb2(&buffer_src->vb2_buf);
+
+	event.type = V4L2_EVENT_CEDRUS_JOB_TIMES;
+
+	times = (struct cedrus_job_times *)event.u.data;
+	times->timestamp = job->buffer_coded->vb2_buf.timestamp;
+	times->queue_ns = ktime_to_ns(cedrus_buffer->time_queue);
+	times->start_ns = ktime_to_ns(ktime_add(job->time_run,
+						job->time_setup));
+	times->done_ns = ktime_to_ns(job->time_done);
+
+	v4l2_event_queue_fh(&ctx->v4l2.fh, &event);
+}
+
+static bool cedrus_context_job_done(struct cedrus_context *ctx, int state,
+				    bool batch)
+{
+	struct cedrus_proc *proc = ctx->proc;
+	struct v4l2_m2m_dev *m2m_dev = proc->dev->v4l2.m2m_dev;
+	struct v4l2_m2m_ctx *m2m_ctx = ctx->v4l2.fh.m2m_ctx;
+	struct vb2_v4l2_buffer *buffer_picture = ctx->job.buffer_picture;
+	struct vb2_v4l2_buffer *buffer_dst;
+	struct device *dev = proc->dev->dev;
+	bool picture_held = ctx->job.picture_held;
+	bool powered = ctx->job.powered;
+	bool last = cedrus_context_job_last_check(ctx);
+	bool keep = ctx->job.coded_keep && !last;
+	bool next = false;
+
+	if (cedrus_debugfs_job_replay(ctx, state))
+		state = VB2_BUF_STATE_ERROR;
+
+	cedrus_engine_job_finish(ctx, state);
+	trace_cedrus_job_finish(ctx, state);
+	cedrus_debugfs_job_finish(ctx, state);
+
+	if (ctx->job.triggered) {
+		cedrus_proc_load_add(proc, ktime_to_us(ctx->job.time_hw));
+		cedrus_devfreq_busy_add(proc->dev,
+					ktime_to_us(ctx->job.time_hw));
+		cedrus_context_job_times_event(ctx);
+	}
+
+	cedrus_context_ctrl_request_put(ctx);
+	memset(&ctx->job, 0, sizeof(ctx->job));
+
+	if (powered)
+		WRITE_ONCE(proc->dev->engine_running, NULL);
+
+	/* The next frame is packed after this one in the same coded buffer. */
+	ctx->coded_kept = keep;
+
+	/* Stay powered in case more jobs follow shortly. */
+	if (powered) {
+		pm_runtime_mark_last_busy(dev);
+		pm_runtime_put_autosuspend(dev);
+	}
+
+	if (!picture_held && !keep) {
+		if (last)
+			cedrus_context_job_last_mark(ctx,
+						     v4l2_m2m_next_dst_buf(m2m_ctx));
+
+		if (batch)
+			next = v4l2_m2m_buf_done_and_job_finish_batch(m2m_dev,
+								      m2m_ctx,
+								      state);
+		else
+			v4l2_m2m_buf_done_and_job_finish(m2m_dev, m2m_ctx,
+							 state);
+
+		cedrus_context_schedule(ctx);
+		return next;
+	}
+
+	/* Held pictures are no longer part of the source queue. */
+	if (!picture_held)
+		v4l2_m2m_src_buf_remove(m2m_ctx);
+
+	buffer_dst = keep ? NULL : v4l2_m2m_dst_buf_remove(m2m_ctx);
+
+	v4l2_m2m_buf_done(buffer_picture, state);
+
+	if (buffer_dst) {
+		if (last)
+			cedrus_context_job_last_mark(ctx, buffer_dst);
+
+		v4l2_m2m_buf_done(buffer_dst, state);
+	}
+
+	if (batch)
+		next = v4l2_m2m_job_finish_batch(m2m_dev, m2m_ctx);
+	else
+		v4l2_m2m_job_finish(m2m_dev, m2m_ctx);
+
+	cedrus_context_schedule(ctx);
+
+	return next;
+}
+
+void cedrus_context_job_finish(struct cedrus_context *ctx, int state)
+{
+	cedrus_context_job_done(ctx, state, false);
+}
+
+bool cedrus_context_job_finish_batch(struct cedrus_context *ctx, int state)
+{
+	/* The context keeps the device when its next job is ready. */
+	return cedrus_context_job_done(ctx, state, true);
+}
+
+static int cedrus_context_job_run_header(struct cedrus_context *ctx)
+{
+	struct cedrus_device *cedrus_dev = ctx->proc->dev;
+	struct v4l2_m2m_ctx *m2m_ctx = ctx->v4l2.fh.m2m_ctx;
+	struct vb2_v4l2_buffer *buffer_dst;
+	int ret;
+
+	ctx->header_pending = false;
+
+	buffer_dst = v4l2_m2m_dst_buf_remove(m2m_ctx);
+	if (WARN_ON(!buffer_dst)) {
+		v4l2_m2m_job_finish(cedrus_dev->v4l2.m2m_dev, m2m_ctx);
+		return -EINVAL;
+	}
+
+	/*
+	 * Headers are produced without the hardware, after the frames packed
+	 * in the coded buffer so far if any.
+	 */
+	ret = cedrus_engine_job_header(ctx, buffer_dst);
+	ctx->coded_kept = false;
+
+	v4l2_m2m_buf_done(buffer_dst, ret ? VB2_BUF_STATE_ERROR :
+			  VB2_BUF_STATE_DONE);
+	v4l2_m2m_job_finish(cedrus_dev->v4l2.m2m_dev, m2m_ctx);
+	cedrus_context_schedule(ctx);
+
+	return ret;
+}
+
+static int cedrus_context_job_setup(struct cedrus_context *ctx)
+{
+	struct cedrus_device *cedrus_dev = ctx->proc->dev;
+	struct v4l2_device *v4l2_dev = &cedrus_dev->v4l2.v4l2_dev;
+	struct cedrus_job *job = &ctx->job;
+	int ret;
 
-	v4l2->ctrls = kzalloc(size, GFP_KERNEL);
-	if (!v4l2->ctrls)
-		return -ENOMEM;
+	/* Power the hardware, which is only needed from there on. */
 
-	ret = v4l2_ctrl_handler_init(handler, count);
+	ret = pm_runtime_resume_and_get(cedrus_dev->dev);
 	if (ret) {
-		v4l2_err(v4l2_dev, "failed to initialize control handler\n");
-		goto error_ctrls;
+		v4l2_err(v4l2_dev, "failed to resume device: %d\n", ret);
+		return ret;
 	}
 
-	for (i = 0; i < proc->engines_count; i++) {
-		const struct cedrus_engine *engine = proc->engines[i];
+	job->powered = true;
 
-		for (j = 0; j < engine->ctrl_configs_count; j++) {
-			const struct v4l2_ctrl_config *ctrl_config =
-				&engine->ctrl_configs[j];
-			struct v4l2_ctrl *ctrl;
-
-			ctrl = v4l2_ctrl_new_custom(handler, ctrl_config, ctx);
-			if (handler->error) {
-				v4l2_err(v4l2_dev,
-					 "failed to create %s control (%d)\n",
-					 v4l2_ctrl_get_name(ctrl_config->id),
-					 handler->error);
-				ret = handler->error;
-				goto error_handler;
-			}
-
-			v4l2->ctrls[index] = ctrl;
-			index++;
-		}
-	}
+	/*
+	 * Configure coded and picture formats. Static registers may be kept
+	 * when the same context was configured last, so any other context is
+	 * forgotten first in case configuration fails halfway.
+	 */
 
-	ctx->v4l2.fh.ctrl_handler = handler;
+	job->configured_kept = cedrus_context_format_configured_check(ctx);
+	if (!job->configured_kept)
+		cedrus_dev->ctx_configured = NULL;
 
-	ret = v4l2_ctrl_handler_setup(handler);
-	if (ret)
-		goto error_handler;
+	ret = cedrus_engine_format_configure(ctx);
+	if (ret) {
+		v4l2_err(v4l2_dev, "failed to configure coded format: %d\n",
+			 ret);
+		return ret;
+	}
 
-	return 0;
+	ret = cedrus_proc_format_picture_configure(ctx);
+	if (ret) {
+		v4l2_err(v4l2_dev, "failed to configure picture format: %d\n",
+			 ret);
+		return ret;
+	}
 
-error_handler:
-	v4l2_ctrl_handler_free(handler);
+	cedrus_dev->ctx_configured = ctx;
 
-error_ctrls:
-	kfree(v4l2->ctrls);
+	WRITE_ONCE(cedrus_dev->engine_running, ctx->engine);
+	ctx->engine_yielding = false;
 
-	return ret;
+	trace_cedrus_format_configure(ctx);
+
+	return 0;
 }
 
-static void cedrus_context_ctrls_cleanup(struct cedrus_context *ctx)
+/*
+ * Jobs of engines that can resume give way to pending jobs of contexts with
+ * a higher priority between their passes (e.g. slices), instead of keeping
+ * the engine for the whole picture. Their buffers stay queued and the job
+ * carries on from there when the context runs next.
+ */
+bool cedrus_context_job_suspend(struct cedrus_context *ctx)
 {
-	v4l2_ctrl_handler_free(&ctx->v4l2.ctrl_handler);
-	kfree(ctx->v4l2.ctrls);
-}
+	struct cedrus_device *cedrus_dev = ctx->proc->dev;
+	struct v4l2_m2m_ctx *m2m_ctx = ctx->v4l2.fh.m2m_ctx;
 
-/* Engine */
+	if (!cedrus_engine_job_resume_check(ctx) ||
+	    !cedrus_context_priority_yield(ctx))
+		return false;
 
-int cedrus_context_engine_update(struct cedrus_context *ctx)
-{
-	unsigned int pixelformat = ctx->v4l2.format_coded.fmt.pix.pixelformat;
-	struct vb2_queue *queue = v4l2_m2m_get_src_vq(ctx->v4l2.fh.m2m_ctx);
-	const struct cedrus_engine *engine;
+	WRITE_ONCE(cedrus_dev->engine_running, NULL);
 
-	engine = cedrus_proc_engine_find_format(ctx->proc, pixelformat);
-	if (WARN_ON(!engine))
-		return -ENODEV;
+	pm_runtime_mark_last_busy(cedrus_dev->dev);
+	pm_runtime_put_autosuspend(cedrus_dev->dev);
 
-	ctx->engine = engine;
+	ctx->job.powered = false;
+	ctx->job_suspended = true;
 
-	if (engine->slice_based)
-		queue->subsystem_flags |=
-			VB2_V4L2_FL_SUPPORTS_M2M_HOLD_CAPTURE_BUF;
-	else
-		queue->subsystem_flags &=
-			~VB2_V4L2_FL_SUPPORTS_M2M_HOLD_CAPTURE_BUF;
+	v4l2_m2m_job_finish(cedrus_dev->v4l2.m2m_dev, m2m_ctx);
 
-	return 0;
-}
+	/* The context is checked again once the other job finishes. */
+	schedule_work(&cedrus_dev->schedule_work);
 
-/* Selection */
+	return true;
+}
 
-int cedrus_context_selection_picture_reset(struct cedrus_context *ctx)
+static int cedrus_context_job_resume(struct cedrus_context *ctx)
 {
-	struct v4l2_pix_format *pix_format = &ctx->v4l2.format_picture.fmt.pix;
-	struct v4l2_rect *selection = &ctx->v4l2.selection_picture;
+	struct cedrus_device *cedrus_dev = ctx->proc->dev;
+	struct v4l2_device *v4l2_dev = &cedrus_dev->v4l2.v4l2_dev;
+	int ret;
 
-	selection->left = 0;
-	selection->top = 0;
-	selection->width = pix_format->width;
-	selection->height = pix_format->height;
+	ctx->job_suspended = false;
+
+	ret = cedrus_context_job_setup(ctx);
+	if (ret)
+		goto error;
+
+	ret = cedrus_engine_job_resume(ctx);
+	if (ret) {
+		v4l2_err(v4l2_dev, "failed to resume engine job: %d\n", ret);
+		goto error;
+	}
+
+	cedrus_proc_context_active_update(ctx->proc, ctx);
+
+	cedrus_context_job_watchdog_schedule(ctx);
+
+	cedrus_engine_job_trigger(ctx);
 
 	return 0;
-}
 
-/* Job */
+error:
+	cedrus_context_job_finish(ctx, VB2_BUF_STATE_ERROR);
 
-void cedrus_context_job_finish(struct cedrus_context *ctx, int state)
+	return ret;
+}
+
+/* Suspended jobs are dropped when their queues stop. */
+static void cedrus_context_job_suspended_cleanup(struct cedrus_context *ctx)
 {
-	struct cedrus_proc *proc = ctx->proc;
-	struct v4l2_m2m_dev *m2m_dev = proc->dev->v4l2.m2m_dev;
-	struct v4l2_m2m_ctx *m2m_ctx = ctx->v4l2.fh.m2m_ctx;
+	if (!ctx->job_suspended)
+		return;
 
-	cedrus_engine_job_finish(ctx, state);
-	memset(&ctx->job, 0, sizeof(ctx->job));
+	cedrus_engine_job_finish(ctx, VB2_BUF_STATE_ERROR);
 
-	v4l2_m2m_buf_done_and_job_finish(m2m_dev, m2m_ctx, state);
+	cedrus_context_ctrl_request_put(ctx);
+	memset(&ctx->job, 0, sizeof(ctx->job));
+	ctx->job_suspended = false;
 }
 
 int cedrus_context_job_run(struct cedrus_context *ctx)
@@ -238,13 +1534,23 @@ int cedrus_context_job_run(struct cedrus_context *ctx)
 	struct media_request *req = NULL;
 	int ret;
 
+	trace_cedrus_job_run(ctx);
+
+	/* Suspended jobs carry on with the same buffers. */
+	if (ctx->job_suspended)
+		return cedrus_context_job_resume(ctx);
+
 	/* Clear job data. */
 
 	memset(job, 0, sizeof(*job));
+	cedrus_debugfs_job_run(ctx);
 
 	if (ctx->engine_job)
 		memset(ctx->engine_job, 0, ctx->engine->job_size);
 
+	if (ctx->header_pending)
+		return cedrus_context_job_run_header(ctx);
+
 	/* Prepare job pointers. */
 
 	queue_src = v4l2_m2m_get_src_vq(m2m_ctx);
@@ -252,6 +1558,25 @@ int cedrus_context_job_run(struct cedrus_context *ctx)
 	buffer_src = v4l2_m2m_next_src_buf(m2m_ctx);
 	buffer_dst = v4l2_m2m_next_dst_buf(m2m_ctx);
 
+	/* Held pictures that are ready go first, in the order they came. */
+	if (ctx->pictures_held_ready) {
+		struct cedrus_buffer *cedrus_buffer =
+			list_first_entry(&ctx->pictures_held,
+					 struct cedrus_buffer, m2m_buffer.list);
+
+		list_del(&cedrus_buffer->m2m_buffer.list);
+		ctx->pictures_held_count--;
+		ctx->pictures_held_ready--;
+
+		buffer_src = &cedrus_buffer->m2m_buffer.vb;
+		job->picture_held = true;
+	}
+
+	if (WARN_ON(!buffer_src || !buffer_dst)) {
+		v4l2_m2m_job_finish(cedrus_dev->v4l2.m2m_dev, m2m_ctx);
+		return -EINVAL;
+	}
+
 	if (proc->role == CEDRUS_ROLE_DECODER) {
 		job->queue_coded = queue_src;
 		job->queue_picture = queue_dst;
@@ -264,16 +1589,27 @@ int cedrus_context_job_run(struct cedrus_context *ctx)
 		job->buffer_picture = buffer_src;
 	}
 
-	/* Setup request controls. */
+	job->deadline = cedrus_context_buffer_deadline(ctx, buffer_src);
 
-	req = ctx->job.buffer_coded->vb2_buf.req_obj.req;
-	if (req)
-		v4l2_ctrl_request_setup(req, ctrl_handler);
+	/*
+	 * Setup request controls, which come with the source buffer: coded
+	 * data for decoders and the picture for encoders, so that per-frame
+	 * encoder parameters apply to that very picture. Held pictures apply
+	 * their request again when they are eventually processed.
+	 */
+
+	req = buffer_src->vb2_buf.req_obj.req;
+	if (req && !ctx->ctrls_pinned)
+		cedrus_context_ctrl_request_setup(ctx, req);
 
 	/* Copy buffer metadata (timestamp). */
 
 	v4l2_m2m_buf_copy_metadata(buffer_src, buffer_dst, true);
 
+	if (proc->role == CEDRUS_ROLE_DECODER)
+		cedrus_context_buffer_index(ctx,
+					    cedrus_job_buffer_picture(ctx));
+
 	/* Prepare engine job. */
 
 	ret = cedrus_engine_job_prepare(ctx);
@@ -282,21 +1618,28 @@ int cedrus_context_job_run(struct cedrus_context *ctx)
 		goto error_ctrl;
 	}
 
-	/* Configure coded and picture formats. */
+	trace_cedrus_job_prepare(ctx);
 
-	ret = cedrus_engine_format_configure(ctx);
-	if (ret) {
-		v4l2_err(v4l2_dev, "failed to configure coded format: %d\n",
-			 ret);
-		goto error_ctrl;
+	/* Set the picture aside when the engine wants it for later. */
+	if (job->picture_hold) {
+		struct cedrus_buffer *cedrus_buffer =
+			cedrus_job_buffer_picture(ctx);
+
+		/* Its request is only completed once it is processed. */
+		v4l2_m2m_src_buf_remove_by_buf(m2m_ctx, job->buffer_picture);
+		list_add_tail(&cedrus_buffer->m2m_buffer.list,
+			      &ctx->pictures_held);
+		ctx->pictures_held_count++;
+
+		memset(job, 0, sizeof(*job));
+		v4l2_m2m_job_finish(cedrus_dev->v4l2.m2m_dev, m2m_ctx);
+
+		return 0;
 	}
 
-	ret = cedrus_proc_format_picture_configure(ctx);
-	if (ret) {
-		v4l2_err(v4l2_dev, "failed to configure picture format: %d\n",
-			 ret);
+	ret = cedrus_context_job_setup(ctx);
+	if (ret)
 		goto error_ctrl;
-	}
 
 	/* Configure engine job. */
 
@@ -306,6 +1649,8 @@ int cedrus_context_job_run(struct cedrus_context *ctx)
 		goto error_ctrl;
 	}
 
+	trace_cedrus_job_configure(ctx);
+
 	/* Complete request controls. */
 
 	if (req)
@@ -317,8 +1662,7 @@ int cedrus_context_job_run(struct cedrus_context *ctx)
 
 	/* Schedule the global watchdog. */
 
-	schedule_delayed_work(&cedrus_dev->watchdog_work,
-			      msecs_to_jiffies(2000));
+	cedrus_context_job_watchdog_schedule(ctx);
 
 	/* Trigger engine job. */
 
@@ -335,6 +1679,65 @@ int cedrus_context_job_run(struct cedrus_context *ctx)
 	return ret;
 }
 
+/* Drain */
+
+static void cedrus_context_last_buffer_done(struct cedrus_context *ctx,
+					    struct vb2_v4l2_buffer *buffer_dst)
+{
+	/* Frames packed so far are part of the last buffer. */
+	if (!ctx->coded_kept)
+		vb2_set_plane_payload(&buffer_dst->vb2_buf, 0, 0);
+
+	ctx->coded_kept = false;
+
+	v4l2_m2m_last_buffer_done(ctx->v4l2.fh.m2m_ctx, buffer_dst);
+	v4l2_event_queue_fh(&ctx->v4l2.fh, &cedrus_context_eos_event);
+}
+
+int cedrus_context_drain(struct cedrus_context *ctx)
+{
+	struct v4l2_m2m_ctx *m2m_ctx = ctx->v4l2.fh.m2m_ctx;
+	struct vb2_v4l2_buffer *buffer_dst;
+
+	if (m2m_ctx->is_draining)
+		return -EBUSY;
+
+	if (m2m_ctx->has_stopped)
+		return 0;
+
+	/*
+	 * Held pictures are only encoded after a later picture, so give the
+	 * last one back to the source queue to end their group with it.
+	 */
+	if (ctx->pictures_held_count > ctx->pictures_held_ready &&
+	    !v4l2_m2m_num_src_bufs_ready(m2m_ctx)) {
+		struct cedrus_buffer *cedrus_buffer =
+			list_last_entry(&ctx->pictures_held,
+					struct cedrus_buffer, m2m_buffer.list);
+
+		list_del(&cedrus_buffer->m2m_buffer.list);
+		ctx->pictures_held_count--;
+
+		v4l2_m2m_buf_queue(m2m_ctx, &cedrus_buffer->m2m_buffer.vb);
+	}
+
+	m2m_ctx->last_src_buf = v4l2_m2m_last_src_buf(m2m_ctx);
+	m2m_ctx->is_draining = true;
+
+	/* The last job flags its own coded buffer (see job_finish). */
+	if (m2m_ctx->last_src_buf || ctx->pictures_held_count ||
+	    ctx->job.buffer_coded)
+		return 0;
+
+	buffer_dst = v4l2_m2m_dst_buf_remove(m2m_ctx);
+	if (buffer_dst)
+		cedrus_context_last_buffer_done(ctx, buffer_dst);
+	else
+		m2m_ctx->next_buf_last = true;
+
+	return 0;
+}
+
 /* Queue */
 
 bool cedrus_context_queue_busy_check(struct cedrus_context *ctx,
@@ -361,6 +1764,25 @@ bool cedrus_context_queue_streaming_check(struct cedrus_context *ctx,
 	return vb2_is_streaming(queue);
 }
 
+bool cedrus_context_queue_fit_check(struct cedrus_context *ctx,
+				    unsigned int buffer_type,
+				    unsigned int size)
+{
+	struct vb2_queue *queue;
+	unsigned int i;
+
+	queue = v4l2_m2m_get_vq(ctx->v4l2.fh.m2m_ctx, buffer_type);
+	if (WARN_ON(!queue))
+		return false;
+
+	/* Imported buffers are checked again when queued. */
+	for (i = 0; i < queue->num_buffers; i++)
+		if (vb2_plane_size(queue->bufs[i], 0) < size)
+			return false;
+
+	return true;
+}
+
 static int cedrus_context_queue_setup(struct vb2_queue *queue,
 				      unsigned int *buffers_count,
 				      unsigned int *planes_count,
@@ -427,6 +1849,11 @@ static int cedrus_context_buffer_init(struct vb2_buffer *vb2_buffer)
 		cedrus_proc_format_type(ctx->proc, vb2_buffer->type);
 	int ret;
 
+	/*
+	 * This is called each time a new DMABUF is imported, so engines should
+	 * keep their own buffers (e.g. reconstruction) in the context instead
+	 * to keep imports free of allocations.
+	 */
 	if (!engine->buffer_size)
 		return 0;
 
@@ -459,6 +1886,8 @@ static void cedrus_context_buffer_cleanup(struct vb2_buffer *vb2_buffer)
 	unsigned int format_type =
 		cedrus_proc_format_type(ctx->proc, vb2_buffer->type);
 
+	cedrus_context_buffer_unindex(ctx, cedrus_buffer);
+
 	if (format_type == CEDRUS_FORMAT_TYPE_PICTURE &&
 	    cedrus_buffer->engine_buffer) {
 		cedrus_engine_buffer_cleanup(ctx, cedrus_buffer);
@@ -493,19 +1922,63 @@ static int cedrus_context_buffer_prepare(struct vb2_buffer *vb2_buffer)
 	return 0;
 }
 
+static bool cedrus_context_buffer_decimated_check(struct cedrus_context *ctx,
+						  struct vb2_buffer *vb2_buffer)
+{
+	unsigned int decimation = READ_ONCE(ctx->decimation);
+	unsigned int index = ctx->decimation_index;
+
+	if (ctx->proc->role != CEDRUS_ROLE_ENCODER ||
+	    !V4L2_TYPE_IS_OUTPUT(vb2_buffer->type) || decimation <= 1)
+		return false;
+
+	/* Request controls only apply with the picture of their request. */
+	if (vb2_buffer->req_obj.req)
+		return false;
+
+	ctx->decimation_index = (index + 1) % decimation;
+
+	return index > 0;
+}
+
 static void cedrus_context_buffer_queue(struct vb2_buffer *vb2_buffer)
 {
 	struct cedrus_context *ctx = vb2_get_drv_priv(vb2_buffer->vb2_queue);
 	struct vb2_v4l2_buffer *v4l2_buffer = to_vb2_v4l2_buffer(vb2_buffer);
+	struct v4l2_m2m_ctx *m2m_ctx = ctx->v4l2.fh.m2m_ctx;
+
+	if (V4L2_TYPE_IS_OUTPUT(vb2_buffer->type))
+		cedrus_buffer_from_vb2(vb2_buffer)->time_queue = ktime_get();
 
-	v4l2_m2m_buf_queue(ctx->v4l2.fh.m2m_ctx, v4l2_buffer);
+	/* Pictures left out by decimation never reach the engine. */
+	if (cedrus_context_buffer_decimated_check(ctx, vb2_buffer)) {
+		vb2_buffer_done(vb2_buffer, VB2_BUF_STATE_DONE);
+		return;
+	}
+
+	/* Complete draining with the first coded buffer queued after it. */
+	if (V4L2_TYPE_IS_CAPTURE(vb2_buffer->type) &&
+	    vb2_is_streaming(vb2_buffer->vb2_queue) &&
+	    v4l2_m2m_dst_buf_is_last(m2m_ctx)) {
+		cedrus_context_last_buffer_done(ctx, v4l2_buffer);
+		return;
+	}
+
+	v4l2_m2m_buf_queue(m2m_ctx, v4l2_buffer);
 }
 
 static int cedrus_context_buffer_validate(struct vb2_buffer *vb2_buffer)
 {
+	struct cedrus_context *ctx = vb2_get_drv_priv(vb2_buffer->vb2_queue);
 	struct vb2_v4l2_buffer *v4l2_buffer = to_vb2_v4l2_buffer(vb2_buffer);
+	struct v4l2_format *format = &ctx->v4l2.format_picture;
+	u32 field = format->fmt.pix.field;
 
-	v4l2_buffer->field = V4L2_FIELD_NONE;
+	/* Interlaced pictures may give their field order and layout. */
+	if (vb2_buffer->type != format->type || field == V4L2_FIELD_NONE)
+		v4l2_buffer->field = V4L2_FIELD_NONE;
+	else if (!V4L2_FIELD_HAS_BOTH(v4l2_buffer->field))
+		v4l2_buffer->field = field;
 
 	return 0;
 }
@@ -518,32 +1991,34 @@ static void cedrus_context_buffer_complete(struct vb2_buffer *vb2_buffer)
 				   &ctx->v4l2.ctrl_handler);
 }
 
-static int cedrus_context_start_streaming(struct vb2_queue *queue,
-					  unsigned int count)
+static int cedrus_context_engine_start(struct cedrus_context *ctx)
 {
-	struct cedrus_context *ctx = vb2_get_drv_priv(queue);
 	const struct cedrus_engine *engine = ctx->engine;
-	struct device *dev = ctx->proc->dev->dev;
-	unsigned int format_type =
-		cedrus_proc_format_type(ctx->proc, queue->type);
 	int ret;
 
-	if (WARN_ON(!engine))
-		return -ENODEV;
+	/* Fail fast instead of waiting on the allocator past the limit. */
+	if (!cedrus_pool_limit_check(ctx->proc->dev))
+		return -ENOMEM;
 
-	/* Only start the engine from the coded queue. */
-	if (format_type != CEDRUS_FORMAT_TYPE_CODED)
-		return 0;
+	cedrus_context_format_invalidate(ctx);
 
-	ret = pm_runtime_resume_and_get(dev);
-	if (ret)
-		goto error_queue;
+	/* Restart with the context kept from the previous session if possible. */
+	if (ctx->engine_ctx || ctx->engine_job) {
+		ret = cedrus_engine_restart(ctx);
+		if (!ret)
+			return 0;
+
+		cedrus_context_engine_release(ctx);
+	}
+
+	/* Kept contexts restart with the slot they hold, if any. */
+	cedrus_pool_reserve(ctx);
 
 	if (engine->ctx_size > 0) {
 		ctx->engine_ctx = kzalloc(engine->ctx_size, GFP_KERNEL);
 		if (!ctx->engine_ctx) {
 			ret = -ENOMEM;
-			goto error_pm;
+			goto error_reserve;
 		}
 	}
 
@@ -573,45 +2048,92 @@ static int cedrus_context_start_streaming(struct vb2_queue *queue,
 		ctx->engine_ctx = NULL;
 	}
 
-error_pm:
-	pm_runtime_put(dev);
-
-error_queue:
-	cedrus_context_queue_cleanup(queue, false);
+error_reserve:
+	cedrus_pool_unreserve(ctx);
 
 	return ret;
 }
 
+static int cedrus_context_start_streaming(struct vb2_queue *queue,
+					  unsigned int count)
+{
+	struct cedrus_context *ctx = vb2_get_drv_priv(queue);
+	const struct cedrus_engine *engine = ctx->engine;
+	unsigned int format_type =
+		cedrus_proc_format_type(ctx->proc, queue->type);
+	int ret;
+
+	if (WARN_ON(!engine))
+		return -ENODEV;
+
+	v4l2_m2m_update_start_streaming_state(ctx->v4l2.fh.m2m_ctx, queue);
+
+	/*
+	 * Only start the engine from the coded queue, unless the coded format
+	 * changed while the coded queue kept streaming (encoder resolution
+	 * change, after draining and stopping the picture queue). The engine
+	 * is then restarted for the new format, which starts a new sequence.
+	 */
+	if (format_type != CEDRUS_FORMAT_TYPE_CODED) {
+		if (!ctx->resize_pending)
+			return 0;
+
+		cedrus_engine_stop(ctx);
+	}
+
+	ret = cedrus_context_engine_start(ctx);
+	if (ret) {
+		cedrus_context_queue_cleanup(queue, false);
+		return ret;
+	}
+
+	ctx->resize_pending = false;
+
+	/* Controls were applied by the engine and stay as they are now. */
+	if (ctx->ctrls_pin)
+		cedrus_context_ctrls_pin_update(ctx, true);
+
+	return 0;
+}
+
 static void cedrus_context_stop_streaming(struct vb2_queue *queue)
 {
 	struct cedrus_context *ctx = vb2_get_drv_priv(queue);
 	const struct cedrus_engine *engine = ctx->engine;
-	struct device *dev = ctx->proc->dev->dev;
 	unsigned int format_type =
 		cedrus_proc_format_type(ctx->proc, queue->type);
 
 	if (WARN_ON(!engine))
 		return;
 
+	/* Return the pictures held by the engine when either queue stops. */
+	cedrus_context_pictures_held_cleanup(ctx);
+	cedrus_context_job_suspended_cleanup(ctx);
+	cedrus_context_job_fence_cleanup(ctx);
+
+	/* Encode the first picture queued when streaming again. */
+	if (format_type == CEDRUS_FORMAT_TYPE_PICTURE)
+		ctx->decimation_index = 0;
+
+	v4l2_m2m_update_stop_streaming_state(ctx->v4l2.fh.m2m_ctx, queue);
+
+	/* Jobs of this context no longer get ahead of other contexts. */
+	cedrus_context_schedule(ctx);
+
 	/* Only stop the engine from the coded queue. */
 	if (format_type != CEDRUS_FORMAT_TYPE_CODED)
 		return;
 
-	cedrus_engine_cleanup(ctx);
+	ctx->header_pending = false;
+	ctx->coded_kept = false;
 
-	if (ctx->engine_job) {
-		kfree(ctx->engine_job);
-		ctx->engine_job = NULL;
-	}
+	cedrus_context_ctrls_pin_update(ctx, false);
 
-	if (ctx->engine_ctx) {
-		kfree(ctx->engine_ctx);
-		ctx->engine_ctx = NULL;
-	}
+	/* Keep the engine context (and its buffers) for a quick restart. */
+	if (cedrus_engine_stop(ctx))
+		cedrus_context_engine_release(ctx);
 
 	cedrus_context_queue_cleanup(queue, true);
-
-	pm_runtime_put(dev);
 }
 
 static const struct vb2_ops cedrus_context_queue_ops = {
@@ -644,14 +2166,14 @@ static int cedrus_context_queue_init(void *private, struct vb2_queue *src_queue,
 	src_queue->mem_ops = &vb2_dma_contig_memops;
 	src_queue->timestamp_flags = V4L2_BUF_FLAG_TIMESTAMP_COPY;
 	src_queue->supports_requests = true;
+	src_queue->allow_cache_hints = true;
 	src_queue->lock = &proc->v4l2.lock;
 	src_queue->dev = proc->dev->dev;
 	src_queue->drv_priv = ctx;
 
 	/*
-	 * FIXME: The current encoder implementation doesn't particularly rely
-	 * on requests, but it might become necessary for some codecs so this
-	 * should be set dynamically later on.
+	 * Encoders only use requests to apply parameters to specific pictures,
+	 * while decoders need them for the per-frame controls.
 	 */
 	if (proc->role == CEDRUS_ROLE_DECODER)
 		src_queue->requires_requests = true;
@@ -668,10 +2190,18 @@ static int cedrus_context_queue_init(void *private, struct vb2_queue *src_queue,
 	dst_queue->ops = &cedrus_context_queue_ops;
 	dst_queue->mem_ops = &vb2_dma_contig_memops;
 	dst_queue->timestamp_flags = V4L2_BUF_FLAG_TIMESTAMP_COPY;
+	dst_queue->allow_cache_hints = true;
 	dst_queue->lock = &proc->v4l2.lock;
 	dst_queue->dev = proc->dev->dev;
 	dst_queue->drv_priv = ctx;
 
+	/*
+	 * Encoder coded buffers are also written by the CPU (with headers and
+	 * side-outputs), so non-coherent ones must be cleaned to memory too.
+	 */
+	if (proc->role == CEDRUS_ROLE_ENCODER)
+		dst_queue->bidirectional = true;
+
 	return vb2_queue_init(dst_queue);
 }
 
@@ -701,6 +2231,18 @@ int cedrus_context_setup(struct cedrus_proc *proc, struct cedrus_context *ctx)
 		return PTR_ERR(fh->m2m_ctx);
 	}
 
+	/*
+	 * Encoder engines may hold pictures for reordering, which are then
+	 * processed without a new source buffer (see job_ready).
+	 */
+	INIT_LIST_HEAD(&ctx->pictures_held);
+
+	hash_init(ctx->buffers_timestamp);
+	spin_lock_init(&ctx->buffers_timestamp_lock);
+
+	if (proc->role == CEDRUS_ROLE_ENCODER)
+		v4l2_m2m_set_src_buffered(fh->m2m_ctx, true);
+
 	/* Ctrls */
 
 	ret = cedrus_context_ctrls_setup(ctx);
@@ -713,6 +2255,18 @@ int cedrus_context_setup(struct cedrus_proc *proc, struct cedrus_context *ctx)
 	if (ret)
 		goto error_ctrls;
 
+	/* Schedule */
+
+	mutex_lock(&proc->dev->contexts_mutex);
+	spin_lock_irq(&proc->dev->contexts_lock);
+	list_add_tail(&ctx->list, &proc->dev->contexts);
+	spin_unlock_irq(&proc->dev->contexts_lock);
+	mutex_unlock(&proc->dev->contexts_mutex);
+
+	/* Debugfs */
+
+	cedrus_debugfs_context_setup(ctx);
+
 	/* V4L2 File Handler */
 
 	v4l2_fh_add(fh);
@@ -730,12 +2284,24 @@ int cedrus_context_setup(struct cedrus_proc *proc, struct cedrus_context *ctx)
 
 void cedrus_context_cleanup(struct cedrus_context *ctx)
 {
+	struct cedrus_device *dev = ctx->proc->dev;
 	struct v4l2_fh *fh = &ctx->v4l2.fh;
 
+	mutex_lock(&dev->contexts_mutex);
+	spin_lock_irq(&dev->contexts_lock);
+	list_del(&ctx->list);
+	spin_unlock_irq(&dev->contexts_lock);
+	mutex_unlock(&dev->contexts_mutex);
+
+	cedrus_context_schedule(ctx);
+
 	cedrus_proc_context_active_clear(ctx->proc, ctx);
 
 	v4l2_fh_del(fh);
-	cedrus_context_ctrls_cleanup(ctx);
 	v4l2_m2m_ctx_release(fh->m2m_ctx);
+	cedrus_context_engine_release(ctx);
+	cedrus_debugfs_context_cleanup(ctx);
+	cedrus_context_format_invalidate(ctx);
+	cedrus_context_ctrls_cleanup(ctx);
 	v4l2_fh_exit(fh);
 }
@@ -9,6 +9,8 @@
 #ifndef _CEDRUS_CONTEXT_H_
 #define _CEDRUS_CONTEXT_H_
 
+#include <linux/dma-fence.h>
+#include <linux/hashtable.h>
 #include <media/v4l2-ctrls.h>
 #include <media/v4l2-fh.h>
 #include <media/v4l2-mem2mem.h>
@@ -16,8 +18,23 @@
 #include <media/videobuf2-v4l2.h>
 
 #include "cedrus.h"
+#include "cedrus_debugfs.h"
+
+#define CEDRUS_CONTEXT_PRIORITY_MAX	7
+
+#define CEDRUS_CONTEXT_ENGINE_YIELD_MS	20
+
+#define CEDRUS_CONTEXT_DEADLINE_MAX_MS	10000
+
+#define CEDRUS_CONTEXT_POLL_MAX_US	1000
+
+#define CEDRUS_CONTEXT_CTRLS_SKIP_MAX	16
+
+#define CEDRUS_CONTEXT_TIMEOUT_MB_CYCLES	20000
+#define CEDRUS_CONTEXT_TIMEOUT_MIN_MS		100
 
 struct cedrus_engine;
+struct cedrus_pool_slot;
 struct cedrus_proc;
 
 struct cedrus_job {
@@ -26,11 +43,44 @@ struct cedrus_job {
 
 	struct vb2_v4l2_buffer	*buffer_coded;
 	struct vb2_v4l2_buffer	*buffer_picture;
+	/* Encoders: keep the coded buffer queued for the next frame. */
+	bool			coded_keep;
+
+	bool			picture_hold;
+	bool			picture_held;
+	/* Encoders: field of the picture to fetch, or the whole frame. */
+	u32			picture_field;
+	/* Configuration of the previous job of the context is still there. */
+	bool			configured_kept;
+
+	/* Completion deadline, or zero for none. */
+	ktime_t			deadline;
+	/* Watchdog expiry for the whole job, or zero for one per pass. */
+	unsigned long		expires;
+
+	/* Decoders: request controls, some of which are read in place. */
+	struct v4l2_ctrl_handler	*ctrl_request;
+
+	ktime_t			time_run;
+	ktime_t			time_trigger;
+	ktime_t			time_setup;
+	ktime_t			time_hw;
+	ktime_t			time_done;
+	bool			triggered;
+	bool			timeout;
+	bool			powered;
 };
 
 struct cedrus_buffer {
 	struct v4l2_m2m_buffer	m2m_buffer;
 	void			*engine_buffer;
+	ktime_t			time_queue;
+
+	/* Decoders: picture buffers indexed by timestamp for references. */
+	struct hlist_node	timestamp_node;
+
+	/* Decoders: coded data is still being appended to the buffer. */
+	bool			coded_open;
 };
 
 struct cedrus_context_v4l2 {
@@ -46,18 +96,79 @@ struct cedrus_context_v4l2 {
 	struct v4l2_fract		timeperframe_picture;
 
 	struct v4l2_rect		selection_picture;
+
+	unsigned int			rotation_picture;
+	bool				hflip_picture;
+	/* Encoders: chroma planes offset, see cedrus_picture_chroma_offset. */
+	unsigned int			chroma_offset_picture;
+	unsigned int			scale_down_picture;
+	bool				qp_map_picture;
 };
 
 struct cedrus_context {
 	struct cedrus_proc		*proc;
+	/* Unique among the contexts of the device, as named in debugfs. */
+	unsigned int			id;
 	const struct cedrus_engine	*engine;
 	void				*engine_ctx;
 	void				*engine_job;
 
+	struct list_head		list;
+	unsigned int			priority;
+	unsigned int			deadline_ms;
+	/* Jobs expected to complete within that time are polled for. */
+	unsigned int			poll_us;
+
+	/* Giving way to jobs of the running engine since that time. */
+	unsigned long			engine_yield_time;
+	bool				engine_yielding;
+
 	struct cedrus_context_v4l2	v4l2;
 	struct cedrus_job		job;
 
+	struct list_head		pictures_held;
+	unsigned int			pictures_held_count;
+	unsigned int			pictures_held_ready;
+
+	bool				header_pending;
+
+	/* Decoders: picture buffers by timestamp, see cedrus_buffer. */
+	DECLARE_HASHTABLE(buffers_timestamp, 5);
+	spinlock_t			buffers_timestamp_lock;
+
+	/* Encoders: source pictures kept queued after the next one. */
+	unsigned int			lookahead;
+
+	/* Encoders: one picture out of decimation queued ones is encoded. */
+	unsigned int			decimation;
+	unsigned int			decimation_index;
+
+	/* Encoders: the next coded buffer already holds previous frames. */
+	bool				coded_kept;
+
+	/* Encoders: the coded format changed while the coded queue streams. */
+	bool				resize_pending;
+
+	/* The job gave way to another context and is resumed next. */
+	bool				job_suspended;
+
+	/* Fence of the next job buffers, waited for with a callback. */
+	struct dma_fence		*fence_wait;
+	struct dma_fence_cb		fence_cb;
+
+	/* Controls are busy and left alone by jobs while pinned. */
+	bool				ctrls_pin;
+	bool				ctrls_pinned;
+
 	unsigned int			bit_depth_coded;
+
+	/* Auxiliary buffers allocated from the pool. */
+	atomic_long_t			memory;
+	/* Slot of the reserved region taken while streaming, if any. */
+	struct cedrus_pool_slot		*pool_slot;
+
+	struct cedrus_debugfs_stats	stats;
+	struct dentry			*debugfs;
 };
 
 static inline void cedrus_buffer_picture_dma(struct cedrus_context *ctx,
@@ -68,6 +179,11 @@ static inline void cedrus_buffer_coded_dma(struct cedrus_context *ctx,
 					   struct cedrus_buffer *cedrus_buffer,
 					   dma_addr_t *addr, unsigned int *size);
 
+/* Buffer */
+
+struct cedrus_buffer *cedrus_context_buffer_find(struct cedrus_context *ctx,
+						 u64 timestamp);
+
 /* Job */
 
 static inline struct cedrus_buffer *
@@ -109,20 +225,15 @@ static inline void cedrus_job_buffer_picture_ref_dma(struct cedrus_context *ctx,
 						     dma_addr_t *luma_addr,
 						     dma_addr_t *chroma_addr)
 {
-	struct vb2_queue *queue = ctx->job.queue_picture;
-	struct vb2_buffer *vb2_buffer;
 	struct cedrus_buffer *cedrus_buffer;
 
-	vb2_buffer = vb2_find_buffer(queue, timestamp);
-	if (!vb2_buffer) {
+	cedrus_buffer = cedrus_context_buffer_find(ctx, timestamp);
+	if (!cedrus_buffer) {
 		*luma_addr = 0;
 		*chroma_addr = 0;
 		return;
 	}
 
-	cedrus_buffer = container_of(vb2_buffer, struct cedrus_buffer,
-				     m2m_buffer.vb.vb2_buf);
-
 	cedrus_buffer_picture_dma(ctx, cedrus_buffer, luma_addr, chroma_addr);
 }
 
@@ -147,6 +258,13 @@ int cedrus_context_ctrl_array_count(struct cedrus_context *ctx, u32 id);
 /* Engine */
 
 int cedrus_context_engine_update(struct cedrus_context *ctx);
+unsigned long cedrus_context_engine_kept_memory(struct cedrus_device *dev);
+void cedrus_context_engine_reclaim(struct cedrus_device *dev);
+
+/* Format */
+
+bool cedrus_context_format_configured_check(struct cedrus_context *ctx);
+void cedrus_context_format_invalidate(struct cedrus_context *ctx);
 
 /* Selection */
 
@@ -154,15 +272,39 @@ int cedrus_context_selection_picture_reset(struct cedrus_context *ctx);
 
 /* Job */
 
+void cedrus_context_job_picture_hold(struct cedrus_context *ctx);
+void cedrus_context_pictures_held_ready(struct cedrus_context *ctx);
+void cedrus_context_job_header_request(struct cedrus_context *ctx);
+bool cedrus_context_job_picture_last_check(struct cedrus_context *ctx);
+unsigned long cedrus_context_job_timeout(struct cedrus_context *ctx);
+void cedrus_context_job_watchdog_schedule(struct cedrus_context *ctx);
+void cedrus_context_job_park(struct cedrus_context *ctx);
+int cedrus_context_job_unpark(struct cedrus_context *ctx);
+int cedrus_context_job_reset(struct cedrus_context *ctx);
+unsigned int cedrus_context_job_poll_timeout(struct cedrus_context *ctx);
+bool cedrus_context_job_ready(struct cedrus_context *ctx);
 void cedrus_context_job_finish(struct cedrus_context *ctx, int state);
+bool cedrus_context_job_finish_batch(struct cedrus_context *ctx, int state);
+bool cedrus_context_job_suspend(struct cedrus_context *ctx);
 int cedrus_context_job_run(struct cedrus_context *ctx);
 
+/* Drain */
+
+int cedrus_context_drain(struct cedrus_context *ctx);
+
+/* Schedule */
+
+void cedrus_context_schedule_work(struct work_struct *work);
+
 /* Queue */
 
 bool cedrus_context_queue_busy_check(struct cedrus_context *ctx,
 				     unsigned int buffer_type);
 bool cedrus_context_queue_streaming_check(struct cedrus_context *ctx,
 					  unsigned int buffer_type);
+bool cedrus_context_queue_fit_check(struct cedrus_context *ctx,
+				    unsigned int buffer_type,
+				    unsigned int size);
 
 /* Context */
 
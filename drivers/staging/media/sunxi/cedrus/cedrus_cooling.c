@@ -0,0 +1,163 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Cedrus Video Engine Driver
+ *
+ * Copyright 2023 Bootlin
+ * Author: Paul Kocialkowski <paul.kocialkowski@bootlin.com>
+ */
+
+#include <linux/clk.h>
+#include <linux/device.h>
+#include <linux/property.h>
+
+#include "cedrus.h"
+#include "cedrus_cooling.h"
+
+/*
+ * The device is registered as a cooling device when the device-tree node
+ * has the #cooling-cells property. Effort states are sampled by engines
+ * when configuring jobs while clock states cap the module clock rate,
+ * through devfreq when it scales the clock.
+ */
+
+/* Clock */
+
+static unsigned long cedrus_cooling_clock_rate(struct cedrus_device *dev,
+					       unsigned long state)
+{
+	unsigned long rate = dev->clock_mod_rate_nominal;
+
+	switch (state) {
+	case CEDRUS_COOLING_STATE_CLOCK_HIGH:
+		return rate / 4 * 3;
+	case CEDRUS_COOLING_STATE_CLOCK_LOW:
+		return rate / 2;
+	default:
+		return rate;
+	}
+}
+
+static int cedrus_cooling_clock_apply(struct cedrus_device *dev,
+				      unsigned long state)
+{
+	struct cedrus_cooling *cooling = &dev->cooling;
+	unsigned long rate = cedrus_cooling_clock_rate(dev, state);
+	int ret;
+
+	if (dev->devfreq.devfreq) {
+		if (state < CEDRUS_COOLING_STATE_CLOCK_HIGH)
+			return dev_pm_qos_update_request(&cooling->qos_request,
+					PM_QOS_MAX_FREQUENCY_DEFAULT_VALUE);
+
+		/* Requests are given in kHz. */
+		return dev_pm_qos_update_request(&cooling->qos_request,
+						 rate / 1000);
+	}
+
+	ret = clk_set_rate(dev->clock_mod, rate);
+	if (ret)
+		return ret;
+
+	/* Timeouts and cycle budgets are derived from the rate. */
+	WRITE_ONCE(dev->clock_mod_rate, clk_get_rate(dev->clock_mod));
+
+	return 0;
+}
+
+/* Cooling Device */
+
+static int cedrus_cooling_get_max_state(struct thermal_cooling_device *device,
+					unsigned long *state)
+{
+	*state = CEDRUS_COOLING_STATE_MAX;
+
+	return 0;
+}
+
+static int cedrus_cooling_get_cur_state(struct thermal_cooling_device *device,
+					unsigned long *state)
+{
+	struct cedrus_device *dev = device->devdata;
+
+	*state = cedrus_cooling_state(&dev->cooling);
+
+	return 0;
+}
+
+static int cedrus_cooling_set_cur_state(struct thermal_cooling_device *device,
+					unsigned long state)
+{
+	struct cedrus_device *dev = device->devdata;
+	struct cedrus_cooling *cooling = &dev->cooling;
+	unsigned long state_current = cedrus_cooling_state(cooling);
+	int ret;
+
+	if (state > CEDRUS_COOLING_STATE_MAX)
+		return -EINVAL;
+
+	if (state == state_current)
+		return 0;
+
+	if (state >= CEDRUS_COOLING_STATE_CLOCK_HIGH ||
+	    state_current >= CEDRUS_COOLING_STATE_CLOCK_HIGH) {
+		ret = cedrus_cooling_clock_apply(dev, state);
+		if (ret < 0)
+			return ret;
+	}
+
+	WRITE_ONCE(cooling->state, state);
+
+	return 0;
+}
+
+static const struct thermal_cooling_device_ops cedrus_cooling_ops = {
+	.get_max_state	= cedrus_cooling_get_max_state,
+	.get_cur_state	= cedrus_cooling_get_cur_state,
+	.set_cur_state	= cedrus_cooling_set_cur_state,
+};
+
+static void cedrus_cooling_qos_remove(void *data)
+{
+	struct cedrus_cooling *cooling = data;
+
+	dev_pm_qos_remove_request(&cooling->qos_request);
+}
+
+int cedrus_cooling_setup(struct cedrus_device *dev)
+{
+	struct cedrus_cooling *cooling = &dev->cooling;
+	struct device *device = dev->dev;
+	struct thermal_cooling_device *cooling_device;
+	int ret;
+
+	if (!IS_ENABLED(CONFIG_THERMAL) ||
+	    !device_property_present(device, "#cooling-cells"))
+		return 0;
+
+	/* The devfreq device must be added first to honour the request. */
+	if (dev->devfreq.devfreq) {
+		ret = dev_pm_qos_add_request(device, &cooling->qos_request,
+					     DEV_PM_QOS_MAX_FREQUENCY,
+					     PM_QOS_MAX_FREQUENCY_DEFAULT_VALUE);
+		if (ret < 0)
+			return ret;
+
+		ret = devm_add_action_or_reset(device,
+					       cedrus_cooling_qos_remove,
+					       cooling);
+		if (ret)
+			return ret;
+	}
+
+	cooling_device =
+		devm_thermal_of_cooling_device_register(device,
+							device->of_node,
+							"cedrus", dev,
+							&cedrus_cooling_ops);
+	if (IS_ERR(cooling_device))
+		return PTR_ERR(cooling_device);
+
+	cooling->device = cooling_device;
+
+	return 0;
+}
@@ -0,0 +1,49 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Cedrus Video Engine Driver
+ *
+ * Copyright 2023 Bootlin
+ * Author: Paul Kocialkowski <paul.kocialkowski@bootlin.com>
+ */
+
+#ifndef _CEDRUS_COOLING_H_
+#define _CEDRUS_COOLING_H_
+
+#include <linux/compiler.h>
+#include <linux/pm_qos.h>
+#include <linux/thermal.h>
+#include <linux/types.h>
+
+struct cedrus_device;
+
+/*
+ * Encoder effort is given up before the module clock rate, so that
+ * streams lose some compression efficiency rather than frames.
+ */
+enum cedrus_cooling_state {
+	CEDRUS_COOLING_STATE_NONE = 0,
+	/* Motion estimation search is shortened. */
+	CEDRUS_COOLING_STATE_SEARCH,
+	/* Quarter-pixel refinement and intra 4x4 prediction are disabled. */
+	CEDRUS_COOLING_STATE_REFINE,
+	/* The module clock rate is lowered to 3/4 and 1/2 of the nominal. */
+	CEDRUS_COOLING_STATE_CLOCK_HIGH,
+	CEDRUS_COOLING_STATE_CLOCK_LOW,
+	CEDRUS_COOLING_STATE_MAX = CEDRUS_COOLING_STATE_CLOCK_LOW,
+};
+
+struct cedrus_cooling {
+	struct thermal_cooling_device	*device;
+	/* Only used to cap the rate when devfreq scales the clock. */
+	struct dev_pm_qos_request	qos_request;
+	unsigned long			state;
+};
+
+static inline unsigned long cedrus_cooling_state(struct cedrus_cooling *cooling)
+{
+	return READ_ONCE(cooling->state);
+}
+
+int cedrus_cooling_setup(struct cedrus_device *dev);
+
+#endif
@@ -0,0 +1,721 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Cedrus Video Engine Driver
+ *
+ * Copyright 2023 Bootlin
+ * Author: Paul Kocialkowski <paul.kocialkowski@bootlin.com>
+ */
+
+#include <linux/debugfs.h>
+#include <linux/math64.h>
+#include <linux/reset.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/sort.h>
+
+#include "cedrus.h"
+#include "cedrus_context.h"
+#include "cedrus_debugfs.h"
+#include "cedrus_engine.h"
+#include "cedrus_proc.h"
+
+/*
+ * Hardware time is measured from trigger to interrupt (summed over the passes
+ * of multi-pass jobs) and setup time from job run to the first trigger.
+ *
+ * The register writes of the next jobs can be captured in a trace, along with
+ * the triggers and interrupts of their passes. Captured single-pass jobs can
+ * be replayed right when they complete, against their own buffers, which are
+ * still held at that point, to measure the hardware time of the exact same
+ * register sequence again.
+ */
+
+static const char * const cedrus_debugfs_codec_names[] = {
+	[CEDRUS_CODEC_MPEG2]	= "mpeg2",
+	[CEDRUS_CODEC_H264]	= "h264",
+	[CEDRUS_CODEC_H265]	= "h265",
+	[CEDRUS_CODEC_VP8]	= "vp8",
+};
+
+static const char *cedrus_debugfs_codec_name(const struct cedrus_engine *engine)
+{
+	if (!engine || engine->codec >= ARRAY_SIZE(cedrus_debugfs_codec_names))
+		return "none";
+
+	return cedrus_debugfs_codec_names[engine->codec];
+}
+
+static const char *cedrus_debugfs_role_name(struct cedrus_proc *proc)
+{
+	if (proc->role == CEDRUS_ROLE_DECODER)
+		return "decoder";
+
+	return "encoder";
+}
+
+/* Trace */
+
+static void cedrus_debugfs_trace_entry_add(struct cedrus_debugfs_trace *trace,
+					   unsigned int type, u32 reg,
+					   u32 value)
+{
+	struct cedrus_debugfs_trace_job *record;
+	struct cedrus_debugfs_trace_entry *entry;
+	unsigned long flags;
+
+	if (!READ_ONCE(trace->active))
+		return;
+
+	spin_lock_irqsave(&trace->lock, flags);
+
+	record = trace->job;
+	if (!record)
+		goto complete;
+
+	if (trace->entries_count == CEDRUS_DEBUGFS_TRACE_ENTRIES_COUNT) {
+		record->overflow = true;
+		goto complete;
+	}
+
+	entry = &trace->entries[trace->entries_count++];
+	entry->type = type;
+	entry->reg = reg;
+	entry->value = value;
+
+	record->entries_count++;
+
+	if (type == CEDRUS_DEBUGFS_TRACE_TRIGGER)
+		record->passes++;
+
+complete:
+	spin_unlock_irqrestore(&trace->lock, flags);
+}
+
+void cedrus_debugfs_trace_write(struct cedrus_device *dev, u32 reg, u32 value)
+{
+	cedrus_debugfs_trace_entry_add(&dev->debugfs.trace,
+				       CEDRUS_DEBUGFS_TRACE_WRITE, reg, value);
+}
+
+static void cedrus_debugfs_trace_job_start(struct cedrus_context *ctx)
+{
+	struct cedrus_debugfs_trace *trace = &ctx->proc->dev->debugfs.trace;
+	struct cedrus_debugfs_trace_job *record;
+	unsigned long flags;
+
+	spin_lock_irqsave(&trace->lock, flags);
+
+	/* Header jobs never reach the hardware nor finish through here. */
+	record = trace->job;
+	if (record)
+		trace->entries_count = record->entries_index;
+	else if (trace->jobs_pending)
+		record = &trace->jobs[trace->jobs_count];
+
+	if (record) {
+		memset(record, 0, sizeof(*record));
+		record->role = cedrus_debugfs_role_name(ctx->proc);
+		record->codec = cedrus_debugfs_codec_name(ctx->engine);
+		record->entries_index = trace->entries_count;
+	}
+
+	trace->job = record;
+	WRITE_ONCE(trace->active, !!record);
+
+	spin_unlock_irqrestore(&trace->lock, flags);
+}
+
+static void cedrus_debugfs_trace_job_finish(struct cedrus_context *ctx)
+{
+	struct cedrus_debugfs_trace *trace = &ctx->proc->dev->debugfs.trace;
+	struct cedrus_debugfs_trace_job *record;
+	unsigned long flags;
+
+	spin_lock_irqsave(&trace->lock, flags);
+
+	record = trace->job;
+	if (!record)
+		goto complete;
+
+	if (ctx->job.triggered) {
+		record->time_hw_us = min_t(s64, ktime_to_us(ctx->job.time_hw),
+					   U32_MAX);
+		trace->jobs_count++;
+		trace->jobs_pending--;
+	} else {
+		trace->entries_count = record->entries_index;
+	}
+
+	trace->job = NULL;
+	WRITE_ONCE(trace->active, false);
+
+complete:
+	spin_unlock_irqrestore(&trace->lock, flags);
+}
+
+bool cedrus_debugfs_trace_irq(struct cedrus_device *dev)
+{
+	struct cedrus_debugfs_trace *trace = &dev->debugfs.trace;
+	struct cedrus_context *ctx = READ_ONCE(trace->replay_ctx);
+
+	if (!ctx)
+		return false;
+
+	trace->replay_time_done = ktime_get();
+
+	cedrus_engine_irq_disable(ctx);
+	cedrus_engine_irq_clear(ctx);
+
+	complete(&trace->replay_done);
+
+	return true;
+}
+
+static int cedrus_debugfs_trace_replay(struct cedrus_context *ctx,
+				       struct cedrus_debugfs_trace_job *record,
+				       u32 *time_us)
+{
+	struct cedrus_device *dev = ctx->proc->dev;
+	struct cedrus_debugfs_trace *trace = &dev->debugfs.trace;
+	struct cedrus_debugfs_trace_entry *entry;
+	unsigned long timeout = cedrus_context_job_timeout(ctx);
+	ktime_t time_trigger = 0;
+	unsigned int i;
+	int ret = 0;
+
+	reinit_completion(&trace->replay_done);
+	WRITE_ONCE(trace->replay_ctx, ctx);
+
+	for (i = 0; i < record->entries_count; i++) {
+		entry = &trace->entries[record->entries_index + i];
+
+		switch (entry->type) {
+		case CEDRUS_DEBUGFS_TRACE_WRITE:
+			writel(entry->value, dev->io_base + entry->reg);
+			break;
+		case CEDRUS_DEBUGFS_TRACE_TRIGGER:
+			time_trigger = ktime_get();
+			break;
+		case CEDRUS_DEBUGFS_TRACE_IRQ:
+			if (!wait_for_completion_timeout(&trace->replay_done,
+							 timeout))
+				ret = -ETIMEDOUT;
+			break;
+		}
+
+		if (ret)
+			break;
+	}
+
+	WRITE_ONCE(trace->replay_ctx, NULL);
+
+	if (ret) {
+		cedrus_engine_irq_disable(ctx);
+		cedrus_engine_irq_clear(ctx);
+		return ret;
+	}
+
+	*time_us = min_t(s64, ktime_us_delta(trace->replay_time_done,
+					     time_trigger), U32_MAX);
+
+	return 0;
+}
+
+/* Job */
+
+void cedrus_debugfs_job_run(struct cedrus_context *ctx)
+{
+	ctx->job.time_run = ktime_get();
+
+	cedrus_debugfs_trace_job_start(ctx);
+}
+
+void cedrus_debugfs_job_trigger(struct cedrus_context *ctx)
+{
+	struct cedrus_job *job = &ctx->job;
+
+	cedrus_debugfs_trace_entry_add(&ctx->proc->dev->debugfs.trace,
+				       CEDRUS_DEBUGFS_TRACE_TRIGGER, 0, 0);
+
+	job->time_trigger = ktime_get();
+
+	if (!job->triggered)
+		job->time_setup = ktime_sub(job->time_trigger, job->time_run);
+
+	job->triggered = true;
+}
+
+void cedrus_debugfs_job_irq(struct cedrus_context *ctx)
+{
+	struct cedrus_job *job = &ctx->job;
+
+	job->time_done = ktime_get();
+	job->time_hw = ktime_add(job->time_hw,
+				 ktime_sub(job->time_done, job->time_trigger));
+
+	cedrus_debugfs_trace_entry_add(&ctx->proc->dev->debugfs.trace,
+				       CEDRUS_DEBUGFS_TRACE_IRQ, 0, 0);
+}
+
+/*
+ * Replays run before the engine finishes the job, since it may update the
+ * buffers that the hardware would write again. Multi-pass jobs are skipped,
+ * as engines may also update buffers between passes.
+ */
+int cedrus_debugfs_job_replay(struct cedrus_context *ctx, int state)
+{
+	struct cedrus_device *dev = ctx->proc->dev;
+	struct cedrus_debugfs_trace *trace = &dev->debugfs.trace;
+	struct cedrus_debugfs_trace_job *record = READ_ONCE(trace->job);
+	u32 replays = READ_ONCE(trace->replays);
+	u32 time_us;
+	unsigned int i;
+	int ret = 0;
+
+	if (!record || !replays || state != VB2_BUF_STATE_DONE ||
+	    !ctx->job.triggered)
+		return 0;
+
+	if (record->passes != 1 || record->overflow) {
+		record->replay_error = -EOPNOTSUPP;
+		return 0;
+	}
+
+	/* Writes from the replays are not part of the job. */
+	WRITE_ONCE(trace->active, false);
+
+	for (i = 0; i < replays; i++) {
+		ret = cedrus_debugfs_trace_replay(ctx, record, &time_us);
+		if (ret)
+			break;
+
+		if (!record->replays || time_us < record->replay_time_min_us)
+			record->replay_time_min_us = time_us;
+
+		record->replay_time_max_us = max(record->replay_time_max_us,
+						 time_us);
+		record->replay_time_us += time_us;
+		record->replays++;
+	}
+
+	WRITE_ONCE(trace->active, true);
+
+	cedrus_write_shadow_invalidate(dev);
+
+	if (ret) {
+		record->replay_error = ret;
+
+		dev->ctx_configured = NULL;
+
+		if (cedrus_proc_reset(ctx))
+			reset_control_reset(dev->reset);
+	}
+
+	return ret;
+}
+
+static void cedrus_debugfs_engine_busy_add(struct cedrus_context *ctx,
+					   u64 time_us)
+{
+	struct cedrus_proc *proc = ctx->proc;
+	struct cedrus_debugfs *debugfs = &proc->dev->debugfs;
+	unsigned int i;
+
+	for (i = 0; i < proc->engines_count; i++)
+		if (proc->engines[i] == ctx->engine)
+			break;
+
+	if (i == proc->engines_count)
+		return;
+
+	spin_lock(&debugfs->lock);
+	proc->engines_busy_us[i] += time_us;
+	spin_unlock(&debugfs->lock);
+}
+
+void cedrus_debugfs_job_finish(struct cedrus_context *ctx, int state)
+{
+	struct cedrus_debugfs_stats *stats = &ctx->stats;
+	struct cedrus_job *job = &ctx->job;
+	u32 time_hw_us, time_setup_us;
+	unsigned int index;
+
+	time_hw_us = min_t(s64, ktime_to_us(job->time_hw), U32_MAX);
+	time_setup_us = min_t(s64, ktime_to_us(job->time_setup), U32_MAX);
+
+	spin_lock(&stats->lock);
+
+	stats->jobs++;
+
+	if (state == VB2_BUF_STATE_ERROR)
+		stats->errors++;
+
+	if (job->timeout)
+		stats->timeouts++;
+
+	/* Buffers are returned to userspace from here on. */
+	if (job->deadline && ktime_after(ktime_get(), job->deadline))
+		stats->deadlines_missed++;
+
+	if (job->triggered) {
+		stats->timed++;
+		stats->time_hw_us += time_hw_us;
+		stats->time_setup_us += time_setup_us;
+		stats->time_engine_ns += ktime_to_ns(job->time_hw);
+
+		index = stats->samples_index;
+		stats->samples_hw_us[index] = time_hw_us;
+		stats->samples_setup_us[index] = time_setup_us;
+
+		stats->samples_index = (index + 1) %
+				       CEDRUS_DEBUGFS_SAMPLES_COUNT;
+
+		if (stats->samples_count < CEDRUS_DEBUGFS_SAMPLES_COUNT)
+			stats->samples_count++;
+	}
+
+	spin_unlock(&stats->lock);
+
+	if (job->triggered)
+		cedrus_debugfs_engine_busy_add(ctx, time_hw_us);
+
+	cedrus_debugfs_trace_job_finish(ctx);
+}
+
+/* Context */
+
+static int cedrus_debugfs_sample_compare(const void *a, const void *b)
+{
+	u32 value_a = *(const u32 *)a;
+	u32 value_b = *(const u32 *)b;
+
+	if (value_a < value_b)
+		return -1;
+
+	return value_a > value_b;
+}
+
+static void cedrus_debugfs_samples_show(struct seq_file *seq, const char *name,
+					u32 *samples, unsigned int count,
+					u64 total, u64 timed)
+{
+	u32 p50 = 0, p99 = 0;
+	u64 average = 0;
+
+	if (count) {
+		sort(samples, count, sizeof(*samples),
+		     cedrus_debugfs_sample_compare, NULL);
+
+		p50 = samples[(count - 1) * 50 / 100];
+		p99 = samples[(count - 1) * 99 / 100];
+	}
+
+	if (timed)
+		average = div64_u64(total, timed);
+
+	seq_printf(seq, "%s: avg %llu p50 %u p99 %u\n", name, average, p50,
+		   p99);
+}
+
+static int cedrus_debugfs_context_show(struct seq_file *seq, void *data)
+{
+	struct cedrus_context *ctx = seq->private;
+	struct cedrus_debugfs_stats *stats = &ctx->stats;
+	u64 jobs, errors, timeouts, timed, time_hw_us, time_setup_us;
+	u64 deadlines_missed;
+	unsigned int count;
+	u32 *samples;
+
+	/* Samples are sorted out of the lock, on a copy. */
+	samples = kmalloc_array(2 * CEDRUS_DEBUGFS_SAMPLES_COUNT,
+				sizeof(*samples), GFP_KERNEL);
+	if (!samples)
+		return -ENOMEM;
+
+	spin_lock(&stats->lock);
+
+	jobs = stats->jobs;
+	errors = stats->errors;
+	timeouts = stats->timeouts;
+	deadlines_missed = stats->deadlines_missed;
+	timed = stats->timed;
+	time_hw_us = stats->time_hw_us;
+	time_setup_us = stats->time_setup_us;
+	count = stats->samples_count;
+
+	memcpy(samples, stats->samples_hw_us, count * sizeof(*samples));
+	memcpy(&samples[CEDRUS_DEBUGFS_SAMPLES_COUNT], stats->samples_setup_us,
+	       count * sizeof(*samples));
+
+	spin_unlock(&stats->lock);
+
+	seq_printf(seq, "role: %s\n", cedrus_debugfs_role_name(ctx->proc));
+	seq_printf(seq, "codec: %s\n", cedrus_debugfs_codec_name(ctx->engine));
+	seq_printf(seq, "priority: %u\n", ctx->priority);
+	seq_printf(seq, "deadline_ms: %u\n", ctx->deadline_ms);
+	seq_printf(seq, "jobs: %llu\n", jobs);
+	seq_printf(seq, "errors: %llu\n", errors);
+	seq_printf(seq, "timeouts: %llu\n", timeouts);
+	seq_printf(seq, "deadlines_missed: %llu\n", deadlines_missed);
+	seq_printf(seq, "memory: %ld\n", atomic_long_read(&ctx->memory));
+
+	cedrus_debugfs_samples_show(seq, "hw_time_us", samples, count,
+				    time_hw_us, timed);
+	cedrus_debugfs_samples_show(seq, "setup_time_us",
+				    &samples[CEDRUS_DEBUGFS_SAMPLES_COUNT],
+				    count, time_setup_us, timed);
+
+	kfree(samples);
+
+	return 0;
+}
+
+DEFINE_SHOW_ATTRIBUTE(cedrus_debugfs_context);
+
+void cedrus_debugfs_context_setup(struct cedrus_context *ctx)
+{
+	struct cedrus_debugfs *debugfs = &ctx->proc->dev->debugfs;
+	char name[32];
+
+	spin_lock_init(&ctx->stats.lock);
+
+	ctx->id = atomic_inc_return(&debugfs->contexts_index);
+
+	snprintf(name, sizeof(name), "context%u", ctx->id);
+
+	/* Engines may add their own files to the context directory. */
+	ctx->debugfs = debugfs_create_dir(name, debugfs->root);
+
+	debugfs_create_file("stats", 0444, ctx->debugfs, ctx,
+			    &cedrus_debugfs_context_fops);
+}
+
+void cedrus_debugfs_context_cleanup(struct cedrus_context *ctx)
+{
+	/* Removal waits for readers that are still using the context. */
+	debugfs_remove(ctx->debugfs);
+	ctx->debugfs = NULL;
+}
+
+/* Debugfs */
+
+static void cedrus_debugfs_engines_proc_show(struct seq_file *seq,
+					     struct cedrus_proc *proc,
+					     u64 time_us)
+{
+	struct cedrus_debugfs *debugfs = &proc->dev->debugfs;
+	unsigned int i;
+
+	for (i = 0; i < proc->engines_count; i++) {
+		const struct cedrus_engine *engine = proc->engines[i];
+		u64 busy_us, percent, permille = 0;
+		u32 tenths;
+
+		spin_lock(&debugfs->lock);
+		busy_us = proc->engines_busy_us[i];
+		spin_unlock(&debugfs->lock);
+
+		if (time_us)
+			permille = div64_u64(busy_us * 1000, time_us);
+
+		percent = div_u64_rem(permille, 10, &tenths);
+
+		seq_printf(seq, "%s %s: busy_ms %llu utilization %llu.%u%%\n",
+			   cedrus_debugfs_role_name(proc),
+			   cedrus_debugfs_codec_name(engine),
+			   div_u64(busy_us, USEC_PER_MSEC),
+			   percent, tenths);
+	}
+}
+
+static int cedrus_debugfs_engines_show(struct seq_file *seq, void *data)
+{
+	struct cedrus_device *dev = seq->private;
+	u64 time_us = ktime_us_delta(ktime_get(), dev->debugfs.time_setup);
+
+	seq_printf(seq, "time_ms: %llu\n", div_u64(time_us, USEC_PER_MSEC));
+
+	cedrus_debugfs_engines_proc_show(seq, &dev->dec, time_us);
+	cedrus_debugfs_engines_proc_show(seq, &dev->enc, time_us);
+
+	return 0;
+}
+
+DEFINE_SHOW_ATTRIBUTE(cedrus_debugfs_engines);
+
+static int cedrus_debugfs_memory_show(struct seq_file *seq, void *data)
+{
+	struct cedrus_device *dev = seq->private;
+	struct cedrus_pool *pool = &dev->pool;
+	unsigned int size;
+
+	mutex_lock(&pool->lock);
+	size = pool->size;
+	mutex_unlock(&pool->lock);
+
+	seq_printf(seq, "used: %ld\n", atomic_long_read(&pool->used));
+	seq_printf(seq, "pooled: %u\n", size);
+
+	return 0;
+}
+
+DEFINE_SHOW_ATTRIBUTE(cedrus_debugfs_memory);
+
+static int cedrus_debugfs_trace_jobs_get(void *data, u64 *value)
+{
+	struct cedrus_debugfs_trace *trace = data;
+
+	*value = READ_ONCE(trace->jobs_pending);
+
+	return 0;
+}
+
+/* Arming the capture drops the jobs captured so far. */
+static int cedrus_debugfs_trace_jobs_set(void *data, u64 value)
+{
+	struct cedrus_debugfs_trace *trace = data;
+	struct cedrus_debugfs_trace_entry *entries = NULL;
+	unsigned long flags;
+
+	mutex_lock(&trace->mutex);
+
+	if (value && !trace->entries) {
+		entries = kvmalloc_array(CEDRUS_DEBUGFS_TRACE_ENTRIES_COUNT,
+					 sizeof(*entries), GFP_KERNEL);
+		if (!entries) {
+			mutex_unlock(&trace->mutex);
+			return -ENOMEM;
+		}
+	}
+
+	spin_lock_irqsave(&trace->lock, flags);
+
+	if (entries)
+		trace->entries = entries;
+
+	trace->jobs_pending = min_t(u64, value,
+				    CEDRUS_DEBUGFS_TRACE_JOBS_COUNT);
+	trace->jobs_count = 0;
+	trace->entries_count = 0;
+	trace->job = NULL;
+	WRITE_ONCE(trace->active, false);
+
+	spin_unlock_irqrestore(&trace->lock, flags);
+
+	mutex_unlock(&trace->mutex);
+
+	return 0;
+}
+
+DEFINE_DEBUGFS_ATTRIBUTE(cedrus_debugfs_trace_jobs_fops,
+			 cedrus_debugfs_trace_jobs_get,
+			 cedrus_debugfs_trace_jobs_set, "%llu\n");
+
+static void cedrus_debugfs_trace_job_show(struct seq_file *seq,
+					  struct cedrus_debugfs_trace *trace,
+					  unsigned int index)
+{
+	struct cedrus_debugfs_trace_job *record = &trace->jobs[index];
+	struct cedrus_debugfs_trace_entry *entry;
+	u64 average = 0;
+	unsigned int i;
+
+	if (record->replays)
+		average = div_u64(record->replay_time_us, record->replays);
+
+	seq_printf(seq, "job %u: %s %s\n", index, record->role, record->codec);
+	seq_printf(seq, "passes: %u\n", record->passes);
+	seq_printf(seq, "writes: %u%s\n", record->entries_count,
+		   record->overflow ? " (overflow)" : "");
+	seq_printf(seq, "hw_time_us: %u\n", record->time_hw_us);
+	seq_printf(seq, "replays: %u\n", record->replays);
+	seq_printf(seq, "replay_time_us: avg %llu min %u max %u\n", average,
+		   record->replay_time_min_us, record->replay_time_max_us);
+
+	if (record->replay_error)
+		seq_printf(seq, "replay_error: %d\n", record->replay_error);
+
+	for (i = 0; i < record->entries_count; i++) {
+		entry = &trace->entries[record->entries_index + i];
+
+		switch (entry->type) {
+		case CEDRUS_DEBUGFS_TRACE_WRITE:
+			seq_printf(seq, "write 0x%03x 0x%08x\n", entry->reg,
+				   entry->value);
+			break;
+		case CEDRUS_DEBUGFS_TRACE_TRIGGER:
+			seq_puts(seq, "trigger\n");
+			break;
+		case CEDRUS_DEBUGFS_TRACE_IRQ:
+			seq_puts(seq, "irq\n");
+			break;
+		}
+	}
+}
+
+static int cedrus_debugfs_trace_show(struct seq_file *seq, void *data)
+{
+	struct cedrus_debugfs_trace *trace = seq->private;
+	unsigned int jobs_count, i;
+	unsigned long flags;
+
+	mutex_lock(&trace->mutex);
+
+	/* Captured jobs are left untouched until the capture is armed. */
+	spin_lock_irqsave(&trace->lock, flags);
+	jobs_count = trace->jobs_count;
+	spin_unlock_irqrestore(&trace->lock, flags);
+
+	for (i = 0; i < jobs_count; i++)
+		cedrus_debugfs_trace_job_show(seq, trace, i);
+
+	mutex_unlock(&trace->mutex);
+
+	return 0;
+}
+
+DEFINE_SHOW_ATTRIBUTE(cedrus_debugfs_trace);
+
+static void cedrus_debugfs_trace_setup(struct cedrus_device *dev)
+{
+	struct cedrus_debugfs_trace *trace = &dev->debugfs.trace;
+	struct dentry *dir;
+
+	spin_lock_init(&trace->lock);
+	mutex_init(&trace->mutex);
+	init_completion(&trace->replay_done);
+
+	dir = debugfs_create_dir("trace", dev->debugfs.root);
+
+	debugfs_create_file_unsafe("jobs", 0644, dir, trace,
+				   &cedrus_debugfs_trace_jobs_fops);
+	debugfs_create_u32("replays", 0644, dir, &trace->replays);
+	debugfs_create_file("writes", 0444, dir, trace,
+			    &cedrus_debugfs_trace_fops);
+}
+
+void cedrus_debugfs_setup(struct cedrus_device *dev)
+{
+	struct cedrus_debugfs *debugfs = &dev->debugfs;
+
+	spin_lock_init(&debugfs->lock);
+	debugfs->time_setup = ktime_get();
+
+	debugfs->root = debugfs_create_dir(dev_name(dev->dev), NULL);
+
+	debugfs_create_file("engines", 0444, debugfs->root, dev,
+			    &cedrus_debugfs_engines_fops);
+	debugfs_create_file("memory", 0444, debugfs->root, dev,
+			    &cedrus_debugfs_memory_fops);
+
+	cedrus_debugfs_trace_setup(dev);
+}
+
+void cedrus_debugfs_cleanup(struct cedrus_device *dev)
+{
+	debugfs_remove(dev->debugfs.root);
+	dev->debugfs.root = NULL;
+
+	kvfree(dev->debugfs.trace.entries);
+	dev->debugfs.trace.entries = NULL;
+}
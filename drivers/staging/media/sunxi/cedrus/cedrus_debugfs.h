@@ -0,0 +1,131 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Cedrus Video Engine Driver
+ *
+ * Copyright 2023 Bootlin
+ * Author: Paul Kocialkowski <paul.kocialkowski@bootlin.com>
+ */
+
+#ifndef _CEDRUS_DEBUGFS_H_
+#define _CEDRUS_DEBUGFS_H_
+
+#include <linux/atomic.h>
+#include <linux/completion.h>
+#include <linux/ktime.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/types.h>
+
+#define CEDRUS_DEBUGFS_SAMPLES_COUNT	128
+
+#define CEDRUS_DEBUGFS_TRACE_ENTRIES_COUNT	16384
+#define CEDRUS_DEBUGFS_TRACE_JOBS_COUNT		32
+
+struct cedrus_context;
+struct cedrus_device;
+struct dentry;
+
+struct cedrus_debugfs_stats {
+	spinlock_t	lock;
+
+	u64		jobs;
+	u64		errors;
+	u64		timeouts;
+	u64		deadlines_missed;
+
+	/* Totals only cover jobs that reached the hardware. */
+	u64		timed;
+	u64		time_hw_us;
+	u64		time_setup_us;
+	/* Engine busy time, reported through fdinfo. */
+	u64		time_engine_ns;
+
+	u32		samples_hw_us[CEDRUS_DEBUGFS_SAMPLES_COUNT];
+	u32		samples_setup_us[CEDRUS_DEBUGFS_SAMPLES_COUNT];
+	unsigned int	samples_index;
+	unsigned int	samples_count;
+};
+
+enum cedrus_debugfs_trace_type {
+	CEDRUS_DEBUGFS_TRACE_WRITE,
+	CEDRUS_DEBUGFS_TRACE_TRIGGER,
+	CEDRUS_DEBUGFS_TRACE_IRQ,
+};
+
+struct cedrus_debugfs_trace_entry {
+	u16	type;
+	u16	reg;
+	u32	value;
+};
+
+struct cedrus_debugfs_trace_job {
+	const char	*role;
+	const char	*codec;
+
+	unsigned int	entries_index;
+	unsigned int	entries_count;
+	unsigned int	passes;
+	bool		overflow;
+	u32		time_hw_us;
+
+	unsigned int	replays;
+	u64		replay_time_us;
+	u32		replay_time_min_us;
+	u32		replay_time_max_us;
+	int		replay_error;
+};
+
+struct cedrus_debugfs_trace {
+	/* Writes are only recorded while a job is captured. */
+	bool				active;
+	spinlock_t			lock;
+	/* Arming serializes with reading the captured jobs. */
+	struct mutex			mutex;
+
+	u32				jobs_pending;
+	u32				replays;
+
+	struct cedrus_debugfs_trace_entry	*entries;
+	unsigned int			entries_count;
+	struct cedrus_debugfs_trace_job	jobs[CEDRUS_DEBUGFS_TRACE_JOBS_COUNT];
+	unsigned int			jobs_count;
+	struct cedrus_debugfs_trace_job	*job;
+
+	struct cedrus_context		*replay_ctx;
+	struct completion		replay_done;
+	ktime_t				replay_time_done;
+};
+
+struct cedrus_debugfs {
+	struct dentry	*root;
+	atomic_t	contexts_index;
+	ktime_t		time_setup;
+	spinlock_t	lock;
+
+	struct cedrus_debugfs_trace	trace;
+};
+
+/* Job */
+
+void cedrus_debugfs_job_run(struct cedrus_context *ctx);
+void cedrus_debugfs_job_trigger(struct cedrus_context *ctx);
+void cedrus_debugfs_job_irq(struct cedrus_context *ctx);
+void cedrus_debugfs_job_finish(struct cedrus_context *ctx, int state);
+int cedrus_debugfs_job_replay(struct cedrus_context *ctx, int state);
+
+/* Trace */
+
+void cedrus_debugfs_trace_write(struct cedrus_device *dev, u32 reg, u32 value);
+bool cedrus_debugfs_trace_irq(struct cedrus_device *dev);
+
+/* Context */
+
+void cedrus_debugfs_context_setup(struct cedrus_context *ctx);
+void cedrus_debugfs_context_cleanup(struct cedrus_context *ctx);
+
+/* Debugfs */
+
+void cedrus_debugfs_setup(struct cedrus_device *dev);
+void cedrus_debugfs_cleanup(struct cedrus_device *dev);
+
+#endif
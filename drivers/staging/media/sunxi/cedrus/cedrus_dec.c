@@ -10,6 +10,8 @@
 
 #include <linux/types.h>
 #include <linux/videodev2.h>
+#include <drm/drm_fourcc.h>
+#include <media/v4l2-ctrls.h>
 
 #include "cedrus.h"
 #include "cedrus_context.h"
@@ -21,6 +23,147 @@
 #include "cedrus_engine.h"
 #include "cedrus_proc.h"
 #include "cedrus_regs.h"
+#include "include/uapi/sunxi-cedrus.h"
+
+/* Ctrl */
+
+static const char * const cedrus_dec_skip_loop_filter_menu[] = {
+	"None",
+	"Non-Reference",
+	"All",
+	NULL,
+};
+
+static int cedrus_dec_ctrl_validate(struct cedrus_context *ctx,
+				    struct v4l2_ctrl *ctrl)
+{
+	unsigned int type;
+
+	switch (ctrl->id) {
+	case V4L2_CID_ROTATE:
+		if (ctrl->val == ctx->v4l2.rotation_picture)
+			return 0;
+		break;
+	case V4L2_CID_CEDRUS_DEC_SCALE_DOWN:
+		if (ctrl->val == ctx->v4l2.scale_down_picture)
+			return 0;
+		break;
+	case V4L2_CID_CEDRUS_DEC_QP_MAP:
+		if (ctrl->val == ctx->v4l2.qp_map_picture)
+			return 0;
+
+		/* The map is only filled by engines knowing the slice QP. */
+		if (ctrl->val && !ctx->engine->qp_map)
+			return -EINVAL;
+
+		/* The map is part of the picture buffers. */
+		type = cedrus_proc_buffer_type(ctx->proc,
+					       CEDRUS_FORMAT_TYPE_PICTURE);
+		if (cedrus_context_queue_busy_check(ctx, type))
+			return -EBUSY;
+
+		return 0;
+	default:
+		return 0;
+	}
+
+	/* Picture transforms are only applied by the secondary output. */
+	if (ctrl->val && !ctx->engine->secondary_output)
+		return -EINVAL;
+
+	/* Reference buffers are allocated with picture buffers. */
+	type = cedrus_proc_buffer_type(ctx->proc, CEDRUS_FORMAT_TYPE_PICTURE);
+	if (cedrus_context_queue_busy_check(ctx, type))
+		return -EBUSY;
+
+	return 0;
+}
+
+static int cedrus_dec_ctrl_prepare(struct cedrus_context *ctx,
+				   struct v4l2_ctrl *ctrl)
+{
+	/* The picture transforms are part of the context formats. */
+	switch (ctrl->id) {
+	case V4L2_CID_ROTATE:
+		if (ctx->v4l2.rotation_picture == ctrl->val)
+			return 0;
+
+		ctx->v4l2.rotation_picture = ctrl->val;
+		break;
+	case V4L2_CID_CEDRUS_DEC_SCALE_DOWN:
+		if (ctx->v4l2.scale_down_picture == ctrl->val)
+			return 0;
+
+		ctx->v4l2.scale_down_picture = ctrl->val;
+		break;
+	case V4L2_CID_CEDRUS_DEC_QP_MAP:
+		if (ctx->v4l2.qp_map_picture == ctrl->val)
+			return 0;
+
+		ctx->v4l2.qp_map_picture = ctrl->val;
+		break;
+	default:
+		return 0;
+	}
+
+	cedrus_context_format_invalidate(ctx);
+
+	/* Picture dimensions follow the transformed coded dimensions. */
+	return cedrus_proc_format_propagate(ctx, CEDRUS_FORMAT_TYPE_CODED);
+}
+
+static const struct v4l2_ctrl_config cedrus_dec_ctrl_configs[] = {
+	{
+		.id	= V4L2_CID_ROTATE,
+		.step	= 90,
+		.min	= 0,
+		.max	= 270,
+		.def	= 0,
+		.ops	= &cedrus_context_ctrl_ops,
+	},
+	{
+		.id	= V4L2_CID_CEDRUS_DEC_SCALE_DOWN,
+		.name	= "Decoder Picture Scale Down",
+		.type	= V4L2_CTRL_TYPE_INTEGER,
+		.step	= 1,
+		.min	= 0,
+		.max	= CEDRUS_DEC_SCALE_DOWN_MAX,
+		.def	= 0,
+		.ops	= &cedrus_context_ctrl_ops,
+	},
+	{
+		.id	= V4L2_CID_CEDRUS_DEC_QP_MAP,
+		.name	= "Decoder QP Map",
+		.type	= V4L2_CTRL_TYPE_BOOLEAN,
+		.step	= 1,
+		.min	= 0,
+		.max	= 1,
+		.def	= 0,
+		.ops	= &cedrus_context_ctrl_ops,
+	},
+	{
+		.id	= V4L2_CID_CEDRUS_DEC_DRM_MODIFIER,
+		.name	= "Decoder DRM Format Modifier",
+		.type	= V4L2_CTRL_TYPE_INTEGER64,
+		.flags	= V4L2_CTRL_FLAG_READ_ONLY |
+			  V4L2_CTRL_FLAG_VOLATILE,
+		.step	= 1,
+		.min	= 0,
+		.max	= S64_MAX,
+		.def	= DRM_FORMAT_MOD_LINEAR,
+		.ops	= &cedrus_context_ctrl_ops,
+	},
+	{
+		.id	= V4L2_CID_CEDRUS_DEC_SKIP_LOOP_FILTER,
+		.name	= "Decoder Skip Loop Filter",
+		.type	= V4L2_CTRL_TYPE_MENU,
+		.min	= CEDRUS_DEC_SKIP_LOOP_FILTER_NONE,
+		.max	= CEDRUS_DEC_SKIP_LOOP_FILTER_ALL,
+		.def	= CEDRUS_DEC_SKIP_LOOP_FILTER_NONE,
+		.qmenu	= cedrus_dec_skip_loop_filter_menu,
+		.ops	= &cedrus_context_ctrl_ops,
+	},
+};
 
 /* Format */
 
@@ -33,6 +176,19 @@ static const struct cedrus_format cedrus_dec_formats[] = {
 	{
 		.pixelformat	= V4L2_PIX_FMT_NV12_32L32,
 		.type		= CEDRUS_FORMAT_TYPE_PICTURE,
+	},
+	{
+		.pixelformat		= V4L2_PIX_FMT_NV12,
+		.pixelformat_coded	= V4L2_PIX_FMT_MPEG2_SLICE,
+		.capabilities		= CEDRUS_CAPABILITY_MPEG2_DEC_ROTATE,
+		.type			= CEDRUS_FORMAT_TYPE_PICTURE,
+	},
+	{
+		.pixelformat		= V4L2_PIX_FMT_P010,
+		.pixelformat_coded	= V4L2_PIX_FMT_HEVC_SLICE,
+		.capabilities		= CEDRUS_CAPABILITY_UNTILED |
+					  CEDRUS_CAPABILITY_H265_10_DEC,
+		.type			= CEDRUS_FORMAT_TYPE_PICTURE,
 	}
 };
 
@@ -65,11 +221,15 @@ int cedrus_dec_format_coded_configure(struct cedrus_context *ctx)
 	u32 value = 0;
 
 	/*
-	 * FIXME: This is only valid on 32-bits DDR's, we should test
-	 * it on the A13/A33.
+	 * FIXME: The 128-bit bandwidth mode is only valid on 32-bits DDR's,
+	 * we should test it on the A13/A33.
 	 */
 	value |= VE_MODE_REC_WR_MODE_2MB;
-	value |= VE_MODE_DDR_MODE_BW_128;
+
+	if (cedrus_capabilities_check(dev, CEDRUS_CAPABILITY_DDR_BW_256))
+		value |= VE_MODE_DDR_MODE_BW_256;
+	else
+		value |= VE_MODE_DDR_MODE_BW_128;
 
 	switch (pix_format->pixelformat) {
 	case V4L2_PIX_FMT_MPEG2_SLICE:
@@ -97,19 +257,57 @@ int cedrus_dec_format_coded_configure(struct cedrus_context *ctx)
 	return 0;
 }
 
-static int cedrus_dec_format_picture_prepare(struct cedrus_context *ctx,
-					     struct v4l2_format *format)
+static int cedrus_dec_reset(struct cedrus_context *ctx)
+{
+	struct cedrus_device *dev = ctx->proc->dev;
+	u32 value;
+
+	/* Disable decoder. */
+	cedrus_write(dev, VE_MODE_REG, VE_MODE_DEC_DISABLED);
+
+	/* Reset decoder. */
+
+	value = cedrus_read(dev, VE_RESET_REG);
+	value |= VE_RESET_DECODER_RESET;
+	cedrus_write(dev, VE_RESET_REG, value);
+
+	value = cedrus_read(dev, VE_RESET_REG);
+	value &= ~VE_RESET_DECODER_RESET;
+	cedrus_write(dev, VE_RESET_REG, value);
+
+	cedrus_write_shadow_invalidate(dev);
+
+	return 0;
+}
+
+static unsigned int
+cedrus_dec_qp_map_size(const struct v4l2_pix_format *pix_format)
+{
+	return DIV_ROUND_UP(pix_format->width, 16) *
+	       DIV_ROUND_UP(pix_format->height, 16);
+}
+
+static int
+cedrus_dec_format_picture_derive(struct cedrus_context *ctx,
+				 struct v4l2_format *format,
+				 const struct v4l2_pix_format *pix_format_coded)
 {
+	struct cedrus_device *dev = ctx->proc->dev;
 	struct v4l2_pix_format *pix_format = &format->fmt.pix;
-	struct v4l2_pix_format *pix_format_coded =
-		&ctx->v4l2.format_coded.fmt.pix;
 	unsigned int width, height;
 	unsigned int sizeimage;
 	unsigned int bytesperline = pix_format->bytesperline;
 
-	/* Picture format dimensions are copied from coded format. */
-	width = pix_format_coded->width;
-	height = pix_format_coded->height;
+	/* Picture format dimensions are copied from (scaled) coded format. */
+	width = DIV_ROUND_UP(pix_format_coded->width,
+			     1 << ctx->v4l2.scale_down_picture);
+	height = DIV_ROUND_UP(pix_format_coded->height,
+			      1 << ctx->v4l2.scale_down_picture);
+
+	/* Quarter turns swap the picture dimensions. */
+	if (ctx->v4l2.rotation_picture == 90 ||
+	    ctx->v4l2.rotation_picture == 270)
+		swap(width, height);
 
 	/* Check minimum allowed bytesperline, maximum is to avoid overflow. */
 	if (bytesperline < width || bytesperline > (32 * width))
@@ -120,6 +318,10 @@ static int cedrus_dec_format_picture_prepare(struct cedrus_context *ctx,
 
 	switch (pix_format->pixelformat) {
 	case V4L2_PIX_FMT_NV12:
+		/* The rotate/scale output has no line stride setting. */
+		if (!cedrus_capabilities_check(dev, CEDRUS_CAPABILITY_UNTILED))
+			bytesperline = ALIGN(width, 16);
+
 		/* Luma plane size. */
 		sizeimage = bytesperline * height;
 
@@ -142,10 +344,24 @@ static int cedrus_dec_format_picture_prepare(struct cedrus_context *ctx,
 		/* Chroma plane size. */
 		sizeimage += bytesperline * ALIGN(height, 64) / 2;
 		break;
+	case V4L2_PIX_FMT_P010:
+		/* Two bytes per sample, 32-aligned stride. */
+		bytesperline = ALIGN(max(bytesperline, width * 2), 32);
+
+		/* Luma plane size. */
+		sizeimage = bytesperline * height;
+
+		/* Chroma plane size. */
+		sizeimage += bytesperline * height / 2;
+		break;
 	default:
 		return -EINVAL;
 	}
 
+	/* The QP map follows the picture data. */
+	if (ctx->v4l2.qp_map_picture)
+		sizeimage += cedrus_dec_qp_map_size(pix_format_coded);
+
 	pix_format->width = width;
 	pix_format->height = height;
 	pix_format->bytesperline = bytesperline;
@@ -161,7 +377,144 @@ static int cedrus_dec_format_picture_prepare(struct cedrus_context *ctx,
 	return 0;
 }
 
-int cedrus_dec_format_picture_configure(struct cedrus_context *ctx)
+static int cedrus_dec_format_picture_prepare(struct cedrus_context *ctx,
+					     struct v4l2_format *format)
+{
+	struct v4l2_pix_format *pix_format_coded =
+		&ctx->v4l2.format_coded.fmt.pix;
+
+	return cedrus_dec_format_picture_derive(ctx, format, pix_format_coded);
+}
+
+bool cedrus_dec_format_picture_secondary_check(struct cedrus_context *ctx)
+{
+	struct v4l2_pix_format *pix_format = &ctx->v4l2.format_picture.fmt.pix;
+
+	/* P010 is only available through the secondary output. */
+	if (pix_format->pixelformat == V4L2_PIX_FMT_P010)
+		return true;
+
+	return ctx->v4l2.scale_down_picture > 0 ||
+	       ctx->v4l2.rotation_picture > 0;
+}
+
+/*
+ * Without untiled output support, untiled pictures are written by the MPEG
+ * engine rotate/scale output while the primary output keeps writing tiled
+ * reference pictures, like the secondary output of later variants.
+ */
+bool cedrus_dec_format_picture_rotate_check(struct cedrus_context *ctx)
+{
+	struct cedrus_device *dev = ctx->proc->dev;
+	struct v4l2_pix_format *pix_format = &ctx->v4l2.format_picture.fmt.pix;
+
+	if (cedrus_capabilities_check(dev, CEDRUS_CAPABILITY_UNTILED))
+		return false;
+
+	return pix_format->pixelformat == V4L2_PIX_FMT_NV12;
+}
+
+void cedrus_dec_format_ref_layout(struct cedrus_context *ctx,
+				  struct cedrus_dec_ref_layout *layout,
+				  bool extra)
+{
+	struct v4l2_pix_format *pix_format = &ctx->v4l2.format_coded.fmt.pix;
+	unsigned int width = ALIGN(pix_format->width, 32);
+	unsigned int luma_height = ALIGN(pix_format->height, 32);
+	unsigned int chroma_height = ALIGN(pix_format->height, 64) / 2;
+
+	layout->chroma_offset = width * luma_height;
+	layout->extra_offset = layout->chroma_offset + width * chroma_height;
+	layout->size = layout->extra_offset;
+
+	if (!extra) {
+		layout->extra_stride = 0;
+		return;
+	}
+
+	layout->extra_stride = ALIGN(width / 4, 32);
+	layout->size += layout->extra_stride * (luma_height + chroma_height);
+}
+
+/* Loop Filter */
+
+bool cedrus_dec_skip_loop_filter_check(struct cedrus_context *ctx,
+				       bool reference)
+{
+	u32 id = V4L2_CID_CEDRUS_DEC_SKIP_LOOP_FILTER;
+
+	switch (cedrus_context_ctrl_value(ctx, id)) {
+	case CEDRUS_DEC_SKIP_LOOP_FILTER_NON_REF:
+		return !reference;
+	case CEDRUS_DEC_SKIP_LOOP_FILTER_ALL:
+		return true;
+	default:
+		return false;
+	}
+}
+
+/* QP Map */
+
+/*
+ * Fill the map with the QP of a slice, from the block where it starts to the
+ * end of the picture, in raster order of square blocks of macroblocks (which
+ * are CTBs for H.265). The slices of a picture come in decoding order, so that
+ * each one overwrites the blocks following its own start.
+ */
+void cedrus_dec_qp_map_fill(struct cedrus_context *ctx, unsigned int block_mbs,
+			    unsigned int block_index, int qp)
+{
+	struct v4l2_pix_format *pix_format = &ctx->v4l2.format_coded.fmt.pix;
+	struct v4l2_pix_format *pix_format_picture =
+		&ctx->v4l2.format_picture.fmt.pix;
+	struct vb2_buffer *vb2_buffer = &ctx->job.buffer_picture->vb2_buf;
+	unsigned int width_mbs = DIV_ROUND_UP(pix_format->width, 16);
+	unsigned int height_mbs = DIV_ROUND_UP(pix_format->height, 16);
+	unsigned int width_blocks = DIV_ROUND_UP(width_mbs, block_mbs);
+	unsigned int x, y, row;
+	u8 *map;
+
+	if (!ctx->v4l2.qp_map_picture)
+		return;
+
+	/* CPU writes would be lost to cache invalidation when dequeued. */
+	if (vb2_buffer->vb2_queue->non_coherent_mem)
+		return;
+
+	map = vb2_plane_vaddr(vb2_buffer, 0);
+	if (!map)
+		return;
+
+	map += pix_format_picture->sizeimage -
+	       cedrus_dec_qp_map_size(&ctx->v4l2.format_coded.fmt.pix);
+	qp = clamp(qp, 0, 51);
+
+	x = (block_index % width_blocks) * block_mbs;
+	y = (block_index / width_blocks) * block_mbs;
+
+	if (y >= height_mbs)
+		return;
+
+	/* Rest of the first row of blocks. */
+	if (x) {
+		for (row = y; row < min(y + block_mbs, height_mbs); row++)
+			memset(map + row * width_mbs + x, qp, width_mbs - x);
+
+		y += block_mbs;
+	}
+
+	/* Whole macroblock rows are contiguous. */
+	if (y < height_mbs)
+		memset(map + y * width_mbs, qp, (height_mbs - y) * width_mbs);
+}
+
+/*
+ * With the secondary output, the primary output holds the engine reference
+ * pictures, in auxiliary buffers kept by the engine, while the secondary
+ * output writes to the picture buffer.
+ */
+static int
+cedrus_dec_format_picture_secondary_configure(struct cedrus_context *ctx)
 {
 	struct cedrus_device *dev = ctx->proc->dev;
 	struct v4l2_pix_format *pix_format = &ctx->v4l2.format_picture.fmt.pix;
@@ -170,6 +523,52 @@ int cedrus_dec_format_picture_configure(struct cedrus_context *ctx)
 	u32 value;
 
 	switch (pix_format->pixelformat) {
+	case V4L2_PIX_FMT_NV12:
+	case V4L2_PIX_FMT_P010:
+		value = VE_SECONDARY_OUT_FMT_EXT_NV12;
+		break;
+	case V4L2_PIX_FMT_NV12_32L32:
+		value = VE_SECONDARY_OUT_FMT_EXT_TILED_32_NV12;
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	cedrus_write(dev, VE_PRIMARY_OUT_FMT,
+		     VE_PRIMARY_OUT_FMT_TILED_32_NV12 | value);
+
+	chroma_size = pix_format->bytesperline * pix_format->height / 2;
+	cedrus_write(dev, VE_CHROMA_BUF_LEN,
+		     VE_SECONDARY_OUT_FMT_EXT |
+		     VE_CHROMA_BUF_LEN_SDRT(chroma_size / 2));
+
+	luma_stride = pix_format->bytesperline;
+	chroma_stride = luma_stride / 2;
+
+	value = VE_SECONDARY_FB_LINE_STRIDE_LUMA(luma_stride) |
+		VE_SECONDARY_FB_LINE_STRIDE_CHROMA(chroma_stride);
+	cedrus_write(dev, VE_SECONDARY_FB_LINE_STRIDE, value);
+
+	return 0;
+}
+
+int cedrus_dec_format_picture_configure(struct cedrus_context *ctx)
+{
+	struct cedrus_device *dev = ctx->proc->dev;
+	struct v4l2_pix_format *pix_format = &ctx->v4l2.format_picture.fmt.pix;
+	u32 pixelformat = pix_format->pixelformat;
+	u32 luma_stride, chroma_stride;
+	u32 chroma_size;
+	u32 value;
+
+	if (cedrus_dec_format_picture_secondary_check(ctx))
+		return cedrus_dec_format_picture_secondary_configure(ctx);
+
+	/* The primary output holds tiled reference pictures. */
+	if (cedrus_dec_format_picture_rotate_check(ctx))
+		pixelformat = V4L2_PIX_FMT_NV12_32L32;
+
+	switch (pixelformat) {
 	case V4L2_PIX_FMT_NV12:
 		cedrus_write(dev, VE_PRIMARY_OUT_FMT, VE_PRIMARY_OUT_FMT_NV12);
 
@@ -243,6 +642,8 @@ static bool cedrus_dec_format_dynamic_check(struct cedrus_context *ctx,
 	struct v4l2_pix_format *pix_format = &format->fmt.pix;
 	struct v4l2_pix_format *pix_format_coded =
 		&ctx->v4l2.format_coded.fmt.pix;
+	struct v4l2_format format_coded = *format;
+	struct v4l2_format format_picture;
 	unsigned int buffer_type;
 	bool streaming;
 	bool busy;
@@ -265,21 +666,38 @@ static bool cedrus_dec_format_dynamic_check(struct cedrus_context *ctx,
 	if (streaming)
 		return false;
 
-	/*
-	 * The picture queue will be reconfigured, thus it must not have any
-	 * buffers allocated.
-	 */
+	/* Coded format must remain the same. */
+	if (pix_format->pixelformat != pix_format_coded->pixelformat)
+		return false;
+
 	buffer_type = cedrus_proc_buffer_type(ctx->proc,
 					      CEDRUS_FORMAT_TYPE_PICTURE);
 	busy = cedrus_context_queue_busy_check(ctx, buffer_type);
-	if (busy)
+	if (!busy)
+		return true;
+
+	/*
+	 * The picture queue will be reconfigured, thus it must not be
+	 * streaming. Its buffers are kept when the picture format derived
+	 * from the new coded format still fits, which is the case when
+	 * switching to a smaller or equal size (e.g. adaptive streaming).
+	 * Engine buffers attached to picture buffers grow when needed.
+	 */
+	streaming = cedrus_context_queue_streaming_check(ctx, buffer_type);
+	if (streaming)
 		return false;
 
-	/* Coded format must remain the same. */
-	if (pix_format->pixelformat != pix_format_coded->pixelformat)
+	if (cedrus_proc_format_coded_prepare(ctx, &format_coded))
 		return false;
 
-	return true;
+	format_picture = ctx->v4l2.format_picture;
+
+	if (cedrus_dec_format_picture_derive(ctx, &format_picture,
+					     &format_coded.fmt.pix))
+		return false;
+
+	return cedrus_context_queue_fit_check(ctx, buffer_type,
+					      format_picture.fmt.pix.sizeimage);
 }
 
 /* Size */
@@ -321,9 +739,15 @@ static const struct cedrus_proc_config cedrus_dec_config = {
 
 	.formats		= cedrus_dec_formats,
 	.formats_count		= ARRAY_SIZE(cedrus_dec_formats),
+
+	.ctrl_configs		= cedrus_dec_ctrl_configs,
+	.ctrl_configs_count	= ARRAY_SIZE(cedrus_dec_ctrl_configs),
 };
 
 static const struct cedrus_proc_ops cedrus_dec_ops = {
+	.ctrl_validate			= cedrus_dec_ctrl_validate,
+	.ctrl_prepare			= cedrus_dec_ctrl_prepare,
+
 	.format_picture_prepare		= cedrus_dec_format_picture_prepare,
 	.format_picture_configure	= cedrus_dec_format_picture_configure,
 
@@ -332,6 +756,8 @@ static const struct cedrus_proc_ops cedrus_dec_ops = {
 	.format_dynamic_check		= cedrus_dec_format_dynamic_check,
 
 	.size_picture_enum		= cedrus_dec_size_picture_enum,
+
+	.reset				= cedrus_dec_reset,
 };
 
 int cedrus_dec_setup(struct cedrus_device *dev)
@@ -14,12 +14,39 @@
 struct cedrus_device;
 struct cedrus_context;
 
+/*
+ * With a secondary output picture format, reference pictures are kept in a
+ * separate buffer in the 32x32 tiled layout, optionally followed by the two
+ * lower bits of 10-bit samples with a stride of a quarter of the width.
+ */
+struct cedrus_dec_ref_layout {
+	unsigned int	chroma_offset;
+	unsigned int	extra_offset;
+	unsigned int	extra_stride;
+	unsigned int	size;
+};
+
 /* Format */
 
 int cedrus_dec_format_coded_prepare(struct cedrus_context *ctx,
 				    struct v4l2_format *format);
 int cedrus_dec_format_coded_configure(struct cedrus_context *ctx);
 int cedrus_dec_format_picture_configure(struct cedrus_context *ctx);
+bool cedrus_dec_format_picture_secondary_check(struct cedrus_context *ctx);
+bool cedrus_dec_format_picture_rotate_check(struct cedrus_context *ctx);
+void cedrus_dec_format_ref_layout(struct cedrus_context *ctx,
+				  struct cedrus_dec_ref_layout *layout,
+				  bool extra);
+
+/* Loop Filter */
+
+bool cedrus_dec_skip_loop_filter_check(struct cedrus_context *ctx,
+				       bool reference);
+
+/* QP Map */
+
+void cedrus_dec_qp_map_fill(struct cedrus_context *ctx, unsigned int block_mbs,
+			    unsigned int block_index, int qp);
 
 /* Decoder */
 
@@ -12,6 +12,7 @@
 #include <linux/types.h>
 #include <linux/videodev2.h>
 #include <media/v4l2-ctrls.h>
+#include <media/v4l2-event.h>
 #include <media/v4l2-mem2mem.h>
 
 #include "cedrus.h"
@@ -21,6 +22,7 @@
 #include "cedrus_engine.h"
 #include "cedrus_proc.h"
 #include "cedrus_regs.h"
+#include "include/uapi/sunxi-cedrus.h"
 
 /* Helpers */
 
@@ -41,55 +43,101 @@ static void cedrus_dec_h264_mv_col_buf_dma(struct cedrus_buffer *cedrus_buffer,
 
 /* Context */
 
-static int cedrus_dec_h264_setup(struct cedrus_context *cedrus_ctx)
+static unsigned int
+cedrus_dec_h264_pic_info_frames(const struct v4l2_ctrl_h264_sps *sps)
+{
+	/* References are limited by the SPS, plus the decoded picture. */
+	return min_t(unsigned int, max(sps->max_num_ref_frames, 1) + 1,
+		     CEDRUS_DEC_H264_FRAME_NUM);
+}
+
+static unsigned int
+cedrus_dec_h264_pic_info_buf_size(struct cedrus_context *cedrus_ctx,
+				  const struct v4l2_ctrl_h264_sps *sps)
 {
-	struct device *dev = cedrus_ctx->proc->dev->dev;
-	struct cedrus_dec_h264_context *h264_ctx = cedrus_ctx->engine_ctx;
 	struct v4l2_pix_format *pix_format =
 		&cedrus_ctx->v4l2.format_coded.fmt.pix;
-	unsigned int pic_info_buf_size;
-	int ret;
-
-	/*
-	 * NOTE: All buffers allocated here are only used by HW, so we
-	 * can add DMA_ATTR_NO_KERNEL_MAPPING flag when allocating them.
-	 */
+	unsigned int frames = cedrus_dec_h264_pic_info_frames(sps);
+	unsigned int size;
 
 	/* Formula for picture buffer size is taken from CedarX source. */
 
 	if (pix_format->width > 2048)
-		pic_info_buf_size = CEDRUS_DEC_H264_FRAME_NUM * 0x4000;
+		size = frames * 0x4000;
 	else
-		pic_info_buf_size = CEDRUS_DEC_H264_FRAME_NUM * 0x1000;
+		size = frames * 0x1000;
+
+	/* Fields need twice the rows. */
+	if (sps->flags & V4L2_H264_SPS_FLAG_FRAME_MBS_ONLY)
+		size += pix_format->height * 64;
+	else
+		size += pix_format->height * 2 * 64;
+
+	return max_t(unsigned int, size, CEDRUS_DEC_H264_PIC_INFO_BUF_SIZE_MIN);
+}
+
+static int
+cedrus_dec_h264_pic_info_buf_alloc(struct cedrus_context *cedrus_ctx,
+				   const struct v4l2_ctrl_h264_sps *sps)
+{
+	struct cedrus_dec_h264_context *h264_ctx = cedrus_ctx->engine_ctx;
+	unsigned int size = cedrus_dec_h264_pic_info_buf_size(cedrus_ctx, sps);
+	dma_addr_t dma;
+	void *buf;
+
+	buf = cedrus_pool_alloc(cedrus_ctx, size, &dma);
+	if (!buf)
+		return -ENOMEM;
+
+	if (h264_ctx->pic_info_buf)
+		cedrus_pool_free(cedrus_ctx, h264_ctx->pic_info_buf_size,
+				 h264_ctx->pic_info_buf,
+				 h264_ctx->pic_info_buf_dma);
+
+	h264_ctx->pic_info_buf = buf;
+	h264_ctx->pic_info_buf_dma = dma;
+	h264_ctx->pic_info_buf_size = size;
+	h264_ctx->pic_info_frames = cedrus_dec_h264_pic_info_frames(sps);
+
+	return 0;
+}
+
+static int cedrus_dec_h264_setup(struct cedrus_context *cedrus_ctx)
+{
+	struct cedrus_device *dev = cedrus_ctx->proc->dev;
+	struct cedrus_dec_h264_context *h264_ctx = cedrus_ctx->engine_ctx;
+	struct v4l2_pix_format *pix_format =
+		&cedrus_ctx->v4l2.format_coded.fmt.pix;
+	const struct v4l2_ctrl_h264_sps *sps;
+	int ret;
 
 	/*
-	 * FIXME: If V4L2_H264_SPS_FLAG_FRAME_MBS_ONLY is set,
-	 * there is no need to multiply by 2.
+	 * NOTE: All buffers allocated here are only used by HW, so we
+	 * can get them from the pool, without kernel mapping.
 	 */
-	pic_info_buf_size += pix_format->height * 2 * 64;
 
-	if (pic_info_buf_size < CEDRUS_DEC_H264_PIC_INFO_BUF_SIZE_MIN)
-		pic_info_buf_size = CEDRUS_DEC_H264_PIC_INFO_BUF_SIZE_MIN;
+	/* The SPS is set before streaming, size from it. */
+	sps = cedrus_context_ctrl_data(cedrus_ctx, V4L2_CID_STATELESS_H264_SPS);
+	if (WARN_ON(!sps))
+		return -EINVAL;
 
-	h264_ctx->pic_info_buf_size = pic_info_buf_size;
-	h264_ctx->pic_info_buf =
-		dma_alloc_attrs(dev, h264_ctx->pic_info_buf_size,
-				&h264_ctx->pic_info_buf_dma,
-				GFP_KERNEL, DMA_ATTR_NO_KERNEL_MAPPING);
-	if (!h264_ctx->pic_info_buf)
-		return -ENOMEM;
+	spin_lock_init(&h264_ctx->coded_lock);
+
+	ret = cedrus_dec_h264_pic_info_buf_alloc(cedrus_ctx, sps);
+	if (ret)
+		return ret;
 
 	/*
 	 * That buffer is supposed to be 16kiB in size, and be aligned
-	 * on 16kiB as well. However, dma_alloc_attrs provides the
-	 * guarantee that we'll have a DMA address aligned on the
-	 * smallest page order that is greater to the requested size,
+	 * on 16kiB as well. However, dma_alloc_attrs (used by the pool)
+	 * provides the guarantee that we'll have a DMA address aligned on
+	 * the smallest page order that is greater to the requested size,
 	 * so we don't have to overallocate.
 	 */
 	h264_ctx->neighbor_info_buf =
-		dma_alloc_attrs(dev, CEDRUS_DEC_H264_NEIGHBOR_INFO_BUF_SIZE,
-				&h264_ctx->neighbor_info_buf_dma,
-				GFP_KERNEL, DMA_ATTR_NO_KERNEL_MAPPING);
+		cedrus_pool_alloc(cedrus_ctx,
+				  CEDRUS_DEC_H264_NEIGHBOR_INFO_BUF_SIZE,
+				  &h264_ctx->neighbor_info_buf_dma);
 	if (!h264_ctx->neighbor_info_buf) {
 		ret = -ENOMEM;
 		goto error_pic_info_buf;
@@ -98,111 +146,263 @@ static int cedrus_dec_h264_setup(struct cedrus_context *cedrus_ctx)
 	if (pix_format->width > 2048) {
 		/*
 		 * Formulas for deblock and intra prediction buffer sizes
-		 * are taken from CedarX source.
+		 * are taken from CedarX source. These buffers replace the
+		 * internal SRAM, whose contents don't survive jobs of other
+		 * contexts either, so they are shared by all the contexts.
 		 */
 
-		h264_ctx->deblk_buf_size =
-			ALIGN(pix_format->width, 32) * 12;
-		h264_ctx->deblk_buf =
-			dma_alloc_attrs(dev, h264_ctx->deblk_buf_size,
-					&h264_ctx->deblk_buf_dma,
-					GFP_KERNEL, DMA_ATTR_NO_KERNEL_MAPPING);
-		if (!h264_ctx->deblk_buf) {
-			ret = -ENOMEM;
+		ret = cedrus_pool_scratch_get(dev, CEDRUS_SCRATCH_DEC_DEBLK,
+					      ALIGN(pix_format->width, 32) *
+					      12);
+		if (ret)
 			goto error_neighbor_info_buf;
-		}
 
 		/*
 		 * NOTE: Multiplying by two deviates from CedarX logic, but it
 		 * is for some unknown reason needed for H264 4K decoding on H6.
 		 */
-		h264_ctx->intra_pred_buf_size =
-			ALIGN(pix_format->width, 64) * 5 * 2;
-		h264_ctx->intra_pred_buf =
-			dma_alloc_attrs(dev, h264_ctx->intra_pred_buf_size,
-					&h264_ctx->intra_pred_buf_dma,
-					GFP_KERNEL, DMA_ATTR_NO_KERNEL_MAPPING);
-		if (!h264_ctx->intra_pred_buf) {
-			ret = -ENOMEM;
+		ret = cedrus_pool_scratch_get(dev, CEDRUS_SCRATCH_DEC_INTRA,
+					      ALIGN(pix_format->width, 64) *
+					      5 * 2);
+		if (ret)
 			goto error_deblk_buf;
-		}
+
+		h264_ctx->dram_bufs = true;
 	}
 
+	h264_ctx->width = pix_format->width;
+
 	return 0;
 
 error_deblk_buf:
-	dma_free_attrs(dev, h264_ctx->deblk_buf_size,
-		       h264_ctx->deblk_buf,
-		       h264_ctx->deblk_buf_dma,
-		       DMA_ATTR_NO_KERNEL_MAPPING);
+	cedrus_pool_scratch_put(dev, CEDRUS_SCRATCH_DEC_DEBLK);
 
 error_neighbor_info_buf:
-	dma_free_attrs(dev, CEDRUS_DEC_H264_NEIGHBOR_INFO_BUF_SIZE,
-		       h264_ctx->neighbor_info_buf,
-		       h264_ctx->neighbor_info_buf_dma,
-		       DMA_ATTR_NO_KERNEL_MAPPING);
+	cedrus_pool_free(cedrus_ctx, CEDRUS_DEC_H264_NEIGHBOR_INFO_BUF_SIZE,
+			 h264_ctx->neighbor_info_buf,
+			 h264_ctx->neighbor_info_buf_dma);
 
 error_pic_info_buf:
-	dma_free_attrs(dev, h264_ctx->pic_info_buf_size,
-		       h264_ctx->pic_info_buf,
-		       h264_ctx->pic_info_buf_dma,
-		       DMA_ATTR_NO_KERNEL_MAPPING);
+	cedrus_pool_free(cedrus_ctx, h264_ctx->pic_info_buf_size,
+			 h264_ctx->pic_info_buf,
+			 h264_ctx->pic_info_buf_dma);
 
 	return ret;
 }
 
 static void cedrus_dec_h264_cleanup(struct cedrus_context *cedrus_ctx)
 {
-	struct device *dev = cedrus_ctx->proc->dev->dev;
+	struct cedrus_device *dev = cedrus_ctx->proc->dev;
 	struct cedrus_dec_h264_context *h264_ctx = cedrus_ctx->engine_ctx;
 
-	dma_free_attrs(dev, h264_ctx->pic_info_buf_size,
-		       h264_ctx->pic_info_buf,
-		       h264_ctx->pic_info_buf_dma,
-		       DMA_ATTR_NO_KERNEL_MAPPING);
+	cedrus_pool_free(cedrus_ctx, h264_ctx->pic_info_buf_size,
+			 h264_ctx->pic_info_buf,
+			 h264_ctx->pic_info_buf_dma);
 
-	dma_free_attrs(dev, CEDRUS_DEC_H264_NEIGHBOR_INFO_BUF_SIZE,
-		       h264_ctx->neighbor_info_buf,
-		       h264_ctx->neighbor_info_buf_dma,
-		       DMA_ATTR_NO_KERNEL_MAPPING);
+	cedrus_pool_free(cedrus_ctx, CEDRUS_DEC_H264_NEIGHBOR_INFO_BUF_SIZE,
+			 h264_ctx->neighbor_info_buf,
+			 h264_ctx->neighbor_info_buf_dma);
+
+	if (h264_ctx->dram_bufs) {
+		cedrus_pool_scratch_put(dev, CEDRUS_SCRATCH_DEC_DEBLK);
+		cedrus_pool_scratch_put(dev, CEDRUS_SCRATCH_DEC_INTRA);
+	}
+}
 
-	if (h264_ctx->deblk_buf_size)
-		dma_free_attrs(dev, h264_ctx->deblk_buf_size,
-			       h264_ctx->deblk_buf,
-			       h264_ctx->deblk_buf_dma,
-			       DMA_ATTR_NO_KERNEL_MAPPING);
+static int cedrus_dec_h264_restart(struct cedrus_context *cedrus_ctx)
+{
+	struct cedrus_dec_h264_context *h264_ctx = cedrus_ctx->engine_ctx;
+	struct cedrus_dec_h264_job *h264_job = cedrus_ctx->engine_job;
+	struct v4l2_pix_format *pix_format =
+		&cedrus_ctx->v4l2.format_coded.fmt.pix;
+	const struct v4l2_ctrl_h264_sps *sps;
+	int ret;
 
-	if (h264_ctx->intra_pred_buf_size)
-		dma_free_attrs(dev, h264_ctx->intra_pred_buf_size,
-			       h264_ctx->intra_pred_buf,
-			       h264_ctx->intra_pred_buf_dma,
-			       DMA_ATTR_NO_KERNEL_MAPPING);
+	/* Shared buffers are sized for the width, setup again otherwise. */
+	if (pix_format->width != h264_ctx->width)
+		return -EINVAL;
+
+	sps = cedrus_context_ctrl_data(cedrus_ctx, V4L2_CID_STATELESS_H264_SPS);
+	if (WARN_ON(!sps))
+		return -EINVAL;
+
+	if (cedrus_dec_h264_pic_info_buf_size(cedrus_ctx, sps) !=
+	    h264_ctx->pic_info_buf_size) {
+		ret = cedrus_dec_h264_pic_info_buf_alloc(cedrus_ctx, sps);
+		if (ret)
+			return ret;
+	}
+
+	/* References of the previous session are gone after a seek. */
+	h264_ctx->sram_valid = false;
+	h264_ctx->sram_scaling_matrix_valid = false;
+
+	memset(h264_job, 0, sizeof(*h264_job));
+
+	return 0;
 }
 
 /* Buffer */
 
-static void cedrus_dec_h264_buffer_cleanup(struct cedrus_context *cedrus_ctx,
-					   struct cedrus_buffer *cedrus_buffer)
+static unsigned int
+cedrus_dec_h264_mv_col_buf_size(struct cedrus_context *cedrus_ctx,
+				const struct v4l2_ctrl_h264_sps *sps)
+{
+	struct v4l2_pix_format *pix_format =
+		&cedrus_ctx->v4l2.format_coded.fmt.pix;
+	unsigned int field_size;
+
+	field_size = DIV_ROUND_UP(pix_format->width, 16) *
+		DIV_ROUND_UP(pix_format->height, 16) * 16;
+	if (!(sps->flags & V4L2_H264_SPS_FLAG_DIRECT_8X8_INFERENCE))
+		field_size = field_size * 2;
+	if (!(sps->flags & V4L2_H264_SPS_FLAG_FRAME_MBS_ONLY))
+		field_size = field_size * 2;
+
+	return field_size * 2;
+}
+
+static void cedrus_dec_h264_ref_dma(struct cedrus_context *ctx,
+				    struct cedrus_buffer *cedrus_buffer,
+				    dma_addr_t *luma_addr,
+				    dma_addr_t *chroma_addr)
+{
+	struct cedrus_dec_h264_buffer *h264_buffer =
+		cedrus_buffer->engine_buffer;
+	struct cedrus_dec_ref_layout layout;
+
+	/* Reference pictures are decoded in place without secondary output. */
+	if (!h264_buffer->ref_buf_size) {
+		cedrus_buffer_picture_dma(ctx, cedrus_buffer, luma_addr,
+					  chroma_addr);
+		return;
+	}
+
+	cedrus_dec_format_ref_layout(ctx, &layout, false);
+
+	*luma_addr = h264_buffer->ref_buf_dma;
+	*chroma_addr = h264_buffer->ref_buf_dma + layout.chroma_offset;
+}
+
+static void
+cedrus_dec_h264_buffer_mv_col_free(struct cedrus_context *cedrus_ctx,
+				   struct cedrus_buffer *cedrus_buffer)
 {
-	struct device *dev = cedrus_ctx->proc->dev->dev;
 	struct cedrus_dec_h264_buffer *h264_buffer =
 		cedrus_buffer->engine_buffer;
 
 	if (h264_buffer->mv_col_buf_size) {
-		dma_free_attrs(dev, h264_buffer->mv_col_buf_size,
-			       h264_buffer->mv_col_buf,
-			       h264_buffer->mv_col_buf_dma,
-			       DMA_ATTR_NO_KERNEL_MAPPING);
+		cedrus_pool_free(cedrus_ctx, h264_buffer->mv_col_buf_size,
+				 h264_buffer->mv_col_buf,
+				 h264_buffer->mv_col_buf_dma);
 
 		h264_buffer->mv_col_buf_size = 0;
 	}
 }
 
+static void cedrus_dec_h264_buffer_cleanup(struct cedrus_context *cedrus_ctx,
+					   struct cedrus_buffer *cedrus_buffer)
+{
+	struct cedrus_dec_h264_buffer *h264_buffer =
+		cedrus_buffer->engine_buffer;
+
+	cedrus_dec_h264_buffer_mv_col_free(cedrus_ctx, cedrus_buffer);
+
+	if (h264_buffer->ref_buf_size) {
+		cedrus_pool_free(cedrus_ctx, h264_buffer->ref_buf_size,
+				 h264_buffer->ref_buf,
+				 h264_buffer->ref_buf_dma);
+
+		h264_buffer->ref_buf_size = 0;
+	}
+}
+
+static int cedrus_dec_h264_buffer_mv_col_alloc(struct cedrus_context *cedrus_ctx,
+					       struct cedrus_buffer *cedrus_buffer,
+					       unsigned int size)
+{
+	struct cedrus_dec_h264_buffer *h264_buffer =
+		cedrus_buffer->engine_buffer;
+
+	cedrus_dec_h264_buffer_mv_col_free(cedrus_ctx, cedrus_buffer);
+
+	/* Buffer is never accessed by CPU, so it can come from the pool. */
+	h264_buffer->mv_col_buf =
+		cedrus_pool_alloc(cedrus_ctx, size,
+				  &h264_buffer->mv_col_buf_dma);
+	if (!h264_buffer->mv_col_buf)
+		return -ENOMEM;
+
+	h264_buffer->mv_col_buf_size = size;
+
+	return 0;
+}
+
+static int cedrus_dec_h264_buffer_ref_alloc(struct cedrus_context *cedrus_ctx,
+					    struct cedrus_buffer *cedrus_buffer)
+{
+	struct cedrus_dec_h264_buffer *h264_buffer =
+		cedrus_buffer->engine_buffer;
+	struct cedrus_dec_ref_layout layout;
+
+	cedrus_dec_format_ref_layout(cedrus_ctx, &layout, false);
+
+	/* Buffer is never accessed by CPU, so it can come from the pool. */
+	h264_buffer->ref_buf =
+		cedrus_pool_alloc(cedrus_ctx, layout.size,
+				  &h264_buffer->ref_buf_dma);
+	if (!h264_buffer->ref_buf)
+		return -ENOMEM;
+
+	h264_buffer->ref_buf_size = layout.size;
+
+	return 0;
+}
+
+static int cedrus_dec_h264_buffer_setup(struct cedrus_context *cedrus_ctx,
+					struct cedrus_buffer *cedrus_buffer)
+{
+	const struct v4l2_ctrl_h264_sps *sps;
+	unsigned int size;
+	int ret;
+
+	/*
+	 * The SPS is set before allocating buffers, so allocate from it here
+	 * instead of when running the first job with this buffer.
+	 */
+	sps = cedrus_context_ctrl_data(cedrus_ctx, V4L2_CID_STATELESS_H264_SPS);
+	if (WARN_ON(!sps))
+		return -EINVAL;
+
+	size = cedrus_dec_h264_mv_col_buf_size(cedrus_ctx, sps);
+
+	ret = cedrus_dec_h264_buffer_mv_col_alloc(cedrus_ctx, cedrus_buffer,
+						  size);
+	if (ret)
+		return ret;
+
+	if (!cedrus_dec_format_picture_secondary_check(cedrus_ctx))
+		return 0;
+
+	ret = cedrus_dec_h264_buffer_ref_alloc(cedrus_ctx, cedrus_buffer);
+	if (ret) {
+		cedrus_dec_h264_buffer_mv_col_free(cedrus_ctx, cedrus_buffer);
+		return ret;
+	}
+
+	return 0;
+}
+
 /* Job */
 
 static int cedrus_dec_h264_job_prepare(struct cedrus_context *ctx)
 {
 	struct cedrus_dec_h264_job *job = ctx->engine_job;
+	struct vb2_buffer *vb2_buffer = &ctx->job.buffer_coded->vb2_buf;
+	unsigned int coded_size = vb2_get_plane_payload(vb2_buffer, 0);
+	unsigned int offsets_count;
+	const u32 *offsets;
+	unsigned int i;
 	u32 id;
 
 	id = V4L2_CID_STATELESS_H264_SPS;
@@ -214,30 +414,76 @@ static int cedrus_dec_h264_job_prepare(struct cedrus_context *ctx)
 	id = V4L2_CID_STATELESS_H264_SCALING_MATRIX;
 	job->scaling_matrix = cedrus_context_ctrl_data(ctx, id);
 
+	id = V4L2_CID_STATELESS_H264_DECODE_PARAMS;
+	job->decode_params = cedrus_context_ctrl_data(ctx, id);
+
+	id = V4L2_CID_CEDRUS_H264_DEC_SLICE_OFFSETS;
+	offsets = cedrus_context_ctrl_data(ctx, id);
+	offsets_count = cedrus_context_ctrl_array_count(ctx, id);
+
 	id = V4L2_CID_STATELESS_H264_SLICE_PARAMS;
 	job->slice_params = cedrus_context_ctrl_data(ctx, id);
+	job->slices_count = 1;
 
 	id = V4L2_CID_STATELESS_H264_PRED_WEIGHTS;
 	job->pred_weights = cedrus_context_ctrl_data(ctx, id);
+	job->pred_weights_slices = false;
 
-	id = V4L2_CID_STATELESS_H264_DECODE_PARAMS;
-	job->decode_params = cedrus_context_ctrl_data(ctx, id);
+	/* Several slices are described by the private controls instead. */
+	if (offsets_count > 1) {
+		id = V4L2_CID_CEDRUS_H264_DEC_SLICES_PARAMS;
+		if (cedrus_context_ctrl_array_count(ctx, id) != offsets_count)
+			return -EINVAL;
+
+		job->slice_params = cedrus_context_ctrl_data(ctx, id);
+		job->slices_count = offsets_count;
+
+		id = V4L2_CID_CEDRUS_H264_DEC_SLICES_PRED_WEIGHTS;
+		if (cedrus_context_ctrl_array_count(ctx, id) == offsets_count) {
+			job->pred_weights = cedrus_context_ctrl_data(ctx, id);
+			job->pred_weights_slices = true;
+		}
+	}
+
+	for (i = 0; i < offsets_count; i++)
+		if (offsets[i] >= coded_size ||
+		    (i && offsets[i] <= offsets[i - 1]))
+			return -EINVAL;
+
+	job->slice_offsets = offsets;
 
 	return 0;
 }
 
+/*
+ * Slices of the same picture may follow each other in the coded buffer, at
+ * the offsets given along with their parameters. Each one ends where the next
+ * one starts, and the last one at the end of the coded data.
+ */
+static void cedrus_dec_h264_slice_bounds(struct cedrus_context *ctx,
+					 unsigned int coded_size,
+					 unsigned int *start,
+					 unsigned int *end)
+{
+	struct cedrus_dec_h264_job *job = ctx->engine_job;
+	unsigned int index = job->slice_index;
+
+	*start = job->slice_offsets ? job->slice_offsets[index] : 0;
+
+	if (job->slice_offsets && index + 1 < job->slices_count)
+		*end = job->slice_offsets[index + 1];
+	else
+		*end = coded_size;
+}
+
 static void cedrus_h264_write_sram(struct cedrus_context *ctx,
 				   unsigned int off,
 				   const void *data, size_t len)
 {
 	struct cedrus_device *dev = ctx->proc->dev;
-	const u32 *buffer = data;
-	size_t count = DIV_ROUND_UP(len, 4);
 
 	cedrus_write(dev, VE_AVC_SRAM_PORT_OFFSET, off << 2);
-
-	while (count--)
-		cedrus_write(dev, VE_AVC_SRAM_PORT_DATA, *buffer++);
+	cedrus_write_port(dev, VE_AVC_SRAM_PORT_DATA, data, len);
 }
 
 static void cedrus_fill_ref_pic(struct cedrus_context *ctx,
@@ -251,7 +497,7 @@ static void cedrus_fill_ref_pic(struct cedrus_context *ctx,
 	dma_addr_t luma_addr, chroma_addr;
 	dma_addr_t mv_col_buf_top_addr, mv_col_buf_bottom_addr;
 
-	cedrus_buffer_picture_dma(ctx, cedrus_buffer, &luma_addr, &chroma_addr);
+	cedrus_dec_h264_ref_dma(ctx, cedrus_buffer, &luma_addr, &chroma_addr);
 	cedrus_dec_h264_mv_col_buf_dma(cedrus_buffer, &mv_col_buf_top_addr,
 				       &mv_col_buf_bottom_addr);
 
@@ -268,19 +514,21 @@ static void cedrus_fill_ref_pic(struct cedrus_context *ctx,
 static int cedrus_write_frame_list(struct cedrus_context *ctx)
 {
 	struct cedrus_device *dev = ctx->proc->dev;
+	struct cedrus_dec_h264_context *h264_ctx = ctx->engine_ctx;
 	struct cedrus_dec_h264_job *h264_job = ctx->engine_job;
 	const struct v4l2_ctrl_h264_decode_params *decode =
 		h264_job->decode_params;
 	const struct v4l2_ctrl_h264_sps *sps = h264_job->sps;
-	struct v4l2_pix_format *pix_format = &ctx->v4l2.format_coded.fmt.pix;
 	struct cedrus_dec_h264_sram_ref_pic pic_list[CEDRUS_DEC_H264_FRAME_NUM];
 	struct cedrus_buffer *cedrus_buffer_picture;
 	struct cedrus_dec_h264_buffer *h264_buffer_picture;
 	unsigned long used_dpbs = 0;
+	unsigned int mv_col_buf_size;
 	u64 timestamp;
 	unsigned int position;
 	int output = -1;
 	unsigned int i;
+	int ret;
 
 	cedrus_buffer_picture = cedrus_job_buffer_picture(ctx);
 	h264_buffer_picture = cedrus_buffer_picture->engine_buffer;
@@ -305,16 +553,21 @@ static int cedrus_write_frame_list(struct cedrus_context *ctx)
 		h264_buffer_ref = cedrus_buffer_ref->engine_buffer;
 
 		position = h264_buffer_ref->position;
-		used_dpbs |= BIT(position);
 
 		if (timestamp == dpb->reference_ts) {
 			output = position;
 			continue;
 		}
 
+		/*
+		 * Only keep the positions of references, which are limited by
+		 * the SPS, so that pictures fit the picture info buffer.
+		 */
 		if (!(dpb->flags & V4L2_H264_DPB_ENTRY_FLAG_ACTIVE))
 			continue;
 
+		used_dpbs |= BIT(position);
+
 		cedrus_fill_ref_pic(ctx, cedrus_buffer_ref,
 				    dpb->top_field_order_cnt,
 				    dpb->bottom_field_order_cnt,
@@ -326,35 +579,22 @@ static int cedrus_write_frame_list(struct cedrus_context *ctx)
 	else
 		position = find_first_zero_bit(&used_dpbs, CEDRUS_DEC_H264_FRAME_NUM);
 
+	if (position >= h264_ctx->pic_info_frames)
+		return -EINVAL;
+
 	h264_buffer_picture->position = position;
 
 	/*
-	 * FIXME: This should be done when allocating buffers, using values from
-	 * controls provided after selecting the format.
+	 * The buffer is allocated along with the picture buffer, only grow it
+	 * when the SPS changed to require more since.
 	 */
-	if (!h264_buffer_picture->mv_col_buf_size) {
-		const struct v4l2_ctrl_h264_sps *sps = h264_job->sps;
-		unsigned int field_size;
-
-		field_size = DIV_ROUND_UP(pix_format->width, 16) *
-			DIV_ROUND_UP(pix_format->height, 16) * 16;
-		if (!(sps->flags & V4L2_H264_SPS_FLAG_DIRECT_8X8_INFERENCE))
-			field_size = field_size * 2;
-		if (!(sps->flags & V4L2_H264_SPS_FLAG_FRAME_MBS_ONLY))
-			field_size = field_size * 2;
-
-		h264_buffer_picture->mv_col_buf_size = field_size * 2;
-		/* Buffer is never accessed by CPU, so we can skip kernel mapping. */
-		h264_buffer_picture->mv_col_buf =
-			dma_alloc_attrs(dev->dev,
-					h264_buffer_picture->mv_col_buf_size,
-					&h264_buffer_picture->mv_col_buf_dma,
-					GFP_KERNEL, DMA_ATTR_NO_KERNEL_MAPPING);
-
-		if (!h264_buffer_picture->mv_col_buf) {
-			h264_buffer_picture->mv_col_buf_size = 0;
-			return -ENOMEM;
-		}
+	mv_col_buf_size = cedrus_dec_h264_mv_col_buf_size(ctx, sps);
+	if (h264_buffer_picture->mv_col_buf_size < mv_col_buf_size) {
+		ret = cedrus_dec_h264_buffer_mv_col_alloc(ctx,
+							  cedrus_buffer_picture,
+							  mv_col_buf_size);
+		if (ret)
+			return ret;
 	}
 
 	if (decode->flags & V4L2_H264_DECODE_PARAM_FLAG_FIELD_PIC)
@@ -369,8 +609,14 @@ static int cedrus_write_frame_list(struct cedrus_context *ctx)
 			    decode->bottom_field_order_cnt,
 			    &pic_list[position]);
 
-	cedrus_h264_write_sram(ctx, CEDRUS_DEC_H264_SRAM_FRAMEBUFFER_LIST,
-			       pic_list, sizeof(pic_list));
+	/* Slices of the same picture share the same list. */
+	if (!h264_ctx->sram_valid ||
+	    memcmp(h264_ctx->sram_frame_list, pic_list, sizeof(pic_list))) {
+		cedrus_h264_write_sram(ctx,
+				       CEDRUS_DEC_H264_SRAM_FRAMEBUFFER_LIST,
+				       pic_list, sizeof(pic_list));
+		memcpy(h264_ctx->sram_frame_list, pic_list, sizeof(pic_list));
+	}
 
 	cedrus_write(dev, VE_H264_OUTPUT_FRAME_IDX, position);
 
@@ -442,6 +688,7 @@ static void cedrus_write_ref_list1(struct cedrus_context *ctx)
 
 static void cedrus_write_scaling_lists(struct cedrus_context *ctx)
 {
+	struct cedrus_dec_h264_context *h264_ctx = ctx->engine_ctx;
 	struct cedrus_dec_h264_job *h264_job = ctx->engine_job;
 	const struct v4l2_ctrl_h264_scaling_matrix *scaling_matrix =
 		h264_job->scaling_matrix;
@@ -450,6 +697,15 @@ static void cedrus_write_scaling_lists(struct cedrus_context *ctx)
 	if (!(pps->flags & V4L2_H264_PPS_FLAG_SCALING_MATRIX_PRESENT))
 		return;
 
+	/* The scaling matrix usually only changes along with the PPS. */
+	if (h264_ctx->sram_scaling_matrix_valid &&
+	    !memcmp(&h264_ctx->sram_scaling_matrix, scaling_matrix,
+		    sizeof(*scaling_matrix)))
+		return;
+
+	h264_ctx->sram_scaling_matrix = *scaling_matrix;
+	h264_ctx->sram_scaling_matrix_valid = true;
+
 	cedrus_h264_write_sram(ctx, CEDRUS_DEC_H264_SRAM_SCALING_LIST_8x8_0,
 			       scaling_matrix->scaling_list_8x8[0],
 			       sizeof(scaling_matrix->scaling_list_8x8[0]));
@@ -506,7 +762,24 @@ static void cedrus_write_pred_weight_table(struct cedrus_context *ctx)
  * It turns out that using VE_H264_VLD_OFFSET to skip bits is not reliable. In
  * rare cases frame is not decoded correctly. However, setting offset to 0 and
  * skipping appropriate amount of bits with flush bits trigger always works.
+ *
+ * Instead of flushing the whole slice header 32 bits at a time, start the VLD
+ * at the last aligned address before the slice data and only flush the
+ * remaining bits. Variants with the flush skip quirk still flush everything
+ * from the start of the slice, or the aligned address before it.
  */
+static unsigned int cedrus_skip_offset(struct cedrus_device *dev,
+				       unsigned int slice_start,
+				       unsigned int header_bit_size)
+{
+	if (cedrus_capabilities_check(dev,
+				      CEDRUS_CAPABILITY_H264_DEC_FLUSH_SKIP))
+		return round_down(slice_start, CEDRUS_DEC_H264_VLD_ADDR_ALIGN);
+
+	return round_down(slice_start + header_bit_size / 8,
+			  CEDRUS_DEC_H264_VLD_ADDR_ALIGN);
+}
+
 static void cedrus_skip_bits(struct cedrus_device *dev, int num)
 {
 	int count = 0;
@@ -528,7 +801,6 @@ static void cedrus_skip_bits(struct cedrus_device *dev, int num)
 static void cedrus_set_params(struct cedrus_context *ctx)
 {
 	struct cedrus_device *dev = ctx->proc->dev;
-	struct cedrus_dec_h264_context *h264_ctx = ctx->engine_ctx;
 	struct cedrus_dec_h264_job *h264_job = ctx->engine_job;
 	const struct v4l2_ctrl_h264_decode_params *decode =
 		h264_job->decode_params;
@@ -538,20 +810,42 @@ static void cedrus_set_params(struct cedrus_context *ctx)
 	const struct v4l2_ctrl_h264_sps *sps = h264_job->sps;
 	struct v4l2_m2m_ctx *m2m_ctx = ctx->v4l2.fh.m2m_ctx;
 	struct v4l2_pix_format *pix_format = &ctx->v4l2.format_coded.fmt.pix;
-	dma_addr_t coded_addr;
+	struct cedrus_buffer *cedrus_buffer_picture =
+		cedrus_job_buffer_picture(ctx);
+	struct cedrus_dec_h264_buffer *h264_buffer_picture =
+		cedrus_buffer_picture->engine_buffer;
+	dma_addr_t coded_addr, addr;
 	unsigned int coded_size;
+	unsigned int slice_start;
+	unsigned int skip_offset;
 	unsigned int pic_width_in_mbs;
+	unsigned int mb_rows, mb_index;
+	unsigned int deblocking_idc;
 	bool mbaff_pic;
 	u32 value;
 
 	cedrus_job_buffer_coded_dma(ctx, &coded_addr, &coded_size);
+	cedrus_dec_h264_slice_bounds(ctx, coded_size, &slice_start,
+				     &coded_size);
+
+	skip_offset = cedrus_skip_offset(dev, slice_start,
+					 slice->header_bit_size);
+
+	h264_job->coded_size = coded_size;
+	h264_job->skip_offset = skip_offset;
+	h264_job->vld_resume = false;
+
+	/* Jobs waiting for coded data have a single deadline. */
+	if (READ_ONCE(cedrus_job_buffer_coded(ctx)->coded_open) &&
+	    !ctx->job.expires)
+		ctx->job.expires = jiffies + cedrus_context_job_timeout(ctx);
 
 	cedrus_write(dev, VE_H264_VLD_OFFSET, 0);
-	cedrus_write(dev, VE_H264_VLD_LEN, coded_size * 8);
+	cedrus_write(dev, VE_H264_VLD_LEN, (coded_size - skip_offset) * 8);
 
 	cedrus_write(dev, VE_H264_VLD_END, coded_addr + coded_size);
 	cedrus_write(dev, VE_H264_VLD_ADDR,
-		     VE_H264_VLD_ADDR_VAL(coded_addr) |
+		     VE_H264_VLD_ADDR_VAL(coded_addr + skip_offset) |
 		     VE_H264_VLD_ADDR_FIRST | VE_H264_VLD_ADDR_VALID |
 		     VE_H264_VLD_ADDR_LAST);
 
@@ -559,10 +853,11 @@ static void cedrus_set_params(struct cedrus_context *ctx)
 		cedrus_write(dev, VE_BUF_CTRL,
 			     VE_BUF_CTRL_INTRAPRED_MIXED_RAM |
 			     VE_BUF_CTRL_DBLK_MIXED_RAM);
-		cedrus_write(dev, VE_DBLK_DRAM_BUF_ADDR,
-			     h264_ctx->deblk_buf_dma);
-		cedrus_write(dev, VE_INTRAPRED_DRAM_BUF_ADDR,
-			     h264_ctx->intra_pred_buf_dma);
+		addr = cedrus_pool_scratch_dma(dev, CEDRUS_SCRATCH_DEC_DEBLK);
+		cedrus_write(dev, VE_DBLK_DRAM_BUF_ADDR, addr);
+
+		addr = cedrus_pool_scratch_dma(dev, CEDRUS_SCRATCH_DEC_INTRA);
+		cedrus_write(dev, VE_INTRAPRED_DRAM_BUF_ADDR, addr);
 	} else {
 		cedrus_write(dev, VE_BUF_CTRL,
 			     VE_BUF_CTRL_INTRAPRED_INT_SRAM |
@@ -578,7 +873,8 @@ static void cedrus_set_params(struct cedrus_context *ctx)
 	cedrus_write(dev, VE_H264_TRIGGER_TYPE,
 		     VE_H264_TRIGGER_TYPE_INIT_SWDEC);
 
-	cedrus_skip_bits(dev, slice->header_bit_size);
+	cedrus_skip_bits(dev, slice_start * 8 + slice->header_bit_size -
+			 skip_offset * 8);
 
 	if (V4L2_H264_CTRL_PRED_WEIGHTS_REQUIRED(pps, slice))
 		cedrus_write_pred_weight_table(ctx);
@@ -638,7 +934,7 @@ static void cedrus_set_params(struct cedrus_context *ctx)
 
 	if (decode->nal_ref_idc)
 		value |= BIT(12);
-	if (m2m_ctx->new_frame)
+	if (m2m_ctx->new_frame && !h264_job->slice_index)
 		value |= VE_H264_SHS_FIRST_SLICE_IN_PIC;
 	if (decode->flags & V4L2_H264_DECODE_PARAM_FLAG_FIELD_PIC)
 		value |= VE_H264_SHS_FIELD_PIC;
@@ -649,10 +945,15 @@ static void cedrus_set_params(struct cedrus_context *ctx)
 
 	cedrus_write(dev, VE_H264_SHS, value);
 
+	/* Deblocking is turned off for all edges with idc 1. */
+	deblocking_idc = slice->disable_deblocking_filter_idc;
+	if (cedrus_dec_skip_loop_filter_check(ctx, decode->nal_ref_idc))
+		deblocking_idc = 1;
+
 	value = VE_H264_SHS2_NUM_REF_IDX_ACTIVE_OVRD |
 		((slice->num_ref_idx_l0_active_minus1 & 0x1f) << 24) |
 		((slice->num_ref_idx_l1_active_minus1 & 0x1f) << 16) |
-		((slice->disable_deblocking_filter_idc & 0x3) << 8) |
+		((deblocking_idc & 0x3) << 8) |
 		((slice->slice_alpha_c0_offset_div2 & 0xf) << 4) |
 		(slice->slice_beta_offset_div2 & 0xf);
 
@@ -667,6 +968,22 @@ static void cedrus_set_params(struct cedrus_context *ctx)
 
 	cedrus_write(dev, VE_H264_SHS_QP, value);
 
+	/*
+	 * MBAFF slices start on macroblock pairs and field macroblock rows
+	 * span two frame macroblock rows: both start at the top one.
+	 */
+	if (mbaff_pic || decode->flags & V4L2_H264_DECODE_PARAM_FLAG_FIELD_PIC)
+		mb_rows = 2;
+	else
+		mb_rows = 1;
+
+	mb_index = slice->first_mb_in_slice % pic_width_in_mbs +
+		   slice->first_mb_in_slice / pic_width_in_mbs * mb_rows *
+		   pic_width_in_mbs;
+
+	cedrus_dec_qp_map_fill(ctx, 1, mb_index, pps->pic_init_qp_minus26 +
+			       26 + slice->slice_qp_delta);
+
 	// clear status flags
 	/* XXX: maybe reuse irq clear function */
 	value = cedrus_read(dev, VE_H264_STATUS);
@@ -674,28 +991,90 @@ static void cedrus_set_params(struct cedrus_context *ctx)
 
 	// enable int
 	/* XXX: Add H264 enable bit (0 value) */
-	cedrus_write(dev, VE_H264_CTRL,
-		     VE_H264_CTRL_SLICE_DECODE_INT |
-		     VE_H264_CTRL_DECODE_ERR_INT |
-		     VE_H264_CTRL_VLD_DATA_REQ_INT);
+	value = VE_H264_CTRL_SLICE_DECODE_INT |
+		VE_H264_CTRL_DECODE_ERR_INT |
+		VE_H264_CTRL_VLD_DATA_REQ_INT;
+
+	if (h264_buffer_picture->ref_buf_size)
+		value |= VE_H264_CTRL_ROTATE_SCALE_OUT_EN;
+
+	cedrus_write(dev, VE_H264_CTRL, value);
+}
+
+static void cedrus_dec_h264_sdrot_write(struct cedrus_context *ctx)
+{
+	struct cedrus_device *dev = ctx->proc->dev;
+	struct cedrus_buffer *cedrus_buffer = cedrus_job_buffer_picture(ctx);
+	struct cedrus_dec_h264_buffer *h264_buffer =
+		cedrus_buffer->engine_buffer;
+	unsigned int scale = ctx->v4l2.scale_down_picture;
+	dma_addr_t luma_addr, chroma_addr;
+	u32 value;
+
+	if (!h264_buffer->ref_buf_size) {
+		cedrus_write(dev, VE_H264_SDROT_CTRL, 0);
+		return;
+	}
+
+	/* Secondary output to the picture buffer. */
+	cedrus_job_buffer_picture_dma(ctx, &luma_addr, &chroma_addr);
+
+	value = VE_H264_SDROT_CTRL_ROTATE(ctx->v4l2.rotation_picture / 90);
+	if (scale)
+		value |= VE_H264_SDROT_CTRL_SCALE_VERT(scale) |
+			 VE_H264_SDROT_CTRL_SCALE_HORZ(scale) |
+			 VE_H264_SDROT_CTRL_EN;
+
+	cedrus_write(dev, VE_H264_SDROT_CTRL, value);
+	cedrus_write(dev, VE_H264_SDROT_LUMA, luma_addr);
+	cedrus_write(dev, VE_H264_SDROT_CHROMA, chroma_addr);
 }
 
 static int cedrus_dec_h264_job_configure(struct cedrus_context *cedrus_ctx)
 {
 	struct cedrus_device *dev = cedrus_ctx->proc->dev;
 	struct cedrus_dec_h264_context *h264_ctx = cedrus_ctx->engine_ctx;
+	struct cedrus_dec_h264_job *h264_job = cedrus_ctx->engine_job;
+	const struct v4l2_ctrl_h264_decode_params *decode =
+		h264_job->decode_params;
+	unsigned int pic_info_buf_size;
 	int ret;
 
-	cedrus_write(dev, VE_H264_SDROT_CTRL, 0);
+	/*
+	 * A new SPS only becomes active with an IDR picture, which doesn't use
+	 * the picture info of previous pictures, so resize the buffer then.
+	 */
+	pic_info_buf_size = cedrus_dec_h264_pic_info_buf_size(cedrus_ctx,
+							      h264_job->sps);
+	if (pic_info_buf_size > h264_ctx->pic_info_buf_size ||
+	    (pic_info_buf_size != h264_ctx->pic_info_buf_size &&
+	     decode->flags & V4L2_H264_DECODE_PARAM_FLAG_IDR_PIC)) {
+		ret = cedrus_dec_h264_pic_info_buf_alloc(cedrus_ctx,
+							 h264_job->sps);
+		if (ret)
+			return ret;
+	}
+
+	cedrus_dec_h264_sdrot_write(cedrus_ctx);
 	cedrus_write(dev, VE_H264_EXTRA_BUFFER1,
 		     h264_ctx->pic_info_buf_dma);
 	cedrus_write(dev, VE_H264_EXTRA_BUFFER2,
 		     h264_ctx->neighbor_info_buf_dma);
 
+	/* SRAM contents are lost when another context ran in-between. */
+	if (!cedrus_ctx->job.configured_kept) {
+		h264_ctx->sram_valid = false;
+		h264_ctx->sram_scaling_matrix_valid = false;
+	}
+
 	cedrus_write_scaling_lists(cedrus_ctx);
 	ret = cedrus_write_frame_list(cedrus_ctx);
-	if (ret)
+	if (ret) {
+		h264_ctx->sram_valid = false;
 		return ret;
+	}
+
+	h264_ctx->sram_valid = true;
 
 	cedrus_set_params(cedrus_ctx);
 
@@ -705,16 +1084,146 @@ static int cedrus_dec_h264_job_configure(struct cedrus_context *cedrus_ctx)
 static void cedrus_dec_h264_job_trigger(struct cedrus_context *ctx)
 {
 	struct cedrus_device *dev = ctx->proc->dev;
+	struct cedrus_dec_h264_job *job = ctx->engine_job;
+
+	/* The VLD picks up the appended coded data on its own. */
+	if (job->vld_resume) {
+		job->vld_resume = false;
+		return;
+	}
 
 	cedrus_write(dev, VE_H264_TRIGGER_TYPE,
 		     VE_H264_TRIGGER_TYPE_AVC_SLICE_DECODE);
 }
 
+/*
+ * Extend the VLD input with the coded data appended to the open coded buffer
+ * of the job, or park the job on the engine until there is some. This is
+ * called with the coded lock held.
+ * XXX: The VLD is assumed to resume from the new end and length once the data
+ * request status is cleared, without another trigger. This was not checked on
+ * hardware, so coded data appends are only available as experimental.
+ */
+static int cedrus_dec_h264_coded_extend(struct cedrus_context *ctx)
+{
+	struct cedrus_device *dev = ctx->proc->dev;
+	struct cedrus_dec_h264_job *job = ctx->engine_job;
+	struct cedrus_buffer *cedrus_buffer = cedrus_job_buffer_coded(ctx);
+	dma_addr_t coded_addr;
+	unsigned int coded_size;
+	u32 value;
+
+	cedrus_job_buffer_coded_dma(ctx, &coded_addr, &coded_size);
+
+	if (coded_size <= job->coded_size) {
+		/* The buffer was closed without the data asked for. */
+		if (!cedrus_buffer->coded_open)
+			return -EIO;
+
+		cedrus_context_job_park(ctx);
+		job->coded_parked = true;
+
+		return -EAGAIN;
+	}
+
+	job->coded_size = coded_size;
+	job->vld_resume = true;
+
+	cedrus_write(dev, VE_H264_VLD_LEN,
+		     (coded_size - job->skip_offset) * 8);
+	cedrus_write(dev, VE_H264_VLD_END, coded_addr + coded_size);
+
+	value = cedrus_read(dev, VE_H264_CTRL);
+	value |= VE_H264_CTRL_SLICE_DECODE_INT |
+		 VE_H264_CTRL_DECODE_ERR_INT |
+		 VE_H264_CTRL_VLD_DATA_REQ_INT;
+
+	cedrus_write(dev, VE_H264_CTRL, value);
+
+	return 0;
+}
+
+static int cedrus_dec_h264_job_continue(struct cedrus_context *ctx)
+{
+	struct cedrus_dec_h264_context *h264_ctx = ctx->engine_ctx;
+	struct cedrus_dec_h264_job *job = ctx->engine_job;
+	int ret;
+
+	/* The next slice of the picture is programmed in full. */
+	if (job->slice_next) {
+		job->slice_next = false;
+		job->slice_index++;
+		job->slice_params++;
+
+		if (job->pred_weights_slices)
+			job->pred_weights++;
+
+		return cedrus_dec_h264_job_configure(ctx);
+	}
+
+	spin_lock(&h264_ctx->coded_lock);
+	ret = cedrus_dec_h264_coded_extend(ctx);
+	spin_unlock(&h264_ctx->coded_lock);
+
+	return ret;
+}
+
+static void cedrus_dec_h264_job_finish(struct cedrus_context *ctx, int state)
+{
+	struct cedrus_dec_h264_context *h264_ctx = ctx->engine_ctx;
+	struct cedrus_dec_h264_job *job = ctx->engine_job;
+	struct vb2_v4l2_buffer *v4l2_buffer = ctx->job.buffer_picture;
+	struct cedrus_h264_dec_error *error;
+	struct v4l2_event event = { 0 };
+
+	/* No more coded data is taken once the slice is done. */
+	spin_lock(&h264_ctx->coded_lock);
+	WRITE_ONCE(cedrus_job_buffer_coded(ctx)->coded_open, false);
+	job->coded_parked = false;
+	spin_unlock(&h264_ctx->coded_lock);
+
+	if (state == VB2_BUF_STATE_DONE || !job->error_status)
+		return;
+
+	/*
+	 * Held capture buffers are returned with the state of the last slice,
+	 * so flag the errored picture directly. The flag is cleared when the
+	 * buffer is queued again.
+	 */
+	if (v4l2_buffer)
+		v4l2_buffer->flags |= V4L2_BUF_FLAG_ERROR;
+
+	event.type = V4L2_EVENT_CEDRUS_H264_DEC_ERROR;
+
+	error = (struct cedrus_h264_dec_error *)event.u.data;
+	error->timestamp = ctx->job.buffer_coded->vb2_buf.timestamp;
+	error->status = job->error_status;
+	error->mb_num = job->error_mb_num;
+	error->error_case = job->error_case;
+
+	v4l2_event_queue_fh(&ctx->v4l2.fh, &event);
+}
+
 /* IRQ */
 
+static bool cedrus_dec_h264_coded_pending(struct cedrus_context *ctx)
+{
+	struct cedrus_dec_h264_job *job = ctx->engine_job;
+	struct cedrus_buffer *cedrus_buffer = cedrus_job_buffer_coded(ctx);
+	struct vb2_buffer *vb2_buffer = &cedrus_buffer->m2m_buffer.vb.vb2_buf;
+
+	/* Only the last slice extends to the coded data still to come. */
+	if (job->slice_index + 1 < job->slices_count)
+		return false;
+
+	return READ_ONCE(cedrus_buffer->coded_open) ||
+	       vb2_get_plane_payload(vb2_buffer, 0) > job->coded_size;
+}
+
 static int cedrus_dec_h264_irq_status(struct cedrus_context *ctx)
 {
 	struct cedrus_device *dev = ctx->proc->dev;
+	struct cedrus_dec_h264_job *job = ctx->engine_job;
 	u32 status;
 
 	status = cedrus_read(dev, VE_H264_STATUS);
@@ -723,10 +1232,27 @@ static int cedrus_dec_h264_irq_status(struct cedrus_context *ctx)
 	if (!status)
 		return CEDRUS_IRQ_NONE;
 
+	/* The engine ran out of coded data that is still being appended. */
+	if (status == VE_H264_STATUS_VLD_DATA_REQ_INT &&
+	    cedrus_dec_h264_coded_pending(ctx))
+		return CEDRUS_IRQ_CONTINUE;
+
 	if  (!(status & VE_H264_CTRL_SLICE_DECODE_INT) ||
 	     status & VE_H264_STATUS_VLD_DATA_REQ_INT ||
-	     status & VE_H264_STATUS_DECODE_ERR_INT)
+	     status & VE_H264_STATUS_DECODE_ERR_INT) {
+		/* Keep the error location before the engine is reset. */
+		job->error_status = status;
+		job->error_mb_num = cedrus_read(dev, VE_H264_CUR_MB_NUM);
+		job->error_case = cedrus_read(dev, VE_H264_ERROR_CASE);
+
 		return CEDRUS_IRQ_ERROR;
+	}
+
+	/* Remaining slices of the picture are decoded in the same job. */
+	if (job->slice_index + 1 < job->slices_count) {
+		job->slice_next = true;
+		return CEDRUS_IRQ_CONTINUE;
+	}
 
 	return CEDRUS_IRQ_SUCCESS;
 }
@@ -749,6 +1275,109 @@ static void cedrus_dec_h264_irq_disable(struct cedrus_context *ctx)
 	cedrus_write(dev, VE_H264_CTRL, value);
 }
 
+/* Ioctl */
+
+static int cedrus_dec_h264_coded_update(struct cedrus_buffer *cedrus_buffer,
+					struct cedrus_dec_coded_append *append)
+{
+	struct vb2_buffer *vb2_buffer = &cedrus_buffer->m2m_buffer.vb.vb2_buf;
+	bool last = append->flags & CEDRUS_DEC_CODED_APPEND_FLAG_LAST;
+
+	if (!cedrus_buffer->coded_open)
+		return -EBUSY;
+
+	/* The engine may already have read the coded data given so far. */
+	if (append->bytesused < vb2_get_plane_payload(vb2_buffer, 0) ||
+	    append->bytesused > vb2_plane_size(vb2_buffer, 0))
+		return -EINVAL;
+
+	vb2_set_plane_payload(vb2_buffer, 0, append->bytesused);
+	WRITE_ONCE(cedrus_buffer->coded_open, !last);
+
+	return 0;
+}
+
+static int cedrus_dec_h264_coded_append(struct cedrus_context *ctx,
+					struct cedrus_dec_coded_append *append)
+{
+	struct cedrus_dec_h264_context *h264_ctx = ctx->engine_ctx;
+	struct cedrus_dec_h264_job *job = ctx->engine_job;
+	unsigned int type = cedrus_proc_buffer_type(ctx->proc,
+						    CEDRUS_FORMAT_TYPE_CODED);
+	struct vb2_queue *queue = v4l2_m2m_get_vq(ctx->v4l2.fh.m2m_ctx, type);
+	struct cedrus_device *dev = ctx->proc->dev;
+	struct cedrus_buffer *cedrus_buffer;
+	struct vb2_buffer *vb2_buffer;
+	bool last = append->flags & CEDRUS_DEC_CODED_APPEND_FLAG_LAST;
+	int ret;
+
+	if (append->flags & ~CEDRUS_DEC_CODED_APPEND_FLAG_LAST)
+		return -EINVAL;
+
+	/* CPU writes would not reach the engine without cache maintenance. */
+	if (queue->non_coherent_mem)
+		return -EINVAL;
+
+	vb2_buffer = vb2_get_buffer(queue, append->index);
+	if (!vb2_buffer)
+		return -EINVAL;
+
+	cedrus_buffer = cedrus_buffer_from_vb2(vb2_buffer);
+
+	/* The payload is given when the buffer is queued. */
+	if (vb2_buffer->state == VB2_BUF_STATE_DEQUEUED) {
+		WRITE_ONCE(cedrus_buffer->coded_open, !last);
+		return 0;
+	}
+
+	/* No job takes the coded data before streaming. */
+	if (!h264_ctx)
+		return cedrus_dec_h264_coded_update(cedrus_buffer, append);
+
+	spin_lock(&h264_ctx->coded_lock);
+
+	ret = cedrus_dec_h264_coded_update(cedrus_buffer, append);
+	if (ret)
+		goto complete;
+
+	/* Take back the job parked for this buffer, unless it timed out. */
+	if (!job->coded_parked ||
+	    ctx->job.buffer_coded != &cedrus_buffer->m2m_buffer.vb)
+		goto complete;
+
+	job->coded_parked = false;
+
+	if (cedrus_context_job_unpark(ctx))
+		goto complete;
+
+	/*
+	 * The job is parked again when no coded data was added, or failed
+	 * right away when the buffer got closed, with the watchdog resetting
+	 * the engine.
+	 */
+	if (cedrus_dec_h264_coded_extend(ctx) == -EIO)
+		mod_delayed_work(system_wq, &dev->watchdog_work, 0);
+
+complete:
+	spin_unlock(&h264_ctx->coded_lock);
+
+	return ret;
+}
+
+static long cedrus_dec_h264_ioctl(struct cedrus_context *ctx,
+				  unsigned int cmd, void *arg)
+{
+	switch (cmd) {
+	case VIDIOC_CEDRUS_DEC_CODED_APPEND:
+		if (!IS_ENABLED(CONFIG_VIDEO_SUNXI_CEDRUS_EXPERIMENTAL))
+			return -ENOTTY;
+
+		return cedrus_dec_h264_coded_append(ctx, arg);
+	default:
+		return -ENOTTY;
+	}
+}
+
 /* Engine */
 
 static const struct cedrus_engine_ops cedrus_dec_h264_ops = {
@@ -757,12 +1386,18 @@ static const struct cedrus_engine_ops cedrus_dec_h264_ops = {
 
 	.setup			= cedrus_dec_h264_setup,
 	.cleanup		= cedrus_dec_h264_cleanup,
+	.restart		= cedrus_dec_h264_restart,
 
+	.buffer_setup		= cedrus_dec_h264_buffer_setup,
 	.buffer_cleanup		= cedrus_dec_h264_buffer_cleanup,
 
 	.job_prepare		= cedrus_dec_h264_job_prepare,
 	.job_configure		= cedrus_dec_h264_job_configure,
 	.job_trigger		= cedrus_dec_h264_job_trigger,
+	.job_continue		= cedrus_dec_h264_job_continue,
+	.job_finish		= cedrus_dec_h264_job_finish,
+
+	.ioctl			= cedrus_dec_h264_ioctl,
 
 	.irq_status		= cedrus_dec_h264_irq_status,
 	.irq_clear		= cedrus_dec_h264_irq_clear,
@@ -811,6 +1446,34 @@ static const struct v4l2_ctrl_config cedrus_dec_h264_ctrl_configs[] = {
 		.max	= V4L2_STATELESS_H264_START_CODE_NONE,
 		.def	= V4L2_STATELESS_H264_START_CODE_NONE,
 	},
+	{
+		.id	= V4L2_CID_CEDRUS_H264_DEC_SLICE_OFFSETS,
+		.name	= "H264 Decoder Slice Offsets",
+		.type	= V4L2_CTRL_TYPE_U32,
+		.flags	= V4L2_CTRL_FLAG_DYNAMIC_ARRAY,
+		.step	= 1,
+		.min	= 0,
+		.max	= U32_MAX,
+		.def	= 0,
+		.dims	= { CEDRUS_H264_DEC_SLICES_MAX },
+		.ops	= &cedrus_context_ctrl_ops,
+	},
+	{
+		.id	= V4L2_CID_CEDRUS_H264_DEC_SLICES_PARAMS,
+		.name	= "H264 Decoder Slices Parameters",
+		.type	= V4L2_CTRL_TYPE_H264_SLICE_PARAMS,
+		.flags	= V4L2_CTRL_FLAG_DYNAMIC_ARRAY,
+		.dims	= { CEDRUS_H264_DEC_SLICES_MAX },
+		.ops	= &cedrus_context_ctrl_ops,
+	},
+	{
+		.id	= V4L2_CID_CEDRUS_H264_DEC_SLICES_PRED_WEIGHTS,
+		.name	= "H264 Decoder Slices Prediction Weights",
+		.type	= V4L2_CTRL_TYPE_H264_PRED_WEIGHTS,
+		.flags	= V4L2_CTRL_FLAG_DYNAMIC_ARRAY,
+		.dims	= { CEDRUS_H264_DEC_SLICES_MAX },
+		.ops	= &cedrus_context_ctrl_ops,
+	},
 };
 
 static const struct v4l2_frmsize_stepwise cedrus_dec_h264_frmsize = {
@@ -832,9 +1495,12 @@ const struct cedrus_engine cedrus_dec_h264 = {
 
 	.pixelformat		= V4L2_PIX_FMT_H264_SLICE,
 	.slice_based		= true,
+	.secondary_output	= true,
+	.qp_map			= true,
 	.ctrl_configs		= cedrus_dec_h264_ctrl_configs,
 	.ctrl_configs_count	= ARRAY_SIZE(cedrus_dec_h264_ctrl_configs),
 	.frmsize		= &cedrus_dec_h264_frmsize,
+	.mb_cycles		= 640,
 
 	.ctx_size		= sizeof(struct cedrus_dec_h264_context),
 	.job_size		= sizeof(struct cedrus_dec_h264_job),
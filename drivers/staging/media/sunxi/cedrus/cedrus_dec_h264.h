@@ -10,6 +10,7 @@
 #ifndef _CEDRUS_DEC_H264_H_
 #define _CEDRUS_DEC_H264_H_
 
+#include <linux/spinlock.h>
 #include <media/v4l2-ctrls.h>
 
 #define CEDRUS_DEC_H264_MAX_REF_IDX		32
@@ -18,21 +19,43 @@
 #define CEDRUS_DEC_H264_NEIGHBOR_INFO_BUF_SIZE	(32 * SZ_1K)
 #define CEDRUS_DEC_H264_PIC_INFO_BUF_SIZE_MIN	(130 * SZ_1K)
 
+#define CEDRUS_DEC_H264_VLD_ADDR_ALIGN		16
+
+/* XXX: move to regs */
+struct cedrus_dec_h264_sram_ref_pic {
+	__le32	top_field_order_cnt;
+	__le32	bottom_field_order_cnt;
+	__le32	frame_info;
+	__le32	luma_ptr;
+	__le32	chroma_ptr;
+	__le32	mv_col_top_ptr;
+	__le32	mv_col_bot_ptr;
+	__le32	reserved;
+} __packed;
+
 struct cedrus_dec_h264_context {
 	void		*pic_info_buf;
 	dma_addr_t	pic_info_buf_dma;
 	ssize_t		pic_info_buf_size;
+	unsigned int	pic_info_frames;
 
 	void		*neighbor_info_buf;
 	dma_addr_t	neighbor_info_buf_dma;
 
-	void		*deblk_buf;
-	dma_addr_t	deblk_buf_dma;
-	ssize_t		deblk_buf_size;
+	/* Deblocking and intra prediction buffers, shared in the pool. */
+	bool		dram_bufs;
+	/* Coded width the buffers were setup for, checked on restart. */
+	unsigned int	width;
+
+	/* Serializes coded data appends with the job taking them. */
+	spinlock_t	coded_lock;
 
-	void		*intra_pred_buf;
-	dma_addr_t	intra_pred_buf_dma;
-	ssize_t		intra_pred_buf_size;
+	/* Last SRAM contents, kept until another context runs. */
+	bool					sram_valid;
+	bool					sram_scaling_matrix_valid;
+	struct v4l2_ctrl_h264_scaling_matrix	sram_scaling_matrix;
+	struct cedrus_dec_h264_sram_ref_pic
+		sram_frame_list[CEDRUS_DEC_H264_FRAME_NUM];
 };
 
 struct cedrus_dec_h264_job {
@@ -42,6 +65,25 @@ struct cedrus_dec_h264_job {
 	const struct v4l2_ctrl_h264_slice_params	*slice_params;
 	const struct v4l2_ctrl_h264_pred_weights	*pred_weights;
 	const struct v4l2_ctrl_h264_decode_params	*decode_params;
+
+	/* Slices of the picture decoded one after the other in the job. */
+	const u32					*slice_offsets;
+	unsigned int					slices_count;
+	unsigned int					slice_index;
+	bool						slice_next;
+	bool						pred_weights_slices;
+
+	/* Coded data programmed so far, extended on VLD data requests. */
+	unsigned int					coded_size;
+	unsigned int					skip_offset;
+	bool						vld_resume;
+	/* Parked on the engine until more coded data is appended. */
+	bool						coded_parked;
+
+	/* Engine state when an error was reported, read from the IRQ. */
+	u32						error_status;
+	u32						error_mb_num;
+	u32						error_case;
 };
 
 struct cedrus_dec_h264_buffer {
@@ -50,7 +92,11 @@ struct cedrus_dec_h264_buffer {
 
 	void		*mv_col_buf;
 	dma_addr_t	mv_col_buf_dma;
-	ssize_t		mv_col_buf_size;
+	unsigned int	mv_col_buf_size;
+
+	void		*ref_buf;
+	dma_addr_t	ref_buf_dma;
+	unsigned int	ref_buf_size;
 };
 
 enum cedrus_dec_h264_pic_type {
@@ -70,18 +116,6 @@ enum cedrus_dec_h264_sram {
 	CEDRUS_DEC_H264_SRAM_SCALING_LIST_4x4	= 0x220,
 };
 
-/* XXX: move to regs */
-struct cedrus_dec_h264_sram_ref_pic {
-	__le32	top_field_order_cnt;
-	__le32	bottom_field_order_cnt;
-	__le32	frame_info;
-	__le32	luma_ptr;
-	__le32	chroma_ptr;
-	__le32	mv_col_top_ptr;
-	__le32	mv_col_bot_ptr;
-	__le32	reserved;
-} __packed;
-
 extern const struct cedrus_engine cedrus_dec_h264;
 
 #endif
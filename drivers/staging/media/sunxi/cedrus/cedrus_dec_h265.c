@@ -39,6 +39,28 @@ static void cedrus_dec_h265_mv_col_buf_dma(struct cedrus_buffer *cedrus_buffer,
 	*bottom_addr = addr;
 }
 
+static void cedrus_dec_h265_ref_dma(struct cedrus_context *ctx,
+				    struct cedrus_buffer *cedrus_buffer,
+				    dma_addr_t *luma_addr,
+				    dma_addr_t *chroma_addr)
+{
+	struct cedrus_dec_h265_buffer *h265_buffer =
+		cedrus_buffer->engine_buffer;
+	struct cedrus_dec_ref_layout layout;
+
+	/* Reference pictures are decoded in place without secondary output. */
+	if (!h265_buffer->ref_buf_size) {
+		cedrus_buffer_picture_dma(ctx, cedrus_buffer, luma_addr,
+					  chroma_addr);
+		return;
+	}
+
+	cedrus_dec_format_ref_layout(ctx, &layout, true);
+
+	*luma_addr = h265_buffer->ref_buf_dma;
+	*chroma_addr = h265_buffer->ref_buf_dma + layout.chroma_offset;
+}
+
 static void cedrus_dec_h265_sram_offset_write(struct cedrus_device *dev,
 					      u32 offset)
 {
@@ -48,18 +70,14 @@ static void cedrus_dec_h265_sram_offset_write(struct cedrus_device *dev,
 static void cedrus_dec_h265_sram_data_write(struct cedrus_device *dev,
 					    void *data, unsigned int size)
 {
-	u32 *word = data;
-
 	WARN_ON((size % sizeof(u32)) != 0);
 
-	while (size >= sizeof(u32)) {
-		cedrus_write(dev, VE_DEC_H265_SRAM_DATA, *word++);
-		size -= sizeof(u32);
-	}
+	cedrus_write_port(dev, VE_DEC_H265_SRAM_DATA, data,
+			  round_down(size, sizeof(u32)));
 }
 
-static void cedrus_dec_h265_bits_skip(struct cedrus_device *dev,
-				      unsigned int count)
+static int cedrus_dec_h265_bits_skip(struct cedrus_device *dev,
+				     unsigned int count)
 {
 	unsigned int written = 0;
 	int ret;
@@ -74,41 +92,80 @@ static void cedrus_dec_h265_bits_skip(struct cedrus_device *dev,
 
 		ret = cedrus_poll_cleared(dev, VE_DEC_H265_STATUS,
 					  VE_DEC_H265_STATUS_VLD_BUSY);
-		if (ret)
+		if (ret) {
 			dev_err_ratelimited(dev->dev,
 					    "timed out waiting to skip bits\n");
+			return ret;
+		}
 
 		written += skip_count;
 	}
+
+	return 0;
 }
 
-static u32 cedrus_dec_h265_bits_read(struct cedrus_device *dev,
-				     unsigned int count)
+static int cedrus_dec_h265_bits_read(struct cedrus_device *dev,
+				     unsigned int count, u32 *value)
 {
+	int ret;
+
 	cedrus_write(dev, VE_DEC_H265_TRIGGER,
 		     VE_DEC_H265_TRIGGER_SHOW_BITS |
 		     VE_DEC_H265_TRIGGER_TYPE_N_BITS(count));
 
-	/* XXX: check return code. */
-	cedrus_poll_cleared(dev, VE_DEC_H265_STATUS,
-			    VE_DEC_H265_STATUS_VLD_BUSY);
+	ret = cedrus_poll_cleared(dev, VE_DEC_H265_STATUS,
+				  VE_DEC_H265_STATUS_VLD_BUSY);
+	if (ret) {
+		dev_err_ratelimited(dev->dev,
+				    "timed out waiting to read bits\n");
+		return ret;
+	}
+
+	*value = cedrus_read(dev, VE_DEC_H265_BITS_READ);
 
-	return cedrus_read(dev, VE_DEC_H265_BITS_READ);
+	return 0;
+}
+
+/*
+ * Cedrus expects that bitstream pointer is actually at the end of the slice
+ * header instead of start of slice data. Padding is 8 bits at most (one bit
+ * set to 1 and at most seven bits set to 0), so we have to inspect only one
+ * byte before slice data. Return the number of padding bits in that byte.
+ */
+static int cedrus_dec_h265_padding_count(u8 padding)
+{
+	/* At least one bit must be set in that byte. */
+	if (padding == 0)
+		return -EINVAL;
+
+	/* Include the one bit. */
+	return __ffs(padding) + 1;
 }
 
 /* Context */
 
+static void cedrus_dec_h265_sram_invalidate(struct cedrus_context *ctx)
+{
+	struct cedrus_dec_h265_context *h265_ctx = ctx->engine_ctx;
+
+	h265_ctx->sram_frame_info_valid = 0;
+	h265_ctx->sram_ref_pic_list_count[0] = 0;
+	h265_ctx->sram_ref_pic_list_count[1] = 0;
+	h265_ctx->sram_scaling_matrix_valid = false;
+}
+
 static int cedrus_dec_h265_setup(struct cedrus_context *cedrus_ctx)
 {
-	struct device *dev = cedrus_ctx->proc->dev->dev;
+	struct cedrus_device *cedrus_dev = cedrus_ctx->proc->dev;
+	struct device *dev = cedrus_dev->dev;
 	struct cedrus_dec_h265_context *h265_ctx = cedrus_ctx->engine_ctx;
 	int ret;
 
-	/* Buffer is never accessed by CPU, so we can skip kernel mapping. */
+	/* Buffer is never accessed by CPU, so it can come from the pool. */
 	h265_ctx->neighbor_info_buf =
-		dma_alloc_attrs(dev, CEDRUS_DEC_H265_NEIGHBOR_INFO_BUF_SIZE,
-				&h265_ctx->neighbor_info_buf_addr, GFP_KERNEL,
-				DMA_ATTR_NO_KERNEL_MAPPING);
+		cedrus_pool_alloc(cedrus_ctx,
+				  CEDRUS_DEC_H265_NEIGHBOR_INFO_BUF_SIZE,
+				  &h265_ctx->neighbor_info_buf_addr);
 	if (!h265_ctx->neighbor_info_buf)
 		return -ENOMEM;
 
@@ -128,10 +185,9 @@ static int cedrus_dec_h265_setup(struct cedrus_context *cedrus_ctx)
 	return 0;
 
 error_neighbor_info_buf:
-	dma_free_attrs(dev, CEDRUS_DEC_H265_NEIGHBOR_INFO_BUF_SIZE,
-		       h265_ctx->neighbor_info_buf,
-		       h265_ctx->neighbor_info_buf_addr,
-		       DMA_ATTR_NO_KERNEL_MAPPING);
+	cedrus_pool_free(cedrus_ctx, CEDRUS_DEC_H265_NEIGHBOR_INFO_BUF_SIZE,
+			 h265_ctx->neighbor_info_buf,
+			 h265_ctx->neighbor_info_buf_addr);
 
 	return ret;
 
@@ -139,43 +195,175 @@ static int cedrus_dec_h265_setup(struct cedrus_context *cedrus_ctx)
 
 static void cedrus_dec_h265_cleanup(struct cedrus_context *cedrus_ctx)
 {
-	struct device *dev = cedrus_ctx->proc->dev->dev;
+	struct cedrus_device *cedrus_dev = cedrus_ctx->proc->dev;
+	struct device *dev = cedrus_dev->dev;
 	struct cedrus_dec_h265_context *h265_ctx = cedrus_ctx->engine_ctx;
 
-	dma_free_attrs(dev, CEDRUS_DEC_H265_NEIGHBOR_INFO_BUF_SIZE,
-		       h265_ctx->neighbor_info_buf,
-		       h265_ctx->neighbor_info_buf_addr,
-		       DMA_ATTR_NO_KERNEL_MAPPING);
+	cedrus_pool_free(cedrus_ctx, CEDRUS_DEC_H265_NEIGHBOR_INFO_BUF_SIZE,
+			 h265_ctx->neighbor_info_buf,
+			 h265_ctx->neighbor_info_buf_addr);
 
 	dma_free_coherent(dev, CEDRUS_DEC_H265_ENTRY_POINTS_BUF_SIZE,
 			  h265_ctx->entry_points_buf,
 			  h265_ctx->entry_points_buf_addr);
 }
 
+static int cedrus_dec_h265_restart(struct cedrus_context *cedrus_ctx)
+{
+	struct cedrus_dec_h265_context *h265_ctx = cedrus_ctx->engine_ctx;
+	struct cedrus_dec_h265_job *h265_job = cedrus_ctx->engine_job;
+
+	/* Buffers don't depend on the format, only references are reset. */
+	cedrus_dec_h265_sram_invalidate(cedrus_ctx);
+	h265_ctx->tiles.valid = false;
+
+	memset(h265_job, 0, sizeof(*h265_job));
+
+	return 0;
+}
+
 /* Buffer */
 
-static void cedrus_dec_h265_buffer_cleanup(struct cedrus_context *cedrus_ctx,
-					   struct cedrus_buffer *cedrus_buffer)
+static unsigned int
+cedrus_dec_h265_mv_col_buf_size(struct cedrus_context *cedrus_ctx,
+				const struct v4l2_ctrl_hevc_sps *sps)
+{
+	struct v4l2_pix_format *pix_format =
+		&cedrus_ctx->v4l2.format_coded.fmt.pix;
+	unsigned int log2_max_luma_coding_block_size;
+	unsigned int ctb_size_luma;
+
+	log2_max_luma_coding_block_size =
+		sps->log2_min_luma_coding_block_size_minus3 + 3 +
+		sps->log2_diff_max_min_luma_coding_block_size;
+
+	/* The smallest coding tree block size allowed by the standard is 16. */
+	ctb_size_luma = 1UL << max(log2_max_luma_coding_block_size, 4U);
+
+	/*
+	 * Each CTB requires a MV col buffer with a specific unit size.
+	 * Since the address is given with missing lsb bits, 1 KiB is
+	 * added to each buffer to ensure proper alignment.
+	 */
+	return DIV_ROUND_UP(pix_format->width, ctb_size_luma) *
+	       DIV_ROUND_UP(pix_format->height, ctb_size_luma) *
+	       CEDRUS_DEC_H265_MV_COL_BUF_UNIT_CTB_SIZE + SZ_1K;
+}
+
+static void cedrus_dec_h265_buffer_mv_col_free(struct cedrus_context *cedrus_ctx,
+					       struct cedrus_buffer *cedrus_buffer)
 {
-	struct device *dev = cedrus_ctx->proc->dev->dev;
 	struct cedrus_dec_h265_buffer *h265_buffer =
 		cedrus_buffer->engine_buffer;
 
 	if (h265_buffer->mv_col_buf_size) {
-		dma_free_attrs(dev, h265_buffer->mv_col_buf_size,
-			       h265_buffer->mv_col_buf,
-			       h265_buffer->mv_col_buf_dma,
-			       DMA_ATTR_NO_KERNEL_MAPPING);
+		cedrus_pool_free(cedrus_ctx, h265_buffer->mv_col_buf_size,
+				 h265_buffer->mv_col_buf,
+				 h265_buffer->mv_col_buf_dma);
 
 		h265_buffer->mv_col_buf_size = 0;
 	}
 }
 
+static void cedrus_dec_h265_buffer_cleanup(struct cedrus_context *cedrus_ctx,
+					   struct cedrus_buffer *cedrus_buffer)
+{
+	struct cedrus_dec_h265_buffer *h265_buffer =
+		cedrus_buffer->engine_buffer;
+
+	cedrus_dec_h265_buffer_mv_col_free(cedrus_ctx, cedrus_buffer);
+
+	if (h265_buffer->ref_buf_size) {
+		cedrus_pool_free(cedrus_ctx, h265_buffer->ref_buf_size,
+				 h265_buffer->ref_buf,
+				 h265_buffer->ref_buf_dma);
+
+		h265_buffer->ref_buf_size = 0;
+	}
+}
+
+static int cedrus_dec_h265_buffer_mv_col_alloc(struct cedrus_context *cedrus_ctx,
+					       struct cedrus_buffer *cedrus_buffer,
+					       unsigned int size)
+{
+	struct cedrus_dec_h265_buffer *h265_buffer =
+		cedrus_buffer->engine_buffer;
+
+	cedrus_dec_h265_buffer_mv_col_free(cedrus_ctx, cedrus_buffer);
+
+	/* Buffer is never accessed by CPU, so it can come from the pool. */
+	h265_buffer->mv_col_buf =
+		cedrus_pool_alloc(cedrus_ctx, size,
+				  &h265_buffer->mv_col_buf_dma);
+	if (!h265_buffer->mv_col_buf)
+		return -ENOMEM;
+
+	h265_buffer->mv_col_buf_size = size;
+
+	return 0;
+}
+
+static int cedrus_dec_h265_buffer_ref_alloc(struct cedrus_context *cedrus_ctx,
+					    struct cedrus_buffer *cedrus_buffer)
+{
+	struct cedrus_dec_h265_buffer *h265_buffer =
+		cedrus_buffer->engine_buffer;
+	struct cedrus_dec_ref_layout layout;
+
+	cedrus_dec_format_ref_layout(cedrus_ctx, &layout, true);
+
+	/* Buffer is never accessed by CPU, so it can come from the pool. */
+	h265_buffer->ref_buf =
+		cedrus_pool_alloc(cedrus_ctx, layout.size,
+				  &h265_buffer->ref_buf_dma);
+	if (!h265_buffer->ref_buf)
+		return -ENOMEM;
+
+	h265_buffer->ref_buf_size = layout.size;
+
+	return 0;
+}
+
+static int cedrus_dec_h265_buffer_setup(struct cedrus_context *cedrus_ctx,
+					struct cedrus_buffer *cedrus_buffer)
+{
+	const struct v4l2_ctrl_hevc_sps *sps;
+	unsigned int size;
+	int ret;
+
+	/*
+	 * The SPS is set before allocating buffers, so allocate from it here
+	 * instead of when running the first job with this buffer.
+	 */
+	sps = cedrus_context_ctrl_data(cedrus_ctx, V4L2_CID_STATELESS_HEVC_SPS);
+	if (WARN_ON(!sps))
+		return -EINVAL;
+
+	size = cedrus_dec_h265_mv_col_buf_size(cedrus_ctx, sps);
+
+	ret = cedrus_dec_h265_buffer_mv_col_alloc(cedrus_ctx, cedrus_buffer,
+						  size);
+	if (ret)
+		return ret;
+
+	if (!cedrus_dec_format_picture_secondary_check(cedrus_ctx))
+		return 0;
+
+	ret = cedrus_dec_h265_buffer_ref_alloc(cedrus_ctx, cedrus_buffer);
+	if (ret) {
+		cedrus_dec_h265_buffer_mv_col_free(cedrus_ctx, cedrus_buffer);
+		return ret;
+	}
+
+	return 0;
+}
+
 /* Job */
 
 static int cedrus_dec_h265_job_prepare(struct cedrus_context *ctx)
 {
 	struct cedrus_dec_h265_job *job = ctx->engine_job;
+	int mode;
 	u32 id;
 
 	id = V4L2_CID_STATELESS_HEVC_SPS;
@@ -187,9 +375,18 @@ static int cedrus_dec_h265_job_prepare(struct cedrus_context *ctx)
 	id = V4L2_CID_STATELESS_HEVC_SCALING_MATRIX;
 	job->scaling_matrix = cedrus_context_ctrl_data(ctx, id);
 
+	id = V4L2_CID_STATELESS_HEVC_DECODE_MODE;
+	mode = cedrus_context_ctrl_value(ctx, id);
+
 	id = V4L2_CID_STATELESS_HEVC_SLICE_PARAMS;
 	job->slice_params = cedrus_context_ctrl_data(ctx, id);
 
+	/* All the slices of the picture are decoded in the same job. */
+	if (mode == V4L2_STATELESS_HEVC_DECODE_MODE_FRAME_BASED)
+		job->slices_count = cedrus_context_ctrl_array_count(ctx, id);
+	else
+		job->slices_count = 1;
+
 	id = V4L2_CID_STATELESS_HEVC_ENTRY_POINT_OFFSETS;
 	job->entry_point_offsets = cedrus_context_ctrl_data(ctx, id);
 	job->entry_point_offsets_count =
@@ -209,12 +406,13 @@ cedrus_dec_h265_frame_info_write_single(struct cedrus_context *ctx,
 					u32 bottom_pic_order_cnt)
 {
 	struct cedrus_device *dev = ctx->proc->dev;
+	struct cedrus_dec_h265_context *h265_ctx = ctx->engine_ctx;
 	struct cedrus_dec_h265_sram_frame_info frame_info = { 0 };
 	dma_addr_t luma_addr, chroma_addr;
 	dma_addr_t mv_col_buf_top_addr, mv_col_buf_bottom_addr;
 	u32 sram_offset;
 
-	cedrus_buffer_picture_dma(ctx, buffer, &luma_addr, &chroma_addr);
+	cedrus_dec_h265_ref_dma(ctx, buffer, &luma_addr, &chroma_addr);
 
 	luma_addr = VE_DEC_H265_SRAM_DATA_ADDR_BASE(luma_addr);
 	chroma_addr = VE_DEC_H265_SRAM_DATA_ADDR_BASE(chroma_addr);
@@ -244,11 +442,20 @@ cedrus_dec_h265_frame_info_write_single(struct cedrus_context *ctx,
 			cpu_to_le32(mv_col_buf_top_addr);
 	}
 
+	/* Slices of the same picture share the same frame info. */
+	if (h265_ctx->sram_frame_info_valid & BIT(index) &&
+	    !memcmp(&h265_ctx->sram_frame_info[index], &frame_info,
+		    sizeof(frame_info)))
+		return;
+
 	sram_offset = VE_DEC_H265_SRAM_OFFSET_FRAME_INFO +
 		      VE_DEC_H265_SRAM_OFFSET_FRAME_INFO_UNIT * index;
 
 	cedrus_dec_h265_sram_offset_write(dev, sram_offset);
 	cedrus_dec_h265_sram_data_write(dev, &frame_info, sizeof(frame_info));
+
+	h265_ctx->sram_frame_info[index] = frame_info;
+	h265_ctx->sram_frame_info_valid |= BIT(index);
 }
 
 static void
@@ -273,17 +480,21 @@ cedrus_dec_h265_frame_info_write_dpb(struct cedrus_context *ctx,
 }
 
 static void
-cedrus_dec_h265_ref_pic_list_write(struct cedrus_device *dev,
+cedrus_dec_h265_ref_pic_list_write(struct cedrus_context *ctx,
 				   const struct v4l2_hevc_dpb_entry *dpb,
 				   const u8 list[], u8 num_ref_idx_active,
-				   u32 sram_offset)
+				   unsigned int list_index)
 {
+	struct cedrus_device *dev = ctx->proc->dev;
+	struct cedrus_dec_h265_context *h265_ctx = ctx->engine_ctx;
+	u32 words[CEDRUS_DEC_H265_SRAM_REF_PIC_LIST_WORDS] = { 0 };
+	unsigned int count = min_t(unsigned int, num_ref_idx_active,
+				   V4L2_HEVC_DPB_ENTRIES_NUM_MAX);
+	unsigned int size = DIV_ROUND_UP(count, 4) * sizeof(u32);
+	u32 sram_offset;
 	unsigned int i;
-	u32 word = 0;
-
-	cedrus_dec_h265_sram_offset_write(dev, sram_offset);
 
-	for (i = 0; i < num_ref_idx_active; i++) {
+	for (i = 0; i < count; i++) {
 		unsigned int shift = (i % 4) * 8;
 		unsigned int index = list[i];
 		u8 value = list[i];
@@ -292,15 +503,24 @@ cedrus_dec_h265_ref_pic_list_write(struct cedrus_device *dev,
 			value |= VE_DEC_H265_SRAM_REF_PIC_LIST_LT_REF;
 
 		/* Each SRAM word gathers up to 4 references. */
-		word |= value << shift;
-
-		/* Write the word to SRAM and clear it for the next batch. */
-		if ((i % 4) == 3 || i == (num_ref_idx_active - 1)) {
-			cedrus_dec_h265_sram_data_write(dev, &word,
-							sizeof(word));
-			word = 0;
-		}
+		words[i / 4] |= value << shift;
 	}
+
+	/* Slices of the same picture often share the same lists. */
+	if (h265_ctx->sram_ref_pic_list_count[list_index] == count &&
+	    !memcmp(h265_ctx->sram_ref_pic_list[list_index], words, size))
+		return;
+
+	if (list_index)
+		sram_offset = VE_DEC_H265_SRAM_OFFSET_REF_PIC_LIST1;
+	else
+		sram_offset = VE_DEC_H265_SRAM_OFFSET_REF_PIC_LIST0;
+
+	cedrus_dec_h265_sram_offset_write(dev, sram_offset);
+	cedrus_dec_h265_sram_data_write(dev, words, size);
+
+	memcpy(h265_ctx->sram_ref_pic_list[list_index], words, size);
+	h265_ctx->sram_ref_pic_list_count[list_index] = count;
 }
 
 static void cedrus_dec_h265_pred_weight_write(struct cedrus_device *dev,
@@ -354,11 +574,21 @@ static void
 cedrus_dec_h265_scaling_list_write(struct cedrus_context *cedrus_ctx)
 {
 	struct cedrus_device *dev = cedrus_ctx->proc->dev;
+	struct cedrus_dec_h265_context *h265_ctx = cedrus_ctx->engine_ctx;
 	struct cedrus_dec_h265_job *h265_job = cedrus_ctx->engine_job;
 	const struct v4l2_ctrl_hevc_scaling_matrix *scaling =
 		h265_job->scaling_matrix;
 	u32 i, j, k, value;
 
+	/* The scaling matrix usually only changes along with the PPS. */
+	if (h265_ctx->sram_scaling_matrix_valid &&
+	    !memcmp(&h265_ctx->sram_scaling_matrix, scaling,
+		    sizeof(*scaling)))
+		return;
+
+	h265_ctx->sram_scaling_matrix = *scaling;
+	h265_ctx->sram_scaling_matrix_valid = true;
+
 	cedrus_write(dev, VE_DEC_H265_SCALING_LIST_DC_COEF0,
 		     (scaling->scaling_list_dc_coef_32x32[1] << 24) |
 		     (scaling->scaling_list_dc_coef_32x32[0] << 16) |
@@ -449,6 +679,71 @@ static int cedrus_h265_is_low_delay(struct cedrus_dec_h265_job *h265_job)
 	return 0;
 }
 
+static bool cedrus_h265_is_reference(struct cedrus_dec_h265_job *h265_job)
+{
+	const struct v4l2_ctrl_hevc_slice_params *slice_params =
+		h265_job->slice_params;
+	u8 nal_unit_type = slice_params->nal_unit_type;
+
+	/* Sub-layer non-reference pictures have even types up to 14. */
+	return nal_unit_type > 14 || nal_unit_type & 1;
+}
+
+static void cedrus_dec_h265_tiles_update(struct cedrus_context *cedrus_ctx)
+{
+	struct cedrus_dec_h265_context *h265_ctx = cedrus_ctx->engine_ctx;
+	struct cedrus_dec_h265_job *h265_job = cedrus_ctx->engine_job;
+	struct cedrus_dec_h265_tiles *tiles = &h265_ctx->tiles;
+	const struct v4l2_ctrl_hevc_pps *pps = h265_job->pps;
+	unsigned int columns_count = pps->num_tile_columns_minus1 + 1;
+	unsigned int rows_count = pps->num_tile_rows_minus1 + 1;
+	unsigned int x, y, tx, ty, index;
+
+	if (WARN_ON(columns_count > CEDRUS_DEC_H265_TILE_COLUMNS_MAX ||
+		    rows_count > CEDRUS_DEC_H265_TILE_ROWS_MAX))
+		return;
+
+	/* Most PPS updates keep the same tile layout. */
+	if (tiles->valid && tiles->columns_count == columns_count &&
+	    tiles->rows_count == rows_count &&
+	    !memcmp(tiles->column_width_minus1, pps->column_width_minus1,
+		    columns_count) &&
+	    !memcmp(tiles->row_height_minus1, pps->row_height_minus1,
+		    rows_count))
+		return;
+
+	tiles->columns_count = columns_count;
+	tiles->rows_count = rows_count;
+	memcpy(tiles->column_width_minus1, pps->column_width_minus1,
+	       columns_count);
+	memcpy(tiles->row_height_minus1, pps->row_height_minus1, rows_count);
+
+	for (x = 0, tx = 0; tx < columns_count; tx++) {
+		tiles->column_start[tx] = x;
+		x += pps->column_width_minus1[tx] + 1;
+	}
+
+	for (y = 0, ty = 0; ty < rows_count; ty++) {
+		tiles->row_start[ty] = y;
+		y += pps->row_height_minus1[ty] + 1;
+	}
+
+	for (ty = 0; ty < rows_count; ty++) {
+		for (tx = 0; tx < columns_count; tx++) {
+			x = tiles->column_start[tx];
+			y = tiles->row_start[ty];
+			index = ty * columns_count + tx;
+
+			tiles->start_ctb[index] = (y << 16) | (x << 0);
+			tiles->end_ctb[index] =
+				((y + pps->row_height_minus1[ty]) << 16) |
+				((x + pps->column_width_minus1[tx]) << 0);
+		}
+	}
+
+	tiles->valid = true;
+}
+
 static void cedrus_dec_h265_tiles_write(struct cedrus_context *cedrus_ctx,
 					unsigned int ctb_addr_x,
 					unsigned int ctb_addr_y)
@@ -456,52 +751,49 @@ static void cedrus_dec_h265_tiles_write(struct cedrus_context *cedrus_ctx,
 	struct cedrus_device *dev = cedrus_ctx->proc->dev;
 	struct cedrus_dec_h265_context *h265_ctx = cedrus_ctx->engine_ctx;
 	struct cedrus_dec_h265_job *h265_job = cedrus_ctx->engine_job;
+	struct cedrus_dec_h265_tiles *tiles = &h265_ctx->tiles;
 	const struct v4l2_ctrl_hevc_slice_params *slice_params =
 		h265_job->slice_params;
 	const struct v4l2_ctrl_hevc_pps *pps = h265_job->pps;
 	const u32 *entry_points = h265_job->entry_point_offsets;
 	u32 num_entry_point_offsets = slice_params->num_entry_point_offsets;
 	u32 *entry_points_buf = h265_ctx->entry_points_buf;
-	int i, x, tx, y, ty;
+	unsigned int tiles_count;
+	unsigned int index;
+	int i, tx, ty;
 
-	for (x = 0, tx = 0; tx < pps->num_tile_columns_minus1 + 1; tx++) {
-		if (x + pps->column_width_minus1[tx] + 1 > ctb_addr_x)
-			break;
+	cedrus_dec_h265_tiles_update(cedrus_ctx);
+	if (!tiles->valid)
+		return;
 
-		x += pps->column_width_minus1[tx] + 1;
-	}
+	tiles_count = tiles->columns_count * tiles->rows_count;
 
-	for (y = 0, ty = 0; ty < pps->num_tile_rows_minus1 + 1; ty++) {
-		if (y + pps->row_height_minus1[ty] + 1 > ctb_addr_y)
+	for (tx = tiles->columns_count - 1; tx > 0; tx--)
+		if (tiles->column_start[tx] <= ctb_addr_x)
 			break;
 
-		y += pps->row_height_minus1[ty] + 1;
-	}
+	for (ty = tiles->rows_count - 1; ty > 0; ty--)
+		if (tiles->row_start[ty] <= ctb_addr_y)
+			break;
+
+	index = ty * tiles->columns_count + tx;
 
-	cedrus_write(dev, VE_DEC_H265_TILE_START_CTB, (y << 16) | (x << 0));
-	cedrus_write(dev, VE_DEC_H265_TILE_END_CTB,
-		     ((y + pps->row_height_minus1[ty]) << 16) |
-		     ((x + pps->column_width_minus1[tx]) << 0));
+	cedrus_write(dev, VE_DEC_H265_TILE_START_CTB, tiles->start_ctb[index]);
+	cedrus_write(dev, VE_DEC_H265_TILE_END_CTB, tiles->end_ctb[index]);
 
 	if (pps->flags & V4L2_HEVC_PPS_FLAG_ENTROPY_CODING_SYNC_ENABLED) {
 		for (i = 0; i < num_entry_point_offsets; i++)
 			entry_points_buf[i] = entry_points[i];
 	} else {
+		/* Each entry point starts the next tile in raster order. */
 		for (i = 0; i < num_entry_point_offsets; i++) {
-			if (tx + 1 >= pps->num_tile_columns_minus1 + 1) {
-				x = 0;
-				tx = 0;
-				y += pps->row_height_minus1[ty++] + 1;
-			} else {
-				x += pps->column_width_minus1[tx++] + 1;
-			}
+			if (++index >= tiles_count)
+				break;
 
 			entry_points_buf[i * 4 + 0] = entry_points[i];
 			entry_points_buf[i * 4 + 1] = 0x0;
-			entry_points_buf[i * 4 + 2] = (y << 16) | (x << 0);
-			entry_points_buf[i * 4 + 3] =
-				((y + pps->row_height_minus1[ty]) << 16) |
-				((x + pps->column_width_minus1[tx]) << 0);
+			entry_points_buf[i * 4 + 2] = tiles->start_ctb[index];
+			entry_points_buf[i * 4 + 3] = tiles->end_ctb[index];
 		}
 	}
 }
@@ -528,26 +820,40 @@ static int cedrus_dec_h265_job_configure(struct cedrus_context *cedrus_ctx)
 	unsigned int ctb_addr_x, ctb_addr_y;
 	struct cedrus_buffer *cedrus_buffer_picture;
 	struct cedrus_dec_h265_buffer *h265_buffer_picture;
+	struct vb2_buffer *vb2_buffer_coded;
+	unsigned int mv_col_buf_size;
+	unsigned int header_bits = 0;
 	dma_addr_t coded_addr;
 	unsigned int coded_size;
+	unsigned int slice_offset;
+	unsigned int slice_size;
 	u32 chroma_log2_weight_denom;
 	u32 num_entry_point_offsets;
 	u32 output_index;
 	bool output_field_pic;
-	u8 padding;
+	bool reference;
+	u8 *coded_data;
+	u32 padding;
 	int count;
 	u32 value;
+	int ret;
 
 	cedrus_buffer_picture = cedrus_job_buffer_picture(cedrus_ctx);
 	h265_buffer_picture = cedrus_buffer_picture->engine_buffer;
 
 	/*
-	 * If entry points offsets are present, we should get exactly the same
-	 * count from the slice params and the controls array.
+	 * SRAM contents are lost when another context ran in-between, while
+	 * further slices of the same job always follow this context.
+	 */
+	if (!h265_job->slice_index && !cedrus_ctx->job.configured_kept)
+		cedrus_dec_h265_sram_invalidate(cedrus_ctx);
+
+	/*
+	 * If entry points offsets are present, the slice params should not
+	 * need more than what is left in the controls array.
 	 */
 	num_entry_point_offsets = slice_params->num_entry_point_offsets;
-	if (num_entry_point_offsets &&
-	    num_entry_point_offsets != h265_job->entry_point_offsets_count)
+	if (num_entry_point_offsets > h265_job->entry_point_offsets_count)
 		return -ERANGE;
 
 	log2_max_luma_coding_block_size =
@@ -557,40 +863,63 @@ static int cedrus_dec_h265_job_configure(struct cedrus_context *cedrus_ctx)
 	width_in_ctb_luma =
 		DIV_ROUND_UP(sps->pic_width_in_luma_samples, ctb_size_luma);
 
-	/* MV column buffer size and allocation. */
 	/*
-	 * FIXME: This should be done when allocating buffers, using values from
-	 * controls provided after selecting the format.
+	 * The MV column buffer is allocated along with the picture buffer,
+	 * only grow it when the SPS changed to require more since.
 	 */
-	if (!h265_buffer_picture->mv_col_buf_size) {
-		/*
-		 * Each CTB requires a MV col buffer with a specific unit size.
-		 * Since the address is given with missing lsb bits, 1 KiB is
-		 * added to each buffer to ensure proper alignment.
-		 */
-		h265_buffer_picture->mv_col_buf_size =
-			DIV_ROUND_UP(pix_format->width, ctb_size_luma) *
-			DIV_ROUND_UP(pix_format->height, ctb_size_luma) *
-			CEDRUS_DEC_H265_MV_COL_BUF_UNIT_CTB_SIZE + SZ_1K;
-
-		/* Buffer is never accessed by CPU, so we can skip kernel mapping. */
-		h265_buffer_picture->mv_col_buf =
-			dma_alloc_attrs(dev->dev,
-					h265_buffer_picture->mv_col_buf_size,
-					&h265_buffer_picture->mv_col_buf_dma,
-					GFP_KERNEL, DMA_ATTR_NO_KERNEL_MAPPING);
-		if (!h265_buffer_picture->mv_col_buf) {
-			h265_buffer_picture->mv_col_buf_size = 0;
-			return -ENOMEM;
-		}
+	mv_col_buf_size = cedrus_dec_h265_mv_col_buf_size(cedrus_ctx, sps);
+	if (h265_buffer_picture->mv_col_buf_size < mv_col_buf_size) {
+		ret = cedrus_dec_h265_buffer_mv_col_alloc(cedrus_ctx,
+							  cedrus_buffer_picture,
+							  mv_col_buf_size);
+		if (ret)
+			return ret;
 	}
 
+	if (slice_params->data_byte_offset == 0)
+		return -EOPNOTSUPP;
+
 	cedrus_job_buffer_coded_dma(cedrus_ctx, &coded_addr, &coded_size);
 
+	/* Slices of the same picture follow each other in the coded buffer. */
+	slice_offset = h265_job->slice_offset;
+	if (slice_offset >= coded_size)
+		return -EINVAL;
+
+	if (h265_job->slices_count > 1)
+		slice_size = min(DIV_ROUND_UP(slice_params->bit_size, 8),
+				 coded_size - slice_offset);
+	else
+		slice_size = coded_size - slice_offset;
+
+	if (slice_params->data_byte_offset > slice_size)
+		return -EINVAL;
+
+	/*
+	 * When the coded buffer is mapped, find the end of the slice header
+	 * from the slice data byte offset on the CPU and start the bitstream
+	 * there directly, instead of walking the header with the VLD.
+	 */
+	vb2_buffer_coded = &cedrus_ctx->job.buffer_coded->vb2_buf;
+	coded_data = vb2_plane_vaddr(vb2_buffer_coded, 0);
+	if (coded_data) {
+		value = slice_offset + slice_params->data_byte_offset - 1;
+		padding = coded_data[value];
+
+		count = cedrus_dec_h265_padding_count(padding);
+		if (count < 0)
+			return count;
+
+		header_bits = slice_params->data_byte_offset * 8 - count;
+	}
+
 	/* Source offset and length in bits. */
 
-	cedrus_write(dev, VE_DEC_H265_BITS_OFFSET, 0);
-	cedrus_write(dev, VE_DEC_H265_BITS_LEN, coded_size * 8);
+	value = slice_offset * 8 + header_bits;
+	cedrus_write(dev, VE_DEC_H265_BITS_OFFSET, value);
+
+	value = (slice_offset + slice_size) * 8;
+	cedrus_write(dev, VE_DEC_H265_BITS_LEN, value);
 
 	/* Source beginning and end addresses. */
 
@@ -615,6 +944,11 @@ static int cedrus_dec_h265_job_configure(struct cedrus_context *cedrus_ctx)
 
 	cedrus_write(dev, VE_DEC_H265_DEC_CTB_ADDR, value);
 
+	cedrus_dec_qp_map_fill(cedrus_ctx, ctb_size_luma / 16,
+			       slice_params->slice_segment_addr,
+			       pps->init_qp_minus26 + 26 +
+			       slice_params->slice_qp_delta);
+
 	if ((pps->flags & V4L2_HEVC_PPS_FLAG_TILES_ENABLED) ||
 	    (pps->flags & V4L2_HEVC_PPS_FLAG_ENTROPY_CODING_SYNC_ENABLED)) {
 		cedrus_dec_h265_tiles_write(cedrus_ctx, ctb_addr_x, ctb_addr_y);
@@ -624,40 +958,32 @@ static int cedrus_dec_h265_job_configure(struct cedrus_context *cedrus_ctx)
 	}
 
 	/* Clear the number of correctly-decoded coding tree blocks. */
-	if (m2m_ctx->new_frame)
+	if (m2m_ctx->new_frame && !h265_job->slice_index)
 		cedrus_write(dev, VE_DEC_H265_DEC_CTB_NUM, 0);
 
 	/* Initialize bitstream access. */
 	cedrus_write(dev, VE_DEC_H265_TRIGGER, VE_DEC_H265_TRIGGER_INIT_SWDEC);
 
-	/*
-	 * Cedrus expects that bitstream pointer is actually at the end of the
-	 * slice header instead of start of slice data. Padding is 8 bits at
-	 * most (one bit set to 1 and at most seven bits set to 0), so we have
-	 * to inspect only one byte before slice data.
-	 */
-
-	if (slice_params->data_byte_offset == 0)
-		return -EOPNOTSUPP;
-
-	cedrus_dec_h265_bits_skip(dev,
-				  (slice_params->data_byte_offset - 1) * 8);
+	/* Otherwise skip the slice header with the VLD. */
+	if (!coded_data) {
+		value = (slice_params->data_byte_offset - 1) * 8;
 
-	padding = cedrus_dec_h265_bits_read(dev, 8);
-
-	/* XXX: rbsp final 1 bit? */
-	/* at least one bit must be set in that byte */
-	if (padding == 0)
-		return -EINVAL;
+		ret = cedrus_dec_h265_bits_skip(dev, value);
+		if (ret)
+			return ret;
 
-	for (count = 0; count < 8; count++)
-		if (padding & (1 << count))
-			break;
+		ret = cedrus_dec_h265_bits_read(dev, 8, &padding);
+		if (ret)
+			return ret;
 
-	/* Include the one bit. */
-	count++;
+		count = cedrus_dec_h265_padding_count(padding);
+		if (count < 0)
+			return count;
 
-	cedrus_dec_h265_bits_skip(dev, 8 - count);
+		ret = cedrus_dec_h265_bits_skip(dev, 8 - count);
+		if (ret)
+			return ret;
+	}
 
 	/* Bitstream parameters. */
 
@@ -821,6 +1147,10 @@ static int cedrus_dec_h265_job_configure(struct cedrus_context *cedrus_ctx)
 				  V4L2_HEVC_SLICE_PARAMS_FLAG_SLICE_DEBLOCKING_FILTER_DISABLED,
 				  slice_params->flags);
 
+	reference = cedrus_h265_is_reference(h265_job);
+	if (cedrus_dec_skip_loop_filter_check(cedrus_ctx, reference))
+		value |= VE_DEC_H265_DEC_SLICE_HDR_INFO1_FLAG_SLICE_DEBLOCKING_FILTER_DISABLED;
+
 	value |= VE_DEC_H265_FLAG(VE_DEC_H265_DEC_SLICE_HDR_INFO1_FLAG_SLICE_LOOP_FILTER_ACROSS_SLICES_ENABLED,
 				  V4L2_HEVC_SLICE_PARAMS_FLAG_SLICE_LOOP_FILTER_ACROSS_SLICES_ENABLED,
 				  slice_params->flags);
@@ -882,12 +1212,54 @@ static int cedrus_dec_h265_job_configure(struct cedrus_context *cedrus_ctx)
 
 	cedrus_write(dev, VE_DEC_H265_OUTPUT_FRAME_IDX, output_index);
 
+	/* Secondary output to the picture buffer. */
+
+	if (h265_buffer_picture->ref_buf_size) {
+		struct cedrus_dec_ref_layout layout;
+		dma_addr_t luma_addr, chroma_addr;
+		unsigned int scale;
+
+		cedrus_dec_format_ref_layout(cedrus_ctx, &layout, true);
+		cedrus_job_buffer_picture_dma(cedrus_ctx, &luma_addr,
+					      &chroma_addr);
+
+		scale = cedrus_ctx->v4l2.scale_down_picture;
+		value = cedrus_ctx->v4l2.rotation_picture / 90;
+		value = VE_DEC_H265_SDRT_CTRL_ROTATE(value);
+		if (scale)
+			value |= VE_DEC_H265_SDRT_CTRL_SCALE_VERT(scale) |
+				 VE_DEC_H265_SDRT_CTRL_SCALE_HORZ(scale) |
+				 VE_DEC_H265_SDRT_CTRL_EN;
+
+		cedrus_write(dev, VE_DEC_H265_SDRT_CTRL, value);
+
+		cedrus_write(dev, VE_DEC_H265_SDRT_LUMA_ADDR,
+			     VE_DEC_H265_SDRT_ADDR_BASE(luma_addr));
+		cedrus_write(dev, VE_DEC_H265_SDRT_CHROMA_ADDR,
+			     VE_DEC_H265_SDRT_ADDR_BASE(chroma_addr));
+
+		value = VE_DEC_H265_LOW_ADDR_SECONDARY_CHROMA(chroma_addr);
+		cedrus_write(dev, VE_DEC_H265_LOW_ADDR, value);
+
+		cedrus_write(dev, VE_DEC_H265_OFFSET_ADDR_FIRST_OUT,
+			     layout.extra_offset);
+
+		value = VE_DEC_H265_10BIT_CONFIGURE_SECOND_OUT_FMT(VE_DEC_H265_SECOND_OUT_FMT_P010) |
+			VE_DEC_H265_10BIT_CONFIGURE_FIRST_2BIT_STRIDE(layout.extra_stride);
+	} else {
+		cedrus_write(dev, VE_DEC_H265_LOW_ADDR, 0);
+
+		value = 0;
+	}
+
+	cedrus_write(dev, VE_DEC_H265_10BIT_CONFIGURE, value);
+
 	/* Reference picture list 0 (for P/B frames). */
 	if (slice_params->slice_type != V4L2_HEVC_SLICE_TYPE_I) {
-		cedrus_dec_h265_ref_pic_list_write(dev, dpb,
+		cedrus_dec_h265_ref_pic_list_write(cedrus_ctx, dpb,
 						   slice_params->ref_idx_l0,
 						   slice_params->num_ref_idx_l0_active_minus1 + 1,
-						   VE_DEC_H265_SRAM_OFFSET_REF_PIC_LIST0);
+						   0);
 
 		if ((pps->flags & V4L2_HEVC_PPS_FLAG_WEIGHTED_PRED) ||
 		    (pps->flags & V4L2_HEVC_PPS_FLAG_WEIGHTED_BIPRED))
@@ -903,10 +1275,10 @@ static int cedrus_dec_h265_job_configure(struct cedrus_context *cedrus_ctx)
 
 	/* Reference picture list 1 (for B frames). */
 	if (slice_params->slice_type == V4L2_HEVC_SLICE_TYPE_B) {
-		cedrus_dec_h265_ref_pic_list_write(dev, dpb,
+		cedrus_dec_h265_ref_pic_list_write(cedrus_ctx, dpb,
 						   slice_params->ref_idx_l1,
 						   slice_params->num_ref_idx_l1_active_minus1 + 1,
-						   VE_DEC_H265_SRAM_OFFSET_REF_PIC_LIST1);
+						   1);
 
 		if (pps->flags & V4L2_HEVC_PPS_FLAG_WEIGHTED_BIPRED)
 			cedrus_dec_h265_pred_weight_write(dev,
@@ -920,8 +1292,13 @@ static int cedrus_dec_h265_job_configure(struct cedrus_context *cedrus_ctx)
 	}
 
 
-	/* Enable relevant interrupts. */
-	cedrus_write(dev, VE_DEC_H265_CTRL, VE_DEC_H265_CTRL_IRQ_MASK);
+	/* Enable relevant interrupts and secondary output. */
+	value = VE_DEC_H265_CTRL_IRQ_MASK;
+
+	if (h265_buffer_picture->ref_buf_size)
+		value |= VE_DEC_H265_CTRL_ROTATE_SCALE_OUT_EN;
+
+	cedrus_write(dev, VE_DEC_H265_CTRL, value);
 
 	return 0;
 }
@@ -933,11 +1310,40 @@ static void cedrus_dec_h265_job_trigger(struct cedrus_context *ctx)
 	cedrus_write(dev, VE_DEC_H265_TRIGGER, VE_DEC_H265_TRIGGER_DEC_SLICE);
 }
 
+static int cedrus_dec_h265_job_continue(struct cedrus_context *ctx)
+{
+	struct cedrus_dec_h265_job *job = ctx->engine_job;
+	const struct v4l2_ctrl_hevc_slice_params *slice_params =
+		job->slice_params;
+
+	/* Coded data of the next slice follows the previous one. */
+	job->slice_offset += DIV_ROUND_UP(slice_params->bit_size, 8);
+	job->entry_point_offsets += slice_params->num_entry_point_offsets;
+	job->entry_point_offsets_count -= slice_params->num_entry_point_offsets;
+	job->slice_params++;
+	job->slice_index++;
+
+	return cedrus_dec_h265_job_configure(ctx);
+}
+
+/*
+ * Each slice is programmed in full, so the job can carry on with the next
+ * one after other contexts, once the SRAM contents are written again.
+ */
+static int cedrus_dec_h265_job_resume(struct cedrus_context *ctx)
+{
+	if (!ctx->job.configured_kept)
+		cedrus_dec_h265_sram_invalidate(ctx);
+
+	return cedrus_dec_h265_job_continue(ctx);
+}
+
 /* IRQ */
 
 static int cedrus_dec_h265_irq_status(struct cedrus_context *ctx)
 {
 	struct cedrus_device *dev = ctx->proc->dev;
+	struct cedrus_dec_h265_job *job = ctx->engine_job;
 	u32 status;
 
 	status = cedrus_read(dev, VE_DEC_H265_STATUS);
@@ -950,6 +1356,10 @@ static int cedrus_dec_h265_irq_status(struct cedrus_context *ctx)
 	     status & VE_DEC_H265_STATUS_CHECK_ERROR)
 		return CEDRUS_IRQ_ERROR;
 
+	/* Remaining slices of the picture are decoded in the same job. */
+	if (job->slice_index + 1 < job->slices_count)
+		return CEDRUS_IRQ_CONTINUE;
+
 	return CEDRUS_IRQ_SUCCESS;
 }
 
@@ -974,17 +1384,22 @@ static void cedrus_dec_h265_irq_disable(struct cedrus_context *ctx)
 /* Engine */
 
 static const struct cedrus_engine_ops cedrus_dec_h265_ops = {
+
 	.format_prepare		= cedrus_dec_format_coded_prepare,
 	.format_configure	= cedrus_dec_format_coded_configure,
 
 	.setup			= cedrus_dec_h265_setup,
 	.cleanup		= cedrus_dec_h265_cleanup,
+	.restart		= cedrus_dec_h265_restart,
 
+	.buffer_setup		= cedrus_dec_h265_buffer_setup,
 	.buffer_cleanup		= cedrus_dec_h265_buffer_cleanup,
 
 	.job_prepare		= cedrus_dec_h265_job_prepare,
 	.job_configure		= cedrus_dec_h265_job_configure,
 	.job_trigger		= cedrus_dec_h265_job_trigger,
+	.job_continue		= cedrus_dec_h265_job_continue,
+	.job_resume		= cedrus_dec_h265_job_resume,
 
 	.irq_status		= cedrus_dec_h265_irq_status,
 	.irq_clear		= cedrus_dec_h265_irq_clear,
@@ -1003,9 +1418,8 @@ static const struct v4l2_ctrl_config cedrus_dec_h265_ctrl_configs[] = {
 	},
 	{
 		.id	= V4L2_CID_STATELESS_HEVC_SLICE_PARAMS,
-		/* The driver can only handle 1 entry per slice for now. */
-		.dims	= { 1 },
-
+		/* One entry per slice in frame-based mode. */
+		.dims	= { CEDRUS_DEC_H265_SLICES_MAX },
 	},
 	{
 		.id	= V4L2_CID_STATELESS_HEVC_ENTRY_POINT_OFFSETS,
@@ -1019,7 +1433,7 @@ static const struct v4l2_ctrl_config cedrus_dec_h265_ctrl_configs[] = {
 	},
 	{
 		.id	= V4L2_CID_STATELESS_HEVC_DECODE_MODE,
-		.max	= V4L2_STATELESS_HEVC_DECODE_MODE_SLICE_BASED,
+		.max	= V4L2_STATELESS_HEVC_DECODE_MODE_FRAME_BASED,
 		.def	= V4L2_STATELESS_HEVC_DECODE_MODE_SLICE_BASED,
 	},
 	{
@@ -1048,9 +1462,12 @@ const struct cedrus_engine cedrus_dec_h265 = {
 
 	.pixelformat		= V4L2_PIX_FMT_HEVC_SLICE,
 	.slice_based		= true,
+	.secondary_output	= true,
+	.qp_map			= true,
 	.ctrl_configs		= cedrus_dec_h265_ctrl_configs,
 	.ctrl_configs_count	= ARRAY_SIZE(cedrus_dec_h265_ctrl_configs),
 	.frmsize		= &cedrus_dec_h265_frmsize,
+	.mb_cycles		= 600,
 
 	.ctx_size		= sizeof(struct cedrus_dec_h265_context),
 	.job_size		= sizeof(struct cedrus_dec_h265_job),
@@ -24,12 +24,64 @@
 #define CEDRUS_DEC_H265_ENTRY_POINTS_BUF_SIZE		(4 * SZ_1K)
 #define CEDRUS_DEC_H265_MV_COL_BUF_UNIT_CTB_SIZE	160
 
+/* Maximum number of slice segments per picture for level 5.2. */
+#define CEDRUS_DEC_H265_SLICES_MAX			200
+
+#define CEDRUS_DEC_H265_TILE_COLUMNS_MAX		20
+#define CEDRUS_DEC_H265_TILE_ROWS_MAX			22
+#define CEDRUS_DEC_H265_TILES_MAX			\
+	(CEDRUS_DEC_H265_TILE_COLUMNS_MAX * CEDRUS_DEC_H265_TILE_ROWS_MAX)
+
+/* Tile bounds in hardware layout, built once for each new PPS layout. */
+struct cedrus_dec_h265_tiles {
+	bool		valid;
+	unsigned int	columns_count;
+	unsigned int	rows_count;
+	u8		column_width_minus1[CEDRUS_DEC_H265_TILE_COLUMNS_MAX];
+	u8		row_height_minus1[CEDRUS_DEC_H265_TILE_ROWS_MAX];
+
+	unsigned int	column_start[CEDRUS_DEC_H265_TILE_COLUMNS_MAX];
+	unsigned int	row_start[CEDRUS_DEC_H265_TILE_ROWS_MAX];
+
+	u32		start_ctb[CEDRUS_DEC_H265_TILES_MAX];
+	u32		end_ctb[CEDRUS_DEC_H265_TILES_MAX];
+};
+
+/* XXX: move to regs */
+struct cedrus_dec_h265_sram_frame_info {
+	__le32	top_pic_order_cnt;
+	__le32	bottom_pic_order_cnt;
+	__le32	top_mv_col_buf_addr;
+	__le32	bottom_mv_col_buf_addr;
+	__le32	luma_addr;
+	__le32	chroma_addr;
+} __packed;
+
+/* Frame info of the DPB entries, followed by the output picture. */
+#define CEDRUS_DEC_H265_SRAM_FRAME_INFO_COUNT	\
+	(V4L2_HEVC_DPB_ENTRIES_NUM_MAX + 1)
+
+/* Each SRAM word of the reference picture lists gathers 4 references. */
+#define CEDRUS_DEC_H265_SRAM_REF_PIC_LIST_WORDS	\
+	DIV_ROUND_UP(V4L2_HEVC_DPB_ENTRIES_NUM_MAX, 4)
+
 struct cedrus_dec_h265_context {
 	void		*neighbor_info_buf;
 	dma_addr_t	neighbor_info_buf_addr;
 
 	void		*entry_points_buf;
 	dma_addr_t	entry_points_buf_addr;
+
+	struct cedrus_dec_h265_tiles	tiles;
+
+	/* Last SRAM contents, kept until another context runs. */
+	u32					sram_frame_info_valid;
+	struct cedrus_dec_h265_sram_frame_info
+		sram_frame_info[CEDRUS_DEC_H265_SRAM_FRAME_INFO_COUNT];
+	unsigned int				sram_ref_pic_list_count[2];
+	u32	sram_ref_pic_list[2][CEDRUS_DEC_H265_SRAM_REF_PIC_LIST_WORDS];
+	bool					sram_scaling_matrix_valid;
+	struct v4l2_ctrl_hevc_scaling_matrix	sram_scaling_matrix;
 };
 
 struct cedrus_dec_h265_job {
@@ -40,23 +92,21 @@ struct cedrus_dec_h265_job {
 	const u32					*entry_point_offsets;
 	u32						entry_point_offsets_count;
 	const struct v4l2_ctrl_hevc_decode_params	*decode_params;
+
+	unsigned int					slices_count;
+	unsigned int					slice_index;
+	unsigned int					slice_offset;
 };
 
 struct cedrus_dec_h265_buffer {
 	void		*mv_col_buf;
 	dma_addr_t	mv_col_buf_dma;
-	ssize_t		mv_col_buf_size;
-};
+	unsigned int	mv_col_buf_size;
 
-/* XXX: move to regs */
-struct cedrus_dec_h265_sram_frame_info {
-	__le32	top_pic_order_cnt;
-	__le32	bottom_pic_order_cnt;
-	__le32	top_mv_col_buf_addr;
-	__le32	bottom_mv_col_buf_addr;
-	__le32	luma_addr;
-	__le32	chroma_addr;
-} __packed;
+	void		*ref_buf;
+	dma_addr_t	ref_buf_dma;
+	unsigned int	ref_buf_size;
+};
 
 /* XXX: move to regs */
 struct cedrus_dec_h265_sram_pred_weight {
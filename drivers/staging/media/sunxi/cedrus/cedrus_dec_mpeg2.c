@@ -17,9 +17,88 @@
 #include "cedrus_dec.h"
 #include "cedrus_dec_mpeg2.h"
 #include "cedrus_engine.h"
+#include "cedrus_pool.h"
 #include "cedrus_proc.h"
 #include "cedrus_regs.h"
 
+/* Buffer */
+
+static void cedrus_dec_mpeg2_ref_dma(struct cedrus_context *ctx,
+				     struct cedrus_buffer *cedrus_buffer,
+				     dma_addr_t *luma_addr,
+				     dma_addr_t *chroma_addr)
+{
+	struct cedrus_dec_mpeg2_buffer *mpeg2_buffer =
+		cedrus_buffer->engine_buffer;
+	struct cedrus_dec_ref_layout layout;
+
+	/* Reference pictures are decoded in place without rotate output. */
+	if (!mpeg2_buffer->ref_buf_size) {
+		cedrus_buffer_picture_dma(ctx, cedrus_buffer, luma_addr,
+					  chroma_addr);
+		return;
+	}
+
+	cedrus_dec_format_ref_layout(ctx, &layout, false);
+
+	*luma_addr = mpeg2_buffer->ref_buf_dma;
+	*chroma_addr = mpeg2_buffer->ref_buf_dma + layout.chroma_offset;
+}
+
+static void cedrus_dec_mpeg2_ref_find_dma(struct cedrus_context *ctx,
+					  u64 timestamp, dma_addr_t *luma_addr,
+					  dma_addr_t *chroma_addr)
+{
+	struct cedrus_buffer *cedrus_buffer;
+
+	cedrus_buffer = cedrus_buffer_picture_find(ctx, timestamp);
+	if (!cedrus_buffer) {
+		*luma_addr = 0;
+		*chroma_addr = 0;
+		return;
+	}
+
+	cedrus_dec_mpeg2_ref_dma(ctx, cedrus_buffer, luma_addr, chroma_addr);
+}
+
+static int cedrus_dec_mpeg2_buffer_setup(struct cedrus_context *ctx,
+					 struct cedrus_buffer *cedrus_buffer)
+{
+	struct cedrus_dec_mpeg2_buffer *mpeg2_buffer =
+		cedrus_buffer->engine_buffer;
+	struct cedrus_dec_ref_layout layout;
+
+	if (!cedrus_dec_format_picture_rotate_check(ctx))
+		return 0;
+
+	cedrus_dec_format_ref_layout(ctx, &layout, false);
+
+	/* Buffer is never accessed by CPU, so it can come from the pool. */
+	mpeg2_buffer->ref_buf =
+		cedrus_pool_alloc(ctx, layout.size, &mpeg2_buffer->ref_buf_dma);
+	if (!mpeg2_buffer->ref_buf)
+		return -ENOMEM;
+
+	mpeg2_buffer->ref_buf_size = layout.size;
+
+	return 0;
+}
+
+static void cedrus_dec_mpeg2_buffer_cleanup(struct cedrus_context *ctx,
+					    struct cedrus_buffer *cedrus_buffer)
+{
+	struct cedrus_dec_mpeg2_buffer *mpeg2_buffer =
+		cedrus_buffer->engine_buffer;
+
+	if (!mpeg2_buffer->ref_buf_size)
+		return;
+
+	cedrus_pool_free(ctx, mpeg2_buffer->ref_buf_size,
+			 mpeg2_buffer->ref_buf, mpeg2_buffer->ref_buf_dma);
+
+	mpeg2_buffer->ref_buf_size = 0;
+}
+
 /* Job */
 
 static int cedrus_dec_mpeg2_job_prepare(struct cedrus_context *ctx)
@@ -39,20 +118,26 @@ static int cedrus_dec_mpeg2_job_prepare(struct cedrus_context *ctx)
 	return 0;
 }
 
-static int cedrus_dec_mpeg2_job_configure(struct cedrus_context *ctx)
+static void cedrus_dec_mpeg2_quantisation_write(struct cedrus_context *ctx)
 {
 	struct cedrus_device *dev = ctx->proc->dev;
+	struct cedrus_dec_mpeg2_context *mpeg2_ctx = ctx->engine_ctx;
 	struct cedrus_dec_mpeg2_job *job = ctx->engine_job;
-	const struct v4l2_ctrl_mpeg2_sequence *seq = job->sequence;
-	const struct v4l2_ctrl_mpeg2_picture *pic = job->picture;
 	const struct v4l2_ctrl_mpeg2_quantisation *quant = job->quantisation;
-	struct v4l2_pix_format *pix_format = &ctx->v4l2.format_coded.fmt.pix;
-	dma_addr_t picture_luma_addr, picture_chroma_addr, coded_addr;
-	unsigned int coded_size;
 	const u8 *matrix;
 	unsigned int i;
-	bool check;
-	u32 value;
+
+	/* Matrix memory contents are lost when another context ran. */
+	if (!ctx->job.configured_kept)
+		mpeg2_ctx->quantisation_valid = false;
+
+	/* The matrices usually only change along with the sequence. */
+	if (mpeg2_ctx->quantisation_valid &&
+	    !memcmp(&mpeg2_ctx->quantisation, quant, sizeof(*quant)))
+		return;
+
+	mpeg2_ctx->quantisation = *quant;
+	mpeg2_ctx->quantisation_valid = true;
 
 	/* Set intra quantisation matrix. */
 
@@ -69,6 +154,24 @@ static int cedrus_dec_mpeg2_job_configure(struct cedrus_context *ctx)
 		cedrus_write(dev, VE_DEC_MPEG_IQMINPUT,
 			     VE_DEC_MPEG_IQMINPUT_WEIGHT(i, matrix[i]) |
 			     VE_DEC_MPEG_IQMINPUT_FLAG_NON_INTRA);
+}
+
+static int cedrus_dec_mpeg2_job_configure(struct cedrus_context *ctx)
+{
+	struct cedrus_device *dev = ctx->proc->dev;
+	struct cedrus_dec_mpeg2_job *job = ctx->engine_job;
+	struct cedrus_buffer *cedrus_buffer = cedrus_job_buffer_picture(ctx);
+	struct cedrus_dec_mpeg2_buffer *mpeg2_buffer =
+		cedrus_buffer->engine_buffer;
+	const struct v4l2_ctrl_mpeg2_sequence *seq = job->sequence;
+	const struct v4l2_ctrl_mpeg2_picture *pic = job->picture;
+	struct v4l2_pix_format *pix_format = &ctx->v4l2.format_coded.fmt.pix;
+	dma_addr_t picture_luma_addr, picture_chroma_addr, coded_addr;
+	unsigned int coded_size;
+	bool check;
+	u32 value;
+
+	cedrus_dec_mpeg2_quantisation_write(ctx);
 
 	/* Set MPEG picture header. */
 
@@ -103,33 +206,42 @@ static int cedrus_dec_mpeg2_job_configure(struct cedrus_context *ctx)
 	value = VE_DEC_MPEG_PICCODEDSIZE_WIDTH(seq->horizontal_size) |
 		VE_DEC_MPEG_PICCODEDSIZE_HEIGHT(seq->vertical_size);
 
-	cedrus_write(dev, VE_DEC_MPEG_PICCODEDSIZE, value);
+	cedrus_write_shadow(dev, VE_DEC_MPEG_PICCODEDSIZE, value);
 
 	value = VE_DEC_MPEG_PICBOUNDSIZE_WIDTH(pix_format->width) |
 		VE_DEC_MPEG_PICBOUNDSIZE_HEIGHT(pix_format->height);
 
-	cedrus_write(dev, VE_DEC_MPEG_PICBOUNDSIZE, value);
+	cedrus_write_shadow(dev, VE_DEC_MPEG_PICBOUNDSIZE, value);
 
 	/* Forward and backward prediction reference buffers. */
 
-	cedrus_job_buffer_picture_ref_dma(ctx, pic->forward_ref_ts,
-					  &picture_luma_addr,
-					  &picture_chroma_addr);
+	cedrus_dec_mpeg2_ref_find_dma(ctx, pic->forward_ref_ts,
+				      &picture_luma_addr,
+				      &picture_chroma_addr);
 
 	cedrus_write(dev, VE_DEC_MPEG_FWD_REF_LUMA_ADDR, picture_luma_addr);
 	cedrus_write(dev, VE_DEC_MPEG_FWD_REF_CHROMA_ADDR, picture_chroma_addr);
 
-	cedrus_job_buffer_picture_ref_dma(ctx, pic->backward_ref_ts,
-					  &picture_luma_addr,
-					  &picture_chroma_addr);
+	cedrus_dec_mpeg2_ref_find_dma(ctx, pic->backward_ref_ts,
+				      &picture_luma_addr,
+				      &picture_chroma_addr);
 
 	cedrus_write(dev, VE_DEC_MPEG_BWD_REF_LUMA_ADDR, picture_luma_addr);
 	cedrus_write(dev, VE_DEC_MPEG_BWD_REF_CHROMA_ADDR, picture_chroma_addr);
 
 	/* Destination luma and chroma buffers. */
 
-	cedrus_job_buffer_picture_dma(ctx, &picture_luma_addr,
-				      &picture_chroma_addr);
+	if (mpeg2_buffer->ref_buf_size) {
+		/* Untiled picture from the rotate/scale output. */
+		cedrus_job_buffer_picture_dma(ctx, &picture_luma_addr,
+					      &picture_chroma_addr);
+
+		cedrus_write(dev, VE_DEC_MPEG_ROT_LUMA, picture_luma_addr);
+		cedrus_write(dev, VE_DEC_MPEG_ROT_CHROMA, picture_chroma_addr);
+	}
+
+	cedrus_dec_mpeg2_ref_dma(ctx, cedrus_buffer, &picture_luma_addr,
+				 &picture_chroma_addr);
 
 	cedrus_write(dev, VE_DEC_MPEG_REC_LUMA, picture_luma_addr);
 	cedrus_write(dev, VE_DEC_MPEG_REC_CHROMA, picture_chroma_addr);
@@ -166,10 +278,14 @@ static int cedrus_dec_mpeg2_job_configure(struct cedrus_context *ctx)
 
 	/* Enable appropriate interruptions and components. */
 
-	cedrus_write(dev, VE_DEC_MPEG_CTRL,
-		     VE_DEC_MPEG_CTRL_IRQ_MASK |
-		     VE_DEC_MPEG_CTRL_MC_NO_WRITEBACK |
-		     VE_DEC_MPEG_CTRL_MC_CACHE_EN);
+	value = VE_DEC_MPEG_CTRL_IRQ_MASK |
+		VE_DEC_MPEG_CTRL_MC_NO_WRITEBACK |
+		VE_DEC_MPEG_CTRL_MC_CACHE_EN;
+
+	if (mpeg2_buffer->ref_buf_size)
+		value |= VE_DEC_MPEG_CTRL_ROTATE_SCALE_OUT_EN;
+
+	cedrus_write(dev, VE_DEC_MPEG_CTRL, value);
 
 	return 0;
 }
@@ -228,6 +344,9 @@ static const struct cedrus_engine_ops cedrus_dec_mpeg2_ops = {
 	.format_prepare		= cedrus_dec_format_coded_prepare,
 	.format_configure	= cedrus_dec_format_coded_configure,
 
+	.buffer_setup		= cedrus_dec_mpeg2_buffer_setup,
+	.buffer_cleanup		= cedrus_dec_mpeg2_buffer_cleanup,
+
 	.job_prepare		= cedrus_dec_mpeg2_job_prepare,
 	.job_configure		= cedrus_dec_mpeg2_job_configure,
 	.job_trigger		= cedrus_dec_mpeg2_job_trigger,
@@ -270,8 +389,9 @@ const struct cedrus_engine cedrus_dec_mpeg2 = {
 	.ctrl_configs		= cedrus_dec_mpeg2_ctrl_configs,
 	.ctrl_configs_count	= ARRAY_SIZE(cedrus_dec_mpeg2_ctrl_configs),
 	.frmsize		= &cedrus_dec_mpeg2_frmsize,
+	.mb_cycles		= 400,
 
-	.ctx_size		= 0,
+	.ctx_size		= sizeof(struct cedrus_dec_mpeg2_context),
 	.job_size		= sizeof(struct cedrus_dec_mpeg2_job),
-	.buffer_size		= 0,
+	.buffer_size		= sizeof(struct cedrus_dec_mpeg2_buffer),
 };
@@ -13,6 +13,18 @@
 
 #include <media/v4l2-ctrls.h>
 
+struct cedrus_dec_mpeg2_context {
+	/* Last quantisation matrices, kept until another context runs. */
+	bool					quantisation_valid;
+	struct v4l2_ctrl_mpeg2_quantisation	quantisation;
+};
+
+struct cedrus_dec_mpeg2_buffer {
+	void		*ref_buf;
+	dma_addr_t	ref_buf_dma;
+	unsigned int	ref_buf_size;
+};
+
 struct cedrus_dec_mpeg2_job {
 	const struct v4l2_ctrl_mpeg2_sequence		*sequence;
 	const struct v4l2_ctrl_mpeg2_picture		*picture;
@@ -440,7 +440,58 @@ static const u8 k_mv_entropy_update_probs[2][V4L2_VP8_MV_PROB_CNT] = {
 
 /* Helpers */
 
-static uint8_t read_bits(struct cedrus_device *dev, unsigned int bits_count,
+static void bool_init(struct cedrus_dec_vp8_bool *bool_dec, const u8 *data,
+		      unsigned int size)
+{
+	unsigned int i;
+
+	bool_dec->data = data;
+	bool_dec->end = data + size;
+	bool_dec->range = 255;
+	bool_dec->value = 0;
+	bool_dec->bit_count = 0;
+
+	/* Data past the end of the partition is read as zeroes. */
+	for (i = 0; i < 2; i++) {
+		bool_dec->value <<= 8;
+
+		if (bool_dec->data < bool_dec->end)
+			bool_dec->value |= *bool_dec->data++;
+	}
+}
+
+static unsigned int bool_read(struct cedrus_dec_vp8_bool *bool_dec,
+			      unsigned int probability)
+{
+	unsigned int split = 1 + (((bool_dec->range - 1) * probability) >> 8);
+	unsigned int split_value = split << 8;
+	unsigned int bit;
+
+	if (bool_dec->value >= split_value) {
+		bit = 1;
+		bool_dec->range -= split;
+		bool_dec->value -= split_value;
+	} else {
+		bit = 0;
+		bool_dec->range = split;
+	}
+
+	while (bool_dec->range < 128) {
+		bool_dec->value <<= 1;
+		bool_dec->range <<= 1;
+
+		if (++bool_dec->bit_count == 8) {
+			bool_dec->bit_count = 0;
+
+			if (bool_dec->data < bool_dec->end)
+				bool_dec->value |= *bool_dec->data++;
+		}
+	}
+
+	return bit;
+}
+
+static void bits_trigger(struct cedrus_device *dev, unsigned int bits_count,
 			 unsigned int probability)
 {
 	cedrus_write(dev, VE_H264_TRIGGER_TYPE,
@@ -449,8 +500,56 @@ static uint8_t read_bits(struct cedrus_device *dev, unsigned int bits_count,
 		     VE_H264_TRIGGER_TYPE_PROBABILITY(probability));
 
 	cedrus_poll_cleared(dev, VE_H264_STATUS, VE_H264_STATUS_VLD_BUSY);
+}
+
+static void bits_flush(struct cedrus_dec_vp8_parser *parser)
+{
+	if (!parser->pending_count)
+		return;
 
-	return cedrus_read(dev, VE_H264_BASIC_BITS);
+	bits_trigger(parser->dev, parser->pending_count, VP8_PROB_HALF);
+	parser->pending_count = 0;
+}
+
+/*
+ * The hardware bool decoder still has to walk through the frame header so
+ * that its internal state is correct for decoding (see the note at the top
+ * of this file), but the values it reads are not needed. When the first
+ * partition is mapped, symbols are decoded on the CPU to follow the header
+ * syntax and runs of half-probability symbols (literals) are consumed by the
+ * hardware in as few triggers as possible, without reading the result back.
+ */
+static unsigned int read_bits(struct cedrus_dec_vp8_parser *parser,
+			      unsigned int bits_count, unsigned int probability)
+{
+	struct cedrus_device *dev = parser->dev;
+	unsigned int value = 0;
+	unsigned int i;
+
+	if (!parser->cpu) {
+		bits_trigger(dev, bits_count, probability);
+
+		return cedrus_read(dev, VE_H264_BASIC_BITS);
+	}
+
+	for (i = 0; i < bits_count; i++) {
+		value <<= 1;
+		value |= bool_read(&parser->bool_dec, probability);
+	}
+
+	if (probability != VP8_PROB_HALF) {
+		bits_flush(parser);
+		bits_trigger(dev, bits_count, probability);
+
+		return value;
+	}
+
+	if (parser->pending_count + bits_count > CEDRUS_DEC_VP8_BIN_LENS_MAX)
+		bits_flush(parser);
+
+	parser->pending_count += bits_count;
+
+	return value;
 }
 
 /* Context */
@@ -500,112 +599,115 @@ static int cedrus_dec_vp8_job_prepare(struct cedrus_context *ctx)
 	return 0;
 }
 
-static void get_delta_q(struct cedrus_device *dev)
+static void get_delta_q(struct cedrus_dec_vp8_parser *parser)
 {
-	if (read_bits(dev, 1, VP8_PROB_HALF)) {
-		read_bits(dev, 4, VP8_PROB_HALF);
-		read_bits(dev, 1, VP8_PROB_HALF);
+	if (read_bits(parser, 1, VP8_PROB_HALF)) {
+		read_bits(parser, 4, VP8_PROB_HALF);
+		read_bits(parser, 1, VP8_PROB_HALF);
 	}
 }
 
-static void process_segmentation_info(struct cedrus_device *dev)
+static void process_segmentation_info(struct cedrus_dec_vp8_parser *parser)
 {
 	int update, i;
 
-	update = read_bits(dev, 1, VP8_PROB_HALF);
+	update = read_bits(parser, 1, VP8_PROB_HALF);
 
-	if (read_bits(dev, 1, VP8_PROB_HALF)) {
-		read_bits(dev, 1, VP8_PROB_HALF);
+	if (read_bits(parser, 1, VP8_PROB_HALF)) {
+		read_bits(parser, 1, VP8_PROB_HALF);
 
 		for (i = 0; i < 4; i++)
-			if (read_bits(dev, 1, VP8_PROB_HALF)) {
-				read_bits(dev, 7, VP8_PROB_HALF);
-				read_bits(dev, 1, VP8_PROB_HALF);
+			if (read_bits(parser, 1, VP8_PROB_HALF)) {
+				read_bits(parser, 7, VP8_PROB_HALF);
+				read_bits(parser, 1, VP8_PROB_HALF);
 			}
 
 		for (i = 0; i < 4; i++)
-			if (read_bits(dev, 1, VP8_PROB_HALF)) {
-				read_bits(dev, 6, VP8_PROB_HALF);
-				read_bits(dev, 1, VP8_PROB_HALF);
+			if (read_bits(parser, 1, VP8_PROB_HALF)) {
+				read_bits(parser, 6, VP8_PROB_HALF);
+				read_bits(parser, 1, VP8_PROB_HALF);
 			}
 	}
 
 	if (update)
 		for (i = 0; i < 3; i++)
-			if (read_bits(dev, 1, VP8_PROB_HALF))
-				read_bits(dev, 8, VP8_PROB_HALF);
+			if (read_bits(parser, 1, VP8_PROB_HALF))
+				read_bits(parser, 8, VP8_PROB_HALF);
 }
 
-static void process_ref_lf_delta_info(struct cedrus_device *dev)
+static void process_ref_lf_delta_info(struct cedrus_dec_vp8_parser *parser)
 {
-	if (read_bits(dev, 1, VP8_PROB_HALF)) {
+	if (read_bits(parser, 1, VP8_PROB_HALF)) {
 		int i;
 
 		for (i = 0; i < 4; i++)
-			if (read_bits(dev, 1, VP8_PROB_HALF)) {
-				read_bits(dev, 6, VP8_PROB_HALF);
-				read_bits(dev, 1, VP8_PROB_HALF);
+			if (read_bits(parser, 1, VP8_PROB_HALF)) {
+				read_bits(parser, 6, VP8_PROB_HALF);
+				read_bits(parser, 1, VP8_PROB_HALF);
 			}
 
 		for (i = 0; i < 4; i++)
-			if (read_bits(dev, 1, VP8_PROB_HALF)) {
-				read_bits(dev, 6, VP8_PROB_HALF);
-				read_bits(dev, 1, VP8_PROB_HALF);
+			if (read_bits(parser, 1, VP8_PROB_HALF)) {
+				read_bits(parser, 6, VP8_PROB_HALF);
+				read_bits(parser, 1, VP8_PROB_HALF);
 			}
 	}
 }
 
-static void process_ref_frame_info(struct cedrus_device *dev)
+static void process_ref_frame_info(struct cedrus_dec_vp8_parser *parser)
 {
-	u8 refresh_golden_frame = read_bits(dev, 1, VP8_PROB_HALF);
-	u8 refresh_alt_ref_frame = read_bits(dev, 1, VP8_PROB_HALF);
+	u8 refresh_golden_frame = read_bits(parser, 1, VP8_PROB_HALF);
+	u8 refresh_alt_ref_frame = read_bits(parser, 1, VP8_PROB_HALF);
 
 	if (!refresh_golden_frame)
-		read_bits(dev, 2, VP8_PROB_HALF);
+		read_bits(parser, 2, VP8_PROB_HALF);
 
 	if (!refresh_alt_ref_frame)
-		read_bits(dev, 2, VP8_PROB_HALF);
+		read_bits(parser, 2, VP8_PROB_HALF);
 
-	read_bits(dev, 1, VP8_PROB_HALF);
-	read_bits(dev, 1, VP8_PROB_HALF);
+	read_bits(parser, 1, VP8_PROB_HALF);
+	read_bits(parser, 1, VP8_PROB_HALF);
 }
 
-static void cedrus_read_header(struct cedrus_device *dev,
+static void cedrus_read_header(struct cedrus_dec_vp8_parser *parser,
 			       const struct v4l2_ctrl_vp8_frame *slice)
 {
+	struct cedrus_device *dev = parser->dev;
 	int i, j;
 
 	if (V4L2_VP8_FRAME_IS_KEY_FRAME(slice)) {
-		read_bits(dev, 1, VP8_PROB_HALF);
-		read_bits(dev, 1, VP8_PROB_HALF);
+		read_bits(parser, 1, VP8_PROB_HALF);
+		read_bits(parser, 1, VP8_PROB_HALF);
 	}
 
-	if (read_bits(dev, 1, VP8_PROB_HALF))
-		process_segmentation_info(dev);
+	if (read_bits(parser, 1, VP8_PROB_HALF))
+		process_segmentation_info(parser);
 
-	read_bits(dev, 1, VP8_PROB_HALF);
-	read_bits(dev, 6, VP8_PROB_HALF);
-	read_bits(dev, 3, VP8_PROB_HALF);
+	read_bits(parser, 1, VP8_PROB_HALF);
+	read_bits(parser, 6, VP8_PROB_HALF);
+	read_bits(parser, 3, VP8_PROB_HALF);
 
-	if (read_bits(dev, 1, VP8_PROB_HALF))
-		process_ref_lf_delta_info(dev);
+	if (read_bits(parser, 1, VP8_PROB_HALF))
+		process_ref_lf_delta_info(parser);
 
-	read_bits(dev, 2, VP8_PROB_HALF);
+	read_bits(parser, 2, VP8_PROB_HALF);
 
 	/* y_ac_qi */
-	read_bits(dev, 7, VP8_PROB_HALF);
+	read_bits(parser, 7, VP8_PROB_HALF);
 
 	/* Parses y_dc_delta, y2_dc_delta, etc. */
 	for (i = 0; i < QUANT_DELTA_COUNT; i++)
-		get_delta_q(dev);
+		get_delta_q(parser);
 
 	if (!V4L2_VP8_FRAME_IS_KEY_FRAME(slice))
-		process_ref_frame_info(dev);
+		process_ref_frame_info(parser);
 
-	read_bits(dev, 1, VP8_PROB_HALF);
+	read_bits(parser, 1, VP8_PROB_HALF);
 
 	if (!V4L2_VP8_FRAME_IS_KEY_FRAME(slice))
-		read_bits(dev, 1, VP8_PROB_HALF);
+		read_bits(parser, 1, VP8_PROB_HALF);
+
+	bits_flush(parser);
 
 	cedrus_write(dev, VE_H264_TRIGGER_TYPE, VE_H264_TRIGGER_TYPE_VP8_UPDATE_COEF);
 	/* XXX: check return code */
@@ -613,43 +715,63 @@ static void cedrus_read_header(struct cedrus_device *dev,
 
 	cedrus_write(dev, VE_H264_STATUS, VE_H264_STATUS_INT_MASK);
 
-	if (read_bits(dev, 1, VP8_PROB_HALF))
-		read_bits(dev, 8, VP8_PROB_HALF);
+	if (read_bits(parser, 1, VP8_PROB_HALF))
+		read_bits(parser, 8, VP8_PROB_HALF);
 
 	if (!V4L2_VP8_FRAME_IS_KEY_FRAME(slice)) {
-		read_bits(dev, 8, VP8_PROB_HALF);
-		read_bits(dev, 8, VP8_PROB_HALF);
-		read_bits(dev, 8, VP8_PROB_HALF);
-
-		if (read_bits(dev, 1, VP8_PROB_HALF)) {
-			read_bits(dev, 8, VP8_PROB_HALF);
-			read_bits(dev, 8, VP8_PROB_HALF);
-			read_bits(dev, 8, VP8_PROB_HALF);
-			read_bits(dev, 8, VP8_PROB_HALF);
+		read_bits(parser, 8, VP8_PROB_HALF);
+		read_bits(parser, 8, VP8_PROB_HALF);
+		read_bits(parser, 8, VP8_PROB_HALF);
+
+		if (read_bits(parser, 1, VP8_PROB_HALF)) {
+			read_bits(parser, 8, VP8_PROB_HALF);
+			read_bits(parser, 8, VP8_PROB_HALF);
+			read_bits(parser, 8, VP8_PROB_HALF);
+			read_bits(parser, 8, VP8_PROB_HALF);
 		}
 
-		if (read_bits(dev, 1, VP8_PROB_HALF)) {
-			read_bits(dev, 8, VP8_PROB_HALF);
-			read_bits(dev, 8, VP8_PROB_HALF);
-			read_bits(dev, 8, VP8_PROB_HALF);
+		if (read_bits(parser, 1, VP8_PROB_HALF)) {
+			read_bits(parser, 8, VP8_PROB_HALF);
+			read_bits(parser, 8, VP8_PROB_HALF);
+			read_bits(parser, 8, VP8_PROB_HALF);
 		}
 
 		for (i = 0; i < 2; i++)
 			for (j = 0; j < V4L2_VP8_MV_PROB_CNT; j++)
-				if (read_bits(dev, 1, k_mv_entropy_update_probs[i][j]))
-					read_bits(dev, 7, VP8_PROB_HALF);
+				if (read_bits(parser, 1,
+					      k_mv_entropy_update_probs[i][j]))
+					read_bits(parser, 7, VP8_PROB_HALF);
 	}
+
+	bits_flush(parser);
 }
 
-static void cedrus_vp8_update_probs(const struct v4l2_ctrl_vp8_frame *slice,
-				    u8 *prob_table)
+/*
+ * The table buffer is only read by the engine and is specific to the context,
+ * so the entropy probabilities are only written (to uncached memory) when they
+ * differ from the ones of the previous frame. The coefficient probabilities
+ * only change with explicit updates, which are rare once the stream settled.
+ */
+static void cedrus_vp8_update_probs(struct cedrus_dec_vp8_context *vp8_ctx,
+				    const struct v4l2_ctrl_vp8_frame *slice)
 {
+	const struct v4l2_vp8_entropy *entropy = &slice->entropy;
+	struct v4l2_vp8_entropy *entropy_last = &vp8_ctx->entropy;
+	u8 *prob_table = vp8_ctx->entropy_probs_buf;
+	bool valid = vp8_ctx->entropy_valid;
+	unsigned int offset;
 	int i, j, k;
 
-	memcpy(&prob_table[0x1008], slice->entropy.y_mode_probs,
-	       sizeof(slice->entropy.y_mode_probs));
-	memcpy(&prob_table[0x1010], slice->entropy.uv_mode_probs,
-	       sizeof(slice->entropy.uv_mode_probs));
+	if (!valid ||
+	    memcmp(entropy->y_mode_probs, entropy_last->y_mode_probs,
+		   sizeof(entropy->y_mode_probs)) ||
+	    memcmp(entropy->uv_mode_probs, entropy_last->uv_mode_probs,
+		   sizeof(entropy->uv_mode_probs))) {
+		memcpy(&prob_table[0x1008], entropy->y_mode_probs,
+		       sizeof(entropy->y_mode_probs));
+		memcpy(&prob_table[0x1010], entropy->uv_mode_probs,
+		       sizeof(entropy->uv_mode_probs));
+	}
 
 	memcpy(&prob_table[0x1018], slice->segment.segment_probs,
 	       sizeof(slice->segment.segment_probs));
@@ -659,16 +781,53 @@ static void cedrus_vp8_update_probs(const struct v4l2_ctrl_vp8_frame *slice,
 	prob_table[0x101e] = slice->prob_last;
 	prob_table[0x101f] = slice->prob_gf;
 
-	memcpy(&prob_table[0x1020], slice->entropy.mv_probs[0],
-	       V4L2_VP8_MV_PROB_CNT);
-	memcpy(&prob_table[0x1040], slice->entropy.mv_probs[1],
-	       V4L2_VP8_MV_PROB_CNT);
+	if (!valid ||
+	    memcmp(entropy->mv_probs, entropy_last->mv_probs,
+		   sizeof(entropy->mv_probs))) {
+		memcpy(&prob_table[0x1020], entropy->mv_probs[0],
+		       V4L2_VP8_MV_PROB_CNT);
+		memcpy(&prob_table[0x1040], entropy->mv_probs[1],
+		       V4L2_VP8_MV_PROB_CNT);
+	}
+
+	if (!valid ||
+	    memcmp(entropy->coeff_probs, entropy_last->coeff_probs,
+		   sizeof(entropy->coeff_probs))) {
+		for (i = 0; i < 4; ++i)
+			for (j = 0; j < 8; ++j)
+				for (k = 0; k < 3; ++k) {
+					offset = i * 512 + j * 64 + k * 16;
+					memcpy(&prob_table[offset],
+					       entropy->coeff_probs[i][j][k],
+					       11);
+				}
+	}
+
+	*entropy_last = *entropy;
+	vp8_ctx->entropy_valid = true;
+}
+
+static void cedrus_dec_vp8_parser_init(struct cedrus_context *ctx,
+				       struct cedrus_dec_vp8_parser *parser,
+				       const struct v4l2_ctrl_vp8_frame *slice,
+				       unsigned int header_size)
+{
+	struct vb2_buffer *vb2_buffer = &ctx->job.buffer_coded->vb2_buf;
+	unsigned int payload = vb2_get_plane_payload(vb2_buffer, 0);
+	unsigned int size;
+	const u8 *data;
+
+	memset(parser, 0, sizeof(*parser));
+	parser->dev = ctx->proc->dev;
+
+	data = vb2_plane_vaddr(vb2_buffer, 0);
+	if (!data || payload <= header_size)
+		return;
+
+	size = min(slice->first_part_size, payload - header_size);
 
-	for (i = 0; i < 4; ++i)
-		for (j = 0; j < 8; ++j)
-			for (k = 0; k < 3; ++k)
-				memcpy(&prob_table[i * 512 + j * 64 + k * 16],
-				       slice->entropy.coeff_probs[i][j][k], 11);
+	bool_init(&parser->bool_dec, data + header_size, size);
+	parser->cpu = true;
 }
 
 static int cedrus_dec_vp8_job_configure(struct cedrus_context *cedrus_ctx)
@@ -677,6 +836,7 @@ static int cedrus_dec_vp8_job_configure(struct cedrus_context *cedrus_ctx)
 	struct cedrus_dec_vp8_context *vp8_ctx = cedrus_ctx->engine_ctx;
 	struct cedrus_dec_vp8_job *vp8_job = cedrus_ctx->engine_job;
 	const struct v4l2_ctrl_vp8_frame *slice = vp8_job->frame;
+	struct cedrus_dec_vp8_parser parser;
 	dma_addr_t luma_addr, chroma_addr;
 	dma_addr_t coded_addr;
 	unsigned int coded_size;
@@ -685,7 +845,7 @@ static int cedrus_dec_vp8_job_configure(struct cedrus_context *cedrus_ctx)
 
 	cedrus_write(dev, VE_H264_CTRL, VE_H264_CTRL_VP8);
 
-	cedrus_vp8_update_probs(slice, vp8_ctx->entropy_probs_buf);
+	cedrus_vp8_update_probs(vp8_ctx, slice);
 
 	value = slice->first_part_size * 8;
 	cedrus_write(dev, VE_VP8_FIRST_DATA_PART_LEN, value);
@@ -778,7 +938,8 @@ static int cedrus_dec_vp8_job_configure(struct cedrus_context *cedrus_ctx)
 
 	cedrus_write(dev, VE_VP8_PPS, value);
 
-	cedrus_read_header(dev, slice);
+	cedrus_dec_vp8_parser_init(cedrus_ctx, &parser, slice, header_size);
+	cedrus_read_header(&parser, slice);
 
 	/* Reset registers changed by hardware. */
 	cedrus_write(dev, VE_H264_CUR_MB_NUM, 0);
@@ -973,6 +1134,7 @@ const struct cedrus_engine cedrus_dec_vp8 = {
 	.ctrl_configs		= cedrus_dec_vp8_ctrl_configs,
 	.ctrl_configs_count	= ARRAY_SIZE(cedrus_dec_vp8_ctrl_configs),
 	.frmsize		= &cedrus_dec_vp8_frmsize,
+	.mb_cycles		= 1000,
 
 	.ctx_size		= sizeof(struct cedrus_dec_vp8_context),
 	.job_size		= sizeof(struct cedrus_dec_vp8_job),
@@ -13,6 +13,24 @@
 #include <media/v4l2-ctrls.h>
 
 #define CEDRUS_DEC_VP8_ENTROPY_PROBS_SIZE	0x2400
+#define CEDRUS_DEC_VP8_BIN_LENS_MAX		8
+
+struct cedrus_device;
+
+struct cedrus_dec_vp8_bool {
+	const u8	*data;
+	const u8	*end;
+	unsigned int	range;
+	unsigned int	value;
+	unsigned int	bit_count;
+};
+
+struct cedrus_dec_vp8_parser {
+	struct cedrus_device		*dev;
+	struct cedrus_dec_vp8_bool	bool_dec;
+	unsigned int			pending_count;
+	bool				cpu;
+};
 
 struct cedrus_dec_vp8_context {
 	unsigned int	last_frame_p_type;
@@ -21,6 +39,10 @@ struct cedrus_dec_vp8_context {
 
 	u8		*entropy_probs_buf;
 	dma_addr_t	entropy_probs_buf_dma;
+
+	/* Last entropy probabilities written to the table buffer. */
+	struct v4l2_vp8_entropy	entropy;
+	bool			entropy_valid;
 };
 
 struct cedrus_dec_vp8_job {
@@ -0,0 +1,199 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Cedrus Video Engine Driver
+ *
+ * Copyright 2023 Bootlin
+ * Author: Paul Kocialkowski <paul.kocialkowski@bootlin.com>
+ */
+
+#include <linux/clk.h>
+#include <linux/devfreq.h>
+#include <linux/pm_opp.h>
+#include <linux/property.h>
+
+#include "cedrus.h"
+#include "cedrus_devfreq.h"
+
+/*
+ * The module clock is scaled with the simple ondemand governor, from the
+ * operating points given in the device-tree. Without them, the clock stays
+ * at the fixed rate of the variant.
+ */
+
+#define CEDRUS_DEVFREQ_POLLING_MS		50
+#define CEDRUS_DEVFREQ_UPTHRESHOLD		60
+#define CEDRUS_DEVFREQ_DOWNDIFFERENTIAL		10
+
+/* Utilization */
+
+void cedrus_devfreq_busy_add(struct cedrus_device *dev, u64 busy_us)
+{
+	struct cedrus_devfreq *devfreq = &dev->devfreq;
+	unsigned long flags;
+
+	if (!devfreq->devfreq)
+		return;
+
+	spin_lock_irqsave(&devfreq->lock, flags);
+	devfreq->busy_us += busy_us;
+	spin_unlock_irqrestore(&devfreq->lock, flags);
+}
+
+static void cedrus_devfreq_reset(struct cedrus_devfreq *devfreq)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&devfreq->lock, flags);
+	devfreq->busy_us = 0;
+	devfreq->time_last = ktime_get();
+	spin_unlock_irqrestore(&devfreq->lock, flags);
+}
+
+/* Profile */
+
+static int cedrus_devfreq_target(struct device *dev, unsigned long *freq,
+				 u32 flags)
+{
+	struct cedrus_device *cedrus_dev = dev_get_drvdata(dev);
+	struct dev_pm_opp *opp;
+	int ret;
+
+	opp = devfreq_recommended_opp(dev, freq, flags);
+	if (IS_ERR(opp))
+		return PTR_ERR(opp);
+
+	dev_pm_opp_put(opp);
+
+	ret = dev_pm_opp_set_rate(dev, *freq);
+	if (ret)
+		return ret;
+
+	/* Timeouts and cycle budgets are derived from the rate. */
+	WRITE_ONCE(cedrus_dev->clock_mod_rate,
+		   clk_get_rate(cedrus_dev->clock_mod));
+
+	return 0;
+}
+
+static int cedrus_devfreq_get_dev_status(struct device *dev,
+					 struct devfreq_dev_status *status)
+{
+	struct cedrus_device *cedrus_dev = dev_get_drvdata(dev);
+	struct cedrus_devfreq *devfreq = &cedrus_dev->devfreq;
+	unsigned long flags;
+	ktime_t now = ktime_get();
+	u64 total_us;
+
+	status->current_frequency = clk_get_rate(cedrus_dev->clock_mod);
+
+	spin_lock_irqsave(&devfreq->lock, flags);
+
+	total_us = ktime_us_delta(now, devfreq->time_last);
+
+	/* Jobs finishing now may have started before the last measure. */
+	status->total_time = total_us;
+	status->busy_time = min(devfreq->busy_us, total_us);
+
+	devfreq->busy_us = 0;
+	devfreq->time_last = now;
+
+	spin_unlock_irqrestore(&devfreq->lock, flags);
+
+	return 0;
+}
+
+static int cedrus_devfreq_get_cur_freq(struct device *dev, unsigned long *freq)
+{
+	struct cedrus_device *cedrus_dev = dev_get_drvdata(dev);
+
+	*freq = clk_get_rate(cedrus_dev->clock_mod);
+
+	return 0;
+}
+
+static struct devfreq_dev_profile cedrus_devfreq_profile = {
+	.timer		= DEVFREQ_TIMER_DELAYED,
+	.polling_ms	= CEDRUS_DEVFREQ_POLLING_MS,
+	.target		= cedrus_devfreq_target,
+	.get_dev_status	= cedrus_devfreq_get_dev_status,
+	.get_cur_freq	= cedrus_devfreq_get_cur_freq,
+};
+
+/* Runtime PM */
+
+void cedrus_devfreq_suspend(struct cedrus_device *dev)
+{
+	struct cedrus_devfreq *devfreq = &dev->devfreq;
+
+	if (!devfreq->devfreq)
+		return;
+
+	devfreq_suspend_device(devfreq->devfreq);
+}
+
+void cedrus_devfreq_resume(struct cedrus_device *dev)
+{
+	struct cedrus_devfreq *devfreq = &dev->devfreq;
+
+	if (!devfreq->devfreq)
+		return;
+
+	/* Time spent suspended doesn't count as idle time. */
+	cedrus_devfreq_reset(devfreq);
+	devfreq_resume_device(devfreq->devfreq);
+}
+
+/* Devfreq */
+
+int cedrus_devfreq_setup(struct cedrus_device *dev)
+{
+	struct cedrus_devfreq *devfreq = &dev->devfreq;
+	struct device *device = dev->dev;
+	struct devfreq *devfreq_device;
+	struct dev_pm_opp *opp;
+	unsigned long rate;
+	int ret;
+
+	/* Without devfreq, the clock stays at the variant rate. */
+	if (!IS_ENABLED(CONFIG_PM_DEVFREQ) ||
+	    !IS_ENABLED(CONFIG_DEVFREQ_GOV_SIMPLE_ONDEMAND) ||
+	    !device_property_present(device, "operating-points-v2"))
+		return 0;
+
+	spin_lock_init(&devfreq->lock);
+	cedrus_devfreq_reset(devfreq);
+
+	ret = devm_pm_opp_set_clkname(device, "mod");
+	if (ret)
+		return ret;
+
+	ret = devm_pm_opp_of_add_table(device);
+	if (ret)
+		return ret;
+
+	/* Start from the operating point closest to the variant rate. */
+	rate = dev->clock_mod_rate;
+
+	opp = devfreq_recommended_opp(device, &rate, 0);
+	if (IS_ERR(opp))
+		return PTR_ERR(opp);
+
+	dev_pm_opp_put(opp);
+
+	cedrus_devfreq_profile.initial_freq = rate;
+
+	devfreq->governor_data.upthreshold = CEDRUS_DEVFREQ_UPTHRESHOLD;
+	devfreq->governor_data.downdifferential =
+		CEDRUS_DEVFREQ_DOWNDIFFERENTIAL;
+
+	devfreq_device = devm_devfreq_add_device(device,
+						 &cedrus_devfreq_profile,
+						 DEVFREQ_GOV_SIMPLE_ONDEMAND,
+						 &devfreq->governor_data);
+	if (IS_ERR(devfreq_device))
+		return PTR_ERR(devfreq_device);
+
+	devfreq->devfreq = devfreq_device;
+
+	return 0;
+}
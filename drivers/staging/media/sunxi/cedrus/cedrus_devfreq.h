@@ -0,0 +1,34 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Cedrus Video Engine Driver
+ *
+ * Copyright 2023 Bootlin
+ * Author: Paul Kocialkowski <paul.kocialkowski@bootlin.com>
+ */
+
+#ifndef _CEDRUS_DEVFREQ_H_
+#define _CEDRUS_DEVFREQ_H_
+
+#include <linux/devfreq.h>
+#include <linux/ktime.h>
+#include <linux/spinlock.h>
+#include <linux/types.h>
+
+struct cedrus_device;
+
+struct cedrus_devfreq {
+	struct devfreq				*devfreq;
+	struct devfreq_simple_ondemand_data	governor_data;
+
+	/* Busy time is accounted when jobs finish. */
+	ktime_t					time_last;
+	u64					busy_us;
+	spinlock_t				lock;
+};
+
+void cedrus_devfreq_busy_add(struct cedrus_device *dev, u64 busy_us);
+void cedrus_devfreq_suspend(struct cedrus_device *dev);
+void cedrus_devfreq_resume(struct cedrus_device *dev);
+int cedrus_devfreq_setup(struct cedrus_device *dev);
+
+#endif
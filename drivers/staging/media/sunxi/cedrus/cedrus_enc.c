@@ -8,6 +8,7 @@
 
 #include <linux/types.h>
 #include <linux/videodev2.h>
+#include <media/v4l2-ctrls.h>
 
 #include "cedrus.h"
 #include "cedrus_context.h"
@@ -17,6 +18,136 @@
 #include "cedrus_proc.h"
 #include "cedrus_regs.h"
 
+/* Ctrl */
+
+static int cedrus_enc_ctrl_validate(struct cedrus_context *ctx,
+				    struct v4l2_ctrl *ctrl)
+{
+	unsigned int type;
+
+	switch (ctrl->id) {
+	case V4L2_CID_CEDRUS_ENC_PICTURE_CHROMA_OFFSET:
+		if (ctrl->val == ctx->v4l2.chroma_offset_picture)
+			return 0;
+
+		/* The offset is part of the picture buffers size. */
+		type = cedrus_proc_buffer_type(ctx->proc,
+					       CEDRUS_FORMAT_TYPE_PICTURE);
+		if (cedrus_context_queue_busy_check(ctx, type))
+			return -EBUSY;
+
+		return 0;
+	}
+
+	return 0;
+}
+
+static int cedrus_enc_ctrl_prepare(struct cedrus_context *ctx,
+				   struct v4l2_ctrl *ctrl)
+{
+	struct v4l2_format *format;
+
+	/* The picture transforms are part of the context formats. */
+	switch (ctrl->id) {
+	case V4L2_CID_ROTATE:
+		if (ctx->v4l2.rotation_picture == ctrl->val)
+			return 0;
+
+		ctx->v4l2.rotation_picture = ctrl->val;
+		cedrus_context_format_invalidate(ctx);
+
+		/* Coded dimensions follow the rotated picture dimensions. */
+		return cedrus_enc_format_coded_reset(ctx);
+	case V4L2_CID_HFLIP:
+		ctx->v4l2.hflip_picture = ctrl->val;
+		cedrus_context_format_invalidate(ctx);
+		return 0;
+	case V4L2_CID_CEDRUS_ENC_CTRLS_PINNED:
+		ctx->ctrls_pin = ctrl->val;
+		return 0;
+	case V4L2_CID_CEDRUS_ENC_PICTURE_CHROMA_OFFSET:
+		if (ctx->v4l2.chroma_offset_picture == ctrl->val)
+			return 0;
+
+		ctx->v4l2.chroma_offset_picture = ctrl->val;
+
+		/* Picture size follows the chroma offset. */
+		format = &ctx->v4l2.format_picture;
+		return cedrus_proc_format_picture_prepare(ctx, format);
+	case V4L2_CID_CEDRUS_ENC_FRAME_DECIMATION:
+		WRITE_ONCE(ctx->decimation, ctrl->val);
+		ctx->decimation_index = 0;
+		return 0;
+	}
+
+	return 0;
+}
+
+/*
+ * Controls that are not specific to a codec are handled by the prepare
+ * operation of each engine that uses them.
+ */
+static const struct v4l2_ctrl_config cedrus_enc_ctrl_configs[] = {
+	{
+		.id	= V4L2_CID_ROTATE,
+		.step	= 90,
+		.min	= 0,
+		.max	= 270,
+		.def	= 0,
+		.ops	= &cedrus_context_ctrl_ops,
+	},
+	{
+		.id	= V4L2_CID_HFLIP,
+		.step	= 1,
+		.min	= 0,
+		.max	= 1,
+		.def	= 0,
+		.ops	= &cedrus_context_ctrl_ops,
+	},
+	{
+		.id	= V4L2_CID_MPEG_VIDEO_GOP_SIZE,
+		.step	= 1,
+		.min	= 1,
+		.max	= USHRT_MAX,
+		.def	= 12,
+		.ops	= &cedrus_context_ctrl_ops,
+	},
+	{
+		.id	= V4L2_CID_MPEG_VIDEO_FORCE_KEY_FRAME,
+		.ops	= &cedrus_context_ctrl_ops,
+	},
+	{
+		.id	= V4L2_CID_CEDRUS_ENC_CTRLS_PINNED,
+		.name	= "Encoder Controls Pinned",
+		.type	= V4L2_CTRL_TYPE_BOOLEAN,
+		.step	= 1,
+		.min	= 0,
+		.max	= 1,
+		.def	= 0,
+		.ops	= &cedrus_context_ctrl_ops,
+	},
+	{
+		.id	= V4L2_CID_CEDRUS_ENC_PICTURE_CHROMA_OFFSET,
+		.name	= "Encoder Picture Chroma Offset",
+		.type	= V4L2_CTRL_TYPE_INTEGER,
+		.step	= 1,
+		.min	= 0,
+		.max	= S32_MAX,
+		.def	= 0,
+		.ops	= &cedrus_context_ctrl_ops,
+	},
+	{
+		.id	= V4L2_CID_CEDRUS_ENC_FRAME_DECIMATION,
+		.name	= "Encoder Frame Decimation",
+		.type	= V4L2_CTRL_TYPE_INTEGER,
+		.step	= 1,
+		.min	= 1,
+		.max	= CEDRUS_ENC_FRAME_DECIMATION_MAX,
+		.def	= 1,
+		.ops	= &cedrus_context_ctrl_ops,
+	},
+};
+
 /* Format */
 
 static const struct cedrus_format cedrus_enc_formats[] = {
@@ -24,22 +155,120 @@ static const struct cedrus_format cedrus_enc_formats[] = {
 		.pixelformat	= V4L2_PIX_FMT_NV12,
 		.type		= CEDRUS_FORMAT_TYPE_PICTURE,
 	},
+	{
+		.pixelformat	= V4L2_PIX_FMT_NV21,
+		.type		= CEDRUS_FORMAT_TYPE_PICTURE,
+	},
+	{
+		.pixelformat	= V4L2_PIX_FMT_YUV420,
+		.type		= CEDRUS_FORMAT_TYPE_PICTURE,
+	},
+	{
+		.pixelformat	= V4L2_PIX_FMT_YVU420,
+		.type		= CEDRUS_FORMAT_TYPE_PICTURE,
+	},
 };
 
+bool cedrus_enc_format_picture_interlaced_check(struct cedrus_context *ctx)
+{
+	return ctx->v4l2.format_picture.fmt.pix.field != V4L2_FIELD_NONE;
+}
+
+static bool cedrus_enc_format_picture_field_check(struct cedrus_context *ctx)
+{
+	return ctx->job.picture_field == V4L2_FIELD_TOP ||
+	       ctx->job.picture_field == V4L2_FIELD_BOTTOM;
+}
+
+static void cedrus_enc_format_picture_fetch(struct cedrus_context *ctx,
+					    struct v4l2_rect *rect)
+{
+	struct v4l2_rect *selection = &ctx->v4l2.selection_picture;
+	unsigned int align = 16;
+
+	/* Each field of interlaced pictures covers whole macroblocks. */
+	if (cedrus_enc_format_picture_interlaced_check(ctx))
+		align = 32;
+
+	/*
+	 * Only the macroblocks covering the selection are fetched, the rest
+	 * of the crop is signalled in the bitstream.
+	 */
+	rect->left = ALIGN_DOWN(selection->left, 16);
+	rect->top = ALIGN_DOWN(selection->top, align);
+	rect->width = ALIGN(selection->left + selection->width, 16) -
+		      rect->left;
+	rect->height = ALIGN(selection->top + selection->height, align) -
+		       rect->top;
+}
+
+static void cedrus_enc_format_picture_transformed(struct cedrus_context *ctx,
+						  unsigned int *width,
+						  unsigned int *height)
+{
+	unsigned int rotation = ctx->v4l2.rotation_picture;
+	struct v4l2_rect fetch;
+
+	cedrus_enc_format_picture_fetch(ctx, &fetch);
+
+	/* Quarter rotations swap the picture dimensions. */
+	if (rotation == 90 || rotation == 270) {
+		*width = fetch.height;
+		*height = fetch.width;
+	} else {
+		*width = fetch.width;
+		*height = fetch.height;
+	}
+}
+
 int cedrus_enc_format_coded_prepare(struct cedrus_context *ctx,
 				    struct v4l2_format *format)
 {
 	struct v4l2_pix_format *pix_format = &format->fmt.pix;
 	struct v4l2_pix_format *pix_format_picture =
 		&ctx->v4l2.format_picture.fmt.pix;
+	unsigned int width = pix_format->width;
+	unsigned int height = pix_format->height;
+	unsigned int width_picture, height_picture;
+
+	cedrus_enc_format_picture_transformed(ctx, &width_picture,
+					      &height_picture);
+
+	/*
+	 * Coded format dimensions default to the (rotated) picture format
+	 * dimensions. Smaller dimensions are reached with the ISP scaler,
+	 * which can only downscale. Interlaced pictures are never scaled, as
+	 * the scaler filter taps would span across fields.
+	 */
+	if (!width || width > width_picture ||
+	    cedrus_enc_format_picture_interlaced_check(ctx))
+		width = width_picture;
+
+	if (!height || height > height_picture ||
+	    cedrus_enc_format_picture_interlaced_check(ctx))
+		height = height_picture;
+
+	/* Apply dimension and alignment constraints. */
+	v4l2_apply_frmsize_constraints(&width, &height, ctx->engine->frmsize);
 
-	/* Coded format dimensions are copied from picture format. */
-	pix_format->width = pix_format_picture->width;
-	pix_format->height = pix_format_picture->height;
+	pix_format->width = min(width, width_picture);
+	pix_format->height = min(height, height_picture);
 
 	/* Zero bytes per line for encoded source. */
 	pix_format->bytesperline = 0;
 
+	/*
+	 * Default to half the size of the 4:2:0 picture, which holds intra
+	 * frames at low quantisation parameters. The rate-control controls
+	 * may still change after the buffers are allocated, so they are not
+	 * taken into account. Frames exceeding the size may start over with
+	 * a higher QP, with engines that support it.
+	 */
+	if (!pix_format->sizeimage)
+		pix_format->sizeimage =
+			ALIGN(pix_format->width * pix_format->height * 3 / 4,
+			      SZ_4K);
+
 	/* Choose some minimum size since this can't be 0 */
 	pix_format->sizeimage = max_t(u32, SZ_1K, pix_format->sizeimage);
 
@@ -54,7 +283,18 @@ int cedrus_enc_format_coded_prepare(struct cedrus_context *ctx,
 	return 0;
 }
 
-int cedrus_enc_format_coded_configure(struct cedrus_context *ctx)
+int cedrus_enc_format_coded_reset(struct cedrus_context *ctx)
+{
+	struct v4l2_format *format = &ctx->v4l2.format_coded;
+
+	/* Reset coded dimensions to the fetched picture dimensions. */
+	format->fmt.pix.width = 0;
+	format->fmt.pix.height = 0;
+
+	return cedrus_proc_format_coded_prepare(ctx, format);
+}
+
+static int cedrus_enc_reset(struct cedrus_context *ctx)
 {
 	struct cedrus_device *dev = ctx->proc->dev;
 	u32 value;
@@ -77,12 +317,49 @@ int cedrus_enc_format_coded_configure(struct cedrus_context *ctx)
 	value &= ~VE_RESET_ENCODER_RESET;
 	cedrus_write(dev, VE_RESET_REG, value);
 
+	cedrus_write_shadow_invalidate(dev);
+
+	return 0;
+}
+
+int cedrus_enc_format_coded_configure(struct cedrus_context *ctx)
+{
+	struct cedrus_device *dev = ctx->proc->dev;
+	struct v4l2_pix_format *pix_format_picture =
+		&ctx->v4l2.format_picture.fmt.pix;
+	unsigned int width_picture = pix_format_picture->width;
+	u32 value;
+
+	/* The encoder is already reset and enabled for this context. */
+	if (cedrus_context_format_configured_check(ctx))
+		return 0;
+
+	cedrus_enc_reset(ctx);
+
 	/* Enable encoder. */
 
 	value = cedrus_read(dev, VE_MODE_REG);
+	value &= ~(VE_MODE_PIC_WIDTH_IS_4096 |
+		   VE_MODE_PIC_WIDTH_MORE_2048 |
+		   VE_MODE_REC_WR_MODE_MASK |
+		   VE_MODE_DDR_MODE_MASK);
 	value |= VE_MODE_ENC_ENABLE |
 		 VE_MODE_ENC_ISP_ENABLE |
 		 VE_MODE_DEC_DISABLED;
+
+	/* Same memory access configuration as the decoder. */
+	value |= VE_MODE_REC_WR_MODE_2MB;
+
+	if (cedrus_capabilities_check(dev, CEDRUS_CAPABILITY_DDR_BW_256))
+		value |= VE_MODE_DDR_MODE_BW_256;
+	else
+		value |= VE_MODE_DDR_MODE_BW_128;
+
+	if (width_picture == 4096)
+		value |= VE_MODE_PIC_WIDTH_IS_4096;
+	if (width_picture > 2048)
+		value |= VE_MODE_PIC_WIDTH_MORE_2048;
+
 	cedrus_write(dev, VE_MODE_REG, value);
 
 	return 0;
@@ -100,6 +377,15 @@ static int cedrus_enc_format_picture_prepare(struct cedrus_context *ctx,
 	/* Apply dimension and alignment constraints. */
 	v4l2_apply_frmsize_constraints(&width, &height, ctx->engine->frmsize);
 
+	/*
+	 * Interlaced pictures are encoded as field pairs by engines that
+	 * support it, with each field covering whole macroblocks.
+	 */
+	if (ctx->engine->interlaced && V4L2_FIELD_HAS_BOTH(pix_format->field))
+		height = ALIGN(height, 32);
+	else
+		pix_format->field = V4L2_FIELD_NONE;
+
 	/* Check minimum allowed bytesperline, maximum is to avoid overflow. */
 	if (bytesperline < width || bytesperline > (32 * width))
 		bytesperline = width;
@@ -109,11 +395,17 @@ static int cedrus_enc_format_picture_prepare(struct cedrus_context *ctx,
 
 	switch (pix_format->pixelformat) {
 	case V4L2_PIX_FMT_NV12:
-		/* Luma plane size. */
-		sizeimage = bytesperline * height;
-
+	case V4L2_PIX_FMT_NV21:
 		/* Chroma plane size. */
-		sizeimage += bytesperline * height / 2;
+		sizeimage = bytesperline * height / 2;
+		break;
+	case V4L2_PIX_FMT_YUV420:
+	case V4L2_PIX_FMT_YVU420:
+		/* Macroblock-aligned chroma stride. */
+		bytesperline = ALIGN(bytesperline, 32);
+
+		/* Chroma planes size. */
+		sizeimage = 2 * (bytesperline / 2) * (height / 2);
 		break;
 	default:
 		return -EINVAL;
@@ -122,32 +414,259 @@ static int cedrus_enc_format_picture_prepare(struct cedrus_context *ctx,
 	pix_format->width = width;
 	pix_format->height = height;
 	pix_format->bytesperline = bytesperline;
+
+	/* Luma plane size, or more up to the chroma offset. */
+	sizeimage += cedrus_picture_chroma_offset(ctx, pix_format);
 	pix_format->sizeimage = sizeimage;
-	pix_format->field = V4L2_FIELD_NONE;
 
 	return 0;
 }
 
-int cedrus_enc_format_picture_configure(struct cedrus_context *ctx)
+bool cedrus_enc_format_picture_rows_check(struct cedrus_context *ctx)
+{
+	struct v4l2_pix_format *pix_format_coded =
+		&ctx->v4l2.format_coded.fmt.pix;
+	unsigned int width_picture, height_picture;
+
+	/*
+	 * Picture rows can only be fed separately when they match coded rows,
+	 * which is not the case with rotation or scaling (the scaler filter
+	 * taps span across rows).
+	 */
+	if (ctx->v4l2.rotation_picture)
+		return false;
+
+	cedrus_enc_format_picture_transformed(ctx, &width_picture,
+					      &height_picture);
+
+	return pix_format_coded->width == width_picture &&
+	       pix_format_coded->height == height_picture;
+}
+
+void cedrus_enc_format_selection_coded(struct cedrus_context *ctx,
+				       struct v4l2_rect *rect)
+{
+	struct v4l2_pix_format *pix_format_coded =
+		&ctx->v4l2.format_coded.fmt.pix;
+	struct v4l2_rect selection = ctx->v4l2.selection_picture;
+	unsigned int width_picture, height_picture;
+	unsigned int width, height;
+	unsigned int right, bottom;
+	struct v4l2_rect fetch;
+
+	/* The selection is relative to the fetched macroblocks. */
+	cedrus_enc_format_picture_fetch(ctx, &fetch);
+
+	selection.left -= fetch.left;
+	selection.top -= fetch.top;
+
+	width = fetch.width;
+	height = fetch.height;
+
+	/* XXX: The flip is assumed to apply before the rotation. */
+	if (ctx->v4l2.hflip_picture)
+		selection.left = width - selection.left - selection.width;
+
+	/* Rotation is clockwise. */
+	switch (ctx->v4l2.rotation_picture) {
+	case 90:
+		rect->left = height - selection.top - selection.height;
+		rect->top = selection.left;
+		rect->width = selection.height;
+		rect->height = selection.width;
+		break;
+	case 180:
+		rect->left = width - selection.left - selection.width;
+		rect->top = height - selection.top - selection.height;
+		rect->width = selection.width;
+		rect->height = selection.height;
+		break;
+	case 270:
+		rect->left = selection.top;
+		rect->top = width - selection.left - selection.width;
+		rect->width = selection.height;
+		rect->height = selection.width;
+		break;
+	default:
+		*rect = selection;
+		break;
+	}
+
+	/* Scale to the coded dimensions, rounding outwards. */
+	cedrus_enc_format_picture_transformed(ctx, &width_picture,
+					      &height_picture);
+
+	right = DIV_ROUND_UP((rect->left + rect->width) *
+			     pix_format_coded->width, width_picture);
+	bottom = DIV_ROUND_UP((rect->top + rect->height) *
+			      pix_format_coded->height, height_picture);
+
+	rect->left = rect->left * pix_format_coded->width / width_picture;
+	rect->top = rect->top * pix_format_coded->height / height_picture;
+	rect->width = right - rect->left;
+	rect->height = bottom - rect->top;
+}
+
+int cedrus_enc_format_picture_rows_configure(struct cedrus_context *ctx,
+					     unsigned int mb_row,
+					     unsigned int mb_rows)
 {
 	struct cedrus_device *dev = ctx->proc->dev;
 	struct v4l2_pix_format *pix_format = &ctx->v4l2.format_picture.fmt.pix;
-	dma_addr_t luma_addr, chroma_addr;
+	struct v4l2_pix_format *pix_format_coded =
+		&ctx->v4l2.format_coded.fmt.pix;
+	struct vb2_v4l2_buffer *v4l2_buffer = ctx->job.buffer_picture;
+	dma_addr_t luma_addr, chroma_addr, chroma1_addr = 0;
 	unsigned int width_mbs, height_mbs;
-	unsigned int stride_mbs;
+	unsigned int coded_width_mbs, coded_height_mbs;
+	unsigned int coded_height = pix_format_coded->height;
+	unsigned int picture_rows;
+	unsigned int luma_offset, chroma_offset;
+	unsigned int luma_stride, chroma_stride;
+	unsigned int luma_field = 0, chroma_field = 0;
+	unsigned int lines = 1;
+	struct v4l2_rect fetch;
+	u32 value;
+
+	/* Strides */
+
+	luma_stride = pix_format->bytesperline;
+
+	if (pix_format->pixelformat == V4L2_PIX_FMT_YUV420 ||
+	    pix_format->pixelformat == V4L2_PIX_FMT_YVU420)
+		chroma_stride = pix_format->bytesperline / 2;
+	else
+		chroma_stride = pix_format->bytesperline;
 
 	/* Dimensions */
 
-	width_mbs = DIV_ROUND_UP(pix_format->width, 16);
-	height_mbs = DIV_ROUND_UP(pix_format->height, 16);
+	cedrus_enc_format_picture_fetch(ctx, &fetch);
+
+	/*
+	 * Fields are fetched as pictures of their own, half as high, either
+	 * from every other line or from their half of the planes.
+	 */
+	if (cedrus_enc_format_picture_field_check(ctx)) {
+		bool bottom = ctx->job.picture_field == V4L2_FIELD_BOTTOM;
+		bool second = bottom;
+
+		/* Bottom fields come first in memory with this layout. */
+		if (v4l2_buffer->field == V4L2_FIELD_SEQ_BT)
+			second = !bottom;
+
+		if (V4L2_FIELD_IS_SEQUENTIAL(v4l2_buffer->field)) {
+			if (second) {
+				luma_field = luma_stride *
+					     pix_format->height / 2;
+				chroma_field = chroma_stride *
+					       pix_format->height / 4;
+			}
+		} else {
+			lines = 2;
+
+			if (bottom) {
+				luma_field = luma_stride;
+				chroma_field = chroma_stride;
+			}
+		}
+
+		fetch.top /= 2;
+		fetch.height /= 2;
+		coded_height /= 2;
+	}
+
+	/* The thumbnail stride shares the register with the input stride. */
+	if (cedrus_enc_format_picture_interlaced_check(ctx)) {
+		value = cedrus_read(dev, VE_ISP_PIC_STRIDE0_REG);
+		value &= ~VE_ISP_PIC_STRIDE0_INPUT_STRIDE_MASK;
+		value |= VE_ISP_PIC_STRIDE0_INPUT_STRIDE_MBS(luma_stride *
+							     lines / 16);
+		cedrus_write(dev, VE_ISP_PIC_STRIDE0_REG, value);
+	}
+
+	width_mbs = fetch.width / 16;
+	height_mbs = fetch.height / 16;
+
+	coded_width_mbs = DIV_ROUND_UP(pix_format_coded->width, 16);
+	coded_height_mbs = DIV_ROUND_UP(coded_height, 16);
+
+	if (WARN_ON(!mb_rows || mb_row + mb_rows > coded_height_mbs))
+		return -EINVAL;
+
+	/* Rows are given in coded macroblocks. */
+	if (!cedrus_enc_format_picture_rows_check(ctx)) {
+		if (WARN_ON(mb_row || mb_rows != coded_height_mbs))
+			return -EINVAL;
+
+		picture_rows = height_mbs;
+	} else {
+		picture_rows = mb_rows;
+	}
 
 	cedrus_write(dev, VE_ISP_PIC_INFO_REG,
 		     VE_ISP_PIC_INFO_WIDTH_MBS(width_mbs) |
-		     VE_ISP_PIC_INFO_HEIGHT_MBS(height_mbs));
+		     VE_ISP_PIC_INFO_HEIGHT_MBS(picture_rows));
 
 	cedrus_write(dev, VE_ISP_SCALER_SIZE_REG,
-		     VE_ISP_SCALER_SIZE_HEIGHT_MBS(height_mbs) |
-		     VE_ISP_SCALER_SIZE_WIDTH_MBS(width_mbs));
+		     VE_ISP_SCALER_SIZE_HEIGHT_MBS(mb_rows) |
+		     VE_ISP_SCALER_SIZE_WIDTH_MBS(coded_width_mbs));
+
+	/* Address */
+
+	cedrus_job_buffer_picture_dma(ctx, &luma_addr, &chroma_addr);
+
+	/* Start from the first fetched macroblock. */
+	luma_offset = (fetch.top + mb_row * 16) * luma_stride * lines +
+		      luma_field + fetch.left;
+
+	luma_addr += luma_offset;
+
+	switch (pix_format->pixelformat) {
+	case V4L2_PIX_FMT_YUV420:
+	case V4L2_PIX_FMT_YVU420:
+		/* Chroma planes are subsampled in both directions. */
+		chroma1_addr = chroma_addr + pix_format->bytesperline / 2 *
+			       pix_format->height / 2;
+
+		chroma_offset = (fetch.top / 2 + mb_row * 8) *
+				chroma_stride * lines + chroma_field +
+				fetch.left / 2;
+
+		chroma_addr += chroma_offset;
+		chroma1_addr += chroma_offset;
+		break;
+	default:
+		/* Chroma is vertically subsampled in the YUV420SP format. */
+		chroma_offset = (fetch.top / 2 + mb_row * 8) *
+				chroma_stride * lines + chroma_field +
+				fetch.left;
+
+		chroma_addr += chroma_offset;
+		break;
+	}
+
+	cedrus_write(dev, VE_ISP_INPUT_LUMA_ADDR_REG, luma_addr);
+	cedrus_write(dev, VE_ISP_INPUT_CHROMA0_ADDR_REG, chroma_addr);
+	cedrus_write(dev, VE_ISP_INPUT_CHROMA1_ADDR_REG, chroma1_addr);
+
+	return 0;
+}
+
+int cedrus_enc_format_picture_configure(struct cedrus_context *ctx)
+{
+	struct cedrus_device *dev = ctx->proc->dev;
+	struct v4l2_pix_format *pix_format = &ctx->v4l2.format_picture.fmt.pix;
+	struct v4l2_pix_format *pix_format_coded =
+		&ctx->v4l2.format_coded.fmt.pix;
+	unsigned int width_picture, height_picture;
+	unsigned int height, height_mbs;
+	unsigned int stride_mbs;
+	int ycbcr_enc, quantization;
+	u32 value;
+
+	/* Static registers are already set for this context. */
+	if (cedrus_context_format_configured_check(ctx))
+		goto rows;
 
 	/* Stride */
 
@@ -162,19 +681,84 @@ int cedrus_enc_format_picture_configure(struct cedrus_context *ctx)
 
 	/* Format */
 
-	cedrus_write(dev, VE_ISP_CTRL_REG,
-		     VE_ISP_CTRL_FORMAT_YUV420SP |
-		     VE_ISP_CTRL_ROTATION_0 |
-		     VE_ISP_CTRL_COLORSPACE_BT601);
+	switch (pix_format->pixelformat) {
+	case V4L2_PIX_FMT_NV12:
+		value = VE_ISP_CTRL_FORMAT_YUV420SP;
+		break;
+	case V4L2_PIX_FMT_NV21:
+		value = VE_ISP_CTRL_FORMAT_YVU420SP;
+		break;
+	case V4L2_PIX_FMT_YUV420:
+		value = VE_ISP_CTRL_FORMAT_YUV420P;
+		break;
+	case V4L2_PIX_FMT_YVU420:
+		value = VE_ISP_CTRL_FORMAT_YVU420P;
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	/* Colorspace */
 
-	/* Address */
+	ycbcr_enc = pix_format->ycbcr_enc;
+	if (ycbcr_enc == V4L2_YCBCR_ENC_DEFAULT)
+		ycbcr_enc = V4L2_MAP_YCBCR_ENC_DEFAULT(pix_format->colorspace);
 
-	cedrus_job_buffer_picture_dma(ctx, &luma_addr, &chroma_addr);
+	quantization = pix_format->quantization;
+	if (quantization == V4L2_QUANTIZATION_DEFAULT)
+		quantization =
+			V4L2_MAP_QUANTIZATION_DEFAULT(false,
+						      pix_format->colorspace,
+						      ycbcr_enc);
 
-	cedrus_write(dev, VE_ISP_INPUT_LUMA_ADDR_REG, luma_addr);
-	cedrus_write(dev, VE_ISP_INPUT_CHROMA0_ADDR_REG, chroma_addr);
+	if (quantization == V4L2_QUANTIZATION_FULL_RANGE)
+		value |= VE_ISP_CTRL_COLORSPACE_YCC;
+	else if (ycbcr_enc == V4L2_YCBCR_ENC_709 ||
+		 ycbcr_enc == V4L2_YCBCR_ENC_XV709)
+		value |= VE_ISP_CTRL_COLORSPACE_BT709;
+	else
+		value |= VE_ISP_CTRL_COLORSPACE_BT601;
 
-	return 0;
+	/* Transform */
+
+	switch (ctx->v4l2.rotation_picture) {
+	case 90:
+		value |= VE_ISP_CTRL_ROTATION_90;
+		break;
+	case 180:
+		value |= VE_ISP_CTRL_ROTATION_180;
+		break;
+	case 270:
+		value |= VE_ISP_CTRL_ROTATION_270;
+		break;
+	default:
+		value |= VE_ISP_CTRL_ROTATION_0;
+		break;
+	}
+
+	if (ctx->v4l2.hflip_picture)
+		value |= VE_ISP_CTRL_HFLIP_EN;
+
+	/* Resize to the coded dimensions during the fetch. */
+	cedrus_enc_format_picture_transformed(ctx, &width_picture,
+					      &height_picture);
+
+	if (pix_format_coded->width != width_picture ||
+	    pix_format_coded->height != height_picture)
+		value |= VE_ISP_CTRL_SCALER_EN;
+
+	cedrus_write(dev, VE_ISP_CTRL_REG, value);
+
+rows:
+	/* Dimensions and address, covering the whole coded picture. */
+
+	height = pix_format_coded->height;
+	if (cedrus_enc_format_picture_field_check(ctx))
+		height /= 2;
+
+	height_mbs = DIV_ROUND_UP(height, 16);
+
+	return cedrus_enc_format_picture_rows_configure(ctx, 0, height_mbs);
 }
 
 static int cedrus_enc_format_setup(struct cedrus_context *ctx)
@@ -217,31 +801,53 @@ static int cedrus_enc_format_setup(struct cedrus_context *ctx)
 static int cedrus_enc_format_propagate(struct cedrus_context *ctx,
 				       unsigned int format_type)
 {
+	unsigned int buffer_type =
+		cedrus_proc_buffer_type(ctx->proc, CEDRUS_FORMAT_TYPE_CODED);
 	int ret;
 
 	/* Format is propagated from picture to coded. */
 	if (format_type != CEDRUS_FORMAT_TYPE_PICTURE)
 		return 0;
 
+	/*
+	 * The coded buffers are kept, with the coded size image, while the
+	 * engine is only reconfigured when pictures start streaming again.
+	 */
+	if (cedrus_context_queue_streaming_check(ctx, buffer_type))
+		ctx->resize_pending = true;
+
 	/* Reset selection from picture format. */
 	ret = cedrus_context_selection_picture_reset(ctx);
 	if (ret)
 		return ret;
 
-	return cedrus_proc_format_coded_prepare(ctx, &ctx->v4l2.format_coded);
+	return cedrus_enc_format_coded_reset(ctx);
+}
+
+static int cedrus_enc_selection_propagate(struct cedrus_context *ctx)
+{
+	unsigned int buffer_type =
+		cedrus_proc_buffer_type(ctx->proc, CEDRUS_FORMAT_TYPE_CODED);
+	bool streaming;
+
+	/* Coded dimensions follow the selection, they can't change now. */
+	streaming = cedrus_context_queue_streaming_check(ctx, buffer_type);
+	if (streaming)
+		return -EBUSY;
+
+	return cedrus_enc_format_coded_reset(ctx);
 }
 
 static bool cedrus_enc_format_dynamic_check(struct cedrus_context *ctx,
 					    struct v4l2_format *format)
 {
 	struct v4l2_pix_format *pix_format = &format->fmt.pix;
-	struct v4l2_pix_format *pix_format_coded =
-		&ctx->v4l2.format_coded.fmt.pix;
-	unsigned int buffer_type;
+	struct v4l2_pix_format *pix_format_picture =
+		&ctx->v4l2.format_picture.fmt.pix;
 	bool streaming;
 	bool busy;
 
-	/* Dynamic format change starts on the coded (output) queue. */
+	/* Dynamic format change starts on the picture (output) queue. */
 	if (!V4L2_TYPE_IS_OUTPUT(format->type))
 		return false;
 
@@ -251,26 +857,17 @@ static bool cedrus_enc_format_dynamic_check(struct cedrus_context *ctx,
 		return false;
 
 	/*
-	 * The coded queue will be reconfigured, thus it must not be streaming.
-	 * However we can keep using the same buffers since there is not direct
-	 * relationship between the buffer size and the format.
+	 * The picture queue will be reconfigured, thus it must not be
+	 * streaming. Its buffers are kept, as long as they are large enough
+	 * for the new format (which is checked when they are queued), while
+	 * the coded queue may keep streaming.
 	 */
 	streaming = cedrus_context_queue_streaming_check(ctx, format->type);
 	if (streaming)
 		return false;
 
-	/*
-	 * The picture queue will be reconfigured, thus it must not have any
-	 * buffers allocated.
-	 */
-	buffer_type =
-		cedrus_proc_buffer_type(ctx->proc, CEDRUS_FORMAT_TYPE_PICTURE);
-	busy = cedrus_context_queue_busy_check(ctx, buffer_type);
-	if (busy)
-		return false;
-
-	/* Coded format must remain the same. */
-	if (pix_format->pixelformat != pix_format_coded->pixelformat)
+	/* Picture format must remain the same. */
+	if (pix_format->pixelformat != pix_format_picture->pixelformat)
 		return false;
 
 	return true;
@@ -303,9 +900,15 @@ static const struct cedrus_proc_config cedrus_enc_config = {
 
 	.formats		= cedrus_enc_formats,
 	.formats_count		= ARRAY_SIZE(cedrus_enc_formats),
+
+	.ctrl_configs		= cedrus_enc_ctrl_configs,
+	.ctrl_configs_count	= ARRAY_SIZE(cedrus_enc_ctrl_configs),
 };
 
 static const struct cedrus_proc_ops cedrus_enc_ops = {
+	.ctrl_validate			= cedrus_enc_ctrl_validate,
+	.ctrl_prepare			= cedrus_enc_ctrl_prepare,
+
 	.format_picture_prepare		= cedrus_enc_format_picture_prepare,
 	.format_picture_configure	= cedrus_enc_format_picture_configure,
 
@@ -313,7 +916,11 @@ static const struct cedrus_proc_ops cedrus_enc_ops = {
 	.format_propagate		= cedrus_enc_format_propagate,
 	.format_dynamic_check		= cedrus_enc_format_dynamic_check,
 
+	.selection_propagate		= cedrus_enc_selection_propagate,
+
 	.size_picture_enum		= cedrus_enc_size_picture_enum,
+
+	.reset				= cedrus_enc_reset,
 };
 
 int cedrus_enc_setup(struct cedrus_device *dev)
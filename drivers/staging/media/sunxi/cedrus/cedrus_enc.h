@@ -18,7 +18,15 @@ struct cedrus_context;
 
 int cedrus_enc_format_coded_prepare(struct cedrus_context *ctx,
 				    struct v4l2_format *format);
+int cedrus_enc_format_coded_reset(struct cedrus_context *ctx);
 int cedrus_enc_format_coded_configure(struct cedrus_context *ctx);
+bool cedrus_enc_format_picture_interlaced_check(struct cedrus_context *ctx);
+bool cedrus_enc_format_picture_rows_check(struct cedrus_context *ctx);
+void cedrus_enc_format_selection_coded(struct cedrus_context *ctx,
+				       struct v4l2_rect *rect);
+int cedrus_enc_format_picture_rows_configure(struct cedrus_context *ctx,
+					     unsigned int mb_row,
+					     unsigned int mb_rows);
 int cedrus_enc_format_picture_configure(struct cedrus_context *ctx);
 
 /* Decoder */
@@ -6,11 +6,19 @@
  * Author: Paul Kocialkowski <paul.kocialkowski@bootlin.com>
  */
 
+#include <asm/unaligned.h>
 #include <linux/align.h>
+#include <linux/debugfs.h>
+#include <linux/dma-buf.h>
+#include <linux/fcntl.h>
+#include <linux/log2.h>
+#include <linux/math64.h>
+#include <linux/seq_file.h>
 #include <linux/sizes.h>
 #include <linux/types.h>
 #include <linux/videodev2.h>
 #include <media/v4l2-ctrls.h>
+#include <media/v4l2-event.h>
 #include <media/videobuf2-core.h>
 #include <media/videobuf2-v4l2.h>
 
@@ -19,8 +27,10 @@
 #include "cedrus_enc.h"
 #include "cedrus_enc_h264.h"
 #include "cedrus_engine.h"
+#include "cedrus_fault.h"
 #include "cedrus_proc.h"
 #include "cedrus_regs.h"
+#include "cedrus_trace.h"
 
 /* Helpers */
 
@@ -76,6 +86,22 @@ static bool cedrus_enc_h264_profile_cabac_check(int profile)
 	}
 }
 
+static bool cedrus_enc_h264_profile_b_frames_check(int profile)
+{
+	switch (profile) {
+	case V4L2_MPEG_VIDEO_H264_PROFILE_BASELINE:
+	case V4L2_MPEG_VIDEO_H264_PROFILE_CONSTRAINED_BASELINE:
+	case V4L2_MPEG_VIDEO_H264_PROFILE_CAVLC_444_INTRA:
+	case V4L2_MPEG_VIDEO_H264_PROFILE_HIGH_10_INTRA:
+	case V4L2_MPEG_VIDEO_H264_PROFILE_HIGH_422_INTRA:
+	case V4L2_MPEG_VIDEO_H264_PROFILE_HIGH_444_INTRA:
+		return false;
+
+	default:
+		return true;
+	}
+}
+
 static u8 cedrus_enc_h264_level_idc(int level)
 {
 	switch (level) {
@@ -124,6 +150,220 @@ static u8 cedrus_enc_h264_level_idc(int level)
 	}
 }
 
+/* Maximum coded picture buffer size in units of 1000 bits. */
+static unsigned int cedrus_enc_h264_level_max_cpb(int level)
+{
+	switch (level) {
+	case V4L2_MPEG_VIDEO_H264_LEVEL_1_0:
+		return 175;
+	case V4L2_MPEG_VIDEO_H264_LEVEL_1B:
+		return 350;
+	case V4L2_MPEG_VIDEO_H264_LEVEL_1_1:
+		return 500;
+	case V4L2_MPEG_VIDEO_H264_LEVEL_1_2:
+		return 1000;
+	case V4L2_MPEG_VIDEO_H264_LEVEL_1_3:
+		return 2000;
+	case V4L2_MPEG_VIDEO_H264_LEVEL_2_0:
+		return 2000;
+	case V4L2_MPEG_VIDEO_H264_LEVEL_2_1:
+		return 4000;
+	case V4L2_MPEG_VIDEO_H264_LEVEL_2_2:
+		return 4000;
+	case V4L2_MPEG_VIDEO_H264_LEVEL_3_0:
+		return 10000;
+	case V4L2_MPEG_VIDEO_H264_LEVEL_3_1:
+		return 14000;
+	case V4L2_MPEG_VIDEO_H264_LEVEL_3_2:
+		return 20000;
+	case V4L2_MPEG_VIDEO_H264_LEVEL_4_0:
+		return 25000;
+	case V4L2_MPEG_VIDEO_H264_LEVEL_4_1:
+		return 62500;
+	case V4L2_MPEG_VIDEO_H264_LEVEL_4_2:
+		return 62500;
+	case V4L2_MPEG_VIDEO_H264_LEVEL_5_0:
+		return 135000;
+	case V4L2_MPEG_VIDEO_H264_LEVEL_5_1:
+		return 240000;
+	case V4L2_MPEG_VIDEO_H264_LEVEL_5_2:
+		return 240000;
+	case V4L2_MPEG_VIDEO_H264_LEVEL_6_0:
+		return 240000;
+	case V4L2_MPEG_VIDEO_H264_LEVEL_6_1:
+		return 480000;
+	case V4L2_MPEG_VIDEO_H264_LEVEL_6_2:
+		return 800000;
+	default:
+		return 0;
+	}
+}
+
+/*
+ * Level limits (table A-1): macroblock rate, frame size and decoded picture
+ * buffer size in macroblocks, bitrate in units of 1000 bits per second and
+ * vertical motion vector range in pixels.
+ */
+struct cedrus_enc_h264_level_limits {
+	int		level;
+	unsigned int	max_mbps;
+	unsigned int	max_fs;
+	unsigned int	max_dpb_mbs;
+	unsigned int	max_br;
+	unsigned int	max_vmv_r;
+};
+
+static const struct cedrus_enc_h264_level_limits
+cedrus_enc_h264_level_limits[] = {
+	{ V4L2_MPEG_VIDEO_H264_LEVEL_1_0, 1485, 99, 396, 64, 64 },
+	{ V4L2_MPEG_VIDEO_H264_LEVEL_1B, 1485, 99, 396, 128, 64 },
+	{ V4L2_MPEG_VIDEO_H264_LEVEL_1_1, 3000, 396, 900, 192, 128 },
+	{ V4L2_MPEG_VIDEO_H264_LEVEL_1_2, 6000, 396, 2376, 384, 128 },
+	{ V4L2_MPEG_VIDEO_H264_LEVEL_1_3, 11880, 396, 2376, 768, 128 },
+	{ V4L2_MPEG_VIDEO_H264_LEVEL_2_0, 11880, 396, 2376, 2000, 128 },
+	{ V4L2_MPEG_VIDEO_H264_LEVEL_2_1, 19800, 792, 4752, 4000, 256 },
+	{ V4L2_MPEG_VIDEO_H264_LEVEL_2_2, 20250, 1620, 8100, 4000, 256 },
+	{ V4L2_MPEG_VIDEO_H264_LEVEL_3_0, 40500, 1620, 8100, 10000, 256 },
+	{ V4L2_MPEG_VIDEO_H264_LEVEL_3_1, 108000, 3600, 18000, 14000, 512 },
+	{ V4L2_MPEG_VIDEO_H264_LEVEL_3_2, 216000, 5120, 20480, 20000, 512 },
+	{ V4L2_MPEG_VIDEO_H264_LEVEL_4_0, 245760, 8192, 32768, 20000, 512 },
+	{ V4L2_MPEG_VIDEO_H264_LEVEL_4_1, 245760, 8192, 32768, 50000, 512 },
+	{ V4L2_MPEG_VIDEO_H264_LEVEL_4_2, 522240, 8704, 34816, 50000, 512 },
+	{ V4L2_MPEG_VIDEO_H264_LEVEL_5_0, 589824, 22080, 110400, 135000, 512 },
+	{ V4L2_MPEG_VIDEO_H264_LEVEL_5_1, 983040, 36864, 184320, 240000, 512 },
+	{ V4L2_MPEG_VIDEO_H264_LEVEL_5_2, 2073600, 36864, 184320, 240000, 512 },
+	{ V4L2_MPEG_VIDEO_H264_LEVEL_6_0, 4177920, 139264, 696320, 240000,
+	  8192 },
+	{ V4L2_MPEG_VIDEO_H264_LEVEL_6_1, 8355840, 139264, 696320, 480000,
+	  8192 },
+	{ V4L2_MPEG_VIDEO_H264_LEVEL_6_2, 16711680, 139264, 696320, 800000,
+	  8192 },
+};
+
+static const struct cedrus_enc_h264_level_limits *
+cedrus_enc_h264_level_limits_find(int level)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(cedrus_enc_h264_level_limits); i++)
+		if (cedrus_enc_h264_level_limits[i].level == level)
+			return &cedrus_enc_h264_level_limits[i];
+
+	return NULL;
+}
+
+/* Presets */
+
+struct cedrus_enc_h264_preset {
+	u32		me_para;
+	bool		dynamic_me;
+	unsigned int	dynamic_me_th[4];
+	unsigned int	qp_max;
+};
+
+/*
+ * XXX: the dynamic motion estimation thresholds are not documented and
+ * were picked to progressively reduce the search on static macroblocks.
+ */
+static const struct cedrus_enc_h264_preset cedrus_enc_h264_presets[] = {
+	[CEDRUS_H264_ENC_PRESET_QUALITY] = {
+		.me_para	= VE_ENC_AVC_ME_PARA_FME_SEARCH_LEVEL(3),
+	},
+	[CEDRUS_H264_ENC_PRESET_BALANCED] = {
+		.me_para	= VE_ENC_AVC_ME_PARA_FME_SEARCH_LEVEL(2),
+	},
+	[CEDRUS_H264_ENC_PRESET_FAST] = {
+		.me_para	= VE_ENC_AVC_ME_PARA_FME_SEARCH_LEVEL(1) |
+				  VE_ENC_AVC_ME_PARA_IME_TIME_PRIO |
+				  VE_ENC_AVC_ME_PARA_QPIX_16X16_OFF_EN,
+		.dynamic_me	= true,
+		.dynamic_me_th	= { 64, 128, 256, 512 },
+	},
+	[CEDRUS_H264_ENC_PRESET_FASTEST] = {
+		.me_para	= VE_ENC_AVC_ME_PARA_FME_SEARCH_LEVEL(0) |
+				  VE_ENC_AVC_ME_PARA_IME_TIME_PRIO |
+				  VE_ENC_AVC_ME_PARA_QPIX_SPLIT_OFF |
+				  VE_ENC_AVC_ME_PARA_QPIX_SMART_OFF |
+				  VE_ENC_AVC_ME_PARA_INTRA_4X4_DIS |
+				  VE_ENC_AVC_ME_PARA_SPLIT_MB_DIS,
+		.dynamic_me	= true,
+		.dynamic_me_th	= { 128, 256, 512, 1023 },
+	},
+	/*
+	 * Desktop content is mostly static or moves by whole windows, which
+	 * the search would hardly find anyway. Intra 4x4 prediction is kept
+	 * for text and the coarse cost control (XXX: assumed, as it is not
+	 * documented) favours skipping unchanged macroblocks.
+	 */
+	[CEDRUS_H264_ENC_PRESET_SCREEN] = {
+		.me_para	= VE_ENC_AVC_ME_PARA_ME_DIS |
+				  VE_ENC_AVC_ME_PARA_FME_SEARCH_LEVEL(0) |
+				  VE_ENC_AVC_ME_PARA_QPIX_SPLIT_OFF |
+				  VE_ENC_AVC_ME_PARA_QPIX_SMART_OFF |
+				  VE_ENC_AVC_ME_PARA_SPLIT_MB_DIS |
+				  VE_ENC_AVC_ME_PARA_COARSE_COST_CTRL(3),
+		.qp_max		= CEDRUS_H264_ENC_PRESET_SCREEN_QP_MAX,
+	},
+};
+
+/*
+ * Under thermal pressure, motion estimation effort is given up on top of
+ * the preset, which costs some compression efficiency but keeps frames.
+ */
+static u32 cedrus_enc_h264_me_para(struct cedrus_context *cedrus_ctx)
+{
+	struct cedrus_device *dev = cedrus_ctx->proc->dev;
+	struct cedrus_enc_h264_job *job = cedrus_ctx->engine_job;
+	unsigned long state = cedrus_cooling_state(&dev->cooling);
+	u32 level_mask = VE_ENC_AVC_ME_PARA_FME_SEARCH_LEVEL(3);
+	u32 value = cedrus_enc_h264_presets[job->preset].me_para;
+	unsigned int level;
+
+	if (state >= CEDRUS_COOLING_STATE_SEARCH) {
+		level = (value & level_mask) >> __ffs(level_mask);
+		if (level)
+			level--;
+
+		value &= ~level_mask;
+		value |= VE_ENC_AVC_ME_PARA_FME_SEARCH_LEVEL(level) |
+			 VE_ENC_AVC_ME_PARA_IME_TIME_PRIO;
+	}
+
+	if (state >= CEDRUS_COOLING_STATE_REFINE)
+		value |= VE_ENC_AVC_ME_PARA_QPIX_SPLIT_OFF |
+			 VE_ENC_AVC_ME_PARA_QPIX_SMART_OFF |
+			 VE_ENC_AVC_ME_PARA_INTRA_4X4_DIS;
+
+	return value;
+}
+
+/*
+ * Macroblock MAD class thresholds of adaptive quantization, without and with.
+ * XXX: The registers are not documented. They are assumed to hold increasing
+ * MAD limits between the classes that the mode optimization parameter scales
+ * the QP modulation of, and were picked for pixel MADs.
+ */
+static const u32 cedrus_enc_h264_aq_mad_th[2][4] = {
+	{ 0, 0, 0, 0 },
+	{ 4, 8, 16, 32 },
+};
+
+static const char * const cedrus_enc_h264_preset_menu[] = {
+	"Quality",
+	"Balanced",
+	"Fast",
+	"Fastest",
+	"Screen Content",
+	NULL,
+};
+
+static const char * const cedrus_enc_h264_frame_type_menu[] = {
+	"Automatic",
+	"Key Frame",
+	"Skipped Frame",
+	NULL,
+};
+
 static u8 cedrus_enc_h264_constraint_set_flags(int profile)
 {
 	switch (profile) {
@@ -191,6 +431,68 @@ static u8 cedrus_enc_h264_vui_sar_idc(int value)
 	}
 }
 
+static u8 cedrus_enc_h264_vui_colour_primaries(int value)
+{
+	switch (value) {
+	case V4L2_COLORSPACE_REC709:
+	case V4L2_COLORSPACE_SRGB:
+	case V4L2_COLORSPACE_JPEG:
+		return 1;
+	case V4L2_COLORSPACE_470_SYSTEM_M:
+		return 4;
+	case V4L2_COLORSPACE_470_SYSTEM_BG:
+		return 5;
+	case V4L2_COLORSPACE_SMPTE170M:
+		return 6;
+	case V4L2_COLORSPACE_SMPTE240M:
+		return 7;
+	case V4L2_COLORSPACE_BT2020:
+		return 9;
+	case V4L2_COLORSPACE_DCI_P3:
+		return 11;
+	default:
+		return 2;
+	}
+}
+
+static u8 cedrus_enc_h264_vui_transfer_characteristics(int value)
+{
+	switch (value) {
+	case V4L2_XFER_FUNC_709:
+		return 1;
+	case V4L2_XFER_FUNC_SMPTE240M:
+		return 7;
+	case V4L2_XFER_FUNC_NONE:
+		return 8;
+	case V4L2_XFER_FUNC_SRGB:
+		return 13;
+	case V4L2_XFER_FUNC_SMPTE2084:
+		return 16;
+	default:
+		return 2;
+	}
+}
+
+static u8 cedrus_enc_h264_vui_matrix_coefficients(int value)
+{
+	switch (value) {
+	case V4L2_YCBCR_ENC_709:
+	case V4L2_YCBCR_ENC_XV709:
+		return 1;
+	case V4L2_YCBCR_ENC_601:
+	case V4L2_YCBCR_ENC_XV601:
+		return 6;
+	case V4L2_YCBCR_ENC_SMPTE240M:
+		return 7;
+	case V4L2_YCBCR_ENC_BT2020:
+		return 9;
+	case V4L2_YCBCR_ENC_BT2020_CONST_LUM:
+		return 10;
+	default:
+		return 2;
+	}
+}
+
 static u8 cedrus_enc_h264_disable_deblocking_filter_idc(int value)
 {
 	switch (value) {
@@ -205,35 +507,56 @@ static u8 cedrus_enc_h264_disable_deblocking_filter_idc(int value)
 	}
 }
 
-static void cedrus_enc_h264_coded_append(struct cedrus_device *dev,
-					 unsigned int value, unsigned int count)
+static void cedrus_enc_h264_bits_reset(struct cedrus_enc_h264_bits *bits)
 {
-	cedrus_poll(dev, VE_ENC_AVC_STATUS_REG,
-		    VE_ENC_AVC_STATUS_PUT_BITS_READY);
+	memset(bits->data, 0, sizeof(bits->data));
+	bits->count = 0;
+}
 
-	cedrus_write(dev, VE_ENC_AVC_PUTBITSDATA_REG, value);
+static void cedrus_enc_h264_bits_append(struct cedrus_enc_h264_bits *bits,
+					u32 value, unsigned int count)
+{
+	unsigned int index = bits->count / 32;
+	unsigned int available = 32 - bits->count % 32;
 
-	cedrus_write(dev, VE_ENC_AVC_STARTTRIG_REG,
-		     VE_ENC_AVC_STARTTRIG_NUM_BITS(count) |
-		     VE_ENC_AVC_STARTTRIG_TYPE_PUT_BITS);
+	if (!count || WARN_ON(count > 32))
+		return;
+
+	if (WARN_ON(bits->count + count > sizeof(bits->data) * 8))
+		return;
+
+	if (count < 32)
+		value &= GENMASK(count - 1, 0);
+
+	/* Words are filled from the most significant bit. */
+	if (count <= available) {
+		bits->data[index] |= value << (available - count);
+	} else {
+		bits->data[index] |= value >> (count - available);
+		bits->data[index + 1] |= value << (32 - count + available);
+	}
+
+	bits->count += count;
 }
 
-static void cedrus_enc_h264_coded_ue(struct cedrus_device *dev,
-				     unsigned int value)
+static void cedrus_enc_h264_bits_ue(struct cedrus_enc_h264_bits *bits,
+				    unsigned int value)
 {
-	unsigned int bits_count;
+	unsigned int zeros_count;
 
 	/*
 	 * Exponential-Golomb coding of x stores the value of x + 1.
 	 * This takes fls(x + 1) + 1 bits and fls(x + 1) heading zero bits
 	 * are added.
 	 */
-	bits_count = 2 * __fls(value + 1) + 1;
+	zeros_count = __fls(value + 1);
 
-	cedrus_enc_h264_coded_append(dev, value + 1, bits_count);
+	cedrus_enc_h264_bits_append(bits, 0, zeros_count);
+	cedrus_enc_h264_bits_append(bits, value + 1, zeros_count + 1);
 }
 
-static void cedrus_enc_h264_coded_se(struct cedrus_device *dev, int value)
+static void cedrus_enc_h264_bits_se(struct cedrus_enc_h264_bits *bits,
+				    int value)
 {
 	unsigned int value_ue;
 
@@ -248,56 +571,137 @@ static void cedrus_enc_h264_coded_se(struct cedrus_device *dev, int value)
 	else
 		value_ue = -2 * value;
 
-	return cedrus_enc_h264_coded_ue(dev, value_ue);
+	cedrus_enc_h264_bits_ue(bits, value_ue);
+}
+
+static void cedrus_enc_h264_bits_u32(struct cedrus_enc_h264_bits *bits,
+				     u32 value)
+{
+	cedrus_enc_h264_bits_append(bits, value, 32);
 }
 
-static void cedrus_enc_h264_coded_bytes(struct cedrus_device *dev, u32 value,
-					unsigned int bytes_count)
+static void cedrus_enc_h264_bits_u16(struct cedrus_enc_h264_bits *bits,
+				     u16 value)
 {
-	unsigned int bits = 8 * bytes_count;
+	cedrus_enc_h264_bits_append(bits, value, 16);
+}
 
-	while (bits > 0) {
-		u8 value_slice = (value >> (bits - 8)) & GENMASK(7, 0);
+static void cedrus_enc_h264_bits_u8(struct cedrus_enc_h264_bits *bits,
+				    u8 value)
+{
+	cedrus_enc_h264_bits_append(bits, value, 8);
+}
 
-		cedrus_enc_h264_coded_append(dev, value_slice, 8);
-		bits -= 8;
-	}
+static void cedrus_enc_h264_bits_bit(struct cedrus_enc_h264_bits *bits,
+				     unsigned int value)
+{
+	cedrus_enc_h264_bits_append(bits, value, 1);
 }
 
-static void cedrus_enc_h264_coded_u32(struct cedrus_device *dev, u32 value)
+static void cedrus_enc_h264_bits_align(struct cedrus_enc_h264_bits *bits)
 {
-	cedrus_enc_h264_coded_bytes(dev, value, 4);
+	unsigned int bits_count;
+
+	bits_count = bits->count % 8;
+	if (!bits_count)
+		return;
+
+	cedrus_enc_h264_bits_append(bits, 0, 8 - bits_count);
 }
 
-static void cedrus_enc_h264_coded_u16(struct cedrus_device *dev, u16 value)
+static u8 cedrus_enc_h264_bits_byte(const struct cedrus_enc_h264_bits *bits,
+				    unsigned int index)
 {
-	cedrus_enc_h264_coded_append(dev, value, 16);
+	return bits->data[index / 4] >> (24 - 8 * (index % 4));
 }
 
-static void cedrus_enc_h264_coded_u8(struct cedrus_device *dev, u8 value)
+static void cedrus_enc_h264_bits_copy(struct cedrus_enc_h264_bits *bits,
+				      const struct cedrus_enc_h264_bits *source)
 {
-	cedrus_enc_h264_coded_append(dev, value, 8);
+	unsigned int count = source->count;
+	unsigned int index = 0;
+
+	while (count > 0) {
+		unsigned int count_word = min(count, 32U);
+		u32 value = source->data[index];
+
+		if (count_word < 32)
+			value >>= 32 - count_word;
+
+		cedrus_enc_h264_bits_append(bits, value, count_word);
+
+		count -= count_word;
+		index++;
+	}
 }
 
-static void cedrus_enc_h264_coded_bit(struct cedrus_device *dev,
-				      unsigned int value)
+static void cedrus_enc_h264_bits_escape(struct cedrus_enc_h264_bits *bits,
+					const struct cedrus_enc_h264_bits *source)
 {
-	cedrus_enc_h264_coded_append(dev, value, 1);
+	unsigned int bytes_count = source->count / 8;
+	unsigned int zeros_count = 0;
+	unsigned int i;
+
+	/*
+	 * Insert an emulation prevention 0x3 byte whenever two zero bytes are
+	 * followed by a byte that could be mistaken for a start code, starting
+	 * after the Annex-B start code and NALU header.
+	 */
+	for (i = 0; i < bytes_count; i++) {
+		u8 value = cedrus_enc_h264_bits_byte(source, i);
+
+		if (i >= CEDRUS_ENC_H264_NALU_PREFIX_SIZE) {
+			if (zeros_count == 2 && value <= 0x3) {
+				cedrus_enc_h264_bits_u8(bits, 0x3);
+				zeros_count = 0;
+			}
+
+			if (value)
+				zeros_count = 0;
+			else
+				zeros_count++;
+		}
+
+		cedrus_enc_h264_bits_u8(bits, value);
+	}
 }
 
+static void cedrus_enc_h264_coded_append(struct cedrus_device *dev,
+					 u32 value, unsigned int count)
+{
+	cedrus_poll(dev, VE_ENC_AVC_STATUS_REG,
+		    VE_ENC_AVC_STATUS_PUT_BITS_READY);
+
+	cedrus_write(dev, VE_ENC_AVC_PUTBITSDATA_REG, value);
+
+	cedrus_write(dev, VE_ENC_AVC_STARTTRIG_REG,
+		     VE_ENC_AVC_STARTTRIG_NUM_BITS(count) |
+		     VE_ENC_AVC_STARTTRIG_TYPE_PUT_BITS);
+}
 
-static void cedrus_enc_h264_coded_align(struct cedrus_device *dev)
+static void cedrus_enc_h264_coded_flush(struct cedrus_device *dev,
+					struct cedrus_enc_h264_bits *bits,
+					unsigned int start)
 {
-	unsigned int bits_count;
-	u32 value;
+	unsigned int count = bits->count - start;
+	unsigned int index = start / 32;
+	unsigned int skip = start % 32;
 
-	value = cedrus_read(dev, VE_ENC_AVC_STM_BIT_LEN_REG);
+	/* Push the serialized bits with full 32-bit words when possible. */
+	while (count > 0) {
+		unsigned int count_word = min(count, 32U - skip);
+		u32 value = bits->data[index] << skip;
 
-	bits_count = value % 8;
-	if (!bits_count)
-		return;
+		if (count_word < 32)
+			value >>= 32 - count_word;
+
+		skip = 0;
+
+		cedrus_enc_h264_coded_append(dev, value, count_word);
 
-	cedrus_enc_h264_coded_append(dev, 0, 8 - bits_count);
+		count -= count_word;
+		index++;
+	}
 }
 
 static void cedrus_enc_h264_coded_eptb(struct cedrus_device *dev, bool enable)
@@ -314,812 +718,4172 @@ static void cedrus_enc_h264_coded_eptb(struct cedrus_device *dev, bool enable)
 	cedrus_write(dev, VE_ENC_AVC_PARA0_REG, value);
 }
 
-/* Ctrl */
+/* State */
 
-static int cedrus_enc_h264_ctrl_validate(struct cedrus_context *ctx,
-					 struct v4l2_ctrl *ctrl)
+static void cedrus_enc_h264_state_sps_invalidate(struct cedrus_enc_h264_state *state)
 {
-	struct v4l2_device *v4l2_dev = &ctx->proc->dev->v4l2.v4l2_dev;
-	int profile;
-
-	switch (ctrl->id) {
-	case V4L2_CID_MPEG_VIDEO_H264_ENTROPY_MODE:
-		struct v4l2_ctrl *ctrl_profile;
-		unsigned int id;
-
-		/* CABAC entropy coding availability depends on profile. */
-		if (ctrl->val != V4L2_MPEG_VIDEO_H264_ENTROPY_MODE_CABAC)
-			return 0;
+	state->sps_valid = false;
 
-		id = V4L2_CID_MPEG_VIDEO_H264_PROFILE;
-		ctrl_profile = cedrus_context_ctrl_find(ctx, id);
-		if (WARN_ON(!ctrl_profile))
-			return -ENODEV;
+	if (state->step > CEDRUS_ENC_H264_STEP_SPS)
+		state->step = CEDRUS_ENC_H264_STEP_SPS;
+}
 
-		profile = ctrl_profile->cur.val;
+static void cedrus_enc_h264_state_pps_invalidate(struct cedrus_enc_h264_state *state)
+{
+	/*
+	 * Serialize the new parameters to the next slot, so that the pictures
+	 * that are still decoded with the previous ones keep them.
+	 */
+	if (state->pps_valid)
+		state->pps_id = (state->pps_id + 1) % CEDRUS_ENC_H264_PPS_COUNT;
 
-		if (!cedrus_enc_h264_profile_cabac_check(profile)) {
-			v4l2_err(v4l2_dev,
-				 "CABAC entropy coding is not supported with the profile currently set.\n");
-			return -EINVAL;
-		}
-		break;
-	}
+	state->pps_valid = false;
 
-	return 0;
+	if (state->step > CEDRUS_ENC_H264_STEP_PPS)
+		state->step = CEDRUS_ENC_H264_STEP_PPS;
 }
 
-static int cedrus_enc_h264_ctrl_prepare(struct cedrus_context *cedrus_ctx,
-					struct v4l2_ctrl *ctrl)
+static void cedrus_enc_h264_state_sample(struct cedrus_context *cedrus_ctx)
 {
 	struct cedrus_enc_h264_context *h264_ctx = cedrus_ctx->engine_ctx;
 	struct cedrus_enc_h264_state *state = &h264_ctx->state;
+	unsigned long *events = &h264_ctx->ctrls_events;
+	unsigned int ltr_use_mask;
+	unsigned int seq;
 
 	/*
-	 * This might (and will) be called before we have a codec context.
-	 * Ignore and call v4l2_ctrl_handler_setup explicitly when the codec
-	 * context is created (streaming start).
+	 * Consume the requests before sampling the values, so that the values
+	 * they come with (such as the long-term reference index) are not older
+	 * than the request itself.
 	 */
-	if (!h264_ctx)
-		return 0;
+	if (test_and_clear_bit(CEDRUS_ENC_H264_EVENT_KEY_FRAME, events))
+		h264_ctx->force_key_frame = true;
 
-	switch (ctrl->id) {
-	case V4L2_CID_MPEG_VIDEO_PREPEND_SPSPPS_TO_IDR:
-		h264_ctx->prepend_sps_pps_idr = ctrl->cur.val;
-		break;
-	case V4L2_CID_MPEG_VIDEO_H264_VUI_SAR_ENABLE:
-		h264_ctx->vui_sar_enable = ctrl->cur.val;
-		break;
-	case V4L2_CID_MPEG_VIDEO_H264_VUI_SAR_IDC:
-		h264_ctx->vui_sar_idc = ctrl->cur.val;
-		break;
-	case V4L2_CID_MPEG_VIDEO_H264_VUI_EXT_SAR_WIDTH:
-		h264_ctx->vui_ext_sar_width = ctrl->cur.val;
-		break;
-	case V4L2_CID_MPEG_VIDEO_H264_VUI_EXT_SAR_HEIGHT:
-		h264_ctx->vui_ext_sar_height = ctrl->cur.val;
-		break;
-	case V4L2_CID_MPEG_VIDEO_H264_PROFILE:
-		h264_ctx->profile = ctrl->cur.val;
+	if (test_and_clear_bit(CEDRUS_ENC_H264_EVENT_SKIP_FRAME, events))
+		h264_ctx->force_skip_frame = true;
 
-		if (!cedrus_enc_h264_profile_cabac_check(h264_ctx->profile)) {
-			unsigned int id = V4L2_CID_MPEG_VIDEO_H264_ENTROPY_MODE;
-			int value = V4L2_MPEG_VIDEO_H264_ENTROPY_MODE_CAVLC;
-			struct v4l2_ctrl *ctrl_entropy =
-				cedrus_context_ctrl_find(cedrus_ctx, id);
+	if (test_and_clear_bit(CEDRUS_ENC_H264_EVENT_LTR_MARK, events))
+		h264_ctx->ltr_mark = true;
 
-			__v4l2_ctrl_s_ctrl(ctrl_entropy, value);
-		}
+	if (test_and_clear_bit(CEDRUS_ENC_H264_EVENT_FRAME_BUDGET, events))
+		h264_ctx->frame_budget_pending = true;
 
-		if (state->step > CEDRUS_ENC_H264_STEP_SPS)
-			state->step = CEDRUS_ENC_H264_STEP_SPS;
-		break;
-	case V4L2_CID_MPEG_VIDEO_H264_LEVEL:
-		h264_ctx->level = ctrl->cur.val;
+	if (test_and_clear_bit(CEDRUS_ENC_H264_EVENT_INTRA_REFRESH_WAVE,
+			       events))
+		h264_ctx->intra_refresh_wave_pending = true;
 
-		if (state->step > CEDRUS_ENC_H264_STEP_SPS)
-			state->step = CEDRUS_ENC_H264_STEP_SPS;
-		break;
-	case V4L2_CID_MPEG_VIDEO_H264_ENTROPY_MODE:
-		h264_ctx->entropy_mode = ctrl->cur.val;
+	/*
+	 * The new SPS reuses the same identifier, so it starts a new sequence
+	 * with an IDR frame. The first frame is an IDR frame already.
+	 */
+	if (test_and_clear_bit(CEDRUS_ENC_H264_EVENT_SPS_INVALIDATE, events)) {
+		cedrus_enc_h264_state_sps_invalidate(state);
 
-		if (state->step > CEDRUS_ENC_H264_STEP_PPS)
-			state->step = CEDRUS_ENC_H264_STEP_PPS;
-		break;
-	case V4L2_CID_MPEG_VIDEO_H264_CHROMA_QP_INDEX_OFFSET:
-		h264_ctx->chroma_qp_index_offset = ctrl->cur.val;
-		break;
-	case V4L2_CID_MPEG_VIDEO_H264_LOOP_FILTER_MODE:
-		h264_ctx->loop_filter_mode = ctrl->cur.val;
-		break;
-	case V4L2_CID_MPEG_VIDEO_H264_LOOP_FILTER_ALPHA:
-		h264_ctx->loop_filter_alpha = ctrl->cur.val;
-		break;
-	case V4L2_CID_MPEG_VIDEO_H264_LOOP_FILTER_BETA:
-		h264_ctx->loop_filter_beta = ctrl->cur.val;
-		break;
-	case V4L2_CID_MPEG_VIDEO_H264_MIN_QP:
-		h264_ctx->qp_min = ctrl->cur.val;
-		break;
-	case V4L2_CID_MPEG_VIDEO_H264_MAX_QP:
-		h264_ctx->qp_max = ctrl->cur.val;
-		break;
-	case V4L2_CID_MPEG_VIDEO_H264_I_FRAME_QP:
-		h264_ctx->qp_i = ctrl->cur.val;
-		break;
-	case V4L2_CID_MPEG_VIDEO_H264_P_FRAME_QP:
-		h264_ctx->qp_p = ctrl->cur.val;
-		break;
-	case V4L2_CID_MPEG_VIDEO_GOP_CLOSURE:
-		h264_ctx->gop_closure = ctrl->cur.val;
-		break;
-	case V4L2_CID_MPEG_VIDEO_GOP_SIZE:
-		h264_ctx->gop_size = ctrl->cur.val;
-		break;
-	case V4L2_CID_MPEG_VIDEO_H264_I_PERIOD:
-		h264_ctx->gop_open_i_period = ctrl->cur.val;
-		break;
-	case V4L2_CID_MPEG_VIDEO_FORCE_KEY_FRAME:
-		h264_ctx->force_key_frame = true;
-		break;
+		if (h264_ctx->dpb_last)
+			h264_ctx->force_key_frame = true;
 	}
 
-	return 0;
+	if (test_and_clear_bit(CEDRUS_ENC_H264_EVENT_PPS_INVALIDATE, events))
+		cedrus_enc_h264_state_pps_invalidate(state);
+
+	if (test_and_clear_bit(CEDRUS_ENC_H264_EVENT_INTRA_REFRESH_RESET,
+			       events))
+		state->intra_refresh_index = 0;
+
+	ltr_use_mask = xchg(&h264_ctx->ctrls_ltr_use_mask, 0);
+	if (ltr_use_mask)
+		h264_ctx->ltr_use_mask = ltr_use_mask;
+
+	/* Retry when the controls were changed while copying. */
+	do {
+		seq = read_seqcount_begin(&h264_ctx->ctrls_seq);
+		h264_ctx->config = h264_ctx->ctrls;
+	} while (read_seqcount_retry(&h264_ctx->ctrls_seq, seq));
 }
 
-/* Context */
+/* Rate Control */
 
-static int cedrus_enc_h264_setup(struct cedrus_context *cedrus_ctx)
+static s64 cedrus_enc_h264_rc_frame_bits(struct cedrus_context *cedrus_ctx,
+					 unsigned int bitrate)
 {
-	struct device *dev = cedrus_ctx->proc->dev->dev;
-	struct v4l2_ctrl_handler *ctrl_handler = &cedrus_ctx->v4l2.ctrl_handler;
-	struct cedrus_enc_h264_context *h264_ctx = cedrus_ctx->engine_ctx;
-	struct cedrus_enc_h264_state *state = &h264_ctx->state;
-	struct v4l2_pix_format *pix_format =
-		&cedrus_ctx->v4l2.format_picture.fmt.pix;
-	unsigned int id;
-	int ret;
-
-	h264_ctx->width_mbs = DIV_ROUND_UP(pix_format->width, 16);
-	h264_ctx->height_mbs = DIV_ROUND_UP(pix_format->height, 16);
+	struct v4l2_fract *timeperframe = &cedrus_ctx->v4l2.timeperframe_coded;
 
-	/* Macroblock Information Buffer */
+	return div_u64((u64)bitrate * timeperframe->numerator,
+		       timeperframe->denominator);
+}
 
-	h264_ctx->mb_info_size = DIV_ROUND_UP(h264_ctx->width_mbs, 32) * SZ_4K;
-	h264_ctx->mb_info = dma_alloc_attrs(dev, h264_ctx->mb_info_size,
-					    &h264_ctx->mb_info_dma, GFP_KERNEL,
-					    DMA_ATTR_NO_KERNEL_MAPPING);
-	if (!h264_ctx->mb_info)
-		return -ENOMEM;
+static s64 cedrus_enc_h264_rc_window(struct cedrus_context *cedrus_ctx)
+{
+	struct cedrus_enc_h264_context *h264_ctx = cedrus_ctx->engine_ctx;
+	s64 frame_bits;
 
-	/* State */
+	frame_bits = cedrus_enc_h264_rc_frame_bits(cedrus_ctx,
+						   h264_ctx->bitrate);
 
-	state->step = CEDRUS_ENC_H264_STEP_START;
-	state->gop_index = 0;
-	state->frame_num = 0;
-	state->pic_order_cnt_lsb = 0;
+	/*
+	 * Constant bitrate must stay within one frame worth of bits from the
+	 * target while variable bitrate may use the margin up to the peak
+	 * bitrate over one second.
+	 */
+	if (h264_ctx->bitrate_mode == V4L2_MPEG_VIDEO_BITRATE_MODE_CBR)
+		return frame_bits;
 
-	h264_ctx->subpix_last_dma = 0;
+	return max_t(s64, frame_bits, h264_ctx->bitrate_peak -
+		     h264_ctx->bitrate);
+}
 
-	/* Bitstream Parameters */
+/*
+ * Follow bitrate and frame rate changes from the next frame, scaling the QP
+ * by the ratio of the frame budgets instead of waiting for the buffer to
+ * drift. Small changes add up until they are worth a QP step.
+ */
+static void cedrus_enc_h264_rc_retarget(struct cedrus_context *cedrus_ctx)
+{
+	struct cedrus_enc_h264_context *h264_ctx = cedrus_ctx->engine_ctx;
+	struct cedrus_enc_h264_state *state = &h264_ctx->state;
+	s64 frame_bits, estimate;
+	int delta = 0;
 
-	h264_ctx->log2_max_frame_num = 8;
-	h264_ctx->pic_order_cnt_type = 0;
-	h264_ctx->log2_max_pic_order_cnt_lsb = 8;
+	if (!h264_ctx->rc_enable ||
+	    h264_ctx->bitrate_mode == V4L2_MPEG_VIDEO_BITRATE_MODE_CQ)
+		return;
 
-	/* Grab entropy mode control for later use. */
+	frame_bits = cedrus_enc_h264_rc_frame_bits(cedrus_ctx,
+						   h264_ctx->bitrate);
 
-	id = V4L2_CID_MPEG_VIDEO_H264_ENTROPY_MODE;
-	h264_ctx->entropy_mode_ctrl = v4l2_ctrl_find(ctrl_handler, id);
-	if (!h264_ctx->entropy_mode_ctrl) {
-		ret = -ENODEV;
-		goto error_dma;
+	if (!state->rc_frame_bits) {
+		state->rc_frame_bits = frame_bits;
+		return;
 	}
 
-	/* Apply initial control values. */
+	/* Each QP step changes the frame size by about 12%. */
+	estimate = state->rc_frame_bits;
 
-	ret = v4l2_ctrl_handler_setup(ctrl_handler);
-	if (ret)
-		goto error_dma;
+	while (estimate > frame_bits + frame_bits / 8 && delta < 51) {
+		estimate -= estimate / 9;
+		delta++;
+	}
 
-	return 0;
+	while (estimate < frame_bits - frame_bits / 8 && delta > -51) {
+		estimate += estimate / 8;
+		delta--;
+	}
 
-error_dma:
-	dma_free_attrs(dev, h264_ctx->mb_info_size, h264_ctx->mb_info,
-		       h264_ctx->mb_info_dma, DMA_ATTR_NO_KERNEL_MAPPING);
+	if (!delta)
+		return;
 
-	return ret;
+	state->rc_qp = clamp((int)state->rc_qp + delta, h264_ctx->qp_min,
+			     h264_ctx->qp_max);
+	state->rc_frame_bits = frame_bits;
 }
 
-static void cedrus_enc_h264_cleanup(struct cedrus_context *cedrus_ctx)
+static bool cedrus_enc_h264_rc_skip_check(struct cedrus_context *cedrus_ctx)
 {
-	struct device *dev = cedrus_ctx->proc->dev->dev;
 	struct cedrus_enc_h264_context *h264_ctx = cedrus_ctx->engine_ctx;
+	struct cedrus_enc_h264_state *state = &h264_ctx->state;
+	s64 limit;
 
-	dma_free_attrs(dev, h264_ctx->mb_info_size, h264_ctx->mb_info,
-		       h264_ctx->mb_info_dma, DMA_ATTR_NO_KERNEL_MAPPING);
-}
-
-/* Buffer */
-
-static int cedrus_enc_h264_buffer_setup(struct cedrus_context *cedrus_ctx,
-					struct cedrus_buffer *cedrus_buffer)
-{
-	struct device *dev = cedrus_ctx->proc->dev->dev;
-	struct cedrus_enc_h264_buffer *h264_buffer =
-		cedrus_buffer->engine_buffer;
-	struct v4l2_pix_format *pix_format =
-		&cedrus_ctx->v4l2.format_picture.fmt.pix;
-	unsigned int width_mbs, height_mbs;
-	unsigned int subpix_size_width, subpix_size_height;
-	int ret;
-
-	width_mbs = DIV_ROUND_UP(pix_format->width, 16);
-	height_mbs = DIV_ROUND_UP(pix_format->height, 16);
-
-	/* Sub-pixel Buffer */
+	/* Buffer fullness is only tracked with bitrate control. */
+	if (!h264_ctx->rc_enable ||
+	    h264_ctx->bitrate_mode == V4L2_MPEG_VIDEO_BITRATE_MODE_CQ)
+		return false;
 
-	subpix_size_width = ALIGN_DOWN((width_mbs + 47) * 2 / 3, 32) +
-			    ALIGN(width_mbs, 32) * 2;
-	subpix_size_height = (height_mbs * 16 + 72) / 8;
+	/*
+	 * The coded picture buffer must not underflow at the decoder, whatever
+	 * the frame skip mode, which takes another frame when it can't fit.
+	 */
+	if (state->hrd_size &&
+	    state->hrd_fullness +
+	    cedrus_enc_h264_rc_frame_bits(cedrus_ctx, state->hrd_bitrate) >
+	    state->hrd_size)
+		return true;
 
-	h264_buffer->subpix_size = subpix_size_width * subpix_size_height;
+	/* Skip frames until the excess bits have been drained. */
+	switch (h264_ctx->frame_skip_mode) {
+	case V4L2_MPEG_VIDEO_FRAME_SKIP_MODE_LEVEL_LIMIT:
+		limit = (s64)cedrus_enc_h264_level_max_cpb(state->level) *
+			1000;
+		return state->rc_level_fullness > limit;
+	case V4L2_MPEG_VIDEO_FRAME_SKIP_MODE_BUF_LIMIT:
+		limit = cedrus_enc_h264_rc_window(cedrus_ctx);
+		return state->rc_fullness > limit;
+	default:
+		return false;
+	}
+}
 
-	h264_buffer->subpix = dma_alloc_attrs(dev, h264_buffer->subpix_size,
-					      &h264_buffer->subpix_dma,
-					      GFP_KERNEL,
-					      DMA_ATTR_NO_KERNEL_MAPPING);
-	if (!h264_buffer->subpix)
-		return -ENOMEM;
+static bool
+cedrus_enc_h264_latency_skip_check(struct cedrus_context *cedrus_ctx)
+{
+	struct cedrus_enc_h264_context *h264_ctx = cedrus_ctx->engine_ctx;
+	struct cedrus_buffer *cedrus_buffer;
+	s64 latency;
 
-	/* Reconstruction Buffer */
+	if (!h264_ctx->max_latency)
+		return false;
 
-	h264_buffer->rec_luma_size = ALIGN(width_mbs, 2) * 16 *
-				     ALIGN(height_mbs + 1, 4) * 16;
-	h264_buffer->rec_chroma_size = ALIGN(width_mbs, 2) * 16 *
-				       ALIGN(DIV_ROUND_UP(height_mbs, 2), 4) *
-				       16;
+	cedrus_buffer = cedrus_job_buffer_picture(cedrus_ctx);
+	latency = ktime_ms_delta(ktime_get(), cedrus_buffer->time_queue);
 
-	h264_buffer->rec_size = ALIGN(h264_buffer->rec_luma_size +
-				      h264_buffer->rec_chroma_size, SZ_4K);
+	return latency > h264_ctx->max_latency;
+}
 
-	h264_buffer->rec = dma_alloc_attrs(dev, h264_buffer->rec_size,
-					   &h264_buffer->rec_dma, GFP_KERNEL,
-					   DMA_ATTR_NO_KERNEL_MAPPING);
-	if (!h264_buffer->rec) {
-		ret = -ENOMEM;
-		goto error_subpix;
+/*
+ * Constant quality maps the quality to a base QP, raised for complex scenes
+ * and lowered for simple ones, where the same QP would look better or worse.
+ * The frame complexity is the MAD computed by the hardware, which doesn't
+ * depend on the QP unlike the residual bits.
+ */
+static unsigned int cedrus_enc_h264_rc_cq_qp(struct cedrus_context *cedrus_ctx)
+{
+	struct cedrus_enc_h264_context *h264_ctx = cedrus_ctx->engine_ctx;
+	struct cedrus_enc_h264_state *state = &h264_ctx->state;
+	unsigned int ref = CEDRUS_ENC_H264_CQ_MAD_REF <<
+			   CEDRUS_ENC_H264_CQ_MAD_SHIFT;
+	unsigned int estimate = state->cq_mad;
+	int qp, delta = 0;
+
+	qp = DIV_ROUND_CLOSEST((100 - h264_ctx->constant_quality) * 51, 99);
+
+	/* Each QP step covers about a third more complexity. */
+	while (estimate && estimate > ref + ref / 3 &&
+	       delta < CEDRUS_ENC_H264_CQ_QP_DELTA_MAX) {
+		estimate -= estimate / 4;
+		delta++;
 	}
 
-	return 0;
-
-error_subpix:
-	dma_free_attrs(dev, h264_buffer->subpix_size, h264_buffer->subpix,
-		       h264_buffer->subpix_dma, DMA_ATTR_NO_KERNEL_MAPPING);
+	while (estimate && estimate < ref - ref / 4 &&
+	       delta > -CEDRUS_ENC_H264_CQ_QP_DELTA_MAX) {
+		estimate += estimate / 3;
+		delta--;
+	}
 
-	return ret;
+	return clamp(qp + delta, h264_ctx->qp_min, h264_ctx->qp_max);
 }
 
-static void cedrus_enc_h264_buffer_cleanup(struct cedrus_context *ctx,
-					   struct cedrus_buffer *cedrus_buffer)
+static void cedrus_enc_h264_rc_cq_update(struct cedrus_context *cedrus_ctx)
 {
-	struct device *dev = ctx->proc->dev->dev;
-	struct cedrus_enc_h264_buffer *h264_buffer =
-		cedrus_buffer->engine_buffer;
-
-	dma_free_attrs(dev, h264_buffer->rec_size, h264_buffer->rec,
-		       h264_buffer->rec_dma, DMA_ATTR_NO_KERNEL_MAPPING);
+	struct cedrus_device *dev = cedrus_ctx->proc->dev;
+	struct cedrus_enc_h264_context *h264_ctx = cedrus_ctx->engine_ctx;
+	struct cedrus_enc_h264_state *state = &h264_ctx->state;
+	struct cedrus_enc_h264_job *job = cedrus_ctx->engine_job;
+	unsigned int mbs = h264_ctx->width_mbs * h264_ctx->height_mbs;
+	unsigned int mad;
+	u64 mad_sum;
+
+	/* Only the MAD of P frames is measured against the references. */
+	if (job->frame_type == CEDRUS_ENC_H264_FRAME_TYPE_P && !job->skip) {
+		mad_sum = cedrus_read(dev, VE_ENC_AVC_RC_MAD_SUM_REG);
+		mad = div_u64(mad_sum << CEDRUS_ENC_H264_CQ_MAD_SHIFT, mbs);
+
+		/* Follow scenes rather than single frames. */
+		if (state->cq_mad)
+			state->cq_mad = (3 * state->cq_mad + mad) / 4;
+		else
+			state->cq_mad = mad;
+	}
 
-	dma_free_attrs(dev, h264_buffer->subpix_size, h264_buffer->subpix,
-		       h264_buffer->subpix_dma, DMA_ATTR_NO_KERNEL_MAPPING);
+	/* The quality may change at any frame. */
+	state->rc_qp = cedrus_enc_h264_rc_cq_qp(cedrus_ctx);
 }
 
-/* Job */
-
-static int cedrus_enc_h264_job_prepare(struct cedrus_context *cedrus_ctx)
+static void cedrus_enc_h264_rc_update(struct cedrus_context *cedrus_ctx,
+				      unsigned int bits)
 {
+	struct cedrus_device *dev = cedrus_ctx->proc->dev;
 	struct cedrus_enc_h264_context *h264_ctx = cedrus_ctx->engine_ctx;
 	struct cedrus_enc_h264_state *state = &h264_ctx->state;
 	struct cedrus_enc_h264_job *job = cedrus_ctx->engine_job;
-	struct v4l2_ctrl_handler *ctrl_handler = &cedrus_ctx->v4l2.ctrl_handler;
+	s64 frame_bits, frame_bits_peak;
+	s64 window, target;
+	unsigned int mad_sum, mad;
+	int delta_max = 2;
+	int delta = 0;
+	s64 estimate;
+
+	if (h264_ctx->bitrate_mode == V4L2_MPEG_VIDEO_BITRATE_MODE_CQ) {
+		cedrus_enc_h264_rc_cq_update(cedrus_ctx);
+		return;
+	}
 
-	/* Sample a coherent state of the controls. */
-	mutex_lock(ctrl_handler->lock);
+	frame_bits = cedrus_enc_h264_rc_frame_bits(cedrus_ctx,
+						   h264_ctx->bitrate);
+	frame_bits_peak = cedrus_enc_h264_rc_frame_bits(cedrus_ctx,
+							h264_ctx->bitrate_peak);
+	window = cedrus_enc_h264_rc_window(cedrus_ctx);
+
+	state->rc_fullness += (s64)bits - frame_bits;
+	state->rc_fullness = clamp_t(s64, state->rc_fullness, -2 * window,
+				     4 * window);
+
+	/* The level buffer is much larger than the window, and may run empty. */
+	state->rc_level_fullness += (s64)bits - frame_bits;
+	state->rc_level_fullness = max_t(s64, state->rc_level_fullness, 0);
+
+	/* The buffer drains at the HRD bitrate and may run empty. */
+	if (state->hrd_size) {
+		state->hrd_fullness += (s64)bits -
+			cedrus_enc_h264_rc_frame_bits(cedrus_ctx,
+						      state->hrd_bitrate);
+		state->hrd_fullness = max_t(s64, state->hrd_fullness, 0);
+	}
 
-	/* Use a single slot for each parameter. */
-	job->seq_parameter_set_id = 0;
-	job->pic_parameter_set_id = 0;
+	/* Complexity changes by more than twice indicate a scene change. */
+	mad_sum = cedrus_read(dev, VE_ENC_AVC_RC_MAD_SUM_REG);
+	if (state->rc_mad_sum &&
+	    (mad_sum / 2 > state->rc_mad_sum || mad_sum < state->rc_mad_sum / 2))
+		delta_max = 4;
 
-	/* Mark every frame as reference. */
-	job->nal_ref_idc = 2;
+	state->rc_mad_sum = mad_sum;
 
-	/* GOP */
+	/*
+	 * I frames are expected to be larger and skipped frames smaller, so
+	 * they only affect the buffer.
+	 */
+	if (job->frame_type != CEDRUS_ENC_H264_FRAME_TYPE_P || job->skip)
+		return;
 
-	if (h264_ctx->gop_closure) {
-		if (state->gop_index == 0)
-			job->frame_type = CEDRUS_ENC_H264_FRAME_TYPE_IDR;
-		else
-			job->frame_type = CEDRUS_ENC_H264_FRAME_TYPE_P;
-	} else {
-		if (state->gop_index == 0)
-			job->frame_type = CEDRUS_ENC_H264_FRAME_TYPE_IDR;
-		else if (h264_ctx->gop_open_i_period > 0 &&
-			 (state->gop_index % h264_ctx->gop_open_i_period) == 0)
-			job->frame_type = CEDRUS_ENC_H264_FRAME_TYPE_I;
-		else
-			job->frame_type = CEDRUS_ENC_H264_FRAME_TYPE_P;
-	}
+	/* Spread the buffer correction over the next frames. */
+	target = frame_bits - div_s64(state->rc_fullness, 8);
+	target = max_t(s64, target, frame_bits / 4);
 
-	if (h264_ctx->force_key_frame) {
-		job->frame_type = CEDRUS_ENC_H264_FRAME_TYPE_IDR;
-		h264_ctx->force_key_frame = false;
-	}
+	if (h264_ctx->bitrate_mode == V4L2_MPEG_VIDEO_BITRATE_MODE_VBR)
+		target = min_t(s64, target, frame_bits_peak);
 
-	state->gop_index++;
+	/* Keep room in the coded picture buffer for the next frames. */
+	if (state->hrd_size)
+		target = clamp_t(s64, (state->hrd_size -
+				       state->hrd_fullness) / 2, 1, target);
 
-	if (h264_ctx->gop_closure)
-		state->gop_index %= h264_ctx->gop_size;
+	/*
+	 * The next frame is expected to follow the complexity trend of the
+	 * frame MAD, within a factor of two: frames getting more complex
+	 * raise the QP before they overshoot, instead of one frame late.
+	 */
+	estimate = bits;
 
-	/* Identification */
+	mad = cedrus_read(dev, VE_ENC_AVC_MAD_REG);
+	if (state->rc_mad && mad)
+		estimate = div_u64((u64)bits *
+				   clamp(mad, state->rc_mad / 2,
+					 state->rc_mad * 2), state->rc_mad);
 
-	if (job->frame_type == CEDRUS_ENC_H264_FRAME_TYPE_IDR) {
-		job->idr_pic_id = 0;
-		state->frame_num = 0;
-		state->pic_order_cnt_lsb = 0;
+	state->rc_mad = mad;
 
-		if (h264_ctx->prepend_sps_pps_idr)
-			state->step = CEDRUS_ENC_H264_STEP_SPS;
+	/* Each QP step changes the frame size by about 12%. */
+	while (estimate > target + target / 8 && delta < delta_max) {
+		estimate -= estimate / 9;
+		delta++;
 	}
 
-	job->frame_num = state->frame_num;
-
-	state->frame_num++;
-	state->frame_num %= BIT(h264_ctx->log2_max_frame_num);
+	while (estimate < target - target / 8 && delta > -delta_max) {
+		estimate += estimate / 8;
+		delta--;
+	}
 
-	job->pic_order_cnt_lsb = state->pic_order_cnt_lsb;
+	/*
+	 * The buffer thresholds of the frame-level model still apply, for a
+	 * buffer drifting away while the frames are close to the target.
+	 */
+	if (state->rc_fullness > 2 * window)
+		delta = max(delta, 1);
+	else if (state->rc_fullness < -window)
+		delta = min(delta, -1);
+
+	/* Never go over the peak bitrate twice in a row. */
+	if (h264_ctx->bitrate_mode == V4L2_MPEG_VIDEO_BITRATE_MODE_VBR &&
+	    bits > frame_bits_peak)
+		delta = max(delta, 1);
+
+	state->rc_qp = clamp((int)state->rc_qp + delta, h264_ctx->qp_min,
+			     h264_ctx->qp_max);
+}
 
-	state->pic_order_cnt_lsb += 2;
-	state->pic_order_cnt_lsb %= BIT(h264_ctx->log2_max_pic_order_cnt_lsb);
+/*
+ * The size of the frame in the previous pass is scaled to the budget, using the
+ * same model as rate control but with the actual complexity of the frame.
+ */
+static unsigned int
+cedrus_enc_h264_frame_budget_qp(struct cedrus_context *cedrus_ctx)
+{
+	struct cedrus_enc_h264_context *h264_ctx = cedrus_ctx->engine_ctx;
+	const s32 *budget = h264_ctx->frame_budget;
+	s64 estimate = budget[CEDRUS_H264_ENC_FRAME_BUDGET_PASS_BITS];
+	s64 target = budget[CEDRUS_H264_ENC_FRAME_BUDGET_BITS];
+	int qp = min(budget[CEDRUS_H264_ENC_FRAME_BUDGET_PASS_QP],
+		     CEDRUS_ENC_H264_QP_COUNT - 1);
+
+	if (!estimate || !target)
+		return qp;
+
+	/* Each QP step changes the frame size by about 12%. */
+	while (estimate > target + target / 8 &&
+	       qp < CEDRUS_ENC_H264_QP_COUNT - 1) {
+		estimate -= estimate / 9;
+		qp++;
+	}
 
-	/* Profile/Level */
+	while (estimate < target - target / 8 && qp > 0) {
+		estimate += estimate / 8;
+		qp--;
+	}
 
-	job->profile_idc = cedrus_enc_h264_profile_idc(h264_ctx->profile);
-	job->level_idc = cedrus_enc_h264_level_idc(h264_ctx->level);
-	job->constraint_set_flags =
-		cedrus_enc_h264_constraint_set_flags(h264_ctx->profile);
+	return qp;
+}
 
-	/* Features */
+/* Lookahead */
 
-	if (h264_ctx->entropy_mode == V4L2_MPEG_VIDEO_H264_ENTROPY_MODE_CABAC) {
-		job->entropy_coding_mode_flag = 1;
+/*
+ * Average the luma samples of a sparse grid over the picture, which costs a
+ * thousand CPU reads regardless of the picture size.
+ */
+static bool cedrus_enc_h264_lookahead_sign(struct cedrus_context *cedrus_ctx,
+					   struct vb2_buffer *vb2_buffer,
+					   u8 *sign)
+{
+	struct v4l2_pix_format *pix_format =
+		&cedrus_ctx->v4l2.format_picture.fmt.pix;
+	unsigned int side = CEDRUS_ENC_H264_LOOKAHEAD_GRID *
+			    CEDRUS_ENC_H264_LOOKAHEAD_SAMPLES;
+	u16 sums[CEDRUS_ENC_H264_LOOKAHEAD_SIGN_SIZE] = { 0 };
+	unsigned int cell, x, y, i, j;
+	u8 *luma, *row;
+
+	/* The CPU cache is not kept in sync with the picture data. */
+	if (vb2_buffer->vb2_queue->non_coherent_mem)
+		return false;
 
-		if (job->frame_type == CEDRUS_ENC_H264_FRAME_TYPE_IDR ||
-		    job->frame_type == CEDRUS_ENC_H264_FRAME_TYPE_I)
-			job->cabac_init_idc = 0;
-		else
-			job->cabac_init_idc = 1;
-	} else {
-		job->entropy_coding_mode_flag = 0;
-		job->cabac_init_idc = 0;
-	}
+	/* Luma always comes first, in the first plane. */
+	luma = vb2_plane_vaddr(vb2_buffer, 0);
+	if (!luma)
+		return false;
 
-	job->chroma_qp_index_offset = h264_ctx->chroma_qp_index_offset;
+	for (i = 0; i < side; i++) {
+		y = (2 * i + 1) * pix_format->height / (2 * side);
+		row = luma + y * pix_format->bytesperline;
 
-	job->disable_deblocking_filter_idc =
-		cedrus_enc_h264_disable_deblocking_filter_idc(h264_ctx->loop_filter_mode);
+		for (j = 0; j < side; j++) {
+			x = (2 * j + 1) * pix_format->width / (2 * side);
+			cell = (i / CEDRUS_ENC_H264_LOOKAHEAD_SAMPLES) *
+			       CEDRUS_ENC_H264_LOOKAHEAD_GRID +
+			       j / CEDRUS_ENC_H264_LOOKAHEAD_SAMPLES;
 
-	if (job->disable_deblocking_filter_idc != 1) {
-		job->slice_alpha_c0_offset_div2 = h264_ctx->loop_filter_alpha;
-		job->slice_beta_offset_div2 = h264_ctx->loop_filter_beta;
+			sums[cell] += row[x];
+		}
 	}
 
-	/* QP */
-
-	switch (job->frame_type) {
-	case CEDRUS_ENC_H264_FRAME_TYPE_IDR:
-	case CEDRUS_ENC_H264_FRAME_TYPE_I:
-		job->qp = h264_ctx->qp_i;
-		break;
-	case CEDRUS_ENC_H264_FRAME_TYPE_P:
-		job->qp = h264_ctx->qp_p;
-		break;
-	}
+	for (i = 0; i < CEDRUS_ENC_H264_LOOKAHEAD_SIGN_SIZE; i++)
+		sign[i] = sums[i] / (CEDRUS_ENC_H264_LOOKAHEAD_SAMPLES *
+				     CEDRUS_ENC_H264_LOOKAHEAD_SAMPLES);
 
-	if (job->qp > h264_ctx->qp_max)
-		job->qp = h264_ctx->qp_max;
-	else if (job->qp < h264_ctx->qp_min)
-		job->qp = h264_ctx->qp_min;
+	return true;
+}
 
-	/* Set initial QP to current QP with each new PPS. */
-	if (state->step < CEDRUS_ENC_H264_STEP_SLICE)
-		state->qp_init = job->qp;
+static unsigned int cedrus_enc_h264_lookahead_diff(const u8 *sign_a,
+						   const u8 *sign_b)
+{
+	unsigned int diff = 0;
+	unsigned int i;
 
-	mutex_unlock(ctrl_handler->lock);
+	for (i = 0; i < CEDRUS_ENC_H264_LOOKAHEAD_SIGN_SIZE; i++)
+		diff += abs((int)sign_a[i] - (int)sign_b[i]);
 
-	return 0;
+	return diff / CEDRUS_ENC_H264_LOOKAHEAD_SIGN_SIZE;
 }
 
-static void cedrus_enc_h264_job_configure_sps(struct cedrus_context *cedrus_ctx)
+/*
+ * Compare the signatures of the next picture and the ones queued after it to
+ * find the scene cuts, which are placed on intra frames. Return the QP delta
+ * for the next picture when it is a P frame.
+ */
+static int cedrus_enc_h264_lookahead(struct cedrus_context *cedrus_ctx)
 {
-	struct cedrus_device *dev = cedrus_ctx->proc->dev;
-	struct cedrus_enc_h264_job *job = cedrus_ctx->engine_job;
 	struct cedrus_enc_h264_context *h264_ctx = cedrus_ctx->engine_ctx;
-	struct v4l2_pix_format *pix_format =
-		&cedrus_ctx->v4l2.format_picture.fmt.pix;
-	struct v4l2_fract *timeperframe = &cedrus_ctx->v4l2.timeperframe_coded;
-	struct v4l2_rect *selection = &cedrus_ctx->v4l2.selection_picture;
-	u32 crop_left, crop_right, crop_top, crop_bottom;
-	u8 profile_idc = job->profile_idc;
-	u8 header;
-
-	/* Syntax element: Annex-B start code. */
-	cedrus_enc_h264_coded_u32(dev, 0x1);
+	struct cedrus_enc_h264_state *state = &h264_ctx->state;
+	struct v4l2_m2m_ctx *m2m_ctx = cedrus_ctx->v4l2.fh.m2m_ctx;
+	struct vb2_v4l2_buffer *buffer_picture = cedrus_ctx->job.buffer_picture;
+	struct vb2_buffer *buffers[CEDRUS_H264_ENC_LOOKAHEAD_MAX];
+	u8 sign[2][CEDRUS_ENC_H264_LOOKAHEAD_SIGN_SIZE];
+	struct v4l2_m2m_buffer *m2m_buffer;
+	unsigned int count = 0, cut = 0;
+	unsigned int diff, diff_max;
+	unsigned long flags;
+	unsigned int i;
+
+	if (!cedrus_ctx->lookahead)
+		return 0;
 
-	header = cedrus_enc_h264_nalu_header(CENDRUS_ENC_H264_NALU_TYPE_SPS, 3);
+	if (!cedrus_enc_h264_lookahead_sign(cedrus_ctx,
+					    &buffer_picture->vb2_buf,
+					    sign[0])) {
+		state->lookahead_sign_valid = false;
+		return 0;
+	}
 
-	/* Syntax element: NALU header. */
-	cedrus_enc_h264_coded_u8(dev, header);
+	diff_max = 0;
 
-	/* Syntax element: profile_idc. */
-	cedrus_enc_h264_coded_u8(dev, job->profile_idc);
+	if (state->lookahead_sign_valid) {
+		diff_max = cedrus_enc_h264_lookahead_diff(state->lookahead_sign,
+							  sign[0]);
 
-	/* Syntax elements: constraint_set*_flag, reserved_zero_2bits. */
-	cedrus_enc_h264_coded_u8(dev, job->constraint_set_flags);
+		/* Start the new scene right away. */
+		if (diff_max > CEDRUS_ENC_H264_LOOKAHEAD_CUT) {
+			state->scene_change = true;
 
-	/* Syntax element: level_idc. */
-	cedrus_enc_h264_coded_u8(dev, job->level_idc);
+			/*
+			 * Closed GOPs and patterns start over from the cut,
+			 * unless held B frames must be ended with a P frame
+			 * first.
+			 */
+			if ((h264_ctx->gop_closure ||
+			     state->gop_pattern_count) && !state->b_count)
+				state->gop_index = 0;
 
-	/* Syntax element: seq_parameter_set_id. */
-	cedrus_enc_h264_coded_ue(dev, job->seq_parameter_set_id);
+			diff_max = 0;
+		}
+	}
 
-	if (profile_idc == 100 || profile_idc == 110 || profile_idc == 122 ||
-	    profile_idc == 244 || profile_idc == 44 || profile_idc == 83 ||
-	    profile_idc == 86 || profile_idc == 118 || profile_idc == 128 ||
-	    profile_idc == 138 || profile_idc == 139 || profile_idc == 134 ||
-	    profile_idc == 135) {
-		/* Syntax element: chroma_format_idc, always YUV 4:2:0 (1). */
-		cedrus_enc_h264_coded_ue(dev, 1);
+	memcpy(state->lookahead_sign, sign[0], sizeof(sign[0]));
+	state->lookahead_sign_valid = true;
 
-		/* Syntax element: bit_depth_luma_minus8. */
-		cedrus_enc_h264_coded_ue(dev, 0);
+	/*
+	 * Queued buffers are only removed by the job path or once the running
+	 * job is done, so they can be used outside of the lock, which cannot
+	 * be held while mapping them.
+	 */
+	spin_lock_irqsave(&m2m_ctx->out_q_ctx.rdy_spinlock, flags);
 
-		/* Syntax element: bit_depth_chroma_minus8. */
-		cedrus_enc_h264_coded_ue(dev, 0);
+	v4l2_m2m_for_each_src_buf(m2m_ctx, m2m_buffer) {
+		if (count == cedrus_ctx->lookahead)
+			break;
 
-		/* Syntax element: qpprime_y_zero_transform_bypass_flag. */
-		cedrus_enc_h264_coded_bit(dev, 0);
+		if (&m2m_buffer->vb == buffer_picture)
+			continue;
 
-		/* Syntax element: seq_scaling_matrix_present_flag. */
-		cedrus_enc_h264_coded_bit(dev, 0);
+		buffers[count++] = &m2m_buffer->vb.vb2_buf;
 	}
 
-	/* Syntax element: log2_max_frame_num_minus4. */
-	cedrus_enc_h264_coded_ue(dev, h264_ctx->log2_max_frame_num - 4);
+	spin_unlock_irqrestore(&m2m_ctx->out_q_ctx.rdy_spinlock, flags);
 
-	/* Syntax element: pic_order_cnt_type. */
-	cedrus_enc_h264_coded_ue(dev, 0);
+	for (i = 0; i < count; i++) {
+		if (!cedrus_enc_h264_lookahead_sign(cedrus_ctx, buffers[i],
+						    sign[(i + 1) % 2]))
+			break;
 
-	/* Syntax element: log2_max_pic_order_cnt_lsb_minus4. */
-	cedrus_enc_h264_coded_ue(dev, h264_ctx->log2_max_pic_order_cnt_lsb - 4);
+		diff = cedrus_enc_h264_lookahead_diff(sign[i % 2],
+						      sign[(i + 1) % 2]);
+		if (diff > CEDRUS_ENC_H264_LOOKAHEAD_CUT) {
+			cut = i + 1;
+			break;
+		}
 
-	/* Syntax element: max_num_ref_frames. */
-	cedrus_enc_h264_coded_ue(dev, 1);
+		diff_max = max(diff_max, diff);
+	}
 
-	/* Syntax element: gaps_in_frame_num_value_allowed_flag. */
-	cedrus_enc_h264_coded_bit(dev, 0);
+	if (cut) {
+		/*
+		 * Hold the end of a closed GOP back until the cut, so that
+		 * its IDR frame is not wasted right before it.
+		 */
+		if (h264_ctx->gop_closure && !state->gop_pattern_count &&
+		    h264_ctx->gop_size > 1 &&
+		    state->gop_index == h264_ctx->gop_size - 1)
+			state->gop_index--;
 
-	/* Syntax element: pic_width_in_mbs_minus1. */
-	cedrus_enc_h264_coded_ue(dev, h264_ctx->width_mbs - 1);
+		/* The last picture of a scene is not referenced for long. */
+		if (cut == 1)
+			return CEDRUS_ENC_H264_LOOKAHEAD_QP_CUT;
 
-	/* Syntax element: pic_height_in_map_units_minus1. */
-	cedrus_enc_h264_coded_ue(dev, h264_ctx->height_mbs - 1);
+		return 0;
+	}
 
-	/* Syntax element: frame_mbs_only_flag. */
-	cedrus_enc_h264_coded_bit(dev, 1);
+	/* Static content is referenced for long, so it is worth more bits. */
+	if (i == cedrus_ctx->lookahead &&
+	    diff_max <= CEDRUS_ENC_H264_LOOKAHEAD_STATIC)
+		return CEDRUS_ENC_H264_LOOKAHEAD_QP_STATIC;
 
-	/* Syntax element: direct_8x8_inference_flag. */
-	cedrus_enc_h264_coded_bit(dev, 0);
+	return 0;
+}
 
-	if (selection->width != pix_format->width ||
-	    selection->height != pix_format->height) {
-		crop_left = selection->left;
-		crop_right = pix_format->width - selection->width -
-			     selection->left;
-		crop_top = selection->top;
-		crop_bottom = pix_format->height - selection->height -
-			      selection->top;
+/* Static Skip */
 
-		/* Syntax element: frame_cropping_flag. */
-		cedrus_enc_h264_coded_bit(dev, 1);
+/*
+ * Compare the signature of the next picture with the one of the last encoded
+ * P frame, which skipped frames keep repeating, so that slow changes still
+ * get encoded eventually.
+ */
+static bool cedrus_enc_h264_static_skip_check(struct cedrus_context *cedrus_ctx)
+{
+	struct cedrus_enc_h264_context *h264_ctx = cedrus_ctx->engine_ctx;
+	struct cedrus_enc_h264_state *state = &h264_ctx->state;
+	struct vb2_v4l2_buffer *buffer_picture = cedrus_ctx->job.buffer_picture;
+	u8 sign[CEDRUS_ENC_H264_LOOKAHEAD_SIGN_SIZE];
+	unsigned int i;
 
-		/* Syntax element: frame_crop_left_offset. */
-		cedrus_enc_h264_coded_ue(dev, crop_left / 2);
+	if (!h264_ctx->static_skip)
+		return false;
 
-		/* Syntax element: frame_crop_right_offset. */
-		cedrus_enc_h264_coded_ue(dev, crop_right / 2);
+	if (!cedrus_enc_h264_lookahead_sign(cedrus_ctx,
+					    &buffer_picture->vb2_buf, sign)) {
+		state->static_sign_valid = false;
+		return false;
+	}
 
-		/* Syntax element: frame_crop_top_offset. */
-		cedrus_enc_h264_coded_ue(dev, crop_top / 2);
+	if (state->static_sign_valid) {
+		for (i = 0; i < CEDRUS_ENC_H264_LOOKAHEAD_SIGN_SIZE; i++)
+			if (abs((int)state->static_sign[i] - (int)sign[i]) >=
+			    h264_ctx->static_skip)
+				break;
 
-		/* Syntax element: frame_crop_bottom_offset. */
-		cedrus_enc_h264_coded_ue(dev, crop_bottom / 2);
+		if (i == CEDRUS_ENC_H264_LOOKAHEAD_SIGN_SIZE)
+			return true;
+	}
+
+	memcpy(state->static_sign, sign, sizeof(sign));
+	state->static_sign_valid = true;
+
+	return false;
+}
+
+/* GOP Pattern */
+
+#define CEDRUS_ENC_H264_GOP_PATTERN_ENTRY(pattern, index) \
+	(&(pattern)[(index) * CEDRUS_H264_ENC_GOP_PATTERN_FIELDS_COUNT])
+
+/* Entries of a GOP pattern, up to the first empty one. */
+static unsigned int cedrus_enc_h264_gop_pattern_count(const s32 *pattern)
+{
+	const s32 *entry;
+	unsigned int count;
+
+	for (count = 0; count < CEDRUS_H264_ENC_GOP_PATTERN_MAX; count++) {
+		entry = CEDRUS_ENC_H264_GOP_PATTERN_ENTRY(pattern, count);
+
+		if (entry[CEDRUS_H264_ENC_GOP_PATTERN_FRAME_TYPE] ==
+		    CEDRUS_H264_ENC_GOP_FRAME_NONE)
+			break;
+	}
+
+	return count;
+}
+
+/* Longest run of B frames, as the pattern repeats. */
+static unsigned int cedrus_enc_h264_gop_pattern_b_frames(const s32 *pattern)
+{
+	unsigned int count = cedrus_enc_h264_gop_pattern_count(pattern);
+	unsigned int run = 0, run_max = 0;
+	const s32 *entry;
+	unsigned int i;
+
+	for (i = 0; i < 2 * count; i++) {
+		entry = CEDRUS_ENC_H264_GOP_PATTERN_ENTRY(pattern, i % count);
+
+		if (entry[CEDRUS_H264_ENC_GOP_PATTERN_FRAME_TYPE] ==
+		    CEDRUS_H264_ENC_GOP_FRAME_B)
+			run_max = max(run_max, ++run);
+		else
+			run = 0;
+	}
+
+	return min(run_max, count);
+}
+
+/* B entries are non-reference P frames too, when B frames are not used. */
+static bool cedrus_enc_h264_gop_pattern_non_ref_check(const s32 *entry)
+{
+	return (entry[CEDRUS_H264_ENC_GOP_PATTERN_FRAME_TYPE] ==
+		CEDRUS_H264_ENC_GOP_FRAME_P ||
+		entry[CEDRUS_H264_ENC_GOP_PATTERN_FRAME_TYPE] ==
+		CEDRUS_H264_ENC_GOP_FRAME_B) &&
+	       !entry[CEDRUS_H264_ENC_GOP_PATTERN_REFERENCE];
+}
+
+/* Whether non-reference frames can follow each other, as it repeats. */
+static bool cedrus_enc_h264_gop_pattern_non_ref_runs(const s32 *pattern)
+{
+	unsigned int count = cedrus_enc_h264_gop_pattern_count(pattern);
+	const s32 *entry, *next;
+	unsigned int i;
+
+	for (i = 0; i < count; i++) {
+		entry = CEDRUS_ENC_H264_GOP_PATTERN_ENTRY(pattern, i);
+		next = CEDRUS_ENC_H264_GOP_PATTERN_ENTRY(pattern,
+							 (i + 1) % count);
+
+		if (cedrus_enc_h264_gop_pattern_non_ref_check(entry) &&
+		    cedrus_enc_h264_gop_pattern_non_ref_check(next))
+			return true;
+	}
+
+	return false;
+}
+
+static int cedrus_enc_h264_gop_pattern_validate(const s32 *pattern)
+{
+	unsigned int count = cedrus_enc_h264_gop_pattern_count(pattern);
+	bool p_unreferenced = false;
+	const s32 *entry, *next;
+	unsigned int b_frames;
+	unsigned int i;
+
+	for (i = 0; i < count; i++) {
+		entry = CEDRUS_ENC_H264_GOP_PATTERN_ENTRY(pattern, i);
+		next = CEDRUS_ENC_H264_GOP_PATTERN_ENTRY(pattern,
+							 (i + 1) % count);
+
+		if (entry[CEDRUS_H264_ENC_GOP_PATTERN_FRAME_TYPE] < 0 ||
+		    entry[CEDRUS_H264_ENC_GOP_PATTERN_FRAME_TYPE] >
+		    CEDRUS_H264_ENC_GOP_FRAME_B ||
+		    entry[CEDRUS_H264_ENC_GOP_PATTERN_REFERENCE] < 0 ||
+		    entry[CEDRUS_H264_ENC_GOP_PATTERN_REFERENCE] > 1)
+			return -EINVAL;
+
+		/* Held B frames cannot cross an IDR frame. */
+		if (entry[CEDRUS_H264_ENC_GOP_PATTERN_FRAME_TYPE] ==
+		    CEDRUS_H264_ENC_GOP_FRAME_B &&
+		    next[CEDRUS_H264_ENC_GOP_PATTERN_FRAME_TYPE] ==
+		    CEDRUS_H264_ENC_GOP_FRAME_IDR)
+			return -EINVAL;
+
+		if (entry[CEDRUS_H264_ENC_GOP_PATTERN_FRAME_TYPE] ==
+		    CEDRUS_H264_ENC_GOP_FRAME_P &&
+		    !entry[CEDRUS_H264_ENC_GOP_PATTERN_REFERENCE])
+			p_unreferenced = true;
+	}
+
+	b_frames = cedrus_enc_h264_gop_pattern_b_frames(pattern);
+
+	/* B frames need a reference on both sides, which P frames provide. */
+	if (b_frames && (b_frames == count || p_unreferenced))
+		return -EINVAL;
+
+	return 0;
+}
+
+/* Ctrl */
+
+static int cedrus_enc_h264_ctrl_validate(struct cedrus_context *ctx,
+					 struct v4l2_ctrl *ctrl)
+{
+	struct v4l2_device *v4l2_dev = &ctx->proc->dev->v4l2.v4l2_dev;
+	int profile;
+	unsigned int i;
+
+	switch (ctrl->id) {
+	case V4L2_CID_MPEG_VIDEO_H264_ENTROPY_MODE:
+		struct v4l2_ctrl *ctrl_profile;
+		unsigned int id;
+
+		/* CABAC entropy coding availability depends on profile. */
+		if (ctrl->val != V4L2_MPEG_VIDEO_H264_ENTROPY_MODE_CABAC)
+			return 0;
+
+		id = V4L2_CID_MPEG_VIDEO_H264_PROFILE;
+		ctrl_profile = cedrus_context_ctrl_find(ctx, id);
+		if (WARN_ON(!ctrl_profile))
+			return -ENODEV;
+
+		profile = ctrl_profile->cur.val;
+
+		if (!cedrus_enc_h264_profile_cabac_check(profile)) {
+			v4l2_err(v4l2_dev,
+				 "CABAC entropy coding is not supported with the profile currently set.\n");
+			return -EINVAL;
+		}
+		break;
+	case V4L2_CID_CEDRUS_H264_ENC_ROI:
+		for (i = 0; i < CEDRUS_H264_ENC_ROI_COUNT; i++) {
+			const s32 *roi = &ctrl->p_new.p_s32[i *
+				CEDRUS_H264_ENC_ROI_FIELDS_COUNT];
+
+			if (roi[CEDRUS_H264_ENC_ROI_LEFT] < 0 ||
+			    roi[CEDRUS_H264_ENC_ROI_TOP] < 0 ||
+			    roi[CEDRUS_H264_ENC_ROI_WIDTH] < 0 ||
+			    roi[CEDRUS_H264_ENC_ROI_HEIGHT] < 0 ||
+			    roi[CEDRUS_H264_ENC_ROI_QP_DELTA] < -51 ||
+			    roi[CEDRUS_H264_ENC_ROI_QP_DELTA] > 51)
+				return -EINVAL;
+		}
+		break;
+	case V4L2_CID_CEDRUS_H264_ENC_GOP_PATTERN:
+		return cedrus_enc_h264_gop_pattern_validate(ctrl->p_new.p_s32);
+	}
+
+	return 0;
+}
+
+static int cedrus_enc_h264_ctrl_prepare(struct cedrus_context *cedrus_ctx,
+					struct v4l2_ctrl *ctrl)
+{
+	struct cedrus_enc_h264_context *h264_ctx = cedrus_ctx->engine_ctx;
+	struct cedrus_enc_h264_config *ctrls;
+	unsigned long *events;
+	bool entropy_cavlc = false;
+
+	/*
+	 * This might (and will) be called before we have a codec context.
+	 * Ignore and call v4l2_ctrl_handler_setup explicitly when the codec
+	 * context is created (streaming start).
+	 */
+	if (!h264_ctx)
+		return 0;
+
+	ctrls = &h264_ctx->ctrls;
+	events = &h264_ctx->ctrls_events;
+
+	/* Jobs only sample the values between write sections. */
+	write_seqcount_begin(&h264_ctx->ctrls_seq);
+
+	switch (ctrl->id) {
+	case V4L2_CID_MPEG_VIDEO_PREPEND_SPSPPS_TO_IDR:
+		ctrls->prepend_sps_pps_idr = ctrl->val;
+		break;
+	case V4L2_CID_MPEG_VIDEO_AU_DELIMITER:
+		ctrls->au_delimiter = ctrl->val;
+		break;
+	case V4L2_CID_CEDRUS_H264_ENC_SEI:
+		ctrls->sei = ctrl->val;
+		break;
+	case V4L2_CID_MPEG_VIDEO_HEADER_MODE:
+		ctrls->header_mode = ctrl->val;
+		break;
+	case V4L2_CID_CEDRUS_H264_ENC_AVCC:
+		ctrls->avcc = ctrl->val;
+		break;
+	case V4L2_CID_HFLIP:
+		/* The SPS crop offsets follow the flipped picture selection. */
+		set_bit(CEDRUS_ENC_H264_EVENT_SPS_INVALIDATE, events);
+		break;
+	case V4L2_CID_MPEG_VIDEO_H264_VUI_SAR_ENABLE:
+		ctrls->vui_sar_enable = ctrl->val;
+		set_bit(CEDRUS_ENC_H264_EVENT_SPS_INVALIDATE, events);
+		break;
+	case V4L2_CID_MPEG_VIDEO_H264_VUI_SAR_IDC:
+		ctrls->vui_sar_idc = ctrl->val;
+		set_bit(CEDRUS_ENC_H264_EVENT_SPS_INVALIDATE, events);
+		break;
+	case V4L2_CID_MPEG_VIDEO_H264_VUI_EXT_SAR_WIDTH:
+		ctrls->vui_ext_sar_width = ctrl->val;
+		set_bit(CEDRUS_ENC_H264_EVENT_SPS_INVALIDATE, events);
+		break;
+	case V4L2_CID_MPEG_VIDEO_H264_VUI_EXT_SAR_HEIGHT:
+		ctrls->vui_ext_sar_height = ctrl->val;
+		set_bit(CEDRUS_ENC_H264_EVENT_SPS_INVALIDATE, events);
+		break;
+	case V4L2_CID_MPEG_VIDEO_H264_PROFILE:
+		ctrls->profile = ctrl->val;
+		entropy_cavlc =
+			!cedrus_enc_h264_profile_cabac_check(ctrls->profile);
+		set_bit(CEDRUS_ENC_H264_EVENT_SPS_INVALIDATE, events);
+		break;
+	case V4L2_CID_MPEG_VIDEO_H264_LEVEL:
+		ctrls->level = ctrl->val;
+		set_bit(CEDRUS_ENC_H264_EVENT_SPS_INVALIDATE, events);
+		break;
+	case V4L2_CID_CEDRUS_H264_ENC_LEVEL_AUTO:
+		ctrls->level_auto = ctrl->val;
+		set_bit(CEDRUS_ENC_H264_EVENT_SPS_INVALIDATE, events);
+		break;
+	case V4L2_CID_MPEG_VIDEO_H264_ENTROPY_MODE:
+		ctrls->entropy_mode = ctrl->val;
+		set_bit(CEDRUS_ENC_H264_EVENT_PPS_INVALIDATE, events);
+		break;
+	case V4L2_CID_MPEG_VIDEO_H264_CHROMA_QP_INDEX_OFFSET:
+		ctrls->chroma_qp_index_offset = ctrl->val;
+		set_bit(CEDRUS_ENC_H264_EVENT_PPS_INVALIDATE, events);
+		break;
+	case V4L2_CID_MPEG_VIDEO_H264_LOOP_FILTER_MODE:
+		ctrls->loop_filter_mode = ctrl->val;
+		break;
+	case V4L2_CID_MPEG_VIDEO_H264_LOOP_FILTER_ALPHA:
+		ctrls->loop_filter_alpha = ctrl->val;
+		break;
+	case V4L2_CID_MPEG_VIDEO_H264_LOOP_FILTER_BETA:
+		ctrls->loop_filter_beta = ctrl->val;
+		break;
+	case V4L2_CID_MPEG_VIDEO_H264_MIN_QP:
+		ctrls->qp_min = ctrl->val;
+		break;
+	case V4L2_CID_MPEG_VIDEO_H264_MAX_QP:
+		ctrls->qp_max = ctrl->val;
+		break;
+	case V4L2_CID_MPEG_VIDEO_H264_I_FRAME_QP:
+		ctrls->qp_i = ctrl->val;
+		break;
+	case V4L2_CID_MPEG_VIDEO_H264_P_FRAME_QP:
+		ctrls->qp_p = ctrl->val;
+		break;
+	case V4L2_CID_MPEG_VIDEO_H264_B_FRAME_QP:
+		ctrls->qp_b = ctrl->val;
+		break;
+	case V4L2_CID_MPEG_VIDEO_GOP_CLOSURE:
+		ctrls->gop_closure = ctrl->val;
+		break;
+	case V4L2_CID_MPEG_VIDEO_GOP_SIZE:
+		ctrls->gop_size = ctrl->val;
+		break;
+	case V4L2_CID_MPEG_VIDEO_H264_I_PERIOD:
+		ctrls->gop_open_i_period = ctrl->val;
+		break;
+	case V4L2_CID_MPEG_VIDEO_FORCE_KEY_FRAME:
+		set_bit(CEDRUS_ENC_H264_EVENT_KEY_FRAME, events);
+		break;
+	case V4L2_CID_CEDRUS_H264_ENC_FRAME_SKIP:
+		set_bit(CEDRUS_ENC_H264_EVENT_SKIP_FRAME, events);
+		break;
+	case V4L2_CID_CEDRUS_H264_ENC_FRAME_TYPE:
+		if (ctrl->val == CEDRUS_H264_ENC_FRAME_TYPE_KEY)
+			set_bit(CEDRUS_ENC_H264_EVENT_KEY_FRAME, events);
+		else if (ctrl->val == CEDRUS_H264_ENC_FRAME_TYPE_SKIP)
+			set_bit(CEDRUS_ENC_H264_EVENT_SKIP_FRAME, events);
+		break;
+	case V4L2_CID_CEDRUS_H264_ENC_DENOISE:
+		ctrls->denoise = ctrl->val;
+		break;
+	case V4L2_CID_CEDRUS_H264_ENC_AQ_STRENGTH:
+		ctrls->aq_strength = ctrl->val;
+		break;
+	case V4L2_CID_CEDRUS_H264_ENC_FAST_START:
+		ctrls->fast_start = ctrl->val;
+		break;
+	case V4L2_CID_CEDRUS_H264_ENC_VFR:
+		ctrls->vfr = ctrl->val;
+		break;
+	case V4L2_CID_CEDRUS_H264_ENC_STATIC_SKIP:
+		ctrls->static_skip = ctrl->val;
+		break;
+	case V4L2_CID_CEDRUS_H264_ENC_PRESET:
+		ctrls->preset = ctrl->val;
+		break;
+	case V4L2_CID_CEDRUS_H264_ENC_TIME_BUDGET:
+		ctrls->time_budget = ctrl->val;
+		break;
+	case V4L2_CID_CEDRUS_H264_ENC_MAX_LATENCY:
+		ctrls->max_latency = ctrl->val;
+		break;
+	case V4L2_CID_CEDRUS_H264_ENC_OVERFLOW_RETRIES:
+		ctrls->overflow_retries = ctrl->val;
+		break;
+	case V4L2_CID_CEDRUS_H264_ENC_OVERFLOW_QP_DELTA:
+		ctrls->overflow_qp_delta = ctrl->val;
+		break;
+	case V4L2_CID_CEDRUS_H264_ENC_SCENE_CHANGE:
+		ctrls->scene_change = ctrl->val;
+		break;
+	case V4L2_CID_CEDRUS_H264_ENC_THUMBNAIL:
+		ctrls->thumbnail = ctrl->val;
+		break;
+	case V4L2_CID_CEDRUS_H264_ENC_HEADROOM:
+		ctrls->headroom = ctrl->val;
+		break;
+	case V4L2_CID_CEDRUS_H264_ENC_FRAMES_PACKED:
+		ctrls->frames_packed = ctrl->val;
+		break;
+	case V4L2_CID_CEDRUS_H264_ENC_MV_INFO:
+		ctrls->mv_info = ctrl->val;
+		break;
+	case V4L2_CID_CEDRUS_H264_ENC_COST_MAP:
+		ctrls->cost_map = ctrl->val;
+		break;
+	case V4L2_CID_CEDRUS_H264_ENC_REC_EXPORT:
+		ctrls->rec_export = ctrl->val;
+		break;
+	case V4L2_CID_CEDRUS_H264_ENC_ERROR_RESILIENCE:
+		ctrls->error_resilience = ctrl->val;
+		set_bit(CEDRUS_ENC_H264_EVENT_PPS_INVALIDATE, events);
+		break;
+	case V4L2_CID_CEDRUS_H264_ENC_LOOKAHEAD:
+		ctrls->lookahead = ctrl->val;
+		break;
+	case V4L2_CID_MPEG_VIDEO_FRAME_SKIP_MODE:
+		ctrls->frame_skip_mode = ctrl->val;
+		break;
+	case V4L2_CID_MPEG_VIDEO_FRAME_RC_ENABLE:
+		ctrls->rc_enable = ctrl->val;
+		break;
+	case V4L2_CID_MPEG_VIDEO_BITRATE_MODE:
+		ctrls->bitrate_mode = ctrl->val;
+		break;
+	case V4L2_CID_MPEG_VIDEO_BITRATE:
+		ctrls->bitrate = ctrl->val;
+		break;
+	case V4L2_CID_MPEG_VIDEO_BITRATE_PEAK:
+		ctrls->bitrate_peak = ctrl->val;
+		break;
+	case V4L2_CID_MPEG_VIDEO_VBV_SIZE:
+		ctrls->vbv_size = ctrl->val;
+		set_bit(CEDRUS_ENC_H264_EVENT_SPS_INVALIDATE, events);
+		break;
+	case V4L2_CID_MPEG_VIDEO_CONSTANT_QUALITY:
+		ctrls->constant_quality = ctrl->val;
+		break;
+	case V4L2_CID_CEDRUS_H264_ENC_ROI:
+		memcpy(ctrls->roi, ctrl->p_new.p_s32, sizeof(ctrls->roi));
+		break;
+	case V4L2_CID_CEDRUS_H264_ENC_FRAME_BUDGET:
+		memcpy(ctrls->frame_budget, ctrl->p_new.p_s32,
+		       sizeof(ctrls->frame_budget));
+		set_bit(CEDRUS_ENC_H264_EVENT_FRAME_BUDGET, events);
+		break;
+	case V4L2_CID_CEDRUS_H264_ENC_GOP_PATTERN:
+		memcpy(ctrls->gop_pattern, ctrl->p_new.p_s32,
+		       sizeof(ctrls->gop_pattern));
+		break;
+	case V4L2_CID_CEDRUS_H264_ENC_QP_LAYER_DELTA:
+		memcpy(ctrls->qp_layer_delta, ctrl->p_new.p_s32,
+		       sizeof(ctrls->qp_layer_delta));
+		break;
+	case V4L2_CID_CEDRUS_H264_ENC_QP_NON_REF_DELTA:
+		ctrls->qp_non_ref_delta = ctrl->val;
+		break;
+	case V4L2_CID_CEDRUS_H264_ENC_STATIC_BACKGROUND:
+		ctrls->static_background = ctrl->val;
+		break;
+	case V4L2_CID_MPEG_VIDEO_INTRA_REFRESH_PERIOD_TYPE:
+		/* Only the cyclic type is supported, restart its cycle. */
+		set_bit(CEDRUS_ENC_H264_EVENT_INTRA_REFRESH_RESET, events);
+		break;
+	case V4L2_CID_MPEG_VIDEO_INTRA_REFRESH_PERIOD:
+		ctrls->intra_refresh_period = ctrl->val;
+		set_bit(CEDRUS_ENC_H264_EVENT_INTRA_REFRESH_RESET, events);
+		break;
+	case V4L2_CID_CEDRUS_H264_ENC_INTRA_REFRESH_WAVE:
+		ctrls->intra_refresh_wave_frames = ctrl->val;
+		set_bit(CEDRUS_ENC_H264_EVENT_INTRA_REFRESH_WAVE, events);
+		break;
+	case V4L2_CID_MPEG_VIDEO_B_FRAMES:
+		ctrls->b_frames = ctrl->val;
+		break;
+	case V4L2_CID_MPEG_VIDEO_MULTI_SLICE_MODE:
+		ctrls->slice_mode = ctrl->val;
+		break;
+	case V4L2_CID_MPEG_VIDEO_MULTI_SLICE_MAX_MB:
+		ctrls->slice_max_mb = ctrl->val;
+		break;
+	case V4L2_CID_MPEG_VIDEO_LTR_COUNT:
+		ctrls->ltr_count = ctrl->val;
+		break;
+	case V4L2_CID_MPEG_VIDEO_FRAME_LTR_INDEX:
+		ctrls->ltr_mark_index = ctrl->val;
+		set_bit(CEDRUS_ENC_H264_EVENT_LTR_MARK, events);
+		break;
+	case V4L2_CID_MPEG_VIDEO_USE_LTR_FRAMES:
+		WRITE_ONCE(h264_ctx->ctrls_ltr_use_mask, ctrl->val);
+		break;
+	case V4L2_CID_MPEG_VIDEO_H264_HIERARCHICAL_CODING:
+		ctrls->hierarchical_coding = ctrl->val;
+		break;
+	case V4L2_CID_MPEG_VIDEO_H264_HIERARCHICAL_CODING_LAYER:
+		ctrls->hierarchical_coding_layer = ctrl->val;
+		break;
+	}
+
+	write_seqcount_end(&h264_ctx->ctrls_seq);
+
+	/* This calls back into the same function, outside the section. */
+	if (entropy_cavlc) {
+		unsigned int id = V4L2_CID_MPEG_VIDEO_H264_ENTROPY_MODE;
+		int value = V4L2_MPEG_VIDEO_H264_ENTROPY_MODE_CAVLC;
+		struct v4l2_ctrl *ctrl_entropy =
+			cedrus_context_ctrl_find(cedrus_ctx, id);
+
+		__v4l2_ctrl_s_ctrl(ctrl_entropy, value);
+	}
+
+	return 0;
+}
+
+/* DPB */
+
+static unsigned int cedrus_enc_h264_ref_count(struct cedrus_enc_h264_state *state)
+{
+	/* B frames use the previous and next P frames as references. */
+	if (state->b_frames)
+		return 2;
+
+	/* The base layer keeps its own reference next to the middle layer. */
+	if (state->temporal_layers > 2)
+		return 2;
+
+	/* Second fields keep the first one next to the previous frame. */
+	if (state->interlaced)
+		return 2;
+
+	return 1;
+}
+
+static int cedrus_enc_h264_picture_setup(struct cedrus_context *cedrus_ctx,
+					 struct cedrus_enc_h264_picture *picture)
+{
+	struct cedrus_device *dev = cedrus_ctx->proc->dev;
+	struct cedrus_enc_h264_context *h264_ctx = cedrus_ctx->engine_ctx;
+	unsigned int width_mbs = h264_ctx->width_mbs;
+	unsigned int height_mbs = h264_ctx->height_mbs;
+	unsigned int subpix_size_width, subpix_size_height;
+	int ret;
+
+	/* Sub-pixel Buffer */
+
+	subpix_size_width = ALIGN_DOWN((width_mbs + 47) * 2 / 3, 32) +
+			    ALIGN(width_mbs, 32) * 2;
+	subpix_size_height = (height_mbs * 16 + 72) / 8;
+
+	picture->subpix_size = subpix_size_width * subpix_size_height;
+	picture->subpix_stride = subpix_size_width;
 
+	picture->subpix = cedrus_pool_alloc(cedrus_ctx, picture->subpix_size,
+					    &picture->subpix_dma);
+	if (!picture->subpix)
+		return -ENOMEM;
+
+	/* Reconstruction Buffer */
+
+	picture->rec_luma_size = ALIGN(width_mbs, 2) * 16 *
+				 ALIGN(height_mbs + 1, 4) * 16;
+	picture->rec_chroma_size = ALIGN(width_mbs, 2) * 16 *
+				   ALIGN(DIV_ROUND_UP(height_mbs, 2), 4) * 16;
+
+	picture->rec_size = ALIGN(picture->rec_luma_size +
+				  picture->rec_chroma_size, SZ_4K);
+
+	/* Exported reconstructions may outlive the context. */
+	if (h264_ctx->dpb_exported) {
+		picture->rec_dmabuf =
+			cedrus_pool_dmabuf_alloc(dev, picture->rec_size,
+						 &picture->rec_dma);
+		if (IS_ERR(picture->rec_dmabuf)) {
+			ret = PTR_ERR(picture->rec_dmabuf);
+			picture->rec_dmabuf = NULL;
+			goto error_subpix;
+		}
 	} else {
-		/* Syntax element: frame_cropping_flag. */
-		cedrus_enc_h264_coded_bit(dev, 0);
+		picture->rec = cedrus_pool_alloc(cedrus_ctx, picture->rec_size,
+						 &picture->rec_dma);
+		if (!picture->rec) {
+			ret = -ENOMEM;
+			goto error_subpix;
+		}
 	}
 
-	/* Syntax element: vui_parameters_present_flag. */
-	cedrus_enc_h264_coded_bit(dev, 1);
+	picture->rec_valid = false;
+	picture->rec_sequence = 0;
 
-	if (h264_ctx->vui_sar_enable) {
-		u8 vui_sar_idc =
-			cedrus_enc_h264_vui_sar_idc(h264_ctx->vui_sar_idc);
+	return 0;
+
+error_subpix:
+	cedrus_pool_free(cedrus_ctx, picture->subpix_size, picture->subpix,
+			 picture->subpix_dma);
+
+	return ret;
+}
+
+static void cedrus_enc_h264_picture_cleanup(struct cedrus_context *cedrus_ctx,
+					    struct cedrus_enc_h264_picture *picture)
+{
+	if (picture->rec_dmabuf) {
+		dma_buf_put(picture->rec_dmabuf);
+		picture->rec_dmabuf = NULL;
+	} else {
+		cedrus_pool_free(cedrus_ctx, picture->rec_size, picture->rec,
+				 picture->rec_dma);
+	}
+
+	cedrus_pool_free(cedrus_ctx, picture->subpix_size, picture->subpix,
+			 picture->subpix_dma);
+}
+
+static struct cedrus_enc_h264_picture *
+cedrus_enc_h264_picture_get(struct cedrus_enc_h264_picture *picture)
+{
+	if (picture)
+		picture->refcount++;
+
+	return picture;
+}
+
+static void cedrus_enc_h264_picture_put(struct cedrus_enc_h264_picture *picture)
+{
+	if (picture && !WARN_ON(!picture->refcount))
+		picture->refcount--;
+}
+
+static struct cedrus_enc_h264_picture *
+cedrus_enc_h264_picture_free(struct cedrus_enc_h264_context *h264_ctx)
+{
+	struct cedrus_enc_h264_picture *picture = NULL;
+	unsigned int i;
+
+	/*
+	 * Pictures are held by the DPB (as reference) and by the job. The least
+	 * recently reconstructed one is reused, so that exported
+	 * reconstructions stay intact for as long as possible.
+	 */
+	for (i = 0; i < h264_ctx->dpb_count; i++) {
+		if (h264_ctx->dpb[i].refcount)
+			continue;
+
+		if (!picture ||
+		    h264_ctx->dpb[i].rec_sequence < picture->rec_sequence)
+			picture = &h264_ctx->dpb[i];
+	}
+
+	return picture;
+}
+
+static void cedrus_enc_h264_ltr_release(struct cedrus_enc_h264_context *h264_ctx)
+{
+	unsigned int i;
+
+	for (i = 0; i < CEDRUS_ENC_H264_LTR_COUNT; i++) {
+		cedrus_enc_h264_picture_put(h264_ctx->dpb_ltr[i]);
+		h264_ctx->dpb_ltr[i] = NULL;
+	}
+
+	h264_ctx->dpb_last_ltr_index = -1;
+}
+
+static void
+cedrus_enc_h264_field_release(struct cedrus_enc_h264_context *h264_ctx)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(h264_ctx->dpb_field); i++) {
+		cedrus_enc_h264_picture_put(h264_ctx->dpb_field[i]);
+		h264_ctx->dpb_field[i] = NULL;
+	}
+}
+
+/* Debugfs */
+
+static const char * const cedrus_enc_h264_histogram_type_names[] = {
+	[CEDRUS_ENC_H264_HISTOGRAM_TYPE_I]	= "i",
+	[CEDRUS_ENC_H264_HISTOGRAM_TYPE_P]	= "p",
+	[CEDRUS_ENC_H264_HISTOGRAM_TYPE_B]	= "b",
+};
+
+static void cedrus_enc_h264_histogram_update(struct cedrus_context *ctx,
+					     unsigned int length)
+{
+	struct cedrus_enc_h264_context *h264_ctx = ctx->engine_ctx;
+	struct cedrus_enc_h264_histogram *histogram = &h264_ctx->histogram;
+	struct cedrus_enc_h264_job *job = ctx->engine_job;
+	unsigned int type, bin;
+
+	switch (job->frame_type) {
+	case CEDRUS_ENC_H264_FRAME_TYPE_P:
+		type = CEDRUS_ENC_H264_HISTOGRAM_TYPE_P;
+		break;
+	case CEDRUS_ENC_H264_FRAME_TYPE_B:
+		type = CEDRUS_ENC_H264_HISTOGRAM_TYPE_B;
+		break;
+	default:
+		type = CEDRUS_ENC_H264_HISTOGRAM_TYPE_I;
+		break;
+	}
+
+	bin = min_t(unsigned int, fls(length),
+		    CEDRUS_ENC_H264_HISTOGRAM_SIZE_BINS - 1);
+
+	spin_lock(&histogram->lock);
+
+	histogram->size[type][bin]++;
+
+	if (job->qp < CEDRUS_ENC_H264_QP_COUNT)
+		histogram->qp[type][job->qp]++;
+
+	spin_unlock(&histogram->lock);
+}
+
+static int cedrus_enc_h264_histogram_show(struct seq_file *seq, void *data)
+{
+	struct cedrus_enc_h264_context *h264_ctx = seq->private;
+	struct cedrus_enc_h264_histogram *histogram;
+	unsigned int type, i;
+
+	/* Only non-empty bins are listed, with the lower bound of sizes. */
+	histogram = kmalloc(sizeof(*histogram), GFP_KERNEL);
+	if (!histogram)
+		return -ENOMEM;
+
+	spin_lock(&h264_ctx->histogram.lock);
+	memcpy(histogram, &h264_ctx->histogram, sizeof(*histogram));
+	spin_unlock(&h264_ctx->histogram.lock);
+
+	for (type = 0; type < CEDRUS_ENC_H264_HISTOGRAM_TYPES_COUNT; type++) {
+		const char *name = cedrus_enc_h264_histogram_type_names[type];
+		u32 *size = histogram->size[type];
+		u32 *qp = histogram->qp[type];
+
+		for (i = 0; i < CEDRUS_ENC_H264_HISTOGRAM_SIZE_BINS; i++)
+			if (size[i])
+				seq_printf(seq, "size %s %u %u\n", name,
+					   i ? 1U << (i - 1) : 0, size[i]);
+
+		for (i = 0; i < CEDRUS_ENC_H264_QP_COUNT; i++)
+			if (qp[i])
+				seq_printf(seq, "qp %s %u %u\n", name, i,
+					   qp[i]);
+	}
+
+	kfree(histogram);
+
+	return 0;
+}
+
+DEFINE_SHOW_ATTRIBUTE(cedrus_enc_h264_histogram);
+
+/* Context */
+
+static const u32 cedrus_enc_h264_ctrls_streaming[] = {
+	V4L2_CID_MPEG_VIDEO_B_FRAMES,
+	V4L2_CID_MPEG_VIDEO_LTR_COUNT,
+	V4L2_CID_MPEG_VIDEO_H264_HIERARCHICAL_CODING,
+	V4L2_CID_MPEG_VIDEO_H264_HIERARCHICAL_CODING_LAYER,
+	V4L2_CID_ROTATE,
+	V4L2_CID_MPEG_VIDEO_HEADER_MODE,
+	V4L2_CID_CEDRUS_H264_ENC_REC_EXPORT,
+	V4L2_CID_CEDRUS_H264_ENC_LOOKAHEAD,
+	V4L2_CID_CEDRUS_H264_ENC_GOP_PATTERN,
+};
+
+static void cedrus_enc_h264_ctrls_grab(struct cedrus_context *cedrus_ctx,
+				       bool grabbed)
+{
+	struct v4l2_ctrl_handler *ctrl_handler = &cedrus_ctx->v4l2.ctrl_handler;
+	struct v4l2_ctrl *ctrl;
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(cedrus_enc_h264_ctrls_streaming); i++) {
+		ctrl = v4l2_ctrl_find(ctrl_handler,
+				      cedrus_enc_h264_ctrls_streaming[i]);
+		if (ctrl)
+			v4l2_ctrl_grab(ctrl, grabbed);
+	}
+}
+
+static unsigned int
+cedrus_enc_h264_height_mbs(struct cedrus_context *cedrus_ctx)
+{
+	struct v4l2_pix_format *pix_format =
+		&cedrus_ctx->v4l2.format_coded.fmt.pix;
+
+	/* Fields are encoded as pictures of their own, half as high. */
+	if (cedrus_enc_format_picture_interlaced_check(cedrus_ctx))
+		return DIV_ROUND_UP(pix_format->height, 32);
+
+	return DIV_ROUND_UP(pix_format->height, 16);
+}
+
+static void cedrus_enc_h264_state_reset(struct cedrus_context *cedrus_ctx)
+{
+	struct cedrus_enc_h264_context *h264_ctx = cedrus_ctx->engine_ctx;
+	struct cedrus_enc_h264_state *state = &h264_ctx->state;
+	const s32 *gop_pattern = &h264_ctx->gop_pattern[0][0];
+	bool non_ref_runs;
+
+	cedrus_enc_h264_state_sample(cedrus_ctx);
+
+	/* Every session starts with an IDR frame and its parameter sets. */
+	memset(state, 0, sizeof(*state));
+
+	state->step = CEDRUS_ENC_H264_STEP_START;
+
+	/* Start rate control from the configured P frame QP. */
+
+	if (h264_ctx->bitrate_mode == V4L2_MPEG_VIDEO_BITRATE_MODE_CQ)
+		state->rc_qp = cedrus_enc_h264_rc_cq_qp(cedrus_ctx);
+	else
+		state->rc_qp = h264_ctx->qp_p;
+	state->rc_fullness = 0;
+	state->rc_level_fullness = 0;
+	state->rc_mad_sum = 0;
+	state->rc_mad = 0;
+
+	/* Keep the first IDR frame small and ramp quality up after it. */
+	state->fast_start_qp_delta = h264_ctx->fast_start;
+
+	state->scene_mad_sum = 0;
+	state->scene_change = false;
+
+	/* Start with the table that suits most content, until measured. */
+	state->cabac_init_idc = 1;
+
+	/*
+	 * Interlaced pictures are encoded as pairs of P fields, each only
+	 * referencing the previous field of the same parity.
+	 */
+	state->interlaced =
+		cedrus_enc_format_picture_interlaced_check(cedrus_ctx);
+
+	/* A GOP pattern overrides the GOP structure controls. */
+	state->gop_pattern_count =
+		cedrus_enc_h264_gop_pattern_count(gop_pattern);
+
+	/* B frames are not allowed with baseline profiles. */
+
+	if (!cedrus_enc_h264_profile_b_frames_check(h264_ctx->profile) ||
+	    state->interlaced)
+		state->b_frames = 0;
+	else if (state->gop_pattern_count)
+		state->b_frames =
+			cedrus_enc_h264_gop_pattern_b_frames(gop_pattern);
+	else
+		state->b_frames = h264_ctx->b_frames;
+
+	/* Temporal layers are built from P frames only. */
+	if (!state->b_frames && !state->interlaced &&
+	    !state->gop_pattern_count && h264_ctx->hierarchical_coding)
+		state->temporal_layers = clamp_t(unsigned int,
+						 h264_ctx->hierarchical_coding_layer,
+						 1, CEDRUS_ENC_H264_TEMPORAL_LAYERS_MAX);
+	else
+		state->temporal_layers = 1;
+
+	state->temporal_index = 0;
+	state->temporal_base_frame_num = 0;
+
+	/*
+	 * Long-term references are only used by P frames, which cannot be
+	 * reordered around B frames or temporal layers.
+	 */
+	if (!state->b_frames && state->temporal_layers == 1 &&
+	    !state->interlaced)
+		state->ltr_count = h264_ctx->ltr_count;
+	else
+		state->ltr_count = 0;
+
+	/* Only requests made while streaming apply to the next frames. */
+	h264_ctx->ltr_mark = false;
+	h264_ctx->ltr_use_mask = 0;
+
+	/*
+	 * All-intra streams never keep a reference, so that every frame is
+	 * encoded as an IDR frame until streaming is restarted.
+	 */
+	state->intra_only = !state->gop_pattern_count &&
+			    h264_ctx->gop_closure && h264_ctx->gop_size == 1;
+
+	/*
+	 * Without reordering, the picture order can be derived from frame num
+	 * (with non-reference frames sharing the one of the next frame), which
+	 * saves the POC LSBs in every slice header. This requires non-reference
+	 * frames to be followed by a reference frame, which is not the case
+	 * when the top temporal layer precedes the last P frame of a closed
+	 * GOP. Fields are left with their explicit order.
+	 */
+	if (state->gop_pattern_count)
+		non_ref_runs =
+			cedrus_enc_h264_gop_pattern_non_ref_runs(gop_pattern);
+	else
+		non_ref_runs = h264_ctx->gop_closure &&
+			       state->temporal_layers > 1;
+
+	state->vfr = h264_ctx->vfr;
+
+	if (state->b_frames || state->interlaced || non_ref_runs || state->vfr)
+		h264_ctx->pic_order_cnt_type = 0;
+	else
+		h264_ctx->pic_order_cnt_type = 2;
+
+	/* Timestamps may be far apart with variable frame rate. */
+	h264_ctx->log2_max_pic_order_cnt_lsb = state->vfr ? 16 : 8;
+
+	/* Frame types are fixed for all-intra streams, with nothing to plan. */
+	cedrus_ctx->lookahead = state->intra_only ? 0 : h264_ctx->lookahead;
+
+	/* Decoded Picture Buffer */
+
+	if (state->intra_only)
+		h264_ctx->dpb_count = 1;
+	else
+		h264_ctx->dpb_count = cedrus_enc_h264_ref_count(state) +
+				      state->ltr_count + 1;
+
+	/* Extra pictures keep exported reconstructions for a while. */
+	if (h264_ctx->rec_export)
+		h264_ctx->dpb_count += CEDRUS_H264_ENC_REC_EXPORT_COUNT;
+}
+
+static void cedrus_enc_h264_start(struct cedrus_context *cedrus_ctx)
+{
+	struct cedrus_enc_h264_context *h264_ctx = cedrus_ctx->engine_ctx;
+	unsigned int i;
+
+	spin_lock(&h264_ctx->dpb_export_lock);
+
+	for (i = 0; i < h264_ctx->dpb_count; i++) {
+		h264_ctx->dpb[i].refcount = 0;
+		h264_ctx->dpb[i].rec_valid = false;
+	}
+
+	spin_unlock(&h264_ctx->dpb_export_lock);
+
+	h264_ctx->dpb_last = NULL;
+	h264_ctx->dpb_prev = NULL;
+	h264_ctx->dpb_base = NULL;
+	h264_ctx->dpb_last_ltr_index = -1;
+
+	for (i = 0; i < CEDRUS_ENC_H264_LTR_COUNT; i++)
+		h264_ctx->dpb_ltr[i] = NULL;
+
+	for (i = 0; i < ARRAY_SIZE(h264_ctx->dpb_field); i++)
+		h264_ctx->dpb_field[i] = NULL;
+
+	/* The reference structure cannot change while streaming. */
+	cedrus_enc_h264_ctrls_grab(cedrus_ctx, true);
+
+	/* Separate headers are returned before the first frame. */
+	if (h264_ctx->header_mode == V4L2_MPEG_VIDEO_HEADER_MODE_SEPARATE)
+		cedrus_context_job_header_request(cedrus_ctx);
+}
+
+static int cedrus_enc_h264_setup(struct cedrus_context *cedrus_ctx)
+{
+	struct cedrus_device *cedrus_dev = cedrus_ctx->proc->dev;
+	struct device *dev = cedrus_dev->dev;
+	struct v4l2_ctrl_handler *ctrl_handler = &cedrus_ctx->v4l2.ctrl_handler;
+	struct cedrus_enc_h264_context *h264_ctx = cedrus_ctx->engine_ctx;
+	struct v4l2_pix_format *pix_format =
+		&cedrus_ctx->v4l2.format_coded.fmt.pix;
+	unsigned int id;
+	unsigned int i;
+	int ret;
+
+	/* Fields are fetched from every other picture row. */
+	if (cedrus_enc_format_picture_interlaced_check(cedrus_ctx) &&
+	    !cedrus_enc_format_picture_rows_check(cedrus_ctx))
+		return -EINVAL;
+
+	h264_ctx->width_mbs = DIV_ROUND_UP(pix_format->width, 16);
+	h264_ctx->height_mbs = cedrus_enc_h264_height_mbs(cedrus_ctx);
+
+	/*
+	 * Macroblock Information Buffer, only holding data within a job and
+	 * shared by all the contexts of the device.
+	 */
+
+	ret = cedrus_pool_scratch_get(cedrus_dev,
+				      CEDRUS_SCRATCH_ENC_MB_INFO,
+				      DIV_ROUND_UP(h264_ctx->width_mbs, 32) *
+				      SZ_4K);
+	if (ret)
+		return ret;
+
+	/*
+	 * Deblocking Filter Buffer, holding the unfiltered bottom lines of the
+	 * previous macroblock row. The internal memory used otherwise is
+	 * shared with motion estimation and stalls the engine on wide
+	 * pictures. Pictures are encoded within a single job, so the buffer
+	 * is shared by all the contexts of the device too.
+	 * XXX: The size per macroblock is an estimate covering four luma and
+	 * chroma lines.
+	 */
+
+	ret = cedrus_pool_scratch_get(cedrus_dev,
+				      CEDRUS_SCRATCH_ENC_DEBLK,
+				      ALIGN(h264_ctx->width_mbs *
+					    CEDRUS_ENC_H264_DEBLK_MB_SIZE,
+					    SZ_4K));
+	if (ret)
+		goto error_mb_info;
+
+	/*
+	 * Temporal Filter Count Buffer, allocated directly since its initial
+	 * contents are used by the first denoised picture.
+	 */
+
+	h264_ctx->tfcnt_size = h264_ctx->width_mbs * h264_ctx->height_mbs *
+			       CEDRUS_ENC_H264_TFCNT_MB_SIZE;
+	if (cedrus_fault_alloc()) {
+		ret = -ENOMEM;
+		goto error_deblk;
+	}
+
+	h264_ctx->tfcnt = dma_alloc_attrs(dev, h264_ctx->tfcnt_size,
+					  &h264_ctx->tfcnt_dma, GFP_KERNEL,
+					  DMA_ATTR_NO_KERNEL_MAPPING);
+	if (!h264_ctx->tfcnt) {
+		ret = -ENOMEM;
+		goto error_deblk;
+	}
+
+	/* Bitstream Parameters */
+
+	/* The POC type and size are selected in state_reset. */
+	h264_ctx->log2_max_frame_num = 8;
+
+	/* Grab entropy mode control for later use. */
+
+	id = V4L2_CID_MPEG_VIDEO_H264_ENTROPY_MODE;
+	h264_ctx->entropy_mode_ctrl = v4l2_ctrl_find(ctrl_handler, id);
+	if (!h264_ctx->entropy_mode_ctrl) {
+		ret = -ENODEV;
+		goto error_tfcnt;
+	}
+
+	/* Apply initial control values. */
+
+	seqcount_mutex_init(&h264_ctx->ctrls_seq, ctrl_handler->lock);
+
+	ret = v4l2_ctrl_handler_setup(ctrl_handler);
+	if (ret)
+		goto error_tfcnt;
+
+	cedrus_enc_h264_state_reset(cedrus_ctx);
+
+	/* Decoded Picture Buffer */
+
+	spin_lock_init(&h264_ctx->dpb_export_lock);
+	h264_ctx->dpb_exported = h264_ctx->rec_export;
+	h264_ctx->dpb_sequence = 0;
+
+	for (i = 0; i < h264_ctx->dpb_count; i++) {
+		ret = cedrus_enc_h264_picture_setup(cedrus_ctx,
+						    &h264_ctx->dpb[i]);
+		if (ret)
+			goto error_dpb;
+	}
+
+	cedrus_enc_h264_start(cedrus_ctx);
+
+	/* Debugfs */
+
+	spin_lock_init(&h264_ctx->histogram.lock);
+
+	h264_ctx->debugfs =
+		debugfs_create_file("h264_histogram", 0444, cedrus_ctx->debugfs,
+				    h264_ctx, &cedrus_enc_h264_histogram_fops);
+
+	return 0;
+
+error_dpb:
+	while (i--)
+		cedrus_enc_h264_picture_cleanup(cedrus_ctx, &h264_ctx->dpb[i]);
+
+error_tfcnt:
+	dma_free_attrs(dev, h264_ctx->tfcnt_size, h264_ctx->tfcnt,
+		       h264_ctx->tfcnt_dma, DMA_ATTR_NO_KERNEL_MAPPING);
+
+error_deblk:
+	cedrus_pool_scratch_put(cedrus_dev, CEDRUS_SCRATCH_ENC_DEBLK);
+
+error_mb_info:
+	cedrus_pool_scratch_put(cedrus_dev, CEDRUS_SCRATCH_ENC_MB_INFO);
+
+	return ret;
+}
+
+static void cedrus_enc_h264_cleanup(struct cedrus_context *cedrus_ctx)
+{
+	struct cedrus_device *cedrus_dev = cedrus_ctx->proc->dev;
+	struct device *dev = cedrus_dev->dev;
+	struct cedrus_enc_h264_context *h264_ctx = cedrus_ctx->engine_ctx;
+	unsigned int i;
+
+	debugfs_remove(h264_ctx->debugfs);
+	h264_ctx->debugfs = NULL;
+
+	cedrus_enc_h264_ctrls_grab(cedrus_ctx, false);
+
+	for (i = 0; i < h264_ctx->dpb_count; i++)
+		cedrus_enc_h264_picture_cleanup(cedrus_ctx, &h264_ctx->dpb[i]);
+
+	dma_free_attrs(dev, h264_ctx->tfcnt_size, h264_ctx->tfcnt,
+		       h264_ctx->tfcnt_dma, DMA_ATTR_NO_KERNEL_MAPPING);
+
+	cedrus_pool_scratch_put(cedrus_dev, CEDRUS_SCRATCH_ENC_DEBLK);
+	cedrus_pool_scratch_put(cedrus_dev, CEDRUS_SCRATCH_ENC_MB_INFO);
+}
+
+/*
+ * Reallocate the buffers sized for the macroblock dimensions, for a coded
+ * format changed since the previous session. Buffers that are large enough
+ * are kept, except for the temporal filter counts which are positional. The
+ * shared scratch buffers are grown before the previous reference is dropped.
+ */
+static int cedrus_enc_h264_resize(struct cedrus_context *cedrus_ctx,
+				  unsigned int width_mbs,
+				  unsigned int height_mbs)
+{
+	struct cedrus_device *cedrus_dev = cedrus_ctx->proc->dev;
+	struct device *dev = cedrus_dev->dev;
+	struct cedrus_enc_h264_context *h264_ctx = cedrus_ctx->engine_ctx;
+	unsigned int tfcnt_size;
+	dma_addr_t tfcnt_dma;
+	void *tfcnt;
+	int ret;
+
+	ret = cedrus_pool_scratch_get(cedrus_dev,
+				      CEDRUS_SCRATCH_ENC_MB_INFO,
+				      DIV_ROUND_UP(width_mbs, 32) * SZ_4K);
+	if (ret)
+		return ret;
+
+	cedrus_pool_scratch_put(cedrus_dev, CEDRUS_SCRATCH_ENC_MB_INFO);
+
+	ret = cedrus_pool_scratch_get(cedrus_dev,
+				      CEDRUS_SCRATCH_ENC_DEBLK,
+				      ALIGN(width_mbs *
+					    CEDRUS_ENC_H264_DEBLK_MB_SIZE,
+					    SZ_4K));
+	if (ret)
+		return ret;
+
+	cedrus_pool_scratch_put(cedrus_dev, CEDRUS_SCRATCH_ENC_DEBLK);
+
+	tfcnt_size = width_mbs * height_mbs * CEDRUS_ENC_H264_TFCNT_MB_SIZE;
+	if (cedrus_fault_alloc())
+		return -ENOMEM;
+
+	tfcnt = dma_alloc_attrs(dev, tfcnt_size, &tfcnt_dma, GFP_KERNEL,
+				DMA_ATTR_NO_KERNEL_MAPPING);
+	if (!tfcnt)
+		return -ENOMEM;
+
+	dma_free_attrs(dev, h264_ctx->tfcnt_size, h264_ctx->tfcnt,
+		       h264_ctx->tfcnt_dma, DMA_ATTR_NO_KERNEL_MAPPING);
+
+	h264_ctx->tfcnt = tfcnt;
+	h264_ctx->tfcnt_dma = tfcnt_dma;
+	h264_ctx->tfcnt_size = tfcnt_size;
+
+	h264_ctx->width_mbs = width_mbs;
+	h264_ctx->height_mbs = height_mbs;
+
+	return 0;
+}
+
+static void cedrus_enc_h264_stop(struct cedrus_context *cedrus_ctx)
+{
+	/* Controls may change until the next restart. */
+	cedrus_enc_h264_ctrls_grab(cedrus_ctx, false);
+}
+
+static int cedrus_enc_h264_restart(struct cedrus_context *cedrus_ctx)
+{
+	struct cedrus_enc_h264_context *h264_ctx = cedrus_ctx->engine_ctx;
+	struct v4l2_pix_format *pix_format =
+		&cedrus_ctx->v4l2.format_coded.fmt.pix;
+	unsigned int dpb_count = h264_ctx->dpb_count;
+	unsigned int width_mbs, height_mbs;
+	bool resized;
+	unsigned int i;
+	int ret;
+
+	if (cedrus_enc_format_picture_interlaced_check(cedrus_ctx) &&
+	    !cedrus_enc_format_picture_rows_check(cedrus_ctx))
+		return -EINVAL;
+
+	/* Buffers are sized for the coded format of the previous session. */
+	width_mbs = DIV_ROUND_UP(pix_format->width, 16);
+	height_mbs = cedrus_enc_h264_height_mbs(cedrus_ctx);
+	resized = h264_ctx->width_mbs != width_mbs ||
+		  h264_ctx->height_mbs != height_mbs;
+
+	if (resized) {
+		ret = cedrus_enc_h264_resize(cedrus_ctx, width_mbs,
+					     height_mbs);
+		if (ret)
+			return ret;
+	}
+
+	cedrus_enc_h264_state_reset(cedrus_ctx);
+
+	/* Keep the pictures for cleanup when more or others are needed. */
+	if (h264_ctx->dpb_count > dpb_count ||
+	    h264_ctx->dpb_exported != !!h264_ctx->rec_export) {
+		h264_ctx->dpb_count = dpb_count;
+		return -EINVAL;
+	}
+
+	for (i = h264_ctx->dpb_count; i < dpb_count; i++)
+		cedrus_enc_h264_picture_cleanup(cedrus_ctx, &h264_ctx->dpb[i]);
+
+	/* Pictures are laid out for the macroblock dimensions. */
+	if (resized) {
+		for (i = 0; i < h264_ctx->dpb_count; i++)
+			cedrus_enc_h264_picture_cleanup(cedrus_ctx,
+							&h264_ctx->dpb[i]);
+
+		for (i = 0; i < h264_ctx->dpb_count; i++) {
+			ret = cedrus_enc_h264_picture_setup(cedrus_ctx,
+							    &h264_ctx->dpb[i]);
+			if (ret)
+				goto error_dpb;
+		}
+	}
+
+	cedrus_enc_h264_start(cedrus_ctx);
+
+	return 0;
+
+error_dpb:
+	while (i--)
+		cedrus_enc_h264_picture_cleanup(cedrus_ctx, &h264_ctx->dpb[i]);
+
+	/* No picture is left for the context release. */
+	h264_ctx->dpb_count = 0;
+
+	return ret;
+}
+
+/* Job */
+
+static const u8 cedrus_enc_h264_temporal_ids[][4] = {
+	/* Single layer. */
+	{ 0 },
+	/* L1T2: every other frame is a non-reference frame. */
+	{ 0, 1 },
+	/* L1T3: the second layer references the base layer. */
+	{ 0, 2, 1, 2 },
+};
+
+static u32 cedrus_enc_h264_vfr_ticks(struct cedrus_context *cedrus_ctx,
+				     u64 timestamp)
+{
+	struct cedrus_enc_h264_context *h264_ctx = cedrus_ctx->engine_ctx;
+	struct v4l2_fract *timeperframe = &cedrus_ctx->v4l2.timeperframe_coded;
+	u64 tick_ns = (u64)timeperframe->numerator * NSEC_PER_SEC;
+	u64 elapsed;
+
+	if (timestamp <= h264_ctx->state.vfr_timestamp)
+		return 0;
+
+	elapsed = timestamp - h264_ctx->state.vfr_timestamp;
+
+	/* A frame requires two ticks in H.264, rounded to the nearest one. */
+	elapsed += div_u64(tick_ns, 4 * timeperframe->denominator);
+
+	return min_t(u64, mul_u64_u64_div_u64(elapsed,
+					      2 * timeperframe->denominator,
+					      tick_ns), U32_MAX);
+}
+
+/*
+ * Derive the picture order count from the timestamp, keeping it increasing
+ * in display order: frames that are not held leave room for the held B frames
+ * displayed before them, which fit between the previous frame and that one.
+ */
+static unsigned int cedrus_enc_h264_vfr_poc(struct cedrus_context *cedrus_ctx)
+{
+	struct cedrus_enc_h264_context *h264_ctx = cedrus_ctx->engine_ctx;
+	struct cedrus_enc_h264_job *job = cedrus_ctx->engine_job;
+	struct cedrus_enc_h264_state *state = &h264_ctx->state;
+	u64 timestamp = cedrus_ctx->job.buffer_picture->vb2_buf.timestamp;
+	u32 poc;
+
+	if (job->frame_type == CEDRUS_ENC_H264_FRAME_TYPE_IDR) {
+		state->vfr_timestamp = timestamp;
+		state->vfr_poc = 0;
+	}
+
+	poc = cedrus_enc_h264_vfr_ticks(cedrus_ctx, timestamp);
+
+	if (cedrus_ctx->job.picture_held) {
+		if (state->vfr_b_left)
+			state->vfr_b_left--;
+
+		poc = clamp(poc, state->vfr_poc_b, state->vfr_poc_anchor -
+			    2 * (state->vfr_b_left + 1));
+		state->vfr_poc_b = poc + 2;
+	} else {
+		u32 poc_min = state->vfr_poc + 2 * job->b_pending;
+
+		poc = clamp(poc, poc_min,
+			    poc_min + CEDRUS_ENC_H264_VFR_POC_GAP_MAX);
+
+		state->vfr_poc_b = state->vfr_poc;
+		state->vfr_poc_anchor = poc;
+		state->vfr_b_left = job->b_pending;
+		state->vfr_poc = poc + 2;
+	}
+
+	return poc % BIT(h264_ctx->log2_max_pic_order_cnt_lsb);
+}
+
+static void cedrus_enc_h264_job_prepare_ltr(struct cedrus_context *cedrus_ctx)
+{
+	struct cedrus_enc_h264_context *h264_ctx = cedrus_ctx->engine_ctx;
+	struct cedrus_enc_h264_state *state = &h264_ctx->state;
+	struct cedrus_enc_h264_job *job = cedrus_ctx->engine_job;
+	unsigned int index;
+
+	if (job->frame_type == CEDRUS_ENC_H264_FRAME_TYPE_P) {
+		/* Switch to a known-good reference when requested. */
+		if (h264_ctx->ltr_use_mask) {
+			index = __ffs(h264_ctx->ltr_use_mask);
+
+			if (index < state->ltr_count &&
+			    h264_ctx->dpb_ltr[index]) {
+				job->ref_ltr = true;
+				job->ref_ltr_index = index;
+			}
+
+			h264_ctx->ltr_use_mask = 0;
+		}
+
+		/* The last frame is only a long-term reference once marked. */
+		if (!job->ref_ltr && h264_ctx->dpb_last_ltr_index >= 0) {
+			job->ref_ltr = true;
+			job->ref_ltr_index = h264_ctx->dpb_last_ltr_index;
+		}
+	}
+
+	if (!h264_ctx->ltr_mark || h264_ctx->ltr_mark_index >= state->ltr_count)
+		return;
+
+	/* IDR frames can only be marked with the first long-term index. */
+	if (job->frame_type == CEDRUS_ENC_H264_FRAME_TYPE_IDR &&
+	    h264_ctx->ltr_mark_index)
+		return;
+
+	job->ltr_mark = true;
+	job->ltr_mark_index = h264_ctx->ltr_mark_index;
+
+	h264_ctx->ltr_mark = false;
+}
+
+/*
+ * Select the lowest level that fits the stream. Level 1b is left out, since it
+ * is signalled differently depending on the profile.
+ */
+static int cedrus_enc_h264_level_auto(struct cedrus_context *cedrus_ctx)
+{
+	struct cedrus_enc_h264_context *h264_ctx = cedrus_ctx->engine_ctx;
+	struct cedrus_enc_h264_state *state = &h264_ctx->state;
+	struct v4l2_fract *timeperframe = &cedrus_ctx->v4l2.timeperframe_coded;
+	const struct cedrus_enc_h264_level_limits *limits;
+	unsigned int width_mbs = h264_ctx->width_mbs;
+	unsigned int height_mbs = h264_ctx->height_mbs;
+	unsigned int fs = width_mbs * height_mbs;
+	unsigned int ref_count;
+	unsigned int br_factor;
+	u64 bitrate = 0;
+	unsigned int i;
+
+	ref_count = cedrus_enc_h264_ref_count(state) + state->ltr_count;
+
+	/* Bitrates are checked at the NAL level, with the profile factor. */
+	if (cedrus_enc_h264_profile_idc(h264_ctx->profile) >= 100)
+		br_factor = 1500;
+	else
+		br_factor = 1200;
+
+	/* Constant quality has no bitrate to fit in the level. */
+	if (h264_ctx->rc_enable) {
+		if (h264_ctx->bitrate_mode == V4L2_MPEG_VIDEO_BITRATE_MODE_VBR)
+			bitrate = h264_ctx->bitrate_peak;
+		else if (h264_ctx->bitrate_mode ==
+			 V4L2_MPEG_VIDEO_BITRATE_MODE_CBR)
+			bitrate = h264_ctx->bitrate;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(cedrus_enc_h264_level_limits); i++) {
+		limits = &cedrus_enc_h264_level_limits[i];
+
+		if (limits->level == V4L2_MPEG_VIDEO_H264_LEVEL_1B)
+			continue;
+
+		if (fs > limits->max_fs ||
+		    width_mbs * width_mbs > limits->max_fs * 8 ||
+		    height_mbs * height_mbs > limits->max_fs * 8)
+			continue;
+
+		if ((u64)fs * timeperframe->denominator >
+		    (u64)limits->max_mbps * timeperframe->numerator)
+			continue;
+
+		if (ref_count * fs > limits->max_dpb_mbs)
+			continue;
+
+		if (bitrate > (u64)limits->max_br * br_factor)
+			continue;
+
+		return limits->level;
+	}
+
+	/* Nothing fits, signal the highest level anyway. */
+	return limits->level;
+}
+
+static void
+cedrus_enc_h264_job_prepare_parameter_sets(struct cedrus_context *cedrus_ctx)
+{
+	struct cedrus_enc_h264_context *h264_ctx = cedrus_ctx->engine_ctx;
+	struct cedrus_enc_h264_state *state = &h264_ctx->state;
+	struct cedrus_enc_h264_job *job = cedrus_ctx->engine_job;
+	int level = h264_ctx->level;
+
+	/*
+	 * Use a single sequence parameter set slot, since a new one starts a
+	 * new sequence anyway, and rotate the picture parameter set slots so
+	 * that their changes apply to the next frame of any type.
+	 */
+	job->seq_parameter_set_id = 0;
+	job->pic_parameter_set_id = state->pps_id;
+
+	/* Profile/Level */
+
+	if (h264_ctx->level_auto)
+		level = cedrus_enc_h264_level_auto(cedrus_ctx);
+
+	/*
+	 * The selected level follows the stream, with a new sequence that
+	 * starts with an IDR frame. The first frame is an IDR frame already.
+	 */
+	if (h264_ctx->level_auto && state->level && level != state->level) {
+		cedrus_enc_h264_state_sps_invalidate(state);
+
+		if (h264_ctx->dpb_last)
+			h264_ctx->force_key_frame = true;
+	}
+
+	state->level = level;
+
+	/* HRD parameters only change with a new SPS. */
+	if (!state->sps_valid) {
+		if (h264_ctx->rc_enable && h264_ctx->vbv_size &&
+		    h264_ctx->bitrate_mode != V4L2_MPEG_VIDEO_BITRATE_MODE_CQ)
+			state->hrd_size = h264_ctx->vbv_size * 8000;
+		else
+			state->hrd_size = 0;
+
+		if (h264_ctx->bitrate_mode == V4L2_MPEG_VIDEO_BITRATE_MODE_VBR)
+			state->hrd_bitrate = h264_ctx->bitrate_peak;
+		else
+			state->hrd_bitrate = h264_ctx->bitrate;
+	}
+
+	job->profile_idc = cedrus_enc_h264_profile_idc(h264_ctx->profile);
+	job->level = level;
+	job->level_idc = cedrus_enc_h264_level_idc(level);
+	job->constraint_set_flags =
+		cedrus_enc_h264_constraint_set_flags(h264_ctx->profile);
+
+	/* Features */
+
+	if (h264_ctx->entropy_mode == V4L2_MPEG_VIDEO_H264_ENTROPY_MODE_CABAC)
+		job->entropy_coding_mode_flag = 1;
+	else
+		job->entropy_coding_mode_flag = 0;
+
+	job->constrained_intra_pred_flag = !!h264_ctx->error_resilience;
+
+	job->chroma_qp_index_offset = h264_ctx->chroma_qp_index_offset;
+}
+
+static int cedrus_enc_h264_job_prepare(struct cedrus_context *cedrus_ctx)
+{
+	struct cedrus_enc_h264_context *h264_ctx = cedrus_ctx->engine_ctx;
+	struct cedrus_enc_h264_state *state = &h264_ctx->state;
+	struct cedrus_enc_h264_job *job = cedrus_ctx->engine_job;
+	struct v4l2_fract *timeperframe = &cedrus_ctx->v4l2.timeperframe_coded;
+	struct v4l2_pix_format *pix_format =
+		&cedrus_ctx->v4l2.format_coded.fmt.pix;
+	unsigned long clock_rate =
+		READ_ONCE(cedrus_ctx->proc->dev->clock_mod_rate);
+	const struct cedrus_enc_h264_preset *preset;
+	int lookahead_qp = 0;
+	int gop_qp = 0;
+	unsigned int qp_max;
+	int qp_delta;
+	const s32 *entry;
+	bool hold = false;
+	unsigned int i;
+
+	/*
+	 * Sample a coherent state of the controls, without waiting for an
+	 * ioctl holding the control handler lock. Pinned controls were last
+	 * sampled when the state was reset.
+	 */
+	if (!cedrus_ctx->ctrls_pinned)
+		cedrus_enc_h264_state_sample(cedrus_ctx);
+
+	cedrus_enc_h264_job_prepare_parameter_sets(cedrus_ctx);
+
+	/*
+	 * Timing information is part of the SPS VUI, with a fixed frame rate,
+	 * so that the new SPS starts with an IDR frame. Equivalent fractions
+	 * keep the same timing and the current sequence.
+	 */
+	if (!state->timeperframe.denominator ||
+	    (u64)timeperframe->numerator * state->timeperframe.denominator !=
+	    (u64)state->timeperframe.numerator * timeperframe->denominator) {
+		state->timeperframe = *timeperframe;
+		cedrus_enc_h264_state_sps_invalidate(state);
+
+		/* The first frame is an IDR frame already. */
+		if (h264_ctx->dpb_last)
+			h264_ctx->force_key_frame = true;
+	}
+
+	cedrus_enc_h264_rc_retarget(cedrus_ctx);
+
+	/* GOP */
+
+	if (cedrus_ctx->job.picture_held) {
+		/* Held pictures are B frames, encoded after their P frame. */
+		job->frame_type = CEDRUS_ENC_H264_FRAME_TYPE_B;
+		job->nal_ref_idc = 0;
+
+		/* Fallback to intra when a reference was lost to an error. */
+		if (!h264_ctx->dpb_prev || !h264_ctx->dpb_last)
+			job->frame_type = CEDRUS_ENC_H264_FRAME_TYPE_I;
+
+		if (state->gop_pattern_count)
+			gop_qp = state->b_qp_delta[state->b_index++];
+	} else {
+		/* The last held picture is given back when draining. */
+		state->b_count = cedrus_ctx->pictures_held_count;
+
+		lookahead_qp = cedrus_enc_h264_lookahead(cedrus_ctx);
+
+		/* Mark every other frame as reference. */
+		job->nal_ref_idc = 2;
+
+		if (state->gop_pattern_count) {
+			entry = h264_ctx->gop_pattern[state->gop_index];
+
+			/* B frames are P frames until they are held. */
+			switch (entry[CEDRUS_H264_ENC_GOP_PATTERN_FRAME_TYPE]) {
+			case CEDRUS_H264_ENC_GOP_FRAME_IDR:
+				job->frame_type = CEDRUS_ENC_H264_FRAME_TYPE_IDR;
+				break;
+			case CEDRUS_H264_ENC_GOP_FRAME_I:
+				job->frame_type = CEDRUS_ENC_H264_FRAME_TYPE_I;
+				break;
+			default:
+				job->frame_type = CEDRUS_ENC_H264_FRAME_TYPE_P;
+				break;
+			}
+
+			/* Long-term reference requests need a reference. */
+			if (job->frame_type == CEDRUS_ENC_H264_FRAME_TYPE_P &&
+			    !entry[CEDRUS_H264_ENC_GOP_PATTERN_REFERENCE] &&
+			    !h264_ctx->ltr_mark)
+				job->nal_ref_idc = 0;
+
+			gop_qp = entry[CEDRUS_H264_ENC_GOP_PATTERN_QP_DELTA];
+			hold = entry[CEDRUS_H264_ENC_GOP_PATTERN_FRAME_TYPE] ==
+			       CEDRUS_H264_ENC_GOP_FRAME_B;
+		} else if (h264_ctx->gop_closure) {
+			if (state->gop_index == 0)
+				job->frame_type = CEDRUS_ENC_H264_FRAME_TYPE_IDR;
+			else
+				job->frame_type = CEDRUS_ENC_H264_FRAME_TYPE_P;
+		} else {
+			if (state->gop_index == 0)
+				job->frame_type = CEDRUS_ENC_H264_FRAME_TYPE_IDR;
+			else if (h264_ctx->gop_open_i_period > 0 &&
+				 (state->gop_index % h264_ctx->gop_open_i_period) == 0)
+				job->frame_type = CEDRUS_ENC_H264_FRAME_TYPE_I;
+			else
+				job->frame_type = CEDRUS_ENC_H264_FRAME_TYPE_P;
+		}
+
+		/*
+		 * Held B frames must not cross an IDR frame: end their group
+		 * with a P frame first and encode the IDR frame right after.
+		 */
+		if (h264_ctx->force_key_frame && !state->b_count) {
+			job->frame_type = CEDRUS_ENC_H264_FRAME_TYPE_IDR;
+			h264_ctx->force_key_frame = false;
+		}
+
+		/* Open GOPs keep their references across scene changes. */
+		if (state->scene_change && !state->b_count) {
+			if (h264_ctx->gop_closure)
+				job->frame_type = CEDRUS_ENC_H264_FRAME_TYPE_IDR;
+			else if (job->frame_type != CEDRUS_ENC_H264_FRAME_TYPE_IDR)
+				job->frame_type = CEDRUS_ENC_H264_FRAME_TYPE_I;
+
+			state->scene_change = false;
+		}
+
+		/* Start over with an IDR frame when no reference is available. */
+		if (!h264_ctx->dpb_last &&
+		    !(h264_ctx->dpb_field[0] && h264_ctx->dpb_field[1]))
+			job->frame_type = CEDRUS_ENC_H264_FRAME_TYPE_IDR;
+
+		/* Restart the temporal layers pattern with each IDR frame. */
+		if (job->frame_type == CEDRUS_ENC_H264_FRAME_TYPE_IDR)
+			state->temporal_index = 0;
+
+		job->temporal_id =
+			cedrus_enc_h264_temporal_ids[state->temporal_layers - 1]
+						    [state->temporal_index];
+
+		state->temporal_index++;
+		state->temporal_index %= BIT(state->temporal_layers - 1);
+
+		/* Frames of the top layer are never referenced. */
+		if (state->temporal_layers > 1 &&
+		    job->temporal_id == state->temporal_layers - 1)
+			job->nal_ref_idc = 0;
+
+		state->gop_index++;
+
+		if (state->gop_pattern_count)
+			state->gop_index %= state->gop_pattern_count;
+		else if (h264_ctx->gop_closure)
+			state->gop_index %= h264_ctx->gop_size;
+
+		/* Closed GOPs end with a P frame, which is not held. */
+		if (!state->gop_pattern_count)
+			hold = !h264_ctx->gop_closure || state->gop_index;
+
+		/*
+		 * Hold B frames until the next P frame is encoded, which always
+		 * ends a closed GOP and the stream when draining.
+		 */
+		if (job->frame_type == CEDRUS_ENC_H264_FRAME_TYPE_P && hold &&
+		    state->b_count < state->b_frames &&
+		    !h264_ctx->force_key_frame && !state->scene_change &&
+		    !cedrus_context_job_picture_last_check(cedrus_ctx)) {
+			if (state->gop_pattern_count)
+				state->b_qp_delta[state->b_count] = gop_qp;
+
+			state->b_count++;
+			cedrus_context_job_picture_hold(cedrus_ctx);
+			return 0;
+		}
+
+		/*
+		 * The last P frame of a closed GOP is never referenced, unless
+		 * held B frames or a long-term reference request need it.
+		 */
+		if (job->frame_type == CEDRUS_ENC_H264_FRAME_TYPE_P &&
+		    !state->gop_pattern_count &&
+		    h264_ctx->gop_closure && state->gop_index == 0 &&
+		    !state->b_count && !h264_ctx->ltr_mark)
+			job->nal_ref_idc = 0;
+
+		/*
+		 * Skipped frames repeat their reference picture and keep their
+		 * reference status, so that the reference structure is kept.
+		 */
+		if (job->frame_type == CEDRUS_ENC_H264_FRAME_TYPE_P &&
+		    !state->interlaced &&
+		    (h264_ctx->force_skip_frame ||
+		     cedrus_enc_h264_rc_skip_check(cedrus_ctx) ||
+		     cedrus_enc_h264_latency_skip_check(cedrus_ctx) ||
+		     cedrus_enc_h264_static_skip_check(cedrus_ctx))) {
+			job->skip = true;
+			h264_ctx->force_skip_frame = false;
+		}
+
+		/* Intra frames are not compared, P frames start over after. */
+		if (job->frame_type != CEDRUS_ENC_H264_FRAME_TYPE_P &&
+		    job->frame_type != CEDRUS_ENC_H264_FRAME_TYPE_B)
+			state->static_sign_valid = false;
+	}
+
+	/* Identification */
+
+	if (job->frame_type == CEDRUS_ENC_H264_FRAME_TYPE_IDR) {
+		/* Consecutive IDR frames must have different identifiers. */
+		job->idr_pic_id = state->idr_pic_id;
+		state->idr_pic_id = (state->idr_pic_id + 1) % 2;
+		state->frame_num = 0;
+		state->pic_order_cnt_lsb = 0;
+
+		if (h264_ctx->prepend_sps_pps_idr)
+			state->step = CEDRUS_ENC_H264_STEP_SPS;
+	}
+
+	job->frame_num = state->frame_num;
+
+	/*
+	 * The base layer only references itself, which is not the last
+	 * reference frame when the middle layer was encoded in-between.
+	 */
+	if (state->temporal_layers > 2 && job->temporal_id == 0) {
+		if (job->frame_type == CEDRUS_ENC_H264_FRAME_TYPE_P) {
+			job->ref_base = true;
+			job->ref_base_frame_num = state->temporal_base_frame_num;
+		}
+
+		state->temporal_base_frame_num = job->frame_num;
+	}
+
+	/* Non-reference frames share the frame num of the next frame. */
+	if (job->nal_ref_idc) {
+		state->frame_num++;
+		state->frame_num %= BIT(h264_ctx->log2_max_frame_num);
+	}
+
+	if (cedrus_ctx->job.picture_held) {
+		job->pic_order_cnt_lsb = state->b_pic_order_cnt_lsb;
+
+		state->b_pic_order_cnt_lsb += 2;
+		state->b_pic_order_cnt_lsb %=
+			BIT(h264_ctx->log2_max_pic_order_cnt_lsb);
+	} else {
+		/* Held B frames come first in display order. */
+		job->b_pending = state->b_count;
+		state->b_pic_order_cnt_lsb = state->pic_order_cnt_lsb;
+		state->b_count = 0;
+		state->b_index = 0;
+
+		job->pic_order_cnt_lsb = state->pic_order_cnt_lsb +
+					 2 * job->b_pending;
+		job->pic_order_cnt_lsb %=
+			BIT(h264_ctx->log2_max_pic_order_cnt_lsb);
+
+		state->pic_order_cnt_lsb = job->pic_order_cnt_lsb + 2;
+		state->pic_order_cnt_lsb %=
+			BIT(h264_ctx->log2_max_pic_order_cnt_lsb);
+
+		/* Held B frames are encoded right after this frame. */
+		if (job->b_pending)
+			cedrus_context_pictures_held_ready(cedrus_ctx);
+	}
+
+	if (state->vfr)
+		job->pic_order_cnt_lsb = cedrus_enc_h264_vfr_poc(cedrus_ctx);
+
+	/* Long-Term References */
+
+	if (state->ltr_count && !cedrus_ctx->job.picture_held)
+		cedrus_enc_h264_job_prepare_ltr(cedrus_ctx);
+
+	/* Features */
+
+	/*
+	 * Each of the CABAC initialization tables is tried on a P frame once
+	 * per probe period, the one giving the smallest frames is used on the
+	 * others. Probes are consecutive and see similar content and QPs.
+	 */
+	if (job->entropy_coding_mode_flag &&
+	    job->frame_type == CEDRUS_ENC_H264_FRAME_TYPE_P && !job->skip) {
+		i = state->cabac_probe_index;
+
+		if (i < CEDRUS_ENC_H264_CABAC_INIT_IDC_COUNT) {
+			job->cabac_init_idc = i;
+			job->cabac_probe = true;
+		} else {
+			job->cabac_init_idc = state->cabac_init_idc;
+		}
+
+		state->cabac_probe_index++;
+		state->cabac_probe_index %= CEDRUS_ENC_H264_CABAC_PROBE_PERIOD;
+	} else if (job->entropy_coding_mode_flag &&
+		   job->frame_type == CEDRUS_ENC_H264_FRAME_TYPE_B) {
+		job->cabac_init_idc = state->cabac_init_idc;
+	} else {
+		job->cabac_init_idc = 0;
+	}
+
+	/* Slices */
+
+	/*
+	 * Each slice is encoded as a separate pass over whole macroblock rows.
+	 * Scaled or rotated pictures must be fed in one pass, so they are
+	 * always encoded as a single slice.
+	 */
+	if (h264_ctx->error_resilience &&
+	    cedrus_enc_format_picture_rows_check(cedrus_ctx))
+		job->slice_mb_rows = 1;
+	else if (h264_ctx->slice_mode ==
+		 V4L2_MPEG_VIDEO_MULTI_SLICE_MODE_MAX_MB &&
+		 cedrus_enc_format_picture_rows_check(cedrus_ctx))
+		job->slice_mb_rows = clamp_t(unsigned int,
+					     h264_ctx->slice_max_mb /
+					     h264_ctx->width_mbs, 1,
+					     h264_ctx->height_mbs);
+	else
+		job->slice_mb_rows = h264_ctx->height_mbs;
+
+	job->slice_count = DIV_ROUND_UP(h264_ctx->height_mbs,
+					job->slice_mb_rows);
+	job->slice_index = 0;
+
+	/* Fields */
+
+	/* Both fields are encoded in the same job, starting with the first. */
+	if (state->interlaced) {
+		struct vb2_v4l2_buffer *v4l2_buffer =
+			cedrus_ctx->job.buffer_picture;
+
+		job->field_count = 2;
+		job->field_bottom_first =
+			v4l2_buffer->field == V4L2_FIELD_INTERLACED_BT ||
+			v4l2_buffer->field == V4L2_FIELD_SEQ_BT;
+
+		cedrus_ctx->job.picture_field = job->field_bottom_first ?
+						V4L2_FIELD_BOTTOM :
+						V4L2_FIELD_TOP;
+	} else {
+		job->field_count = 1;
+	}
+
+	job->field_index = 0;
+
+	job->disable_deblocking_filter_idc =
+		cedrus_enc_h264_disable_deblocking_filter_idc(h264_ctx->loop_filter_mode);
+
+	/* Slices are encoded independently, without filtering across them. */
+	if (job->slice_count > 1 && job->disable_deblocking_filter_idc == 0)
+		job->disable_deblocking_filter_idc = 2;
+
+	if (job->disable_deblocking_filter_idc != 1) {
+		job->slice_alpha_c0_offset_div2 = h264_ctx->loop_filter_alpha;
+		job->slice_beta_offset_div2 = h264_ctx->loop_filter_beta;
+	}
+
+	/* QP */
+
+	if (h264_ctx->rc_enable) {
+		/* Keep the I/P QP difference from the fixed QP controls. */
+		switch (job->frame_type) {
+		case CEDRUS_ENC_H264_FRAME_TYPE_IDR:
+		case CEDRUS_ENC_H264_FRAME_TYPE_I:
+			job->qp = max_t(int, (int)state->rc_qp +
+					h264_ctx->qp_i - h264_ctx->qp_p, 0);
+			break;
+		case CEDRUS_ENC_H264_FRAME_TYPE_P:
+			job->qp = state->rc_qp;
+			break;
+		case CEDRUS_ENC_H264_FRAME_TYPE_B:
+			job->qp = max_t(int, (int)state->rc_qp +
+					h264_ctx->qp_b - h264_ctx->qp_p, 0);
+			break;
+		}
+	} else {
+		switch (job->frame_type) {
+		case CEDRUS_ENC_H264_FRAME_TYPE_IDR:
+		case CEDRUS_ENC_H264_FRAME_TYPE_I:
+			job->qp = h264_ctx->qp_i;
+			break;
+		case CEDRUS_ENC_H264_FRAME_TYPE_P:
+			job->qp = h264_ctx->qp_p;
+			break;
+		case CEDRUS_ENC_H264_FRAME_TYPE_B:
+			job->qp = h264_ctx->qp_b;
+			break;
+		}
+	}
+
+	qp_delta = gop_qp;
+
+	if (job->frame_type == CEDRUS_ENC_H264_FRAME_TYPE_P) {
+		job->background_qp_delta = h264_ctx->static_background;
+
+		qp_delta += lookahead_qp +
+			    h264_ctx->qp_layer_delta[job->temporal_id] +
+			    job->background_qp_delta;
+	}
+
+	/* Nothing is predicted from non-reference frames. */
+	if (!job->nal_ref_idc)
+		qp_delta += h264_ctx->qp_non_ref_delta;
+
+	if (state->fast_start_qp_delta) {
+		qp_delta += state->fast_start_qp_delta;
+		state->fast_start_qp_delta--;
+	}
+
+	job->qp = max_t(int, (int)job->qp + qp_delta, 0);
+
+	/* Skipped frames have no residuals to spend the budget on. */
+	if (h264_ctx->frame_budget_pending && !job->skip) {
+		job->qp = cedrus_enc_h264_frame_budget_qp(cedrus_ctx);
+		h264_ctx->frame_budget_pending = false;
+	}
+
+	/* Presets may cap the QP further, but not below the minimum. */
+	preset = &cedrus_enc_h264_presets[h264_ctx->preset];
+	qp_max = h264_ctx->qp_max;
+
+	if (preset->qp_max)
+		qp_max = max_t(unsigned int, h264_ctx->qp_min,
+			       min_t(unsigned int, qp_max, preset->qp_max));
+
+	if (job->qp > qp_max)
+		job->qp = qp_max;
+	else if (job->qp < h264_ctx->qp_min)
+		job->qp = h264_ctx->qp_min;
+
+	/* Preset */
+
+	job->preset = h264_ctx->preset;
+
+	/*
+	 * Spread the time budget evenly across the macroblocks, at the current
+	 * clock rate (which may be scaled with the engine load).
+	 */
+	if (h264_ctx->time_budget)
+		job->mb_cycles_max =
+			max_t(u64, div64_u64((u64)h264_ctx->time_budget *
+					     clock_rate,
+					     (u64)USEC_PER_SEC *
+					     h264_ctx->width_mbs *
+					     h264_ctx->height_mbs *
+					     job->field_count), 1);
+	else
+		job->mb_cycles_max = 0;
+
+	/* Temporal Denoise */
+
+	/*
+	 * The filter needs the previous reconstruction as history, which is
+	 * not kept for each field.
+	 */
+	if (h264_ctx->denoise && !state->interlaced &&
+	    (job->frame_type == CEDRUS_ENC_H264_FRAME_TYPE_P ||
+	     job->frame_type == CEDRUS_ENC_H264_FRAME_TYPE_B)) {
+		job->denoise = true;
+		job->denoise_max_coef = DIV_ROUND_UP(h264_ctx->denoise * 127,
+						     CEDRUS_ENC_H264_DENOISE_MAX);
+	}
+
+	/* Adaptive Quantization */
+
+	job->aq_strength = h264_ctx->aq_strength;
+
+	/* Packing */
+
+	/* Frames packed in the same coded buffer follow the previous ones. */
+	if (cedrus_ctx->coded_kept) {
+		struct vb2_buffer *vb2_buffer =
+			&cedrus_ctx->job.buffer_coded->vb2_buf;
+
+		job->offset = vb2_get_plane_payload(vb2_buffer, 0);
+	} else {
+		h264_ctx->pack_count = 0;
+	}
+
+	/* Thumbnail */
+
+	/*
+	 * The thumbnail takes the end of the coded buffer, if it fits. Side
+	 * outputs cover a single pass over the picture, so they are not
+	 * written for fields.
+	 */
+	if (h264_ctx->thumbnail && !state->interlaced) {
+		unsigned int stride = h264_ctx->width_mbs * 16;
+		unsigned int size = stride * h264_ctx->height_mbs * 16 * 3 / 2;
+		unsigned int coded_size;
+		dma_addr_t coded_addr;
+
+		cedrus_job_buffer_coded_dma(cedrus_ctx, &coded_addr,
+					    &coded_size);
+
+		if (coded_size >= job->offset + size + SZ_1K) {
+			job->thumbnail = true;
+			job->thumbnail_offset = ALIGN_DOWN(coded_size - size, 16);
+			job->thumbnail_stride = stride;
+		}
+	}
+
+	/* Motion Vectors */
+
+	/* Motion vectors are written before the thumbnail, if they fit. */
+	if ((h264_ctx->mv_info || h264_ctx->cost_map) && !state->interlaced) {
+		unsigned int size = h264_ctx->width_mbs * h264_ctx->height_mbs *
+				    CEDRUS_H264_ENC_MV_INFO_MB_SIZE;
+		unsigned int coded_size;
+		dma_addr_t coded_addr;
+
+		cedrus_job_buffer_coded_dma(cedrus_ctx, &coded_addr,
+					    &coded_size);
+
+		if (job->thumbnail)
+			coded_size = job->thumbnail_offset;
+
+		if (coded_size >= job->offset + size + SZ_1K) {
+			job->mv_info = true;
+			job->mv_info_offset = ALIGN_DOWN(coded_size - size, 16);
+		}
+	}
+
+	/* Macroblock Cost Map */
+
+	/* The map is condensed from the motion vectors (see job_finish). */
+	if (h264_ctx->cost_map && job->mv_info &&
+	    vb2_plane_vaddr(&cedrus_ctx->job.buffer_coded->vb2_buf, 0)) {
+		unsigned int size = h264_ctx->width_mbs * h264_ctx->height_mbs;
+
+		if (job->mv_info_offset >= job->offset + size + SZ_1K) {
+			job->cost_map = true;
+			job->cost_map_offset =
+				ALIGN_DOWN(job->mv_info_offset - size, 16);
+		}
+	}
+
+	/* Headroom */
+
+	/* Keep room for a transport header, if the bitstream still fits. */
+	if (h264_ctx->headroom) {
+		unsigned int coded_size;
+		dma_addr_t coded_addr;
+
+		cedrus_job_buffer_coded_dma(cedrus_ctx, &coded_addr,
+					    &coded_size);
+
+		if (job->cost_map)
+			coded_size = job->cost_map_offset;
+		else if (job->mv_info)
+			coded_size = job->mv_info_offset;
+		else if (job->thumbnail)
+			coded_size = job->thumbnail_offset;
+
+		if (coded_size >= job->offset + h264_ctx->headroom + SZ_1K)
+			job->headroom = h264_ctx->headroom;
+	}
+
+	/* Cyclic Intra Refresh */
+
+	/*
+	 * Refresh a band of macroblock columns with each P frame, sweeping
+	 * across the picture once per period. Waves requested by the client
+	 * sweep it once over their own number of frames, taking over the cycle
+	 * which restarts after them. Intra frames restart the cycle and make
+	 * waves moot.
+	 */
+	if (job->frame_type == CEDRUS_ENC_H264_FRAME_TYPE_IDR ||
+	    job->frame_type == CEDRUS_ENC_H264_FRAME_TYPE_I) {
+		state->intra_refresh_index = 0;
+		state->intra_refresh_wave = 0;
+		h264_ctx->intra_refresh_wave_pending = false;
+	} else if (job->frame_type == CEDRUS_ENC_H264_FRAME_TYPE_P &&
+		   !job->constrained_intra_pred_flag) {
+		unsigned int period = h264_ctx->intra_refresh_period;
+		unsigned int index = state->intra_refresh_index;
+
+		if (h264_ctx->intra_refresh_wave_pending) {
+			state->intra_refresh_wave =
+				h264_ctx->intra_refresh_wave_frames;
+			state->intra_refresh_wave_index = 0;
+			h264_ctx->intra_refresh_wave_pending = false;
+			job->intra_refresh_wave = true;
+		}
+
+		if (state->intra_refresh_wave) {
+			period = state->intra_refresh_wave;
+			index = state->intra_refresh_wave_index;
+		}
+
+		if (period > 0) {
+			unsigned int band_mbs =
+				DIV_ROUND_UP(h264_ctx->width_mbs, period);
+			unsigned int start_mb = index * band_mbs;
+
+			if (start_mb < h264_ctx->width_mbs) {
+				job->intra_refresh = true;
+				job->intra_refresh_period = period;
+				job->intra_refresh_start_mb = start_mb;
+				job->intra_refresh_end_mb =
+					min(start_mb + band_mbs,
+					    h264_ctx->width_mbs) - 1;
+			}
+		}
+
+		if (state->intra_refresh_wave) {
+			if (++state->intra_refresh_wave_index == period) {
+				state->intra_refresh_wave = 0;
+				state->intra_refresh_index = 0;
+			}
+		} else if (period > 0) {
+			state->intra_refresh_index++;
+			state->intra_refresh_index %= period;
+		}
+	}
+
+	/* Supplemental Enhancement Information */
+
+	/*
+	 * Tell decoders where they can start, besides at IDR frames. Waves are
+	 * always signalled, since telling when the picture is whole again is
+	 * what they are requested for.
+	 */
+	if (h264_ctx->sei & CEDRUS_H264_ENC_SEI_RECOVERY_POINT ||
+	    job->intra_refresh_wave) {
+		if (job->frame_type == CEDRUS_ENC_H264_FRAME_TYPE_I) {
+			job->recovery_point = true;
+			job->recovery_exact = true;
+		} else if (job->intra_refresh && !job->intra_refresh_start_mb) {
+			/*
+			 * The picture is only refreshed at the end of the
+			 * cycle and motion vectors may still reach areas that
+			 * were not refreshed yet.
+			 */
+			job->recovery_point = true;
+			job->recovery_frame_cnt =
+				job->intra_refresh_period - 1;
+		}
+	}
+
+	/* Hypothetical Reference Decoder */
+
+	if (state->hrd_size) {
+		s64 room = state->hrd_size - state->hrd_fullness;
+		u64 delay;
+
+		job->hrd = true;
+
+		/* Removal delays count from the last buffering period. */
+		job->hrd_removal_delay = state->hrd_ticks;
+
+		if (job->frame_type == CEDRUS_ENC_H264_FRAME_TYPE_IDR ||
+		    job->frame_type == CEDRUS_ENC_H264_FRAME_TYPE_I) {
+			/* The decoder waits for the room left in the buffer. */
+			delay = div_u64((u64)max_t(s64, room, 0) * 90000,
+					state->hrd_bitrate);
+
+			if (delay > CEDRUS_ENC_H264_HRD_DELAY_MAX)
+				delay = CEDRUS_ENC_H264_HRD_DELAY_MAX;
+
+			job->hrd_buffering_period = true;
+			job->hrd_initial_delay = max_t(u64, delay, 1);
+			state->hrd_ticks = 0;
+		}
+
+		/*
+		 * Frames are output one frame later when B frames are used, as
+		 * they come right after their future reference, which itself
+		 * comes before the held B frames in display order.
+		 */
+		if (cedrus_ctx->job.picture_held)
+			job->hrd_output_delay = 0;
+		else
+			job->hrd_output_delay = 2 * (!!state->b_frames +
+						     job->b_pending);
+
+		/* A frame takes two ticks. */
+		state->hrd_ticks += 2;
+	}
+
+	/* Regions of Interest */
+
+	job->roi_count = 0;
+
+	for (i = 0; i < CEDRUS_H264_ENC_ROI_COUNT; i++) {
+		const s32 *roi = h264_ctx->roi[i];
+		struct cedrus_enc_h264_roi *job_roi = &job->roi[job->roi_count];
+		unsigned int right, bottom;
+
+		if (!roi[CEDRUS_H264_ENC_ROI_WIDTH] ||
+		    !roi[CEDRUS_H264_ENC_ROI_HEIGHT])
+			continue;
+
+		if (roi[CEDRUS_H264_ENC_ROI_LEFT] >= pix_format->width ||
+		    roi[CEDRUS_H264_ENC_ROI_TOP] >= pix_format->height)
+			continue;
+
+		right = min_t(unsigned int, roi[CEDRUS_H264_ENC_ROI_LEFT] +
+			      roi[CEDRUS_H264_ENC_ROI_WIDTH],
+			      pix_format->width);
+		bottom = min_t(unsigned int, roi[CEDRUS_H264_ENC_ROI_TOP] +
+			       roi[CEDRUS_H264_ENC_ROI_HEIGHT],
+			       pix_format->height);
+
+		/* Field macroblocks cover twice as many picture lines. */
+		job_roi->left_mb = roi[CEDRUS_H264_ENC_ROI_LEFT] / 16;
+		job_roi->top_mb = roi[CEDRUS_H264_ENC_ROI_TOP] /
+				  (16 * job->field_count);
+		job_roi->right_mb = DIV_ROUND_UP(right, 16) - 1;
+		job_roi->bottom_mb = DIV_ROUND_UP(bottom,
+						  16 * job->field_count) - 1;
+		/* Regions of interest are not part of the background. */
+		qp_delta = roi[CEDRUS_H264_ENC_ROI_QP_DELTA] -
+			   (int)job->background_qp_delta;
+		job_roi->qp_delta = clamp(qp_delta, -51, 51);
+
+		job->roi_count++;
+	}
+
+	/* Set initial QP to current QP with each newly serialized PPS. */
+	if (!state->pps_valid)
+		state->qp_init = job->qp;
+
+	return 0;
+}
+
+static void cedrus_enc_h264_job_configure_hrd(struct cedrus_context *cedrus_ctx,
+					      struct cedrus_enc_h264_bits *bits)
+{
+	struct cedrus_enc_h264_context *h264_ctx = cedrus_ctx->engine_ctx;
+	struct cedrus_enc_h264_state *state = &h264_ctx->state;
+	unsigned int length = CEDRUS_ENC_H264_HRD_DELAY_LENGTH;
+	unsigned int bitrate_scale = 0;
+	unsigned int size_scale = 0;
+	unsigned int value;
+
+	/* Keep the values short, which costs little precision. */
+	while (bitrate_scale < 15 &&
+	       state->hrd_bitrate >> (6 + bitrate_scale) > U16_MAX)
+		bitrate_scale++;
+
+	while (size_scale < 15 && state->hrd_size >> (4 + size_scale) > U16_MAX)
+		size_scale++;
+
+	/* Syntax element: cpb_cnt_minus1. */
+	cedrus_enc_h264_bits_ue(bits, 0);
+
+	/* Syntax element: bit_rate_scale. */
+	cedrus_enc_h264_bits_append(bits, bitrate_scale, 4);
+
+	/* Syntax element: cpb_size_scale. */
+	cedrus_enc_h264_bits_append(bits, size_scale, 4);
+
+	/* Syntax element: bit_rate_value_minus1. */
+	value = DIV_ROUND_UP(state->hrd_bitrate, BIT(6 + bitrate_scale));
+	cedrus_enc_h264_bits_ue(bits, max(value, 1U) - 1);
+
+	/* Syntax element: cpb_size_value_minus1. */
+	value = state->hrd_size >> (4 + size_scale);
+	cedrus_enc_h264_bits_ue(bits, max(value, 1U) - 1);
+
+	/*
+	 * Without filler data, the buffer may run empty on the encoder side,
+	 * which is only allowed with variable bitrate delivery.
+	 */
+	/* Syntax element: cbr_flag. */
+	cedrus_enc_h264_bits_bit(bits, 0);
+
+	/* Syntax element: initial_cpb_removal_delay_length_minus1. */
+	cedrus_enc_h264_bits_append(bits, length - 1, 5);
+
+	/* Syntax element: cpb_removal_delay_length_minus1. */
+	cedrus_enc_h264_bits_append(bits, length - 1, 5);
+
+	/* Syntax element: dpb_output_delay_length_minus1. */
+	cedrus_enc_h264_bits_append(bits, length - 1, 5);
+
+	/* Syntax element: time_offset_length. */
+	cedrus_enc_h264_bits_append(bits, 0, 5);
+}
+
+static void cedrus_enc_h264_job_configure_sps(struct cedrus_context *cedrus_ctx,
+					      struct cedrus_enc_h264_bits *bits)
+{
+	struct cedrus_enc_h264_job *job = cedrus_ctx->engine_job;
+	struct cedrus_enc_h264_context *h264_ctx = cedrus_ctx->engine_ctx;
+	struct cedrus_enc_h264_state *state = &h264_ctx->state;
+	struct v4l2_pix_format *pix_format =
+		&cedrus_ctx->v4l2.format_coded.fmt.pix;
+	struct v4l2_fract *timeperframe = &state->timeperframe;
+	struct v4l2_rect selection;
+	u32 crop_left, crop_right, crop_top, crop_bottom;
+	u8 profile_idc = job->profile_idc;
+	unsigned int crop_unit_y;
+	u8 header;
+
+	/* Syntax element: Annex-B start code. */
+	cedrus_enc_h264_bits_u32(bits, 0x1);
+
+	header = cedrus_enc_h264_nalu_header(CENDRUS_ENC_H264_NALU_TYPE_SPS, 3);
+
+	/* Syntax element: NALU header. */
+	cedrus_enc_h264_bits_u8(bits, header);
+
+	/* Syntax element: profile_idc. */
+	cedrus_enc_h264_bits_u8(bits, job->profile_idc);
+
+	/* Syntax elements: constraint_set*_flag, reserved_zero_2bits. */
+	cedrus_enc_h264_bits_u8(bits, job->constraint_set_flags);
+
+	/* Syntax element: level_idc. */
+	cedrus_enc_h264_bits_u8(bits, job->level_idc);
+
+	/* Syntax element: seq_parameter_set_id. */
+	cedrus_enc_h264_bits_ue(bits, job->seq_parameter_set_id);
+
+	if (profile_idc == 100 || profile_idc == 110 || profile_idc == 122 ||
+	    profile_idc == 244 || profile_idc == 44 || profile_idc == 83 ||
+	    profile_idc == 86 || profile_idc == 118 || profile_idc == 128 ||
+	    profile_idc == 138 || profile_idc == 139 || profile_idc == 134 ||
+	    profile_idc == 135) {
+		/* Syntax element: chroma_format_idc, always YUV 4:2:0 (1). */
+		cedrus_enc_h264_bits_ue(bits, 1);
+
+		/* Syntax element: bit_depth_luma_minus8. */
+		cedrus_enc_h264_bits_ue(bits, 0);
+
+		/* Syntax element: bit_depth_chroma_minus8. */
+		cedrus_enc_h264_bits_ue(bits, 0);
+
+		/* Syntax element: qpprime_y_zero_transform_bypass_flag. */
+		cedrus_enc_h264_bits_bit(bits, 0);
+
+		/* Syntax element: seq_scaling_matrix_present_flag. */
+		cedrus_enc_h264_bits_bit(bits, 0);
+	}
+
+	/* Syntax element: log2_max_frame_num_minus4. */
+	cedrus_enc_h264_bits_ue(bits, h264_ctx->log2_max_frame_num - 4);
+
+	/* Syntax element: pic_order_cnt_type. */
+	cedrus_enc_h264_bits_ue(bits, h264_ctx->pic_order_cnt_type);
+
+	if (h264_ctx->pic_order_cnt_type == 0) {
+		/* Syntax element: log2_max_pic_order_cnt_lsb_minus4. */
+		cedrus_enc_h264_bits_ue(bits,
+					h264_ctx->log2_max_pic_order_cnt_lsb - 4);
+	}
+
+	/* Syntax element: max_num_ref_frames. */
+	cedrus_enc_h264_bits_ue(bits, cedrus_enc_h264_ref_count(state) +
+				state->ltr_count);
+
+	/*
+	 * Dropping the reference frames of the middle temporal layer leaves
+	 * gaps in frame num for the base layer.
+	 */
+
+	/* Syntax element: gaps_in_frame_num_value_allowed_flag. */
+	cedrus_enc_h264_bits_bit(bits, state->temporal_layers > 2);
+
+	/* Syntax element: pic_width_in_mbs_minus1. */
+	cedrus_enc_h264_bits_ue(bits, h264_ctx->width_mbs - 1);
+
+	/* Map units are macroblock pairs, so fields are as high as them. */
+	/* Syntax element: pic_height_in_map_units_minus1. */
+	cedrus_enc_h264_bits_ue(bits, h264_ctx->height_mbs - 1);
+
+	/* Syntax element: frame_mbs_only_flag. */
+	cedrus_enc_h264_bits_bit(bits, !state->interlaced);
+
+	if (state->interlaced) {
+		/* Syntax element: mb_adaptive_frame_field_flag. */
+		cedrus_enc_h264_bits_bit(bits, 0);
+	}
+
+	/* The inference is required without frame_mbs_only_flag. */
+	/* Syntax element: direct_8x8_inference_flag. */
+	cedrus_enc_h264_bits_bit(bits, state->interlaced);
+
+	/* The picture crop rectangle is transformed to the coded picture. */
+	cedrus_enc_format_selection_coded(cedrus_ctx, &selection);
+
+	crop_left = selection.left;
+	crop_right = pix_format->width - selection.width - selection.left;
+	crop_top = selection.top;
+	crop_bottom = pix_format->height - selection.height - selection.top;
+
+	/* Vertical offsets are given in units of chroma lines of a field. */
+	crop_unit_y = state->interlaced ? 4 : 2;
+
+	if (crop_left || crop_right || crop_top || crop_bottom) {
+		/* Syntax element: frame_cropping_flag. */
+		cedrus_enc_h264_bits_bit(bits, 1);
+
+		/* Syntax element: frame_crop_left_offset. */
+		cedrus_enc_h264_bits_ue(bits, crop_left / 2);
+
+		/* Syntax element: frame_crop_right_offset. */
+		cedrus_enc_h264_bits_ue(bits, crop_right / 2);
+
+		/* Syntax element: frame_crop_top_offset. */
+		cedrus_enc_h264_bits_ue(bits, crop_top / crop_unit_y);
+
+		/* Syntax element: frame_crop_bottom_offset. */
+		cedrus_enc_h264_bits_ue(bits, crop_bottom / crop_unit_y);
+
+	} else {
+		/* Syntax element: frame_cropping_flag. */
+		cedrus_enc_h264_bits_bit(bits, 0);
+	}
+
+	/* Syntax element: vui_parameters_present_flag. */
+	cedrus_enc_h264_bits_bit(bits, 1);
+
+	if (h264_ctx->vui_sar_enable) {
+		u8 vui_sar_idc =
+			cedrus_enc_h264_vui_sar_idc(h264_ctx->vui_sar_idc);
+
+		/* Syntax element: aspect_ratio_info_present_flag. */
+		cedrus_enc_h264_bits_bit(bits, 1);
+
+		/* Syntax element: aspect_ratio_idc. */
+		cedrus_enc_h264_bits_u8(bits, vui_sar_idc);
+
+		if (h264_ctx->vui_sar_idc ==
+		    V4L2_MPEG_VIDEO_H264_VUI_SAR_IDC_EXTENDED) {
+			/* Syntax element: sar_width. */
+			cedrus_enc_h264_bits_u16(bits,
+						 h264_ctx->vui_ext_sar_width);
+
+			/* Syntax element: sar_height. */
+			cedrus_enc_h264_bits_u16(bits,
+						 h264_ctx->vui_ext_sar_height);
+		}
+	} else {
+		/* Syntax element: aspect_ratio_info_present_flag. */
+		cedrus_enc_h264_bits_bit(bits, 0);
+	}
+
+	/* Syntax element: overscan_info_present_flag. */
+	cedrus_enc_h264_bits_bit(bits, 0);
+
+	if (pix_format->colorspace != V4L2_COLORSPACE_DEFAULT) {
+		int colorspace = pix_format->colorspace;
+		int xfer_func = pix_format->xfer_func;
+		int ycbcr_enc = pix_format->ycbcr_enc;
+		int quantization = pix_format->quantization;
+		u8 value;
+
+		if (xfer_func == V4L2_XFER_FUNC_DEFAULT)
+			xfer_func = V4L2_MAP_XFER_FUNC_DEFAULT(colorspace);
+
+		if (ycbcr_enc == V4L2_YCBCR_ENC_DEFAULT)
+			ycbcr_enc = V4L2_MAP_YCBCR_ENC_DEFAULT(colorspace);
+
+		if (quantization == V4L2_QUANTIZATION_DEFAULT)
+			quantization =
+				V4L2_MAP_QUANTIZATION_DEFAULT(false, colorspace,
+							      ycbcr_enc);
+
+		/* Syntax element: video_signal_type_present_flag. */
+		cedrus_enc_h264_bits_bit(bits, 1);
+
+		/* Unspecified video format. */
+		/* Syntax element: video_format. */
+		cedrus_enc_h264_bits_append(bits, 5, 3);
+
+		/* Syntax element: video_full_range_flag. */
+		cedrus_enc_h264_bits_bit(bits, quantization ==
+					 V4L2_QUANTIZATION_FULL_RANGE);
+
+		/* Syntax element: colour_description_present_flag. */
+		cedrus_enc_h264_bits_bit(bits, 1);
+
+		/* Syntax element: colour_primaries. */
+		value = cedrus_enc_h264_vui_colour_primaries(colorspace);
+		cedrus_enc_h264_bits_u8(bits, value);
+
+		/* Syntax element: transfer_characteristics. */
+		value = cedrus_enc_h264_vui_transfer_characteristics(xfer_func);
+		cedrus_enc_h264_bits_u8(bits, value);
+
+		/* Syntax element: matrix_coefficients. */
+		value = cedrus_enc_h264_vui_matrix_coefficients(ycbcr_enc);
+		cedrus_enc_h264_bits_u8(bits, value);
+	} else {
+		/* Syntax element: video_signal_type_present_flag. */
+		cedrus_enc_h264_bits_bit(bits, 0);
+	}
+
+	/* Syntax element: chroma_loc_info_present_flag. */
+	cedrus_enc_h264_bits_bit(bits, 0);
+
+	/* Syntax element: timing_info_present_flag. */
+	cedrus_enc_h264_bits_bit(bits, 1);
+
+	/* Syntax element: num_units_in_tick. */
+	cedrus_enc_h264_bits_u32(bits, timeperframe->numerator);
+
+	/* A frame requires two ticks in H.264. */
+	/* Syntax element: time_scale. */
+	cedrus_enc_h264_bits_u32(bits, timeperframe->denominator * 2);
+
+	/* Syntax element: fixed_frame_rate_flag. */
+	cedrus_enc_h264_bits_bit(bits, !state->vfr);
+
+	if (state->hrd_size) {
+		/* Syntax element: nal_hrd_parameters_present_flag. */
+		cedrus_enc_h264_bits_bit(bits, 1);
+
+		cedrus_enc_h264_job_configure_hrd(cedrus_ctx, bits);
+	} else {
+		/* Syntax element: nal_hrd_parameters_present_flag. */
+		cedrus_enc_h264_bits_bit(bits, 0);
+	}
+
+	/* Syntax element: vcl_hrd_parameters_present_flag. */
+	cedrus_enc_h264_bits_bit(bits, 0);
+
+	if (state->hrd_size) {
+		/* Syntax element: low_delay_hrd_flag. */
+		cedrus_enc_h264_bits_bit(bits, 0);
+	}
+
+	/* Syntax element: pic_struct_present_flag. */
+	cedrus_enc_h264_bits_bit(bits, 0);
+
+	/*
+	 * Signal the actual reordering and buffering needs so that decoders
+	 * can output pictures right away instead of filling their DPB.
+	 */
+	/* Syntax element: bitstream_restriction_flag. */
+	cedrus_enc_h264_bits_bit(bits, 1);
+
+	/* Syntax element: motion_vectors_over_pic_boundaries_flag. */
+	cedrus_enc_h264_bits_bit(bits, 1);
+
+	/* Syntax element: max_bytes_per_pic_denom. */
+	cedrus_enc_h264_bits_ue(bits, 2);
+
+	/* Syntax element: max_bits_per_mb_denom. */
+	cedrus_enc_h264_bits_ue(bits, 1);
+
+	/* Syntax element: log2_max_mv_length_horizontal. */
+	cedrus_enc_h264_bits_ue(bits, 15);
+
+	/* Syntax element: log2_max_mv_length_vertical. */
+	cedrus_enc_h264_bits_ue(bits, 15);
+
+	/* B frames are only ever preceded by a single future reference. */
+	/* Syntax element: max_num_reorder_frames. */
+	cedrus_enc_h264_bits_ue(bits, state->b_frames ? 1 : 0);
+
+	/* Syntax element: max_dec_frame_buffering. */
+	cedrus_enc_h264_bits_ue(bits, cedrus_enc_h264_ref_count(state) +
+				state->ltr_count);
+
+	/* Syntax element: rbsp_stop_one_bit. */
+	cedrus_enc_h264_bits_bit(bits, 1);
+
+	cedrus_enc_h264_bits_align(bits);
+}
+
+static void cedrus_enc_h264_job_configure_pps(struct cedrus_context *cedrus_ctx,
+					      struct cedrus_enc_h264_bits *bits)
+{
+	struct cedrus_enc_h264_job *job = cedrus_ctx->engine_job;
+	struct cedrus_enc_h264_context *h264_ctx = cedrus_ctx->engine_ctx;
+	struct cedrus_enc_h264_state *state = &h264_ctx->state;
+	u8 header;
+
+	/* Syntax element: Annex-B start code. */
+	cedrus_enc_h264_bits_u32(bits, 0x1);
+
+	header = cedrus_enc_h264_nalu_header(CENDRUS_ENC_H264_NALU_TYPE_PPS, 3);
+
+	/* Syntax element: NALU header. */
+	cedrus_enc_h264_bits_u8(bits, header);
+
+	/* Syntax element: pic_parameter_set_id. */
+	cedrus_enc_h264_bits_ue(bits, job->pic_parameter_set_id);
+
+	/* Syntax element: seq_parameter_set_id. */
+	cedrus_enc_h264_bits_ue(bits, job->seq_parameter_set_id);
+
+	/* Syntax element: entropy_coding_mode_flag. */
+	cedrus_enc_h264_bits_bit(bits, job->entropy_coding_mode_flag);
+
+	/* Syntax element: bottom_field_pic_order_in_frame_present_flag. */
+	cedrus_enc_h264_bits_bit(bits, 0);
+
+	/* Syntax element: num_slice_groups_minus1. */
+	cedrus_enc_h264_bits_ue(bits, 0);
+
+	/* Syntax element: num_ref_idx_l0_default_active_minus1. */
+	cedrus_enc_h264_bits_ue(bits, 0);
+
+	/* Syntax element: num_ref_idx_l1_default_active_minus1. */
+	cedrus_enc_h264_bits_ue(bits, 0);
+
+	/* Syntax element: weighted_pred_flag. */
+	cedrus_enc_h264_bits_bit(bits, 0);
+
+	/* Syntax element: weighted_bipred_idc. */
+	cedrus_enc_h264_bits_append(bits, 0, 2);
+
+	/* Syntax element: pic_init_qp_minus26. */
+	cedrus_enc_h264_bits_se(bits, state->qp_init - 26);
+
+	/* Syntax element: pic_init_qs_minus26. */
+	cedrus_enc_h264_bits_se(bits, state->qp_init - 26);
+
+	/* Syntax element: chroma_qp_index_offset. */
+	cedrus_enc_h264_bits_se(bits, job->chroma_qp_index_offset);
+
+	/* Syntax element: deblocking_filter_control_present_flag. */
+	cedrus_enc_h264_bits_bit(bits, 1);
+
+	/* Syntax element: constrained_intra_pred_flag. */
+	cedrus_enc_h264_bits_bit(bits, job->constrained_intra_pred_flag);
+
+	/* Syntax element: redundant_pic_cnt_present_flag. */
+	cedrus_enc_h264_bits_bit(bits, 0);
+
+	/*
+	 * The engine only has 4x4 transforms, so the High profile extension
+	 * is left out and transform_8x8_mode_flag is inferred to be 0.
+	 */
+
+	/* Syntax element: rbsp_stop_one_bit. */
+	cedrus_enc_h264_bits_bit(bits, 1);
+
+	cedrus_enc_h264_bits_align(bits);
+}
+
+static void cedrus_enc_h264_job_configure_aud(struct cedrus_context *ctx,
+					      struct cedrus_enc_h264_bits *bits)
+{
+	struct cedrus_enc_h264_job *job = ctx->engine_job;
+	u8 primary_pic_type;
+	u8 header;
+
+	/* Syntax element: Annex-B start code. */
+	cedrus_enc_h264_bits_u32(bits, 0x1);
+
+	header = cedrus_enc_h264_nalu_header(CENDRUS_ENC_H264_NALU_TYPE_AUD, 0);
+
+	/* Syntax element: NALU header. */
+	cedrus_enc_h264_bits_u8(bits, header);
+
+	/* Slice types that may be found in the picture. */
+	switch (job->frame_type) {
+	case CEDRUS_ENC_H264_FRAME_TYPE_IDR:
+	case CEDRUS_ENC_H264_FRAME_TYPE_I:
+		primary_pic_type = 0;
+		break;
+	case CEDRUS_ENC_H264_FRAME_TYPE_P:
+		primary_pic_type = 1;
+		break;
+	case CEDRUS_ENC_H264_FRAME_TYPE_B:
+	default:
+		primary_pic_type = 2;
+		break;
+	}
+
+	/* Syntax element: primary_pic_type. */
+	cedrus_enc_h264_bits_append(bits, primary_pic_type, 3);
+
+	/* Syntax element: rbsp_stop_one_bit. */
+	cedrus_enc_h264_bits_bit(bits, 1);
+
+	cedrus_enc_h264_bits_align(bits);
+}
+
+static void cedrus_enc_h264_job_configure_sei(struct cedrus_context *ctx,
+					      struct cedrus_enc_h264_bits *bits)
+{
+	struct cedrus_enc_h264_job *job = ctx->engine_job;
+	struct cedrus_enc_h264_bits raw;
+	unsigned int payload_bits;
+	u8 header;
+
+	cedrus_enc_h264_bits_reset(&raw);
+
+	/* Syntax element: Annex-B start code. */
+	cedrus_enc_h264_bits_u32(&raw, 0x1);
+
+	header = cedrus_enc_h264_nalu_header(CENDRUS_ENC_H264_NALU_TYPE_SEI, 0);
+
+	/* Syntax element: NALU header. */
+	cedrus_enc_h264_bits_u8(&raw, header);
+
+	/* Syntax element: last_payload_type_byte. */
+	cedrus_enc_h264_bits_u8(&raw, CEDRUS_ENC_H264_SEI_TYPE_RECOVERY_POINT);
+
+	/* The Exponential-Golomb frame count is followed by 4 bits of flags. */
+	payload_bits = 2 * __fls(job->recovery_frame_cnt + 1) + 1 + 4;
+
+	/* Syntax element: last_payload_size_byte. */
+	cedrus_enc_h264_bits_u8(&raw, DIV_ROUND_UP(payload_bits, 8));
+
+	/* Syntax element: recovery_frame_cnt. */
+	cedrus_enc_h264_bits_ue(&raw, job->recovery_frame_cnt);
+
+	/* Syntax element: exact_match_flag. */
+	cedrus_enc_h264_bits_bit(&raw, job->recovery_exact);
+
+	/* Syntax element: broken_link_flag. */
+	cedrus_enc_h264_bits_bit(&raw, 0);
+
+	/* Syntax element: changing_slice_group_idc. */
+	cedrus_enc_h264_bits_append(&raw, 0, 2);
+
+	if (raw.count % 8) {
+		/* Syntax element: bit_equal_to_one. */
+		cedrus_enc_h264_bits_bit(&raw, 1);
+
+		/* Syntax element: bit_equal_to_zero. */
+		cedrus_enc_h264_bits_align(&raw);
+	}
+
+	/* Syntax element: rbsp_stop_one_bit. */
+	cedrus_enc_h264_bits_bit(&raw, 1);
+
+	cedrus_enc_h264_bits_align(&raw);
+
+	/* Headers are pushed without emulation prevention by the engine. */
+	cedrus_enc_h264_bits_escape(bits, &raw);
+}
+
+static void
+cedrus_enc_h264_job_configure_sei_hrd(struct cedrus_context *ctx,
+				      struct cedrus_enc_h264_bits *bits,
+				      unsigned int field_index)
+{
+	struct cedrus_enc_h264_job *job = ctx->engine_job;
+	unsigned int length = CEDRUS_ENC_H264_HRD_DELAY_LENGTH;
+	struct cedrus_enc_h264_bits raw;
+	u8 header;
+
+	cedrus_enc_h264_bits_reset(&raw);
+
+	/* Syntax element: Annex-B start code. */
+	cedrus_enc_h264_bits_u32(&raw, 0x1);
+
+	header = cedrus_enc_h264_nalu_header(CENDRUS_ENC_H264_NALU_TYPE_SEI, 0);
+
+	/* Syntax element: NALU header. */
+	cedrus_enc_h264_bits_u8(&raw, header);
+
+	/* The second field is part of the same buffering period. */
+	if (job->hrd_buffering_period && !field_index) {
+		/* Syntax element: last_payload_type_byte. */
+		cedrus_enc_h264_bits_u8(&raw,
+					CEDRUS_ENC_H264_SEI_TYPE_BUF_PERIOD);
+
+		/* The SPS identifier is followed by the two delays. */
+		/* Syntax element: last_payload_size_byte. */
+		cedrus_enc_h264_bits_u8(&raw, DIV_ROUND_UP(1 + 2 * length, 8));
+
+		/* Syntax element: seq_parameter_set_id. */
+		cedrus_enc_h264_bits_ue(&raw, job->seq_parameter_set_id);
+
+		/* Syntax element: initial_cpb_removal_delay. */
+		cedrus_enc_h264_bits_append(&raw, job->hrd_initial_delay,
+					    length);
+
+		/* Syntax element: initial_cpb_removal_delay_offset. */
+		cedrus_enc_h264_bits_append(&raw, 0, length);
+
+		/* Syntax element: bit_equal_to_one. */
+		cedrus_enc_h264_bits_bit(&raw, 1);
+
+		/* Syntax element: bit_equal_to_zero. */
+		cedrus_enc_h264_bits_align(&raw);
+	}
+
+	/* Syntax element: last_payload_type_byte. */
+	cedrus_enc_h264_bits_u8(&raw, CEDRUS_ENC_H264_SEI_TYPE_PIC_TIMING);
+
+	/* Syntax element: last_payload_size_byte. */
+	cedrus_enc_h264_bits_u8(&raw, 2 * length / 8);
+
+	/* The second field is removed one tick after the first one. */
+	/* Syntax element: cpb_removal_delay. */
+	cedrus_enc_h264_bits_append(&raw, job->hrd_removal_delay + field_index,
+				    length);
+
+	/* Syntax element: dpb_output_delay. */
+	cedrus_enc_h264_bits_append(&raw, job->hrd_output_delay, length);
+
+	/* Syntax element: rbsp_stop_one_bit. */
+	cedrus_enc_h264_bits_bit(&raw, 1);
+
+	cedrus_enc_h264_bits_align(&raw);
+
+	/* Headers are pushed without emulation prevention by the engine. */
+	cedrus_enc_h264_bits_escape(bits, &raw);
+}
+
+static void
+cedrus_enc_h264_job_configure_prefix(struct cedrus_context *cedrus_ctx,
+				     struct cedrus_enc_h264_bits *bits)
+{
+	struct cedrus_enc_h264_job *job = cedrus_ctx->engine_job;
+	u8 header;
+
+	/* Syntax element: Annex-B start code. */
+	cedrus_enc_h264_bits_u32(bits, 0x1);
+
+	header = cedrus_enc_h264_nalu_header(CENDRUS_ENC_H264_NALU_TYPE_PREFIX,
+					     job->nal_ref_idc);
+
+	/* Syntax element: NALU header. */
+	cedrus_enc_h264_bits_u8(bits, header);
+
+	/* Syntax element: svc_extension_flag. */
+	cedrus_enc_h264_bits_bit(bits, 1);
+
+	/* Syntax element: idr_flag. */
+	cedrus_enc_h264_bits_bit(bits, job->frame_type ==
+				 CEDRUS_ENC_H264_FRAME_TYPE_IDR);
+
+	/* Syntax element: priority_id. */
+	cedrus_enc_h264_bits_append(bits, 0, 6);
+
+	/* Syntax element: no_inter_layer_pred_flag. */
+	cedrus_enc_h264_bits_bit(bits, 1);
+
+	/* Syntax element: dependency_id. */
+	cedrus_enc_h264_bits_append(bits, 0, 3);
+
+	/* Syntax element: quality_id. */
+	cedrus_enc_h264_bits_append(bits, 0, 4);
+
+	/* Syntax element: temporal_id. */
+	cedrus_enc_h264_bits_append(bits, job->temporal_id, 3);
+
+	/* Syntax element: use_ref_base_pic_flag. */
+	cedrus_enc_h264_bits_bit(bits, 0);
+
+	/* Syntax element: discardable_flag. */
+	cedrus_enc_h264_bits_bit(bits, 0);
+
+	/* Syntax element: output_flag. */
+	cedrus_enc_h264_bits_bit(bits, 1);
+
+	/* Syntax element: reserved_three_2bits. */
+	cedrus_enc_h264_bits_append(bits, 3, 2);
+
+	/* The payload is empty for non-reference frames. */
+	if (!job->nal_ref_idc)
+		return;
+
+	/* Syntax element: store_ref_base_pic_flag. */
+	cedrus_enc_h264_bits_bit(bits, 0);
+
+	/* Syntax element: additional_prefix_nal_unit_extension_flag. */
+	cedrus_enc_h264_bits_bit(bits, 0);
+
+	/* Syntax element: rbsp_stop_one_bit. */
+	cedrus_enc_h264_bits_bit(bits, 1);
+
+	cedrus_enc_h264_bits_align(bits);
+}
+
+static void
+cedrus_enc_h264_job_configure_slice_header(struct cedrus_context *cedrus_ctx,
+					   struct cedrus_enc_h264_bits *bits,
+					   unsigned int field_index,
+					   unsigned int slice_index)
+{
+	struct cedrus_enc_h264_job *job = cedrus_ctx->engine_job;
+	struct cedrus_enc_h264_context *h264_ctx = cedrus_ctx->engine_ctx;
+	struct cedrus_enc_h264_state *state = &h264_ctx->state;
+	unsigned int pic_order_cnt_lsb;
+	bool idr;
+	u8 slice_type;
+	u8 nalu_type;
+	u8 header;
+
+	/*
+	 * The second field of an IDR frame is an intra field that must not
+	 * drop the first one from the references.
+	 */
+	idr = job->frame_type == CEDRUS_ENC_H264_FRAME_TYPE_IDR && !field_index;
+
+	/* Signal the temporal layer of the slice in a SVC prefix NALU. */
+	if (state->temporal_layers > 1)
+		cedrus_enc_h264_job_configure_prefix(cedrus_ctx, bits);
+
+	h264_ctx->header_slice_start = bits->count;
+
+	/* Syntax element: Annex-B start code. */
+	cedrus_enc_h264_bits_u32(bits, 0x1);
+
+	if (idr)
+		nalu_type = CENDRUS_ENC_H264_NALU_TYPE_SLICE_IDR;
+	else
+		nalu_type = CENDRUS_ENC_H264_NALU_TYPE_SLICE_NON_IDR;
+
+	header = cedrus_enc_h264_nalu_header(nalu_type, job->nal_ref_idc);
+
+	/* Syntax element: NALU header. */
+	cedrus_enc_h264_bits_u8(bits, header);
+
+	/* Syntax element: first_mb_in_slice. */
+	cedrus_enc_h264_bits_ue(bits, slice_index * job->slice_mb_rows *
+				h264_ctx->width_mbs);
+
+	/* Syntax element: slice_type. */
+	switch (job->frame_type) {
+	case CEDRUS_ENC_H264_FRAME_TYPE_IDR:
+	case CEDRUS_ENC_H264_FRAME_TYPE_I:
+		slice_type = CEDRUS_ENC_H264_SLICE_TYPE_I;
+		break;
+	case CEDRUS_ENC_H264_FRAME_TYPE_P:
+		slice_type = CEDRUS_ENC_H264_SLICE_TYPE_P;
+		break;
+	case CEDRUS_ENC_H264_FRAME_TYPE_B:
+	default:
+		slice_type = CEDRUS_ENC_H264_SLICE_TYPE_B;
+		break;
+	}
+
+	cedrus_enc_h264_bits_ue(bits, slice_type);
+
+	/* Syntax element: pic_parameter_set_id. */
+	cedrus_enc_h264_bits_ue(bits, job->pic_parameter_set_id);
+
+	/* Syntax element: frame_num. */
+	cedrus_enc_h264_bits_append(bits, job->frame_num,
+				    h264_ctx->log2_max_frame_num);
+
+	if (state->interlaced) {
+		/* Syntax element: field_pic_flag. */
+		cedrus_enc_h264_bits_bit(bits, 1);
+
+		/* Syntax element: bottom_field_flag. */
+		cedrus_enc_h264_bits_bit(bits, (field_index +
+					 job->field_bottom_first) % 2);
+	}
+
+	if (idr) {
+		/* Syntax element: idr_pic_id. */
+		cedrus_enc_h264_bits_ue(bits, job->idr_pic_id);
+	}
+
+	/* The second field follows the first one in display order. */
+	pic_order_cnt_lsb = (job->pic_order_cnt_lsb + field_index) %
+			    BIT(h264_ctx->log2_max_pic_order_cnt_lsb);
+
+	if (h264_ctx->pic_order_cnt_type == 0) {
+		/* Syntax element: pic_order_cnt_lsb. */
+		cedrus_enc_h264_bits_append(bits, pic_order_cnt_lsb,
+					    h264_ctx->log2_max_pic_order_cnt_lsb);
+	}
+
+	if (slice_type == CEDRUS_ENC_H264_SLICE_TYPE_B) {
+		/* Syntax element: direct_spatial_mv_pred_flag. */
+		cedrus_enc_h264_bits_bit(bits, 1);
+	}
+
+	if (slice_type != CEDRUS_ENC_H264_SLICE_TYPE_I) {
+		/* Syntax element: num_ref_idx_active_override_flag. */
+		cedrus_enc_h264_bits_bit(bits, 0);
+
+		/* Syntax element: ref_pic_list_modification_flag_l0. */
+		cedrus_enc_h264_bits_bit(bits, job->ref_ltr || job->ref_base);
+
+		if (job->ref_base) {
+			/* Syntax element: modification_of_pic_nums_idc. */
+			cedrus_enc_h264_bits_ue(bits, 0);
+
+			/* Syntax element: abs_diff_pic_num_minus1. */
+			cedrus_enc_h264_bits_ue(bits, (job->frame_num -
+						job->ref_base_frame_num - 1) %
+						BIT(h264_ctx->log2_max_frame_num));
+
+			/* Syntax element: modification_of_pic_nums_idc. */
+			cedrus_enc_h264_bits_ue(bits, 3);
+		} else if (job->ref_ltr) {
+			/* Syntax element: modification_of_pic_nums_idc. */
+			cedrus_enc_h264_bits_ue(bits, 2);
+
+			/* Syntax element: long_term_pic_num. */
+			cedrus_enc_h264_bits_ue(bits, job->ref_ltr_index);
+
+			/* Syntax element: modification_of_pic_nums_idc. */
+			cedrus_enc_h264_bits_ue(bits, 3);
+		}
+	}
+
+	if (slice_type == CEDRUS_ENC_H264_SLICE_TYPE_B) {
+		/* Syntax element: ref_pic_list_modification_flag_l1. */
+		cedrus_enc_h264_bits_bit(bits, 0);
+	}
+
+	if (job->nal_ref_idc) {
+		if (idr) {
+			/* Syntax element: no_output_of_prior_pics_flag. */
+			cedrus_enc_h264_bits_bit(bits, 0);
+
+			/* Syntax element: long_term_reference_flag. */
+			cedrus_enc_h264_bits_bit(bits, job->ltr_mark);
+		} else {
+			/* Syntax element: adaptive_ref_pic_marking_mode_flag. */
+			cedrus_enc_h264_bits_bit(bits, job->ltr_mark);
+		}
+
+		if (job->ltr_mark && !idr) {
+			/* Syntax element: memory_management_control_operation. */
+			cedrus_enc_h264_bits_ue(bits, 4);
+
+			/* Syntax element: max_long_term_frame_idx_plus1. */
+			cedrus_enc_h264_bits_ue(bits, state->ltr_count);
+
+			/* Syntax element: memory_management_control_operation. */
+			cedrus_enc_h264_bits_ue(bits, 6);
+
+			/* Syntax element: long_term_frame_idx. */
+			cedrus_enc_h264_bits_ue(bits, job->ltr_mark_index);
+
+			/* Syntax element: memory_management_control_operation. */
+			cedrus_enc_h264_bits_ue(bits, 0);
+		}
+	}
+
+	if (slice_type != CEDRUS_ENC_H264_SLICE_TYPE_I &&
+	    job->entropy_coding_mode_flag) {
+		/* Syntax element: cabac_init_idc. */
+		cedrus_enc_h264_bits_ue(bits, job->cabac_init_idc);
+	}
+
+	/* Syntax element: slice_qp_delta. */
+	cedrus_enc_h264_bits_se(bits, job->qp - state->qp_init);
+
+	/* Syntax element: disable_deblocking_filter_idc. */
+	cedrus_enc_h264_bits_ue(bits, job->disable_deblocking_filter_idc);
+
+	if (job->disable_deblocking_filter_idc != 1) {
+		/* Syntax element: slice_alpha_c0_offset_div2. */
+		cedrus_enc_h264_bits_se(bits, job->slice_alpha_c0_offset_div2);
+
+		/* Syntax element: slice_beta_offset_div2. */
+		cedrus_enc_h264_bits_se(bits, job->slice_beta_offset_div2);
+	}
+}
+
+static void cedrus_enc_h264_job_configure_sps_update(struct cedrus_context *ctx)
+{
+	struct cedrus_enc_h264_context *h264_ctx = ctx->engine_ctx;
+	struct cedrus_enc_h264_state *state = &h264_ctx->state;
+	struct cedrus_enc_h264_bits raw;
+
+	if (state->sps_valid)
+		return;
+
+	cedrus_enc_h264_bits_reset(&raw);
+	cedrus_enc_h264_job_configure_sps(ctx, &raw);
+
+	cedrus_enc_h264_bits_reset(&h264_ctx->sps_bits);
+	cedrus_enc_h264_bits_escape(&h264_ctx->sps_bits, &raw);
+	state->sps_valid = true;
+}
+
+static void cedrus_enc_h264_job_configure_pps_update(struct cedrus_context *ctx)
+{
+	struct cedrus_enc_h264_context *h264_ctx = ctx->engine_ctx;
+	struct cedrus_enc_h264_state *state = &h264_ctx->state;
+	struct cedrus_enc_h264_bits raw;
+
+	if (state->pps_valid)
+		return;
+
+	cedrus_enc_h264_bits_reset(&raw);
+	cedrus_enc_h264_job_configure_pps(ctx, &raw);
+
+	cedrus_enc_h264_bits_reset(&h264_ctx->pps_bits);
+	cedrus_enc_h264_bits_escape(&h264_ctx->pps_bits, &raw);
+	state->pps_valid = true;
+}
+
+static void cedrus_enc_h264_job_prepare_headers(struct cedrus_context *ctx,
+						unsigned int field_index,
+						unsigned int slice_index)
+{
+	struct cedrus_enc_h264_job *job = ctx->engine_job;
+	struct cedrus_enc_h264_context *h264_ctx = ctx->engine_ctx;
+	struct cedrus_enc_h264_state *state = &h264_ctx->state;
+	struct cedrus_enc_h264_bits *bits = &h264_ctx->header_bits;
+	bool active = true;
+
+	/* Serialize all the headers in memory, without the hardware. */
+	cedrus_enc_h264_bits_reset(bits);
+
+	h264_ctx->header_prefix_count = 0;
+	h264_ctx->header_flush_start = 0;
+
+	/* The delimiter starts the access unit, before parameter sets. */
+	if (h264_ctx->au_delimiter && !slice_index)
+		cedrus_enc_h264_job_configure_aud(ctx, bits);
+
+	while (active) {
+		switch (state->step) {
+		case CEDRUS_ENC_H264_STEP_START:
+			state->step = CEDRUS_ENC_H264_STEP_SPS;
+			break;
+		case CEDRUS_ENC_H264_STEP_SPS:
+			cedrus_enc_h264_job_configure_sps_update(ctx);
+
+			cedrus_enc_h264_bits_copy(bits, &h264_ctx->sps_bits);
+			state->step = CEDRUS_ENC_H264_STEP_PPS;
+			break;
+		case CEDRUS_ENC_H264_STEP_PPS:
+			cedrus_enc_h264_job_configure_pps_update(ctx);
+
+			cedrus_enc_h264_bits_copy(bits, &h264_ctx->pps_bits);
+			state->step = CEDRUS_ENC_H264_STEP_SLICE;
+			break;
+		case CEDRUS_ENC_H264_STEP_SLICE:
+			/* Buffering periods come first in the access unit. */
+			if (job->hrd && !slice_index)
+				cedrus_enc_h264_job_configure_sei_hrd(ctx, bits,
+						field_index);
+
+			if (job->recovery_point && !field_index && !slice_index)
+				cedrus_enc_h264_job_configure_sei(ctx, bits);
+
+			/* Whole NAL units, that can be written with the CPU. */
+			h264_ctx->header_prefix_count = bits->count;
+
+			cedrus_enc_h264_job_configure_slice_header(ctx, bits,
+								   field_index,
+								   slice_index);
+			active = false;
+			break;
+		}
+	}
+}
+
+static void cedrus_enc_h264_job_configure_headers(struct cedrus_context *ctx)
+{
+	struct cedrus_device *dev = ctx->proc->dev;
+	struct cedrus_enc_h264_context *h264_ctx = ctx->engine_ctx;
+	struct cedrus_enc_h264_bits *bits = &h264_ctx->header_bits;
+
+	/* Disable emulation-prevention 0x3 byte. */
+	cedrus_enc_h264_coded_eptb(dev, 0);
+
+	cedrus_enc_h264_coded_flush(dev, bits, h264_ctx->header_flush_start);
+
+	/* Enable emulation-prevention 0x3 byte. */
+	cedrus_enc_h264_coded_eptb(dev, 1);
+
+	/* Wait for sync idle. */
+	cedrus_poll(dev, VE_RESET_REG,
+		    VE_RESET_CACHE_SYNC_IDLE |
+		    VE_RESET_SYNC_IDLE);
+}
+
+static unsigned int
+cedrus_enc_h264_job_configure_headers_direct(struct cedrus_context *ctx,
+					     unsigned int offset,
+					     unsigned int size)
+{
+	struct cedrus_enc_h264_context *h264_ctx = ctx->engine_ctx;
+	struct cedrus_enc_h264_bits *bits = &h264_ctx->header_bits;
+	unsigned int length = h264_ctx->header_prefix_count / 8;
+	unsigned int i;
+	u8 *data;
+
+	if (!length || WARN_ON_ONCE(h264_ctx->header_prefix_count % 8))
+		return 0;
+
+	/* Keep some room for the slice header and data. */
+	if (offset + length >= size)
+		return 0;
+
+	data = cedrus_buffer_coded_vaddr(cedrus_job_buffer_coded(ctx));
+	if (!data)
+		return 0;
+
+	/*
+	 * Writes to the write-combined mapping (or cleaned from the cache for
+	 * non-coherent buffers) are ordered before the engine is started by
+	 * the barrier of register writes.
+	 */
+	for (i = 0; i < length; i++)
+		data[offset + i] = cedrus_enc_h264_bits_byte(bits, i);
+
+	cedrus_buffer_coded_sync_device(cedrus_job_buffer_coded(ctx), offset,
+					length);
+
+	h264_ctx->header_flush_start = length * 8;
+
+	return length;
+}
+
+static void cedrus_enc_h264_job_configure_thumbnail(struct cedrus_context *cedrus_ctx,
+						    unsigned int mb_row)
+{
+	struct cedrus_device *dev = cedrus_ctx->proc->dev;
+	struct cedrus_enc_h264_job *job = cedrus_ctx->engine_job;
+	struct cedrus_enc_h264_context *h264_ctx = cedrus_ctx->engine_ctx;
+	unsigned int stride = job->thumbnail_stride;
+	dma_addr_t luma_addr, chroma_addr;
+	unsigned int size;
+	u32 value;
+
+	/*
+	 * The picture control and stride registers are kept across jobs of
+	 * the same context, so always clear the previous thumbnail setup.
+	 */
+	if (!job->thumbnail) {
+		value = cedrus_read(dev, VE_ISP_CTRL_REG);
+		value &= ~VE_ISP_CTRL_THUMB_EN;
+		cedrus_write(dev, VE_ISP_CTRL_REG, value);
+		return;
+	}
+
+	cedrus_job_buffer_coded_dma(cedrus_ctx, &luma_addr, &size);
+
+	luma_addr += job->thumbnail_offset;
+	chroma_addr = luma_addr + stride * h264_ctx->height_mbs * 16;
+
+	/* Chroma is vertically subsampled in the YUV420SP format. */
+	luma_addr += mb_row * 16 * stride;
+	chroma_addr += mb_row * 8 * stride;
+
+	cedrus_write(dev, VE_ISP_OUTPUT_LUMA_ADDR_REG, luma_addr);
+	cedrus_write(dev, VE_ISP_OUTPUT_CHROMA_ADDR_REG, chroma_addr);
+
+	value = cedrus_read(dev, VE_ISP_PIC_STRIDE0_REG);
+	value &= ~VE_ISP_PIC_STRIDE0_THUMB_STRIDE_MASK;
+	value |= VE_ISP_PIC_STRIDE0_THUMB_STRIDE_MBS(stride / 16);
+	cedrus_write(dev, VE_ISP_PIC_STRIDE0_REG, value);
+
+	value = cedrus_read(dev, VE_ISP_CTRL_REG);
+	value |= VE_ISP_CTRL_THUMB_EN;
+	cedrus_write(dev, VE_ISP_CTRL_REG, value);
+}
+
+/*
+ * The stream length only counts the bits written by the engine, from the bit
+ * offset it was programmed with, where the stream ends in the coded buffer.
+ */
+static unsigned int cedrus_enc_h264_stream_bits(struct cedrus_device *dev)
+{
+	return cedrus_read(dev, VE_ENC_AVC_STM_BIT_OFFSET_REG) +
+	       cedrus_read(dev, VE_ENC_AVC_STM_BIT_LEN_REG);
+}
 
-		/* Syntax element: aspect_ratio_info_present_flag. */
-		cedrus_enc_h264_coded_bit(dev, 1);
+static int cedrus_enc_h264_job_nalu_add(struct cedrus_enc_h264_job *job,
+					unsigned int offset)
+{
+	if (WARN_ON_ONCE(job->nalu_count == CEDRUS_ENC_H264_NALU_MAX))
+		return -ENOSPC;
 
-		/* Syntax element: aspect_ratio_idc. */
-		cedrus_enc_h264_coded_u8(dev, vui_sar_idc);
+	job->nalu_offsets[job->nalu_count++] = offset;
 
-		if (h264_ctx->vui_sar_idc ==
-		    V4L2_MPEG_VIDEO_H264_VUI_SAR_IDC_EXTENDED) {
-			/* Syntax element: sar_width. */
-			cedrus_enc_h264_coded_u16(dev,
-						  h264_ctx->vui_ext_sar_width);
+	return 0;
+}
 
-			/* Syntax element: sar_height. */
-			cedrus_enc_h264_coded_u16(dev,
-						  h264_ctx->vui_ext_sar_height);
-		}
-	} else {
-		/* Syntax element: aspect_ratio_info_present_flag. */
-		cedrus_enc_h264_coded_bit(dev, 0);
-	}
+static int cedrus_enc_h264_job_configure_avcc(struct cedrus_context *ctx)
+{
+	struct cedrus_device *dev = ctx->proc->dev;
+	struct cedrus_enc_h264_job *job = ctx->engine_job;
+	struct cedrus_enc_h264_context *h264_ctx = ctx->engine_ctx;
+	struct cedrus_enc_h264_bits *bits = &h264_ctx->header_bits;
+	unsigned int length = h264_ctx->header_prefix_count / 8;
+	unsigned int start;
+	unsigned int i;
+	int ret;
 
-	/* Syntax element: overscan_info_present_flag. */
-	cedrus_enc_h264_coded_bit(dev, 0);
+	job->nalu_count = 0;
 
-	/* Syntax element: video_signal_type_present_flag. */
-	cedrus_enc_h264_coded_bit(dev, 0);
+	if (!h264_ctx->avcc)
+		return 0;
 
-	/* Syntax element: chroma_loc_info_present_flag. */
-	cedrus_enc_h264_coded_bit(dev, 0);
+	/* The start codes are replaced with the CPU after each slice. */
+	if (!cedrus_buffer_coded_vaddr(cedrus_job_buffer_coded(ctx)))
+		return -EINVAL;
 
-	/* Syntax element: timing_info_present_flag. */
-	cedrus_enc_h264_coded_bit(dev, 1);
+	/* The next slices follow the previous one in the coded buffer. */
+	if (job->slice_index || job->field_index)
+		start = cedrus_enc_h264_stream_bits(dev) / 8;
+	else
+		start = job->offset + job->headroom;
 
-	/* Syntax element: num_units_in_tick. */
-	cedrus_enc_h264_coded_u32(dev, timeperframe->denominator);
+	/*
+	 * Whole NAL units are escaped, so that start codes are the only runs
+	 * of three zero bytes in there.
+	 */
+	for (i = 0; i + 4 <= length; i++) {
+		if (cedrus_enc_h264_bits_byte(bits, i) ||
+		    cedrus_enc_h264_bits_byte(bits, i + 1) ||
+		    cedrus_enc_h264_bits_byte(bits, i + 2) ||
+		    cedrus_enc_h264_bits_byte(bits, i + 3) != 0x1)
+			continue;
+
+		ret = cedrus_enc_h264_job_nalu_add(job, start + i);
+		if (ret)
+			return ret;
+
+		i += 3;
+	}
 
-	/* A frame requires two ticks in H.264. */
-	/* Syntax element: time_scale. */
-	cedrus_enc_h264_coded_u32(dev, timeperframe->numerator * 2);
+	/* The SVC prefix NALU and slice header are not escaped yet. */
+	if (h264_ctx->header_slice_start > h264_ctx->header_prefix_count) {
+		ret = cedrus_enc_h264_job_nalu_add(job, start + length);
+		if (ret)
+			return ret;
+	}
 
-	/* Syntax element: fixed_frame_rate_flag. */
-	cedrus_enc_h264_coded_bit(dev, 1);
+	return cedrus_enc_h264_job_nalu_add(job, start +
+					    h264_ctx->header_slice_start / 8);
+}
 
-	/* Syntax element: nal_hrd_parameters_present_flag. */
-	cedrus_enc_h264_coded_bit(dev, 0);
+static void cedrus_enc_h264_job_avcc(struct cedrus_context *ctx,
+				     unsigned int end)
+{
+	struct cedrus_enc_h264_job *job = ctx->engine_job;
+	struct cedrus_buffer *cedrus_buffer = cedrus_job_buffer_coded(ctx);
+	unsigned int start, next;
+	unsigned int i;
+	u8 *data;
 
-	/* Syntax element: vcl_hrd_parameters_present_flag. */
-	cedrus_enc_h264_coded_bit(dev, 0);
+	if (!job->nalu_count)
+		return;
 
-	/* Syntax element: pic_struct_present_flag. */
-	cedrus_enc_h264_coded_bit(dev, 0);
+	data = cedrus_buffer_coded_vaddr(cedrus_buffer);
 
-	/* Syntax element: bitstream_restriction_flag. */
-	cedrus_enc_h264_coded_bit(dev, 0);
+	/* Lengths have the same size as the start codes they replace. */
+	for (i = 0; i < job->nalu_count; i++) {
+		start = job->nalu_offsets[i];
 
-	/* Syntax element: rbsp_stop_one_bit. */
-	cedrus_enc_h264_coded_bit(dev, 1);
+		if (i + 1 < job->nalu_count)
+			next = job->nalu_offsets[i + 1];
+		else
+			next = end;
 
-	cedrus_enc_h264_coded_align(dev);
+		cedrus_buffer_coded_sync_cpu(cedrus_buffer, start, 4);
+		put_unaligned_be32(next - start - 4, data + start);
+		cedrus_buffer_coded_sync_device(cedrus_buffer, start, 4);
+	}
 }
 
-static void cedrus_enc_h264_job_configure_pps(struct cedrus_context *cedrus_ctx)
+static int cedrus_enc_h264_job_configure_slice(struct cedrus_context *cedrus_ctx)
 {
 	struct cedrus_device *dev = cedrus_ctx->proc->dev;
 	struct cedrus_enc_h264_job *job = cedrus_ctx->engine_job;
 	struct cedrus_enc_h264_context *h264_ctx = cedrus_ctx->engine_ctx;
-	struct cedrus_enc_h264_state *state = &h264_ctx->state;
-	u8 header;
+	unsigned int mb_row, mb_rows, mb_row_end;
+	unsigned int luma_offset, chroma_offset;
+	unsigned int subpix_offset;
+	unsigned int rec_stride;
+	unsigned int roi_count = 0;
+	unsigned int mv_size;
+	dma_addr_t mv_addr = 0;
+	unsigned int i;
+	u32 value;
+	int ret;
 
-	/* Syntax element: Annex-B start code. */
-	cedrus_enc_h264_coded_u32(dev, 0x1);
+	mb_row = job->slice_index * job->slice_mb_rows;
+	mb_rows = min(job->slice_mb_rows, h264_ctx->height_mbs - mb_row);
+	mb_row_end = mb_row + mb_rows - 1;
 
-	header = cedrus_enc_h264_nalu_header(CENDRUS_ENC_H264_NALU_TYPE_PPS, 3);
+	/* Produce H.264 headers, serialized ahead of time. */
 
-	/* Syntax element: NALU header. */
-	cedrus_enc_h264_coded_u8(dev, header);
+	ret = cedrus_enc_h264_job_configure_avcc(cedrus_ctx);
+	if (ret)
+		return ret;
 
-	/* Syntax element: pic_parameter_set_id. */
-	cedrus_enc_h264_coded_ue(dev, job->pic_parameter_set_id);
+	cedrus_enc_h264_job_configure_headers(cedrus_ctx);
 
-	/* Syntax element: seq_parameter_set_id. */
-	cedrus_enc_h264_coded_ue(dev, job->seq_parameter_set_id);
+	/* Restrict the picture input to the slice rows. */
 
-	/* Syntax element: entropy_coding_mode_flag. */
-	cedrus_enc_h264_coded_bit(dev, job->entropy_coding_mode_flag);
+	ret = cedrus_enc_format_picture_rows_configure(cedrus_ctx, mb_row,
+						       mb_rows);
+	if (ret)
+		return ret;
 
-	/* Syntax element: bottom_field_pic_order_in_frame_present_flag. */
-	cedrus_enc_h264_coded_bit(dev, 0);
+	/* Write the thumbnail rows that match the slice rows. */
+	cedrus_enc_h264_job_configure_thumbnail(cedrus_ctx, mb_row);
 
-	/* Syntax element: num_slice_groups_minus1. */
-	cedrus_enc_h264_coded_ue(dev, 0);
+	/*
+	 * Write the motion vectors of the slice rows, if requested.
+	 * XXX: The record size and layout are taken from the vendor library.
+	 */
+	if (job->mv_info) {
+		cedrus_job_buffer_coded_dma(cedrus_ctx, &mv_addr, &mv_size);
 
-	/* Syntax element: num_ref_idx_l0_default_active_minus1. */
-	cedrus_enc_h264_coded_ue(dev, 0);
+		mv_addr += job->mv_info_offset + mb_row * h264_ctx->width_mbs *
+			   CEDRUS_H264_ENC_MV_INFO_MB_SIZE;
+	}
 
-	/* Syntax element: num_ref_idx_l1_default_active_minus1. */
-	cedrus_enc_h264_coded_ue(dev, 0);
+	cedrus_write_shadow(dev, VE_ENC_AVC_MV_BUF_ADDR_REG, mv_addr);
 
-	/* Syntax element: weighted_pred_flag. */
-	cedrus_enc_h264_coded_bit(dev, 0);
+	/*
+	 * The engine sees each slice as a picture of its own, so point the
+	 * reconstruction, reference and subpixel buffers at the slice rows.
+	 */
+	rec_stride = ALIGN(h264_ctx->width_mbs, 2) * 16;
+	luma_offset = mb_row * 16 * rec_stride;
+	chroma_offset = mb_row * 8 * rec_stride;
+	subpix_offset = mb_row * 2 * job->rec->subpix_stride;
 
-	/* Syntax element: weighted_bipred_idc. */
-	cedrus_enc_h264_coded_append(dev, 0, 2);
+	/* Configure reconstruction buffer. */
 
-	/* Syntax element: pic_init_qp_minus26. */
-	cedrus_enc_h264_coded_se(dev, state->qp_init - 26);
+	cedrus_write(dev, VE_ENC_AVC_REC_ADDR_Y_REG,
+		     job->rec->rec_dma + luma_offset);
+	cedrus_write(dev, VE_ENC_AVC_REC_ADDR_C_REG,
+		     job->rec->rec_dma + job->rec->rec_luma_size +
+		     chroma_offset);
 
-	/* Syntax element: pic_init_qs_minus26. */
-	cedrus_enc_h264_coded_se(dev, state->qp_init - 26);
+	cedrus_write(dev, VE_ENC_AVC_REF0_ADDR_Y_REG,
+		     job->ref->rec_dma + luma_offset);
+	cedrus_write(dev, VE_ENC_AVC_REF0_ADDR_C_REG,
+		     job->ref->rec_dma + job->ref->rec_luma_size +
+		     chroma_offset);
 
-	/* Syntax element: chroma_qp_index_offset. */
-	cedrus_enc_h264_coded_se(dev, job->chroma_qp_index_offset);
+	cedrus_write(dev, VE_ENC_AVC_REF1_ADDR_Y_REG,
+		     job->ref1->rec_dma + luma_offset);
+	cedrus_write(dev, VE_ENC_AVC_REF1_ADDR_C_REG,
+		     job->ref1->rec_dma + job->ref1->rec_luma_size +
+		     chroma_offset);
 
-	/* Syntax element: deblocking_filter_control_present_flag. */
-	cedrus_enc_h264_coded_bit(dev, 1);
+	/* Configure subpixel buffers. */
 
-	/* Syntax element: constrained_intra_pred_flag. */
-	cedrus_enc_h264_coded_bit(dev, 0);
+	cedrus_write(dev, VE_ENC_AVC_SUBPIX_ADDR_NEW_REG,
+		     job->rec->subpix_dma + subpix_offset);
+	cedrus_write(dev, VE_ENC_AVC_SUBPIX_ADDR_LAST_REG,
+		     job->last->subpix_dma + subpix_offset);
 
-	/* Syntax element: redundant_pic_cnt_present_flag. */
-	cedrus_enc_h264_coded_bit(dev, 0);
+	/* Configure regions of interest, relative to the slice rows. */
 
-	/* Syntax element: rbsp_stop_one_bit. */
-	cedrus_enc_h264_coded_bit(dev, 1);
+	value = 0;
 
-	cedrus_enc_h264_coded_align(dev);
-}
+	for (i = 0; i < CEDRUS_H264_ENC_ROI_COUNT; i++) {
+		struct cedrus_enc_h264_roi *roi = &job->roi[i];
+		unsigned int top, bottom;
+		u32 area = 0;
 
-static void
-cedrus_enc_h264_job_configure_slice_header(struct cedrus_context *cedrus_ctx)
-{
-	struct cedrus_device *dev = cedrus_ctx->proc->dev;
-	struct cedrus_enc_h264_job *job = cedrus_ctx->engine_job;
-	struct cedrus_enc_h264_context *h264_ctx = cedrus_ctx->engine_ctx;
-	struct cedrus_enc_h264_state *state = &h264_ctx->state;
-	u8 slice_type;
-	u8 nalu_type;
-	u8 header;
+		if (i < job->roi_count && roi->top_mb <= mb_row_end &&
+		    roi->bottom_mb >= mb_row) {
+			top = max(roi->top_mb, mb_row) - mb_row;
+			bottom = min(roi->bottom_mb, mb_row_end) - mb_row;
 
-	/* Syntax element: Annex-B start code. */
-	cedrus_enc_h264_coded_u32(dev, 0x1);
+			area = VE_ENC_AVC_ROI_AREA_TOP_MB(top) |
+			       VE_ENC_AVC_ROI_AREA_LEFT_MB(roi->left_mb) |
+			       VE_ENC_AVC_ROI_AREA_BOTTOM_MB(bottom) |
+			       VE_ENC_AVC_ROI_AREA_RIGHT_MB(roi->right_mb);
+			value |= VE_ENC_AVC_ROI_QP_OFFSET(i, roi->qp_delta);
+			roi_count++;
+		}
 
-	if (job->frame_type == CEDRUS_ENC_H264_FRAME_TYPE_IDR)
-		nalu_type = CENDRUS_ENC_H264_NALU_TYPE_SLICE_IDR;
-	else
-		nalu_type = CENDRUS_ENC_H264_NALU_TYPE_SLICE_NON_IDR;
+		cedrus_write(dev, VE_ENC_AVC_ROI_AREA_REG(i), area);
+	}
 
-	header = cedrus_enc_h264_nalu_header(nalu_type, job->nal_ref_idc);
+	cedrus_write(dev, VE_ENC_AVC_ROI_QP_OFFSET_REG, value);
 
-	/* Syntax element: NALU header. */
-	cedrus_enc_h264_coded_u8(dev, header);
+	/* Configure temporal filter count buffer, relative to the slice rows. */
 
-	/* Syntax element: first_mb_in_slice. */
-	cedrus_enc_h264_coded_ue(dev, 0);
+	cedrus_write(dev, VE_ENC_AVC_TFCNT_ADDR_REG,
+		     h264_ctx->tfcnt_dma + mb_row * h264_ctx->width_mbs *
+		     CEDRUS_ENC_H264_TFCNT_MB_SIZE);
 
-	/* Syntax element: slice_type. */
-	if (job->frame_type == CEDRUS_ENC_H264_FRAME_TYPE_IDR ||
-	    job->frame_type == CEDRUS_ENC_H264_FRAME_TYPE_I)
-		slice_type = CEDRUS_ENC_H264_SLICE_TYPE_I;
-	else
-		slice_type = CEDRUS_ENC_H264_SLICE_TYPE_P;
+	/* Configure motion estimation parameters. */
 
-	cedrus_enc_h264_coded_ue(dev, slice_type);
+	value = VE_ENC_AVC_ME_PARA_DEBLK_TO_DRAM |
+		cedrus_enc_h264_me_para(cedrus_ctx);
 
-	/* Syntax element: pic_parameter_set_id. */
-	cedrus_enc_h264_coded_ue(dev, job->pic_parameter_set_id);
+	if (!job->mv_info)
+		value |= VE_ENC_AVC_ME_PARA_WB_MV_INFO_DIS;
 
-	/* Syntax element: frame_num. */
-	cedrus_enc_h264_coded_append(dev, job->frame_num,
-				    h264_ctx->log2_max_frame_num);
+	if (roi_count)
+		value |= VE_ENC_AVC_ME_PARA_ROI_EN;
 
-	if (job->frame_type == CEDRUS_ENC_H264_FRAME_TYPE_IDR) {
-		/* Syntax element: idr_pic_id. */
-		cedrus_enc_h264_coded_ue(dev, job->idr_pic_id);
+	/*
+	 * Bias the static background towards skipped macroblocks, with small
+	 * residuals quantized away.
+	 * XXX: The coarse cost control is not documented and its highest value
+	 * is assumed to favour skipping the most.
+	 */
+	if (job->background_qp_delta) {
+		value &= ~(VE_ENC_AVC_ME_PARA_QUANT_THRESHOLD_DIS |
+			   VE_ENC_AVC_ME_PARA_SKIP_MB_DIS |
+			   VE_ENC_AVC_ME_PARA_COARSE_COST_CTRL(3));
+		value |= VE_ENC_AVC_ME_PARA_COARSE_COST_CTRL(3);
 	}
 
-	if (h264_ctx->pic_order_cnt_type == 0) {
-		/* Syntax element: pic_order_cnt_lsb. */
-		cedrus_enc_h264_coded_append(dev, job->pic_order_cnt_lsb,
-					    h264_ctx->log2_max_pic_order_cnt_lsb);
-	}
+	/*
+	 * The engine does not constrain intra prediction to intra neighbours,
+	 * so keep intra macroblocks out of inter slices altogether.
+	 * XXX: The bit is assumed to only restrict the macroblock decision.
+	 */
+	if (job->constrained_intra_pred_flag &&
+	    job->frame_type != CEDRUS_ENC_H264_FRAME_TYPE_IDR &&
+	    job->frame_type != CEDRUS_ENC_H264_FRAME_TYPE_I)
+		value |= VE_ENC_AVC_ME_PARA_INTRA_PRED_DIS;
 
-	if (slice_type == CEDRUS_ENC_H264_SLICE_TYPE_P) {
-		/* Syntax element: num_ref_idx_active_override_flag. */
-		cedrus_enc_h264_coded_bit(dev, 0);
+	cedrus_write_shadow(dev, VE_ENC_AVC_ME_PARA_REG, value);
 
-		/* Syntax element: ref_pic_list_modification_flag_l0. */
-		cedrus_enc_h264_coded_bit(dev, 0);
-	}
+	return 0;
+}
 
-	/* XXX: only for pictures marked as reference. */
-	if (job->frame_type == CEDRUS_ENC_H264_FRAME_TYPE_IDR) {
-		/* Syntax element: no_output_of_prior_pics_flag. */
-		cedrus_enc_h264_coded_bit(dev, 0);
+static u32 cedrus_enc_h264_job_pic_type(struct cedrus_enc_h264_job *job)
+{
+	/* Fields reference the previous field of the same parity. */
+	if (job->field_count < 2)
+		return VE_ENC_AVC_PARA0_REF_PIC_TYPE_FRAME |
+		       VE_ENC_AVC_PARA0_PIC_TYPE_FRAME;
 
-		/* Syntax element: long_term_reference_flag. */
-		cedrus_enc_h264_coded_bit(dev, 0);
-	} else {
-		/* Syntax element: adaptive_ref_pic_marking_mode_flag. */
-		cedrus_enc_h264_coded_bit(dev, 0);
-	}
+	if ((job->field_index + job->field_bottom_first) % 2)
+		return VE_ENC_AVC_PARA0_REF_PIC_TYPE_FIELD_BOT |
+		       VE_ENC_AVC_PARA0_PIC_TYPE_FIELD_BOT;
 
-	if (slice_type != CEDRUS_ENC_H264_SLICE_TYPE_I &&
-	    job->entropy_coding_mode_flag) {
-		/* Syntax element: cabac_init_idc. */
-		cedrus_enc_h264_coded_ue(dev, job->cabac_init_idc);
-	}
+	return VE_ENC_AVC_PARA0_REF_PIC_TYPE_FIELD_TOP |
+	       VE_ENC_AVC_PARA0_PIC_TYPE_FIELD_TOP;
+}
 
-	/* Syntax element: slice_qp_delta. */
-	cedrus_enc_h264_coded_se(dev, job->qp - state->qp_init);
+static int
+cedrus_enc_h264_job_configure_field(struct cedrus_context *cedrus_ctx)
+{
+	struct cedrus_enc_h264_job *job = cedrus_ctx->engine_job;
+	struct cedrus_enc_h264_context *h264_ctx = cedrus_ctx->engine_ctx;
+	unsigned int parity = (job->field_index + job->field_bottom_first) % 2;
+	struct cedrus_enc_h264_picture *picture;
 
-	/* Syntax element: disable_deblocking_filter_idc. */
-	cedrus_enc_h264_coded_ue(dev, job->disable_deblocking_filter_idc);
+	/* The field is fetched from its picture rows only. */
+	cedrus_ctx->job.picture_field = parity ? V4L2_FIELD_BOTTOM :
+						 V4L2_FIELD_TOP;
 
-	if (job->disable_deblocking_filter_idc != 1) {
-		/* Syntax element: slice_alpha_c0_offset_div2. */
-		cedrus_enc_h264_coded_se(dev, job->slice_alpha_c0_offset_div2);
+	/* Select reconstruction and reference pictures from the DPB. */
 
-		/* Syntax element: slice_beta_offset_div2. */
-		cedrus_enc_h264_coded_se(dev, job->slice_beta_offset_div2);
+	picture = cedrus_enc_h264_picture_free(h264_ctx);
+	if (WARN_ON(!picture))
+		return -EBUSY;
+
+	job->rec = cedrus_enc_h264_picture_get(picture);
+	job->rec->rec_sequence = ++h264_ctx->dpb_sequence;
+
+	/* The previous reconstruction is about to be overwritten. */
+	if (job->rec->rec_dmabuf) {
+		spin_lock(&h264_ctx->dpb_export_lock);
+		job->rec->rec_valid = false;
+		spin_unlock(&h264_ctx->dpb_export_lock);
 	}
-}
 
-static void cedrus_enc_h264_job_configure_headers(struct cedrus_context *ctx)
-{
-	struct cedrus_device *dev = ctx->proc->dev;
-	struct cedrus_enc_h264_context *h264_ctx = ctx->engine_ctx;
-	struct cedrus_enc_h264_state *state = &h264_ctx->state;
-	bool active = true;
+	/*
+	 * The previous field of the same parity comes first in the default
+	 * reference list, for both fields of the frame.
+	 */
+	if (job->frame_type == CEDRUS_ENC_H264_FRAME_TYPE_P)
+		picture = h264_ctx->dpb_field[parity];
+	else
+		picture = job->rec;
 
-	/* Disable emulation-prevention 0x3 byte. */
-	cedrus_enc_h264_coded_eptb(dev, 0);
+	job->ref = cedrus_enc_h264_picture_get(picture);
+	job->ref1 = cedrus_enc_h264_picture_get(picture);
+	job->last = cedrus_enc_h264_picture_get(picture);
 
-	while (active) {
-		switch (state->step) {
-		case CEDRUS_ENC_H264_STEP_START:
-			state->step = CEDRUS_ENC_H264_STEP_SPS;
-			break;
-		case CEDRUS_ENC_H264_STEP_SPS:
-			cedrus_enc_h264_job_configure_sps(ctx);
-			state->step = CEDRUS_ENC_H264_STEP_PPS;
-			break;
-		case CEDRUS_ENC_H264_STEP_PPS:
-			cedrus_enc_h264_job_configure_pps(ctx);
-			state->step = CEDRUS_ENC_H264_STEP_SLICE;
-			break;
-		case CEDRUS_ENC_H264_STEP_SLICE:
-			cedrus_enc_h264_job_configure_slice_header(ctx);
-			active = false;
-			break;
-		}
+	/* Keep the new reconstruction as reference for the next frame. */
+	if (job->nal_ref_idc && !h264_ctx->state.intra_only) {
+		cedrus_enc_h264_picture_put(h264_ctx->dpb_field[parity]);
+		h264_ctx->dpb_field[parity] =
+			cedrus_enc_h264_picture_get(job->rec);
 	}
 
-	/* Enable emulation-prevention 0x3 byte. */
-	cedrus_enc_h264_coded_eptb(dev, 1);
-
-	/* Wait for sync idle. */
-	cedrus_poll(dev, VE_RESET_REG,
-		    VE_RESET_CACHE_SYNC_IDLE |
-		    VE_RESET_SYNC_IDLE);
+	return 0;
 }
 
-static int cedrus_enc_h264_job_configure(struct cedrus_context *cedrus_ctx)
+static void
+cedrus_enc_h264_job_configure_stream(struct cedrus_context *cedrus_ctx)
 {
 	struct cedrus_device *dev = cedrus_ctx->proc->dev;
 	struct cedrus_enc_h264_job *job = cedrus_ctx->engine_job;
-	struct cedrus_enc_h264_context *h264_ctx = cedrus_ctx->engine_ctx;
-	struct cedrus_enc_h264_buffer *h264_buffer =
-		cedrus_job_engine_buffer(cedrus_ctx);
-	struct v4l2_pix_format *pix_format =
-		&cedrus_ctx->v4l2.format_picture.fmt.pix;
-	unsigned int stride_mbs_div_48;
-	unsigned int luma_size;
+	unsigned int offset;
 	unsigned int size;
 	dma_addr_t addr;
-	u32 value;
 
-	cedrus_write(dev, VE_ENC_AVC_STARTTRIG_REG, 0);
+	/*
+	 * Configure coded buffer, with the bitstream after the frames packed
+	 * so far and the headroom.
+	 */
 
-	/* Configure coded buffer. */
+	cedrus_job_buffer_coded_dma(cedrus_ctx, &addr, &size);
 
-	cedrus_write(dev, VE_ENC_AVC_STM_BIT_OFFSET_REG, 0);
+	/* Keep the bitstream away from the side-outputs. */
+	if (job->cost_map)
+		size = job->cost_map_offset;
+	else if (job->mv_info)
+		size = job->mv_info_offset;
+	else if (job->thumbnail)
+		size = job->thumbnail_offset;
 
-	cedrus_job_buffer_coded_dma(cedrus_ctx, &addr, &size);
+	/*
+	 * Write the whole NAL units ahead of the first slice header directly
+	 * when the coded buffer is mapped, which is much quicker than pushing
+	 * them word by word to the engine. The slice header is not aligned and
+	 * needs emulation prevention with the slice data, so it is always
+	 * pushed to the engine.
+	 */
+	offset = job->offset + job->headroom;
+	offset += cedrus_enc_h264_job_configure_headers_direct(cedrus_ctx,
+								offset, size);
+
+	cedrus_write(dev, VE_ENC_AVC_STM_BIT_OFFSET_REG, offset * 8);
 
 	cedrus_write(dev, VE_ENC_AVC_STM_START_ADDR_REG, addr);
 	cedrus_write(dev, VE_ENC_AVC_STM_END_ADDR_REG, addr + size - 1);
@@ -1129,61 +4893,206 @@ static int cedrus_enc_h264_job_configure(struct cedrus_context *cedrus_ctx)
 	cedrus_write(dev, VE_ENC_AVC_STM_BIT_LEN_REG, 0);
 	cedrus_write(dev, VE_ENC_AVC_HEADER_BITS_REG, 0);
 	cedrus_write(dev, VE_ENC_AVC_RESIDUAL_BITS_REG, 0);
+}
+
+static u32 cedrus_enc_h264_job_para1(struct cedrus_context *cedrus_ctx)
+{
+	struct cedrus_enc_h264_job *job = cedrus_ctx->engine_job;
+	struct v4l2_pix_format *pix_format =
+		&cedrus_ctx->v4l2.format_picture.fmt.pix;
+	const struct cedrus_enc_h264_preset *preset =
+		&cedrus_enc_h264_presets[job->preset];
+	const struct cedrus_enc_h264_level_limits *level_limits;
+	unsigned int stride_mbs_div_48;
+	unsigned int clip_mv_par;
+	unsigned int aq_par;
+	u32 value;
 
-	/* Produce H.264 headers. */
+	stride_mbs_div_48 = DIV_ROUND_UP(pix_format->bytesperline / 16, 48);
 
-	cedrus_enc_h264_job_configure_headers(cedrus_ctx);
+	value = VE_ENC_AVC_PARA1_QP_CHROMA_OFFSET0(job->chroma_qp_index_offset) |
+		VE_ENC_AVC_PARA1_STRIDE_MBS_DIV_48(stride_mbs_div_48) |
+		VE_ENC_AVC_PARA1_RC_MODE_FIXED |
+		VE_ENC_AVC_PARA1_FIXED_QP(job->qp);
 
-	/* Configure macroblock info buffer. */
+	if (preset->dynamic_me)
+		value |= VE_ENC_AVC_PARA1_DYNAMIC_ME_EN;
 
-	cedrus_write(dev, VE_ENC_AVC_MB_INFO_ADDR_REG, h264_ctx->mb_info_dma);
+	/*
+	 * Keep motion vectors within the vertical range of the level.
+	 * XXX: The parameter is assumed to select a range of 64 << par pixels,
+	 * so only levels below 3.1 need clipping.
+	 */
+	level_limits = cedrus_enc_h264_level_limits_find(job->level);
+	if (level_limits && level_limits->max_vmv_r < 512) {
+		clip_mv_par = ilog2(level_limits->max_vmv_r / 64);
+		value |= VE_ENC_AVC_PARA1_CLIP_MV_EN |
+			 VE_ENC_AVC_PARA1_CLIP_MV_PAR(clip_mv_par);
+	}
+
+	/* Only keep the filter history when the filter is used. */
+	if (!job->denoise)
+		value |= VE_ENC_AVC_PARA1_TEMP_FILTER_HIS_OUT_DIS;
 
-	/* Clear motion vector buffer. */
+	/* Strengths map to the mode optimization parameter, from 0. */
+	if (job->aq_strength) {
+		aq_par = job->aq_strength - 1;
+		value |= VE_ENC_AVC_PARA1_MODE_OPTIMIZE_EN |
+			 VE_ENC_AVC_PARA1_MODE_OPTIMIZE_PAR(aq_par);
+	}
 
-	cedrus_write(dev, VE_ENC_AVC_MV_BUF_ADDR_REG, 0);
+	return value;
+}
 
-	/* Configure reconstruction buffer. */
+static int
+cedrus_enc_h264_job_configure_frame(struct cedrus_context *cedrus_ctx)
+{
+	struct cedrus_enc_h264_job *job = cedrus_ctx->engine_job;
+	struct cedrus_enc_h264_context *h264_ctx = cedrus_ctx->engine_ctx;
+	struct cedrus_enc_h264_picture *picture;
+	unsigned int i;
 
-	cedrus_write(dev, VE_ENC_AVC_REC_ADDR_Y_REG, h264_buffer->rec_dma);
-	cedrus_write(dev, VE_ENC_AVC_REC_ADDR_C_REG, h264_buffer->rec_dma +
-		     h264_buffer->rec_luma_size);
+	/* Select reconstruction and reference pictures from the DPB. */
 
-	if (job->frame_type == CEDRUS_ENC_H264_FRAME_TYPE_P) {
-		addr = h264_ctx->rec_last_dma;
-		luma_size = h264_ctx->rec_last_luma_size;
-	} else {
-		/* XXX: is this really needed? */
-		addr = h264_buffer->rec_dma;
-		luma_size = h264_buffer->rec_luma_size;
-	}
+	picture = cedrus_enc_h264_picture_free(h264_ctx);
+	if (WARN_ON(!picture))
+		return -EBUSY;
 
-	cedrus_write(dev, VE_ENC_AVC_REF0_ADDR_Y_REG, addr);
-	cedrus_write(dev, VE_ENC_AVC_REF0_ADDR_C_REG, addr + luma_size);
+	job->rec = cedrus_enc_h264_picture_get(picture);
+	job->rec->rec_sequence = ++h264_ctx->dpb_sequence;
 
-	h264_ctx->rec_last_dma = h264_buffer->rec_dma;
-	h264_ctx->rec_last_luma_size = h264_buffer->rec_luma_size;
+	/* The previous reconstruction is about to be overwritten. */
+	if (job->rec->rec_dmabuf) {
+		spin_lock(&h264_ctx->dpb_export_lock);
+		job->rec->rec_valid = false;
+		spin_unlock(&h264_ctx->dpb_export_lock);
+	}
 
-	/* Configure subpixel buffers. */
+	if (job->frame_type == CEDRUS_ENC_H264_FRAME_TYPE_B)
+		picture = h264_ctx->dpb_prev;
+	else if (job->frame_type == CEDRUS_ENC_H264_FRAME_TYPE_P &&
+		 job->ref_ltr)
+		picture = h264_ctx->dpb_ltr[job->ref_ltr_index];
+	else if (job->frame_type == CEDRUS_ENC_H264_FRAME_TYPE_P &&
+		 job->ref_base && h264_ctx->dpb_base)
+		picture = h264_ctx->dpb_base;
+	else if (job->frame_type == CEDRUS_ENC_H264_FRAME_TYPE_P &&
+		 h264_ctx->dpb_last)
+		picture = h264_ctx->dpb_last;
+	else
+		/* XXX: is this really needed? */
+		picture = job->rec;
 
-	cedrus_write(dev, VE_ENC_AVC_SUBPIX_ADDR_NEW_REG,
-		     h264_buffer->subpix_dma);
+	job->ref = cedrus_enc_h264_picture_get(picture);
+
+	/* B frames also reference the P frame that follows them. */
+	if (job->frame_type == CEDRUS_ENC_H264_FRAME_TYPE_B)
+		picture = h264_ctx->dpb_last;
+	else
+		picture = job->ref;
 
-	if (!h264_ctx->subpix_last_dma)
-		h264_ctx->subpix_last_dma = h264_buffer->subpix_dma;
+	job->ref1 = cedrus_enc_h264_picture_get(picture);
 
 	/* XXX: is this for the last reference or the last encoded frame? */
-	cedrus_write(dev, VE_ENC_AVC_SUBPIX_ADDR_LAST_REG,
-		     h264_ctx->subpix_last_dma);
+	if (job->ref_ltr || job->ref_base)
+		picture = job->ref;
+	else if (h264_ctx->dpb_last)
+		picture = h264_ctx->dpb_last;
+	else
+		picture = job->rec;
+
+	job->last = cedrus_enc_h264_picture_get(picture);
 
-	h264_ctx->subpix_last_dma = h264_buffer->subpix_dma;
+	/* Keep the new reconstruction as reference for the next frames. */
+	if (job->nal_ref_idc && !h264_ctx->state.intra_only) {
+		cedrus_enc_h264_picture_put(h264_ctx->dpb_prev);
+		h264_ctx->dpb_prev = NULL;
+
+		/* Held B frames still need the previous reference. */
+		if (job->b_pending)
+			h264_ctx->dpb_prev = h264_ctx->dpb_last;
+		else
+			cedrus_enc_h264_picture_put(h264_ctx->dpb_last);
+
+		h264_ctx->dpb_last = cedrus_enc_h264_picture_get(job->rec);
+		h264_ctx->dpb_last_ltr_index = -1;
+
+		/* Keep the base layer reference apart from the middle layer. */
+		if (h264_ctx->state.temporal_layers > 2 && !job->temporal_id) {
+			cedrus_enc_h264_picture_put(h264_ctx->dpb_base);
+			h264_ctx->dpb_base =
+				cedrus_enc_h264_picture_get(job->rec);
+		}
+
+		/* IDR frames drop all the long-term references. */
+		if (job->frame_type == CEDRUS_ENC_H264_FRAME_TYPE_IDR)
+			cedrus_enc_h264_ltr_release(h264_ctx);
+
+		/* Marking replaces the previous picture with the same index. */
+		if (job->ltr_mark) {
+			i = job->ltr_mark_index;
+
+			cedrus_enc_h264_picture_put(h264_ctx->dpb_ltr[i]);
+			h264_ctx->dpb_ltr[i] =
+				cedrus_enc_h264_picture_get(job->rec);
+			h264_ctx->dpb_last_ltr_index = i;
+		}
+	}
+
+	return 0;
+}
+
+/* Program the whole job, which is done again when the frame starts over. */
+static int
+cedrus_enc_h264_job_configure_regs(struct cedrus_context *cedrus_ctx)
+{
+	struct cedrus_device *dev = cedrus_ctx->proc->dev;
+	struct cedrus_enc_h264_job *job = cedrus_ctx->engine_job;
+	const struct cedrus_enc_h264_preset *preset =
+		&cedrus_enc_h264_presets[job->preset];
+	const u32 *mad_th = cedrus_enc_h264_aq_mad_th[!!job->aq_strength];
+	const struct cedrus_reg_value regs_static[] = {
+		{ VE_ENC_AVC_PARA2_REG, 0 },
+		{ VE_ENC_AVC_DYNAMIC_ME_PAR0_REG,
+		  VE_ENC_AVC_DYNAMIC_ME_PAR0_TH0(preset->dynamic_me_th[0]) |
+		  VE_ENC_AVC_DYNAMIC_ME_PAR0_TH1(preset->dynamic_me_th[1]) },
+		{ VE_ENC_AVC_DYNAMIC_ME_PAR1_REG,
+		  VE_ENC_AVC_DYNAMIC_ME_PAR1_TH2(preset->dynamic_me_th[2]) |
+		  VE_ENC_AVC_DYNAMIC_ME_PAR1_TH3(preset->dynamic_me_th[3]) },
+		{ VE_ENC_AVC_RC_INIT_REG, 0 },
+		{ VE_ENC_AVC_RC_MAD_TH0_REG, mad_th[0] },
+		{ VE_ENC_AVC_RC_MAD_TH1_REG, mad_th[1] },
+		{ VE_ENC_AVC_RC_MAD_TH2_REG, mad_th[2] },
+		{ VE_ENC_AVC_RC_MAD_TH3_REG, mad_th[3] },
+	};
+	unsigned int pic_var;
+	dma_addr_t addr;
+	u32 value;
+
+	cedrus_write(dev, VE_ENC_AVC_STARTTRIG_REG, 0);
+
+	cedrus_enc_h264_job_configure_stream(cedrus_ctx);
+
+	/* Configure macroblock info buffer. */
+
+	addr = cedrus_pool_scratch_dma(dev, CEDRUS_SCRATCH_ENC_MB_INFO);
+	cedrus_write_shadow(dev, VE_ENC_AVC_MB_INFO_ADDR_REG, addr);
 
 	/* Configure deblocking filter buffer. */
 
-	cedrus_write(dev, VE_ENC_AVC_DEBLK_ADDR_REG, 0);
+	addr = cedrus_pool_scratch_dma(dev, CEDRUS_SCRATCH_ENC_DEBLK);
+	cedrus_write_shadow(dev, VE_ENC_AVC_DEBLK_ADDR_REG, addr);
 
 	/* Configure cyclic intra refresh. */
 
-	cedrus_write(dev, VE_ENC_AVC_CYCLIC_INTRA_REFRESH_REG, 0);
+	if (job->intra_refresh)
+		value = VE_ENC_AVC_CYCLIC_INTRA_REFRESH_EN |
+			VE_ENC_AVC_CYCLIC_INTRA_REFRESH_COL_START_MB(job->intra_refresh_start_mb) |
+			VE_ENC_AVC_CYCLIC_INTRA_REFRESH_COL_END_MB(job->intra_refresh_end_mb);
+	else
+		value = 0;
+
+	cedrus_write_shadow(dev, VE_ENC_AVC_CYCLIC_INTRA_REFRESH_REG, value);
 
 	/* Configure encode parameters. */
 
@@ -1195,8 +5104,19 @@ static int cedrus_enc_h264_job_configure(struct cedrus_context *cedrus_ctx)
 		VE_ENC_AVC_PARA0_BETA_OFFSET_DIV2(job->slice_beta_offset_div2) |
 		VE_ENC_AVC_PARA0_ALPHA_OFFSET_DIV2(job->slice_alpha_c0_offset_div2) |
 		VE_ENC_AVC_PARA0_FIX_MODE_NUM(job->cabac_init_idc) |
-		VE_ENC_AVC_PARA0_REF_PIC_TYPE_FRAME |
-		VE_ENC_AVC_PARA0_PIC_TYPE_FRAME;
+		cedrus_enc_h264_job_pic_type(job);
+
+	switch (job->disable_deblocking_filter_idc) {
+	case 0:
+		value |= VE_ENC_AVC_PARA0_DEBLOCK_IDC_EN;
+		break;
+	case 1:
+		value |= VE_ENC_AVC_PARA0_DEBLOCK_IDC_DIS;
+		break;
+	case 2:
+		value |= VE_ENC_AVC_PARA0_DEBLOCK_IDC_DIS_SLICE;
+		break;
+	}
 
 	if (job->entropy_coding_mode_flag)
 		value |= VE_ENC_AVC_PARA0_ENTROPY_CODING_CABAC;
@@ -1209,52 +5129,92 @@ static int cedrus_enc_h264_job_configure(struct cedrus_context *cedrus_ctx)
 		value |= VE_ENC_AVC_PARA0_SLICE_TYPE_I;
 		break;
 	case CEDRUS_ENC_H264_FRAME_TYPE_P:
-		value |= VE_ENC_AVC_PARA0_SLICE_TYPE_P;
+		if (job->skip)
+			value |= VE_ENC_AVC_PARA0_SLICE_TYPE_P_SKIPPED;
+		else
+			value |= VE_ENC_AVC_PARA0_SLICE_TYPE_P;
+		break;
+	case CEDRUS_ENC_H264_FRAME_TYPE_B:
+		value |= VE_ENC_AVC_PARA0_SLICE_TYPE_B;
 		break;
 	}
 
 	cedrus_write(dev, VE_ENC_AVC_PARA0_REG, value);
 
-	stride_mbs_div_48 = DIV_ROUND_UP(pix_format->bytesperline / 16, 48);
+	value = cedrus_enc_h264_job_para1(cedrus_ctx);
+	cedrus_write_shadow(dev, VE_ENC_AVC_PARA1_REG, value);
 
-	cedrus_write(dev, VE_ENC_AVC_PARA1_REG,
-		     VE_ENC_AVC_PARA1_QP_CHROMA_OFFSET0(job->chroma_qp_index_offset) |
-		     VE_ENC_AVC_PARA1_STRIDE_MBS_DIV_48(stride_mbs_div_48) |
-		     VE_ENC_AVC_PARA1_RC_MODE_FIXED |
-		     VE_ENC_AVC_PARA1_FIXED_QP(job->qp));
+	/* Configure temporal denoise filter. */
 
-	cedrus_write(dev, VE_ENC_AVC_PARA2_REG, 0);
+	/*
+	 * XXX: the picture variance is fixed to a value that should suit
+	 * typical sensor noise instead of being estimated by the hardware.
+	 */
+	value = 0;
 
-	/* Dynamic motion estimation is disabled. */
-	cedrus_write(dev, VE_ENC_AVC_DYNAMIC_ME_PAR0_REG, 0);
-	cedrus_write(dev, VE_ENC_AVC_DYNAMIC_ME_PAR1_REG, 0);
+	if (job->denoise) {
+		pic_var = CEDRUS_ENC_H264_DENOISE_PIC_VAR;
 
-	/* Configure rate-control parameters. */
+		value |= VE_ENC_AVC_TEMPORAL_FILTER_PAR_TEMPORAL_FILTER_EN |
+			 VE_ENC_AVC_TEMPORAL_FILTER_PAR_FIX_PIC_VAR_EN;
+		value |= VE_ENC_AVC_TEMPORAL_FILTER_PAR_PIC_VAR_TIMES_MAX_COEF(pic_var * job->denoise_max_coef);
+		value |= VE_ENC_AVC_TEMPORAL_FILTER_PAR_MAX_COEF(job->denoise_max_coef);
+		value |= VE_ENC_AVC_TEMPORAL_FILTER_PAR_PIC_VAR(pic_var);
+	}
 
-	cedrus_write(dev, VE_ENC_AVC_RC_INIT_REG, 0);
-	cedrus_write(dev, VE_ENC_AVC_RC_MAD_TH0_REG, 0);
-	cedrus_write(dev, VE_ENC_AVC_RC_MAD_TH1_REG, 0);
-	cedrus_write(dev, VE_ENC_AVC_RC_MAD_TH2_REG, 0);
-	cedrus_write(dev, VE_ENC_AVC_RC_MAD_TH3_REG, 0);
+	cedrus_write_shadow(dev, VE_ENC_AVC_TEMPORAL_FILTER_PAR_REG, value);
 
-	/* Configure motion estimation parameters. */
+	/*
+	 * Configure dynamic motion estimation thresholds and rate-control
+	 * parameters, which rarely change between jobs.
+	 */
 
-	cedrus_write(dev, VE_ENC_AVC_ME_PARA_REG,
-		     VE_ENC_AVC_ME_PARA_WB_MV_INFO_DIS |
-		     VE_ENC_AVC_ME_PARA_FME_SEARCH_LEVEL(2));
+	cedrus_write_batch(dev, regs_static, ARRAY_SIZE(regs_static));
 
 	/* Clear statistics. */
 
 	cedrus_write(dev, VE_ENC_AVC_MAD_REG, 0);
-	cedrus_write(dev, VE_ENC_AVC_OVERTIME_MB_REG, 0);
 	cedrus_write(dev, VE_ENC_AVC_ME_INFO_REG, 0);
 
-	return 0;
+	/* Configure macroblock overtime protection, disabled with 0. */
+
+	cedrus_write_shadow(dev, VE_ENC_AVC_OVERTIME_MB_REG, job->mb_cycles_max);
+
+	return cedrus_enc_h264_job_configure_slice(cedrus_ctx);
+}
+
+static int cedrus_enc_h264_job_configure(struct cedrus_context *cedrus_ctx)
+{
+	struct cedrus_enc_h264_job *job = cedrus_ctx->engine_job;
+	struct cedrus_enc_h264_context *h264_ctx = cedrus_ctx->engine_ctx;
+	int ret;
+
+	/*
+	 * Serialize the headers of the first slice before programming the
+	 * engine. The ones of the next slices are serialized while the engine
+	 * encodes the previous slice (see job_trigger). Keep the step they
+	 * started from, in case the frame has to start over.
+	 */
+	job->overflow_step = h264_ctx->state.step;
+
+	cedrus_enc_h264_job_prepare_headers(cedrus_ctx, 0, 0);
+
+	/* Fields keep references of their own. */
+	if (h264_ctx->state.interlaced)
+		ret = cedrus_enc_h264_job_configure_field(cedrus_ctx);
+	else
+		ret = cedrus_enc_h264_job_configure_frame(cedrus_ctx);
+
+	if (ret)
+		return ret;
+
+	return cedrus_enc_h264_job_configure_regs(cedrus_ctx);
 }
 
 static void cedrus_enc_h264_job_trigger(struct cedrus_context *ctx)
 {
 	struct cedrus_device *dev = ctx->proc->dev;
+	struct cedrus_enc_h264_job *job = ctx->engine_job;
 
 	/* Enable interrupt. */
 
@@ -1267,6 +5227,249 @@ static void cedrus_enc_h264_job_trigger(struct cedrus_context *ctx)
 	cedrus_write(dev, VE_ENC_AVC_STARTTRIG_REG,
 		     VE_ENC_AVC_STARTTRIG_ENCODE_MODE_H264 |
 		     VE_ENC_AVC_STARTTRIG_TYPE_ENC_START);
+
+	/*
+	 * The headers of this slice were already pushed, so serialize the
+	 * ones of the next slice (or field) while the engine is busy.
+	 */
+	if (job->slice_index + 1 < job->slice_count)
+		cedrus_enc_h264_job_prepare_headers(ctx, job->field_index,
+						    job->slice_index + 1);
+	else if (job->field_index + 1 < job->field_count)
+		cedrus_enc_h264_job_prepare_headers(ctx, job->field_index + 1,
+						    0);
+}
+
+static int cedrus_enc_h264_job_retry(struct cedrus_context *ctx)
+{
+	struct cedrus_enc_h264_job *job = ctx->engine_job;
+	struct cedrus_enc_h264_context *h264_ctx = ctx->engine_ctx;
+	int ret;
+
+	/*
+	 * The frame keeps the same reconstruction and reference pictures when
+	 * it starts over, so the references selected for the next frames stay
+	 * valid. The first field of interlaced frames already replaced its
+	 * reference once the second one is encoded, so only the first field
+	 * can start over.
+	 */
+	if (job->overflow_retries >= h264_ctx->overflow_retries ||
+	    job->field_index || job->qp >= h264_ctx->qp_max)
+		return -ENOSPC;
+
+	job->overflow_retries++;
+	job->qp = min_t(int, job->qp + h264_ctx->overflow_qp_delta,
+			h264_ctx->qp_max);
+	job->slice_index = 0;
+
+	/*
+	 * The engine is not expected to start over from a stall, so reset
+	 * it and program the whole job again instead.
+	 */
+	ret = cedrus_context_job_reset(ctx);
+	if (ret)
+		return ret;
+
+	/* Serialize the same headers again, with the new slice QP. */
+	h264_ctx->state.step = job->overflow_step;
+
+	cedrus_enc_h264_job_prepare_headers(ctx, 0, 0);
+
+	/*
+	 * XXX: The temporal filter counts were already updated by the failed
+	 * attempt, which is assumed to only slightly change the filtering.
+	 */
+	return cedrus_enc_h264_job_configure_regs(ctx);
+}
+
+static int cedrus_enc_h264_job_continue(struct cedrus_context *ctx)
+{
+	struct cedrus_device *dev = ctx->proc->dev;
+	struct cedrus_enc_h264_job *job = ctx->engine_job;
+	u32 value;
+	int ret;
+
+	/* Start over with a higher QP when the coded buffer is full. */
+	if (job->overflow_pending) {
+		job->overflow_pending = false;
+
+		return cedrus_enc_h264_job_retry(ctx);
+	}
+
+	cedrus_write(dev, VE_ENC_AVC_STARTTRIG_REG, 0);
+
+	/* The previous slice ends where the next one starts. */
+	value = cedrus_enc_h264_stream_bits(dev);
+	cedrus_enc_h264_job_avcc(ctx, value / 8);
+
+	/* Coded data of the next slice follows the previous one. */
+	job->slice_index++;
+
+	/* The second field starts over with its own pictures. */
+	if (job->slice_index == job->slice_count) {
+		job->slice_index = 0;
+		job->field_index++;
+
+		cedrus_enc_h264_picture_put(job->rec);
+		cedrus_enc_h264_picture_put(job->ref);
+		cedrus_enc_h264_picture_put(job->ref1);
+		cedrus_enc_h264_picture_put(job->last);
+
+		job->rec = NULL;
+		job->ref = NULL;
+		job->ref1 = NULL;
+		job->last = NULL;
+
+		ret = cedrus_enc_h264_job_configure_field(ctx);
+		if (ret)
+			return ret;
+
+		value = cedrus_read(dev, VE_ENC_AVC_PARA0_REG);
+		value &= ~(VE_ENC_AVC_PARA0_REF_PIC_TYPE_MASK |
+			   VE_ENC_AVC_PARA0_PIC_TYPE_MASK);
+		value |= cedrus_enc_h264_job_pic_type(job);
+		cedrus_write(dev, VE_ENC_AVC_PARA0_REG, value);
+	}
+
+	return cedrus_enc_h264_job_configure_slice(ctx);
+}
+
+static void cedrus_enc_h264_job_cost_map(struct cedrus_context *ctx)
+{
+	struct vb2_v4l2_buffer *v4l2_buffer = ctx->job.buffer_coded;
+	struct cedrus_buffer *cedrus_buffer = cedrus_job_buffer_coded(ctx);
+	struct cedrus_enc_h264_job *job = ctx->engine_job;
+	struct cedrus_enc_h264_context *h264_ctx = ctx->engine_ctx;
+	unsigned int count = h264_ctx->width_mbs * h264_ctx->height_mbs;
+	const struct cedrus_enc_h264_mv_info *mv_info;
+	unsigned int i;
+	u8 *data;
+	u8 *map;
+
+	data = vb2_plane_vaddr(&v4l2_buffer->vb2_buf, 0);
+	mv_info = (const struct cedrus_enc_h264_mv_info *)(data +
+							   job->mv_info_offset);
+	map = data + job->cost_map_offset;
+
+	cedrus_buffer_coded_sync_cpu(cedrus_buffer, job->mv_info_offset,
+				     count * sizeof(*mv_info));
+	cedrus_buffer_coded_sync_cpu(cedrus_buffer, job->cost_map_offset,
+				     count);
+
+	/* Each macroblock has 256 luma pixels. */
+	for (i = 0; i < count; i++)
+		map[i] = min_t(unsigned int, le16_to_cpu(mv_info[i].sad) / 256,
+			       U8_MAX);
+
+	cedrus_buffer_coded_sync_device(cedrus_buffer, job->cost_map_offset,
+					count);
+}
+
+static void cedrus_enc_h264_job_stats(struct cedrus_context *ctx,
+				      unsigned int length)
+{
+	struct cedrus_device *dev = ctx->proc->dev;
+	struct vb2_v4l2_buffer *v4l2_buffer = ctx->job.buffer_coded;
+	struct cedrus_enc_h264_job *job = ctx->engine_job;
+	struct cedrus_h264_enc_stats *stats;
+	struct v4l2_event event = { 0 };
+
+	event.type = V4L2_EVENT_CEDRUS_H264_ENC_STATS;
+
+	stats = (struct cedrus_h264_enc_stats *)event.u.data;
+	stats->timestamp = v4l2_buffer->vb2_buf.timestamp;
+	stats->flags = v4l2_buffer->flags & (V4L2_BUF_FLAG_KEYFRAME |
+					     V4L2_BUF_FLAG_PFRAME |
+					     V4L2_BUF_FLAG_BFRAME);
+	stats->qp = job->qp;
+	stats->frame_bits = length * 8;
+	stats->header_bits = cedrus_read(dev, VE_ENC_AVC_HEADER_BITS_REG);
+	stats->residual_bits = cedrus_read(dev, VE_ENC_AVC_RESIDUAL_BITS_REG);
+	stats->mad_sum = cedrus_read(dev, VE_ENC_AVC_RC_MAD_SUM_REG);
+	stats->me_info = cedrus_read(dev, VE_ENC_AVC_ME_INFO_REG);
+
+	if (job->thumbnail)
+		stats->thumbnail_offset = job->thumbnail_offset;
+
+	stats->offset = job->offset;
+
+	if (job->mv_info)
+		stats->mv_info_offset = job->mv_info_offset;
+
+	if (job->cost_map)
+		stats->cost_map_offset = job->cost_map_offset;
+
+	v4l2_event_queue_fh(&ctx->v4l2.fh, &event);
+}
+
+static void cedrus_enc_h264_job_scene_change(struct cedrus_context *ctx)
+{
+	struct cedrus_device *dev = ctx->proc->dev;
+	struct vb2_v4l2_buffer *v4l2_buffer = ctx->job.buffer_coded;
+	struct cedrus_enc_h264_job *job = ctx->engine_job;
+	struct cedrus_enc_h264_context *h264_ctx = ctx->engine_ctx;
+	struct cedrus_enc_h264_state *state = &h264_ctx->state;
+	struct v4l2_event event = { 0 };
+	unsigned int mad_sum, mad_sum_last;
+	u64 timestamp;
+
+	/* Intra frames have no temporal difference to compare with. */
+	if (job->frame_type == CEDRUS_ENC_H264_FRAME_TYPE_IDR ||
+	    job->frame_type == CEDRUS_ENC_H264_FRAME_TYPE_I) {
+		state->scene_mad_sum = 0;
+		return;
+	}
+
+	mad_sum = cedrus_read(dev, VE_ENC_AVC_RC_MAD_SUM_REG);
+	mad_sum_last = state->scene_mad_sum;
+	state->scene_mad_sum = mad_sum;
+
+	if (!h264_ctx->scene_change || !mad_sum_last)
+		return;
+
+	if ((u64)mad_sum * 100 <=
+	    (u64)mad_sum_last * (100 + h264_ctx->scene_change))
+		return;
+
+	/* Start the next frame without references to the previous scene. */
+	state->scene_change = true;
+	state->scene_mad_sum = 0;
+
+	event.type = V4L2_EVENT_CEDRUS_H264_ENC_SCENE_CHANGE;
+
+	timestamp = v4l2_buffer->vb2_buf.timestamp;
+	memcpy(event.u.data, &timestamp, sizeof(timestamp));
+
+	v4l2_event_queue_fh(&ctx->v4l2.fh, &event);
+}
+
+static void cedrus_enc_h264_job_cabac(struct cedrus_context *ctx,
+				      unsigned int length)
+{
+	struct cedrus_enc_h264_job *job = ctx->engine_job;
+	struct cedrus_enc_h264_context *h264_ctx = ctx->engine_ctx;
+	struct cedrus_enc_h264_state *state = &h264_ctx->state;
+	u32 *bits = &state->cabac_bits[job->cabac_init_idc];
+	unsigned int i;
+
+	if (!job->cabac_probe)
+		return;
+
+	/* Smooth the probes across periods, starting from the first one. */
+	if (*bits)
+		*bits = (*bits * 3 + length * 8) / 4;
+	else
+		*bits = length * 8;
+
+	/* Select the table once all of them were probed again. */
+	if (job->cabac_init_idc + 1 < CEDRUS_ENC_H264_CABAC_INIT_IDC_COUNT)
+		return;
+
+	for (i = 0; i < CEDRUS_ENC_H264_CABAC_INIT_IDC_COUNT; i++)
+		if (state->cabac_bits[i] &&
+		    state->cabac_bits[i] <
+		    state->cabac_bits[state->cabac_init_idc])
+			state->cabac_init_idc = i;
 }
 
 static void cedrus_enc_h264_job_finish(struct cedrus_context *ctx, int state)
@@ -1275,22 +5478,57 @@ static void cedrus_enc_h264_job_finish(struct cedrus_context *ctx, int state)
 	struct vb2_v4l2_buffer *v4l2_buffer = ctx->job.buffer_coded;
 	struct vb2_buffer *vb2_buffer = &v4l2_buffer->vb2_buf;
 	struct cedrus_enc_h264_job *job = ctx->engine_job;
+	struct cedrus_enc_h264_context *h264_ctx = ctx->engine_ctx;
 	u32 length;
 
+	/* Release the pictures held by the job. */
+	cedrus_enc_h264_picture_put(job->rec);
+	cedrus_enc_h264_picture_put(job->ref);
+	cedrus_enc_h264_picture_put(job->ref1);
+	cedrus_enc_h264_picture_put(job->last);
+
 	if (state != VB2_BUF_STATE_DONE) {
+		/* Never reference an incomplete reconstruction. */
+		if (job->rec && h264_ctx->dpb_last == job->rec) {
+			cedrus_enc_h264_picture_put(h264_ctx->dpb_last);
+			h264_ctx->dpb_last = NULL;
+		}
+
+		/* Nor a field without the other one of its frame. */
+		cedrus_enc_h264_field_release(h264_ctx);
+
+		/* The next frame is an IDR frame, which drops them anyway. */
+		if (!h264_ctx->dpb_last) {
+			cedrus_enc_h264_ltr_release(h264_ctx);
+
+			cedrus_enc_h264_picture_put(h264_ctx->dpb_base);
+			h264_ctx->dpb_base = NULL;
+		}
+
 		vb2_set_plane_payload(vb2_buffer, 0, 0);
+
 		return;
 	}
 
-	length = cedrus_read(dev, VE_ENC_AVC_STM_BIT_LEN_REG);
+	length = cedrus_enc_h264_stream_bits(dev);
 
 	WARN_ON(length % 8);
 	length /= 8;
 
+	cedrus_enc_h264_job_avcc(ctx, length);
+
 	WARN_ON(length > vb2_plane_size(vb2_buffer, 0));
 
 	vb2_set_plane_payload(vb2_buffer, 0, length);
 
+	/* The payload includes the packed frames and the headroom. */
+	if (!WARN_ON(length < job->offset + job->headroom))
+		length -= job->offset + job->headroom;
+
+	/* Adapt the QP of the next frame right away. */
+	if (h264_ctx->rc_enable)
+		cedrus_enc_h264_rc_update(ctx, length * 8);
+
 	switch (job->frame_type) {
 	case CEDRUS_ENC_H264_FRAME_TYPE_IDR:
 	case CEDRUS_ENC_H264_FRAME_TYPE_I:
@@ -1299,7 +5537,117 @@ static void cedrus_enc_h264_job_finish(struct cedrus_context *ctx, int state)
 	case CEDRUS_ENC_H264_FRAME_TYPE_P:
 		v4l2_buffer->flags |= V4L2_BUF_FLAG_PFRAME;
 		break;
+	case CEDRUS_ENC_H264_FRAME_TYPE_B:
+		v4l2_buffer->flags |= V4L2_BUF_FLAG_BFRAME;
+		break;
+	}
+
+	trace_cedrus_enc_h264_frame(ctx, job->frame_type, job->qp, length);
+
+	/* The reconstruction can be exported once complete, as a frame. */
+	if (job->rec && job->rec->rec_dmabuf && job->field_count < 2) {
+		spin_lock(&h264_ctx->dpb_export_lock);
+		job->rec->rec_timestamp = v4l2_buffer->vb2_buf.timestamp;
+		job->rec->rec_valid = true;
+		spin_unlock(&h264_ctx->dpb_export_lock);
+	}
+
+	if (job->cost_map)
+		cedrus_enc_h264_job_cost_map(ctx);
+
+	/* Report statistics for userspace encoding decisions. */
+	cedrus_enc_h264_job_stats(ctx, length);
+	cedrus_enc_h264_histogram_update(ctx, length);
+
+	cedrus_enc_h264_job_scene_change(ctx);
+	cedrus_enc_h264_job_cabac(ctx, length);
+
+	/* Pack the next frame after this one, if it is likely to fit. */
+	h264_ctx->pack_count++;
+
+	if (!job->thumbnail && !job->mv_info &&
+	    h264_ctx->pack_count < h264_ctx->frames_packed) {
+		unsigned int payload = vb2_get_plane_payload(vb2_buffer, 0);
+		unsigned int size = vb2_plane_size(vb2_buffer, 0);
+
+		if (size - payload >= payload - job->offset + SZ_1K)
+			ctx->job.coded_keep = true;
+	}
+}
+
+static int cedrus_enc_h264_job_header(struct cedrus_context *ctx,
+				      struct vb2_v4l2_buffer *v4l2_buffer)
+{
+	struct cedrus_enc_h264_context *h264_ctx = ctx->engine_ctx;
+	struct cedrus_enc_h264_state *state = &h264_ctx->state;
+	struct vb2_buffer *vb2_buffer = &v4l2_buffer->vb2_buf;
+	struct cedrus_buffer *cedrus_buffer =
+		container_of(v4l2_buffer, struct cedrus_buffer, m2m_buffer.vb);
+	struct cedrus_enc_h264_bits *sps_bits = &h264_ctx->sps_bits;
+	struct cedrus_enc_h264_bits *pps_bits = &h264_ctx->pps_bits;
+	unsigned int sps_length, pps_length;
+	unsigned int headroom, payload, offset = 0;
+	unsigned int size;
+	unsigned int i;
+	u8 *data;
+
+	data = vb2_plane_vaddr(vb2_buffer, 0);
+	if (!data)
+		return -ENOMEM;
+
+	cedrus_enc_h264_state_sample(ctx);
+	cedrus_enc_h264_job_prepare_parameter_sets(ctx);
+
+	state->timeperframe = ctx->v4l2.timeperframe_coded;
+	state->qp_init = h264_ctx->qp_i;
+	headroom = h264_ctx->headroom;
+
+	state->sps_valid = false;
+	state->pps_valid = false;
+
+	cedrus_enc_h264_job_configure_sps_update(ctx);
+	cedrus_enc_h264_job_configure_pps_update(ctx);
+
+	/* Serialized headers are byte-aligned. */
+	sps_length = sps_bits->count / 8;
+	pps_length = pps_bits->count / 8;
+
+	/* Headers follow the frames packed in the coded buffer, if any. */
+	if (ctx->coded_kept)
+		offset = vb2_get_plane_payload(vb2_buffer, 0);
+
+	size = vb2_plane_size(vb2_buffer, 0) - offset;
+
+	/* Keep the same headroom as frames, if the headers still fit. */
+	if (headroom + sps_length + pps_length > size)
+		headroom = 0;
+
+	if (sps_length + pps_length > size)
+		return -ENOSPC;
+
+	payload = offset + headroom + sps_length + pps_length;
+	data += offset + headroom;
+
+	for (i = 0; i < sps_length; i++)
+		data[i] = cedrus_enc_h264_bits_byte(sps_bits, i);
+
+	for (i = 0; i < pps_length; i++)
+		data[sps_length + i] = cedrus_enc_h264_bits_byte(pps_bits, i);
+
+	if (h264_ctx->avcc) {
+		put_unaligned_be32(sps_length - 4, data);
+		put_unaligned_be32(pps_length - 4, data + sps_length);
 	}
+
+	cedrus_buffer_coded_sync_device(cedrus_buffer, offset + headroom,
+					sps_length + pps_length);
+
+	vb2_set_plane_payload(vb2_buffer, 0, payload);
+
+	/* The first frame then starts with its slice header. */
+	state->step = CEDRUS_ENC_H264_STEP_SLICE;
+
+	return 0;
 }
 
 /* IRQ */
@@ -1307,14 +5655,35 @@ static void cedrus_enc_h264_job_finish(struct cedrus_context *ctx, int state)
 static int cedrus_enc_h264_irq_status(struct cedrus_context *ctx)
 {
 	struct cedrus_device *dev = ctx->proc->dev;
+	struct cedrus_enc_h264_job *job = ctx->engine_job;
 	u32 status;
 
 	status = cedrus_read(dev, VE_ENC_AVC_STATUS_REG);
 	if (!(status & VE_ENC_AVC_STATUS_MASK))
 		return CEDRUS_IRQ_NONE;
 
-	if (status & VE_ENC_AVC_STATUS_FINISH)
+	/*
+	 * Macroblocks running overtime fall back to cheaper decisions and
+	 * still end with a complete frame.
+	 */
+	if (status & VE_ENC_AVC_STATUS_FINISH) {
+		if (job->slice_index + 1 < job->slice_count ||
+		    job->field_index + 1 < job->field_count)
+			return CEDRUS_IRQ_CONTINUE;
+
 		return CEDRUS_IRQ_SUCCESS;
+	}
+
+	/*
+	 * A full coded buffer stalls the engine, after which the frame may
+	 * start over from a reset engine.
+	 */
+	if (status & VE_ENC_AVC_STATUS_STALL &&
+	    cedrus_enc_h264_stream_bits(dev) >=
+	    cedrus_read(dev, VE_ENC_AVC_STM_BIT_MAX_REG)) {
+		job->overflow_pending = true;
+		return CEDRUS_IRQ_CONTINUE;
+	}
 
 	return CEDRUS_IRQ_ERROR;
 }
@@ -1333,6 +5702,71 @@ static void cedrus_enc_h264_irq_disable(struct cedrus_context *ctx)
 	cedrus_write(dev, VE_ENC_AVC_INT_EN_REG, 0);
 }
 
+/* Ioctl */
+
+static long
+cedrus_enc_h264_rec_expbuf(struct cedrus_context *ctx,
+			   struct cedrus_h264_enc_rec_expbuf *expbuf)
+{
+	struct cedrus_enc_h264_context *h264_ctx = ctx->engine_ctx;
+	struct cedrus_enc_h264_picture *picture = NULL;
+	unsigned int i;
+	int fd;
+
+	if (expbuf->flags & ~(O_CLOEXEC | O_ACCMODE))
+		return -EINVAL;
+
+	/* The engine context only exists while streaming. */
+	if (!h264_ctx || !h264_ctx->dpb_exported)
+		return -EINVAL;
+
+	spin_lock(&h264_ctx->dpb_export_lock);
+
+	for (i = 0; i < h264_ctx->dpb_count; i++) {
+		if (!h264_ctx->dpb[i].rec_valid ||
+		    h264_ctx->dpb[i].rec_timestamp != expbuf->timestamp)
+			continue;
+
+		picture = &h264_ctx->dpb[i];
+		get_dma_buf(picture->rec_dmabuf);
+		break;
+	}
+
+	spin_unlock(&h264_ctx->dpb_export_lock);
+
+	if (!picture)
+		return -ENOENT;
+
+	fd = dma_buf_fd(picture->rec_dmabuf, expbuf->flags);
+	if (fd < 0) {
+		dma_buf_put(picture->rec_dmabuf);
+		return fd;
+	}
+
+	/* XXX: The reconstruction is assumed to use the decoder tiling. */
+	expbuf->fd = fd;
+	expbuf->pixelformat = V4L2_PIX_FMT_NV12_32L32;
+	expbuf->width = h264_ctx->width_mbs * 16;
+	expbuf->height = h264_ctx->height_mbs * 16;
+	expbuf->bytesperline = ALIGN(h264_ctx->width_mbs, 2) * 16;
+	expbuf->chroma_offset = picture->rec_luma_size;
+	expbuf->size = picture->rec_size;
+	memset(expbuf->reserved, 0, sizeof(expbuf->reserved));
+
+	return 0;
+}
+
+static long cedrus_enc_h264_ioctl(struct cedrus_context *ctx,
+				  unsigned int cmd, void *arg)
+{
+	switch (cmd) {
+	case VIDIOC_CEDRUS_H264_ENC_REC_EXPBUF:
+		return cedrus_enc_h264_rec_expbuf(ctx, arg);
+	default:
+		return -ENOTTY;
+	}
+}
+
 /* Engine */
 
 static const struct cedrus_engine_ops cedrus_enc_h264_ops = {
@@ -1344,14 +5778,17 @@ static const struct cedrus_engine_ops cedrus_enc_h264_ops = {
 
 	.setup			= cedrus_enc_h264_setup,
 	.cleanup		= cedrus_enc_h264_cleanup,
-
-	.buffer_setup		= cedrus_enc_h264_buffer_setup,
-	.buffer_cleanup		= cedrus_enc_h264_buffer_cleanup,
+	.stop			= cedrus_enc_h264_stop,
+	.restart		= cedrus_enc_h264_restart,
 
 	.job_prepare		= cedrus_enc_h264_job_prepare,
 	.job_configure		= cedrus_enc_h264_job_configure,
 	.job_trigger		= cedrus_enc_h264_job_trigger,
+	.job_continue		= cedrus_enc_h264_job_continue,
 	.job_finish		= cedrus_enc_h264_job_finish,
+	.job_header		= cedrus_enc_h264_job_header,
+
+	.ioctl			= cedrus_enc_h264_ioctl,
 
 	.irq_status		= cedrus_enc_h264_irq_status,
 	.irq_clear		= cedrus_enc_h264_irq_clear,
@@ -1362,30 +5799,243 @@ static const struct v4l2_ctrl_config cedrus_enc_h264_ctrl_configs[] = {
 	/* Queue */
 
 	{
-		.id		= V4L2_CID_MIN_BUFFERS_FOR_OUTPUT,
+		.id		= V4L2_CID_MIN_BUFFERS_FOR_OUTPUT,
+		.step		= 1,
+		.min		= 1,
+		.max		= 32,
+		.def		= 1,
+		.flags		= V4L2_CTRL_FLAG_VOLATILE,
+	},
+
+	/* Bitstream */
+
+	{
+		.id		= V4L2_CID_MPEG_VIDEO_HEADER_MODE,
+		.min		= V4L2_MPEG_VIDEO_HEADER_MODE_SEPARATE,
+		.max		= V4L2_MPEG_VIDEO_HEADER_MODE_JOINED_WITH_1ST_FRAME,
+		.def		= V4L2_MPEG_VIDEO_HEADER_MODE_JOINED_WITH_1ST_FRAME,
+		.ops		= &cedrus_context_ctrl_ops,
+	},
+	{
+		.id		= V4L2_CID_CEDRUS_H264_ENC_AVCC,
+		.name		= "H264 Length-Prefixed Output",
+		.type		= V4L2_CTRL_TYPE_BOOLEAN,
+		.step		= 1,
+		.min		= 0,
+		.max		= 1,
+		.def		= 0,
+		.ops		= &cedrus_context_ctrl_ops,
+	},
+	{
+		.id		= V4L2_CID_MPEG_VIDEO_MULTI_SLICE_MODE,
+		.min		= V4L2_MPEG_VIDEO_MULTI_SLICE_MODE_SINGLE,
+		.max		= V4L2_MPEG_VIDEO_MULTI_SLICE_MODE_MAX_MB,
+		.def		= V4L2_MPEG_VIDEO_MULTI_SLICE_MODE_SINGLE,
+		.ops		= &cedrus_context_ctrl_ops,
+	},
+	{
+		.id		= V4L2_CID_MPEG_VIDEO_MULTI_SLICE_MAX_MB,
+		.step		= 1,
+		.min		= 1,
+		.max		= (CEDRUS_WIDTH_MAX / 16) * (CEDRUS_HEIGHT_MAX / 16),
+		.def		= 1,
+		.ops		= &cedrus_context_ctrl_ops,
+	},
+	{
+		.id		= V4L2_CID_MPEG_VIDEO_PREPEND_SPSPPS_TO_IDR,
+		.step		= 1,
+		.min		= 0,
+		.max		= 1,
+		.def		= 0,
+		.ops		= &cedrus_context_ctrl_ops,
+	},
+	{
+		.id		= V4L2_CID_MPEG_VIDEO_AU_DELIMITER,
+		.step		= 1,
+		.min		= 0,
+		.max		= 1,
+		.def		= 0,
+		.ops		= &cedrus_context_ctrl_ops,
+	},
+	{
+		.id		= V4L2_CID_CEDRUS_H264_ENC_SEI,
+		.name		= "H264 SEI Messages",
+		.type		= V4L2_CTRL_TYPE_BITMASK,
+		.max		= CEDRUS_H264_ENC_SEI_RECOVERY_POINT,
+		.def		= 0,
+		.ops		= &cedrus_context_ctrl_ops,
+	},
+	{
+		.id		= V4L2_CID_MPEG_VIDEO_FRAME_SKIP_MODE,
+		.min		= V4L2_MPEG_VIDEO_FRAME_SKIP_MODE_DISABLED,
+		.max		= V4L2_MPEG_VIDEO_FRAME_SKIP_MODE_BUF_LIMIT,
+		.def		= V4L2_MPEG_VIDEO_FRAME_SKIP_MODE_DISABLED,
+		.ops		= &cedrus_context_ctrl_ops,
+	},
+	{
+		.id		= V4L2_CID_CEDRUS_H264_ENC_DENOISE,
+		.name		= "H264 Temporal Denoise",
+		.type		= V4L2_CTRL_TYPE_INTEGER,
+		.step		= 1,
+		.min		= 0,
+		.max		= CEDRUS_ENC_H264_DENOISE_MAX,
+		.def		= 0,
+		.ops		= &cedrus_context_ctrl_ops,
+	},
+	{
+		.id		= V4L2_CID_CEDRUS_H264_ENC_AQ_STRENGTH,
+		.name		= "H264 Adaptive Quantization Strength",
+		.type		= V4L2_CTRL_TYPE_INTEGER,
+		.step		= 1,
+		.min		= 0,
+		.max		= CEDRUS_ENC_H264_AQ_STRENGTH_MAX,
+		.def		= 0,
+		.ops		= &cedrus_context_ctrl_ops,
+	},
+	{
+		.id		= V4L2_CID_CEDRUS_H264_ENC_FAST_START,
+		.name		= "H264 Fast Start QP Raise",
+		.type		= V4L2_CTRL_TYPE_INTEGER,
+		.step		= 1,
+		.min		= 0,
+		.max		= 51,
+		.def		= 0,
+		.ops		= &cedrus_context_ctrl_ops,
+	},
+	{
+		.id		= V4L2_CID_CEDRUS_H264_ENC_VFR,
+		.name		= "H264 Variable Frame Rate",
+		.type		= V4L2_CTRL_TYPE_BOOLEAN,
+		.step		= 1,
+		.min		= 0,
+		.max		= 1,
+		.def		= 0,
+		.ops		= &cedrus_context_ctrl_ops,
+	},
+	{
+		.id		= V4L2_CID_CEDRUS_H264_ENC_STATIC_SKIP,
+		.name		= "H264 Static Frame Skip Threshold",
+		.type		= V4L2_CTRL_TYPE_INTEGER,
+		.step		= 1,
+		.min		= 0,
+		.max		= CEDRUS_H264_ENC_STATIC_SKIP_MAX,
+		.def		= 0,
+		.ops		= &cedrus_context_ctrl_ops,
+	},
+	{
+		.id		= V4L2_CID_CEDRUS_H264_ENC_PRESET,
+		.name		= "H264 Encoding Preset",
+		.type		= V4L2_CTRL_TYPE_MENU,
+		.min		= CEDRUS_H264_ENC_PRESET_QUALITY,
+		.max		= CEDRUS_H264_ENC_PRESET_SCREEN,
+		.def		= CEDRUS_H264_ENC_PRESET_BALANCED,
+		.qmenu		= cedrus_enc_h264_preset_menu,
+		.ops		= &cedrus_context_ctrl_ops,
+	},
+	{
+		.id		= V4L2_CID_CEDRUS_H264_ENC_TIME_BUDGET,
+		.name		= "H264 Frame Time Budget",
+		.type		= V4L2_CTRL_TYPE_INTEGER,
+		.step		= 1,
+		.min		= 0,
+		.max		= USEC_PER_SEC,
+		.def		= 0,
+		.ops		= &cedrus_context_ctrl_ops,
+	},
+	{
+		.id		= V4L2_CID_CEDRUS_H264_ENC_MAX_LATENCY,
+		.name		= "H264 Maximum Latency",
+		.type		= V4L2_CTRL_TYPE_INTEGER,
+		.step		= 1,
+		.min		= 0,
+		.max		= MSEC_PER_SEC * 10,
+		.def		= 0,
+		.ops		= &cedrus_context_ctrl_ops,
+	},
+	{
+		.id		= V4L2_CID_CEDRUS_H264_ENC_OVERFLOW_RETRIES,
+		.name		= "H264 Overflow Retries",
+		.type		= V4L2_CTRL_TYPE_INTEGER,
+		.step		= 1,
+		.min		= 0,
+		.max		= 8,
+		.def		= 0,
+		.ops		= &cedrus_context_ctrl_ops,
+	},
+	{
+		.id		= V4L2_CID_CEDRUS_H264_ENC_OVERFLOW_QP_DELTA,
+		.name		= "H264 Overflow QP Delta",
+		.type		= V4L2_CTRL_TYPE_INTEGER,
 		.step		= 1,
 		.min		= 1,
-		.max		= 32,
+		.max		= 51,
+		.def		= 6,
+		.ops		= &cedrus_context_ctrl_ops,
+	},
+	{
+		.id		= V4L2_CID_CEDRUS_H264_ENC_SCENE_CHANGE,
+		.name		= "H264 Scene Change Threshold",
+		.type		= V4L2_CTRL_TYPE_INTEGER,
+		.step		= 1,
+		.min		= 0,
+		.max		= 1000,
+		.def		= 0,
+		.ops		= &cedrus_context_ctrl_ops,
+	},
+	{
+		.id		= V4L2_CID_CEDRUS_H264_ENC_THUMBNAIL,
+		.name		= "H264 Thumbnail Output",
+		.type		= V4L2_CTRL_TYPE_BOOLEAN,
+		.step		= 1,
+		.min		= 0,
+		.max		= 1,
+		.def		= 0,
+		.ops		= &cedrus_context_ctrl_ops,
+	},
+	{
+		.id		= V4L2_CID_CEDRUS_H264_ENC_HEADROOM,
+		.name		= "H264 Coded Buffer Headroom",
+		.type		= V4L2_CTRL_TYPE_INTEGER,
+		.step		= 1,
+		.min		= 0,
+		.max		= CEDRUS_H264_ENC_HEADROOM_MAX,
+		.def		= 0,
+		.ops		= &cedrus_context_ctrl_ops,
+	},
+	{
+		.id		= V4L2_CID_CEDRUS_H264_ENC_FRAMES_PACKED,
+		.name		= "H264 Frames Per Coded Buffer",
+		.type		= V4L2_CTRL_TYPE_INTEGER,
+		.step		= 1,
+		.min		= 1,
+		.max		= CEDRUS_H264_ENC_FRAMES_PACKED_MAX,
 		.def		= 1,
-		.flags		= V4L2_CTRL_FLAG_VOLATILE,
+		.ops		= &cedrus_context_ctrl_ops,
 	},
-
-	/* Bitstream */
-
 	{
-		.id		= V4L2_CID_MPEG_VIDEO_HEADER_MODE,
-		.min		= V4L2_MPEG_VIDEO_HEADER_MODE_JOINED_WITH_1ST_FRAME,
-		.max		= V4L2_MPEG_VIDEO_HEADER_MODE_JOINED_WITH_1ST_FRAME,
-		.def		= V4L2_MPEG_VIDEO_HEADER_MODE_JOINED_WITH_1ST_FRAME,
+		.id		= V4L2_CID_CEDRUS_H264_ENC_MV_INFO,
+		.name		= "H264 Motion Vector Output",
+		.type		= V4L2_CTRL_TYPE_BOOLEAN,
+		.step		= 1,
+		.min		= 0,
+		.max		= 1,
+		.def		= 0,
+		.ops		= &cedrus_context_ctrl_ops,
 	},
 	{
-		.id		= V4L2_CID_MPEG_VIDEO_MULTI_SLICE_MODE,
-		.min		= V4L2_MPEG_VIDEO_MULTI_SLICE_MODE_SINGLE,
-		.max		= V4L2_MPEG_VIDEO_MULTI_SLICE_MODE_SINGLE,
-		.def		= V4L2_MPEG_VIDEO_MULTI_SLICE_MODE_SINGLE,
+		.id		= V4L2_CID_CEDRUS_H264_ENC_COST_MAP,
+		.name		= "H264 Macroblock Cost Map",
+		.type		= V4L2_CTRL_TYPE_BOOLEAN,
+		.step		= 1,
+		.min		= 0,
+		.max		= 1,
+		.def		= 0,
+		.ops		= &cedrus_context_ctrl_ops,
 	},
 	{
-		.id		= V4L2_CID_MPEG_VIDEO_PREPEND_SPSPPS_TO_IDR,
+		.id		= V4L2_CID_CEDRUS_H264_ENC_REC_EXPORT,
+		.name		= "H264 Reconstruction Export",
+		.type		= V4L2_CTRL_TYPE_BOOLEAN,
 		.step		= 1,
 		.min		= 0,
 		.max		= 1,
@@ -1393,10 +6043,43 @@ static const struct v4l2_ctrl_config cedrus_enc_h264_ctrl_configs[] = {
 		.ops		= &cedrus_context_ctrl_ops,
 	},
 	{
-		.id		= V4L2_CID_MPEG_VIDEO_FRAME_SKIP_MODE,
-		.min		= V4L2_MPEG_VIDEO_FRAME_SKIP_MODE_DISABLED,
-		.max		= V4L2_MPEG_VIDEO_FRAME_SKIP_MODE_DISABLED,
-		.def		= V4L2_MPEG_VIDEO_FRAME_SKIP_MODE_DISABLED,
+		.id		= V4L2_CID_CEDRUS_H264_ENC_ERROR_RESILIENCE,
+		.name		= "H264 Error Resilience",
+		.type		= V4L2_CTRL_TYPE_BOOLEAN,
+		.step		= 1,
+		.min		= 0,
+		.max		= 1,
+		.def		= 0,
+		.ops		= &cedrus_context_ctrl_ops,
+	},
+	{
+		.id		= V4L2_CID_CEDRUS_H264_ENC_LOOKAHEAD,
+		.name		= "H264 Lookahead",
+		.type		= V4L2_CTRL_TYPE_INTEGER,
+		.step		= 1,
+		.min		= 0,
+		.max		= CEDRUS_H264_ENC_LOOKAHEAD_MAX,
+		.def		= 0,
+		.ops		= &cedrus_context_ctrl_ops,
+	},
+	{
+		.id		= V4L2_CID_CEDRUS_H264_ENC_FRAME_SKIP,
+		.name		= "H264 Frame Skip",
+		.type		= V4L2_CTRL_TYPE_BUTTON,
+		.flags		= V4L2_CTRL_FLAG_WRITE_ONLY |
+				  V4L2_CTRL_FLAG_EXECUTE_ON_WRITE,
+		.ops		= &cedrus_context_ctrl_ops,
+	},
+	{
+		.id		= V4L2_CID_CEDRUS_H264_ENC_FRAME_TYPE,
+		.name		= "H264 Frame Type",
+		.type		= V4L2_CTRL_TYPE_MENU,
+		.flags		= V4L2_CTRL_FLAG_EXECUTE_ON_WRITE,
+		.min		= CEDRUS_H264_ENC_FRAME_TYPE_AUTO,
+		.max		= CEDRUS_H264_ENC_FRAME_TYPE_SKIP,
+		.def		= CEDRUS_H264_ENC_FRAME_TYPE_AUTO,
+		.qmenu		= cedrus_enc_h264_frame_type_menu,
+		.ops		= &cedrus_context_ctrl_ops,
 	},
 	{
 		.id		= V4L2_CID_MPEG_VIDEO_H264_VUI_SAR_ENABLE,
@@ -1457,6 +6140,16 @@ static const struct v4l2_ctrl_config cedrus_enc_h264_ctrl_configs[] = {
 		.def		= V4L2_MPEG_VIDEO_H264_LEVEL_3_1,
 		.ops		= &cedrus_context_ctrl_ops,
 	},
+	{
+		.id		= V4L2_CID_CEDRUS_H264_ENC_LEVEL_AUTO,
+		.name		= "H264 Automatic Level",
+		.type		= V4L2_CTRL_TYPE_BOOLEAN,
+		.step		= 1,
+		.min		= 0,
+		.max		= 1,
+		.def		= 0,
+		.ops		= &cedrus_context_ctrl_ops,
+	},
 
 	/* Features */
 
@@ -1534,16 +6227,153 @@ static const struct v4l2_ctrl_config cedrus_enc_h264_ctrl_configs[] = {
 		.ops		= &cedrus_context_ctrl_ops,
 	},
 	{
-		.id		= V4L2_CID_MPEG_VIDEO_GOP_CLOSURE,
-		.def		= 1,
+		.id		= V4L2_CID_MPEG_VIDEO_H264_B_FRAME_QP,
+		.step		= 1,
+		.min		= 0,
+		.max		= 51,
+		.def		= 30,
+		.ops		= &cedrus_context_ctrl_ops,
+	},
+	{
+		.id		= V4L2_CID_MPEG_VIDEO_FRAME_RC_ENABLE,
+		.def		= 0,
+		.ops		= &cedrus_context_ctrl_ops,
+	},
+	{
+		.id		= V4L2_CID_MPEG_VIDEO_BITRATE_MODE,
+		.min		= V4L2_MPEG_VIDEO_BITRATE_MODE_VBR,
+		.max		= V4L2_MPEG_VIDEO_BITRATE_MODE_CQ,
+		.def		= V4L2_MPEG_VIDEO_BITRATE_MODE_VBR,
+		.ops		= &cedrus_context_ctrl_ops,
+	},
+	{
+		.id		= V4L2_CID_MPEG_VIDEO_BITRATE,
+		.step		= 1,
+		.min		= 1000,
+		.max		= 100000000,
+		.def		= 2000000,
+		.ops		= &cedrus_context_ctrl_ops,
+	},
+	{
+		.id		= V4L2_CID_MPEG_VIDEO_BITRATE_PEAK,
+		.step		= 1,
+		.min		= 1000,
+		.max		= 100000000,
+		.def		= 4000000,
+		.ops		= &cedrus_context_ctrl_ops,
+	},
+	{
+		.id		= V4L2_CID_MPEG_VIDEO_VBV_SIZE,
+		.step		= 1,
+		.min		= 0,
+		.max		= 100000,
+		.def		= 0,
 		.ops		= &cedrus_context_ctrl_ops,
 	},
 	{
-		.id		= V4L2_CID_MPEG_VIDEO_GOP_SIZE,
+		.id		= V4L2_CID_MPEG_VIDEO_CONSTANT_QUALITY,
 		.step		= 1,
 		.min		= 1,
+		.max		= 100,
+		.def		= 50,
+		.ops		= &cedrus_context_ctrl_ops,
+	},
+	{
+		.id		= V4L2_CID_MPEG_VIDEO_INTRA_REFRESH_PERIOD_TYPE,
+		.min		= V4L2_CID_MPEG_VIDEO_INTRA_REFRESH_PERIOD_TYPE_CYCLIC,
+		.max		= V4L2_CID_MPEG_VIDEO_INTRA_REFRESH_PERIOD_TYPE_CYCLIC,
+		.def		= V4L2_CID_MPEG_VIDEO_INTRA_REFRESH_PERIOD_TYPE_CYCLIC,
+		.ops		= &cedrus_context_ctrl_ops,
+	},
+	{
+		.id		= V4L2_CID_MPEG_VIDEO_INTRA_REFRESH_PERIOD,
+		.step		= 1,
+		.min		= 0,
 		.max		= USHRT_MAX,
-		.def		= 12,
+		.def		= 0,
+		.ops		= &cedrus_context_ctrl_ops,
+	},
+	{
+		.id		= V4L2_CID_CEDRUS_H264_ENC_ROI,
+		.name		= "H264 Regions of Interest",
+		.type		= V4L2_CTRL_TYPE_INTEGER,
+		.step		= 1,
+		.min		= -51,
+		.max		= CEDRUS_WIDTH_MAX,
+		.def		= 0,
+		.dims		= { CEDRUS_H264_ENC_ROI_COUNT,
+				    CEDRUS_H264_ENC_ROI_FIELDS_COUNT },
+		.ops		= &cedrus_context_ctrl_ops,
+	},
+	{
+		.id		= V4L2_CID_CEDRUS_H264_ENC_FRAME_BUDGET,
+		.name		= "H264 Frame Budget",
+		.type		= V4L2_CTRL_TYPE_INTEGER,
+		.flags		= V4L2_CTRL_FLAG_EXECUTE_ON_WRITE,
+		.step		= 1,
+		.min		= 0,
+		.max		= S32_MAX,
+		.def		= 0,
+		.dims		= { CEDRUS_H264_ENC_FRAME_BUDGET_FIELDS_COUNT },
+		.ops		= &cedrus_context_ctrl_ops,
+	},
+	{
+		.id		= V4L2_CID_CEDRUS_H264_ENC_INTRA_REFRESH_WAVE,
+		.name		= "H264 Intra Refresh Wave",
+		.type		= V4L2_CTRL_TYPE_INTEGER,
+		.flags		= V4L2_CTRL_FLAG_EXECUTE_ON_WRITE,
+		.step		= 1,
+		.min		= 1,
+		.max		= USHRT_MAX,
+		.def		= 1,
+		.ops		= &cedrus_context_ctrl_ops,
+	},
+	{
+		.id		= V4L2_CID_CEDRUS_H264_ENC_GOP_PATTERN,
+		.name		= "H264 GOP Pattern",
+		.type		= V4L2_CTRL_TYPE_INTEGER,
+		.step		= 1,
+		.min		= -51,
+		.max		= 51,
+		.def		= 0,
+		.dims		= { CEDRUS_H264_ENC_GOP_PATTERN_MAX,
+				    CEDRUS_H264_ENC_GOP_PATTERN_FIELDS_COUNT },
+		.ops		= &cedrus_context_ctrl_ops,
+	},
+	{
+		.id		= V4L2_CID_CEDRUS_H264_ENC_QP_LAYER_DELTA,
+		.name		= "H264 Layer QP Deltas",
+		.type		= V4L2_CTRL_TYPE_INTEGER,
+		.step		= 1,
+		.min		= -51,
+		.max		= 51,
+		.def		= 0,
+		.dims		= { CEDRUS_H264_ENC_QP_LAYERS_COUNT },
+		.ops		= &cedrus_context_ctrl_ops,
+	},
+	{
+		.id		= V4L2_CID_CEDRUS_H264_ENC_QP_NON_REF_DELTA,
+		.name		= "H264 Non-Reference QP Delta",
+		.type		= V4L2_CTRL_TYPE_INTEGER,
+		.step		= 1,
+		.min		= -51,
+		.max		= 51,
+		.def		= 0,
+		.ops		= &cedrus_context_ctrl_ops,
+	},
+	{
+		.id		= V4L2_CID_CEDRUS_H264_ENC_STATIC_BACKGROUND,
+		.name		= "H264 Static Background QP Delta",
+		.type		= V4L2_CTRL_TYPE_INTEGER,
+		.step		= 1,
+		.min		= 0,
+		.max		= 12,
+		.def		= 0,
+		.ops		= &cedrus_context_ctrl_ops,
+	},
+	{
+		.id		= V4L2_CID_MPEG_VIDEO_GOP_CLOSURE,
+		.def		= 1,
 		.ops		= &cedrus_context_ctrl_ops,
 	},
 	{
@@ -1555,7 +6385,54 @@ static const struct v4l2_ctrl_config cedrus_enc_h264_ctrl_configs[] = {
 		.ops		= &cedrus_context_ctrl_ops,
 	},
 	{
-		.id		= V4L2_CID_MPEG_VIDEO_FORCE_KEY_FRAME,
+		.id		= V4L2_CID_MPEG_VIDEO_B_FRAMES,
+		.step		= 1,
+		.min		= 0,
+		.max		= 3,
+		.def		= 0,
+		.ops		= &cedrus_context_ctrl_ops,
+	},
+	{
+		.id		= V4L2_CID_MPEG_VIDEO_H264_HIERARCHICAL_CODING,
+		.def		= 0,
+		.ops		= &cedrus_context_ctrl_ops,
+	},
+	{
+		.id		= V4L2_CID_MPEG_VIDEO_H264_HIERARCHICAL_CODING_TYPE,
+		.min		= V4L2_MPEG_VIDEO_H264_HIERARCHICAL_CODING_P,
+		.max		= V4L2_MPEG_VIDEO_H264_HIERARCHICAL_CODING_P,
+		.def		= V4L2_MPEG_VIDEO_H264_HIERARCHICAL_CODING_P,
+		.ops		= &cedrus_context_ctrl_ops,
+	},
+	{
+		.id		= V4L2_CID_MPEG_VIDEO_H264_HIERARCHICAL_CODING_LAYER,
+		.step		= 1,
+		.min		= 1,
+		.max		= CEDRUS_ENC_H264_TEMPORAL_LAYERS_MAX,
+		.def		= 1,
+		.ops		= &cedrus_context_ctrl_ops,
+	},
+	{
+		.id		= V4L2_CID_MPEG_VIDEO_LTR_COUNT,
+		.step		= 1,
+		.min		= 0,
+		.max		= CEDRUS_ENC_H264_LTR_COUNT,
+		.def		= 0,
+		.ops		= &cedrus_context_ctrl_ops,
+	},
+	{
+		.id		= V4L2_CID_MPEG_VIDEO_FRAME_LTR_INDEX,
+		.step		= 1,
+		.min		= 0,
+		.max		= CEDRUS_ENC_H264_LTR_COUNT - 1,
+		.def		= 0,
+		.ops		= &cedrus_context_ctrl_ops,
+	},
+	{
+		.id		= V4L2_CID_MPEG_VIDEO_USE_LTR_FRAMES,
+		.min		= 0,
+		.max		= BIT(CEDRUS_ENC_H264_LTR_COUNT) - 1,
+		.def		= 0,
 		.ops		= &cedrus_context_ctrl_ops,
 	},
 };
@@ -1581,8 +6458,13 @@ const struct cedrus_engine cedrus_enc_h264 = {
 	.ctrl_configs		= cedrus_enc_h264_ctrl_configs,
 	.ctrl_configs_count	= ARRAY_SIZE(cedrus_enc_h264_ctrl_configs),
 	.frmsize		= &cedrus_enc_h264_frmsize,
+	.interlaced		= true,
+	.mb_cycles		= 1200,
 
 	.ctx_size		= sizeof(struct cedrus_enc_h264_context),
 	.job_size		= sizeof(struct cedrus_enc_h264_job),
-	.buffer_size		= sizeof(struct cedrus_enc_h264_buffer),
 };
+
+#if IS_ENABLED(CONFIG_VIDEO_SUNXI_CEDRUS_KUNIT_TEST)
+#include "cedrus_enc_h264_test.c"
+#endif
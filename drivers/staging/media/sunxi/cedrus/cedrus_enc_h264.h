@@ -9,18 +9,33 @@
 #ifndef _CEDRUS_ENC_H264_H_
 #define _CEDRUS_ENC_H264_H_
 
+#include <linux/seqlock.h>
+#include <linux/spinlock.h>
+#include <linux/stddef.h>
 #include <media/v4l2-ctrls.h>
 
+#include "include/uapi/sunxi-cedrus.h"
+
 #define CENDRUS_ENC_H264_NALU_TYPE_SLICE_NON_IDR	1
 #define CENDRUS_ENC_H264_NALU_TYPE_SLICE_IDR		5
+#define CENDRUS_ENC_H264_NALU_TYPE_SEI			6
 #define CENDRUS_ENC_H264_NALU_TYPE_SPS			7
 #define CENDRUS_ENC_H264_NALU_TYPE_PPS			8
 #define CENDRUS_ENC_H264_NALU_TYPE_AUD			9
+#define CENDRUS_ENC_H264_NALU_TYPE_PREFIX		14
 
 #define CEDRUS_ENC_H264_SLICE_TYPE_I		2
 #define CEDRUS_ENC_H264_SLICE_TYPE_B		1
 #define CEDRUS_ENC_H264_SLICE_TYPE_P		0
 
+#define CEDRUS_ENC_H264_SEI_TYPE_BUF_PERIOD	0
+#define CEDRUS_ENC_H264_SEI_TYPE_PIC_TIMING	1
+#define CEDRUS_ENC_H264_SEI_TYPE_RECOVERY_POINT	6
+
+/* Length of the HRD delays, in bits. */
+#define CEDRUS_ENC_H264_HRD_DELAY_LENGTH	24
+#define CEDRUS_ENC_H264_HRD_DELAY_MAX		GENMASK(23, 0)
+
 #define CEDRUS_ENC_H264_CONSTRAINT_SET0_FLAG	BIT(7)
 #define CEDRUS_ENC_H264_CONSTRAINT_SET1_FLAG	BIT(6)
 #define CEDRUS_ENC_H264_CONSTRAINT_SET2_FLAG	BIT(5)
@@ -28,6 +43,50 @@
 #define CEDRUS_ENC_H264_CONSTRAINT_SET4_FLAG	BIT(3)
 #define CEDRUS_ENC_H264_CONSTRAINT_SET5_FLAG	BIT(2)
 
+#define CEDRUS_ENC_H264_HEADER_BITS_SIZE	256
+#define CEDRUS_ENC_H264_NALU_PREFIX_SIZE	5
+#define CEDRUS_ENC_H264_NALU_MAX		8
+
+#define CEDRUS_ENC_H264_PPS_COUNT		4
+
+#define CEDRUS_ENC_H264_REF_COUNT		2
+#define CEDRUS_ENC_H264_LTR_COUNT		2
+#define CEDRUS_ENC_H264_TEMPORAL_LAYERS_MAX	CEDRUS_H264_ENC_QP_LAYERS_COUNT
+
+#define CEDRUS_ENC_H264_TFCNT_MB_SIZE		4
+#define CEDRUS_ENC_H264_DEBLK_MB_SIZE		128
+#define CEDRUS_ENC_H264_DENOISE_MAX		100
+#define CEDRUS_ENC_H264_DENOISE_PIC_VAR		8
+
+#define CEDRUS_ENC_H264_AQ_STRENGTH_MAX		8
+/* Picture order count gap that keeps 16-bit LSBs unambiguous. */
+#define CEDRUS_ENC_H264_VFR_POC_GAP_MAX		BIT(14)
+#define CEDRUS_ENC_H264_DPB_COUNT \
+	(CEDRUS_ENC_H264_REF_COUNT + CEDRUS_ENC_H264_LTR_COUNT + 1 + \
+	 CEDRUS_H264_ENC_REC_EXPORT_COUNT)
+
+#define CEDRUS_ENC_H264_CABAC_INIT_IDC_COUNT	3
+#define CEDRUS_ENC_H264_CABAC_PROBE_PERIOD	32
+
+#define CEDRUS_ENC_H264_QP_COUNT		52
+
+/* Constant quality: per-macroblock pixel MAD of the quality base QP. */
+#define CEDRUS_ENC_H264_CQ_MAD_SHIFT		4
+#define CEDRUS_ENC_H264_CQ_MAD_REF		8
+#define CEDRUS_ENC_H264_CQ_QP_DELTA_MAX		6
+#define CEDRUS_ENC_H264_HISTOGRAM_SIZE_BINS	24
+
+/* Lookahead signatures average a square of samples per cell of a grid. */
+#define CEDRUS_ENC_H264_LOOKAHEAD_GRID		8
+#define CEDRUS_ENC_H264_LOOKAHEAD_SAMPLES	4
+#define CEDRUS_ENC_H264_LOOKAHEAD_SIGN_SIZE \
+	(CEDRUS_ENC_H264_LOOKAHEAD_GRID * CEDRUS_ENC_H264_LOOKAHEAD_GRID)
+/* Mean absolute signature differences, out of 255. */
+#define CEDRUS_ENC_H264_LOOKAHEAD_CUT		24
+#define CEDRUS_ENC_H264_LOOKAHEAD_STATIC	1
+#define CEDRUS_ENC_H264_LOOKAHEAD_QP_CUT	2
+#define CEDRUS_ENC_H264_LOOKAHEAD_QP_STATIC	(-1)
+
 enum cedrus_enc_h264_frame_type {
 	CEDRUS_ENC_H264_FRAME_TYPE_IDR,
 	CEDRUS_ENC_H264_FRAME_TYPE_I,
@@ -35,6 +94,13 @@ enum cedrus_enc_h264_frame_type {
 	CEDRUS_ENC_H264_FRAME_TYPE_B,
 };
 
+enum cedrus_enc_h264_histogram_type {
+	CEDRUS_ENC_H264_HISTOGRAM_TYPE_I,
+	CEDRUS_ENC_H264_HISTOGRAM_TYPE_P,
+	CEDRUS_ENC_H264_HISTOGRAM_TYPE_B,
+	CEDRUS_ENC_H264_HISTOGRAM_TYPES_COUNT,
+};
+
 enum cedrus_enc_h264_step {
 	CEDRUS_ENC_H264_STEP_START,
 	CEDRUS_ENC_H264_STEP_SPS,
@@ -42,50 +108,295 @@ enum cedrus_enc_h264_step {
 	CEDRUS_ENC_H264_STEP_SLICE,
 };
 
+/* Requests from the controls, consumed by the job path. */
+enum cedrus_enc_h264_event {
+	CEDRUS_ENC_H264_EVENT_KEY_FRAME,
+	CEDRUS_ENC_H264_EVENT_SKIP_FRAME,
+	CEDRUS_ENC_H264_EVENT_LTR_MARK,
+	CEDRUS_ENC_H264_EVENT_SPS_INVALIDATE,
+	CEDRUS_ENC_H264_EVENT_PPS_INVALIDATE,
+	CEDRUS_ENC_H264_EVENT_INTRA_REFRESH_RESET,
+	CEDRUS_ENC_H264_EVENT_FRAME_BUDGET,
+	CEDRUS_ENC_H264_EVENT_INTRA_REFRESH_WAVE,
+};
+
+struct cedrus_enc_h264_picture {
+	void		*rec;
+	dma_addr_t	rec_dma;
+	unsigned int	rec_size;
+	unsigned int	rec_luma_size;
+	unsigned int	rec_chroma_size;
+
+	/* Exported reconstruction, valid for the frame of the timestamp. */
+	struct dma_buf	*rec_dmabuf;
+	u64		rec_timestamp;
+	bool		rec_valid;
+	unsigned int	rec_sequence;
+
+	void		*subpix;
+	dma_addr_t	subpix_dma;
+	unsigned int	subpix_size;
+	unsigned int	subpix_stride;
+
+	unsigned int	refcount;
+};
+
+/* XXX: Motion vector record layout, as taken from the vendor library. */
+struct cedrus_enc_h264_mv_info {
+	__le16	mv_x;
+	__le16	mv_y;
+	__le16	sad;
+	__le16	reserved;
+} __packed;
+
+struct cedrus_enc_h264_roi {
+	unsigned int	left_mb;
+	unsigned int	top_mb;
+	unsigned int	right_mb;
+	unsigned int	bottom_mb;
+	int		qp_delta;
+};
+
 struct cedrus_enc_h264_job {
 	unsigned int	nal_ref_idc;
 	unsigned int	frame_type;
 	unsigned int	frame_num;
 	unsigned int	pic_order_cnt_lsb;
 	unsigned int	qp;
+	bool		skip;
 
 	unsigned int	seq_parameter_set_id;
 	unsigned int	pic_parameter_set_id;
 	unsigned int	idr_pic_id;
 
 	unsigned int	profile_idc;
+	int		level;
 	unsigned int	level_idc;
 	unsigned int	constraint_set_flags;
 	unsigned int	entropy_coding_mode_flag;
+	unsigned int	constrained_intra_pred_flag;
 	unsigned int	chroma_qp_index_offset;
 	unsigned int	disable_deblocking_filter_idc;
 	int		slice_alpha_c0_offset_div2;
 	int		slice_beta_offset_div2;
 
 	unsigned int	cabac_init_idc;
+	bool		cabac_probe;
+
+	struct cedrus_enc_h264_roi	roi[CEDRUS_H264_ENC_ROI_COUNT];
+	unsigned int			roi_count;
+
+	/* QP increase of the background, outside of the regions of interest. */
+	unsigned int			background_qp_delta;
+
+	bool				denoise;
+	unsigned int			denoise_max_coef;
+
+	unsigned int			aq_strength;
+
+	unsigned int			preset;
+	unsigned int			mb_cycles_max;
+
+	bool				thumbnail;
+	unsigned int			thumbnail_offset;
+	unsigned int			thumbnail_stride;
+
+	bool				mv_info;
+	unsigned int			mv_info_offset;
+
+	bool				cost_map;
+	unsigned int			cost_map_offset;
+
+	unsigned int			headroom;
+	/* Size of the frames packed before this one in the coded buffer. */
+	unsigned int			offset;
+
+	bool				intra_refresh;
+	bool				intra_refresh_wave;
+	unsigned int			intra_refresh_period;
+	unsigned int			intra_refresh_start_mb;
+	unsigned int			intra_refresh_end_mb;
+
+	bool				recovery_point;
+	bool				recovery_exact;
+	unsigned int			recovery_frame_cnt;
+
+	/* Hypothetical reference decoder delays, in 90 kHz units or ticks. */
+	bool				hrd;
+	bool				hrd_buffering_period;
+	unsigned int			hrd_initial_delay;
+	unsigned int			hrd_removal_delay;
+	unsigned int			hrd_output_delay;
+
+	unsigned int			slice_mb_rows;
+	unsigned int			slice_count;
+	unsigned int			slice_index;
+
+	/* Interlaced pictures are encoded as two fields, in temporal order. */
+	unsigned int			field_count;
+	unsigned int			field_index;
+	bool				field_bottom_first;
+
+	/* Start codes of the current slice, replaced with NAL unit lengths. */
+	unsigned int			nalu_offsets[CEDRUS_ENC_H264_NALU_MAX];
+	unsigned int			nalu_count;
+
+	/* Frames overflowing the coded buffer start over with a higher QP. */
+	bool				overflow_pending;
+	unsigned int			overflow_retries;
+	enum cedrus_enc_h264_step	overflow_step;
+
+	struct cedrus_enc_h264_picture	*rec;
+	struct cedrus_enc_h264_picture	*ref;
+	struct cedrus_enc_h264_picture	*ref1;
+	struct cedrus_enc_h264_picture	*last;
+
+	unsigned int			b_pending;
+
+	bool				ltr_mark;
+	unsigned int			ltr_mark_index;
+	bool				ref_ltr;
+	unsigned int			ref_ltr_index;
+
+	unsigned int			temporal_id;
+	bool				ref_base;
+	unsigned int			ref_base_frame_num;
+};
+
+struct cedrus_enc_h264_bits {
+	u32		data[CEDRUS_ENC_H264_HEADER_BITS_SIZE / 4];
+	unsigned int	count;
 };
 
 struct cedrus_enc_h264_state {
 	unsigned int	step;
+	bool		sps_valid;
+	bool		pps_valid;
+	unsigned int	pps_id;
+
+	bool		intra_only;
+	bool		interlaced;
+	bool		vfr;
 
 	unsigned int	gop_index;
+	unsigned int	idr_pic_id;
 	unsigned int	frame_num;
 	unsigned int	pic_order_cnt_lsb;
 
+	unsigned int	b_frames;
+	unsigned int	b_count;
+	unsigned int	b_pic_order_cnt_lsb;
+
+	/*
+	 * Variable frame rate picture order counts, in ticks since the
+	 * timestamp of the IDR frame: the next one after the last frame not
+	 * held, bounds for the held B frames and how many are left.
+	 */
+	u64		vfr_timestamp;
+	u32		vfr_poc;
+	u32		vfr_poc_b;
+	u32		vfr_poc_anchor;
+	unsigned int	vfr_b_left;
+
+	/* Entries of the GOP pattern in use, or 0 without a pattern. */
+	unsigned int	gop_pattern_count;
+	/* GOP pattern QP deltas of the held B frames, in encoding order. */
+	int		b_qp_delta[CEDRUS_H264_ENC_GOP_PATTERN_MAX];
+	unsigned int	b_index;
+
+	unsigned int	ltr_count;
+
+	/* Level signalled in the current sequence. */
+	int		level;
+
+	unsigned int	temporal_layers;
+	unsigned int	temporal_index;
+	unsigned int	temporal_base_frame_num;
+
 	unsigned int	qp_init;
+	/* QP raise of the fast start ramp, down by one with each frame. */
+	unsigned int	fast_start_qp_delta;
+
+	unsigned int	intra_refresh_index;
+	/* Frames of the requested wave, or zero when none is running. */
+	unsigned int	intra_refresh_wave;
+	unsigned int	intra_refresh_wave_index;
+
+	unsigned int	rc_qp;
+	s64		rc_fullness;
+	/* Fullness of a buffer of the level CPB size, without the window. */
+	s64		rc_level_fullness;
+	unsigned int	rc_mad_sum;
+	/* Frame MAD of the last P frame, for the complexity trend. */
+	unsigned int	rc_mad;
+	/* Frame budget the QP was last adjusted for, in bits. */
+	s64		rc_frame_bits;
+	/* Constant quality: smoothed MAD per macroblock, in fixed point. */
+	unsigned int	cq_mad;
+
+	/*
+	 * Coded picture buffer size and input bitrate signalled in the SPS,
+	 * with the buffer fullness as seen from the encoder, in bits.
+	 */
+	unsigned int	hrd_size;
+	unsigned int	hrd_bitrate;
+	s64		hrd_fullness;
+	/* Ticks since the last buffering period. */
+	unsigned int	hrd_ticks;
+
+	unsigned int	scene_mad_sum;
+	bool		scene_change;
+
+	/* Lookahead signature of the last source picture, when valid. */
+	u8		lookahead_sign[CEDRUS_ENC_H264_LOOKAHEAD_SIGN_SIZE];
+	bool		lookahead_sign_valid;
+
+	/* Lookahead signature of the last encoded P frame, when valid. */
+	u8		static_sign[CEDRUS_ENC_H264_LOOKAHEAD_SIGN_SIZE];
+	bool		static_sign_valid;
+
+	/* Smoothed size of P frames coded with each CABAC table, in bits. */
+	unsigned int	cabac_init_idc;
+	unsigned int	cabac_probe_index;
+	u32		cabac_bits[CEDRUS_ENC_H264_CABAC_INIT_IDC_COUNT];
+
+	struct v4l2_fract	timeperframe;
+};
+
+/* Frame sizes are binned by powers of two, in bytes. */
+struct cedrus_enc_h264_histogram {
+	u32		size[CEDRUS_ENC_H264_HISTOGRAM_TYPES_COUNT]
+			    [CEDRUS_ENC_H264_HISTOGRAM_SIZE_BINS];
+	u32		qp[CEDRUS_ENC_H264_HISTOGRAM_TYPES_COUNT]
+			  [CEDRUS_ENC_H264_QP_COUNT];
+	spinlock_t	lock;
 };
 
 struct cedrus_enc_h264_context {
 	struct cedrus_enc_h264_state	state;
+	struct cedrus_enc_h264_bits	header_bits;
+	unsigned int			header_prefix_count;
+	unsigned int			header_slice_start;
+	unsigned int			header_flush_start;
+	struct cedrus_enc_h264_bits	sps_bits;
+	struct cedrus_enc_h264_bits	pps_bits;
 
-	void				*mb_info;
-	dma_addr_t			mb_info_dma;
-	unsigned int			mb_info_size;
-
-	dma_addr_t			subpix_last_dma;
+	void				*tfcnt;
+	dma_addr_t			tfcnt_dma;
+	unsigned int			tfcnt_size;
 
-	dma_addr_t			rec_last_dma;
-	unsigned int			rec_last_luma_size;
+	struct cedrus_enc_h264_picture	dpb[CEDRUS_ENC_H264_DPB_COUNT];
+	struct cedrus_enc_h264_picture	*dpb_last;
+	struct cedrus_enc_h264_picture	*dpb_prev;
+	struct cedrus_enc_h264_picture	*dpb_base;
+	struct cedrus_enc_h264_picture	*dpb_ltr[CEDRUS_ENC_H264_LTR_COUNT];
+	/* Last reference field of each parity, top first. */
+	struct cedrus_enc_h264_picture	*dpb_field[2];
+	int				dpb_last_ltr_index;
+	unsigned int			dpb_count;
+	unsigned int			dpb_sequence;
+	bool				dpb_exported;
+	spinlock_t			dpb_export_lock;
 
 	unsigned int			width_mbs;
 	unsigned int			height_mbs;
@@ -94,40 +405,104 @@ struct cedrus_enc_h264_context {
 	unsigned int			log2_max_pic_order_cnt_lsb;
 	unsigned int			log2_max_frame_num;
 
-	int				prepend_sps_pps_idr;
-	int				profile;
-	int				level;
-	int				vui_sar_enable;
-	int				vui_sar_idc;
-	int				vui_ext_sar_width;
-	int				vui_ext_sar_height;
-	int				entropy_mode;
-	int				chroma_qp_index_offset;
-	int				loop_filter_mode;
-	int				loop_filter_alpha;
-	int				loop_filter_beta;
-	int				qp_min;
-	int				qp_max;
-	int				qp_i;
-	int				qp_p;
-	int				gop_closure;
-	int				gop_size;
-	int				gop_open_i_period;
+	/* Control values, as sampled for the current job. */
+	struct_group_tagged(cedrus_enc_h264_config, config,
+		int			prepend_sps_pps_idr;
+		int			au_delimiter;
+		int			sei;
+		int			header_mode;
+		int			avcc;
+		int			profile;
+		int			level;
+		int			level_auto;
+		int			vui_sar_enable;
+		int			vui_sar_idc;
+		int			vui_ext_sar_width;
+		int			vui_ext_sar_height;
+		int			entropy_mode;
+		int			chroma_qp_index_offset;
+		int			loop_filter_mode;
+		int			loop_filter_alpha;
+		int			loop_filter_beta;
+		int			qp_min;
+		int			qp_max;
+		int			qp_i;
+		int			qp_p;
+		int			qp_b;
+		int			gop_closure;
+		int			gop_size;
+		int			gop_open_i_period;
+		int			b_frames;
+		int			frame_skip_mode;
+		int			rc_enable;
+		int			bitrate_mode;
+		int			bitrate;
+		int			bitrate_peak;
+		int			vbv_size;
+		int			constant_quality;
+		int			intra_refresh_period;
+		int			intra_refresh_wave_frames;
+		int			denoise;
+		int			aq_strength;
+		int			fast_start;
+		int			vfr;
+		int			static_skip;
+		int			preset;
+		int			time_budget;
+		int			max_latency;
+		int			overflow_retries;
+		int			overflow_qp_delta;
+		int			scene_change;
+		int			thumbnail;
+		int			headroom;
+		int			frames_packed;
+		int			mv_info;
+		int			cost_map;
+		int			rec_export;
+		int			error_resilience;
+		int			lookahead;
+		int			slice_mode;
+		int			slice_max_mb;
+		int			ltr_count;
+		int			hierarchical_coding;
+		int			hierarchical_coding_layer;
+		unsigned int		ltr_mark_index;
+		s32			roi[CEDRUS_H264_ENC_ROI_COUNT]
+					   [CEDRUS_H264_ENC_ROI_FIELDS_COUNT];
+		s32			frame_budget
+				[CEDRUS_H264_ENC_FRAME_BUDGET_FIELDS_COUNT];
+		s32			qp_layer_delta
+					[CEDRUS_H264_ENC_QP_LAYERS_COUNT];
+		int			qp_non_ref_delta;
+		int			static_background;
+		s32			gop_pattern
+				[CEDRUS_H264_ENC_GOP_PATTERN_MAX]
+				[CEDRUS_H264_ENC_GOP_PATTERN_FIELDS_COUNT];
+	);
+
+	/*
+	 * Control values, as last set. Writers are serialized by the control
+	 * handler lock, which the job path does not take.
+	 */
+	struct cedrus_enc_h264_config	ctrls;
+	seqcount_mutex_t		ctrls_seq;
+	unsigned long			ctrls_events;
+	unsigned int			ctrls_ltr_use_mask;
+
 	bool				force_key_frame;
+	bool				force_skip_frame;
+	bool				frame_budget_pending;
+	bool				intra_refresh_wave_pending;
+	bool				ltr_mark;
+	unsigned int			ltr_use_mask;
 
-	struct v4l2_ctrl		*entropy_mode_ctrl;
-};
+	/* Frames packed in the current coded buffer so far. */
+	unsigned int			pack_count;
 
-struct cedrus_enc_h264_buffer {
-	void		*rec;
-	dma_addr_t	rec_dma;
-	unsigned int	rec_size;
-	unsigned int	rec_luma_size;
-	unsigned int	rec_chroma_size;
+	struct v4l2_ctrl		*entropy_mode_ctrl;
 
-	void		*subpix;
-	dma_addr_t	subpix_dma;
-	unsigned int	subpix_size;
+	struct cedrus_enc_h264_histogram	histogram;
+	struct dentry				*debugfs;
 };
 
 extern const struct cedrus_engine cedrus_enc_h264;
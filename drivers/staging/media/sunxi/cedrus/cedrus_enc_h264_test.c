@@ -0,0 +1,258 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Cedrus Video Engine Driver
+ *
+ * Copyright 2023 Bootlin
+ * Author: Paul Kocialkowski <paul.kocialkowski@bootlin.com>
+ */
+
+/*
+ * This file is included from cedrus_enc_h264.c so that the static header
+ * writers can be tested without the hardware.
+ */
+
+#include <kunit/test.h>
+#include <linux/ktime.h>
+
+#define CEDRUS_ENC_H264_TEST_TIMING_LOOPS	1000
+
+struct cedrus_enc_h264_test {
+	struct cedrus_context		ctx;
+	struct cedrus_enc_h264_context	h264_ctx;
+	struct cedrus_enc_h264_job	job;
+	struct cedrus_enc_h264_bits	bits;
+	struct cedrus_enc_h264_bits	escaped;
+};
+
+/* Constrained baseline 1280x720 at 30 fps, level 3.1. */
+static const u8 cedrus_enc_h264_test_data_sps[] = {
+	0x00, 0x00, 0x00, 0x01, 0x67, 0x42, 0xc0, 0x1f, 0xf4, 0x02, 0x80, 0x2d,
+	0x90, 0x80, 0x00, 0x00, 0x00, 0x80, 0x00, 0x00, 0x1e, 0x46, 0xd0, 0x40,
+	0x21, 0x50,
+};
+
+static const u8 cedrus_enc_h264_test_data_sps_escaped[] = {
+	0x00, 0x00, 0x00, 0x01, 0x67, 0x42, 0xc0, 0x1f, 0xf4, 0x02, 0x80, 0x2d,
+	0x90, 0x80, 0x00, 0x00, 0x03, 0x00, 0x80, 0x00, 0x00, 0x1e, 0x46, 0xd0,
+	0x40, 0x21, 0x50,
+};
+
+static const u8 cedrus_enc_h264_test_data_pps_cavlc[] = {
+	0x00, 0x00, 0x00, 0x01, 0x68, 0xce, 0x3c, 0x80,
+};
+
+static const u8 cedrus_enc_h264_test_data_pps_cabac[] = {
+	0x00, 0x00, 0x00, 0x01, 0x68, 0xee, 0x3c, 0x80,
+};
+
+static int cedrus_enc_h264_test_init(struct kunit *test)
+{
+	struct cedrus_enc_h264_test *data;
+	struct cedrus_context *ctx;
+	struct v4l2_pix_format *pix_format;
+
+	data = kunit_kzalloc(test, sizeof(*data), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, data);
+
+	ctx = &data->ctx;
+	ctx->engine_ctx = &data->h264_ctx;
+	ctx->engine_job = &data->job;
+
+	pix_format = &ctx->v4l2.format_coded.fmt.pix;
+	pix_format->width = 1280;
+	pix_format->height = 720;
+
+	ctx->v4l2.selection_picture.width = 1280;
+	ctx->v4l2.selection_picture.height = 720;
+	ctx->v4l2.timeperframe_coded.numerator = 1;
+	ctx->v4l2.timeperframe_coded.denominator = 30;
+
+	data->h264_ctx.width_mbs = 80;
+	data->h264_ctx.height_mbs = 45;
+	data->h264_ctx.log2_max_frame_num = 4;
+	data->h264_ctx.log2_max_pic_order_cnt_lsb = 4;
+	data->h264_ctx.state.qp_init = 26;
+	data->h264_ctx.state.timeperframe = ctx->v4l2.timeperframe_coded;
+
+	data->job.profile_idc = 66;
+	data->job.constraint_set_flags = CEDRUS_ENC_H264_CONSTRAINT_SET0_FLAG |
+					 CEDRUS_ENC_H264_CONSTRAINT_SET1_FLAG;
+	data->job.level_idc = 31;
+
+	cedrus_enc_h264_bits_reset(&data->bits);
+	cedrus_enc_h264_bits_reset(&data->escaped);
+
+	test->priv = data;
+
+	return 0;
+}
+
+#define CEDRUS_ENC_H264_TEST_BITS_EXPECT(test, bits, expected) \
+	cedrus_enc_h264_test_bits_check(test, bits, expected, \
+					ARRAY_SIZE(expected))
+
+static void cedrus_enc_h264_test_bits_check(struct kunit *test,
+					    struct cedrus_enc_h264_bits *bits,
+					    const u8 *expected,
+					    unsigned int size)
+{
+	unsigned int i;
+
+	KUNIT_ASSERT_EQ(test, bits->count, size * 8);
+
+	for (i = 0; i < size; i++)
+		KUNIT_EXPECT_EQ_MSG(test, cedrus_enc_h264_bits_byte(bits, i),
+				    expected[i], "byte %u", i);
+}
+
+static void cedrus_enc_h264_test_bits_ue(struct kunit *test)
+{
+	struct cedrus_enc_h264_test *data = test->priv;
+	struct cedrus_enc_h264_bits *bits = &data->bits;
+
+	/* Codes 1, 010, 011, 00100 and 0001000. */
+	cedrus_enc_h264_bits_ue(bits, 0);
+	cedrus_enc_h264_bits_ue(bits, 1);
+	cedrus_enc_h264_bits_ue(bits, 2);
+	cedrus_enc_h264_bits_ue(bits, 3);
+	cedrus_enc_h264_bits_ue(bits, 7);
+
+	KUNIT_EXPECT_EQ(test, bits->count, 19);
+	KUNIT_EXPECT_EQ(test, bits->data[0], 0xa6410000);
+}
+
+static void cedrus_enc_h264_test_bits_se(struct kunit *test)
+{
+	struct cedrus_enc_h264_test *data = test->priv;
+	struct cedrus_enc_h264_bits *bits = &data->bits;
+
+	/* Codes 010, 011, 00100, 00101 and 1. */
+	cedrus_enc_h264_bits_se(bits, 1);
+	cedrus_enc_h264_bits_se(bits, -1);
+	cedrus_enc_h264_bits_se(bits, 2);
+	cedrus_enc_h264_bits_se(bits, -2);
+	cedrus_enc_h264_bits_se(bits, 0);
+
+	KUNIT_EXPECT_EQ(test, bits->count, 17);
+	KUNIT_EXPECT_EQ(test, bits->data[0], 0x4c858000);
+}
+
+static void cedrus_enc_h264_test_bits_append(struct kunit *test)
+{
+	struct cedrus_enc_h264_test *data = test->priv;
+	struct cedrus_enc_h264_bits *bits = &data->bits;
+
+	/* The second value straddles the first two words. */
+	cedrus_enc_h264_bits_append(bits, 0x3, 30);
+	cedrus_enc_h264_bits_append(bits, 0xf, 8);
+
+	KUNIT_EXPECT_EQ(test, bits->count, 38);
+	KUNIT_EXPECT_EQ(test, bits->data[0], 0x0000000c);
+	KUNIT_EXPECT_EQ(test, bits->data[1], 0x3c000000);
+}
+
+static void cedrus_enc_h264_test_bits_escape(struct kunit *test)
+{
+	static const u8 source[] = {
+		0x00, 0x00, 0x00, 0x01, 0x67, 0x00, 0x00, 0x01, 0x00, 0x00,
+		0x00, 0x00, 0x03,
+	};
+	static const u8 expected[] = {
+		0x00, 0x00, 0x00, 0x01, 0x67, 0x00, 0x00, 0x03, 0x01, 0x00,
+		0x00, 0x03, 0x00, 0x00, 0x03, 0x03,
+	};
+	struct cedrus_enc_h264_test *data = test->priv;
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(source); i++)
+		cedrus_enc_h264_bits_u8(&data->bits, source[i]);
+
+	cedrus_enc_h264_bits_escape(&data->escaped, &data->bits);
+
+	CEDRUS_ENC_H264_TEST_BITS_EXPECT(test, &data->escaped, expected);
+}
+
+static void cedrus_enc_h264_test_sps(struct kunit *test)
+{
+	struct cedrus_enc_h264_test *data = test->priv;
+
+	cedrus_enc_h264_job_configure_sps(&data->ctx, &data->bits);
+
+	CEDRUS_ENC_H264_TEST_BITS_EXPECT(test, &data->bits,
+					 cedrus_enc_h264_test_data_sps);
+
+	cedrus_enc_h264_bits_escape(&data->escaped, &data->bits);
+
+	CEDRUS_ENC_H264_TEST_BITS_EXPECT(test, &data->escaped,
+					 cedrus_enc_h264_test_data_sps_escaped);
+}
+
+static void cedrus_enc_h264_test_pps(struct kunit *test)
+{
+	struct cedrus_enc_h264_test *data = test->priv;
+
+	cedrus_enc_h264_job_configure_pps(&data->ctx, &data->bits);
+
+	CEDRUS_ENC_H264_TEST_BITS_EXPECT(test, &data->bits,
+					 cedrus_enc_h264_test_data_pps_cavlc);
+
+	cedrus_enc_h264_bits_reset(&data->bits);
+	data->job.entropy_coding_mode_flag = 1;
+
+	cedrus_enc_h264_job_configure_pps(&data->ctx, &data->bits);
+
+	CEDRUS_ENC_H264_TEST_BITS_EXPECT(test, &data->bits,
+					 cedrus_enc_h264_test_data_pps_cabac);
+}
+
+static void cedrus_enc_h264_test_timing(struct kunit *test)
+{
+	struct cedrus_enc_h264_test *data = test->priv;
+	ktime_t start;
+	s64 elapsed;
+	unsigned int i;
+
+	/* Parameter sets are serialized and escaped at each stream start. */
+	start = ktime_get();
+
+	for (i = 0; i < CEDRUS_ENC_H264_TEST_TIMING_LOOPS; i++) {
+		cedrus_enc_h264_bits_reset(&data->bits);
+		cedrus_enc_h264_job_configure_sps(&data->ctx, &data->bits);
+
+		cedrus_enc_h264_bits_reset(&data->escaped);
+		cedrus_enc_h264_bits_escape(&data->escaped, &data->bits);
+
+		cedrus_enc_h264_bits_reset(&data->bits);
+		cedrus_enc_h264_job_configure_pps(&data->ctx, &data->bits);
+
+		cedrus_enc_h264_bits_escape(&data->escaped, &data->bits);
+	}
+
+	elapsed = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	kunit_info(test, "sps and pps: %lld ns per iteration\n",
+		   div_s64(elapsed, CEDRUS_ENC_H264_TEST_TIMING_LOOPS));
+
+	KUNIT_EXPECT_EQ(test, data->escaped.count,
+			(ARRAY_SIZE(cedrus_enc_h264_test_data_sps_escaped) +
+			 ARRAY_SIZE(cedrus_enc_h264_test_data_pps_cavlc)) * 8);
+}
+
+static struct kunit_case cedrus_enc_h264_test_cases[] = {
+	KUNIT_CASE(cedrus_enc_h264_test_bits_ue),
+	KUNIT_CASE(cedrus_enc_h264_test_bits_se),
+	KUNIT_CASE(cedrus_enc_h264_test_bits_append),
+	KUNIT_CASE(cedrus_enc_h264_test_bits_escape),
+	KUNIT_CASE(cedrus_enc_h264_test_sps),
+	KUNIT_CASE(cedrus_enc_h264_test_pps),
+	KUNIT_CASE(cedrus_enc_h264_test_timing),
+	{}
+};
+
+static struct kunit_suite cedrus_enc_h264_test_suite = {
+	.name = "cedrus-enc-h264",
+	.init = cedrus_enc_h264_test_init,
+	.test_cases = cedrus_enc_h264_test_cases,
+};
+
+kunit_test_suite(cedrus_enc_h264_test_suite);
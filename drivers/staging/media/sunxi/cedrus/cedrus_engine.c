@@ -12,7 +12,10 @@
 
 #include "cedrus.h"
 #include "cedrus_context.h"
+#include "cedrus_debugfs.h"
 #include "cedrus_engine.h"
+#include "cedrus_fault.h"
+#include "cedrus_trace.h"
 
 /* Ctrl */
 
@@ -92,6 +95,36 @@ void cedrus_engine_cleanup(struct cedrus_context *ctx)
 	engine->ops->cleanup(ctx);
 }
 
+int cedrus_engine_stop(struct cedrus_context *ctx)
+{
+	const struct cedrus_engine *engine = ctx->engine;
+
+	if (WARN_ON(!engine || !engine->ops))
+		return -ENODEV;
+
+	/* The context is only kept when it can be restarted later. */
+	if (!engine->ops->restart)
+		return -EOPNOTSUPP;
+
+	if (engine->ops->stop)
+		engine->ops->stop(ctx);
+
+	return 0;
+}
+
+int cedrus_engine_restart(struct cedrus_context *ctx)
+{
+	const struct cedrus_engine *engine = ctx->engine;
+
+	if (WARN_ON(!engine || !engine->ops))
+		return -ENODEV;
+
+	if (!engine->ops->restart)
+		return -EOPNOTSUPP;
+
+	return engine->ops->restart(ctx);
+}
+
 /* Buffer */
 
 int cedrus_engine_buffer_setup(struct cedrus_context *ctx,
@@ -154,9 +187,54 @@ void cedrus_engine_job_trigger(struct cedrus_context *ctx)
 	if (WARN_ON(!engine || !engine->ops || !engine->ops->job_trigger))
 		return;
 
+	trace_cedrus_job_trigger(ctx);
+	cedrus_debugfs_job_trigger(ctx);
+
+	/* The job is left for the watchdog to time out. */
+	if (cedrus_fault_job_stall())
+		return;
+
 	engine->ops->job_trigger(ctx);
 }
 
+int cedrus_engine_job_continue(struct cedrus_context *ctx)
+{
+	const struct cedrus_engine *engine = ctx->engine;
+
+	if (WARN_ON(!engine || !engine->ops || !engine->ops->job_continue))
+		return -ENODEV;
+
+	return engine->ops->job_continue(ctx);
+}
+
+bool cedrus_engine_job_resume_check(struct cedrus_context *ctx)
+{
+	const struct cedrus_engine *engine = ctx->engine;
+
+	return engine && engine->ops && engine->ops->job_resume;
+}
+
+int cedrus_engine_job_resume(struct cedrus_context *ctx)
+{
+	const struct cedrus_engine *engine = ctx->engine;
+
+	if (WARN_ON(!engine || !engine->ops || !engine->ops->job_resume))
+		return -ENODEV;
+
+	return engine->ops->job_resume(ctx);
+}
+
+int cedrus_engine_job_header(struct cedrus_context *ctx,
+			     struct vb2_v4l2_buffer *buffer)
+{
+	const struct cedrus_engine *engine = ctx->engine;
+
+	if (WARN_ON(!engine || !engine->ops || !engine->ops->job_header))
+		return -ENODEV;
+
+	return engine->ops->job_header(ctx, buffer);
+}
+
 void cedrus_engine_job_finish(struct cedrus_context *ctx, int state)
 {
 	const struct cedrus_engine *engine = ctx->engine;
@@ -167,6 +245,19 @@ void cedrus_engine_job_finish(struct cedrus_context *ctx, int state)
 	engine->ops->job_finish(ctx, state);
 }
 
+/* Ioctl */
+
+long cedrus_engine_ioctl(struct cedrus_context *ctx, unsigned int cmd,
+			 void *arg)
+{
+	const struct cedrus_engine *engine = ctx->engine;
+
+	if (!engine || !engine->ops || !engine->ops->ioctl)
+		return -ENOTTY;
+
+	return engine->ops->ioctl(ctx, cmd, arg);
+}
+
 /* IRQ */
 
 irqreturn_t cedrus_engine_irq_status(struct cedrus_context *ctx)
@@ -14,6 +14,7 @@
 
 struct cedrus_context;
 struct cedrus_buffer;
+struct vb2_v4l2_buffer;
 
 struct cedrus_engine_ops {
 	int (*ctrl_validate)(struct cedrus_context *ctx,
@@ -26,6 +27,8 @@ struct cedrus_engine_ops {
 
 	int (*setup)(struct cedrus_context *ctx);
 	void (*cleanup)(struct cedrus_context *ctx);
+	void (*stop)(struct cedrus_context *ctx);
+	int (*restart)(struct cedrus_context *ctx);
 
 	int (*buffer_setup)(struct cedrus_context *ctx,
 			    struct cedrus_buffer *buffer);
@@ -35,7 +38,14 @@ struct cedrus_engine_ops {
 	int (*job_prepare)(struct cedrus_context *ctx);
 	int (*job_configure)(struct cedrus_context *ctx);
 	void (*job_trigger)(struct cedrus_context *ctx);
+	int (*job_continue)(struct cedrus_context *ctx);
+	/* Continue after other contexts used the engine, from a suspend. */
+	int (*job_resume)(struct cedrus_context *ctx);
 	void (*job_finish)(struct cedrus_context *ctx, int state);
+	int (*job_header)(struct cedrus_context *ctx,
+			  struct vb2_v4l2_buffer *buffer);
+
+	long (*ioctl)(struct cedrus_context *ctx, unsigned int cmd, void *arg);
 
 	int (*irq_status)(struct cedrus_context *ctx);
 	void (*irq_clear)(struct cedrus_context *ctx);
@@ -52,6 +62,12 @@ struct cedrus_engine {
 
 	u32					pixelformat;
 	bool					slice_based;
+	bool					secondary_output;
+	bool					interlaced;
+	bool					qp_map;
+
+	/* Nominal engine cycles per macroblock, for the throughput estimate. */
+	unsigned int				mb_cycles;
 
 	const struct v4l2_ctrl_config		*ctrl_configs;
 	unsigned int				ctrl_configs_count;
@@ -80,6 +96,8 @@ int cedrus_engine_format_configure(struct cedrus_context *ctx);
 
 int cedrus_engine_setup(struct cedrus_context *ctx);
 void cedrus_engine_cleanup(struct cedrus_context *ctx);
+int cedrus_engine_stop(struct cedrus_context *ctx);
+int cedrus_engine_restart(struct cedrus_context *ctx);
 
 /* Buffer */
 
@@ -93,7 +111,17 @@ void cedrus_engine_buffer_cleanup(struct cedrus_context *ctx,
 int cedrus_engine_job_prepare(struct cedrus_context *ctx);
 int cedrus_engine_job_configure(struct cedrus_context *ctx);
 void cedrus_engine_job_trigger(struct cedrus_context *ctx);
+int cedrus_engine_job_continue(struct cedrus_context *ctx);
+bool cedrus_engine_job_resume_check(struct cedrus_context *ctx);
+int cedrus_engine_job_resume(struct cedrus_context *ctx);
 void cedrus_engine_job_finish(struct cedrus_context *ctx, int state);
+int cedrus_engine_job_header(struct cedrus_context *ctx,
+			     struct vb2_v4l2_buffer *buffer);
+
+/* Ioctl */
+
+long cedrus_engine_ioctl(struct cedrus_context *ctx, unsigned int cmd,
+			 void *arg);
 
 /* IRQ */
 
@@ -0,0 +1,62 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Cedrus Video Engine Driver
+ *
+ * Copyright 2023 Bootlin
+ * Author: Paul Kocialkowski <paul.kocialkowski@bootlin.com>
+ */
+
+#include <linux/fault-inject.h>
+
+#include "cedrus.h"
+#include "cedrus_fault.h"
+
+/*
+ * Faults are configured through the standard fault injection attributes
+ * (probability, interval, times, ...) in the device debugfs directory, see
+ * Documentation/fault-injection/fault-injection.rst:
+ * - fail_irq_drop ignores the job interrupt, leaving it to the watchdog;
+ * - fail_irq_error reports a job error instead of the hardware status;
+ * - fail_job_stall never triggers the hardware, so that the job times out;
+ * - fail_alloc fails auxiliary buffer allocations in engine setup.
+ */
+
+static DECLARE_FAULT_ATTR(cedrus_fault_irq_drop_attr);
+static DECLARE_FAULT_ATTR(cedrus_fault_irq_error_attr);
+static DECLARE_FAULT_ATTR(cedrus_fault_job_stall_attr);
+static DECLARE_FAULT_ATTR(cedrus_fault_alloc_attr);
+
+bool cedrus_fault_irq_drop(void)
+{
+	return should_fail(&cedrus_fault_irq_drop_attr, 1);
+}
+
+bool cedrus_fault_irq_error(void)
+{
+	return should_fail(&cedrus_fault_irq_error_attr, 1);
+}
+
+bool cedrus_fault_job_stall(void)
+{
+	return should_fail(&cedrus_fault_job_stall_attr, 1);
+}
+
+bool cedrus_fault_alloc(void)
+{
+	return should_fail(&cedrus_fault_alloc_attr, 1);
+}
+
+void cedrus_fault_setup(struct cedrus_device *dev)
+{
+	struct dentry *root = dev->debugfs.root;
+
+	/* Attributes are removed along with the debugfs root. */
+	fault_create_debugfs_attr("fail_irq_drop", root,
+				  &cedrus_fault_irq_drop_attr);
+	fault_create_debugfs_attr("fail_irq_error", root,
+				  &cedrus_fault_irq_error_attr);
+	fault_create_debugfs_attr("fail_job_stall", root,
+				  &cedrus_fault_job_stall_attr);
+	fault_create_debugfs_attr("fail_alloc", root,
+				  &cedrus_fault_alloc_attr);
+}
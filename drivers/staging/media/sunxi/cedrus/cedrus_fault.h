@@ -0,0 +1,53 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Cedrus Video Engine Driver
+ *
+ * Copyright 2023 Bootlin
+ * Author: Paul Kocialkowski <paul.kocialkowski@bootlin.com>
+ */
+
+#ifndef _CEDRUS_FAULT_H_
+#define _CEDRUS_FAULT_H_
+
+#include <linux/types.h>
+
+struct cedrus_device;
+
+#if IS_ENABLED(CONFIG_VIDEO_SUNXI_CEDRUS_FAULT_INJECTION)
+
+bool cedrus_fault_irq_drop(void);
+bool cedrus_fault_irq_error(void);
+bool cedrus_fault_job_stall(void);
+bool cedrus_fault_alloc(void);
+
+void cedrus_fault_setup(struct cedrus_device *dev);
+
+#else
+
+static inline bool cedrus_fault_irq_drop(void)
+{
+	return false;
+}
+
+static inline bool cedrus_fault_irq_error(void)
+{
+	return false;
+}
+
+static inline bool cedrus_fault_job_stall(void)
+{
+	return false;
+}
+
+static inline bool cedrus_fault_alloc(void)
+{
+	return false;
+}
+
+static inline void cedrus_fault_setup(struct cedrus_device *dev)
+{
+}
+
+#endif
+
+#endif
@@ -0,0 +1,793 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Cedrus Video Engine Driver
+ *
+ * Copyright 2023 Bootlin
+ * Author: Paul Kocialkowski <paul.kocialkowski@bootlin.com>
+ */
+
+#include <linux/dma-buf.h>
+#include <linux/dma-direct.h>
+#include <linux/dma-mapping.h>
+#include <linux/genalloc.h>
+#include <linux/iommu.h>
+#include <linux/jiffies.h>
+#include <linux/log2.h>
+#include <linux/module.h>
+#include <linux/of.h>
+#include <linux/of_reserved_mem.h>
+#include <linux/slab.h>
+
+#include "cedrus.h"
+#include "cedrus_context.h"
+#include "cedrus_fault.h"
+#include "cedrus_pool.h"
+
+/*
+ * The pool keeps auxiliary buffers that are only accessed by the hardware
+ * around for a while after they were freed, so that streams that are stopped
+ * and started again (e.g. when switching channels) can reuse them instead of
+ * going through the contiguous allocator each time.
+ */
+
+/*
+ * Buffers in use are accounted to the device, and to the context that
+ * allocated them unless they are shared scratch buffers. Past the device
+ * limit, allocations fail and contexts can't start streaming, instead of
+ * stalling the allocations of every other stream on memory compaction.
+ */
+
+static unsigned int cedrus_pool_limit_mb;
+module_param_named(memory_limit_mb, cedrus_pool_limit_mb, uint, 0644);
+MODULE_PARM_DESC(memory_limit_mb,
+		 "Auxiliary buffers memory limit in MiB (default: 0 for none)");
+
+/*
+ * A second memory region can be dedicated to auxiliary buffers, split in as
+ * many slots as streams are expected to run at the same time. Each context
+ * takes a slot when it starts streaming and allocates from it first, so that
+ * starting a stream neither depends on the state of the contiguous allocator
+ * nor on the buffers of other streams. Slot buffers go back to the slot when
+ * freed, instead of the pool entries, and don't count towards the limit.
+ */
+
+static unsigned int cedrus_pool_reserved_channels = 1;
+module_param_named(reserved_channels, cedrus_pool_reserved_channels, uint,
+		   0444);
+MODULE_PARM_DESC(reserved_channels,
+		 "Streams expected to share the reserved region (default: 1)");
+
+/* Size */
+
+static unsigned int cedrus_pool_size_class(unsigned int size)
+{
+	unsigned int step;
+
+	size = PAGE_ALIGN(size);
+
+	/* Size classes are spaced by an eighth of the next power of two. */
+	step = max_t(unsigned int, roundup_pow_of_two(size) / 8, PAGE_SIZE);
+
+	return ALIGN(size, step);
+}
+
+/* Entry */
+
+static void cedrus_pool_entry_release(struct cedrus_device *dev,
+				      struct cedrus_pool_entry *entry)
+{
+	struct cedrus_pool *pool = &dev->pool;
+
+	list_del(&entry->list);
+	pool->size -= entry->size;
+
+	dma_free_attrs(dev->dev, entry->size, entry->cpu, entry->dma,
+		       DMA_ATTR_NO_KERNEL_MAPPING);
+	kfree(entry);
+}
+
+/* Limit */
+
+static unsigned long cedrus_pool_limit(void)
+{
+	return (unsigned long)READ_ONCE(cedrus_pool_limit_mb) * SZ_1M;
+}
+
+bool cedrus_pool_limit_check(struct cedrus_device *dev)
+{
+	unsigned long limit = cedrus_pool_limit();
+
+	return !limit || atomic_long_read(&dev->pool.used) < limit;
+}
+
+/* Reserved region */
+
+static struct cedrus_pool_slot *
+cedrus_pool_reserved_slot(struct cedrus_device *dev, dma_addr_t dma)
+{
+	struct cedrus_pool *pool = &dev->pool;
+	unsigned long size = pool->reserved_slot_size *
+			     pool->reserved_slots_count;
+
+	if (!pool->reserved_slots || dma < pool->reserved_dma ||
+	    dma - pool->reserved_dma >= size)
+		return NULL;
+
+	return &pool->reserved_slots[(dma - pool->reserved_dma) /
+				     pool->reserved_slot_size];
+}
+
+static void *cedrus_pool_reserved_alloc(struct cedrus_context *ctx,
+					unsigned int size, dma_addr_t *dma)
+{
+	struct cedrus_pool_slot *slot = ctx->pool_slot;
+	unsigned long addr;
+
+	if (!slot)
+		return NULL;
+
+	addr = gen_pool_alloc(slot->pool, cedrus_pool_size_class(size));
+	if (!addr)
+		return NULL;
+
+	*dma = addr;
+
+	/* Buffers are never accessed by CPU, the address is only a cookie. */
+	return (void *)addr;
+}
+
+void cedrus_pool_reserve(struct cedrus_context *ctx)
+{
+	struct cedrus_pool *pool = &ctx->proc->dev->pool;
+	struct cedrus_pool_slot *slot;
+	unsigned int i;
+
+	if (!pool->reserved_slots || ctx->pool_slot)
+		return;
+
+	mutex_lock(&pool->lock);
+
+	/* Slots still holding buffers of a previous owner are left alone. */
+	for (i = 0; i < pool->reserved_slots_count; i++) {
+		slot = &pool->reserved_slots[i];
+
+		if (slot->ctx ||
+		    gen_pool_avail(slot->pool) != gen_pool_size(slot->pool))
+			continue;
+
+		slot->ctx = ctx;
+		ctx->pool_slot = slot;
+		break;
+	}
+
+	mutex_unlock(&pool->lock);
+
+	if (!ctx->pool_slot)
+		dev_dbg(ctx->proc->dev->dev,
+			"No reserved slot left, using the default allocator\n");
+}
+
+void cedrus_pool_unreserve(struct cedrus_context *ctx)
+{
+	struct cedrus_pool *pool = &ctx->proc->dev->pool;
+
+	if (!ctx->pool_slot)
+		return;
+
+	/* Buffers still allocated go back to the slot when freed. */
+	mutex_lock(&pool->lock);
+	ctx->pool_slot->ctx = NULL;
+	ctx->pool_slot = NULL;
+	mutex_unlock(&pool->lock);
+}
+
+static int cedrus_pool_reserved_setup(struct cedrus_device *dev)
+{
+	struct cedrus_pool *pool = &dev->pool;
+	unsigned int count = max(cedrus_pool_reserved_channels, 1U);
+	struct cedrus_pool_slot *slots;
+	struct reserved_mem *rmem;
+	struct device_node *node;
+	unsigned long slot_size;
+	dma_addr_t dma;
+	unsigned int i;
+	int ret;
+
+	/* Behind an IOMMU, buffers don't need contiguous memory. */
+	if (device_iommu_mapped(dev->dev))
+		return 0;
+
+	/* The first region is the default one, for the queues. */
+	node = of_parse_phandle(dev->dev->of_node, "memory-region", 1);
+	if (!node)
+		return 0;
+
+	rmem = of_reserved_mem_lookup(node);
+	of_node_put(node);
+	if (!rmem)
+		return -EINVAL;
+
+	slot_size = rounddown(rmem->size / count, PAGE_SIZE);
+	dma = phys_to_dma(dev->dev, rmem->base);
+
+	/* Zero is the allocation failure value of the allocator. */
+	if (!slot_size || !dma)
+		return -EINVAL;
+
+	slots = kcalloc(count, sizeof(*slots), GFP_KERNEL);
+	if (!slots)
+		return -ENOMEM;
+
+	for (i = 0; i < count; i++) {
+		slots[i].pool = gen_pool_create(PAGE_SHIFT, -1);
+		if (!slots[i].pool) {
+			ret = -ENOMEM;
+			goto error_slots;
+		}
+
+		/* Limit fragmentation with buffers of various sizes. */
+		gen_pool_set_algo(slots[i].pool, gen_pool_best_fit, NULL);
+
+		ret = gen_pool_add(slots[i].pool, dma + i * slot_size,
+				   slot_size, -1);
+		if (ret) {
+			gen_pool_destroy(slots[i].pool);
+			goto error_slots;
+		}
+	}
+
+	pool->reserved_dma = dma;
+	pool->reserved_slot_size = slot_size;
+	pool->reserved_slots_count = count;
+	pool->reserved_slots = slots;
+
+	return 0;
+
+error_slots:
+	while (i--)
+		gen_pool_destroy(slots[i].pool);
+
+	kfree(slots);
+
+	return ret;
+}
+
+static void cedrus_pool_reserved_cleanup(struct cedrus_device *dev)
+{
+	struct cedrus_pool *pool = &dev->pool;
+	unsigned int i;
+
+	if (!pool->reserved_slots)
+		return;
+
+	for (i = 0; i < pool->reserved_slots_count; i++)
+		gen_pool_destroy(pool->reserved_slots[i].pool);
+
+	kfree(pool->reserved_slots);
+	pool->reserved_slots = NULL;
+}
+
+/* Buffer */
+
+static void *cedrus_pool_buffer_alloc(struct cedrus_device *dev,
+				      unsigned int size, dma_addr_t *dma)
+{
+	struct cedrus_pool *pool = &dev->pool;
+	struct cedrus_pool_entry *entry;
+	unsigned long limit = cedrus_pool_limit();
+	void *cpu = NULL;
+
+	if (cedrus_fault_alloc())
+		return NULL;
+
+	size = cedrus_pool_size_class(size);
+
+	/* Concurrent allocations may slightly go past the limit. */
+	if (limit && atomic_long_read(&pool->used) + size > limit)
+		return NULL;
+
+	mutex_lock(&pool->lock);
+
+	/* Most recently freed entries come first. */
+	list_for_each_entry(entry, &pool->entries, list) {
+		if (entry->size != size)
+			continue;
+
+		list_del(&entry->list);
+		pool->size -= entry->size;
+
+		cpu = entry->cpu;
+		*dma = entry->dma;
+		kfree(entry);
+		break;
+	}
+
+	mutex_unlock(&pool->lock);
+
+	/* Buffer is never accessed by CPU, so we can skip kernel mapping. */
+	if (!cpu)
+		cpu = dma_alloc_attrs(dev->dev, size, dma, GFP_KERNEL,
+				      DMA_ATTR_NO_KERNEL_MAPPING);
+
+	if (cpu)
+		atomic_long_add(size, &pool->used);
+
+	return cpu;
+}
+
+static void cedrus_pool_buffer_free(struct cedrus_device *dev,
+				    unsigned int size, void *cpu,
+				    dma_addr_t dma)
+{
+	struct cedrus_pool *pool = &dev->pool;
+	struct cedrus_pool_entry *entry;
+
+	size = cedrus_pool_size_class(size);
+
+	atomic_long_sub(size, &pool->used);
+
+	entry = kzalloc(sizeof(*entry), GFP_KERNEL);
+	if (!entry) {
+		dma_free_attrs(dev->dev, size, cpu, dma,
+			       DMA_ATTR_NO_KERNEL_MAPPING);
+		return;
+	}
+
+	entry->cpu = cpu;
+	entry->dma = dma;
+	entry->size = size;
+	entry->time = jiffies;
+
+	mutex_lock(&pool->lock);
+
+	list_add(&entry->list, &pool->entries);
+	pool->size += size;
+
+	/* Release the least recently freed entries beyond the pool size. */
+	while (pool->size > CEDRUS_POOL_SIZE_MAX) {
+		entry = list_last_entry(&pool->entries,
+					struct cedrus_pool_entry, list);
+		cedrus_pool_entry_release(dev, entry);
+	}
+
+	mutex_unlock(&pool->lock);
+
+	schedule_delayed_work(&pool->trim_work,
+			      msecs_to_jiffies(CEDRUS_POOL_TRIM_DELAY_MS));
+}
+
+void *cedrus_pool_alloc(struct cedrus_context *ctx, unsigned int size,
+			dma_addr_t *dma)
+{
+	void *cpu;
+
+	cpu = cedrus_pool_reserved_alloc(ctx, size, dma);
+	if (!cpu)
+		cpu = cedrus_pool_buffer_alloc(ctx->proc->dev, size, dma);
+
+	if (cpu)
+		atomic_long_add(cedrus_pool_size_class(size), &ctx->memory);
+
+	return cpu;
+}
+
+void cedrus_pool_free(struct cedrus_context *ctx, unsigned int size,
+		      void *cpu, dma_addr_t dma)
+{
+	struct cedrus_pool_slot *slot;
+
+	atomic_long_sub(cedrus_pool_size_class(size), &ctx->memory);
+
+	/* The buffer may belong to a slot no longer taken by the context. */
+	slot = cedrus_pool_reserved_slot(ctx->proc->dev, dma);
+	if (slot) {
+		gen_pool_free(slot->pool, dma, cedrus_pool_size_class(size));
+		return;
+	}
+
+	cedrus_pool_buffer_free(ctx->proc->dev, size, cpu, dma);
+}
+
+/* Shared buffer */
+
+struct cedrus_pool_dmabuf {
+	struct device	*dev;
+	void		*cpu;
+	dma_addr_t	dma;
+	unsigned int	size;
+};
+
+static struct sg_table *
+cedrus_pool_dmabuf_map(struct dma_buf_attachment *attachment,
+		       enum dma_data_direction direction)
+{
+	struct cedrus_pool_dmabuf *priv = attachment->dmabuf->priv;
+	struct sg_table *sgt;
+	int ret;
+
+	sgt = kzalloc(sizeof(*sgt), GFP_KERNEL);
+	if (!sgt)
+		return ERR_PTR(-ENOMEM);
+
+	ret = dma_get_sgtable_attrs(priv->dev, sgt, priv->cpu, priv->dma,
+				    priv->size, DMA_ATTR_NO_KERNEL_MAPPING);
+	if (ret)
+		goto error_sgt;
+
+	ret = dma_map_sgtable(attachment->dev, sgt, direction, 0);
+	if (ret)
+		goto error_table;
+
+	return sgt;
+
+error_table:
+	sg_free_table(sgt);
+
+error_sgt:
+	kfree(sgt);
+
+	return ERR_PTR(ret);
+}
+
+static void cedrus_pool_dmabuf_unmap(struct dma_buf_attachment *attachment,
+				     struct sg_table *sgt,
+				     enum dma_data_direction direction)
+{
+	dma_unmap_sgtable(attachment->dev, sgt, direction, 0);
+	sg_free_table(sgt);
+	kfree(sgt);
+}
+
+static int cedrus_pool_dmabuf_mmap(struct dma_buf *dmabuf,
+				   struct vm_area_struct *vma)
+{
+	struct cedrus_pool_dmabuf *priv = dmabuf->priv;
+
+	return dma_mmap_attrs(priv->dev, vma, priv->cpu, priv->dma, priv->size,
+			      DMA_ATTR_NO_KERNEL_MAPPING);
+}
+
+static void cedrus_pool_dmabuf_release(struct dma_buf *dmabuf)
+{
+	struct cedrus_pool_dmabuf *priv = dmabuf->priv;
+
+	/*
+	 * The last reference may be dropped by another process long after the
+	 * driver is gone, so the buffer is not returned to the pool.
+	 */
+	dma_free_attrs(priv->dev, priv->size, priv->cpu, priv->dma,
+		       DMA_ATTR_NO_KERNEL_MAPPING);
+	put_device(priv->dev);
+	kfree(priv);
+}
+
+static const struct dma_buf_ops cedrus_pool_dmabuf_ops = {
+	.map_dma_buf	= cedrus_pool_dmabuf_map,
+	.unmap_dma_buf	= cedrus_pool_dmabuf_unmap,
+	.mmap		= cedrus_pool_dmabuf_mmap,
+	.release	= cedrus_pool_dmabuf_release,
+};
+
+struct dma_buf *cedrus_pool_dmabuf_alloc(struct cedrus_device *dev,
+					 unsigned int size, dma_addr_t *dma)
+{
+	DEFINE_DMA_BUF_EXPORT_INFO(info);
+	struct cedrus_pool_dmabuf *priv;
+	struct dma_buf *dmabuf;
+	int ret;
+
+	if (cedrus_fault_alloc())
+		return ERR_PTR(-ENOMEM);
+
+	priv = kzalloc(sizeof(*priv), GFP_KERNEL);
+	if (!priv)
+		return ERR_PTR(-ENOMEM);
+
+	priv->size = cedrus_pool_size_class(size);
+	priv->cpu = dma_alloc_attrs(dev->dev, priv->size, &priv->dma,
+				    GFP_KERNEL, DMA_ATTR_NO_KERNEL_MAPPING);
+	if (!priv->cpu) {
+		ret = -ENOMEM;
+		goto error_priv;
+	}
+
+	priv->dev = get_device(dev->dev);
+
+	info.ops = &cedrus_pool_dmabuf_ops;
+	info.size = priv->size;
+	info.flags = O_RDWR;
+	info.priv = priv;
+
+	dmabuf = dma_buf_export(&info);
+	if (IS_ERR(dmabuf)) {
+		ret = PTR_ERR(dmabuf);
+		goto error_buffer;
+	}
+
+	*dma = priv->dma;
+
+	return dmabuf;
+
+error_buffer:
+	put_device(priv->dev);
+	dma_free_attrs(dev->dev, priv->size, priv->cpu, priv->dma,
+		       DMA_ATTR_NO_KERNEL_MAPPING);
+
+error_priv:
+	kfree(priv);
+
+	return ERR_PTR(ret);
+}
+
+/* Scratch buffer */
+
+/*
+ * Scratch buffers only hold intermediate data within a single job, so a
+ * single one of each type is shared by all the contexts of the device and
+ * grown to the largest size they need. Growing happens while jobs of other
+ * contexts may run with the previous buffer, which is only released once
+ * the scratch buffer is no longer used at all.
+ */
+
+int cedrus_pool_scratch_get(struct cedrus_device *dev, unsigned int type,
+			    unsigned int size)
+{
+	struct cedrus_pool *pool = &dev->pool;
+	struct cedrus_pool_scratch *scratch;
+	struct cedrus_pool_entry *entry;
+	dma_addr_t dma;
+	void *cpu;
+	int ret = 0;
+
+	if (WARN_ON(type >= CEDRUS_SCRATCH_COUNT))
+		return -EINVAL;
+
+	scratch = &pool->scratch[type];
+
+	mutex_lock(&pool->scratch_lock);
+
+	if (size > scratch->size) {
+		entry = kzalloc(sizeof(*entry), GFP_KERNEL);
+		if (!entry) {
+			ret = -ENOMEM;
+			goto complete;
+		}
+
+		cpu = cedrus_pool_buffer_alloc(dev, size, &dma);
+		if (!cpu) {
+			kfree(entry);
+			ret = -ENOMEM;
+			goto complete;
+		}
+
+		if (scratch->cpu) {
+			entry->cpu = scratch->cpu;
+			entry->dma = scratch->dma;
+			entry->size = scratch->size;
+			list_add(&entry->list, &scratch->retired);
+		} else {
+			kfree(entry);
+		}
+
+		scratch->cpu = cpu;
+		WRITE_ONCE(scratch->dma, dma);
+		scratch->size = size;
+	}
+
+	scratch->users++;
+
+complete:
+	mutex_unlock(&pool->scratch_lock);
+
+	return ret;
+}
+
+void cedrus_pool_scratch_put(struct cedrus_device *dev, unsigned int type)
+{
+	struct cedrus_pool *pool = &dev->pool;
+	struct cedrus_pool_scratch *scratch;
+	struct cedrus_pool_entry *entry, *entry_next;
+	LIST_HEAD(entries);
+	unsigned int size;
+	dma_addr_t dma;
+	void *cpu;
+
+	if (WARN_ON(type >= CEDRUS_SCRATCH_COUNT))
+		return;
+
+	scratch = &pool->scratch[type];
+
+	mutex_lock(&pool->scratch_lock);
+
+	if (WARN_ON(!scratch->users) || --scratch->users) {
+		mutex_unlock(&pool->scratch_lock);
+		return;
+	}
+
+	list_splice_init(&scratch->retired, &entries);
+
+	cpu = scratch->cpu;
+	dma = scratch->dma;
+	size = scratch->size;
+
+	scratch->cpu = NULL;
+	scratch->size = 0;
+
+	mutex_unlock(&pool->scratch_lock);
+
+	/* The buffers go back to the pool for the next user. */
+	list_for_each_entry_safe(entry, entry_next, &entries, list) {
+		cedrus_pool_buffer_free(dev, entry->size, entry->cpu,
+					entry->dma);
+		kfree(entry);
+	}
+
+	cedrus_pool_buffer_free(dev, size, cpu, dma);
+}
+
+dma_addr_t cedrus_pool_scratch_dma(struct cedrus_device *dev,
+				   unsigned int type)
+{
+	if (WARN_ON(type >= CEDRUS_SCRATCH_COUNT))
+		return 0;
+
+	/* Jobs take the address without the lock, growing only swaps it. */
+	return READ_ONCE(dev->pool.scratch[type].dma);
+}
+
+/* Trim */
+
+static void cedrus_pool_trim(struct work_struct *work)
+{
+	struct cedrus_pool *pool =
+		container_of(to_delayed_work(work), struct cedrus_pool,
+			     trim_work);
+	struct cedrus_device *dev =
+		container_of(pool, struct cedrus_device, pool);
+	unsigned long delay = msecs_to_jiffies(CEDRUS_POOL_TRIM_DELAY_MS);
+	struct cedrus_pool_entry *entry, *entry_next;
+	unsigned long time = 0;
+	bool pending = false;
+
+	mutex_lock(&pool->lock);
+
+	list_for_each_entry_safe_reverse(entry, entry_next, &pool->entries,
+					 list) {
+		if (time_before(jiffies, entry->time + delay)) {
+			time = entry->time;
+			pending = true;
+			break;
+		}
+
+		cedrus_pool_entry_release(dev, entry);
+	}
+
+	mutex_unlock(&pool->lock);
+
+	/* Come back when the oldest remaining entry expires. */
+	if (pending)
+		schedule_delayed_work(&pool->trim_work,
+				      time + delay - jiffies);
+}
+
+/* Shrinker */
+
+/*
+ * Pool entries are released right away under memory pressure, least recently
+ * freed first, so that other drivers get the contiguous memory back during
+ * allocation bursts. Contexts kept for a quick restart can't be released from
+ * reclaim since their locks may be held by the allocating task, so this is
+ * deferred to a work that returns their buffers to the pool and drains it.
+ */
+
+static unsigned long cedrus_pool_shrink_count(struct shrinker *shrinker,
+					      struct shrink_control *sc)
+{
+	struct cedrus_pool *pool =
+		container_of(shrinker, struct cedrus_pool, shrinker);
+	struct cedrus_device *dev =
+		container_of(pool, struct cedrus_device, pool);
+	unsigned long size;
+
+	size = READ_ONCE(pool->size) + cedrus_context_engine_kept_memory(dev);
+	if (!size)
+		return SHRINK_EMPTY;
+
+	return size >> PAGE_SHIFT;
+}
+
+static unsigned long cedrus_pool_shrink_scan(struct shrinker *shrinker,
+					     struct shrink_control *sc)
+{
+	struct cedrus_pool *pool =
+		container_of(shrinker, struct cedrus_pool, shrinker);
+	struct cedrus_device *dev =
+		container_of(pool, struct cedrus_device, pool);
+	struct cedrus_pool_entry *entry;
+	unsigned long freed = 0;
+
+	if (!mutex_trylock(&pool->lock))
+		return SHRINK_STOP;
+
+	while (freed < sc->nr_to_scan && !list_empty(&pool->entries)) {
+		entry = list_last_entry(&pool->entries,
+					struct cedrus_pool_entry, list);
+		freed += entry->size >> PAGE_SHIFT;
+		cedrus_pool_entry_release(dev, entry);
+	}
+
+	mutex_unlock(&pool->lock);
+
+	if (freed < sc->nr_to_scan && cedrus_context_engine_kept_memory(dev))
+		schedule_work(&pool->reclaim_work);
+
+	return freed;
+}
+
+static void cedrus_pool_reclaim(struct work_struct *work)
+{
+	struct cedrus_pool *pool =
+		container_of(work, struct cedrus_pool, reclaim_work);
+	struct cedrus_device *dev =
+		container_of(pool, struct cedrus_device, pool);
+	struct cedrus_pool_entry *entry, *entry_next;
+
+	cedrus_context_engine_reclaim(dev);
+
+	/* The buffers of the released contexts are back in the pool. */
+	mutex_lock(&pool->lock);
+
+	list_for_each_entry_safe(entry, entry_next, &pool->entries, list)
+		cedrus_pool_entry_release(dev, entry);
+
+	mutex_unlock(&pool->lock);
+}
+
+/* Pool */
+
+void cedrus_pool_setup(struct cedrus_device *dev)
+{
+	struct cedrus_pool *pool = &dev->pool;
+	unsigned int i;
+
+	INIT_LIST_HEAD(&pool->entries);
+	mutex_init(&pool->lock);
+	INIT_DELAYED_WORK(&pool->trim_work, cedrus_pool_trim);
+	INIT_WORK(&pool->reclaim_work, cedrus_pool_reclaim);
+
+	for (i = 0; i < CEDRUS_SCRATCH_COUNT; i++)
+		INIT_LIST_HEAD(&pool->scratch[i].retired);
+
+	mutex_init(&pool->scratch_lock);
+
+	pool->shrinker.count_objects = cedrus_pool_shrink_count;
+	pool->shrinker.scan_objects = cedrus_pool_shrink_scan;
+	pool->shrinker.seeks = DEFAULT_SEEKS;
+
+	/* The pool still works without, only trimmed after a delay. */
+	if (register_shrinker(&pool->shrinker, "cedrus-pool"))
+		dev_warn(dev->dev, "Failed to register pool shrinker\n");
+
+	/* Buffers come from the default allocator without the region. */
+	if (cedrus_pool_reserved_setup(dev))
+		dev_warn(dev->dev, "Failed to setup reserved region\n");
+}
+
+void cedrus_pool_cleanup(struct cedrus_device *dev)
+{
+	struct cedrus_pool *pool = &dev->pool;
+	struct cedrus_pool_entry *entry, *entry_next;
+
+	unregister_shrinker(&pool->shrinker);
+	cancel_work_sync(&pool->reclaim_work);
+	cancel_delayed_work_sync(&pool->trim_work);
+
+	mutex_lock(&pool->lock);
+
+	list_for_each_entry_safe(entry, entry_next, &pool->entries, list)
+		cedrus_pool_entry_release(dev, entry);
+
+	mutex_unlock(&pool->lock);
+
+	cedrus_pool_reserved_cleanup(dev);
+}
@@ -0,0 +1,110 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Cedrus Video Engine Driver
+ *
+ * Copyright 2023 Bootlin
+ * Author: Paul Kocialkowski <paul.kocialkowski@bootlin.com>
+ */
+
+#ifndef _CEDRUS_POOL_H_
+#define _CEDRUS_POOL_H_
+
+#include <linux/atomic.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/shrinker.h>
+#include <linux/sizes.h>
+#include <linux/types.h>
+#include <linux/workqueue.h>
+
+#define CEDRUS_POOL_SIZE_MAX		SZ_32M
+#define CEDRUS_POOL_TRIM_DELAY_MS	5000
+
+struct cedrus_context;
+struct cedrus_device;
+struct dma_buf;
+
+enum cedrus_scratch_type {
+	CEDRUS_SCRATCH_ENC_MB_INFO,
+	CEDRUS_SCRATCH_ENC_DEBLK,
+	CEDRUS_SCRATCH_DEC_DEBLK,
+	CEDRUS_SCRATCH_DEC_INTRA,
+	CEDRUS_SCRATCH_COUNT,
+};
+
+struct cedrus_pool_entry {
+	struct list_head	list;
+	void			*cpu;
+	dma_addr_t		dma;
+	unsigned int		size;
+	unsigned long		time;
+};
+
+struct cedrus_pool_slot {
+	struct gen_pool		*pool;
+	struct cedrus_context	*ctx;
+};
+
+struct cedrus_pool_scratch {
+	struct list_head	retired;
+	void			*cpu;
+	dma_addr_t		dma;
+	unsigned int		size;
+	unsigned int		users;
+};
+
+struct cedrus_pool {
+	struct list_head	entries;
+	unsigned int		size;
+	/* Buffers in use, out of the pool entries. */
+	atomic_long_t		used;
+	struct mutex		lock;
+	struct delayed_work	trim_work;
+	struct shrinker		shrinker;
+	struct work_struct	reclaim_work;
+
+	/* Dedicated reserved region, split in a slot per expected stream. */
+	dma_addr_t		reserved_dma;
+	unsigned long		reserved_slot_size;
+	unsigned int		reserved_slots_count;
+	struct cedrus_pool_slot	*reserved_slots;
+
+	struct cedrus_pool_scratch	scratch[CEDRUS_SCRATCH_COUNT];
+	struct mutex			scratch_lock;
+};
+
+/* Limit */
+
+bool cedrus_pool_limit_check(struct cedrus_device *dev);
+
+/* Reserved region */
+
+void cedrus_pool_reserve(struct cedrus_context *ctx);
+void cedrus_pool_unreserve(struct cedrus_context *ctx);
+
+/* Buffer */
+
+void *cedrus_pool_alloc(struct cedrus_context *ctx, unsigned int size,
+			dma_addr_t *dma);
+void cedrus_pool_free(struct cedrus_context *ctx, unsigned int size,
+		      void *cpu, dma_addr_t dma);
+
+/* Shared buffer */
+
+struct dma_buf *cedrus_pool_dmabuf_alloc(struct cedrus_device *dev,
+					 unsigned int size, dma_addr_t *dma);
+
+/* Scratch buffer */
+
+int cedrus_pool_scratch_get(struct cedrus_device *dev, unsigned int type,
+			    unsigned int size);
+void cedrus_pool_scratch_put(struct cedrus_device *dev, unsigned int type);
+dma_addr_t cedrus_pool_scratch_dma(struct cedrus_device *dev,
+				   unsigned int type);
+
+/* Pool */
+
+void cedrus_pool_setup(struct cedrus_device *dev);
+void cedrus_pool_cleanup(struct cedrus_device *dev);
+
+#endif
@@ -6,6 +6,9 @@
  * Author: Paul Kocialkowski <paul.kocialkowski@bootlin.com>
  */
 
+#include <linux/math64.h>
+#include <linux/module.h>
+#include <linux/seq_file.h>
 #include <linux/types.h>
 #include <media/v4l2-ctrls.h>
 #include <media/v4l2-event.h>
@@ -16,6 +19,12 @@
 #include "cedrus_context.h"
 #include "cedrus_engine.h"
 #include "cedrus_proc.h"
+#include "include/uapi/sunxi-cedrus.h"
+
+static bool cedrus_proc_coded_cached = true;
+module_param_named(enc_coded_cached, cedrus_proc_coded_cached, bool, 0644);
+MODULE_PARM_DESC(enc_coded_cached,
+		 "Allocate encoder coded buffers as cached memory (default: true)");
 
 /* Context */
 
@@ -44,6 +53,30 @@ void cedrus_proc_context_active_clear(struct cedrus_proc *proc,
 	spin_unlock_irqrestore(&proc->ctx_active_lock, flags);
 }
 
+/* Ctrl */
+
+int cedrus_proc_ctrl_validate(struct cedrus_context *ctx,
+			      struct v4l2_ctrl *ctrl)
+{
+	struct cedrus_proc *proc = ctx->proc;
+
+	if (!proc->ops || !proc->ops->ctrl_validate)
+		return 0;
+
+	return proc->ops->ctrl_validate(ctx, ctrl);
+}
+
+int cedrus_proc_ctrl_prepare(struct cedrus_context *ctx,
+			     struct v4l2_ctrl *ctrl)
+{
+	struct cedrus_proc *proc = ctx->proc;
+
+	if (!proc->ops || !proc->ops->ctrl_prepare)
+		return 0;
+
+	return proc->ops->ctrl_prepare(ctx, ctrl);
+}
+
 /* Format */
 
 unsigned int cedrus_proc_format_find_first(struct cedrus_proc *proc,
@@ -51,27 +84,47 @@ unsigned int cedrus_proc_format_find_first(struct cedrus_proc *proc,
 {
 	unsigned int i;
 
+	/* Formats restricted to a coded format are never picked by default. */
 	for (i = 0; i < proc->formats_count; i++) {
 		struct cedrus_format *format = &proc->formats[i];
 
-		if (format->type == format_type)
+		if (format->type == format_type && !format->pixelformat_coded)
 			return format->pixelformat;
 	}
 
 	return 0;
 }
 
-static bool cedrus_proc_format_check(struct cedrus_proc *proc,
+static bool cedrus_proc_format_match(struct cedrus_context *ctx,
+				     struct cedrus_format *format,
+				     unsigned int format_type)
+{
+	struct v4l2_pix_format *pix_format_coded =
+		&ctx->v4l2.format_coded.fmt.pix;
+
+	if (format->type != format_type)
+		return false;
+
+	/* Some picture formats are only produced by a specific engine. */
+	if (format->pixelformat_coded &&
+	    format->pixelformat_coded != pix_format_coded->pixelformat)
+		return false;
+
+	return true;
+}
+
+static bool cedrus_proc_format_check(struct cedrus_context *ctx,
 				     unsigned int pixelformat,
 				     unsigned int format_type)
 {
+	struct cedrus_proc *proc = ctx->proc;
 	unsigned int i;
 
 	for (i = 0; i < proc->formats_count; i++) {
 		struct cedrus_format *format = &proc->formats[i];
 
 		if (format->pixelformat == pixelformat &&
-		    format->type == format_type)
+		    cedrus_proc_format_match(ctx, format, format_type))
 			return true;
 	}
 
@@ -85,7 +138,7 @@ int cedrus_proc_format_coded_prepare(struct cedrus_context *ctx,
 	struct v4l2_pix_format *pix_format = &format->fmt.pix;
 
 	/* Select the first coded format in case of invalid format. */
-	if (!cedrus_proc_format_check(proc, pix_format->pixelformat,
+	if (!cedrus_proc_format_check(ctx, pix_format->pixelformat,
 				      CEDRUS_FORMAT_TYPE_CODED))
 		pix_format->pixelformat =
 			cedrus_proc_format_find_first(proc,
@@ -104,7 +157,7 @@ int cedrus_proc_format_picture_prepare(struct cedrus_context *ctx,
 		return -ENODEV;
 
 	/* Select the first picture format in case of invalid format. */
-	if (!cedrus_proc_format_check(proc, pix_format->pixelformat,
+	if (!cedrus_proc_format_check(ctx, pix_format->pixelformat,
 				      CEDRUS_FORMAT_TYPE_PICTURE))
 		pix_format->pixelformat =
 			cedrus_proc_format_find_first(proc,
@@ -219,6 +272,19 @@ static int cedrus_proc_formats_setup(struct cedrus_proc *proc,
 	return 0;
 }
 
+/* Selection */
+
+static int cedrus_proc_selection_propagate(struct cedrus_context *ctx)
+{
+	struct cedrus_proc *proc = ctx->proc;
+
+	/* Selection propagation is optional. */
+	if (!proc->ops || !proc->ops->selection_propagate)
+		return 0;
+
+	return proc->ops->selection_propagate(ctx);
+}
+
 /* Size */
 
 static int cedrus_proc_size_picture_enum(struct cedrus_context *ctx,
@@ -232,6 +298,19 @@ static int cedrus_proc_size_picture_enum(struct cedrus_context *ctx,
 	return proc->ops->size_picture_enum(ctx, frmsizeenum);
 }
 
+/* Reset */
+
+int cedrus_proc_reset(struct cedrus_context *ctx)
+{
+	struct cedrus_proc *proc = ctx->proc;
+
+	/* Fine-grained reset is optional, callers fall back to a full reset. */
+	if (!proc->ops || !proc->ops->reset)
+		return -EOPNOTSUPP;
+
+	return proc->ops->reset(ctx);
+}
+
 /* Engine */
 
 const struct cedrus_engine *
@@ -280,6 +359,11 @@ static int cedrus_proc_engines_setup(struct cedrus_proc *proc,
 	if (!proc->engines)
 		return -ENOMEM;
 
+	size = count * sizeof(*proc->engines_busy_us);
+	proc->engines_busy_us = devm_kzalloc(dev, size, GFP_KERNEL);
+	if (!proc->engines_busy_us)
+		return -ENOMEM;
+
 	proc->engines_count = count;
 
 	for (i = 0; i < config->engines_count; i++) {
@@ -327,7 +411,7 @@ static int cedrus_proc_enum_fmt(struct file *file, void *private,
 	for (i = 0; i < proc->formats_count; i++) {
 		struct cedrus_format *format = &proc->formats[i];
 
-		if (format->type != format_type)
+		if (!cedrus_proc_format_match(ctx, format, format_type))
 			continue;
 
 		if (fmtdesc->index == index) {
@@ -368,12 +452,9 @@ static int cedrus_proc_g_fmt(struct file *file, void *private,
 	return 0;
 }
 
-static int cedrus_proc_s_fmt(struct file *file, void *private,
-			     struct v4l2_format *format)
+int cedrus_proc_format_set(struct cedrus_context *ctx,
+			   struct v4l2_format *format)
 {
-	struct cedrus_context *ctx =
-		container_of(file->private_data, struct cedrus_context,
-			     v4l2.fh);
 	unsigned int format_type =
 		cedrus_proc_format_type(ctx->proc, format->type);
 	bool dynamic = cedrus_proc_format_dynamic_check(ctx, format);
@@ -398,6 +479,8 @@ static int cedrus_proc_s_fmt(struct file *file, void *private,
 	else
 		ctx->v4l2.format_picture = *format;
 
+	cedrus_context_format_invalidate(ctx);
+
 	/* Propagate format. */
 	ret = cedrus_proc_format_propagate(ctx, format_type);
 	if (ret)
@@ -413,6 +496,16 @@ static int cedrus_proc_s_fmt(struct file *file, void *private,
 	return 0;
 }
 
+static int cedrus_proc_s_fmt(struct file *file, void *private,
+			     struct v4l2_format *format)
+{
+	struct cedrus_context *ctx =
+		container_of(file->private_data, struct cedrus_context,
+			     v4l2.fh);
+
+	return cedrus_proc_format_set(ctx, format);
+}
+
 static int cedrus_proc_try_fmt(struct file *file, void *private,
 			       struct v4l2_format *format)
 {
@@ -452,7 +545,7 @@ static int cedrus_proc_enum_framesizes(struct file *file, void *private,
 	}
 
 	/* Picture frame sizes come dynamically from the proc. */
-	check = cedrus_proc_format_check(proc, pixelformat,
+	check = cedrus_proc_format_check(ctx, pixelformat,
 					 CEDRUS_FORMAT_TYPE_PICTURE);
 	if (check)
 		return cedrus_proc_size_picture_enum(ctx, frmsizeenum);
@@ -535,7 +628,9 @@ static int cedrus_proc_s_selection(struct file *file, void *private,
 		cedrus_proc_format_type(ctx->proc, selection->type);
 	struct v4l2_pix_format *pix_format =
 		&ctx->v4l2.format_picture.fmt.pix;
+	struct v4l2_rect selection_picture = ctx->v4l2.selection_picture;
 	unsigned int width_max, height_max;
+	int ret;
 
 	if (format_type != CEDRUS_FORMAT_TYPE_PICTURE)
 		return -EINVAL;
@@ -554,6 +649,14 @@ static int cedrus_proc_s_selection(struct file *file, void *private,
 					    height_max);
 
 		ctx->v4l2.selection_picture = selection->r;
+		cedrus_context_format_invalidate(ctx);
+
+		ret = cedrus_proc_selection_propagate(ctx);
+		if (ret) {
+			ctx->v4l2.selection_picture = selection_picture;
+			return ret;
+		}
+
 		return 0;
 	}
 
@@ -630,6 +733,103 @@ static int cedrus_proc_s_parm(struct file *file, void *private,
 	return 0;
 }
 
+/*
+ * Encoded data is read back by the CPU (for parsing, muxing or encryption),
+ * which is much faster from cached memory than from write-combined mappings.
+ */
+static void cedrus_proc_memory_flags(struct cedrus_proc *proc, u32 type,
+				     u32 memory, u32 *flags)
+{
+	if (proc->role == CEDRUS_ROLE_ENCODER &&
+	    cedrus_proc_format_type(proc, type) == CEDRUS_FORMAT_TYPE_CODED &&
+	    memory == V4L2_MEMORY_MMAP && READ_ONCE(cedrus_proc_coded_cached))
+		*flags |= V4L2_MEMORY_FLAG_NON_COHERENT;
+}
+
+static int cedrus_proc_reqbufs(struct file *file, void *private,
+			       struct v4l2_requestbuffers *requestbuffers)
+{
+	struct cedrus_context *ctx =
+		container_of(file->private_data, struct cedrus_context,
+			     v4l2.fh);
+	u32 flags = requestbuffers->flags;
+
+	cedrus_proc_memory_flags(ctx->proc, requestbuffers->type,
+				 requestbuffers->memory, &flags);
+	requestbuffers->flags = flags;
+
+	return v4l2_m2m_ioctl_reqbufs(file, private, requestbuffers);
+}
+
+static int cedrus_proc_create_bufs(struct file *file, void *private,
+				   struct v4l2_create_buffers *create_buffers)
+{
+	struct cedrus_context *ctx =
+		container_of(file->private_data, struct cedrus_context,
+			     v4l2.fh);
+
+	cedrus_proc_memory_flags(ctx->proc, create_buffers->format.type,
+				 create_buffers->memory,
+				 &create_buffers->flags);
+
+	return v4l2_m2m_ioctl_create_bufs(file, private, create_buffers);
+}
+
+static int cedrus_proc_encoder_cmd(struct file *file, void *private,
+				   struct v4l2_encoder_cmd *encoder_cmd)
+{
+	struct cedrus_context *ctx =
+		container_of(file->private_data, struct cedrus_context,
+			     v4l2.fh);
+	struct v4l2_m2m_ctx *m2m_ctx = ctx->v4l2.fh.m2m_ctx;
+	int ret;
+
+	ret = v4l2_m2m_ioctl_try_encoder_cmd(file, private, encoder_cmd);
+	if (ret)
+		return ret;
+
+	/* Pictures held by the engine are taken into account for draining. */
+	if (encoder_cmd->cmd == V4L2_ENC_CMD_STOP)
+		ret = cedrus_context_drain(ctx);
+	else
+		ret = v4l2_m2m_encoder_cmd(file, m2m_ctx, encoder_cmd);
+
+	if (ret)
+		return ret;
+
+	v4l2_m2m_try_schedule(m2m_ctx);
+
+	return 0;
+}
+
+static int cedrus_proc_subscribe_event(struct v4l2_fh *fh,
+				       const struct v4l2_event_subscription *sub)
+{
+	switch (sub->type) {
+	case V4L2_EVENT_EOS:
+		return v4l2_event_subscribe(fh, sub, 2, NULL);
+	case V4L2_EVENT_CEDRUS_H264_ENC_STATS:
+	case V4L2_EVENT_CEDRUS_H264_ENC_SCENE_CHANGE:
+	case V4L2_EVENT_CEDRUS_JOB_TIMES:
+	case V4L2_EVENT_CEDRUS_H264_DEC_ERROR:
+		/* Keep enough events for all the coded buffers in flight. */
+		return v4l2_event_subscribe(fh, sub, VIDEO_MAX_FRAME, NULL);
+	default:
+		return v4l2_ctrl_subscribe_event(fh, sub);
+	}
+}
+
+static long cedrus_proc_default(struct file *file, void *private,
+				bool valid_prio, unsigned int cmd, void *arg)
+{
+	struct cedrus_context *ctx =
+		container_of(file->private_data, struct cedrus_context,
+			     v4l2.fh);
+
+	/* Private ioctls are specific to the engine in use. */
+	return cedrus_engine_ioctl(ctx, cmd, arg);
+}
+
 static const struct v4l2_ioctl_ops cedrus_proc_ioctl_ops = {
 	.vidioc_querycap		= cedrus_proc_querycap,
 
@@ -652,9 +852,9 @@ static const struct v4l2_ioctl_ops cedrus_proc_ioctl_ops = {
 	.vidioc_g_parm			= cedrus_proc_g_parm,
 	.vidioc_s_parm			= cedrus_proc_s_parm,
 
-	.vidioc_create_bufs		= v4l2_m2m_ioctl_create_bufs,
+	.vidioc_create_bufs		= cedrus_proc_create_bufs,
 	.vidioc_prepare_buf		= v4l2_m2m_ioctl_prepare_buf,
-	.vidioc_reqbufs			= v4l2_m2m_ioctl_reqbufs,
+	.vidioc_reqbufs			= cedrus_proc_reqbufs,
 	.vidioc_querybuf		= v4l2_m2m_ioctl_querybuf,
 	.vidioc_expbuf			= v4l2_m2m_ioctl_expbuf,
 	.vidioc_qbuf			= v4l2_m2m_ioctl_qbuf,
@@ -666,8 +866,13 @@ static const struct v4l2_ioctl_ops cedrus_proc_ioctl_ops = {
 	.vidioc_decoder_cmd		= v4l2_m2m_ioctl_stateless_decoder_cmd,
 	.vidioc_try_decoder_cmd		= v4l2_m2m_ioctl_stateless_try_decoder_cmd,
 
-	.vidioc_subscribe_event		= v4l2_ctrl_subscribe_event,
+	.vidioc_encoder_cmd		= cedrus_proc_encoder_cmd,
+	.vidioc_try_encoder_cmd		= v4l2_m2m_ioctl_try_encoder_cmd,
+
+	.vidioc_subscribe_event		= cedrus_proc_subscribe_event,
 	.vidioc_unsubscribe_event	= v4l2_event_unsubscribe,
+
+	.vidioc_default			= cedrus_proc_default,
 };
 
 static int cedrus_proc_open(struct file *file)
@@ -714,6 +919,31 @@ static int cedrus_proc_release(struct file *file)
 	return 0;
 }
 
+/*
+ * Engine busy time of the file handle, with keys following the DRM client
+ * usage stats. A file handle only uses the engine of its device node, the
+ * other one is always reported so that both are found for every client.
+ */
+static void cedrus_proc_show_fdinfo(struct seq_file *seq, struct file *file)
+{
+	struct cedrus_proc *proc = video_drvdata(file);
+	struct cedrus_context *ctx =
+		container_of(file->private_data, struct cedrus_context,
+			     v4l2.fh);
+	u64 time_ns;
+
+	spin_lock(&ctx->stats.lock);
+	time_ns = ctx->stats.time_engine_ns;
+	spin_unlock(&ctx->stats.lock);
+
+	seq_printf(seq, "cedrus-driver:\t%s\n", CEDRUS_NAME);
+	seq_printf(seq, "cedrus-client-id:\t%u\n", ctx->id);
+	seq_printf(seq, "cedrus-engine-decode:\t%llu ns\n",
+		   proc->role == CEDRUS_ROLE_DECODER ? time_ns : 0);
+	seq_printf(seq, "cedrus-engine-encode:\t%llu ns\n",
+		   proc->role == CEDRUS_ROLE_ENCODER ? time_ns : 0);
+}
+
 static const struct v4l2_file_operations cedrus_proc_fops = {
 	.owner		= THIS_MODULE,
 	.open		= cedrus_proc_open,
@@ -721,6 +951,7 @@ static const struct v4l2_file_operations cedrus_proc_fops = {
 	.unlocked_ioctl	= video_ioctl2,
 	.mmap		= v4l2_m2m_fop_mmap,
 	.poll		= v4l2_m2m_fop_poll,
+	.show_fdinfo	= cedrus_proc_show_fdinfo,
 };
 
 /* V4L2 */
@@ -802,6 +1033,8 @@ static int cedrus_proc_v4l2_setup(struct cedrus_proc *proc)
 		v4l2_disable_ioctl(video_dev, VIDIOC_S_SELECTION);
 		v4l2_disable_ioctl(video_dev, VIDIOC_G_PARM);
 		v4l2_disable_ioctl(video_dev, VIDIOC_S_PARM);
+		v4l2_disable_ioctl(video_dev, VIDIOC_ENCODER_CMD);
+		v4l2_disable_ioctl(video_dev, VIDIOC_TRY_ENCODER_CMD);
 	} else {
 		v4l2_disable_ioctl(video_dev, VIDIOC_DECODER_CMD);
 		v4l2_disable_ioctl(video_dev, VIDIOC_TRY_DECODER_CMD);
@@ -933,6 +1166,65 @@ void cedrus_proc_v4l2_cleanup(struct cedrus_proc *proc)
 	video_unregister_device(video_dev);
 }
 
+/* Load */
+
+static void cedrus_proc_load_roll(struct cedrus_proc_load *load, ktime_t now)
+{
+	s64 elapsed = ktime_us_delta(now, load->window_start);
+
+	if (elapsed < CEDRUS_PROC_LOAD_WINDOW_US)
+		return;
+
+	/* The last window is only relevant if it just ended. */
+	if (elapsed < 2 * CEDRUS_PROC_LOAD_WINDOW_US) {
+		load->busy_us_last = load->busy_us;
+		load->window_start = ktime_add_us(load->window_start,
+						  CEDRUS_PROC_LOAD_WINDOW_US);
+	} else {
+		load->busy_us_last = 0;
+		load->window_start = now;
+	}
+
+	load->busy_us = 0;
+}
+
+void cedrus_proc_load_add(struct cedrus_proc *proc, u64 busy_us)
+{
+	struct cedrus_proc_load *load = &proc->load;
+	unsigned long flags;
+
+	spin_lock_irqsave(&load->lock, flags);
+
+	cedrus_proc_load_roll(load, ktime_get());
+	load->busy_us += busy_us;
+
+	spin_unlock_irqrestore(&load->lock, flags);
+}
+
+unsigned int cedrus_proc_load(struct cedrus_proc *proc)
+{
+	struct cedrus_proc_load *load = &proc->load;
+	ktime_t now = ktime_get();
+	unsigned long flags;
+	u64 elapsed, busy_us;
+
+	spin_lock_irqsave(&load->lock, flags);
+
+	cedrus_proc_load_roll(load, now);
+
+	elapsed = ktime_us_delta(now, load->window_start);
+	busy_us = div64_u64(load->busy_us_last *
+			    (CEDRUS_PROC_LOAD_WINDOW_US - elapsed),
+			    CEDRUS_PROC_LOAD_WINDOW_US);
+	busy_us += load->busy_us;
+
+	spin_unlock_irqrestore(&load->lock, flags);
+
+	busy_us = div64_u64(busy_us * 100, CEDRUS_PROC_LOAD_WINDOW_US);
+
+	return min_t(u64, busy_us, 100);
+}
+
 /* Proc */
 
 int cedrus_proc_setup(struct cedrus_device *dev, struct cedrus_proc *proc,
@@ -944,9 +1236,14 @@ int cedrus_proc_setup(struct cedrus_device *dev, struct cedrus_proc *proc,
 	proc->dev = dev;
 	proc->ops = ops;
 	proc->role = config->role;
+	proc->ctrl_configs = config->ctrl_configs;
+	proc->ctrl_configs_count = config->ctrl_configs_count;
 
 	spin_lock_init(&proc->ctx_active_lock);
 
+	spin_lock_init(&proc->load.lock);
+	proc->load.window_start = ktime_get();
+
 	ret = cedrus_proc_engines_setup(proc, config);
 	if (ret == -ENODEV)
 		return 0;
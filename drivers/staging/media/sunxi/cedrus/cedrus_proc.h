@@ -9,12 +9,17 @@
 #ifndef _CEDRUS_PROC_H_
 #define _CEDRUS_PROC_H_
 
+#include <linux/ktime.h>
+#include <linux/spinlock.h>
 #include <linux/videodev2.h>
 #include <media/media-device.h>
 #include <media/media-entity.h>
+#include <media/v4l2-ctrls.h>
 
 #include "cedrus.h"
 
+#define CEDRUS_PROC_LOAD_WINDOW_US	USEC_PER_SEC
+
 struct cedrus_format;
 struct cedrus_device;
 struct cedrus_proc;
@@ -38,9 +43,17 @@ struct cedrus_proc_config {
 
 	const struct cedrus_format	*formats;
 	unsigned int			formats_count;
+
+	const struct v4l2_ctrl_config	*ctrl_configs;
+	unsigned int			ctrl_configs_count;
 };
 
 struct cedrus_proc_ops {
+	int (*ctrl_validate)(struct cedrus_context *ctx,
+			     struct v4l2_ctrl *ctrl);
+	int (*ctrl_prepare)(struct cedrus_context *ctx,
+			    struct v4l2_ctrl *ctrl);
+
 	int (*format_picture_prepare)(struct cedrus_context *ctx,
 				      struct v4l2_format *format);
 	int (*format_picture_configure)(struct cedrus_context *ctx);
@@ -51,8 +64,12 @@ struct cedrus_proc_ops {
 	bool (*format_dynamic_check)(struct cedrus_context *ctx,
 				     struct v4l2_format *format);
 
+	int (*selection_propagate)(struct cedrus_context *ctx);
+
 	int (*size_picture_enum)(struct cedrus_context *ctx,
 				 struct v4l2_frmsizeenum *frmsizeenum);
+
+	int (*reset)(struct cedrus_context *ctx);
 };
 
 struct cedrus_proc_v4l2 {
@@ -70,6 +87,17 @@ struct cedrus_proc_v4l2 {
 	struct mutex			lock;
 };
 
+/*
+ * Busy time is accounted over fixed windows and the load is estimated from
+ * the current window and the part of the last one that is still in range.
+ */
+struct cedrus_proc_load {
+	ktime_t		window_start;
+	u64		busy_us;
+	u64		busy_us_last;
+	spinlock_t	lock;
+};
+
 struct cedrus_proc {
 	struct cedrus_device		*dev;
 	int				role;
@@ -80,12 +108,18 @@ struct cedrus_proc {
 
 	const struct cedrus_engine	**engines;
 	unsigned int			engines_count;
+	u64				*engines_busy_us;
 
 	struct cedrus_format		*formats;
 	unsigned int			formats_count;
 
+	const struct v4l2_ctrl_config	*ctrl_configs;
+	unsigned int			ctrl_configs_count;
+
 	struct cedrus_context		*ctx_active;
 	spinlock_t			ctx_active_lock;
+
+	struct cedrus_proc_load		load;
 };
 
 /* Format */
@@ -131,6 +165,13 @@ void cedrus_proc_context_active_update(struct cedrus_proc *proc,
 void cedrus_proc_context_active_clear(struct cedrus_proc *proc,
 				      struct cedrus_context *ctx);
 
+/* Ctrl */
+
+int cedrus_proc_ctrl_validate(struct cedrus_context *ctx,
+			      struct v4l2_ctrl *ctrl);
+int cedrus_proc_ctrl_prepare(struct cedrus_context *ctx,
+			     struct v4l2_ctrl *ctrl);
+
 /* Format */
 
 unsigned int cedrus_proc_format_find_first(struct cedrus_proc *proc,
@@ -143,6 +184,8 @@ int cedrus_proc_format_picture_configure(struct cedrus_context *ctx);
 int cedrus_proc_format_setup(struct cedrus_context *ctx);
 int cedrus_proc_format_propagate(struct cedrus_context *ctx,
 				 unsigned int format_type);
+int cedrus_proc_format_set(struct cedrus_context *ctx,
+			   struct v4l2_format *format);
 
 /* Engine */
 
@@ -150,6 +193,15 @@ const struct cedrus_engine *
 cedrus_proc_engine_find_format(struct cedrus_proc *proc,
 			       unsigned int pixelformat);
 
+/* Load */
+
+void cedrus_proc_load_add(struct cedrus_proc *proc, u64 busy_us);
+unsigned int cedrus_proc_load(struct cedrus_proc *proc);
+
+/* Reset */
+
+int cedrus_proc_reset(struct cedrus_context *ctx);
+
 /* Proc */
 
 int cedrus_proc_setup(struct cedrus_device *dev, struct cedrus_proc *proc,
@@ -46,8 +46,10 @@
 #define VE_MODE_RAMPD				BIT(31)
 #define VE_MODE_PIC_WIDTH_IS_4096		BIT(22)
 #define VE_MODE_PIC_WIDTH_MORE_2048		BIT(21)
+#define VE_MODE_REC_WR_MODE_MASK		(1 << 20)
 #define VE_MODE_REC_WR_MODE_2MB			(1 << 20)
 #define VE_MODE_REC_WR_MODE_1MB			(0 << 20)
+#define VE_MODE_DDR_MODE_MASK			(3 << 16)
 #define VE_MODE_DDR_MODE_BW_128			(3 << 16)
 #define VE_MODE_DDR_MODE_BW_256			(2 << 16)
 #define VE_MODE_ENC_ENABLE			BIT(7)
@@ -88,6 +90,11 @@
 #define VE_PRIMARY_FB_LINE_STRIDE_CHROMA(s)	SHIFT_AND_MASK_BITS(s, 31, 16)
 #define VE_PRIMARY_FB_LINE_STRIDE_LUMA(s)	SHIFT_AND_MASK_BITS(s, 15, 0)
 
+#define VE_SECONDARY_FB_LINE_STRIDE		0xcc
+
+#define VE_SECONDARY_FB_LINE_STRIDE_CHROMA(s)	SHIFT_AND_MASK_BITS(s, 31, 16)
+#define VE_SECONDARY_FB_LINE_STRIDE_LUMA(s)	SHIFT_AND_MASK_BITS(s, 15, 0)
+
 #define VE_CHROMA_BUF_LEN			0xe8
 
 #define VE_SECONDARY_OUT_FMT_TILED_32_NV12	(0x00 << 30)
@@ -509,9 +516,17 @@
 #define VE_DEC_H265_BITS_END_ADDR_BASE(a)	((a) >> 8)
 
 #define VE_DEC_H265_SDRT_CTRL			(VE_ENGINE_DEC_H265 + 0x50)
+
+#define VE_DEC_H265_SDRT_CTRL_ROTATE(v)		SHIFT_AND_MASK_BITS(v, 10, 8)
+#define VE_DEC_H265_SDRT_CTRL_SCALE_VERT(v)	SHIFT_AND_MASK_BITS(v, 5, 4)
+#define VE_DEC_H265_SDRT_CTRL_SCALE_HORZ(v)	SHIFT_AND_MASK_BITS(v, 3, 2)
+#define VE_DEC_H265_SDRT_CTRL_EN		BIT(0)
+
 #define VE_DEC_H265_SDRT_LUMA_ADDR		(VE_ENGINE_DEC_H265 + 0x54)
 #define VE_DEC_H265_SDRT_CHROMA_ADDR		(VE_ENGINE_DEC_H265 + 0x58)
 
+#define VE_DEC_H265_SDRT_ADDR_BASE(a)		((a) >> 8)
+
 #define VE_DEC_H265_OUTPUT_FRAME_IDX		(VE_ENGINE_DEC_H265 + 0x5c)
 
 #define VE_DEC_H265_NEIGHBOR_INFO_ADDR		(VE_ENGINE_DEC_H265 + 0x60)
@@ -599,6 +614,7 @@
 
 #define VE_H264_CTRL			0x220
 #define VE_H264_CTRL_VP8			BIT(29)
+#define VE_H264_CTRL_ROTATE_SCALE_OUT_EN	BIT(9)
 #define VE_H264_CTRL_VLD_DATA_REQ_INT		BIT(2)
 #define VE_H264_CTRL_DECODE_ERR_INT		BIT(1)
 #define VE_H264_CTRL_SLICE_DECODE_INT		BIT(0)
@@ -639,6 +655,13 @@
 #define VE_H264_VLD_LEN			0x238
 #define VE_H264_VLD_END			0x23c
 #define VE_H264_SDROT_CTRL		0x240
+#define VE_H264_SDROT_CTRL_ROTATE(v)		SHIFT_AND_MASK_BITS(v, 10, 8)
+#define VE_H264_SDROT_CTRL_SCALE_VERT(v)	SHIFT_AND_MASK_BITS(v, 5, 4)
+#define VE_H264_SDROT_CTRL_SCALE_HORZ(v)	SHIFT_AND_MASK_BITS(v, 3, 2)
+#define VE_H264_SDROT_CTRL_EN			BIT(0)
+
+#define VE_H264_SDROT_LUMA		0x244
+#define VE_H264_SDROT_CHROMA		0x248
 #define VE_H264_OUTPUT_FRAME_IDX	0x24c
 #define VE_H264_EXTRA_BUFFER1		0x250
 #define VE_H264_EXTRA_BUFFER2		0x254
@@ -727,7 +750,9 @@
 
 #define VE_ISP_PIC_STRIDE0_REG			(VE_ENGINE_ENC_ISP_BASE + 0x4)
 #define VE_ISP_PIC_STRIDE0_INPUT_STRIDE_MBS(v)	SHIFT_AND_MASK_BITS(v, 26, 16)
+#define VE_ISP_PIC_STRIDE0_INPUT_STRIDE_MASK	GENMASK(26, 16)
 #define VE_ISP_PIC_STRIDE0_THUMB_STRIDE_MBS(v)	SHIFT_AND_MASK_BITS(v, 9, 0)
+#define VE_ISP_PIC_STRIDE0_THUMB_STRIDE_MASK	GENMASK(9, 0)
 
 #define VE_ISP_CTRL_REG				(VE_ENGINE_ENC_ISP_BASE + 0x8)
 #define VE_ISP_CTRL_FORMAT_YUV420SP		(0 << 27)
@@ -781,9 +806,11 @@
 #define VE_ENC_AVC_PARA0_REF_PIC_TYPE_FRAME	(0 << 2)
 #define VE_ENC_AVC_PARA0_REF_PIC_TYPE_FIELD_TOP	(1 << 2)
 #define VE_ENC_AVC_PARA0_REF_PIC_TYPE_FIELD_BOT	(2 << 2)
+#define VE_ENC_AVC_PARA0_REF_PIC_TYPE_MASK	GENMASK(3, 2)
 #define VE_ENC_AVC_PARA0_PIC_TYPE_FRAME		(0 << 0)
 #define VE_ENC_AVC_PARA0_PIC_TYPE_FIELD_TOP	(1 << 0)
 #define VE_ENC_AVC_PARA0_PIC_TYPE_FIELD_BOT	(2 << 0)
+#define VE_ENC_AVC_PARA0_PIC_TYPE_MASK		GENMASK(1, 0)
 
 #define VE_ENC_AVC_PARA1_REG			(VE_ENGINE_ENC_H264_BASE + 0x8)
 #define VE_ENC_AVC_PARA1_MODE_OPTIMIZE_EN	BIT(31)
@@ -923,9 +950,19 @@
 #define VE_ENC_AVC_TFCNT_ADDR_REG		(VE_ENGINE_ENC_H264_BASE + 0xc8)
 
 #define VE_ENC_AVC_ROI_QP_OFFSET_REG		(VE_ENGINE_ENC_H264_BASE + 0xcc)
+#define VE_ENC_AVC_ROI_QP_OFFSET(i, v)		SHIFT_AND_MASK_BITS(v, \
+							    (i) * 8 + 7, \
+							    (i) * 8)
+
 #define VE_ENC_AVC_ROI_0_AREA_REG		(VE_ENGINE_ENC_H264_BASE + 0xd0)
 #define VE_ENC_AVC_ROI_1_AREA_REG		(VE_ENGINE_ENC_H264_BASE + 0xd4)
 #define VE_ENC_AVC_ROI_2_AREA_REG		(VE_ENGINE_ENC_H264_BASE + 0xd8)
 #define VE_ENC_AVC_ROI_3_AREA_REG		(VE_ENGINE_ENC_H264_BASE + 0xdc)
+#define VE_ENC_AVC_ROI_AREA_REG(i)		(VE_ENC_AVC_ROI_0_AREA_REG + \
+						 (i) * 4)
+#define VE_ENC_AVC_ROI_AREA_TOP_MB(v)		SHIFT_AND_MASK_BITS(v, 31, 24)
+#define VE_ENC_AVC_ROI_AREA_LEFT_MB(v)		SHIFT_AND_MASK_BITS(v, 23, 16)
+#define VE_ENC_AVC_ROI_AREA_BOTTOM_MB(v)	SHIFT_AND_MASK_BITS(v, 15, 8)
+#define VE_ENC_AVC_ROI_AREA_RIGHT_MB(v)		SHIFT_AND_MASK_BITS(v, 7, 0)
 
 #endif
@@ -0,0 +1,444 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Cedrus Video Engine Driver
+ *
+ * Copyright 2023 Bootlin
+ * Author: Paul Kocialkowski <paul.kocialkowski@bootlin.com>
+ */
+
+#include <linux/debugfs.h>
+#include <linux/math64.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/wait.h>
+#include <media/v4l2-mem2mem.h>
+#include <media/videobuf2-core.h>
+#include <media/videobuf2-v4l2.h>
+
+#include "cedrus.h"
+#include "cedrus_context.h"
+#include "cedrus_proc.h"
+#include "cedrus_selftest.h"
+
+/*
+ * The self-test encodes a synthetic NV12 pattern to H.264 from a context of
+ * its own, with default controls, that goes through the same job scheduling
+ * and engine operations as the contexts of userspace clients. Buffers are
+ * queued to the videobuf2 queues of the context directly, without a file.
+ *
+ * Parameters are given in the selftest debugfs directory (width, height and
+ * frames), writing to the run file starts a run and blocks until it completes.
+ * Results of the last run are found in the results file.
+ *
+ * The lock of the queues is only taken for each operation, as with ioctls, so
+ * that userspace clients of the encoder are not blocked during a run. A run
+ * fails with a timeout when no buffer completes in time.
+ */
+
+#define CEDRUS_SELFTEST_PICTURES_COUNT	4
+#define CEDRUS_SELFTEST_CODED_COUNT	2
+#define CEDRUS_SELFTEST_FRAMES_MAX	10000
+#define CEDRUS_SELFTEST_FRAME_NS	33333333ULL
+#define CEDRUS_SELFTEST_PATTERN_SHIFT	3
+#define CEDRUS_SELFTEST_DQBUF_TIMEOUT_MS	2000
+
+/* Pattern */
+
+static void cedrus_selftest_pattern_fill(struct vb2_buffer *vb2_buffer,
+					 struct v4l2_pix_format *pix_format,
+					 unsigned int index)
+{
+	unsigned int stride = pix_format->bytesperline;
+	unsigned int height = pix_format->height;
+	unsigned int shift = index * CEDRUS_SELFTEST_PATTERN_SHIFT;
+	u8 *luma = vb2_plane_vaddr(vb2_buffer, 0);
+	unsigned int x, y;
+	u8 *chroma;
+
+	if (!luma)
+		return;
+
+	chroma = luma + stride * height;
+
+	/* Diagonal gradients, shifted between pictures to give motion. */
+	for (y = 0; y < height; y++)
+		for (x = 0; x < stride; x++)
+			luma[y * stride + x] = x + y + shift;
+
+	for (y = 0; y < height / 2; y++) {
+		for (x = 0; x < stride; x += 2) {
+			chroma[y * stride + x] = 64 + (x + shift) / 4;
+			chroma[y * stride + x + 1] = 192 - (y + shift) / 4;
+		}
+	}
+}
+
+/* Run */
+
+static int cedrus_selftest_format_setup(struct cedrus_context *ctx,
+					unsigned int width,
+					unsigned int height)
+{
+	struct v4l2_format format;
+	int ret;
+
+	/* The coded format selects the engine. */
+	format = ctx->v4l2.format_coded;
+	format.fmt.pix.pixelformat = V4L2_PIX_FMT_H264;
+	format.fmt.pix.width = 0;
+	format.fmt.pix.height = 0;
+	format.fmt.pix.sizeimage = 0;
+
+	ret = cedrus_proc_format_set(ctx, &format);
+	if (ret)
+		return ret;
+
+	format = ctx->v4l2.format_picture;
+	format.fmt.pix.pixelformat = V4L2_PIX_FMT_NV12;
+	format.fmt.pix.width = width;
+	format.fmt.pix.height = height;
+	format.fmt.pix.bytesperline = 0;
+	format.fmt.pix.field = V4L2_FIELD_NONE;
+
+	return cedrus_proc_format_set(ctx, &format);
+}
+
+static int cedrus_selftest_queue(struct vb2_queue *queue, unsigned int index,
+				 unsigned int frame)
+{
+	struct vb2_buffer *vb2_buffer = vb2_get_buffer(queue, index);
+	struct vb2_v4l2_buffer *v4l2_buffer = to_vb2_v4l2_buffer(vb2_buffer);
+	int ret;
+
+	/* There is no struct v4l2_buffer from userspace to take these from. */
+	vb2_buffer->timestamp = frame * CEDRUS_SELFTEST_FRAME_NS;
+	v4l2_buffer->field = V4L2_FIELD_NONE;
+	v4l2_buffer->flags = 0;
+
+	mutex_lock(queue->lock);
+	ret = vb2_core_qbuf(queue, index, NULL, NULL);
+	mutex_unlock(queue->lock);
+
+	return ret;
+}
+
+static int cedrus_selftest_dequeue(struct vb2_queue *queue,
+				   unsigned int *index)
+{
+	long timeout = msecs_to_jiffies(CEDRUS_SELFTEST_DQBUF_TIMEOUT_MS);
+	int ret;
+
+	/* Buffers are dequeued without blocking with the queue lock held. */
+	while (true) {
+		mutex_lock(queue->lock);
+		ret = vb2_core_dqbuf(queue, index, NULL, true);
+		mutex_unlock(queue->lock);
+
+		if (ret != -EAGAIN)
+			return ret;
+
+		timeout = wait_event_interruptible_timeout(queue->done_wq,
+				!list_empty(&queue->done_list) || queue->error,
+				timeout);
+		if (timeout < 0)
+			return timeout;
+		else if (!timeout)
+			return -ETIMEDOUT;
+	}
+}
+
+static int cedrus_selftest_reqbufs(struct vb2_queue *queue,
+				   unsigned int *count)
+{
+	int ret;
+
+	mutex_lock(queue->lock);
+	ret = vb2_core_reqbufs(queue, VB2_MEMORY_MMAP, 0, count);
+	mutex_unlock(queue->lock);
+
+	return ret;
+}
+
+static int cedrus_selftest_streamon(struct vb2_queue *queue)
+{
+	int ret;
+
+	mutex_lock(queue->lock);
+	ret = vb2_core_streamon(queue, queue->type);
+	mutex_unlock(queue->lock);
+
+	return ret;
+}
+
+static void cedrus_selftest_streamoff(struct vb2_queue *queue)
+{
+	mutex_lock(queue->lock);
+	vb2_core_streamoff(queue, queue->type);
+	mutex_unlock(queue->lock);
+}
+
+static int cedrus_selftest_encode(struct cedrus_context *ctx,
+				  struct cedrus_selftest_results *results)
+{
+	struct v4l2_m2m_ctx *m2m_ctx = ctx->v4l2.fh.m2m_ctx;
+	struct vb2_queue *queue_picture = v4l2_m2m_get_src_vq(m2m_ctx);
+	struct vb2_queue *queue_coded = v4l2_m2m_get_dst_vq(m2m_ctx);
+	struct v4l2_pix_format *pix_format = &ctx->v4l2.format_picture.fmt.pix;
+	unsigned int pictures_count = CEDRUS_SELFTEST_PICTURES_COUNT;
+	unsigned int coded_count = CEDRUS_SELFTEST_CODED_COUNT;
+	unsigned int frames = results->frames;
+	unsigned int queued = 0, done, index, i;
+	ktime_t time_start;
+	int ret;
+
+	ret = cedrus_selftest_reqbufs(queue_picture, &pictures_count);
+	if (ret)
+		return ret;
+
+	ret = cedrus_selftest_reqbufs(queue_coded, &coded_count);
+	if (ret)
+		goto complete_picture;
+
+	for (i = 0; i < pictures_count; i++)
+		cedrus_selftest_pattern_fill(vb2_get_buffer(queue_picture, i),
+					     pix_format, i);
+
+	ret = cedrus_selftest_streamon(queue_picture);
+	if (ret)
+		goto complete_coded;
+
+	ret = cedrus_selftest_streamon(queue_coded);
+	if (ret)
+		goto complete_streamoff_picture;
+
+	time_start = ktime_get();
+
+	for (i = 0; i < pictures_count && queued < frames; i++, queued++) {
+		ret = cedrus_selftest_queue(queue_picture, i, queued);
+		if (ret)
+			goto complete_streamoff;
+	}
+
+	for (i = 0; i < coded_count; i++) {
+		ret = cedrus_selftest_queue(queue_coded, i, 0);
+		if (ret)
+			goto complete_streamoff;
+	}
+
+	v4l2_m2m_try_schedule(m2m_ctx);
+
+	/* Pictures and coded buffers complete together, in order. */
+	for (done = 0; done < frames; done++) {
+		ret = cedrus_selftest_dequeue(queue_coded, &index);
+		if (ret)
+			goto complete_streamoff;
+
+		results->size +=
+			vb2_get_plane_payload(vb2_get_buffer(queue_coded,
+							     index), 0);
+
+		if (done + coded_count < frames) {
+			ret = cedrus_selftest_queue(queue_coded, index, 0);
+			if (ret)
+				goto complete_streamoff;
+		}
+
+		ret = cedrus_selftest_dequeue(queue_picture, &index);
+		if (ret)
+			goto complete_streamoff;
+
+		if (queued < frames) {
+			ret = cedrus_selftest_queue(queue_picture, index,
+						    queued++);
+			if (ret)
+				goto complete_streamoff;
+		}
+
+		v4l2_m2m_try_schedule(m2m_ctx);
+	}
+
+	results->time_us = ktime_us_delta(ktime_get(), time_start);
+
+complete_streamoff:
+	cedrus_selftest_streamoff(queue_coded);
+
+complete_streamoff_picture:
+	cedrus_selftest_streamoff(queue_picture);
+
+complete_coded:
+	coded_count = 0;
+	cedrus_selftest_reqbufs(queue_coded, &coded_count);
+
+complete_picture:
+	pictures_count = 0;
+	cedrus_selftest_reqbufs(queue_picture, &pictures_count);
+
+	return ret;
+}
+
+static int cedrus_selftest_run(struct cedrus_device *dev,
+			       struct cedrus_selftest_results *results)
+{
+	struct cedrus_proc *proc = &dev->enc;
+	struct cedrus_debugfs_stats *stats;
+	struct cedrus_context *ctx;
+	struct mutex *lock = &proc->v4l2.lock;
+	int ret;
+
+	ctx = kzalloc(sizeof(*ctx), GFP_KERNEL);
+	if (!ctx)
+		return -ENOMEM;
+
+	/* The context is set up and used as from its file operations. */
+	mutex_lock(lock);
+
+	ret = cedrus_context_setup(proc, ctx);
+	if (ret) {
+		mutex_unlock(lock);
+		goto complete;
+	}
+
+	ret = cedrus_selftest_format_setup(ctx, results->width,
+					   results->height);
+
+	mutex_unlock(lock);
+
+	if (ret)
+		goto error_context;
+
+	results->width = ctx->v4l2.format_picture.fmt.pix.width;
+	results->height = ctx->v4l2.format_picture.fmt.pix.height;
+
+	/* Queue operations take the lock themselves. */
+	ret = cedrus_selftest_encode(ctx, results);
+
+	stats = &ctx->stats;
+
+	spin_lock(&stats->lock);
+	results->errors = stats->errors;
+	results->timed = stats->timed;
+	results->time_setup_us = stats->time_setup_us;
+	results->time_hw_us = stats->time_hw_us;
+	spin_unlock(&stats->lock);
+
+	results->clock_mod_rate = READ_ONCE(dev->clock_mod_rate);
+
+error_context:
+	mutex_lock(lock);
+	cedrus_context_cleanup(ctx);
+	mutex_unlock(lock);
+
+complete:
+	kfree(ctx);
+
+	return ret;
+}
+
+/* Debugfs */
+
+static int cedrus_selftest_run_set(void *data, u64 value)
+{
+	struct cedrus_device *dev = data;
+	struct cedrus_selftest *selftest = &dev->selftest;
+	struct cedrus_selftest_results *results = &selftest->results;
+	int ret;
+
+	mutex_lock(&selftest->lock);
+
+	memset(results, 0, sizeof(*results));
+	results->width = selftest->width;
+	results->height = selftest->height;
+	results->frames = clamp_t(u32, selftest->frames, 1,
+				  CEDRUS_SELFTEST_FRAMES_MAX);
+
+	ret = cedrus_selftest_run(dev, results);
+	results->error = ret;
+
+	mutex_unlock(&selftest->lock);
+
+	return ret;
+}
+
+DEFINE_DEBUGFS_ATTRIBUTE(cedrus_selftest_run_fops, NULL,
+			 cedrus_selftest_run_set, "%llu\n");
+
+static int cedrus_selftest_results_show(struct seq_file *seq, void *data)
+{
+	struct cedrus_device *dev = seq->private;
+	struct cedrus_selftest *selftest = &dev->selftest;
+	struct cedrus_selftest_results *results = &selftest->results;
+	u64 fps = 0, time_setup_us = 0, time_hw_us = 0, time_frame_us = 0;
+	u32 hundredths;
+
+	mutex_lock(&selftest->lock);
+
+	if (results->time_us) {
+		fps = div64_u64((u64)results->frames * USEC_PER_SEC * 100,
+				results->time_us);
+		time_frame_us = div_u64(results->time_us, results->frames);
+	}
+
+	if (results->timed) {
+		time_setup_us = div64_u64(results->time_setup_us,
+					  results->timed);
+		time_hw_us = div64_u64(results->time_hw_us, results->timed);
+	}
+
+	fps = div_u64_rem(fps, 100, &hundredths);
+
+	seq_printf(seq, "width: %u\n", results->width);
+	seq_printf(seq, "height: %u\n", results->height);
+	seq_printf(seq, "frames: %u\n", results->frames);
+	seq_printf(seq, "error: %d\n", results->error);
+	seq_printf(seq, "errors: %llu\n", results->errors);
+	seq_printf(seq, "time_ms: %llu\n",
+		   div_u64(results->time_us, USEC_PER_MSEC));
+	seq_printf(seq, "fps: %llu.%02u\n", fps, hundredths);
+	seq_printf(seq, "size: %llu\n", results->size);
+	seq_printf(seq, "frame_time_us: %llu\n", time_frame_us);
+	seq_printf(seq, "setup_time_us: %llu\n", time_setup_us);
+	seq_printf(seq, "hw_time_us: %llu\n", time_hw_us);
+	seq_printf(seq, "clock_rate: %lu\n", results->clock_mod_rate);
+	seq_printf(seq, "clock_rate_nominal: %lu\n",
+		   dev->clock_mod_rate_nominal);
+
+	mutex_unlock(&selftest->lock);
+
+	return 0;
+}
+
+DEFINE_SHOW_ATTRIBUTE(cedrus_selftest_results);
+
+void cedrus_selftest_setup(struct cedrus_device *dev)
+{
+	struct cedrus_selftest *selftest = &dev->selftest;
+	struct dentry *dir;
+
+	if (!cedrus_capabilities_check(dev, CEDRUS_CAPABILITY_H264_ENC))
+		return;
+
+	mutex_init(&selftest->lock);
+
+	selftest->width = 1280;
+	selftest->height = 720;
+	selftest->frames = 300;
+
+	dir = debugfs_create_dir("selftest", dev->debugfs.root);
+
+	debugfs_create_u32("width", 0644, dir, &selftest->width);
+	debugfs_create_u32("height", 0644, dir, &selftest->height);
+	debugfs_create_u32("frames", 0644, dir, &selftest->frames);
+	debugfs_create_file_unsafe("run", 0200, dir, dev,
+				   &cedrus_selftest_run_fops);
+	debugfs_create_file("results", 0444, dir, dev,
+			    &cedrus_selftest_results_fops);
+
+	selftest->debugfs = dir;
+}
+
+void cedrus_selftest_cleanup(struct cedrus_device *dev)
+{
+	/* Removal waits for a run in progress, which needs the encoder. */
+	debugfs_remove(dev->selftest.debugfs);
+	dev->selftest.debugfs = NULL;
+}
@@ -0,0 +1,51 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Cedrus Video Engine Driver
+ *
+ * Copyright 2023 Bootlin
+ * Author: Paul Kocialkowski <paul.kocialkowski@bootlin.com>
+ */
+
+#ifndef _CEDRUS_SELFTEST_H_
+#define _CEDRUS_SELFTEST_H_
+
+#include <linux/mutex.h>
+#include <linux/types.h>
+
+struct cedrus_device;
+struct dentry;
+
+struct cedrus_selftest_results {
+	u32		width;
+	u32		height;
+	u32		frames;
+	u64		errors;
+	int		error;
+
+	u64		time_us;
+	u64		size;
+
+	/* Totals only cover jobs that reached the hardware. */
+	u64		timed;
+	u64		time_setup_us;
+	u64		time_hw_us;
+
+	unsigned long	clock_mod_rate;
+};
+
+struct cedrus_selftest {
+	struct dentry			*debugfs;
+
+	/* Runs are serialized, along with their parameters. */
+	struct mutex			lock;
+	u32				width;
+	u32				height;
+	u32				frames;
+
+	struct cedrus_selftest_results	results;
+};
+
+void cedrus_selftest_setup(struct cedrus_device *dev);
+void cedrus_selftest_cleanup(struct cedrus_device *dev);
+
+#endif
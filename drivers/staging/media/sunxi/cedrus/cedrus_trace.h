@@ -0,0 +1,165 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Cedrus Video Engine Driver
+ *
+ * Copyright 2023 Bootlin
+ * Author: Paul Kocialkowski <paul.kocialkowski@bootlin.com>
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM cedrus
+
+#if !defined(_CEDRUS_TRACE_H_) || defined(TRACE_HEADER_MULTI_READ)
+#define _CEDRUS_TRACE_H_
+
+#include <linux/tracepoint.h>
+#include <media/videobuf2-v4l2.h>
+
+#include "cedrus_context.h"
+#include "cedrus_engine.h"
+#include "cedrus_proc.h"
+
+#define CEDRUS_TRACE_FRAME_FLAGS \
+	(V4L2_BUF_FLAG_KEYFRAME | V4L2_BUF_FLAG_PFRAME | V4L2_BUF_FLAG_BFRAME)
+
+DECLARE_EVENT_CLASS(cedrus_job_class,
+	TP_PROTO(struct cedrus_context *ctx),
+	TP_ARGS(ctx),
+
+	TP_STRUCT__entry(
+		__field(const void *, ctx)
+		__field(int, codec)
+		__field(int, role)
+	),
+
+	TP_fast_assign(
+		__entry->ctx = ctx;
+		__entry->codec = ctx->engine ? ctx->engine->codec : -1;
+		__entry->role = ctx->proc->role;
+	),
+
+	TP_printk("ctx=%p codec=%d role=%d",
+		  __entry->ctx, __entry->codec, __entry->role)
+);
+
+DEFINE_EVENT(cedrus_job_class, cedrus_job_run,
+	TP_PROTO(struct cedrus_context *ctx),
+	TP_ARGS(ctx)
+);
+
+DEFINE_EVENT(cedrus_job_class, cedrus_job_prepare,
+	TP_PROTO(struct cedrus_context *ctx),
+	TP_ARGS(ctx)
+);
+
+DEFINE_EVENT(cedrus_job_class, cedrus_format_configure,
+	TP_PROTO(struct cedrus_context *ctx),
+	TP_ARGS(ctx)
+);
+
+DEFINE_EVENT(cedrus_job_class, cedrus_job_configure,
+	TP_PROTO(struct cedrus_context *ctx),
+	TP_ARGS(ctx)
+);
+
+DEFINE_EVENT(cedrus_job_class, cedrus_job_trigger,
+	TP_PROTO(struct cedrus_context *ctx),
+	TP_ARGS(ctx)
+);
+
+DEFINE_EVENT(cedrus_job_class, cedrus_watchdog,
+	TP_PROTO(struct cedrus_context *ctx),
+	TP_ARGS(ctx)
+);
+
+TRACE_EVENT(cedrus_irq,
+	TP_PROTO(struct cedrus_context *ctx, int status),
+	TP_ARGS(ctx, status),
+
+	TP_STRUCT__entry(
+		__field(const void *, ctx)
+		__field(int, codec)
+		__field(int, role)
+		__field(int, status)
+	),
+
+	TP_fast_assign(
+		__entry->ctx = ctx;
+		__entry->codec = ctx->engine ? ctx->engine->codec : -1;
+		__entry->role = ctx->proc->role;
+		__entry->status = status;
+	),
+
+	TP_printk("ctx=%p codec=%d role=%d status=%d",
+		  __entry->ctx, __entry->codec, __entry->role, __entry->status)
+);
+
+TRACE_EVENT(cedrus_job_finish,
+	TP_PROTO(struct cedrus_context *ctx, int state),
+	TP_ARGS(ctx, state),
+
+	TP_STRUCT__entry(
+		__field(const void *, ctx)
+		__field(int, codec)
+		__field(int, role)
+		__field(int, state)
+		__field(u32, frame_flags)
+		__field(unsigned int, payload)
+	),
+
+	TP_fast_assign(
+		struct vb2_v4l2_buffer *buffer = ctx->job.buffer_coded;
+
+		__entry->ctx = ctx;
+		__entry->codec = ctx->engine ? ctx->engine->codec : -1;
+		__entry->role = ctx->proc->role;
+		__entry->state = state;
+		__entry->frame_flags = buffer ?
+				       buffer->flags & CEDRUS_TRACE_FRAME_FLAGS :
+				       0;
+		__entry->payload = buffer ?
+				   vb2_get_plane_payload(&buffer->vb2_buf, 0) :
+				   0;
+	),
+
+	TP_printk("ctx=%p codec=%d role=%d state=%d frame_flags=%s payload=%u",
+		  __entry->ctx, __entry->codec, __entry->role, __entry->state,
+		  __print_flags(__entry->frame_flags, "|",
+				{ V4L2_BUF_FLAG_KEYFRAME, "KEYFRAME" },
+				{ V4L2_BUF_FLAG_PFRAME, "PFRAME" },
+				{ V4L2_BUF_FLAG_BFRAME, "BFRAME" }),
+		  __entry->payload)
+);
+
+TRACE_EVENT(cedrus_enc_h264_frame,
+	TP_PROTO(struct cedrus_context *ctx, unsigned int frame_type,
+		 unsigned int qp, unsigned int payload),
+	TP_ARGS(ctx, frame_type, qp, payload),
+
+	TP_STRUCT__entry(
+		__field(const void *, ctx)
+		__field(unsigned int, frame_type)
+		__field(unsigned int, qp)
+		__field(unsigned int, payload)
+	),
+
+	TP_fast_assign(
+		__entry->ctx = ctx;
+		__entry->frame_type = frame_type;
+		__entry->qp = qp;
+		__entry->payload = payload;
+	),
+
+	TP_printk("ctx=%p frame_type=%u qp=%u payload=%u",
+		  __entry->ctx, __entry->frame_type, __entry->qp,
+		  __entry->payload)
+);
+
+#endif
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE cedrus_trace
+
+#include <trace/define_trace.h>
@@ -0,0 +1,667 @@
+/* SPDX-License-Identifier: GPL-2.0 WITH Linux-syscall-note */
+/*
+ * Cedrus Video Engine Driver
+ *
+ * Copyright 2023 Bootlin
+ */
+
+#ifndef _UAPI_SUNXI_CEDRUS_H_
+#define _UAPI_SUNXI_CEDRUS_H_
+
+#include <linux/types.h>
+#include <linux/v4l2-controls.h>
+#include <linux/videodev2.h>
+
+/*
+ * H.264 encoder regions of interest, as an array of
+ * CEDRUS_H264_ENC_ROI_COUNT by CEDRUS_H264_ENC_ROI_FIELDS_COUNT integers.
+ * Each region is described by its rectangle in pixels, rounded outwards to
+ * macroblocks, and the QP delta applied to the macroblocks it covers.
+ * Regions with a zero width or height are disabled.
+ */
+#define V4L2_CID_CEDRUS_H264_ENC_ROI		(V4L2_CID_USER_CEDRUS_BASE + 0)
+
+#define CEDRUS_H264_ENC_ROI_COUNT		4
+
+enum cedrus_h264_enc_roi_field {
+	CEDRUS_H264_ENC_ROI_LEFT,
+	CEDRUS_H264_ENC_ROI_TOP,
+	CEDRUS_H264_ENC_ROI_WIDTH,
+	CEDRUS_H264_ENC_ROI_HEIGHT,
+	CEDRUS_H264_ENC_ROI_QP_DELTA,
+	CEDRUS_H264_ENC_ROI_FIELDS_COUNT,
+};
+
+/*
+ * H.264 encoder frame skip request: the next P frame is encoded with all its
+ * macroblocks skipped, repeating its reference picture for a few bytes.
+ */
+#define V4L2_CID_CEDRUS_H264_ENC_FRAME_SKIP	(V4L2_CID_USER_CEDRUS_BASE + 1)
+
+/*
+ * H.264 encoder temporal denoise filter strength, from 0 (disabled) to 100.
+ * The filter blends each macroblock with the previous reconstruction, which
+ * reduces the bitrate spent on sensor noise.
+ */
+#define V4L2_CID_CEDRUS_H264_ENC_DENOISE	(V4L2_CID_USER_CEDRUS_BASE + 2)
+
+/*
+ * H.264 encoder speed/quality preset, trading motion estimation and mode
+ * decision effort for engine time. The screen content preset is meant for
+ * desktop captures: it skips motion estimation, favours intra and skipped
+ * macroblocks and caps the frame QP at CEDRUS_H264_ENC_PRESET_SCREEN_QP_MAX
+ * (or V4L2_CID_MPEG_VIDEO_H264_MIN_QP if higher) to keep text sharp.
+ */
+#define V4L2_CID_CEDRUS_H264_ENC_PRESET		(V4L2_CID_USER_CEDRUS_BASE + 3)
+
+enum cedrus_h264_enc_preset {
+	CEDRUS_H264_ENC_PRESET_QUALITY,
+	CEDRUS_H264_ENC_PRESET_BALANCED,
+	CEDRUS_H264_ENC_PRESET_FAST,
+	CEDRUS_H264_ENC_PRESET_FASTEST,
+	CEDRUS_H264_ENC_PRESET_SCREEN,
+};
+
+#define CEDRUS_H264_ENC_PRESET_SCREEN_QP_MAX	32
+
+/*
+ * H.264 encoder time budget per frame in microseconds, or 0 for no limit.
+ * Macroblocks exceeding their share of the budget are encoded with cheaper
+ * decisions, which bounds the worst-case encoding time.
+ */
+#define V4L2_CID_CEDRUS_H264_ENC_TIME_BUDGET	(V4L2_CID_USER_CEDRUS_BASE + 4)
+
+/*
+ * H.264 encoder scene change threshold in percents, or 0 to disable scene
+ * change detection. When the MAD sum of a P or B frame exceeds the one of the
+ * previous inter frame by this ratio, the next frame is encoded as an IDR (with
+ * a closed GOP) or I frame and a V4L2_EVENT_CEDRUS_H264_ENC_SCENE_CHANGE event
+ * is sent.
+ */
+#define V4L2_CID_CEDRUS_H264_ENC_SCENE_CHANGE	(V4L2_CID_USER_CEDRUS_BASE + 5)
+
+/*
+ * H.264 encoder thumbnail side-output, written by the ISP while fetching the
+ * picture. The thumbnail is the picture as fed to the encoder, downscaled when
+ * the coded dimensions are smaller than the picture dimensions, in the NV12
+ * format with the luma stride aligned to 16 and whole macroblock rows.
+ * It is placed at the end of the coded buffer, at the offset reported in
+ * struct cedrus_h264_enc_stats, which is zero when the coded buffer is too
+ * small to hold it.
+ */
+#define V4L2_CID_CEDRUS_H264_ENC_THUMBNAIL	(V4L2_CID_USER_CEDRUS_BASE + 6)
+
+/*
+ * Job scheduling priority of the context, from 0 (default) to 7. A context
+ * with a job ready gives way to the contexts of the device (decoders and
+ * encoders alike) with a higher priority and a job ready too, while contexts
+ * of the same priority are served in turn. Contexts of lower priority may
+ * starve when higher priority contexts always have a job ready.
+ */
+#define V4L2_CID_CEDRUS_PRIORITY		(V4L2_CID_USER_CEDRUS_BASE + 7)
+
+/*
+ * Decoder picture scale-down, as a power of two from 0 (full size) to 2
+ * (quarter size). The picture buffers receive the decoded picture downscaled
+ * by the engine secondary output, with the picture format dimensions divided
+ * accordingly, while the driver keeps full-size reference pictures internally.
+ * It can only be changed when no picture buffer is allocated.
+ */
+#define V4L2_CID_CEDRUS_DEC_SCALE_DOWN		(V4L2_CID_USER_CEDRUS_BASE + 8)
+
+#define CEDRUS_DEC_SCALE_DOWN_MAX		2
+
+/*
+ * H.264 encoder frame type request, acted upon each time it is set, even with
+ * the same value. Unlike the button controls, it can be attached to a request
+ * along with an output buffer, which then applies to that very picture, as
+ * do the QP and ROI controls of the request.
+ */
+#define V4L2_CID_CEDRUS_H264_ENC_FRAME_TYPE	(V4L2_CID_USER_CEDRUS_BASE + 11)
+
+enum cedrus_h264_enc_frame_type {
+	CEDRUS_H264_ENC_FRAME_TYPE_AUTO,
+	CEDRUS_H264_ENC_FRAME_TYPE_KEY,
+	CEDRUS_H264_ENC_FRAME_TYPE_SKIP,
+};
+
+/*
+ * Encoder control pinning, taken into account when streaming starts. When
+ * enabled, all the controls of the context are busy while streaming, so that
+ * jobs keep the configuration they started with and skip sampling controls
+ * and applying request controls, at the lowest per-frame cost.
+ */
+#define V4L2_CID_CEDRUS_ENC_CTRLS_PINNED	(V4L2_CID_USER_CEDRUS_BASE + 12)
+
+/*
+ * H.264 encoder coded buffer headroom in bytes, left untouched before the
+ * bitstream so that a transport header can be written there in place. The
+ * payload of the coded buffers includes it, while the frame size reported in
+ * struct cedrus_h264_enc_stats does not. No headroom is kept when the coded
+ * buffer is too small for it.
+ */
+#define V4L2_CID_CEDRUS_H264_ENC_HEADROOM	(V4L2_CID_USER_CEDRUS_BASE + 13)
+
+#define CEDRUS_H264_ENC_HEADROOM_MAX		4096
+
+/*
+ * H.264 encoder frames packed per coded buffer, from 1 (default) to
+ * CEDRUS_H264_ENC_FRAMES_PACKED_MAX. Successive frames are written one
+ * after the other in the same coded buffer, which is done when it holds that
+ * many frames or when the next frame is unlikely to fit in the space left.
+ * The offset and size of each frame are reported in struct
+ * cedrus_h264_enc_stats, while the buffer carries the timestamp and flags of
+ * its last frame. A frame exceeding the space left continues in the next coded
+ * buffer, which ends the packing. Frames are not packed with the thumbnail or
+ * motion vector side-outputs.
+ */
+#define V4L2_CID_CEDRUS_H264_ENC_FRAMES_PACKED	(V4L2_CID_USER_CEDRUS_BASE + 14)
+
+#define CEDRUS_H264_ENC_FRAMES_PACKED_MAX	64
+
+/*
+ * H.264 encoder SEI messages, as a bitmask of the messages inserted before the
+ * first slice of the frames they apply to. The recovery point message is sent
+ * with non-IDR I frames and with the P frames starting a cyclic intra refresh,
+ * where decoding can start to get correct pictures after the refresh period.
+ */
+#define V4L2_CID_CEDRUS_H264_ENC_SEI		(V4L2_CID_USER_CEDRUS_BASE + 15)
+
+#define CEDRUS_H264_ENC_SEI_RECOVERY_POINT	(1 << 0)
+
+/*
+ * H.264 encoder motion vector side-output, written back by the engine as part
+ * of motion estimation. It holds a CEDRUS_H264_ENC_MV_INFO_MB_SIZE bytes
+ * record per macroblock, in raster order over the coded picture, with the
+ * horizontal and vertical motion vector components of the macroblock as
+ * signed 16-bit quarter-pixel values, the sum of absolute differences of its
+ * prediction as an unsigned 16-bit value and 2 reserved bytes. It is placed
+ * at the end of the coded buffer, before the thumbnail if any, at the offset
+ * reported in struct cedrus_h264_enc_stats, which is zero when the coded
+ * buffer is too small to hold it.
+ */
+#define V4L2_CID_CEDRUS_H264_ENC_MV_INFO	(V4L2_CID_USER_CEDRUS_BASE + 16)
+
+#define CEDRUS_H264_ENC_MV_INFO_MB_SIZE		8
+
+/*
+ * H.264 encoder macroblock cost map side-output, with a byte per macroblock in
+ * raster order over the coded picture, holding the mean absolute difference
+ * per pixel of its prediction (saturated to 255). It is condensed from the
+ * motion vector records, which are written back for the purpose, and placed
+ * before them in the coded buffer, at the offset reported in struct
+ * cedrus_h264_enc_stats, which is zero when the coded buffer is too small to
+ * hold it.
+ */
+#define V4L2_CID_CEDRUS_H264_ENC_COST_MAP	(V4L2_CID_USER_CEDRUS_BASE + 17)
+
+/*
+ * H.264 encoder reconstruction export, taken into account when streaming
+ * starts. When enabled, the reconstructed pictures of the encoded frames can
+ * be exported as DMABUFs with VIDIOC_CEDRUS_H264_ENC_REC_EXPBUF, for instance
+ * to measure the encoding quality against the source pictures. The engine
+ * keeps CEDRUS_H264_ENC_REC_EXPORT_COUNT extra pictures, so that the
+ * reconstruction of a frame is kept intact until at least that many following
+ * frames are encoded. An exported reconstruction that is still in use after
+ * that window gets overwritten.
+ */
+#define V4L2_CID_CEDRUS_H264_ENC_REC_EXPORT	(V4L2_CID_USER_CEDRUS_BASE + 18)
+
+#define CEDRUS_H264_ENC_REC_EXPORT_COUNT	2
+
+/*
+ * H.264 encoder error resilience, for lossy links. When enabled, every
+ * macroblock row is coded as a slice of its own (unless the picture is scaled
+ * or rotated), without deblocking across slices, and the PPS sets
+ * constrained_intra_pred_flag, with intra macroblocks only coded in intra
+ * frames. A lost packet then only corrupts the rows of its slice, which are
+ * repaired by the next intra frame. Cyclic intra refresh is not available in
+ * that mode.
+ */
+#define V4L2_CID_CEDRUS_H264_ENC_ERROR_RESILIENCE \
+	(V4L2_CID_USER_CEDRUS_BASE + 19)
+
+/*
+ * Decoder QP map side-output, for the H.264 and H.265 decoders. When enabled,
+ * the picture buffers end with a byte per 16x16 macroblock in raster order
+ * over the coded picture, holding the luma QP of the slice covering it, as the
+ * engine does not report macroblock QP deltas. It occupies the last
+ * DIV_ROUND_UP(width, 16) * DIV_ROUND_UP(height, 16) bytes of the picture
+ * format size image, for the coded format dimensions, and is not written to
+ * picture buffers allocated with V4L2_MEMORY_FLAG_NON_COHERENT. It can only
+ * be changed when no picture buffer is allocated.
+ */
+#define V4L2_CID_CEDRUS_DEC_QP_MAP		(V4L2_CID_USER_CEDRUS_BASE + 20)
+
+/*
+ * H.264 encoder lookahead, as the number of source pictures (up to
+ * CEDRUS_H264_ENC_LOOKAHEAD_MAX) queued after the next one before it is
+ * encoded, or 0 to disable it. It is taken into account when streaming starts
+ * and needs that many extra source buffers, except when draining. The driver
+ * compares a sparse luma signature of the pictures to find scene cuts: the
+ * IDR (with a closed GOP) or I frame is placed on the cut, a closed GOP ending
+ * shortly before a cut is extended up to it and the frame right before a cut
+ * gets a higher QP. P frames get a lower QP when the content stays static over
+ * the whole lookahead. Source buffers allocated with
+ * V4L2_MEMORY_FLAG_NON_COHERENT are not analysed.
+ */
+#define V4L2_CID_CEDRUS_H264_ENC_LOOKAHEAD	(V4L2_CID_USER_CEDRUS_BASE + 21)
+
+#define CEDRUS_H264_ENC_LOOKAHEAD_MAX		8
+
+/*
+ * H.264 encoder GOP pattern, as an array of CEDRUS_H264_ENC_GOP_PATTERN_MAX
+ * by CEDRUS_H264_ENC_GOP_PATTERN_FIELDS_COUNT integers, taken into account
+ * when streaming starts. Each entry gives the type of a frame in display order,
+ * whether it is used as a reference and the QP delta applied to it, and the
+ * entries up to the first one of type CEDRUS_H264_ENC_GOP_FRAME_NONE are
+ * repeated over the stream. An empty pattern (default) keeps the GOP structure
+ * from the GOP, B frames and hierarchical coding controls, which a pattern
+ * overrides. I and IDR frames are always references, B frames never are and
+ * are encoded as P frames when the profile does not allow them. B frames
+ * cannot precede an IDR frame and the P frames of a pattern with B frames must
+ * be references. Key frame requests and scene changes apply as usual.
+ */
+#define V4L2_CID_CEDRUS_H264_ENC_GOP_PATTERN	(V4L2_CID_USER_CEDRUS_BASE + 22)
+
+#define CEDRUS_H264_ENC_GOP_PATTERN_MAX		16
+
+enum cedrus_h264_enc_gop_pattern_field {
+	CEDRUS_H264_ENC_GOP_PATTERN_FRAME_TYPE,
+	CEDRUS_H264_ENC_GOP_PATTERN_REFERENCE,
+	CEDRUS_H264_ENC_GOP_PATTERN_QP_DELTA,
+	CEDRUS_H264_ENC_GOP_PATTERN_FIELDS_COUNT,
+};
+
+enum cedrus_h264_enc_gop_frame {
+	CEDRUS_H264_ENC_GOP_FRAME_NONE,
+	CEDRUS_H264_ENC_GOP_FRAME_IDR,
+	CEDRUS_H264_ENC_GOP_FRAME_I,
+	CEDRUS_H264_ENC_GOP_FRAME_P,
+	CEDRUS_H264_ENC_GOP_FRAME_B,
+};
+
+/*
+ * H.264 encoder QP deltas of P frames for each temporal layer, as an array of
+ * CEDRUS_H264_ENC_QP_LAYERS_COUNT integers starting with the base layer. They
+ * add up with the other QP deltas and keep applying with rate control, so that
+ * the layers that are referenced the least can be coded with higher QPs.
+ */
+#define V4L2_CID_CEDRUS_H264_ENC_QP_LAYER_DELTA	(V4L2_CID_USER_CEDRUS_BASE + 23)
+
+#define CEDRUS_H264_ENC_QP_LAYERS_COUNT		3
+
+/*
+ * H.264 encoder QP delta of non-reference frames, which include B frames and
+ * the P frames of the top temporal layer, added to their other QP deltas.
+ */
+#define V4L2_CID_CEDRUS_H264_ENC_QP_NON_REF_DELTA \
+	(V4L2_CID_USER_CEDRUS_BASE + 24)
+
+/*
+ * Nominal throughput of the engine selected by the coded format, in 16x16
+ * macroblocks per second at the module clock rate of the variant, as a
+ * read-only value. It estimates sustained decoding or encoding (with the
+ * default preset) of typical content, shared by all the contexts of the
+ * device, so that the macroblock rate of the streams can be checked against it
+ * before they are started. It is 0 when unknown.
+ */
+#define V4L2_CID_CEDRUS_MB_RATE			(V4L2_CID_USER_CEDRUS_BASE + 25)
+
+/*
+ * DRM format modifier of the decoded pictures with the current picture format,
+ * for importing exported picture buffers in DRM planes or in the GPU without a
+ * conversion: DRM_FORMAT_MOD_ALLWINNER_TILED for V4L2_PIX_FMT_NV12_32L32 and
+ * DRM_FORMAT_MOD_LINEAR for the other formats.
+ */
+#define V4L2_CID_CEDRUS_DEC_DRM_MODIFIER	(V4L2_CID_USER_CEDRUS_BASE + 26)
+
+/*
+ * Decoder loop filter skipping, for fast decoding (e.g. trick play, thumbnails
+ * or overloaded systems) at the cost of picture quality. The deblocking filter
+ * of H.264 and H.265 slices is disabled either on non-reference pictures only,
+ * which keeps the artifacts from spreading to other pictures, or on all
+ * pictures. It applies to the slices decoded after it is set.
+ */
+#define V4L2_CID_CEDRUS_DEC_SKIP_LOOP_FILTER	(V4L2_CID_USER_CEDRUS_BASE + 27)
+
+enum cedrus_dec_skip_loop_filter {
+	CEDRUS_DEC_SKIP_LOOP_FILTER_NONE,
+	CEDRUS_DEC_SKIP_LOOP_FILTER_NON_REF,
+	CEDRUS_DEC_SKIP_LOOP_FILTER_ALL,
+};
+
+/*
+ * H.264 encoder maximum latency in milliseconds, or 0 for no limit. Source
+ * pictures that were queued for longer than this when their P frame is about
+ * to be encoded are encoded as skipped P frames instead, which lets the encoder
+ * catch up with live sources at the cost of picture quality. Key frames and B
+ * frames are never skipped.
+ */
+#define V4L2_CID_CEDRUS_H264_ENC_MAX_LATENCY	(V4L2_CID_USER_CEDRUS_BASE + 28)
+
+/*
+ * Job deadline of the context in milliseconds, or 0 (default) for no deadline.
+ * Each job is given a deadline at that time after its source buffer (coded data
+ * for decoders and the picture for encoders) was queued. Among the contexts of
+ * the same scheduling priority (see V4L2_CID_CEDRUS_PRIORITY) with a job ready,
+ * the one with the earliest deadline goes first, and contexts without deadline
+ * go last.
+ */
+#define V4L2_CID_CEDRUS_DEADLINE		(V4L2_CID_USER_CEDRUS_BASE + 29)
+
+/*
+ * Jobs of the context that completed after their deadline, as a read-only
+ * count since the context was opened.
+ */
+#define V4L2_CID_CEDRUS_DEADLINE_MISSED		(V4L2_CID_USER_CEDRUS_BASE + 30)
+
+/*
+ * H.264 encoder automatic level selection. When enabled, the level signalled
+ * in the SPS is the lowest one that fits the coded dimensions, frame rate,
+ * reference frames and bitrate (the peak bitrate with variable bitrate, or no
+ * bitrate constraint without rate control) instead of the level control value.
+ * A change of the selected level starts a new sequence with an IDR frame.
+ */
+#define V4L2_CID_CEDRUS_H264_ENC_LEVEL_AUTO	(V4L2_CID_USER_CEDRUS_BASE + 31)
+
+/*
+ * H.264 encoder overflow retries, or 0 (default) to return overflowing frames
+ * with an error. Frames that overflow the coded buffer are encoded again from
+ * the start, after a reset of the engine, with their QP increased by
+ * V4L2_CID_CEDRUS_H264_ENC_OVERFLOW_QP_DELTA, up to the maximum QP, at most
+ * this many times. Interlaced frames can only start over while their first
+ * field is encoded.
+ */
+#define V4L2_CID_CEDRUS_H264_ENC_OVERFLOW_RETRIES \
+	(V4L2_CID_USER_CEDRUS_BASE + 32)
+
+/*
+ * H.264 encoder QP increase of each overflow retry, 6 by default, which about
+ * halves the size of the frame.
+ */
+#define V4L2_CID_CEDRUS_H264_ENC_OVERFLOW_QP_DELTA \
+	(V4L2_CID_USER_CEDRUS_BASE + 33)
+
+/*
+ * H.264 encoder length-prefixed output. When enabled, each NAL unit in the
+ * coded buffers starts with its length as a 4-byte big-endian value instead of
+ * an Annex-B start code, as expected in MP4 and Matroska samples. This requires
+ * MMAP coded buffers.
+ */
+#define V4L2_CID_CEDRUS_H264_ENC_AVCC		(V4L2_CID_USER_CEDRUS_BASE + 34)
+
+/*
+ * H.264 encoder static background mode for fixed cameras, as the QP increase
+ * of the background of P frames, or 0 (default) to disable it. Macroblocks of
+ * P frames with little change are biased towards being skipped, and the P frame
+ * QP is increased by this value outside of the regions of interest (see
+ * V4L2_CID_CEDRUS_H264_ENC_ROI), whose QP deltas are decreased by as much so
+ * that they keep their quality. It adds up with the other QP deltas and keeps
+ * applying with rate control.
+ */
+#define V4L2_CID_CEDRUS_H264_ENC_STATIC_BACKGROUND \
+	(V4L2_CID_USER_CEDRUS_BASE + 36)
+
+/*
+ * H.264 encoder adaptive quantization strength, from 0 (disabled, default) to
+ * 8. The engine modulates the QP of each macroblock around the frame QP from
+ * its MAD, with lower QPs for flat areas (where artifacts show the most) and
+ * higher QPs for busy textures that mask them. It applies with and without
+ * rate control.
+ */
+#define V4L2_CID_CEDRUS_H264_ENC_AQ_STRENGTH	(V4L2_CID_USER_CEDRUS_BASE + 37)
+
+/*
+ * H.264 encoder frame budget for multi-pass encoding, as an array of
+ * CEDRUS_H264_ENC_FRAME_BUDGET_FIELDS_COUNT integers, acted upon each time it
+ * is set and usually attached to a request along with the output buffer of the
+ * picture. The frame_bits and qp of the picture from the struct
+ * cedrus_h264_enc_stats of a previous pass (which can be stored as-is between
+ * passes) give the QP of the next frame that is not skipped, to reach the
+ * budget in bits. It takes over rate control and the other QP deltas for that
+ * frame, within the QP limits.
+ */
+#define V4L2_CID_CEDRUS_H264_ENC_FRAME_BUDGET	(V4L2_CID_USER_CEDRUS_BASE + 38)
+
+enum cedrus_h264_enc_frame_budget_field {
+	CEDRUS_H264_ENC_FRAME_BUDGET_PASS_BITS,
+	CEDRUS_H264_ENC_FRAME_BUDGET_PASS_QP,
+	CEDRUS_H264_ENC_FRAME_BUDGET_BITS,
+	CEDRUS_H264_ENC_FRAME_BUDGET_FIELDS_COUNT,
+};
+
+/*
+ * H.264 encoder intra refresh wave, as the number of P frames over which to
+ * refresh the whole picture once with bands of intra macroblock columns, acted
+ * upon each time it is set. It recovers from losses reported by the receiver
+ * without the size burst of a key frame, taking over the cyclic intra refresh
+ * until the wave completes. The first frame of the wave always carries a
+ * recovery point SEI message telling when the picture is whole again. Intra
+ * frames cancel the wave.
+ */
+#define V4L2_CID_CEDRUS_H264_ENC_INTRA_REFRESH_WAVE \
+	(V4L2_CID_USER_CEDRUS_BASE + 39)
+
+/*
+ * Encoder picture chroma offset in bytes, from the start of the buffer to the
+ * chroma planes of the single-plane picture formats, which can only be set
+ * while the picture queue is not busy. It allows importing pictures with an
+ * aligned chroma plane without copying them, while padded luma rows are
+ * rather left out with the picture crop selection. Offsets smaller than the
+ * luma plane size (such as the default zero) keep chroma right after luma.
+ * The size of the picture format takes it into account.
+ */
+#define V4L2_CID_CEDRUS_ENC_PICTURE_CHROMA_OFFSET \
+	(V4L2_CID_USER_CEDRUS_BASE + 40)
+
+/*
+ * Encoder frame decimation ratio, from 1 (default) to
+ * CEDRUS_ENC_FRAME_DECIMATION_MAX. Only one picture out of every ratio queued
+ * pictures is encoded, the others are returned right away without reaching
+ * the engine, which allows feeding the same pictures to contexts encoding at
+ * a lower rate. Pictures queued with a request are always encoded so that
+ * their controls apply. The coded frame interval (VIDIOC_S_PARM on the coded
+ * queue) should be set to match, since rate control follows it. Counting
+ * restarts with each picture queue streaming and ratio change.
+ */
+#define V4L2_CID_CEDRUS_ENC_FRAME_DECIMATION	(V4L2_CID_USER_CEDRUS_BASE + 41)
+
+#define CEDRUS_ENC_FRAME_DECIMATION_MAX		64
+
+/*
+ * H.264 encoder fast start QP raise, from 0 (disabled, default) to 51. The
+ * first IDR frame of each session is encoded with that much higher a QP, to
+ * keep its size and the time before viewers see a picture low. The raise then
+ * decreases by one with each following frame, so that quality ramps up to the
+ * configured (or rate-controlled) QPs without a burst on the next P frames.
+ */
+#define V4L2_CID_CEDRUS_H264_ENC_FAST_START	(V4L2_CID_USER_CEDRUS_BASE + 42)
+
+/*
+ * H.264 encoder variable frame rate, taken into account when streaming
+ * starts. The picture order counts are derived from the timestamps of the
+ * pictures, in units of half the coded frame interval (which is the time
+ * base signalled in the VUI, without the fixed frame rate flag), so that
+ * userspace may drop unchanged pictures at the source instead of queueing
+ * skipped frames at the full rate. Rate control and the HRD still follow the
+ * coded frame interval.
+ */
+#define V4L2_CID_CEDRUS_H264_ENC_VFR		(V4L2_CID_USER_CEDRUS_BASE + 43)
+
+/*
+ * H.264 encoder static frame skip threshold, from 0 (disabled, default) to
+ * CEDRUS_H264_ENC_STATIC_SKIP_MAX. P frames are skipped when the average luma
+ * of each cell of a sparse grid over the source picture differs from the one
+ * of the last encoded picture by less than the threshold, which costs about a
+ * thousand CPU reads per frame. Skipped frames repeat their reference picture
+ * and take little engine time. It only applies when the CPU can read the
+ * pictures, which excludes non-coherent buffers.
+ */
+#define V4L2_CID_CEDRUS_H264_ENC_STATIC_SKIP	(V4L2_CID_USER_CEDRUS_BASE + 44)
+
+#define CEDRUS_H264_ENC_STATIC_SKIP_MAX		32
+
+/*
+ * Completion polling threshold of the context in microseconds, or 0 (default)
+ * to always wait for the interrupt. Jobs are expected to take as long as the
+ * previous one of the context on the engine, and when that fits within the
+ * threshold, the CPU that triggered the job busy-waits for its completion
+ * instead of going through the interrupt handlers. Jobs still running past the
+ * threshold fall back to the interrupt. This trades CPU time for latency with
+ * tiny pictures, where interrupt handling takes as long as the engine.
+ */
+#define V4L2_CID_CEDRUS_POLL_THRESHOLD		(V4L2_CID_USER_CEDRUS_BASE + 45)
+
+/*
+ * H.264 decoder slice byte offsets in the coded buffer, as a dynamic array of
+ * up to CEDRUS_H264_DEC_SLICES_MAX entries, so that consecutive slices of a
+ * picture are decoded from one coded buffer and request, instead of one for
+ * each slice. Each slice ends where the next one starts, and the last one at
+ * the end of the coded data. The offsets must be increasing. A single offset
+ * may skip the beginning of the buffer, with the standard H.264 slice
+ * parameters and prediction weights controls.
+ */
+#define V4L2_CID_CEDRUS_H264_DEC_SLICE_OFFSETS	(V4L2_CID_USER_CEDRUS_BASE + 46)
+
+/*
+ * H.264 decoder slice parameters, as a dynamic array of struct
+ * v4l2_ctrl_h264_slice_params with one entry for each slice offset. It is
+ * required and replaces the standard H.264 slice parameters control when
+ * several slice offsets are given.
+ */
+#define V4L2_CID_CEDRUS_H264_DEC_SLICES_PARAMS	(V4L2_CID_USER_CEDRUS_BASE + 47)
+
+/*
+ * H.264 decoder prediction weights, as a dynamic array of struct
+ * v4l2_ctrl_h264_pred_weights with one entry for each slice offset. With
+ * several slice offsets, it replaces the standard H.264 prediction weights
+ * control when its size matches, which is otherwise used for all the slices.
+ */
+#define V4L2_CID_CEDRUS_H264_DEC_SLICES_PRED_WEIGHTS \
+	(V4L2_CID_USER_CEDRUS_BASE + 48)
+
+#define CEDRUS_H264_DEC_SLICES_MAX		64
+
+/*
+ * H.264 encoder per-frame statistics, sent as struct cedrus_h264_enc_stats
+ * in the event data when each frame is encoded. The timestamp is the one of the
+ * coded buffer, which is copied from the source picture, and the offset is the
+ * one of the frame (with its headroom) in the coded buffer.
+ */
+#define V4L2_EVENT_CEDRUS_H264_ENC_STATS	(V4L2_EVENT_CEDRUS_BASE + 0)
+
+/*
+ * H.264 encoder scene change detection, with the timestamp of the frame where
+ * the change was detected as a __u64 in the event data.
+ */
+#define V4L2_EVENT_CEDRUS_H264_ENC_SCENE_CHANGE	(V4L2_EVENT_CEDRUS_BASE + 1)
+
+/*
+ * Per-job latency breakdown, sent as struct cedrus_job_times in the event data
+ * when each job completes, for decoders and encoders alike. The timestamp is
+ * the one of the capture buffer, which is copied from the output buffer.
+ */
+#define V4L2_EVENT_CEDRUS_JOB_TIMES		(V4L2_EVENT_CEDRUS_BASE + 2)
+
+/*
+ * H.264 decoder error, sent as struct cedrus_h264_dec_error in the event data
+ * when the engine reports an error while decoding a slice. The timestamp is
+ * the one of the output buffer holding the slice. The capture buffer is still
+ * returned with the macroblocks decoded so far and V4L2_BUF_FLAG_ERROR set,
+ * also when it is held for the next slices, so that the errored area can be
+ * concealed.
+ */
+#define V4L2_EVENT_CEDRUS_H264_DEC_ERROR	(V4L2_EVENT_CEDRUS_BASE + 3)
+
+struct cedrus_h264_enc_stats {
+	__u64	timestamp;
+	__u32	flags;
+	__u32	qp;
+	__u32	frame_bits;
+	__u32	header_bits;
+	__u32	residual_bits;
+	__u32	mad_sum;
+	__u32	me_info;
+	__u32	thumbnail_offset;
+	__u32	offset;
+	__u32	mv_info_offset;
+	__u32	cost_map_offset;
+	__u32	reserved[1];
+};
+
+/*
+ * The status holds the engine interrupt status bits. The macroblock number is
+ * the one of the errored macroblock, counted in decoding order from the start
+ * of the picture, and the error case is the raw engine error code.
+ */
+struct cedrus_h264_dec_error {
+	__u64	timestamp;
+	__u32	status;
+	__u32	mb_num;
+	__u32	error_case;
+	__u32	reserved[3];
+};
+
+/*
+ * Times are CLOCK_MONOTONIC nanoseconds: when the output buffer was queued to
+ * the driver, when the job was first started on the hardware and when the
+ * hardware signalled the end of its last pass.
+ */
+struct cedrus_job_times {
+	__u64	timestamp;
+	__u64	queue_ns;
+	__u64	start_ns;
+	__u64	done_ns;
+	__u32	reserved[4];
+};
+
+/*
+ * H.264 encoder reconstruction export, for the frame of the given coded buffer
+ * timestamp with the V4L2_CID_CEDRUS_H264_ENC_REC_EXPORT control enabled.
+ * The flags (O_CLOEXEC and access mode) apply to the returned file descriptor.
+ * The picture is in the V4L2_PIX_FMT_NV12_32L32 format, covering whole
+ * macroblocks of the coded picture, with the chroma plane at the given offset.
+ */
+struct cedrus_h264_enc_rec_expbuf {
+	__u64	timestamp;
+	__u32	flags;
+	__s32	fd;
+	__u32	pixelformat;
+	__u32	width;
+	__u32	height;
+	__u32	bytesperline;
+	__u32	chroma_offset;
+	__u32	size;
+	__u32	reserved[4];
+};
+
+#define VIDIOC_CEDRUS_H264_ENC_REC_EXPBUF \
+	_IOWR('V', BASE_VIDIOC_PRIVATE + 0, struct cedrus_h264_enc_rec_expbuf)
+
+/*
+ * H.264 decoder coded data append, for decoding a slice while it is still
+ * being received. The output buffer of the given index is opened by a first
+ * call without CEDRUS_DEC_CODED_APPEND_FLAG_LAST before it is queued, with at
+ * least the slice header in its payload. Each call then gives the total size of
+ * the coded data written so far to the buffer, which must not be allocated with
+ * V4L2_MEMORY_FLAG_NON_COHERENT. When the engine runs out of coded data, it
+ * waits for more (holding the engine for other contexts) until the buffer is
+ * closed with CEDRUS_DEC_CODED_APPEND_FLAG_LAST. The job fails when its single
+ * timeout, counted from its start, passes first. Buffers are also closed when
+ * they are done. The ioctl is experimental and returns ENOTTY unless the
+ * driver is built with its experimental features.
+ */
+struct cedrus_dec_coded_append {
+	__u32	index;
+	__u32	bytesused;
+	__u32	flags;
+	__u32	reserved[5];
+};
+
+#define CEDRUS_DEC_CODED_APPEND_FLAG_LAST	(1 << 0)
+
+#define VIDIOC_CEDRUS_DEC_CODED_APPEND \
+	_IOW('V', BASE_VIDIOC_PRIVATE + 1, struct cedrus_dec_coded_append)
+
+#endif
@@ -190,6 +190,8 @@ int v4l2_prio_check(struct v4l2_prio_state *global, enum v4l2_priority local);
  * @mmap: operations needed to implement the mmap() syscall
  * @open: operations needed to implement the open() syscall
  * @release: operations needed to implement the release() syscall
+ * @show_fdinfo: operations needed to show the driver specific keys of
+ *	/proc/<pid>/fdinfo/<fd>
  *
  * .. note::
  *
@@ -211,6 +213,7 @@ struct v4l2_file_operations {
 	int (*mmap) (struct file *, struct vm_area_struct *);
 	int (*open) (struct file *);
 	int (*release) (struct file *);
+	void (*show_fdinfo) (struct seq_file *, struct file *);
 };
 
 /*
@@ -191,6 +191,31 @@ void v4l2_m2m_try_schedule(struct v4l2_m2m_ctx *m2m_ctx);
 void v4l2_m2m_job_finish(struct v4l2_m2m_dev *m2m_dev,
 			 struct v4l2_m2m_ctx *m2m_ctx);
 
+/**
+ * v4l2_m2m_job_finish_batch() - inform the framework that a job has been
+ * finished and keep the device for the next job of the same instance
+ *
+ * @m2m_dev: opaque pointer to the internal data to handle M2M context
+ * @m2m_ctx: m2m context assigned to the instance given by struct &v4l2_m2m_ctx
+ *
+ * Same as v4l2_m2m_job_finish(), unless the instance has another job ready
+ * (see v4l2_m2m_try_schedule()) and no other instance is waiting for the
+ * device. In that case, the instance keeps running and the driver has to run
+ * its next job right away, as it would from &v4l2_m2m_ops->device_run, which
+ * is not called. This allows drivers to chain jobs from their (threaded)
+ * interrupt handler without going through the job scheduler each time.
+ *
+ * Like v4l2_m2m_job_finish(), this function may be called from atomic
+ * context, e.g. an interrupt handler. The driver then runs the next job from
+ * that same context, when the function returns true. It must not be called
+ * from &v4l2_m2m_ops->device_run.
+ *
+ * Return: true if the driver has to run the next job, false if the job was
+ * finished as with v4l2_m2m_job_finish().
+ */
+bool v4l2_m2m_job_finish_batch(struct v4l2_m2m_dev *m2m_dev,
+			       struct v4l2_m2m_ctx *m2m_ctx);
+
 /**
  * v4l2_m2m_buf_done_and_job_finish() - return source/destination buffers with
  * state and inform the framework that a job has been finished and have it
@@ -218,6 +243,25 @@ void v4l2_m2m_buf_done_and_job_finish(struct v4l2_m2m_dev *m2m_dev,
 				      struct v4l2_m2m_ctx *m2m_ctx,
 				      enum vb2_buffer_state state);
 
+/**
+ * v4l2_m2m_buf_done_and_job_finish_batch() - return source/destination buffers
+ * with state and keep the device for the next job of the same instance
+ *
+ * @m2m_dev: opaque pointer to the internal data to handle M2M context
+ * @m2m_ctx: m2m context assigned to the instance given by struct &v4l2_m2m_ctx
+ * @state: vb2 buffer state passed to v4l2_m2m_buf_done().
+ *
+ * Same as v4l2_m2m_buf_done_and_job_finish(), with the job finished as
+ * with v4l2_m2m_job_finish_batch(). This function may also be called from
+ * atomic context.
+ *
+ * Return: true if the driver has to run the next job, false if the job was
+ * finished as with v4l2_m2m_buf_done_and_job_finish().
+ */
+bool v4l2_m2m_buf_done_and_job_finish_batch(struct v4l2_m2m_dev *m2m_dev,
+					    struct v4l2_m2m_ctx *m2m_ctx,
+					    enum vb2_buffer_state state);
+
 static inline void
 v4l2_m2m_buf_done(struct vb2_v4l2_buffer *buf, enum vb2_buffer_state state)
 {
@@ -2468,6 +2468,12 @@ struct v4l2_streamparm {
 #define V4L2_EVENT_MOTION_DET			6
 #define V4L2_EVENT_PRIVATE_START		0x08000000
 
+/*
+ * The base for the cedrus driver events.
+ * We reserve 16 events for this driver.
+ */
+#define V4L2_EVENT_CEDRUS_BASE			(V4L2_EVENT_PRIVATE_START + 0x11c0)
+
 /* Payload for V4L2_EVENT_VSYNC */
 struct v4l2_event_vsync {
 	/* Can be V4L2_FIELD_ANY, _NONE, _TOP or _BOTTOM */
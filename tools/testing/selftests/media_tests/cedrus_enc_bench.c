@@ -0,0 +1,677 @@
+// SPDX-License-Identifier: GPL-2.0
+
+/*
+ * cedrus_enc_bench - Cedrus H.264 Encoder Benchmark
+ *
+ * Copyright 2023 Bootlin
+ *
+ */
+
+/*
+ * This benchmark should not be included in the Kselftest run. It should be
+ * run when the cedrus driver with H.264 encoding support is present.
+ *
+ * The benchmark feeds the encoder video device with synthetic NV12 pictures
+ * and reports the encoding rate, the latency of each frame (from picture
+ * queue to coded buffer dequeue), the CPU time of the process and the size
+ * of the coded frames. Each coded frame is checked to start with an Annex B
+ * start code and the benchmark fails if any frame does not.
+ *
+ * Usage:
+ *	./cedrus_enc_bench -d /dev/videoX [-w width] [-h height] [-n frames]
+ *			   [-q qp] [-g gop size] [-b b-frames] [-e cavlc|cabac]
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <linux/videodev2.h>
+
+#include "../kselftest.h"
+
+#define BUFFERS_COUNT	4
+#define POLL_TIMEOUT_MS	5000
+
+struct buffer {
+	void		*data;
+	size_t		size;
+};
+
+struct bench {
+	int			fd;
+
+	unsigned int		width;
+	unsigned int		height;
+	unsigned int		frames;
+	int			qp;
+	int			gop_size;
+	int			b_frames;
+	int			entropy_mode;
+
+	unsigned int		bytesperline;
+	unsigned int		sizeimage;
+
+	struct buffer		pictures[BUFFERS_COUNT];
+	unsigned int		pictures_count;
+	struct buffer		coded[BUFFERS_COUNT];
+	unsigned int		coded_count;
+
+	struct timespec		*queue_times;
+	double			*latencies_ms;
+
+	unsigned int		frames_queued;
+	unsigned int		frames_coded;
+	unsigned int		frames_key;
+	unsigned long long	bytes;
+	unsigned long long	bytes_key;
+	unsigned int		errors;
+	bool			stopped;
+};
+
+static double timespec_ms(const struct timespec *ts)
+{
+	return ts->tv_sec * 1000.0 + ts->tv_nsec / 1000000.0;
+}
+
+static double timespec_delta_ms(const struct timespec *start,
+				const struct timespec *end)
+{
+	return timespec_ms(end) - timespec_ms(start);
+}
+
+static int ctrl_set(struct bench *bench, unsigned int id, int value,
+		    const char *name)
+{
+	struct v4l2_ext_control ctrl = {
+		.id = id,
+		.value = value,
+	};
+	struct v4l2_ext_controls ctrls = {
+		.which = V4L2_CTRL_WHICH_CUR_VAL,
+		.count = 1,
+		.controls = &ctrl,
+	};
+
+	if (ioctl(bench->fd, VIDIOC_S_EXT_CTRLS, &ctrls) < 0) {
+		printf("Failed to set %s to %d: %s\n", name, value,
+		       strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+static int ctrls_setup(struct bench *bench)
+{
+	int ret = 0;
+
+	/* Constant QP, so that runs are comparable. */
+	ret |= ctrl_set(bench, V4L2_CID_MPEG_VIDEO_FRAME_RC_ENABLE, 0,
+			"rate control");
+	ret |= ctrl_set(bench, V4L2_CID_MPEG_VIDEO_H264_I_FRAME_QP, bench->qp,
+			"I frame QP");
+	ret |= ctrl_set(bench, V4L2_CID_MPEG_VIDEO_H264_P_FRAME_QP, bench->qp,
+			"P frame QP");
+	ret |= ctrl_set(bench, V4L2_CID_MPEG_VIDEO_GOP_SIZE, bench->gop_size,
+			"GOP size");
+
+	/* CABAC and B frames are not part of the baseline profile. */
+	if (bench->entropy_mode || bench->b_frames)
+		ret |= ctrl_set(bench, V4L2_CID_MPEG_VIDEO_H264_PROFILE,
+				V4L2_MPEG_VIDEO_H264_PROFILE_MAIN, "profile");
+
+	ret |= ctrl_set(bench, V4L2_CID_MPEG_VIDEO_H264_ENTROPY_MODE,
+			bench->entropy_mode, "entropy mode");
+
+	if (bench->b_frames) {
+		ret |= ctrl_set(bench, V4L2_CID_MPEG_VIDEO_H264_B_FRAME_QP,
+				bench->qp, "B frame QP");
+		ret |= ctrl_set(bench, V4L2_CID_MPEG_VIDEO_B_FRAMES,
+				bench->b_frames, "B frames");
+	}
+
+	return ret ? -1 : 0;
+}
+
+static bool format_coded_check(struct bench *bench)
+{
+	struct v4l2_fmtdesc fmtdesc = {
+		.type = V4L2_BUF_TYPE_VIDEO_CAPTURE,
+	};
+
+	while (!ioctl(bench->fd, VIDIOC_ENUM_FMT, &fmtdesc)) {
+		if (fmtdesc.pixelformat == V4L2_PIX_FMT_H264)
+			return true;
+
+		fmtdesc.index++;
+	}
+
+	return false;
+}
+
+static int formats_setup(struct bench *bench)
+{
+	struct v4l2_format format;
+
+	memset(&format, 0, sizeof(format));
+	format.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	format.fmt.pix.pixelformat = V4L2_PIX_FMT_H264;
+	format.fmt.pix.width = bench->width;
+	format.fmt.pix.height = bench->height;
+
+	if (ioctl(bench->fd, VIDIOC_S_FMT, &format) < 0) {
+		printf("Failed to set coded format: %s\n", strerror(errno));
+		return -1;
+	}
+
+	memset(&format, 0, sizeof(format));
+	format.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+	format.fmt.pix.pixelformat = V4L2_PIX_FMT_NV12;
+	format.fmt.pix.width = bench->width;
+	format.fmt.pix.height = bench->height;
+
+	if (ioctl(bench->fd, VIDIOC_S_FMT, &format) < 0) {
+		printf("Failed to set picture format: %s\n", strerror(errno));
+		return -1;
+	}
+
+	if (format.fmt.pix.pixelformat != V4L2_PIX_FMT_NV12 ||
+	    format.fmt.pix.width != bench->width ||
+	    format.fmt.pix.height != bench->height) {
+		printf("Picture format %ux%u NV12 is not supported\n",
+		       bench->width, bench->height);
+		return -1;
+	}
+
+	bench->bytesperline = format.fmt.pix.bytesperline;
+	bench->sizeimage = format.fmt.pix.sizeimage;
+
+	return 0;
+}
+
+static int buffers_setup(struct bench *bench, unsigned int type,
+			 struct buffer *buffers, unsigned int *count)
+{
+	struct v4l2_requestbuffers reqbufs = {
+		.count = BUFFERS_COUNT,
+		.type = type,
+		.memory = V4L2_MEMORY_MMAP,
+	};
+	unsigned int i;
+
+	if (ioctl(bench->fd, VIDIOC_REQBUFS, &reqbufs) < 0) {
+		printf("Failed to request buffers: %s\n", strerror(errno));
+		return -1;
+	}
+
+	if (reqbufs.count > BUFFERS_COUNT)
+		reqbufs.count = BUFFERS_COUNT;
+
+	for (i = 0; i < reqbufs.count; i++) {
+		struct v4l2_buffer buffer = {
+			.index = i,
+			.type = type,
+			.memory = V4L2_MEMORY_MMAP,
+		};
+
+		if (ioctl(bench->fd, VIDIOC_QUERYBUF, &buffer) < 0) {
+			printf("Failed to query buffer: %s\n",
+			       strerror(errno));
+			return -1;
+		}
+
+		buffers[i].size = buffer.length;
+		buffers[i].data = mmap(NULL, buffer.length,
+				       PROT_READ | PROT_WRITE, MAP_SHARED,
+				       bench->fd, buffer.m.offset);
+		if (buffers[i].data == MAP_FAILED) {
+			printf("Failed to map buffer: %s\n", strerror(errno));
+			return -1;
+		}
+	}
+
+	*count = reqbufs.count;
+
+	return 0;
+}
+
+static void buffers_cleanup(struct buffer *buffers, unsigned int count)
+{
+	unsigned int i;
+
+	for (i = 0; i < count; i++)
+		munmap(buffers[i].data, buffers[i].size);
+}
+
+static void picture_fill(struct bench *bench, unsigned char *data,
+			 unsigned int frame)
+{
+	unsigned int stride = bench->bytesperline;
+	unsigned char *chroma = data + stride * bench->height;
+	unsigned int square = (bench->width < bench->height ? bench->width :
+			       bench->height) / 4;
+	unsigned int square_x = (frame * 8) % (bench->width - square);
+	unsigned int square_y = (frame * 4) % (bench->height - square);
+	unsigned int x, y;
+
+	/* A moving gradient with a moving square gives motion to estimate. */
+	for (y = 0; y < bench->height; y++)
+		for (x = 0; x < bench->width; x++) {
+			bool inside = x >= square_x && x < square_x + square &&
+				      y >= square_y && y < square_y + square;
+
+			data[y * stride + x] = inside ? 235 :
+					       (x + y + frame * 2) & 0xff;
+		}
+
+	for (y = 0; y < bench->height / 2; y++)
+		for (x = 0; x < bench->width; x += 2) {
+			chroma[y * stride + x] = 128 + ((x + frame) & 0x1f);
+			chroma[y * stride + x + 1] = 128 - ((y + frame) & 0x1f);
+		}
+}
+
+static int picture_queue(struct bench *bench, unsigned int index)
+{
+	unsigned int frame = bench->frames_queued;
+	struct v4l2_buffer buffer = {
+		.index = index,
+		.type = V4L2_BUF_TYPE_VIDEO_OUTPUT,
+		.memory = V4L2_MEMORY_MMAP,
+		.bytesused = bench->sizeimage,
+	};
+
+	picture_fill(bench, bench->pictures[index].data, frame);
+
+	/* The timestamp is copied to the coded buffer and gives the frame. */
+	buffer.timestamp.tv_sec = frame / 1000000;
+	buffer.timestamp.tv_usec = frame % 1000000;
+
+	clock_gettime(CLOCK_MONOTONIC, &bench->queue_times[frame]);
+
+	if (ioctl(bench->fd, VIDIOC_QBUF, &buffer) < 0) {
+		printf("Failed to queue picture buffer: %s\n", strerror(errno));
+		return -1;
+	}
+
+	bench->frames_queued++;
+
+	return 0;
+}
+
+static int coded_queue(struct bench *bench, unsigned int index)
+{
+	struct v4l2_buffer buffer = {
+		.index = index,
+		.type = V4L2_BUF_TYPE_VIDEO_CAPTURE,
+		.memory = V4L2_MEMORY_MMAP,
+	};
+
+	if (ioctl(bench->fd, VIDIOC_QBUF, &buffer) < 0) {
+		printf("Failed to queue coded buffer: %s\n", strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+static int encoder_stop(struct bench *bench)
+{
+	struct v4l2_encoder_cmd cmd = {
+		.cmd = V4L2_ENC_CMD_STOP,
+	};
+
+	bench->stopped = true;
+
+	/* Without the stop command, frames that are held are not encoded. */
+	if (ioctl(bench->fd, VIDIOC_ENCODER_CMD, &cmd) < 0) {
+		printf("Failed to stop encoder: %s\n", strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+static bool coded_check(const unsigned char *data, unsigned int size)
+{
+	if (size >= 4 && !data[0] && !data[1] && !data[2] && data[3] == 1)
+		return true;
+
+	return size >= 3 && !data[0] && !data[1] && data[2] == 1;
+}
+
+static void coded_done(struct bench *bench, struct v4l2_buffer *buffer,
+		       const struct timespec *now)
+{
+	unsigned int frame = buffer->timestamp.tv_sec * 1000000 +
+			     buffer->timestamp.tv_usec;
+	unsigned char *data = bench->coded[buffer->index].data;
+
+	if (buffer->flags & V4L2_BUF_FLAG_ERROR) {
+		printf("Frame %u failed to encode\n", frame);
+		bench->errors++;
+		return;
+	}
+
+	if (frame >= bench->frames_queued) {
+		printf("Coded buffer has unexpected frame %u\n", frame);
+		bench->errors++;
+		return;
+	}
+
+	if (!coded_check(data, buffer->bytesused)) {
+		printf("Frame %u does not start with a start code\n", frame);
+		bench->errors++;
+	}
+
+	bench->latencies_ms[bench->frames_coded] =
+		timespec_delta_ms(&bench->queue_times[frame], now);
+	bench->frames_coded++;
+	bench->bytes += buffer->bytesused;
+
+	if (buffer->flags & V4L2_BUF_FLAG_KEYFRAME) {
+		bench->frames_key++;
+		bench->bytes_key += buffer->bytesused;
+	}
+}
+
+static int picture_dequeue(struct bench *bench)
+{
+	struct v4l2_buffer buffer = {
+		.type = V4L2_BUF_TYPE_VIDEO_OUTPUT,
+		.memory = V4L2_MEMORY_MMAP,
+	};
+
+	if (ioctl(bench->fd, VIDIOC_DQBUF, &buffer) < 0)
+		return errno == EAGAIN ? 0 : -1;
+
+	if (bench->frames_queued < bench->frames)
+		return picture_queue(bench, buffer.index);
+
+	if (!bench->stopped)
+		return encoder_stop(bench);
+
+	return 0;
+}
+
+static int coded_dequeue(struct bench *bench, bool *done)
+{
+	struct v4l2_buffer buffer = {
+		.type = V4L2_BUF_TYPE_VIDEO_CAPTURE,
+		.memory = V4L2_MEMORY_MMAP,
+	};
+	struct timespec now;
+
+	if (ioctl(bench->fd, VIDIOC_DQBUF, &buffer) < 0)
+		return errno == EAGAIN ? 0 : -1;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	/* The last buffer of the stream may be empty. */
+	if (buffer.bytesused || !(buffer.flags & V4L2_BUF_FLAG_LAST))
+		coded_done(bench, &buffer, &now);
+
+	if (buffer.flags & V4L2_BUF_FLAG_LAST ||
+	    bench->frames_coded >= bench->frames) {
+		*done = true;
+		return 0;
+	}
+
+	return coded_queue(bench, buffer.index);
+}
+
+static int bench_run(struct bench *bench)
+{
+	unsigned int type;
+	bool done = false;
+	unsigned int i;
+
+	for (i = 0; i < bench->coded_count; i++)
+		if (coded_queue(bench, i))
+			return -1;
+
+	for (i = 0; i < bench->pictures_count && i < bench->frames; i++)
+		if (picture_queue(bench, i))
+			return -1;
+
+	type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+	if (ioctl(bench->fd, VIDIOC_STREAMON, &type) < 0) {
+		printf("Failed to start picture stream: %s\n", strerror(errno));
+		return -1;
+	}
+
+	type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	if (ioctl(bench->fd, VIDIOC_STREAMON, &type) < 0) {
+		printf("Failed to start coded stream: %s\n", strerror(errno));
+		return -1;
+	}
+
+	if (bench->frames_queued == bench->frames && encoder_stop(bench))
+		return -1;
+
+	while (!done) {
+		struct pollfd pollfd = {
+			.fd = bench->fd,
+			.events = POLLIN | POLLOUT,
+		};
+		int ret;
+
+		ret = poll(&pollfd, 1, POLL_TIMEOUT_MS);
+		if (ret < 0) {
+			printf("Failed to poll: %s\n", strerror(errno));
+			return -1;
+		} else if (!ret) {
+			printf("Timed out after %u coded frames\n",
+			       bench->frames_coded);
+			return -1;
+		}
+
+		if (pollfd.revents & POLLERR) {
+			printf("Poll error after %u coded frames\n",
+			       bench->frames_coded);
+			return -1;
+		}
+
+		if (pollfd.revents & POLLOUT && picture_dequeue(bench)) {
+			printf("Failed to dequeue picture: %s\n",
+			       strerror(errno));
+			return -1;
+		}
+
+		if (pollfd.revents & POLLIN && coded_dequeue(bench, &done)) {
+			printf("Failed to dequeue coded: %s\n",
+			       strerror(errno));
+			return -1;
+		}
+	}
+
+	type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+	ioctl(bench->fd, VIDIOC_STREAMOFF, &type);
+
+	type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	ioctl(bench->fd, VIDIOC_STREAMOFF, &type);
+
+	return 0;
+}
+
+static int latency_compare(const void *a, const void *b)
+{
+	double latency_a = *(const double *)a;
+	double latency_b = *(const double *)b;
+
+	return (latency_a > latency_b) - (latency_a < latency_b);
+}
+
+static double latency_percentile(struct bench *bench, unsigned int percent)
+{
+	return bench->latencies_ms[(bench->frames_coded - 1) * percent / 100];
+}
+
+static void bench_report(struct bench *bench, double elapsed_ms,
+			 double cpu_ms)
+{
+	unsigned int frames = bench->frames_coded;
+	unsigned int frames_other = frames - bench->frames_key;
+
+	printf("%ux%u frames %u qp %d gop %d b-frames %d entropy %s\n",
+	       bench->width, bench->height, frames, bench->qp, bench->gop_size,
+	       bench->b_frames, bench->entropy_mode ? "cabac" : "cavlc");
+
+	if (!frames)
+		return;
+
+	qsort(bench->latencies_ms, frames, sizeof(*bench->latencies_ms),
+	      latency_compare);
+
+	printf("fps: %.2f\n", frames * 1000.0 / elapsed_ms);
+	printf("latency ms: p50 %.2f p90 %.2f p99 %.2f max %.2f\n",
+	       latency_percentile(bench, 50), latency_percentile(bench, 90),
+	       latency_percentile(bench, 99),
+	       bench->latencies_ms[frames - 1]);
+	printf("cpu time ms: %.2f (%.3f per frame)\n", cpu_ms,
+	       cpu_ms / frames);
+	printf("bytes per frame: %llu (key %llu, other %llu)\n",
+	       bench->bytes / frames,
+	       bench->frames_key ? bench->bytes_key / bench->frames_key : 0,
+	       frames_other ?
+	       (bench->bytes - bench->bytes_key) / frames_other : 0);
+	printf("errors: %u\n", bench->errors);
+}
+
+static double rusage_ms(void)
+{
+	struct rusage usage;
+
+	getrusage(RUSAGE_SELF, &usage);
+
+	return usage.ru_utime.tv_sec * 1000.0 +
+	       usage.ru_utime.tv_usec / 1000.0 +
+	       usage.ru_stime.tv_sec * 1000.0 +
+	       usage.ru_stime.tv_usec / 1000.0;
+}
+
+static void usage(const char *name)
+{
+	printf("Usage: %s -d /dev/videoX [-w width] [-h height] [-n frames]\n"
+	       "\t[-q qp] [-g gop size] [-b b-frames] [-e cavlc|cabac]\n",
+	       name);
+}
+
+int main(int argc, char **argv)
+{
+	struct bench bench = {
+		.width = 1280,
+		.height = 720,
+		.frames = 300,
+		.qp = 26,
+		.gop_size = 30,
+	};
+	struct v4l2_capability capability;
+	struct timespec start, end;
+	const char *device = NULL;
+	double cpu_ms;
+	int ret = KSFT_FAIL;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "d:w:h:n:q:g:b:e:")) != -1) {
+		switch (opt) {
+		case 'd':
+			device = optarg;
+			break;
+		case 'w':
+			bench.width = atoi(optarg);
+			break;
+		case 'h':
+			bench.height = atoi(optarg);
+			break;
+		case 'n':
+			bench.frames = atoi(optarg);
+			break;
+		case 'q':
+			bench.qp = atoi(optarg);
+			break;
+		case 'g':
+			bench.gop_size = atoi(optarg);
+			break;
+		case 'b':
+			bench.b_frames = atoi(optarg);
+			break;
+		case 'e':
+			bench.entropy_mode = !strcmp(optarg, "cabac");
+			break;
+		default:
+			usage(argv[0]);
+			exit(KSFT_FAIL);
+		}
+	}
+
+	if (!device || !bench.frames || bench.width < 16 ||
+	    bench.height < 16) {
+		usage(argv[0]);
+		exit(KSFT_FAIL);
+	}
+
+	bench.queue_times = calloc(bench.frames, sizeof(*bench.queue_times));
+	bench.latencies_ms = calloc(bench.frames, sizeof(*bench.latencies_ms));
+	if (!bench.queue_times || !bench.latencies_ms) {
+		printf("Failed to allocate frame records\n");
+		exit(KSFT_FAIL);
+	}
+
+	bench.fd = open(device, O_RDWR | O_NONBLOCK);
+	if (bench.fd < 0) {
+		printf("Failed to open %s: %s\n", device, strerror(errno));
+		exit(KSFT_FAIL);
+	}
+
+	if (ioctl(bench.fd, VIDIOC_QUERYCAP, &capability) < 0 ||
+	    !(capability.device_caps & V4L2_CAP_VIDEO_M2M) ||
+	    !format_coded_check(&bench)) {
+		printf("%s is not an H.264 encoder\n", device);
+		ret = KSFT_SKIP;
+		goto out_close;
+	}
+
+	if (formats_setup(&bench) || ctrls_setup(&bench))
+		goto out_close;
+
+	if (buffers_setup(&bench, V4L2_BUF_TYPE_VIDEO_OUTPUT, bench.pictures,
+			  &bench.pictures_count) ||
+	    buffers_setup(&bench, V4L2_BUF_TYPE_VIDEO_CAPTURE, bench.coded,
+			  &bench.coded_count))
+		goto out_buffers;
+
+	cpu_ms = rusage_ms();
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	if (bench_run(&bench))
+		goto out_buffers;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	cpu_ms = rusage_ms() - cpu_ms;
+
+	bench_report(&bench, timespec_delta_ms(&start, &end), cpu_ms);
+
+	if (!bench.errors && bench.frames_coded == bench.frames)
+		ret = KSFT_PASS;
+
+out_buffers:
+	buffers_cleanup(bench.pictures, bench.pictures_count);
+	buffers_cleanup(bench.coded, bench.coded_count);
+
+out_close:
+	close(bench.fd);
+	free(bench.queue_times);
+	free(bench.latencies_ms);
+
+	return ret;
+}